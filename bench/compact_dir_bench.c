@@ -0,0 +1,296 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * Memory benchmark of compact directories (see compact_dir.h).
+ *
+ *   make bench
+ *   ./bin/bench-compact-dir 10000000            (10M entries, all kept in memory)
+ *   ./bin/bench-compact-dir --stream 50000000   (50M entries, one directory at a time)
+ *
+ * Synthetic photo-like entries (IMG_<number>.JPG, random sizes of 1-10 MB,
+ * random nanoseconds, mtimes a few seconds apart, the same owner and mode)
+ * are built into directories of --dir-entries entries (default: 10000).
+ * Every directory is built, scanned with a cursor and searched by random
+ * names. The bytes per entry are the memory usage of all directories
+ * divided by the number of entries. They are compared with one malloc()-ed
+ * name and one struct filestat per entry (the naive layout).
+ * Without --stream all directories are kept until the end, so the peak RSS
+ * shows the real footprint. With --stream each directory is freed after it
+ * is measured, so entries that would not fit into memory are still measured.
+ *
+ * Results on a VM (1 core, gcc -O2, glibc malloc):
+ *
+ *   entries  dir entries  options   bytes/entry  naive  build   scan    lookup   peak RSS
+ *   10M      10000        kept      30.3         208    1.8 s   0.9 s   2.1 us   294 MB
+ *   50M      10000        --stream  30.3         208    7.6 s   3.8 s   1.7 us   4.6 MB
+ *   1M       1000000      kept      30.3         208    0.2 s   0.1 s   6.1 us   266 MB (inputs)
+ *   10M      10000        -H        62.3         208    5.6 s   1.3 s   2.6 us   602 MB
+ *
+ * The 50M entries take 1.5 GB as compact directories (9.7 GB in the naive
+ * layout), which did not fit into the memory of the VM, so they were streamed.
+ */
+
+#include "header_common.h"
+
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "compact_dir.h"
+#include "filestat_converter.h"
+
+#include "log.h"
+
+/** Default number of entries */
+#define BENCH_DEFAULT_ENTRIES (10000000)
+
+/** Default number of entries of one directory */
+#define BENCH_DEFAULT_DIR_ENTRIES (10000)
+
+/** Number of random lookups in every directory */
+#define BENCH_LOOKUPS_PER_DIR (100)
+
+/** Maximum length of a generated name (with the null) */
+#define BENCH_NAME_SIZE (32)
+
+/**
+ * Get seconds of a monotonic clock
+ *
+ * @return the seconds
+ */
+static double monotonic_sec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * Get the next pseudo-random number (xorshift64*)
+ *
+ * @param state is the state of the generator (not zero)
+ * @return the number
+ */
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Fill inputs of one directory with synthetic entries
+ *
+ * @param inputs is the array of inputs
+ * @param names is the buffer of names (BENCH_NAME_SIZE per entry)
+ * @param count is the number of entries
+ * @param first is the number of the first entry (names are unique over all directories)
+ * @param hashes determines if entries get random SHA-256 hashes
+ * @param rng is the state of the generator
+ */
+static void fill_inputs(struct compact_dir_input *inputs, char *names, size_t count, uint64_t first, bool hashes,
+						uint64_t *rng)
+{
+	int64_t mtime = 1500000000 + (int64_t)(first * 3);
+	for (size_t i = 0; i < count; i++)
+	{
+		char *name = names + i * BENCH_NAME_SIZE;
+		(void)snprintf(name, BENCH_NAME_SIZE, "IMG_%010" PRIu64 ".JPG", first + i);
+
+		struct compact_dir_input *input = &inputs[i];
+		memset(input, 0, sizeof(struct compact_dir_input));
+		input->name = name;
+
+		struct filestat *s = &input->my_stat;
+		s->size = 1000000 + (int64_t)(next_random(rng) % 9000000);
+		s->blocks = convert_filesize_to_fileblocks(s->size);
+		s->mode = 0100644;
+		s->uid = 1000;
+		s->gid = 1000;
+		mtime += 1 + (int64_t)(next_random(rng) % 5);
+		s->mtime = mtime;
+		s->mtimensec = (int64_t)(next_random(rng) % 1000000000);
+		s->atime = s->mtime;
+		s->atimensec = s->mtimensec;
+		s->ctime = s->mtime;
+		s->ctimensec = s->mtimensec;
+		s->nlink = 1;
+		s->blksize = 4096;
+
+		if (hashes)
+		{
+			for (size_t j = 0; j < 64; j += 16)
+			{
+				(void)snprintf(s->sha256 + j, 17, "%016" PRIx64, next_random(rng));
+			}
+		}
+	}
+}
+
+/**
+ * Print help
+ *
+ * @param program_name is the name of the program
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] [entries]", program_name);
+	PrintToStdoutF("Builds compact directories of synthetic entries (default: %d) and reports", BENCH_DEFAULT_ENTRIES);
+	PrintToStdout("bytes per entry, times of building, scanning and lookups, and the peak RSS.");
+	PrintToStdout("Options:");
+	PrintToStdout("-d   --dir-entries=<n>     entries of one directory (default: 10000)");
+	PrintToStdout("-s   --stream              free every directory after it is measured");
+	PrintToStdout("-H   --sha256              give every entry a SHA-256 hash");
+	PrintToStdout("-h   --help                show this help");
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t entries = BENCH_DEFAULT_ENTRIES;
+	uint64_t dir_entries = BENCH_DEFAULT_DIR_ENTRIES;
+	bool stream = false;
+	bool hashes = false;
+
+	static const struct option long_options[] = {
+		{"dir-entries", required_argument, NULL, 'd'},
+		{"stream", no_argument, NULL, 's'},
+		{"sha256", no_argument, NULL, 'H'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "d:sHh", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dir_entries = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			stream = true;
+			break;
+		case 'H':
+			hashes = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return 0;
+		default:
+			print_help(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc)
+		entries = strtoull(argv[optind], NULL, 10);
+	if (entries == 0 || dir_entries == 0)
+	{
+		print_help(argv[0]);
+		return 1;
+	}
+	if (dir_entries > entries)
+		dir_entries = entries;
+
+	size_t dir_count = (size_t)((entries + dir_entries - 1) / dir_entries);
+	struct compact_dir_input *inputs =
+		(struct compact_dir_input *)malloc(dir_entries * sizeof(struct compact_dir_input));
+	char *names = (char *)malloc(dir_entries * BENCH_NAME_SIZE);
+	struct compact_dir **dirs = (struct compact_dir **)calloc(stream ? 1 : dir_count, sizeof(struct compact_dir *));
+	if (inputs == NULL || names == NULL || dirs == NULL)
+	{
+		PrintToStderr("Failed to allocate inputs");
+		return 1;
+	}
+
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	uint64_t memory = 0;
+	uint64_t naive = 0;
+	uint64_t scanned = 0;
+	uint64_t lookups = 0;
+	double build_sec = 0;
+	double scan_sec = 0;
+	double lookup_sec = 0;
+
+	struct compact_dir_cursor cursor;
+	struct compact_dir_entry entry;
+	for (size_t d = 0; d < dir_count; d++)
+	{
+		uint64_t first = (uint64_t)d * dir_entries;
+		size_t count = (size_t)((entries - first < dir_entries) ? entries - first : dir_entries);
+		fill_inputs(inputs, names, count, first, hashes, &rng);
+
+		// The naive layout: a pointer to a malloc()-ed name (16-byte chunks) and a struct filestat
+		for (size_t i = 0; i < count; i++)
+		{
+			naive += sizeof(char *) + ((strlen(inputs[i].name) + 1 + 8 + 15) & ~(size_t)15) + sizeof(struct filestat);
+		}
+
+		double start = monotonic_sec();
+		struct compact_dir *dir;
+		int res = compact_dir_build(inputs, count, &dir);
+		build_sec += monotonic_sec() - start;
+		if (res != 0)
+		{
+			PrintToStderrF("Failed to build directory: %s", strerror(-res));
+			return 1;
+		}
+		memory += compact_dir_memory_usage(dir);
+
+		start = monotonic_sec();
+		compact_dir_cursor_init(&cursor, dir);
+		while (compact_dir_cursor_next(&cursor, &entry) == 0)
+		{
+			scanned++;
+		}
+		compact_dir_cursor_free(&cursor);
+		scan_sec += monotonic_sec() - start;
+
+		start = monotonic_sec();
+		compact_dir_cursor_init(&cursor, dir);
+		for (int i = 0; i < BENCH_LOOKUPS_PER_DIR; i++)
+		{
+			const char *name = inputs[next_random(&rng) % count].name;
+			if (compact_dir_find(dir, name, &cursor, &entry) != 0)
+			{
+				PrintToStderrF("Failed to find entry: %s", name);
+				return 1;
+			}
+			lookups++;
+		}
+		compact_dir_cursor_free(&cursor);
+		lookup_sec += monotonic_sec() - start;
+
+		if (stream)
+			compact_dir_free(dir);
+		else
+			dirs[d] = dir;
+	}
+
+	struct rusage usage;
+	(void)getrusage(RUSAGE_SELF, &usage);
+
+	PrintToStdoutF("Entries: %" PRIu64 " in %zu directories of %" PRIu64 " (%s%s)", entries, dir_count, dir_entries,
+				   stream ? "streamed" : "kept", hashes ? ", with hashes" : "");
+	PrintToStdoutF("Memory: %.1f bytes per entry (%.1f MB), naive layout: %.1f bytes per entry",
+				   (double)memory / (double)entries, (double)memory / 1e6, (double)naive / (double)entries);
+	PrintToStdoutF("Build: %.2f s, scan: %.2f s (%" PRIu64 " entries), lookup: %.2f us (%" PRIu64 " lookups)",
+				   build_sec, scan_sec, scanned, lookup_sec * 1e6 / (double)lookups, lookups);
+	PrintToStdoutF("Peak RSS: %.1f MB", (double)usage.ru_maxrss / 1024.0);
+
+	if (!stream)
+	{
+		for (size_t d = 0; d < dir_count; d++)
+		{
+			compact_dir_free(dirs[d]);
+		}
+	}
+	free(dirs);
+	free(inputs);
+	free(names);
+	return (scanned == entries) ? 0 : 1;
+}
@@ -0,0 +1,727 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "filestat_parser.h"
+#include "storage.h"
+
+/*
+ * Direct descriptors (file_index of openat and close) appeared in the same
+ * kernel headers as IORING_FILE_INDEX_ALLOC, older headers are not supported.
+ */
+#if defined(IORING_FILE_INDEX_ALLOC) && defined(__NR_io_uring_setup) && defined(STATX_BASIC_STATS)
+#define BATCH_LOADER_HAVE_IO_URING
+#endif
+
+/**
+ * Batched loader of metadata of directory entries
+ */
+struct batch_loader
+{
+	/** True if io_uring is used */
+	bool async;
+
+#ifdef BATCH_LOADER_HAVE_IO_URING
+	/** File descriptor of the ring */
+	int ring_fd;
+
+	/** Number of submission queue entries */
+	unsigned int depth;
+
+	/** Mapped submission queue ring */
+	void *sq_ptr;
+
+	/** Size of the mapped submission queue ring */
+	size_t sq_size;
+
+	/** Mapped completion queue ring (can be the same as sq_ptr) */
+	void *cq_ptr;
+
+	/** Size of the mapped completion queue ring */
+	size_t cq_size;
+
+	/** Mapped array of submission queue entries */
+	struct io_uring_sqe *sqes;
+
+	/** Size of the mapped array of submission queue entries */
+	size_t sqes_size;
+
+	/** Pointers into the submission queue ring */
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+
+	/** Pointers into the completion queue ring */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/** Number of registered direct descriptor slots (one per openat -> read -> close chain) */
+	unsigned int slots_count;
+
+	/** Read buffers (one per slot) */
+	char *buffers;
+
+	/** Results of statx (one per submission queue entry) */
+	struct statx *statx_bufs;
+
+	/** Results of openat (one per slot) */
+	int *open_results;
+
+	/** Results of read (one per slot) */
+	int *read_results;
+#endif
+};
+
+#ifdef BATCH_LOADER_HAVE_IO_URING
+
+/** Kinds of operations encoded in the lowest bits of user_data */
+#define OP_STATX (0)
+#define OP_OPEN (1)
+#define OP_READ (2)
+#define OP_CLOSE (3)
+#define OP_BITS (2)
+
+/**
+ * Convert statx to stat
+ *
+ * @param stx is the source statx
+ * @param stbuf is the target stat
+ */
+static void convert_statx_to_stat(const struct statx *stx, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	stbuf->st_ino = stx->stx_ino;
+	stbuf->st_mode = stx->stx_mode;
+	stbuf->st_nlink = stx->stx_nlink;
+	stbuf->st_uid = stx->stx_uid;
+	stbuf->st_gid = stx->stx_gid;
+	stbuf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	stbuf->st_size = (off_t)stx->stx_size;
+	stbuf->st_blksize = stx->stx_blksize;
+	stbuf->st_blocks = (blkcnt_t)stx->stx_blocks;
+	stbuf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	stbuf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	stbuf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	stbuf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	stbuf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	stbuf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * Unmap rings and close the ring file descriptor
+ *
+ * @param loader is the loader
+ */
+static void batch_loader_close_ring(struct batch_loader *loader)
+{
+	if (loader->sqes != NULL && loader->sqes != MAP_FAILED)
+		(void)munmap(loader->sqes, loader->sqes_size);
+	if (loader->cq_ptr != NULL && loader->cq_ptr != MAP_FAILED && loader->cq_ptr != loader->sq_ptr)
+		(void)munmap(loader->cq_ptr, loader->cq_size);
+	if (loader->sq_ptr != NULL && loader->sq_ptr != MAP_FAILED)
+		(void)munmap(loader->sq_ptr, loader->sq_size);
+	if (loader->ring_fd >= 0)
+		(void)close(loader->ring_fd);
+
+	loader->sqes = NULL;
+	loader->cq_ptr = NULL;
+	loader->sq_ptr = NULL;
+	loader->ring_fd = -1;
+
+	free(loader->buffers);
+	free(loader->statx_bufs);
+	free(loader->open_results);
+	free(loader->read_results);
+	loader->buffers = NULL;
+	loader->statx_bufs = NULL;
+	loader->open_results = NULL;
+	loader->read_results = NULL;
+
+	loader->async = false;
+}
+
+/**
+ * Check that the kernel supports all required operations
+ *
+ * @param ring_fd is the ring file descriptor
+ * @return true if all operations are supported
+ */
+static bool batch_loader_probe(int ring_fd)
+{
+	static const int required_ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+	const size_t ops_count = 256;
+
+	struct io_uring_probe *probe = (struct io_uring_probe *)calloc(
+		1, sizeof(struct io_uring_probe) + ops_count * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return false;
+
+	bool supported = (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops_count) == 0);
+	for (size_t i = 0; supported && i < sizeof(required_ops) / sizeof(required_ops[0]); i++)
+	{
+		int op = required_ops[i];
+		supported = (op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0);
+	}
+
+	free(probe);
+	return supported;
+}
+
+/**
+ * Set up the ring
+ *
+ * @param loader is the loader
+ * @param depth is the number of submission queue entries
+ * @return 0 on success, nonzero value on error (the loader stays synchronous)
+ */
+static int batch_loader_setup_ring(struct batch_loader *loader, unsigned int depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	loader->ring_fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+	if (loader->ring_fd < 0)
+		return -errno;
+
+	// Completion queue is expected to hold results of all submitted entries
+	if (!batch_loader_probe(loader->ring_fd) ||
+		(params.features & IORING_FEAT_NODROP) == 0 ||
+		params.cq_entries < params.sq_entries)
+	{
+		batch_loader_close_ring(loader);
+		return -EOPNOTSUPP;
+	}
+
+	loader->depth = params.sq_entries;
+	loader->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	loader->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+	{
+		if (loader->cq_size > loader->sq_size)
+			loader->sq_size = loader->cq_size;
+		loader->cq_size = loader->sq_size;
+	}
+
+	loader->sq_ptr = mmap(NULL, loader->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						  loader->ring_fd, IORING_OFF_SQ_RING);
+	if (loader->sq_ptr == MAP_FAILED)
+	{
+		batch_loader_close_ring(loader);
+		return -ENOMEM;
+	}
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+	{
+		loader->cq_ptr = loader->sq_ptr;
+	}
+	else
+	{
+		loader->cq_ptr = mmap(NULL, loader->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+							  loader->ring_fd, IORING_OFF_CQ_RING);
+		if (loader->cq_ptr == MAP_FAILED)
+		{
+			batch_loader_close_ring(loader);
+			return -ENOMEM;
+		}
+	}
+
+	loader->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	loader->sqes = (struct io_uring_sqe *)mmap(NULL, loader->sqes_size, PROT_READ | PROT_WRITE,
+											   MAP_SHARED | MAP_POPULATE, loader->ring_fd, IORING_OFF_SQES);
+	if (loader->sqes == MAP_FAILED)
+	{
+		batch_loader_close_ring(loader);
+		return -ENOMEM;
+	}
+
+	uint8_t *sq = (uint8_t *)loader->sq_ptr;
+	loader->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	loader->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	loader->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+	uint8_t *cq = (uint8_t *)loader->cq_ptr;
+	loader->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	loader->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	loader->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	loader->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Every chain takes three entries: openat, read and close
+	loader->slots_count = loader->depth / 3;
+	if (loader->slots_count == 0)
+	{
+		batch_loader_close_ring(loader);
+		return -EINVAL;
+	}
+
+	loader->buffers = (char *)malloc((size_t)loader->slots_count * BATCH_LOADER_READ_BUFFER_SIZE);
+	loader->statx_bufs = (struct statx *)malloc(loader->depth * sizeof(struct statx));
+	loader->open_results = (int *)malloc(loader->slots_count * sizeof(int));
+	loader->read_results = (int *)malloc(loader->slots_count * sizeof(int));
+	int *fds = (int *)malloc(loader->slots_count * sizeof(int));
+	if (loader->buffers == NULL || loader->statx_bufs == NULL ||
+		loader->open_results == NULL || loader->read_results == NULL || fds == NULL)
+	{
+		free(fds);
+		batch_loader_close_ring(loader);
+		return -ENOMEM;
+	}
+
+	// Register empty slots for direct descriptors
+	for (unsigned int i = 0; i < loader->slots_count; i++)
+	{
+		fds[i] = -1;
+	}
+
+	long res = syscall(__NR_io_uring_register, loader->ring_fd, IORING_REGISTER_FILES, fds, loader->slots_count);
+	free(fds);
+	if (res != 0)
+	{
+		batch_loader_close_ring(loader);
+		return -EOPNOTSUPP;
+	}
+
+	loader->async = true;
+	return 0;
+}
+
+/**
+ * Get the next free submission queue entry (the queue must be drained before a batch)
+ *
+ * @param loader is the loader
+ * @param index is the index of the entry in the batch
+ * @return zeroed entry
+ */
+static struct io_uring_sqe *batch_loader_get_sqe(struct batch_loader *loader, unsigned int index)
+{
+	unsigned int tail = *loader->sq_tail + index;
+	unsigned int slot = tail & *loader->sq_mask;
+
+	struct io_uring_sqe *sqe = &loader->sqes[slot];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	loader->sq_array[slot] = slot;
+	return sqe;
+}
+
+/**
+ * Submit prepared entries and wait for all their completions
+ *
+ * @param loader is the loader
+ * @param count is the number of prepared entries
+ * @param on_complete is called for every completion
+ * @param arg is the argument for on_complete
+ * @return 0 on success, negative value if the ring failed
+ */
+static int batch_loader_submit_and_wait(struct batch_loader *loader, unsigned int count,
+										void (*on_complete)(struct batch_loader *, uint64_t, int, void *),
+										void *arg)
+{
+	// Publish entries to the kernel
+	__atomic_store_n(loader->sq_tail, *loader->sq_tail + count, __ATOMIC_RELEASE);
+
+	unsigned int to_submit = count;
+	unsigned int completed = 0;
+
+	while (completed < count)
+	{
+		long res = syscall(__NR_io_uring_enter, loader->ring_fd, to_submit, count - completed,
+						   IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			return -errno;
+		}
+
+		if ((unsigned int)res > to_submit)
+			return -EIO;
+		to_submit -= (unsigned int)res;
+
+		unsigned int head = *loader->cq_head;
+		unsigned int tail = __atomic_load_n(loader->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			const struct io_uring_cqe *cqe = &loader->cqes[head & *loader->cq_mask];
+			on_complete(loader, cqe->user_data, cqe->res, arg);
+			head++;
+			completed++;
+		}
+		__atomic_store_n(loader->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/**
+ * Arguments of completion handlers
+ */
+struct batch_context
+{
+	/** Entries of the directory */
+	struct catalog_dir_entry *entries;
+
+	/** Results of entries */
+	int *results;
+
+	/** Index of the first entry of the batch */
+	size_t start;
+
+	/** Indexes of entries of chains (one per slot) */
+	size_t *chain_entries;
+};
+
+/**
+ * Handle completion of statx
+ */
+static void on_statx_complete(struct batch_loader *loader, uint64_t user_data, int res, void *arg)
+{
+	struct batch_context *ctx = (struct batch_context *)arg;
+	size_t index = (size_t)(user_data >> OP_BITS);
+	size_t entry_index = ctx->start + index;
+
+	if (res < 0)
+	{
+		ctx->results[entry_index] = res;
+		return;
+	}
+
+	convert_statx_to_stat(&loader->statx_bufs[index], &ctx->entries[entry_index].stbuf);
+	ctx->results[entry_index] = 0;
+}
+
+/**
+ * Handle completion of openat, read or close
+ */
+static void on_chain_complete(struct batch_loader *loader, uint64_t user_data, int res, void *arg)
+{
+	(void)arg;
+
+	unsigned int slot = (unsigned int)(user_data >> OP_BITS);
+	switch (user_data & ((1 << OP_BITS) - 1))
+	{
+	case OP_OPEN:
+		loader->open_results[slot] = res;
+		break;
+	case OP_READ:
+		loader->read_results[slot] = res;
+		break;
+	default:
+		// Failed close of a direct descriptor leaves nothing to clean up
+		break;
+	}
+}
+
+/**
+ * Stat all entries with statx in batches
+ *
+ * @param loader is the loader
+ * @param dir_fd is the directory file descriptor
+ * @param entries is the array of entries
+ * @param count is the number of entries
+ * @param results is the array of results
+ * @return 0 on success, negative value if the ring failed
+ */
+static int batch_loader_statx_all(struct batch_loader *loader, int dir_fd, struct catalog_dir_entry *entries,
+								  size_t count, int *results)
+{
+	struct batch_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.entries = entries;
+	ctx.results = results;
+
+	for (size_t start = 0; start < count; start += loader->depth)
+	{
+		unsigned int batch = (count - start < loader->depth) ? (unsigned int)(count - start) : loader->depth;
+
+		for (unsigned int i = 0; i < batch; i++)
+		{
+			struct io_uring_sqe *sqe = batch_loader_get_sqe(loader, i);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dir_fd;
+			sqe->addr = (uint64_t)(uintptr_t)entries[start + i].name;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (uint64_t)(uintptr_t)&loader->statx_bufs[i];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = ((uint64_t)i << OP_BITS) | OP_STATX;
+		}
+
+		ctx.start = start;
+		int res = batch_loader_submit_and_wait(loader, batch, on_statx_complete, &ctx);
+		if (res != 0)
+			return res;
+	}
+
+	return 0;
+}
+
+/**
+ * Read filestat files of entries with openat -> read -> close chains
+ *
+ * @param loader is the loader
+ * @param dir_fd is the directory file descriptor
+ * @param entries is the array of entries
+ * @param indexes is the array of indexes of entries to read
+ * @param count is the number of indexes
+ * @param results is the array of results of entries
+ * @return 0 on success, negative value if the ring failed or direct descriptors are not supported
+ */
+static int batch_loader_read_all(struct batch_loader *loader, int dir_fd, struct catalog_dir_entry *entries,
+								 const size_t *indexes, size_t count, int *results)
+{
+	for (size_t start = 0; start < count; start += loader->slots_count)
+	{
+		unsigned int batch = (count - start < loader->slots_count) ? (unsigned int)(count - start) : loader->slots_count;
+
+		for (unsigned int slot = 0; slot < batch; slot++)
+		{
+			struct catalog_dir_entry *entry = &entries[indexes[start + slot]];
+			uint64_t user_data = (uint64_t)slot << OP_BITS;
+
+			loader->open_results[slot] = -ECANCELED;
+			loader->read_results[slot] = -ECANCELED;
+
+			struct io_uring_sqe *sqe = batch_loader_get_sqe(loader, slot * 3);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = dir_fd;
+			sqe->addr = (uint64_t)(uintptr_t)entry->name;
+			sqe->open_flags = O_RDONLY;
+			sqe->file_index = slot + 1; // zero means "not a direct descriptor"
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = user_data | OP_OPEN;
+
+			sqe = batch_loader_get_sqe(loader, slot * 3 + 1);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = (int)slot;
+			sqe->addr = (uint64_t)(uintptr_t)(loader->buffers + (size_t)slot * BATCH_LOADER_READ_BUFFER_SIZE);
+			sqe->len = BATCH_LOADER_READ_BUFFER_SIZE;
+			sqe->off = 0;
+			// Hard link: the descriptor should be closed even if read fails
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+			sqe->user_data = user_data | OP_READ;
+
+			sqe = batch_loader_get_sqe(loader, slot * 3 + 2);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = slot + 1;
+			sqe->user_data = user_data | OP_CLOSE;
+		}
+
+		int res = batch_loader_submit_and_wait(loader, batch * 3, on_chain_complete, NULL);
+		if (res != 0)
+			return res;
+
+		for (unsigned int slot = 0; slot < batch; slot++)
+		{
+			size_t index = indexes[start + slot];
+			struct catalog_dir_entry *entry = &entries[index];
+
+			// Kernels without direct descriptors reject file_index of openat
+			if (loader->open_results[slot] == -EINVAL)
+				return -EOPNOTSUPP;
+
+			if (loader->open_results[slot] < 0)
+			{
+				results[index] = loader->open_results[slot];
+				continue;
+			}
+
+			if (loader->read_results[slot] < 0)
+			{
+				results[index] = loader->read_results[slot];
+				continue;
+			}
+
+			res = read_filestat_from_buffer(loader->buffers + (size_t)slot * BATCH_LOADER_READ_BUFFER_SIZE,
+											(size_t)loader->read_results[slot], &entry->my_stat);
+
+			// Small sparse files can have a block allocated for the xattr and do not look sparse
+			if (res != 0 && storage_read_sparse(dir_fd, entry->name, &entry->stbuf, &entry->my_stat) == 0)
+				res = 0;
+
+			if (res != 0)
+			{
+				results[index] = res;
+				continue;
+			}
+
+			entry->has_filestat = true;
+		}
+	}
+
+	return 0;
+}
+
+#endif // BATCH_LOADER_HAVE_IO_URING
+
+/**
+ * Make a loader (falls back to usual system calls if io_uring is not available)
+ *
+ * @param loader is the result (must be freed by batch_loader_free())
+ * @param depth is the number of submission queue entries
+ * @return 0 on success, -ENOMEM on error
+ */
+int batch_loader_new(struct batch_loader **loader, unsigned int depth)
+{
+	struct batch_loader *result = (struct batch_loader *)calloc(1, sizeof(struct batch_loader));
+	if (result == NULL)
+		return -ENOMEM;
+
+#ifdef BATCH_LOADER_HAVE_IO_URING
+	result->ring_fd = -1;
+	(void)batch_loader_setup_ring(result, (depth == 0) ? BATCH_LOADER_DEFAULT_DEPTH : depth);
+#else
+	(void)depth;
+#endif
+
+	*loader = result;
+	return 0;
+}
+
+/**
+ * Check if the loader uses io_uring
+ *
+ * @param loader is the loader (can be NULL)
+ * @return true if io_uring is used
+ */
+bool batch_loader_is_async(const struct batch_loader *loader)
+{
+	return loader != NULL && loader->async;
+}
+
+/**
+ * Fill stbuf and my_stat of entries (entries must have name set)
+ * and read filestat files of non-empty regular files if needed
+ * (unless the lookup has their filestats). Symlink targets are not read.
+ *
+ * @param loader is the loader (must be async)
+ * @param dir_fd is the directory file descriptor
+ * @param entries is the array of entries
+ * @param count is the number of entries
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param results is the array of results for entries (0 on success, 1 if entry should be skipped,
+ *        negative value on error)
+ * @return 0 on success, nonzero value if io_uring failed as a whole (the loader is switched to
+ *         usual system calls and entries should be filled again)
+ */
+int batch_loader_fill_entries(struct batch_loader *loader, int dir_fd, struct catalog_dir_entry *entries,
+							  size_t count, bool read_filestats, const struct catalog_dir_lookup *lookup, int *results)
+{
+#ifdef BATCH_LOADER_HAVE_IO_URING
+	if (!batch_loader_is_async(loader))
+		return -EOPNOTSUPP;
+
+	int res = batch_loader_statx_all(loader, dir_fd, entries, count, results);
+	if (res != 0)
+	{
+		batch_loader_close_ring(loader);
+		return res;
+	}
+
+	size_t *indexes = (size_t *)malloc((count + 1) * sizeof(size_t));
+	if (indexes == NULL)
+		return -ENOMEM;
+
+	size_t indexes_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		struct catalog_dir_entry *entry = &entries[i];
+		if (results[i] != 0)
+			continue;
+
+		if (!S_ISREG(entry->stbuf.st_mode) &&
+			!S_ISDIR(entry->stbuf.st_mode) &&
+			!S_ISLNK(entry->stbuf.st_mode))
+		{
+			results[i] = 1;
+			continue;
+		}
+
+		if (fill_filestat_from_stat(&entry->my_stat, &entry->stbuf) != 0)
+		{
+			results[i] = -EPERM;
+			continue;
+		}
+
+		if (!read_filestats || !S_ISREG(entry->stbuf.st_mode))
+			continue;
+
+		if (lookup != NULL && lookup->get(lookup->ctx, entry->name, &entry->stbuf, &entry->my_stat))
+		{
+			entry->has_filestat = true;
+			entry->from_lookup = true;
+			continue;
+		}
+
+		if (entry->stbuf.st_size == 0 ||
+			entry->stbuf.st_size > BATCH_LOADER_READ_BUFFER_SIZE ||
+			storage_is_sparse(&entry->stbuf))
+		{
+			// Record in the xattr (see storage.h), unusually big filestat file or not a filestat at all
+			results[i] = storage_read_filestat(dir_fd, entry->name, &entry->stbuf, &entry->my_stat);
+			entry->has_filestat = (results[i] == 0);
+
+			// Same logic as in getattr(): empty files without a record are not released yet
+			if (results[i] == -ENODATA && entry->stbuf.st_size == 0)
+				results[i] = 0;
+			continue;
+		}
+
+		indexes[indexes_count++] = i;
+	}
+
+	res = batch_loader_read_all(loader, dir_fd, entries, indexes, indexes_count, results);
+	free(indexes);
+
+	if (res != 0)
+	{
+		batch_loader_close_ring(loader);
+		return res;
+	}
+
+	return 0;
+#else
+	(void)loader;
+	(void)dir_fd;
+	(void)entries;
+	(void)count;
+	(void)read_filestats;
+	(void)lookup;
+	(void)results;
+	return -EOPNOTSUPP;
+#endif
+}
+
+/**
+ * Free the loader
+ *
+ * @param loader is the loader (can be NULL)
+ */
+void batch_loader_free(struct batch_loader *loader)
+{
+	if (loader == NULL)
+		return;
+
+#ifdef BATCH_LOADER_HAVE_IO_URING
+	batch_loader_close_ring(loader);
+#endif
+
+	free(loader);
+}
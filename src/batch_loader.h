@@ -0,0 +1,82 @@
+#ifndef INC_CATALOGFS_BATCH_LOADER_H
+#define INC_CATALOGFS_BATCH_LOADER_H
+
+#include "header_common.h"
+
+// Forward declarations
+struct catalog_dir_entry;
+struct catalog_dir_lookup;
+
+/**
+ * Batched loader of metadata of directory entries.
+ *
+ * Loading a directory of a catalog means statx() of every entry and
+ * openat(), read() and close() of every filestat file, that is four
+ * synchronous system calls per entry. The loader submits them with io_uring
+ * in batches instead:
+ *
+ *  - statx for all entries of the batch;
+ *  - then openat -> read -> close chains for all filestat files of the batch,
+ *    linked with IOSQE_IO_LINK and using direct (registered) descriptors,
+ *    so a chain needs no round trip to user space between its steps.
+ *
+ * If io_uring is not available (old kernel, seccomp, not Linux) or some
+ * operation is not supported, the loader falls back to usual system calls
+ * with the same results (see catalog_dir_load_batch()).
+ *
+ * A loader is not thread-safe, every thread should have its own one.
+ */
+
+/** Default number of submission queue entries */
+#define BATCH_LOADER_DEFAULT_DEPTH (256)
+
+/** Filestat files bigger than this are read with usual system calls */
+#define BATCH_LOADER_READ_BUFFER_SIZE (4096)
+
+// Forward declaration
+struct batch_loader;
+
+/**
+ * Make a loader (falls back to usual system calls if io_uring is not available)
+ *
+ * @param loader is the result (must be freed by batch_loader_free())
+ * @param depth is the number of submission queue entries
+ * @return 0 on success, -ENOMEM on error
+ */
+int batch_loader_new(struct batch_loader **loader, unsigned int depth);
+
+/**
+ * Check if the loader uses io_uring
+ *
+ * @param loader is the loader (can be NULL)
+ * @return true if io_uring is used
+ */
+bool batch_loader_is_async(const struct batch_loader *loader);
+
+/**
+ * Fill stbuf and my_stat of entries (entries must have name set)
+ * and read filestat files of non-empty regular files if needed
+ * (unless the lookup has their filestats). Symlink targets are not read.
+ *
+ * @param loader is the loader (must be async)
+ * @param dir_fd is the directory file descriptor
+ * @param entries is the array of entries
+ * @param count is the number of entries
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param results is the array of results for entries (0 on success, 1 if entry should be skipped,
+ *        negative value on error)
+ * @return 0 on success, nonzero value if io_uring failed as a whole (the loader is switched to
+ *         usual system calls and entries should be filled again)
+ */
+int batch_loader_fill_entries(struct batch_loader *loader, int dir_fd, struct catalog_dir_entry *entries,
+							  size_t count, bool read_filestats, const struct catalog_dir_lookup *lookup, int *results);
+
+/**
+ * Free the loader
+ *
+ * @param loader is the loader (can be NULL)
+ */
+void batch_loader_free(struct batch_loader *loader);
+
+#endif // INC_CATALOGFS_BATCH_LOADER_H
@@ -0,0 +1,139 @@
+#include "header_common.h"
+
+#include <stdarg.h>
+
+#include "byte_buffer.h"
+#include "varint.h"
+
+/** Initial capacity of buffers */
+#define BYTE_BUFFER_INITIAL_CAPACITY (256)
+
+/**
+ * Make sure the buffer has space for additional bytes
+ *
+ * @param buf is the buffer
+ * @param additional is the number of additional bytes
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_reserve(struct byte_buffer *buf, size_t additional)
+{
+	if (additional > SIZE_MAX - buf->len)
+		return -ENOMEM;
+
+	size_t needed = buf->len + additional;
+	if (needed <= buf->capacity)
+		return 0;
+
+	size_t new_capacity = (buf->capacity == 0) ? BYTE_BUFFER_INITIAL_CAPACITY : buf->capacity;
+	while (new_capacity < needed)
+	{
+		if (new_capacity > SIZE_MAX / 2)
+		{
+			new_capacity = needed;
+			break;
+		}
+		new_capacity *= 2;
+	}
+
+	uint8_t *new_data = (uint8_t *)realloc(buf->data, new_capacity);
+	if (new_data == NULL)
+		return -ENOMEM;
+
+	buf->data = new_data;
+	buf->capacity = new_capacity;
+	return 0;
+}
+
+/**
+ * Append bytes to the buffer
+ *
+ * @param buf is the buffer
+ * @param data is the data to append
+ * @param len is the length of data
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append(struct byte_buffer *buf, const void *data, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	int res = byte_buffer_reserve(buf, len);
+	if (res != 0)
+		return res;
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+/**
+ * Append unsigned value encoded as varint to the buffer
+ *
+ * @param buf is the buffer
+ * @param value is the value to append
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_varint(struct byte_buffer *buf, uint64_t value)
+{
+	int res = byte_buffer_reserve(buf, VARINT_MAX_LENGTH);
+	if (res != 0)
+		return res;
+
+	buf->len += varint_encode(buf->data + buf->len, value);
+	return 0;
+}
+
+/**
+ * Append signed value encoded as zigzag varint to the buffer
+ *
+ * @param buf is the buffer
+ * @param value is the value to append
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_svarint(struct byte_buffer *buf, int64_t value)
+{
+	return byte_buffer_append_varint(buf, zigzag_encode(value));
+}
+
+/**
+ * Append formatted text to the buffer (without null-terminator)
+ *
+ * @param buf is the buffer
+ * @param format is the printf-like format
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_format(struct byte_buffer *buf, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+
+	if (len < 0)
+		return -EINVAL;
+
+	// Reserve space for the null-terminator written by vsnprintf() too
+	int res = byte_buffer_reserve(buf, (size_t)len + 1);
+	if (res != 0)
+		return res;
+
+	va_start(args, format);
+	(void)vsnprintf((char *)buf->data + buf->len, (size_t)len + 1, format, args);
+	va_end(args);
+
+	buf->len += (size_t)len;
+	return 0;
+}
+
+/**
+ * Free the buffer data (the buffer can be reused after that)
+ *
+ * @param buf is the buffer
+ */
+void byte_buffer_free(struct byte_buffer *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->capacity = 0;
+}
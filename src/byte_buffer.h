@@ -0,0 +1,75 @@
+#ifndef INC_CATALOGFS_BYTE_BUFFER_H
+#define INC_CATALOGFS_BYTE_BUFFER_H
+
+#include "header_common.h"
+
+/**
+ * Growable buffer of bytes
+ */
+struct byte_buffer
+{
+	/** Data of the buffer */
+	uint8_t *data;
+
+	/** Number of used bytes */
+	size_t len;
+
+	/** Number of allocated bytes */
+	size_t capacity;
+};
+
+/**
+ * Make sure the buffer has space for additional bytes
+ *
+ * @param buf is the buffer
+ * @param additional is the number of additional bytes
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_reserve(struct byte_buffer *buf, size_t additional);
+
+/**
+ * Append bytes to the buffer
+ *
+ * @param buf is the buffer
+ * @param data is the data to append
+ * @param len is the length of data
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append(struct byte_buffer *buf, const void *data, size_t len);
+
+/**
+ * Append unsigned value encoded as varint to the buffer
+ *
+ * @param buf is the buffer
+ * @param value is the value to append
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_varint(struct byte_buffer *buf, uint64_t value);
+
+/**
+ * Append signed value encoded as zigzag varint to the buffer
+ *
+ * @param buf is the buffer
+ * @param value is the value to append
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_svarint(struct byte_buffer *buf, int64_t value);
+
+/**
+ * Append formatted text to the buffer (without null-terminator)
+ *
+ * @param buf is the buffer
+ * @param format is the printf-like format
+ * @return 0 on success, -ENOMEM on error
+ */
+int byte_buffer_append_format(struct byte_buffer *buf, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Free the buffer data (the buffer can be reused after that)
+ *
+ * @param buf is the buffer
+ */
+void byte_buffer_free(struct byte_buffer *buf);
+
+#endif // INC_CATALOGFS_BYTE_BUFFER_H
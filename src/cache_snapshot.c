@@ -0,0 +1,647 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache_snapshot.h"
+
+#include "sha256.h"
+#include "varint.h"
+
+/** Magic of the header */
+#define CACHE_SNAPSHOT_MAGIC "CatalogFS.Snap.1"
+
+/** Length of the magic (without the null terminator) */
+#define CACHE_SNAPSHOT_MAGIC_LENGTH (16)
+
+/** Size of the header (magic, source inode, records, table offset, table size, file size) */
+#define CACHE_SNAPSHOT_HEADER_SIZE (64)
+
+/** Offset of the inode of the source directory in the header */
+#define HEADER_SOURCE_INO_OFFSET (16)
+
+/** Offset of the number of records in the header */
+#define HEADER_COUNT_OFFSET (24)
+
+/** Offset of the offset of the hash table in the header */
+#define HEADER_TABLE_OFFSET (32)
+
+/** Offset of the number of slots of the hash table in the header */
+#define HEADER_SLOTS_OFFSET (40)
+
+/** Offset of the size of the file in the header */
+#define HEADER_FILE_SIZE_OFFSET (48)
+
+/** Bits of a slot used by the offset of the record */
+#define SLOT_OFFSET_BITS (40)
+
+/** Mask of the offset of the record in a slot */
+#define SLOT_OFFSET_MASK ((UINT64_C(1) << SLOT_OFFSET_BITS) - 1)
+
+/** Maximum size of an encoded record without the path */
+#define MAX_RECORD_SIZE (20 * VARINT_MAX_LENGTH + 1 + SHA256_DIGEST_SIZE)
+
+/** Number of fields of a record encoded as varints (validators and filestat) */
+#define RECORD_VARINT_FIELDS (19)
+
+/**
+ * Mapped snapshot file
+ */
+struct cache_snapshot
+{
+	/** Mapped file */
+	const uint8_t *data;
+
+	/** Size of the file */
+	size_t size;
+
+	/** Number of records */
+	size_t count;
+
+	/** Hash table of records */
+	const uint8_t *slots;
+
+	/** Number of slots (power of 2) */
+	size_t slots_count;
+
+	/** End of records (start of the hash table) */
+	size_t records_end;
+};
+
+/**
+ * Position of a written record (the hash table is built when all records are written)
+ */
+struct snapshot_slot
+{
+	/** Hash of the path */
+	uint64_t hash;
+
+	/** Offset of the record in the file */
+	uint64_t offset;
+};
+
+/**
+ * Writer of a snapshot file
+ */
+struct cache_snapshot_writer
+{
+	/** Temporary file */
+	FILE *file;
+
+	/** Path of the snapshot */
+	char *path;
+
+	/** Path of the temporary file */
+	char *tmp_path;
+
+	/** Inode of the source directory */
+	ino_t source_ino;
+
+	/** Offset of the next record */
+	uint64_t offset;
+
+	/** Positions of written records */
+	struct snapshot_slot *slots;
+
+	/** Number of written records */
+	size_t count;
+
+	/** Capacity of slots */
+	size_t capacity;
+};
+
+/**
+ * Calculate hash of a path (64-bit FNV-1a, it's stored in files, so it must never change)
+ *
+ * @param path is the path
+ * @param path_len is the length of the path
+ * @return hash of the path
+ */
+static uint64_t snapshot_hash(const char *path, size_t path_len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < path_len; i++)
+	{
+		hash ^= (uint8_t)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Get the tag of a hash kept in a slot
+ *
+ * @param hash is the hash of the path
+ * @return the tag (high bits of a slot)
+ */
+static uint64_t slot_tag(uint64_t hash)
+{
+	return hash >> SLOT_OFFSET_BITS;
+}
+
+/**
+ * Encode the record without the path
+ *
+ * @param buf is the target buffer (at least MAX_RECORD_SIZE bytes)
+ * @param record is the record
+ * @return the size of the encoded record
+ */
+static size_t encode_record(uint8_t *buf, const struct cache_snapshot_record *record)
+{
+	const struct filestat *s = &record->my_stat;
+
+	size_t len = 0;
+	len += varint_encode(buf + len, (uint64_t)record->ino);
+	len += varint_encode(buf + len, zigzag_encode(record->size));
+	len += varint_encode(buf + len, zigzag_encode(record->mtim.tv_sec));
+	len += varint_encode(buf + len, (uint64_t)record->mtim.tv_nsec);
+	len += varint_encode(buf + len, zigzag_encode(record->ctim.tv_sec));
+	len += varint_encode(buf + len, (uint64_t)record->ctim.tv_nsec);
+	len += varint_encode(buf + len, s->mode);
+	len += varint_encode(buf + len, s->uid);
+	len += varint_encode(buf + len, s->gid);
+	len += varint_encode(buf + len, zigzag_encode(s->size));
+	len += varint_encode(buf + len, zigzag_encode(s->blocks));
+	len += varint_encode(buf + len, zigzag_encode(s->atime));
+	len += varint_encode(buf + len, zigzag_encode(s->mtime));
+	len += varint_encode(buf + len, zigzag_encode(s->ctime));
+	len += varint_encode(buf + len, zigzag_encode(s->atimensec));
+	len += varint_encode(buf + len, zigzag_encode(s->mtimensec));
+	len += varint_encode(buf + len, zigzag_encode(s->ctimensec));
+	len += varint_encode(buf + len, s->nlink);
+	len += varint_encode(buf + len, zigzag_encode(s->blksize));
+
+	// Hashes are kept binary, an invalid hash is dropped like an unknown one
+	bool has_hash = sha256_from_hex(s->sha256, buf + len + 1);
+	buf[len++] = (has_hash) ? SHA256_DIGEST_SIZE : 0;
+	if (has_hash)
+		len += SHA256_DIGEST_SIZE;
+
+	return len;
+}
+
+/**
+ * Decode the record at the offset
+ *
+ * @param snapshot is the snapshot
+ * @param offset is the offset of the record
+ * @param path is the path of the record (points into the mapped file)
+ * @param path_len is the length of the path
+ * @param record is the decoded record (can be NULL to decode only the path)
+ * @param next is the offset of the next record (can be NULL)
+ * @return 0 on success, -EIO for broken data
+ */
+static int decode_record(const struct cache_snapshot *snapshot, size_t offset, const char **path,
+						 size_t *path_len, struct cache_snapshot_record *record, size_t *next)
+{
+	if (offset < CACHE_SNAPSHOT_HEADER_SIZE || offset >= snapshot->records_end)
+		return -EIO;
+
+	const uint8_t *pos = snapshot->data + offset;
+	const uint8_t *end = snapshot->data + snapshot->records_end;
+
+	uint64_t len;
+	if (varint_decode(&pos, end, &len) != 0 || len > (uint64_t)(end - pos))
+		return -EIO;
+
+	*path = (const char *)pos;
+	*path_len = (size_t)len;
+	pos += len;
+
+	if (record == NULL)
+		return 0;
+
+	uint64_t v[RECORD_VARINT_FIELDS];
+	for (size_t i = 0; i < RECORD_VARINT_FIELDS; i++)
+	{
+		if (varint_decode(&pos, end, &v[i]) != 0)
+			return -EIO;
+	}
+
+	struct filestat *s = &record->my_stat;
+	record->ino = (ino_t)v[0];
+	record->size = (off_t)zigzag_decode(v[1]);
+	record->mtim.tv_sec = (time_t)zigzag_decode(v[2]);
+	record->mtim.tv_nsec = (long)v[3];
+	record->ctim.tv_sec = (time_t)zigzag_decode(v[4]);
+	record->ctim.tv_nsec = (long)v[5];
+	s->mode = (uint32_t)v[6];
+	s->uid = (uint32_t)v[7];
+	s->gid = (uint32_t)v[8];
+	s->size = zigzag_decode(v[9]);
+	s->blocks = zigzag_decode(v[10]);
+	s->atime = zigzag_decode(v[11]);
+	s->mtime = zigzag_decode(v[12]);
+	s->ctime = zigzag_decode(v[13]);
+	s->atimensec = zigzag_decode(v[14]);
+	s->mtimensec = zigzag_decode(v[15]);
+	s->ctimensec = zigzag_decode(v[16]);
+	s->nlink = v[17];
+	s->blksize = zigzag_decode(v[18]);
+
+	if (pos >= end)
+		return -EIO;
+
+	size_t hash_len = *pos++;
+	if (hash_len == SHA256_DIGEST_SIZE && end - pos >= SHA256_DIGEST_SIZE)
+	{
+		sha256_to_hex(pos, s->sha256);
+		pos += SHA256_DIGEST_SIZE;
+	}
+	else if (hash_len == 0)
+	{
+		s->sha256[0] = '\0';
+	}
+	else
+	{
+		return -EIO;
+	}
+
+	if (next != NULL)
+		*next = (size_t)(pos - snapshot->data);
+
+	return 0;
+}
+
+/* ----------------------------------------------------------- *
+ * Reading
+ * ----------------------------------------------------------- */
+
+/**
+ * Map the snapshot file
+ *
+ * @param snapshot is the new snapshot (must be closed by cache_snapshot_close())
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory the snapshot must belong to
+ * @return 0 on success, -ENOENT if there is no snapshot, -EINVAL if it's not a snapshot
+ *         or it belongs to another source directory, other negative value (mostly -errno) on error
+ */
+int cache_snapshot_open(struct cache_snapshot **snapshot, const char *path, ino_t source_ino)
+{
+	*snapshot = NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) == -1)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	if (!S_ISREG(stbuf.st_mode) || stbuf.st_size < CACHE_SNAPSHOT_HEADER_SIZE)
+	{
+		(void)close(fd);
+		return -EINVAL;
+	}
+
+	size_t size = (size_t)stbuf.st_size;
+	void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	int errno_stored = errno;
+	(void)close(fd);
+	if (data == MAP_FAILED)
+		return -errno_stored;
+
+	// Records are looked up in random order, readahead would only waste memory
+	(void)madvise(data, size, MADV_RANDOM);
+
+	const uint8_t *header = (const uint8_t *)data;
+	uint64_t count = read_le64(header + HEADER_COUNT_OFFSET);
+	uint64_t table_offset = read_le64(header + HEADER_TABLE_OFFSET);
+	uint64_t slots_count = read_le64(header + HEADER_SLOTS_OFFSET);
+
+	if (memcmp(header, CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_LENGTH) != 0 ||
+		read_le64(header + HEADER_SOURCE_INO_OFFSET) != (uint64_t)source_ino ||
+		read_le64(header + HEADER_FILE_SIZE_OFFSET) != (uint64_t)size ||
+		slots_count == 0 || (slots_count & (slots_count - 1)) != 0 || count >= slots_count ||
+		table_offset < CACHE_SNAPSHOT_HEADER_SIZE || table_offset > size ||
+		slots_count > (size - table_offset) / sizeof(uint64_t))
+	{
+		(void)munmap(data, size);
+		return -EINVAL;
+	}
+
+	struct cache_snapshot *new_snapshot = (struct cache_snapshot *)calloc(1, sizeof(struct cache_snapshot));
+	if (new_snapshot == NULL)
+	{
+		(void)munmap(data, size);
+		return -ENOMEM;
+	}
+
+	new_snapshot->data = (const uint8_t *)data;
+	new_snapshot->size = size;
+	new_snapshot->count = (size_t)count;
+	new_snapshot->slots = new_snapshot->data + table_offset;
+	new_snapshot->slots_count = (size_t)slots_count;
+	new_snapshot->records_end = (size_t)table_offset;
+
+	*snapshot = new_snapshot;
+	return 0;
+}
+
+/**
+ * Find the record of the path
+ *
+ * @param snapshot is the snapshot
+ * @param path is the relative path (does not need to be null-terminated)
+ * @param path_len is the length of the path
+ * @param record is the found record
+ * @return true if the record was found
+ */
+bool cache_snapshot_get(const struct cache_snapshot *snapshot, const char *path, size_t path_len,
+						struct cache_snapshot_record *record)
+{
+	uint64_t hash = snapshot_hash(path, path_len);
+	uint64_t tag = slot_tag(hash);
+	size_t mask = snapshot->slots_count - 1;
+
+	// The table is never full, so an empty slot ends every probe sequence
+	for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask)
+	{
+		uint64_t slot = read_le64(snapshot->slots + i * sizeof(uint64_t));
+		if (slot == 0)
+			return false;
+
+		if ((slot >> SLOT_OFFSET_BITS) != tag)
+			continue;
+
+		const char *record_path;
+		size_t record_path_len;
+		if (decode_record(snapshot, (size_t)(slot & SLOT_OFFSET_MASK), &record_path, &record_path_len,
+						  NULL, NULL) != 0)
+			return false;
+
+		if (record_path_len == path_len && memcmp(record_path, path, path_len) == 0)
+		{
+			return decode_record(snapshot, (size_t)(slot & SLOT_OFFSET_MASK), &record_path, &record_path_len,
+								 record, NULL) == 0;
+		}
+	}
+}
+
+/**
+ * Get the number of records
+ *
+ * @param snapshot is the snapshot (can be NULL)
+ * @return number of records
+ */
+size_t cache_snapshot_count(const struct cache_snapshot *snapshot)
+{
+	return (snapshot != NULL) ? snapshot->count : 0;
+}
+
+/**
+ * Call the callback for every record in the order of the file
+ *
+ * @param snapshot is the snapshot
+ * @param callback is the function called for every record
+ * @param ctx is the context for the callback
+ * @return 0 on success, the nonzero value of the callback if it stopped, -EIO for a broken record
+ */
+int cache_snapshot_for_each(const struct cache_snapshot *snapshot, cache_snapshot_for_each_cb callback, void *ctx)
+{
+	size_t offset = CACHE_SNAPSHOT_HEADER_SIZE;
+	while (offset < snapshot->records_end)
+	{
+		const char *path;
+		size_t path_len;
+		struct cache_snapshot_record record;
+		int res = decode_record(snapshot, offset, &path, &path_len, &record, &offset);
+		if (res != 0)
+			return res;
+
+		res = callback(ctx, path, path_len, &record);
+		if (res != 0)
+			return res;
+	}
+
+	return 0;
+}
+
+/**
+ * Unmap the snapshot
+ *
+ * @param snapshot is the snapshot (can be NULL)
+ */
+void cache_snapshot_close(struct cache_snapshot *snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	(void)munmap((void *)snapshot->data, snapshot->size);
+	free(snapshot);
+}
+
+/* ----------------------------------------------------------- *
+ * Writing
+ * ----------------------------------------------------------- */
+
+/**
+ * Start writing a snapshot to a temporary file next to the target path
+ *
+ * @param writer is the new writer (must be finished by cache_snapshot_writer_finish() or
+ *        cache_snapshot_writer_abort())
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int cache_snapshot_writer_open(struct cache_snapshot_writer **writer, const char *path, ino_t source_ino)
+{
+	*writer = NULL;
+
+	struct cache_snapshot_writer *new_writer =
+		(struct cache_snapshot_writer *)calloc(1, sizeof(struct cache_snapshot_writer));
+	if (new_writer == NULL)
+		return -ENOMEM;
+
+	size_t path_len = strlen(path);
+	new_writer->path = strdup(path);
+	new_writer->tmp_path = (char *)malloc(path_len + sizeof(".tmp"));
+	if (new_writer->path == NULL || new_writer->tmp_path == NULL)
+	{
+		cache_snapshot_writer_abort(new_writer);
+		return -ENOMEM;
+	}
+	memcpy(new_writer->tmp_path, path, path_len);
+	memcpy(new_writer->tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+	int fd = open(new_writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		int errno_stored = errno;
+		free(new_writer->tmp_path);
+		new_writer->tmp_path = NULL;
+		cache_snapshot_writer_abort(new_writer);
+		return -errno_stored;
+	}
+
+	new_writer->file = fdopen(fd, "wb");
+	if (new_writer->file == NULL)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		cache_snapshot_writer_abort(new_writer);
+		return -errno_stored;
+	}
+
+	// The header is written by cache_snapshot_writer_finish()
+	uint8_t header[CACHE_SNAPSHOT_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	if (fwrite(header, 1, sizeof(header), new_writer->file) != sizeof(header))
+	{
+		cache_snapshot_writer_abort(new_writer);
+		return -EIO;
+	}
+
+	new_writer->source_ino = source_ino;
+	new_writer->offset = CACHE_SNAPSHOT_HEADER_SIZE;
+
+	*writer = new_writer;
+	return 0;
+}
+
+/**
+ * Add a record (paths must be unique)
+ *
+ * @param writer is the writer
+ * @param path is the relative path (does not need to be null-terminated)
+ * @param path_len is the length of the path
+ * @param record is the record
+ * @return 0 on success, -ENAMETOOLONG for too long paths, other negative value on error
+ */
+int cache_snapshot_writer_add(struct cache_snapshot_writer *writer, const char *path, size_t path_len,
+							  const struct cache_snapshot_record *record)
+{
+	if (path_len > CACHE_SNAPSHOT_MAX_PATH)
+		return -ENAMETOOLONG;
+
+	if (writer->offset > SLOT_OFFSET_MASK)
+		return -EFBIG;
+
+	if (writer->count == writer->capacity)
+	{
+		size_t new_capacity = (writer->capacity == 0) ? 1024 : writer->capacity * 2;
+		struct snapshot_slot *new_slots =
+			(struct snapshot_slot *)realloc(writer->slots, new_capacity * sizeof(struct snapshot_slot));
+		if (new_slots == NULL)
+			return -ENOMEM;
+
+		writer->slots = new_slots;
+		writer->capacity = new_capacity;
+	}
+
+	uint8_t len_buf[VARINT_MAX_LENGTH];
+	size_t len_size = varint_encode(len_buf, path_len);
+
+	uint8_t buf[MAX_RECORD_SIZE];
+	size_t size = encode_record(buf, record);
+
+	if (fwrite(len_buf, 1, len_size, writer->file) != len_size ||
+		fwrite(path, 1, path_len, writer->file) != path_len ||
+		fwrite(buf, 1, size, writer->file) != size)
+	{
+		return -EIO;
+	}
+
+	writer->slots[writer->count].hash = snapshot_hash(path, path_len);
+	writer->slots[writer->count].offset = writer->offset;
+	writer->count++;
+	writer->offset += len_size + path_len + size;
+
+	return 0;
+}
+
+/**
+ * Write the hash table, sync the file and replace the old snapshot with it
+ *
+ * @param writer is the writer (freed in any case)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int cache_snapshot_writer_finish(struct cache_snapshot_writer *writer)
+{
+	// At most half of slots are used, so probe sequences stay short
+	size_t slots_count = 16;
+	while (slots_count < writer->count * 2)
+		slots_count *= 2;
+
+	uint64_t *table = (uint64_t *)calloc(slots_count, sizeof(uint64_t));
+	if (table == NULL)
+	{
+		cache_snapshot_writer_abort(writer);
+		return -ENOMEM;
+	}
+
+	size_t mask = slots_count - 1;
+	for (size_t i = 0; i < writer->count; i++)
+	{
+		size_t index = (size_t)writer->slots[i].hash & mask;
+		while (table[index] != 0)
+			index = (index + 1) & mask;
+
+		table[index] = htole64((slot_tag(writer->slots[i].hash) << SLOT_OFFSET_BITS) | writer->slots[i].offset);
+	}
+
+	uint64_t table_offset = writer->offset;
+	uint64_t file_size = table_offset + slots_count * sizeof(uint64_t);
+
+	uint8_t header[CACHE_SNAPSHOT_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_LENGTH);
+	write_le64(header + HEADER_SOURCE_INO_OFFSET, (uint64_t)writer->source_ino);
+	write_le64(header + HEADER_COUNT_OFFSET, writer->count);
+	write_le64(header + HEADER_TABLE_OFFSET, table_offset);
+	write_le64(header + HEADER_SLOTS_OFFSET, slots_count);
+	write_le64(header + HEADER_FILE_SIZE_OFFSET, file_size);
+
+	bool ok = (fwrite(table, sizeof(uint64_t), slots_count, writer->file) == slots_count &&
+			   fseek(writer->file, 0, SEEK_SET) == 0 &&
+			   fwrite(header, 1, sizeof(header), writer->file) == sizeof(header) &&
+			   fflush(writer->file) == 0 &&
+			   fsync(fileno(writer->file)) == 0);
+	int res = (ok) ? 0 : ((errno != 0) ? -errno : -EIO);
+	free(table);
+
+	if (fclose(writer->file) != 0 && res == 0)
+		res = (errno != 0) ? -errno : -EIO;
+	writer->file = NULL;
+
+	if (res == 0 && rename(writer->tmp_path, writer->path) == -1)
+		res = -errno;
+
+	if (res == 0)
+	{
+		// The temporary file is the snapshot now
+		free(writer->tmp_path);
+		writer->tmp_path = NULL;
+	}
+
+	cache_snapshot_writer_abort(writer);
+	return res;
+}
+
+/**
+ * Remove the temporary file and free the writer
+ *
+ * @param writer is the writer (can be NULL)
+ */
+void cache_snapshot_writer_abort(struct cache_snapshot_writer *writer)
+{
+	if (writer == NULL)
+		return;
+
+	if (writer->file != NULL)
+		(void)fclose(writer->file);
+
+	if (writer->tmp_path != NULL && writer->path != NULL)
+		(void)unlink(writer->tmp_path);
+
+	free(writer->tmp_path);
+	free(writer->path);
+	free(writer->slots);
+	free(writer);
+}
@@ -0,0 +1,159 @@
+#ifndef INC_CATALOGFS_CACHE_SNAPSHOT_H
+#define INC_CATALOGFS_CACHE_SNAPSHOT_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "filestat.h"
+
+/**
+ * Snapshot of the metadata cache in a file (see metadata_cache.h).
+ *
+ * The metadata cache is lost at unmount, so after a remount every filestat
+ * file is read again. A snapshot keeps cached filestats together with
+ * validators of their index files, so a new mount maps the snapshot and uses
+ * its records without reading anything but the pages of the records it needs:
+ *
+ *  - a header (magic, inode of the source directory, number of records,
+ *    position of the hash table and the size of the file);
+ *  - records: a varint length of the relative path, the path, varint-encoded
+ *    validators (inode, size, mtime and ctime of the index file) and
+ *    varint-encoded filestat fields with a binary SHA-256 hash;
+ *  - an open addressing hash table of 64-bit slots with the offset of
+ *    a record (low 40 bits) and a tag of the hash of its path (high 24 bits),
+ *    so lookups of missing paths rarely touch records.
+ *
+ * All numbers of the header and the table are little-endian.
+ * A snapshot is written to a temporary file that replaces the old one,
+ * so readers of the old snapshot are not affected. Records are validated by
+ * the caller when they are used, nothing is checked at open except the header.
+ */
+
+/** Maximum length of a relative path of a record */
+#define CACHE_SNAPSHOT_MAX_PATH (4096)
+
+// Forward declarations
+struct cache_snapshot;
+struct cache_snapshot_writer;
+
+/**
+ * Record of a snapshot: a filestat with validators of its index file
+ */
+struct cache_snapshot_record
+{
+	/** Inode of the index file */
+	ino_t ino;
+
+	/** Size of the index file */
+	off_t size;
+
+	/** Modification time of the index file */
+	struct timespec mtim;
+
+	/** Status change time of the index file */
+	struct timespec ctim;
+
+	/** Parsed filestat */
+	struct filestat my_stat;
+};
+
+/**
+ * Callback of cache_snapshot_for_each()
+ *
+ * @param ctx is the context passed to cache_snapshot_for_each()
+ * @param path is the relative path of the record (not null-terminated)
+ * @param path_len is the length of the path
+ * @param record is the record
+ * @return 0 to continue, nonzero value to stop
+ */
+typedef int (*cache_snapshot_for_each_cb)(void *ctx, const char *path, size_t path_len,
+										  const struct cache_snapshot_record *record);
+
+/**
+ * Map the snapshot file
+ *
+ * @param snapshot is the new snapshot (must be closed by cache_snapshot_close())
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory the snapshot must belong to
+ * @return 0 on success, -ENOENT if there is no snapshot, -EINVAL if it's not a snapshot
+ *         or it belongs to another source directory, other negative value (mostly -errno) on error
+ */
+int cache_snapshot_open(struct cache_snapshot **snapshot, const char *path, ino_t source_ino);
+
+/**
+ * Find the record of the path
+ *
+ * @param snapshot is the snapshot
+ * @param path is the relative path (does not need to be null-terminated)
+ * @param path_len is the length of the path
+ * @param record is the found record
+ * @return true if the record was found
+ */
+bool cache_snapshot_get(const struct cache_snapshot *snapshot, const char *path, size_t path_len,
+						struct cache_snapshot_record *record);
+
+/**
+ * Get the number of records
+ *
+ * @param snapshot is the snapshot (can be NULL)
+ * @return number of records
+ */
+size_t cache_snapshot_count(const struct cache_snapshot *snapshot);
+
+/**
+ * Call the callback for every record in the order of the file
+ *
+ * @param snapshot is the snapshot
+ * @param callback is the function called for every record
+ * @param ctx is the context for the callback
+ * @return 0 on success, the nonzero value of the callback if it stopped, -EIO for a broken record
+ */
+int cache_snapshot_for_each(const struct cache_snapshot *snapshot, cache_snapshot_for_each_cb callback, void *ctx);
+
+/**
+ * Unmap the snapshot
+ *
+ * @param snapshot is the snapshot (can be NULL)
+ */
+void cache_snapshot_close(struct cache_snapshot *snapshot);
+
+/**
+ * Start writing a snapshot to a temporary file next to the target path
+ *
+ * @param writer is the new writer (must be finished by cache_snapshot_writer_finish() or
+ *        cache_snapshot_writer_abort())
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int cache_snapshot_writer_open(struct cache_snapshot_writer **writer, const char *path, ino_t source_ino);
+
+/**
+ * Add a record (paths must be unique)
+ *
+ * @param writer is the writer
+ * @param path is the relative path (does not need to be null-terminated)
+ * @param path_len is the length of the path
+ * @param record is the record
+ * @return 0 on success, -ENAMETOOLONG for too long paths, other negative value on error
+ */
+int cache_snapshot_writer_add(struct cache_snapshot_writer *writer, const char *path, size_t path_len,
+							  const struct cache_snapshot_record *record);
+
+/**
+ * Write the hash table, sync the file and replace the old snapshot with it
+ *
+ * @param writer is the writer (freed in any case)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int cache_snapshot_writer_finish(struct cache_snapshot_writer *writer);
+
+/**
+ * Remove the temporary file and free the writer
+ *
+ * @param writer is the writer (can be NULL)
+ */
+void cache_snapshot_writer_abort(struct cache_snapshot_writer *writer);
+
+#endif // INC_CATALOGFS_CACHE_SNAPSHOT_H
@@ -0,0 +1,2000 @@
+#include "header_common.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "catalog_db.h"
+
+#include "filestat_converter.h"
+#include "pager.h"
+#include "sha256.h"
+#include "varint.h"
+
+/** Version of the layout of the catalog (stored after the header of the pager) */
+#define DB_VERSION (1)
+
+/** Offset of the version in page 0 */
+#define DB_VERSION_OFFSET (PAGER_HEADER_SIZE)
+
+/** Offset of the number of the root page in page 0 */
+#define DB_ROOT_OFFSET (PAGER_HEADER_SIZE + 4)
+
+/** Offset of the next id in page 0 */
+#define DB_NEXT_ID_OFFSET (PAGER_HEADER_SIZE + 8)
+
+/** Offset of the number of entries in page 0 */
+#define DB_ENTRIES_OFFSET (PAGER_HEADER_SIZE + 16)
+
+/** Type of leaf pages (cells are keys with values) */
+#define PAGE_TYPE_LEAF (1)
+
+/** Type of interior pages (cells are children with separator keys) */
+#define PAGE_TYPE_INTERIOR (2)
+
+/** Size of the page header: type, number of cells, start of cells, fragmented bytes, link */
+#define PAGE_HEADER_SIZE (16)
+
+/** Offset of the number of cells in a page */
+#define PAGE_COUNT_OFFSET (2)
+
+/** Offset of the start of the cell area in a page */
+#define PAGE_CELLS_START_OFFSET (4)
+
+/** Offset of the number of bytes of removed cells in the cell area */
+#define PAGE_FRAGMENTED_OFFSET (6)
+
+/** Offset of the next leaf page (leaf pages) or the rightmost child (interior pages) */
+#define PAGE_LINK_OFFSET (8)
+
+/** Space for cells and their slots in a page */
+#define PAGE_USABLE_SIZE (PAGER_PAGE_SIZE - PAGE_HEADER_SIZE)
+
+/** Maximum size of a cell with its slot (a split page always gets at least one of three cells) */
+#define MAX_CELL_SIZE (PAGE_USABLE_SIZE / 3)
+
+/** Maximum depth of the tree */
+#define MAX_DEPTH (24)
+
+/** Flag of a regular file that is not released yet */
+#define RECORD_FLAG_PENDING (1)
+
+/**
+ * Single-file catalog
+ */
+struct catalog_db
+{
+	/** File of pages */
+	struct pager *pager;
+
+	/** Number of the root page of the tree */
+	uint32_t root_page;
+
+	/** Id of the next added entry */
+	uint64_t next_id;
+
+	/** Number of entries */
+	uint64_t entries;
+
+	/** There are changes that are not committed */
+	bool has_changes;
+
+	/** Time of the oldest change that is not committed */
+	struct timespec first_change;
+
+	/** Lock of the catalog (every call of the interface holds it) */
+	pthread_mutex_t lock;
+
+	/** Condition to wake up the commit thread on close */
+	pthread_cond_t cond;
+
+	/** Thread that commits changes after a pause of requests */
+	pthread_t thread;
+
+	/** The commit thread is started */
+	bool thread_started;
+
+	/** The commit thread should stop */
+	bool stopping;
+};
+
+/**
+ * Key of an entry: id of the parent directory and the name
+ */
+struct db_key
+{
+	/** Id of the parent directory */
+	uint64_t parent;
+
+	/** Name (not null-terminated) */
+	const char *name;
+
+	/** Length of the name */
+	size_t name_len;
+};
+
+/**
+ * Path from the root page to a leaf page
+ */
+struct db_path
+{
+	/** Pages from the root (pages[depth - 1] is the leaf) */
+	uint32_t pages[MAX_DEPTH];
+
+	/** Index of the child in every interior page, index of the key in the leaf */
+	size_t indexes[MAX_DEPTH];
+
+	/** Number of pages */
+	int depth;
+};
+
+/**
+ * Resolved path of an entry
+ */
+struct db_resolved
+{
+	/** Key of the entry */
+	struct db_key key;
+
+	/** Key of the parent directory (the root has the empty name in the parent 0) */
+	struct db_key parent_key;
+};
+
+/* ----------------------------------------------------------- *
+ * Pages
+ * ----------------------------------------------------------- */
+
+/**
+ * Read 16-bit value in little-endian byte order
+ *
+ * @param buf is the source buffer
+ * @return the value
+ */
+static inline uint16_t read_le16(const uint8_t *buf)
+{
+	return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+/**
+ * Write 16-bit value in little-endian byte order
+ *
+ * @param buf is the target buffer
+ * @param value is the value
+ */
+static inline void write_le16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = (uint8_t)value;
+	buf[1] = (uint8_t)(value >> 8);
+}
+
+/**
+ * Get the number of cells of the page
+ *
+ * @param page is the page
+ * @return number of cells
+ */
+static inline size_t page_count(const uint8_t *page)
+{
+	return read_le16(page + PAGE_COUNT_OFFSET);
+}
+
+/**
+ * Get the cell of the page
+ *
+ * @param page is the page
+ * @param index is the index of the cell
+ * @return pointer to the cell
+ */
+static inline uint8_t *page_cell(uint8_t *page, size_t index)
+{
+	return page + read_le16(page + PAGE_HEADER_SIZE + index * 2);
+}
+
+/**
+ * Get the link of the page (next leaf or rightmost child)
+ *
+ * @param page is the page
+ * @return the page number
+ */
+static inline uint32_t page_link(const uint8_t *page)
+{
+	return read_le32(page + PAGE_LINK_OFFSET);
+}
+
+/**
+ * Make the page empty
+ *
+ * @param page is the page
+ * @param type is the type of the page
+ * @param link is the link of the page (next leaf or rightmost child)
+ */
+static void page_init(uint8_t *page, uint8_t type, uint32_t link)
+{
+	memset(page, 0, PAGE_HEADER_SIZE);
+	page[0] = type;
+	write_le16(page + PAGE_CELLS_START_OFFSET, 0); // 0 means PAGER_PAGE_SIZE (it does not fit into 16 bits)
+	write_le32(page + PAGE_LINK_OFFSET, link);
+}
+
+/**
+ * Get the start of the cell area
+ *
+ * @param page is the page
+ * @return offset of the first byte of cells
+ */
+static inline size_t page_cells_start(const uint8_t *page)
+{
+	size_t start = read_le16(page + PAGE_CELLS_START_OFFSET);
+	return (start == 0) ? PAGER_PAGE_SIZE : start;
+}
+
+/**
+ * Parse the key at the position
+ *
+ * @param pos is the position (moved past the key)
+ * @param end is the end of the page
+ * @param key is the parsed key
+ * @return 0 on success, -EIO for broken data
+ */
+static int parse_key(const uint8_t **pos, const uint8_t *end, struct db_key *key)
+{
+	uint64_t name_len;
+	if (varint_decode(pos, end, &key->parent) != 0 ||
+		varint_decode(pos, end, &name_len) != 0 ||
+		name_len > (uint64_t)(end - *pos))
+		return -EIO;
+
+	key->name = (const char *)*pos;
+	key->name_len = (size_t)name_len;
+	*pos += name_len;
+	return 0;
+}
+
+/**
+ * Parse the cell of the page
+ *
+ * @param page is the page
+ * @param index is the index of the cell
+ * @param key is the key of the cell
+ * @param value is the value (leaf pages) or NULL
+ * @param value_len is the length of the value (leaf pages) or NULL
+ * @param child is the child page (interior pages) or NULL
+ * @return size of the cell, 0 for broken data
+ */
+static size_t parse_cell(uint8_t *page, size_t index, struct db_key *key,
+						 const uint8_t **value, size_t *value_len, uint32_t *child)
+{
+	const uint8_t *cell = page_cell(page, index);
+	const uint8_t *end = page + PAGER_PAGE_SIZE;
+	const uint8_t *pos = cell;
+
+	if (cell < page + PAGE_HEADER_SIZE || cell >= end)
+		return 0;
+
+	if (page[0] == PAGE_TYPE_INTERIOR)
+	{
+		if (end - pos < 4)
+			return 0;
+
+		if (child != NULL)
+			*child = read_le32(pos);
+		pos += 4;
+	}
+
+	if (parse_key(&pos, end, key) != 0)
+		return 0;
+
+	if (page[0] == PAGE_TYPE_LEAF)
+	{
+		uint64_t len;
+		if (varint_decode(&pos, end, &len) != 0 || len > (uint64_t)(end - pos))
+			return 0;
+
+		if (value != NULL)
+			*value = pos;
+		if (value_len != NULL)
+			*value_len = (size_t)len;
+		pos += len;
+	}
+
+	return (size_t)(pos - cell);
+}
+
+/**
+ * Compare keys (by parent id, then by name bytes, a prefix goes first)
+ *
+ * @param a is the first key
+ * @param b is the second key
+ * @return negative, zero or positive value as for strcmp()
+ */
+static int compare_keys(const struct db_key *a, const struct db_key *b)
+{
+	if (a->parent != b->parent)
+		return (a->parent < b->parent) ? -1 : 1;
+
+	size_t len = (a->name_len < b->name_len) ? a->name_len : b->name_len;
+	int res = memcmp(a->name, b->name, len);
+	if (res != 0)
+		return res;
+
+	return (a->name_len > b->name_len) - (a->name_len < b->name_len);
+}
+
+/**
+ * Find the position of the key in the page: the first cell with a key
+ * not less than the key (leaf pages) or the child that can contain the key
+ * (interior pages, the number of cells means the rightmost child)
+ *
+ * @param page is the page
+ * @param key is the key
+ * @param found is set if a leaf cell has the same key (can be NULL)
+ * @return the index, negative value for broken data
+ */
+static ssize_t page_search(uint8_t *page, const struct db_key *key, bool *found)
+{
+	bool is_leaf = (page[0] == PAGE_TYPE_LEAF);
+	size_t low = 0;
+	size_t high = page_count(page);
+
+	if (found != NULL)
+		*found = false;
+
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+
+		struct db_key cell_key;
+		if (parse_cell(page, mid, &cell_key, NULL, NULL, NULL) == 0)
+			return -EIO;
+
+		int cmp = compare_keys(&cell_key, key);
+
+		// Leaf pages look for the first key >= key, interior pages for the first separator > key
+		if (cmp < 0 || (!is_leaf && cmp == 0))
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			if (cmp == 0 && found != NULL)
+				*found = true;
+			high = mid;
+		}
+	}
+
+	return (ssize_t)low;
+}
+
+/**
+ * Get the child page of the interior page at the index
+ *
+ * @param page is the interior page
+ * @param index is the index (the number of cells means the rightmost child)
+ * @return the page number
+ */
+static uint32_t page_child(uint8_t *page, size_t index)
+{
+	if (index >= page_count(page))
+		return page_link(page);
+
+	return read_le32(page_cell(page, index));
+}
+
+/**
+ * Set the child page of the interior page at the index
+ *
+ * @param page is the interior page
+ * @param index is the index (the number of cells means the rightmost child)
+ * @param child is the page number
+ */
+static void page_set_child(uint8_t *page, size_t index, uint32_t child)
+{
+	if (index >= page_count(page))
+		write_le32(page + PAGE_LINK_OFFSET, child);
+	else
+		write_le32(page_cell(page, index), child);
+}
+
+/**
+ * Move all cells to the end of the page, so removed cells do not take space
+ *
+ * @param page is the page
+ * @return 0 on success, negative value on error
+ */
+static int page_compact(uint8_t *page)
+{
+	uint8_t copy[PAGER_PAGE_SIZE];
+	memcpy(copy, page, PAGER_PAGE_SIZE);
+
+	size_t count = page_count(page);
+	size_t start = PAGER_PAGE_SIZE;
+	for (size_t i = 0; i < count; i++)
+	{
+		struct db_key key;
+		size_t size = parse_cell(copy, i, &key, NULL, NULL, NULL);
+		if (size == 0)
+			return -EIO;
+
+		start -= size;
+		memcpy(page + start, page_cell(copy, i), size);
+		write_le16(page + PAGE_HEADER_SIZE + i * 2, (uint16_t)start);
+	}
+
+	write_le16(page + PAGE_CELLS_START_OFFSET, (uint16_t)(start % PAGER_PAGE_SIZE));
+	write_le16(page + PAGE_FRAGMENTED_OFFSET, 0);
+	return 0;
+}
+
+/**
+ * Insert the cell into the page
+ *
+ * @param page is the page
+ * @param index is the index of the new cell
+ * @param cell is the cell
+ * @param size is the size of the cell
+ * @return 0 on success, -ENOSPC if the cell does not fit, other negative value on error
+ */
+static int page_insert(uint8_t *page, size_t index, const uint8_t *cell, size_t size)
+{
+	size_t count = page_count(page);
+	size_t slots_end = PAGE_HEADER_SIZE + (count + 1) * 2;
+	size_t start = page_cells_start(page);
+
+	if (slots_end + size > start)
+	{
+		if (slots_end + size > start + read_le16(page + PAGE_FRAGMENTED_OFFSET))
+			return -ENOSPC;
+
+		int res = page_compact(page);
+		if (res != 0)
+			return res;
+
+		start = page_cells_start(page);
+	}
+
+	start -= size;
+	memcpy(page + start, cell, size);
+
+	uint8_t *slot = page + PAGE_HEADER_SIZE + index * 2;
+	memmove(slot + 2, slot, (count - index) * 2);
+	write_le16(slot, (uint16_t)start);
+
+	write_le16(page + PAGE_CELLS_START_OFFSET, (uint16_t)start);
+	write_le16(page + PAGE_COUNT_OFFSET, (uint16_t)(count + 1));
+	return 0;
+}
+
+/**
+ * Remove the cell from the page
+ *
+ * @param page is the page
+ * @param index is the index of the cell
+ * @return 0 on success, negative value for broken data
+ */
+static int page_remove(uint8_t *page, size_t index)
+{
+	struct db_key key;
+	size_t size = parse_cell(page, index, &key, NULL, NULL, NULL);
+	if (size == 0)
+		return -EIO;
+
+	size_t count = page_count(page);
+	uint8_t *slot = page + PAGE_HEADER_SIZE + index * 2;
+	memmove(slot, slot + 2, (count - index - 1) * 2);
+	write_le16(page + PAGE_COUNT_OFFSET, (uint16_t)(count - 1));
+
+	if (count == 1)
+	{
+		write_le16(page + PAGE_CELLS_START_OFFSET, 0);
+		write_le16(page + PAGE_FRAGMENTED_OFFSET, 0);
+	}
+	else
+	{
+		write_le16(page + PAGE_FRAGMENTED_OFFSET, (uint16_t)(read_le16(page + PAGE_FRAGMENTED_OFFSET) + size));
+	}
+
+	return 0;
+}
+
+/* ----------------------------------------------------------- *
+ * Cells and records
+ * ----------------------------------------------------------- */
+
+/**
+ * Encode the key (and the child page for interior cells)
+ *
+ * @param buf is the target buffer (at least 4 + 2 * VARINT_MAX_LENGTH + name_len bytes)
+ * @param key is the key
+ * @param child is the child page (interior cells) or 0 (leaf cells)
+ * @param is_interior is the flag of interior cells
+ * @return the size of encoded data
+ */
+static size_t encode_key(uint8_t *buf, const struct db_key *key, uint32_t child, bool is_interior)
+{
+	size_t len = 0;
+	if (is_interior)
+	{
+		write_le32(buf, child);
+		len += 4;
+	}
+
+	len += varint_encode(buf + len, key->parent);
+	len += varint_encode(buf + len, key->name_len);
+	memcpy(buf + len, key->name, key->name_len);
+	return len + key->name_len;
+}
+
+/**
+ * Encode the record of the entry (the value of a leaf cell)
+ *
+ * @param buf is the target buffer (at least MAX_CELL_SIZE bytes)
+ * @param entry is the entry
+ * @return the size of the record, 0 if it does not fit
+ */
+static size_t encode_record(uint8_t *buf, const struct catalog_db_entry *entry)
+{
+	const struct filestat *s = &entry->my_stat;
+	size_t link_len = S_ISLNK(s->mode) ? strlen(entry->link_target) : 0;
+	if (link_len > CATALOG_DB_MAX_LINK_TARGET)
+		return 0;
+
+	size_t len = 0;
+	len += varint_encode(buf + len, entry->id);
+	len += varint_encode(buf + len, (entry->pending) ? RECORD_FLAG_PENDING : 0);
+	len += varint_encode(buf + len, s->mode);
+	len += varint_encode(buf + len, s->uid);
+	len += varint_encode(buf + len, s->gid);
+	len += varint_encode(buf + len, zigzag_encode(s->size));
+	len += varint_encode(buf + len, zigzag_encode(s->blocks));
+	len += varint_encode(buf + len, zigzag_encode(s->atime));
+	len += varint_encode(buf + len, zigzag_encode(s->mtime));
+	len += varint_encode(buf + len, zigzag_encode(s->ctime));
+	len += varint_encode(buf + len, zigzag_encode(s->atimensec));
+	len += varint_encode(buf + len, zigzag_encode(s->mtimensec));
+	len += varint_encode(buf + len, zigzag_encode(s->ctimensec));
+	len += varint_encode(buf + len, s->nlink);
+	len += varint_encode(buf + len, zigzag_encode(s->blksize));
+
+	// Hashes are kept binary, an invalid hash is dropped like an unknown one
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	bool has_hash = sha256_from_hex(s->sha256, hash);
+
+	buf[len++] = (has_hash) ? SHA256_DIGEST_SIZE : 0;
+	if (has_hash)
+	{
+		memcpy(buf + len, hash, SHA256_DIGEST_SIZE);
+		len += SHA256_DIGEST_SIZE;
+	}
+
+	len += varint_encode(buf + len, link_len);
+	memcpy(buf + len, entry->link_target, link_len);
+	return len + link_len;
+}
+
+/**
+ * Decode the record of the entry
+ *
+ * @param data is the record
+ * @param size is the size of the record
+ * @param entry is the decoded entry
+ * @return 0 on success, -EIO for broken data
+ */
+static int decode_record(const uint8_t *data, size_t size, struct catalog_db_entry *entry)
+{
+	const uint8_t *pos = data;
+	const uint8_t *end = data + size;
+	uint64_t v[15];
+
+	for (size_t i = 0; i < 15; i++)
+	{
+		if (varint_decode(&pos, end, &v[i]) != 0)
+			return -EIO;
+	}
+
+	struct filestat *s = &entry->my_stat;
+	entry->id = v[0];
+	entry->pending = (v[1] & RECORD_FLAG_PENDING) != 0;
+	s->mode = (uint32_t)v[2];
+	s->uid = (uint32_t)v[3];
+	s->gid = (uint32_t)v[4];
+	s->size = zigzag_decode(v[5]);
+	s->blocks = zigzag_decode(v[6]);
+	s->atime = zigzag_decode(v[7]);
+	s->mtime = zigzag_decode(v[8]);
+	s->ctime = zigzag_decode(v[9]);
+	s->atimensec = zigzag_decode(v[10]);
+	s->mtimensec = zigzag_decode(v[11]);
+	s->ctimensec = zigzag_decode(v[12]);
+	s->nlink = v[13];
+	s->blksize = zigzag_decode(v[14]);
+
+	if (pos >= end)
+		return -EIO;
+
+	size_t hash_len = *pos++;
+	if (hash_len == SHA256_DIGEST_SIZE && end - pos >= SHA256_DIGEST_SIZE)
+	{
+		sha256_to_hex(pos, s->sha256);
+		pos += SHA256_DIGEST_SIZE;
+	}
+	else if (hash_len == 0)
+	{
+		s->sha256[0] = '\0';
+	}
+	else
+	{
+		return -EIO;
+	}
+
+	uint64_t link_len;
+	if (varint_decode(&pos, end, &link_len) != 0 ||
+		link_len > CATALOG_DB_MAX_LINK_TARGET ||
+		link_len > (uint64_t)(end - pos))
+		return -EIO;
+
+	memcpy(entry->link_target, pos, (size_t)link_len);
+	entry->link_target[link_len] = '\0';
+	return 0;
+}
+
+/* ----------------------------------------------------------- *
+ * Tree
+ * ----------------------------------------------------------- */
+
+/**
+ * Find the leaf page that can contain the key
+ *
+ * @param db is the catalog
+ * @param key is the key
+ * @param path is the path to the leaf (the last index is the position of the key in the leaf)
+ * @param found is set if the leaf has the key
+ * @return 0 on success, negative value on error
+ */
+static int find_leaf(struct catalog_db *db, const struct db_key *key, struct db_path *path, bool *found)
+{
+	uint32_t page_no = db->root_page;
+	path->depth = 0;
+
+	while (true)
+	{
+		if (path->depth == MAX_DEPTH)
+			return -EIO;
+
+		uint8_t *page;
+		int res = pager_get(db->pager, page_no, &page);
+		if (res != 0)
+			return res;
+
+		if (page[0] != PAGE_TYPE_LEAF && page[0] != PAGE_TYPE_INTERIOR)
+			return -EIO;
+
+		ssize_t index = page_search(page, key, found);
+		if (index < 0)
+			return (int)index;
+
+		path->pages[path->depth] = page_no;
+		path->indexes[path->depth] = (size_t)index;
+		path->depth++;
+
+		if (page[0] == PAGE_TYPE_LEAF)
+			return 0;
+
+		page_no = page_child(page, (size_t)index);
+	}
+}
+
+/**
+ * Turn the root page into an interior page with the only child (a copy of the old root),
+ * so the root page number never changes and the old root can be split as a usual page
+ *
+ * @param db is the catalog
+ * @param path is the path from the root (it's made one level deeper)
+ * @return 0 on success, negative value on error
+ */
+static int grow_root(struct catalog_db *db, struct db_path *path)
+{
+	if (path->depth == MAX_DEPTH)
+		return -EIO;
+
+	uint8_t *root;
+	int res = pager_get_for_write(db->pager, db->root_page, &root);
+	if (res != 0)
+		return res;
+
+	uint32_t child_no;
+	uint8_t *child;
+	res = pager_allocate(db->pager, &child_no, &child);
+	if (res != 0)
+		return res;
+
+	memcpy(child, root, PAGER_PAGE_SIZE);
+	page_init(root, PAGE_TYPE_INTERIOR, child_no);
+
+	memmove(&path->pages[1], &path->pages[0], (size_t)path->depth * sizeof(path->pages[0]));
+	memmove(&path->indexes[1], &path->indexes[0], (size_t)path->depth * sizeof(path->indexes[0]));
+	path->pages[0] = db->root_page;
+	path->indexes[0] = 0;
+	path->pages[1] = child_no;
+	path->depth++;
+	return 0;
+}
+
+/**
+ * Insert the cell into the page at the level of the path, splitting full pages up to the root
+ *
+ * @param db is the catalog
+ * @param path is the path from the root
+ * @param level is the level of the page in the path
+ * @param cell is the cell
+ * @param size is the size of the cell
+ * @param index is the index of the new cell in the page
+ * @return 0 on success, negative value on error
+ */
+static int insert_cell(struct catalog_db *db, struct db_path *path, int level,
+					   const uint8_t *cell, size_t size, size_t index)
+{
+	uint8_t *page;
+	int res = pager_get_for_write(db->pager, path->pages[level], &page);
+	if (res != 0)
+		return res;
+
+	res = page_insert(page, index, cell, size);
+	if (res != -ENOSPC)
+		return res;
+
+	if (level == 0)
+	{
+		res = grow_root(db, path);
+		if (res != 0)
+			return res;
+
+		level = 1;
+		res = pager_get_for_write(db->pager, path->pages[level], &page);
+		if (res != 0)
+			return res;
+	}
+
+	// Cells of the full page with the new one in order, the page is rebuilt from the copy
+	uint8_t copy[PAGER_PAGE_SIZE];
+	memcpy(copy, page, PAGER_PAGE_SIZE);
+
+	size_t count = page_count(copy) + 1;
+	const uint8_t *cells[PAGE_USABLE_SIZE / 2 + 1];
+	size_t sizes[PAGE_USABLE_SIZE / 2 + 1];
+	size_t total = 0;
+
+	for (size_t i = 0, j = 0; i < count; i++)
+	{
+		if (i == index)
+		{
+			cells[i] = cell;
+			sizes[i] = size;
+		}
+		else
+		{
+			struct db_key key;
+			sizes[i] = parse_cell(copy, j, &key, NULL, NULL, NULL);
+			if (sizes[i] == 0)
+				return -EIO;
+			cells[i] = page_cell(copy, j);
+			j++;
+		}
+		total += sizes[i] + 2;
+	}
+
+	bool is_leaf = (copy[0] == PAGE_TYPE_LEAF);
+
+	// Split by bytes: the left page gets cells [0, split), the right one the rest
+	size_t split = 0;
+	size_t left_size = 0;
+	while (split < count - 1 && (left_size + sizes[split] + 2) * 2 <= total)
+	{
+		left_size += sizes[split] + 2;
+		split++;
+	}
+	if (split == 0)
+	{
+		left_size = sizes[0] + 2;
+		split = 1;
+	}
+
+	// Appends (entries created in the order of names) leave full pages behind, not half-empty ones
+	if (index == count - 1)
+	{
+		split = count - 1;
+		left_size = total - sizes[split] - 2;
+	}
+
+	// Interior pages move the separator at split up, so the right page must have it
+	if (!is_leaf && split == count - 1)
+	{
+		split--;
+		left_size -= sizes[split] + 2;
+	}
+
+	uint32_t right_no;
+	uint8_t *right;
+	res = pager_allocate(db->pager, &right_no, &right);
+	if (res != 0)
+		return res;
+
+	// The new page may have moved the cache around, the page itself is still cached
+	res = pager_get_for_write(db->pager, path->pages[level], &page);
+	if (res != 0)
+		return res;
+
+	uint32_t left_no = path->pages[level];
+
+	// The separator is the first key of the right page (a copy of the key with the left page as the child)
+	struct db_key separator;
+	const uint8_t *pos = cells[split] + ((is_leaf) ? 0 : 4);
+	if (parse_key(&pos, cells[split] + sizes[split], &separator) != 0)
+		return -EIO;
+
+	uint8_t separator_cell[4 + 2 * VARINT_MAX_LENGTH + CATALOG_DB_MAX_NAME];
+	size_t separator_size = encode_key(separator_cell, &separator, left_no, true);
+
+	if (is_leaf)
+	{
+		page_init(right, PAGE_TYPE_LEAF, page_link(copy));
+		page_init(page, PAGE_TYPE_LEAF, right_no);
+	}
+	else
+	{
+		// The child of the separator becomes the rightmost child of the left page
+		page_init(right, PAGE_TYPE_INTERIOR, page_link(copy));
+		page_init(page, PAGE_TYPE_INTERIOR, read_le32(cells[split]));
+	}
+
+	for (size_t i = 0; i < split && res == 0; i++)
+		res = page_insert(page, i, cells[i], sizes[i]);
+
+	size_t right_start = (is_leaf) ? split : split + 1;
+	for (size_t i = right_start; i < count && res == 0; i++)
+		res = page_insert(right, i - right_start, cells[i], sizes[i]);
+
+	if (res != 0)
+		return (res == -ENOSPC) ? -EIO : res;
+
+	// The parent pointed to the left page, it points to the right one after the separator
+	uint8_t *parent;
+	res = pager_get_for_write(db->pager, path->pages[level - 1], &parent);
+	if (res != 0)
+		return res;
+
+	size_t parent_index = path->indexes[level - 1];
+	page_set_child(parent, parent_index, right_no);
+
+	return insert_cell(db, path, level - 1, separator_cell, separator_size, parent_index);
+}
+
+/**
+ * Find the value of the key
+ *
+ * @param db is the catalog
+ * @param key is the key
+ * @param entry is the decoded entry
+ * @return 0 on success, -ENOENT if there is no such key, other negative value on error
+ */
+static int tree_get(struct catalog_db *db, const struct db_key *key, struct catalog_db_entry *entry)
+{
+	struct db_path path;
+	bool found;
+	int res = find_leaf(db, key, &path, &found);
+	if (res != 0)
+		return res;
+
+	if (!found)
+		return -ENOENT;
+
+	uint8_t *page;
+	res = pager_get(db->pager, path.pages[path.depth - 1], &page);
+	if (res != 0)
+		return res;
+
+	struct db_key cell_key;
+	const uint8_t *value;
+	size_t value_len;
+	if (parse_cell(page, path.indexes[path.depth - 1], &cell_key, &value, &value_len, NULL) == 0)
+		return -EIO;
+
+	return decode_record(value, value_len, entry);
+}
+
+/**
+ * Insert or replace the value of the key
+ *
+ * @param db is the catalog
+ * @param key is the key
+ * @param entry is the entry to encode
+ * @param replace is the flag to replace an existing value (otherwise it's -EEXIST)
+ * @return 0 on success, -EEXIST, -ENAMETOOLONG or other negative value on error
+ */
+static int tree_put(struct catalog_db *db, const struct db_key *key, const struct catalog_db_entry *entry, bool replace)
+{
+	if (key->name_len > CATALOG_DB_MAX_NAME)
+		return -ENAMETOOLONG;
+
+	uint8_t cell[PAGE_USABLE_SIZE];
+	size_t key_size = encode_key(cell, key, 0, false);
+
+	uint8_t record[PAGE_USABLE_SIZE];
+	size_t record_size = encode_record(record, entry);
+	if (record_size == 0)
+		return -ENAMETOOLONG;
+
+	size_t size = key_size + varint_encode(cell + key_size, record_size);
+	if (size + record_size + 2 > MAX_CELL_SIZE)
+		return -ENAMETOOLONG;
+
+	memcpy(cell + size, record, record_size);
+	size += record_size;
+
+	struct db_path path;
+	bool found;
+	int res = find_leaf(db, key, &path, &found);
+	if (res != 0)
+		return res;
+
+	size_t index = path.indexes[path.depth - 1];
+	if (found)
+	{
+		if (!replace)
+			return -EEXIST;
+
+		uint8_t *page;
+		res = pager_get_for_write(db->pager, path.pages[path.depth - 1], &page);
+		if (res != 0)
+			return res;
+
+		res = page_remove(page, index);
+		if (res != 0)
+			return res;
+	}
+
+	return insert_cell(db, &path, path.depth - 1, cell, size, index);
+}
+
+/**
+ * Remove the key
+ *
+ * @param db is the catalog
+ * @param key is the key
+ * @return 0 on success, -ENOENT if there is no such key, other negative value on error
+ */
+static int tree_remove(struct catalog_db *db, const struct db_key *key)
+{
+	struct db_path path;
+	bool found;
+	int res = find_leaf(db, key, &path, &found);
+	if (res != 0)
+		return res;
+
+	if (!found)
+		return -ENOENT;
+
+	uint8_t *page;
+	res = pager_get_for_write(db->pager, path.pages[path.depth - 1], &page);
+	if (res != 0)
+		return res;
+
+	return page_remove(page, path.indexes[path.depth - 1]);
+}
+
+/**
+ * Call the callback for every key of the parent directory in order
+ *
+ * @param db is the catalog
+ * @param parent is the id of the directory
+ * @param callback is the callback with the key and the raw value (nonzero result stops the scan)
+ * @param ctx is the context of the callback
+ * @return 0 on success (or if the callback stopped the scan), negative value on error
+ */
+static int tree_scan(struct catalog_db *db, uint64_t parent,
+					 int (*callback)(void *ctx, const struct db_key *key, const uint8_t *value, size_t value_len),
+					 void *ctx)
+{
+	struct db_key first = {parent, "", 0};
+	struct db_path path;
+	bool found;
+	int res = find_leaf(db, &first, &path, &found);
+	if (res != 0)
+		return res;
+
+	uint32_t page_no = path.pages[path.depth - 1];
+	size_t index = path.indexes[path.depth - 1];
+
+	while (page_no != 0)
+	{
+		uint8_t *page;
+		res = pager_get(db->pager, page_no, &page);
+		if (res != 0)
+			return res;
+
+		size_t count = page_count(page);
+		for (; index < count; index++)
+		{
+			struct db_key key;
+			const uint8_t *value;
+			size_t value_len;
+			if (parse_cell(page, index, &key, &value, &value_len, NULL) == 0)
+				return -EIO;
+
+			if (key.parent != parent)
+				return 0;
+
+			if (callback(ctx, &key, value, value_len) != 0)
+				return 0;
+		}
+
+		// Removals leave empty leaves, the keys can continue after them
+		page_no = page_link(page);
+		index = 0;
+	}
+
+	return 0;
+}
+
+/* ----------------------------------------------------------- *
+ * Catalog
+ * ----------------------------------------------------------- */
+
+/**
+ * Remember the time of the oldest change that is not committed
+ *
+ * @param db is the catalog
+ */
+static void note_change(struct catalog_db *db)
+{
+	if (db->has_changes)
+		return;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &db->first_change);
+	db->has_changes = true;
+}
+
+/**
+ * Resolve the path to the key of the entry and the key of its parent directory
+ *
+ * @param db is the catalog
+ * @param path is the path
+ * @param resolved is the resolved keys (names point into path)
+ * @return 0 on success, -ENOENT if a parent is missing, -ENOTDIR if it's not a directory,
+ *         -ENAMETOOLONG for too long names, other negative value on error
+ */
+static int resolve(struct catalog_db *db, const char *path, struct db_resolved *resolved)
+{
+	struct db_key root_parent = {0, "", 0};
+	resolved->parent_key = root_parent;
+	resolved->key = root_parent;
+
+	const char *pos = path;
+	while (*pos == '/')
+		pos++;
+
+	if (*pos == '\0' || strcmp(pos, ".") == 0)
+		return 0;
+
+	uint64_t parent = CATALOG_DB_ROOT_ID;
+	while (true)
+	{
+		const char *slash = strchr(pos, '/');
+		size_t len = (slash != NULL) ? (size_t)(slash - pos) : strlen(pos);
+		if (len > CATALOG_DB_MAX_NAME)
+			return -ENAMETOOLONG;
+
+		struct db_key key = {parent, pos, len};
+
+		// Trailing slashes are ignored
+		const char *next = (slash != NULL) ? slash : pos + len;
+		while (*next == '/')
+			next++;
+
+		if (*next == '\0')
+		{
+			resolved->key = key;
+			return 0;
+		}
+
+		struct catalog_db_entry entry;
+		int res = tree_get(db, &key, &entry);
+		if (res != 0)
+			return res;
+
+		if (!S_ISDIR(entry.my_stat.mode))
+			return -ENOTDIR;
+
+		resolved->parent_key = key;
+		parent = entry.id;
+		pos = next;
+	}
+}
+
+/**
+ * Set mtime and ctime of the directory to the current time (after a change of its entries)
+ *
+ * @param db is the catalog
+ * @param key is the key of the directory
+ * @return 0 on success, negative value on error
+ */
+static int touch_dir(struct catalog_db *db, const struct db_key *key)
+{
+	struct catalog_db_entry entry;
+	int res = tree_get(db, key, &entry);
+	if (res != 0)
+		return res;
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+	entry.my_stat.mtime = entry.my_stat.ctime = (int64_t)now.tv_sec;
+	entry.my_stat.mtimensec = entry.my_stat.ctimensec = (int64_t)now.tv_nsec;
+
+	return tree_put(db, key, &entry, true);
+}
+
+/**
+ * Find the entry by path, the lock must be held (see catalog_db_lookup())
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the found entry
+ * @return 0 on success, -ENOENT if there is no entry, -ENOTDIR if a parent is not a directory,
+ *         other negative value on error
+ */
+static int db_lookup(struct catalog_db *db, const char *path, struct catalog_db_entry *entry)
+{
+	struct db_resolved resolved;
+	int res = resolve(db, path, &resolved);
+	if (res != 0)
+		return res;
+
+	return tree_get(db, &resolved.key, entry);
+}
+
+/**
+ * Add a new entry, the lock must be held (see catalog_db_add())
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the entry (its id is assigned)
+ * @return 0 on success, -EEXIST if the entry exists, -ENOENT/-ENOTDIR for a missing parent,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+static int db_add(struct catalog_db *db, const char *path, struct catalog_db_entry *entry)
+{
+	struct db_resolved resolved;
+	int res = resolve(db, path, &resolved);
+	if (res != 0)
+		return res;
+
+	// The root directory always exists
+	if (resolved.key.parent == 0)
+		return -EEXIST;
+
+	entry->id = db->next_id;
+	res = tree_put(db, &resolved.key, entry, false);
+	if (res != 0)
+		return res;
+
+	db->next_id++;
+	db->entries++;
+	note_change(db);
+
+	return touch_dir(db, &resolved.parent_key);
+}
+
+/**
+ * Replace metadata of an existing entry, the lock must be held (see catalog_db_update())
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the new metadata
+ * @return 0 on success, -ENOENT if there is no entry, other negative value on error
+ */
+static int db_update(struct catalog_db *db, const char *path, const struct catalog_db_entry *entry)
+{
+	struct db_resolved resolved;
+	int res = resolve(db, path, &resolved);
+	if (res != 0)
+		return res;
+
+	struct catalog_db_entry current;
+	res = tree_get(db, &resolved.key, &current);
+	if (res != 0)
+		return res;
+
+	struct catalog_db_entry updated = *entry;
+	updated.id = current.id;
+	updated.my_stat.mode = (current.my_stat.mode & S_IFMT) | (entry->my_stat.mode & ~S_IFMT);
+
+	res = tree_put(db, &resolved.key, &updated, true);
+	if (res == 0)
+		note_change(db);
+
+	return res;
+}
+
+/**
+ * Add or replace an entry of a directory given by its id, the lock must be held
+ * (see catalog_db_put_at())
+ *
+ * @param db is the catalog
+ * @param parent is the id of the parent directory
+ * @param name is the name of the entry
+ * @param entry is the entry (gets its id)
+ * @return 0 on success, -EEXIST if an entry of another type exists,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+static int db_put_at(struct catalog_db *db, uint64_t parent, const char *name, struct catalog_db_entry *entry)
+{
+	struct db_key key = {parent, name, strlen(name)};
+
+	// New entries are the common case of bulk loading, so the insert is tried first
+	entry->id = db->next_id;
+	int res = tree_put(db, &key, entry, false);
+	if (res == 0)
+	{
+		db->next_id++;
+		db->entries++;
+		note_change(db);
+		return 0;
+	}
+	if (res != -EEXIST)
+		return res;
+
+	struct catalog_db_entry current;
+	res = tree_get(db, &key, &current);
+	if (res != 0)
+		return res;
+
+	if ((current.my_stat.mode & S_IFMT) != (entry->my_stat.mode & S_IFMT))
+		return -EEXIST;
+
+	entry->id = current.id;
+	res = tree_put(db, &key, entry, true);
+	if (res == 0)
+		note_change(db);
+
+	return res;
+}
+
+/**
+ * Check if the directory has entries
+ *
+ * @param ctx is a pointer to the flag to set
+ * @param key is the key of the found entry
+ * @param value is the value of the entry
+ * @param value_len is the length of the value
+ * @return 1 to stop the scan
+ */
+static int set_found(void *ctx, const struct db_key *key, const uint8_t *value, size_t value_len)
+{
+	(void)key;
+	(void)value;
+	(void)value_len;
+
+	*(bool *)ctx = true;
+	return 1;
+}
+
+/**
+ * Check if the directory has entries
+ *
+ * @param db is the catalog
+ * @param id is the id of the directory
+ * @param has_entries is set if there are entries
+ * @return 0 on success, negative value on error
+ */
+static int dir_has_entries(struct catalog_db *db, uint64_t id, bool *has_entries)
+{
+	*has_entries = false;
+	return tree_scan(db, id, set_found, has_entries);
+}
+
+/**
+ * Remove the entry by its key after checks of its type (like unlink() and rmdir())
+ *
+ * @param db is the catalog
+ * @param key is the key of the entry
+ * @param is_dir is the flag to remove a directory
+ * @return 0 on success, negative value on error
+ */
+static int remove_entry(struct catalog_db *db, const struct db_key *key, bool is_dir)
+{
+	if (key->parent == 0)
+		return -EBUSY;
+
+	struct catalog_db_entry entry;
+	int res = tree_get(db, key, &entry);
+	if (res != 0)
+		return res;
+
+	if (is_dir != S_ISDIR(entry.my_stat.mode))
+		return (is_dir) ? -ENOTDIR : -EISDIR;
+
+	if (is_dir)
+	{
+		bool has_entries;
+		res = dir_has_entries(db, entry.id, &has_entries);
+		if (res != 0)
+			return res;
+
+		if (has_entries)
+			return -ENOTEMPTY;
+	}
+
+	res = tree_remove(db, key);
+	if (res != 0)
+		return res;
+
+	db->entries--;
+	note_change(db);
+	return 0;
+}
+
+/**
+ * Remove an entry, the lock must be held (see catalog_db_remove())
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param is_dir is the flag to remove a directory (like rmdir()) and not a file (like unlink())
+ * @return 0 on success, -ENOENT if there is no entry, -EISDIR/-ENOTDIR for the wrong type,
+ *         -ENOTEMPTY for a directory with entries, -EBUSY for the root, other negative value on error
+ */
+static int db_remove(struct catalog_db *db, const char *path, bool is_dir)
+{
+	struct db_resolved resolved;
+	int res = resolve(db, path, &resolved);
+	if (res != 0)
+		return res;
+
+	res = remove_entry(db, &resolved.key, is_dir);
+	if (res != 0)
+		return res;
+
+	return touch_dir(db, &resolved.parent_key);
+}
+
+/**
+ * Check if the path is the same as the directory path or is inside it
+ *
+ * @param path is the path
+ * @param dir_path is the path of the directory
+ * @return true if the path is inside the directory
+ */
+static bool is_path_inside(const char *path, const char *dir_path)
+{
+	while (*path == '/')
+		path++;
+	while (*dir_path == '/')
+		dir_path++;
+
+	size_t len = strlen(dir_path);
+	while (len > 0 && dir_path[len - 1] == '/')
+		len--;
+
+	return strncmp(path, dir_path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * Rename an entry, the lock must be held (see catalog_db_rename())
+ *
+ * @param db is the catalog
+ * @param from is the path of the entry
+ * @param to is the new path
+ * @return 0 on success, -ENOENT if there is no entry, -EINVAL for moving a directory into itself,
+ *         -EISDIR/-ENOTDIR/-ENOTEMPTY for a target that can't be replaced, other negative value on error
+ */
+static int db_rename(struct catalog_db *db, const char *from, const char *to)
+{
+	struct db_resolved from_resolved;
+	int res = resolve(db, from, &from_resolved);
+	if (res != 0)
+		return res;
+
+	struct db_resolved to_resolved;
+	res = resolve(db, to, &to_resolved);
+	if (res != 0)
+		return res;
+
+	if (from_resolved.key.parent == 0 || to_resolved.key.parent == 0)
+		return -EBUSY;
+
+	struct catalog_db_entry entry;
+	res = tree_get(db, &from_resolved.key, &entry);
+	if (res != 0)
+		return res;
+
+	if (compare_keys(&from_resolved.key, &to_resolved.key) == 0)
+		return 0;
+
+	bool is_dir = S_ISDIR(entry.my_stat.mode);
+	if (is_dir && is_path_inside(to, from))
+		return -EINVAL;
+
+	struct catalog_db_entry target;
+	res = tree_get(db, &to_resolved.key, &target);
+	if (res == 0)
+	{
+		if (is_dir && !S_ISDIR(target.my_stat.mode))
+			return -ENOTDIR;
+
+		res = remove_entry(db, &to_resolved.key, S_ISDIR(target.my_stat.mode));
+		if (res != 0)
+			return res;
+	}
+	else if (res != -ENOENT)
+	{
+		return res;
+	}
+
+	// Entries of a directory refer to its id, so they move with it
+	res = tree_put(db, &to_resolved.key, &entry, false);
+	if (res != 0)
+		return res;
+
+	res = tree_remove(db, &from_resolved.key);
+	if (res != 0)
+		return res;
+
+	note_change(db);
+
+	res = touch_dir(db, &from_resolved.parent_key);
+	if (res == 0 && compare_keys(&from_resolved.parent_key, &to_resolved.parent_key) != 0)
+		res = touch_dir(db, &to_resolved.parent_key);
+
+	return res;
+}
+
+/**
+ * Context of listing of a directory
+ */
+struct list_ctx
+{
+	/** Callback of catalog_db_list() */
+	catalog_db_list_cb callback;
+
+	/** Context of the callback */
+	void *ctx;
+
+	/** Error of decoding */
+	int res;
+};
+
+/**
+ * Decode the entry and pass it to the callback of catalog_db_list()
+ *
+ * @param ctx is the listing context
+ * @param key is the key of the entry
+ * @param value is the value of the entry
+ * @param value_len is the length of the value
+ * @return nonzero value to stop the scan
+ */
+static int list_entry(void *ctx, const struct db_key *key, const uint8_t *value, size_t value_len)
+{
+	struct list_ctx *list = (struct list_ctx *)ctx;
+
+	struct catalog_db_entry entry;
+	list->res = decode_record(value, value_len, &entry);
+	if (list->res != 0)
+		return 1;
+
+	char name[CATALOG_DB_MAX_NAME + 1];
+	memcpy(name, key->name, key->name_len);
+	name[key->name_len] = '\0';
+
+	return list->callback(list->ctx, name, &entry);
+}
+
+/**
+ * List entries of the directory, the lock must be held (see catalog_db_list())
+ *
+ * @param db is the catalog
+ * @param path is the path of the directory
+ * @param callback is the function called for every entry (it must not change the catalog)
+ * @param ctx is the context for the callback
+ * @return 0 on success (also if the callback stopped listing), -ENOENT/-ENOTDIR if there is
+ *         no such directory, other negative value on error
+ */
+static int db_list(struct catalog_db *db, const char *path, catalog_db_list_cb callback, void *ctx)
+{
+	struct catalog_db_entry dir;
+	int res = db_lookup(db, path, &dir);
+	if (res != 0)
+		return res;
+
+	if (!S_ISDIR(dir.my_stat.mode))
+		return -ENOTDIR;
+
+	struct list_ctx list = {callback, ctx, 0};
+	res = tree_scan(db, dir.id, list_entry, &list);
+	if (res != 0)
+		return res;
+
+	return list.res;
+}
+
+/**
+ * Commit all changes now, the lock must be held (see catalog_db_commit())
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+static int db_commit(struct catalog_db *db)
+{
+	uint8_t *header;
+	int res = pager_get(db->pager, 0, &header);
+	if (res != 0)
+		return res;
+
+	if (read_le32(header + DB_VERSION_OFFSET) != DB_VERSION ||
+		read_le32(header + DB_ROOT_OFFSET) != db->root_page ||
+		read_le64(header + DB_NEXT_ID_OFFSET) != db->next_id ||
+		read_le64(header + DB_ENTRIES_OFFSET) != db->entries)
+	{
+		res = pager_get_for_write(db->pager, 0, &header);
+		if (res != 0)
+			return res;
+
+		write_le32(header + DB_VERSION_OFFSET, DB_VERSION);
+		write_le32(header + DB_ROOT_OFFSET, db->root_page);
+		write_le64(header + DB_NEXT_ID_OFFSET, db->next_id);
+		write_le64(header + DB_ENTRIES_OFFSET, db->entries);
+	}
+
+	res = pager_commit(db->pager);
+	if (res != 0)
+		return res;
+
+	db->has_changes = false;
+	return 0;
+}
+
+/**
+ * Commit changes if they are due and trim the page cache,
+ * the lock must be held (see catalog_db_commit_if_due())
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+static int db_commit_if_due(struct catalog_db *db)
+{
+	int res = 0;
+
+	if (db->has_changes)
+	{
+		struct timespec now;
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+		int64_t elapsed_ms = (int64_t)(now.tv_sec - db->first_change.tv_sec) * 1000 +
+							 (now.tv_nsec - db->first_change.tv_nsec) / 1000000;
+
+		if (elapsed_ms >= CATALOG_DB_COMMIT_INTERVAL_MS ||
+			pager_dirty_count(db->pager) >= CATALOG_DB_COMMIT_DIRTY_PAGES)
+		{
+			res = db_commit(db);
+		}
+	}
+
+	pager_shrink(db->pager);
+	return res;
+}
+
+
+/* ----------------------------------------------------------- *
+ * Interface
+ * ----------------------------------------------------------- */
+
+/**
+ * Initialize a new catalog: an empty root page and the root directory
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+static int create_tree(struct catalog_db *db)
+{
+	uint32_t root_no;
+	uint8_t *root;
+	int res = pager_allocate(db->pager, &root_no, &root);
+	if (res != 0)
+		return res;
+
+	page_init(root, PAGE_TYPE_LEAF, 0);
+	db->root_page = root_no;
+	db->next_id = CATALOG_DB_ROOT_ID + 1;
+	db->entries = 1;
+
+	struct catalog_db_entry entry;
+	memset(&entry, 0, sizeof(entry));
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+
+	entry.id = CATALOG_DB_ROOT_ID;
+	entry.my_stat.mode = S_IFDIR | 0755;
+	entry.my_stat.uid = (uint32_t)getuid();
+	entry.my_stat.gid = (uint32_t)getgid();
+	entry.my_stat.atime = entry.my_stat.mtime = entry.my_stat.ctime = (int64_t)now.tv_sec;
+	entry.my_stat.atimensec = entry.my_stat.mtimensec = entry.my_stat.ctimensec = (int64_t)now.tv_nsec;
+	entry.my_stat.nlink = 2;
+	entry.my_stat.blksize = PAGER_PAGE_SIZE;
+
+	struct db_key key = {0, "", 0};
+	res = tree_put(db, &key, &entry, false);
+	if (res != 0)
+		return res;
+
+	return db_commit(db);
+}
+
+/**
+ * Commit changes of the catalog in background once they are CATALOG_DB_COMMIT_INTERVAL_MS old,
+ * so changes followed by a pause of requests are committed too
+ *
+ * @param arg is the catalog
+ * @return NULL
+ */
+static void *commit_thread(void *arg)
+{
+	struct catalog_db *db = (struct catalog_db *)arg;
+
+	pthread_mutex_lock(&db->lock);
+	while (!db->stopping)
+	{
+		struct timespec deadline;
+		(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += CATALOG_DB_COMMIT_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (long)(CATALOG_DB_COMMIT_INTERVAL_MS % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		(void)pthread_cond_timedwait(&db->cond, &db->lock, &deadline);
+
+		// Errors are reported by the next commit of a request or of close
+		if (!db->stopping)
+			(void)db_commit_if_due(db);
+	}
+	pthread_mutex_unlock(&db->lock);
+
+	return NULL;
+}
+
+/**
+ * Open (or create) a single-file catalog
+ *
+ * @param db is the new catalog
+ * @param path is the path of the file
+ * @param cache_size is the maximum memory of the page cache (in bytes)
+ * @param sync is the flag to sync the journal on every commit
+ * @return 0 on success, -EBUSY if the file is used by another process,
+ *         -EINVAL if it's not a catalog, other negative value (mostly -errno) on error
+ */
+int catalog_db_open(struct catalog_db **db, const char *path, size_t cache_size, bool sync)
+{
+	struct catalog_db *new_db = (struct catalog_db *)calloc(1, sizeof(struct catalog_db));
+	if (new_db == NULL)
+		return -ENOMEM;
+
+	pthread_condattr_t cond_attr;
+	if (pthread_condattr_init(&cond_attr) != 0)
+	{
+		free(new_db);
+		return -ENOMEM;
+	}
+
+	// Deadlines of the commit thread are monotonic, changes of the clock do not delay commits
+	(void)pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	int res = pthread_cond_init(&new_db->cond, &cond_attr);
+	(void)pthread_condattr_destroy(&cond_attr);
+	if (res != 0)
+	{
+		free(new_db);
+		return -ENOMEM;
+	}
+
+	if (pthread_mutex_init(&new_db->lock, NULL) != 0)
+	{
+		pthread_cond_destroy(&new_db->cond);
+		free(new_db);
+		return -ENOMEM;
+	}
+
+	bool created;
+	res = pager_open(&new_db->pager, path, cache_size, sync, &created);
+	if (res == 0)
+	{
+		if (created)
+		{
+			res = create_tree(new_db);
+		}
+		else
+		{
+			uint8_t *header;
+			res = pager_get(new_db->pager, 0, &header);
+			if (res == 0)
+			{
+				new_db->root_page = read_le32(header + DB_ROOT_OFFSET);
+				new_db->next_id = read_le64(header + DB_NEXT_ID_OFFSET);
+				new_db->entries = read_le64(header + DB_ENTRIES_OFFSET);
+
+				if (read_le32(header + DB_VERSION_OFFSET) != DB_VERSION || new_db->root_page == 0)
+					res = -EINVAL;
+			}
+		}
+
+		if (res != 0)
+			pager_close(new_db->pager);
+	}
+
+	if (res != 0)
+	{
+		pthread_mutex_destroy(&new_db->lock);
+		pthread_cond_destroy(&new_db->cond);
+		free(new_db);
+		return res;
+	}
+
+	*db = new_db;
+	return 0;
+}
+
+/**
+ * Start the background thread that commits changes after a pause of requests
+ * (otherwise changes are committed only by calls of catalog_db_commit_if_due())
+ *
+ * @param db is the catalog
+ * @return 0 on success, -EAGAIN if the thread can't be created
+ */
+int catalog_db_start_commit_thread(struct catalog_db *db)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = 0;
+	if (!db->thread_started)
+	{
+		res = (pthread_create(&db->thread, NULL, commit_thread, db) == 0) ? 0 : -EAGAIN;
+		db->thread_started = (res == 0);
+	}
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Commit all changes and close the catalog
+ *
+ * @param db is the catalog (can be NULL)
+ * @return 0 on success, negative value if the last changes could not be committed
+ */
+int catalog_db_close(struct catalog_db *db)
+{
+	if (db == NULL)
+		return 0;
+
+	if (db->thread_started)
+	{
+		pthread_mutex_lock(&db->lock);
+		db->stopping = true;
+		pthread_cond_broadcast(&db->cond);
+		pthread_mutex_unlock(&db->lock);
+
+		(void)pthread_join(db->thread, NULL);
+	}
+
+	int res = db_commit(db);
+
+	pager_close(db->pager);
+	pthread_mutex_destroy(&db->lock);
+	pthread_cond_destroy(&db->cond);
+	free(db);
+	return res;
+}
+
+/**
+ * Find the entry by path
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the found entry
+ * @return 0 on success, -ENOENT if there is no entry, -ENOTDIR if a parent is not a directory,
+ *         other negative value on error
+ */
+int catalog_db_lookup(struct catalog_db *db, const char *path, struct catalog_db_entry *entry)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_lookup(db, path, entry);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Add a new entry (the parent directory must exist)
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the entry (its id is assigned)
+ * @return 0 on success, -EEXIST if the entry exists, -ENOENT/-ENOTDIR for a missing parent,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+int catalog_db_add(struct catalog_db *db, const char *path, struct catalog_db_entry *entry)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_add(db, path, entry);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Replace metadata of an existing entry (the id and the type are kept)
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the new metadata
+ * @return 0 on success, -ENOENT if there is no entry, other negative value on error
+ */
+int catalog_db_update(struct catalog_db *db, const char *path, const struct catalog_db_entry *entry)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_update(db, path, entry);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Find the entry of a directory given by its id
+ *
+ * @param db is the catalog
+ * @param parent is the id of the parent directory
+ * @param name is the name of the entry
+ * @param entry is the found entry
+ * @return 0 on success, -ENOENT if there is no entry, other negative value on error
+ */
+int catalog_db_lookup_at(struct catalog_db *db, uint64_t parent, const char *name, struct catalog_db_entry *entry)
+{
+	struct db_key key = {parent, name, strlen(name)};
+
+	pthread_mutex_lock(&db->lock);
+	int res = tree_get(db, &key, entry);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Add or replace an entry of a directory given by its id (for bulk loading:
+ * the path is not resolved and times of the directory are not changed)
+ *
+ * @param db is the catalog
+ * @param parent is the id of the parent directory (must be a directory of the catalog)
+ * @param name is the name of the entry
+ * @param entry is the entry (gets a new id, or the id of the replaced entry)
+ * @return 0 on success, -EEXIST if an entry of another type exists,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+int catalog_db_put_at(struct catalog_db *db, uint64_t parent, const char *name, struct catalog_db_entry *entry)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_put_at(db, parent, name, entry);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Remove an entry
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param is_dir is the flag to remove a directory (like rmdir()) and not a file (like unlink())
+ * @return 0 on success, -ENOENT if there is no entry, -EISDIR/-ENOTDIR for the wrong type,
+ *         -ENOTEMPTY for a directory with entries, -EBUSY for the root, other negative value on error
+ */
+int catalog_db_remove(struct catalog_db *db, const char *path, bool is_dir)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_remove(db, path, is_dir);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Rename an entry like rename() does (an existing target file or empty directory is replaced)
+ *
+ * @param db is the catalog
+ * @param from is the path of the entry
+ * @param to is the new path
+ * @return 0 on success, -ENOENT if there is no entry, -EINVAL for moving a directory into itself,
+ *         -EISDIR/-ENOTDIR/-ENOTEMPTY for a target that can't be replaced, other negative value on error
+ */
+int catalog_db_rename(struct catalog_db *db, const char *from, const char *to)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_rename(db, from, to);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * List entries of the directory in the order of names (bytes)
+ *
+ * @param db is the catalog
+ * @param path is the path of the directory
+ * @param callback is the function called for every entry (it must not change the catalog)
+ * @param ctx is the context for the callback
+ * @return 0 on success (also if the callback stopped listing), -ENOENT/-ENOTDIR if there is
+ *         no such directory, other negative value on error
+ */
+int catalog_db_list(struct catalog_db *db, const char *path, catalog_db_list_cb callback, void *ctx)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_list(db, path, callback, ctx);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Commit all changes now
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+int catalog_db_commit(struct catalog_db *db)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_commit(db);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Commit changes if the oldest of them is older than CATALOG_DB_COMMIT_INTERVAL_MS
+ * or too many pages are dirty (group commit), and trim the page cache.
+ * Should be called after every request.
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+int catalog_db_commit_if_due(struct catalog_db *db)
+{
+	pthread_mutex_lock(&db->lock);
+	int res = db_commit_if_due(db);
+	pthread_mutex_unlock(&db->lock);
+
+	return res;
+}
+
+/**
+ * Get counters of the catalog
+ *
+ * @param db is the catalog
+ * @param stats is the target counters
+ */
+void catalog_db_get_stats(struct catalog_db *db, struct catalog_db_stats *stats)
+{
+	pthread_mutex_lock(&db->lock);
+
+	struct pager_stats pager_stats;
+	pager_get_stats(db->pager, &pager_stats);
+
+	memset(stats, 0, sizeof(struct catalog_db_stats));
+	stats->entries = db->entries;
+	stats->pages = pager_stats.page_count;
+	stats->cached_pages = pager_stats.cached_pages;
+	stats->dirty_pages = pager_stats.dirty_pages;
+	stats->cache_hits = pager_stats.hits;
+	stats->cache_misses = pager_stats.misses;
+	stats->commits = pager_stats.commits;
+	stats->checkpoints = pager_stats.checkpoints;
+
+	pthread_mutex_unlock(&db->lock);
+}
@@ -0,0 +1,263 @@
+#ifndef INC_CATALOGFS_CATALOG_DB_H
+#define INC_CATALOGFS_CATALOG_DB_H
+
+#include "header_common.h"
+
+#include "filestat.h"
+
+/**
+ * Single-file catalog: a writable B+tree of entries in a file of pages
+ * (see pager.h for the page cache and the write-ahead journal).
+ *
+ * A directory tree of index files costs an inode and a file per entry,
+ * so creating millions of entries through the mount is bound by the
+ * filesystem of the catalog. A single-file catalog keeps all entries in one
+ * B+tree keyed by (id of the parent directory, name), so:
+ *
+ *  - entries of a directory are adjacent in the tree and are listed by
+ *    a scan of leaf pages;
+ *  - every entry has a unique id (shown as the inode number), a directory is
+ *    the parent of its children by id, so renaming a directory changes one
+ *    key whatever the size of its subtree;
+ *  - the root directory is the entry with the empty name in the parent 0.
+ *
+ * Values are varint-encoded metadata (struct filestat fields, a flag of files
+ * that are not released yet and targets of symlinks).
+ *
+ * Changes are made in the page cache and are committed in groups (see
+ * catalog_db_commit_if_due() and catalog_db_start_commit_thread()), so a crash
+ * loses at most the last CATALOG_DB_COMMIT_INTERVAL_MS of changes and never
+ * leaves a broken tree.
+ * Pages are not merged after removals, empty pages are reused by later
+ * inserts in the same range of keys.
+ *
+ * Paths are relative to the root of the catalog ("a/b", "/a/b" and "." or "/"
+ * for the root). Every call holds the lock of the catalog, so it can be used
+ * by the commit thread and by callers from several threads.
+ */
+
+/** Extension of single-file catalogs (only a convention) */
+#define CATALOG_DB_EXTENSION ".catalogfs"
+
+/** Id of the root directory */
+#define CATALOG_DB_ROOT_ID (1)
+
+/** Maximum length of a name of an entry */
+#define CATALOG_DB_MAX_NAME (255)
+
+/** Maximum length of a target of a symlink that fits into a page */
+#define CATALOG_DB_MAX_LINK_TARGET (640)
+
+/** Maximum time between a change and its commit (in milliseconds) */
+#define CATALOG_DB_COMMIT_INTERVAL_MS (1000)
+
+/** Number of dirty pages that triggers a commit */
+#define CATALOG_DB_COMMIT_DIRTY_PAGES (16384)
+
+// Forward declaration
+struct catalog_db;
+
+/**
+ * Entry of a single-file catalog
+ */
+struct catalog_db_entry
+{
+	/** Unique id of the entry (assigned by catalog_db_add()) */
+	uint64_t id;
+
+	/** Metadata (mode includes the type of the entry) */
+	struct filestat my_stat;
+
+	/** The regular file was created but not released yet */
+	bool pending;
+
+	/** Target of the symlink (empty for other types) */
+	char link_target[CATALOG_DB_MAX_LINK_TARGET + 1];
+};
+
+/**
+ * Counters of a single-file catalog
+ */
+struct catalog_db_stats
+{
+	/** Number of entries (including the root directory) */
+	uint64_t entries;
+
+	/** Number of pages in the file */
+	uint32_t pages;
+
+	/** Number of cached pages */
+	size_t cached_pages;
+
+	/** Number of dirty (not committed) pages */
+	size_t dirty_pages;
+
+	/** Number of page reads answered from the cache */
+	uint64_t cache_hits;
+
+	/** Number of pages read from the file */
+	uint64_t cache_misses;
+
+	/** Number of commits */
+	uint64_t commits;
+
+	/** Number of checkpoints of the journal */
+	uint64_t checkpoints;
+};
+
+/**
+ * Callback of catalog_db_list()
+ *
+ * @param ctx is the context passed to catalog_db_list()
+ * @param name is the name of the entry (null-terminated)
+ * @param entry is the entry
+ * @return 0 to continue, nonzero value to stop listing
+ */
+typedef int (*catalog_db_list_cb)(void *ctx, const char *name, const struct catalog_db_entry *entry);
+
+/**
+ * Open (or create) a single-file catalog
+ *
+ * @param db is the new catalog
+ * @param path is the path of the file
+ * @param cache_size is the maximum memory of the page cache (in bytes)
+ * @param sync is the flag to sync the journal on every commit
+ * @return 0 on success, -EBUSY if the file is used by another process,
+ *         -EINVAL if it's not a catalog, other negative value (mostly -errno) on error
+ */
+int catalog_db_open(struct catalog_db **db, const char *path, size_t cache_size, bool sync);
+
+/**
+ * Start the background thread that commits changes after a pause of requests
+ * (otherwise changes are committed only by calls of catalog_db_commit_if_due())
+ *
+ * @param db is the catalog
+ * @return 0 on success, -EAGAIN if the thread can't be created
+ */
+int catalog_db_start_commit_thread(struct catalog_db *db);
+
+/**
+ * Commit all changes and close the catalog
+ *
+ * @param db is the catalog (can be NULL)
+ * @return 0 on success, negative value if the last changes could not be committed
+ */
+int catalog_db_close(struct catalog_db *db);
+
+/**
+ * Find the entry by path
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the found entry
+ * @return 0 on success, -ENOENT if there is no entry, -ENOTDIR if a parent is not a directory,
+ *         other negative value on error
+ */
+int catalog_db_lookup(struct catalog_db *db, const char *path, struct catalog_db_entry *entry);
+
+/**
+ * Add a new entry (the parent directory must exist)
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the entry (its id is assigned)
+ * @return 0 on success, -EEXIST if the entry exists, -ENOENT/-ENOTDIR for a missing parent,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+int catalog_db_add(struct catalog_db *db, const char *path, struct catalog_db_entry *entry);
+
+/**
+ * Replace metadata of an existing entry (the id and the type are kept)
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param entry is the new metadata
+ * @return 0 on success, -ENOENT if there is no entry, other negative value on error
+ */
+int catalog_db_update(struct catalog_db *db, const char *path, const struct catalog_db_entry *entry);
+
+/**
+ * Find the entry of a directory given by its id
+ *
+ * @param db is the catalog
+ * @param parent is the id of the parent directory
+ * @param name is the name of the entry
+ * @param entry is the found entry
+ * @return 0 on success, -ENOENT if there is no entry, other negative value on error
+ */
+int catalog_db_lookup_at(struct catalog_db *db, uint64_t parent, const char *name, struct catalog_db_entry *entry);
+
+/**
+ * Add or replace an entry of a directory given by its id (for bulk loading:
+ * the path is not resolved and times of the directory are not changed)
+ *
+ * @param db is the catalog
+ * @param parent is the id of the parent directory (must be a directory of the catalog)
+ * @param name is the name of the entry
+ * @param entry is the entry (gets a new id, or the id of the replaced entry)
+ * @return 0 on success, -EEXIST if an entry of another type exists,
+ *         -ENAMETOOLONG for too long names and symlink targets, other negative value on error
+ */
+int catalog_db_put_at(struct catalog_db *db, uint64_t parent, const char *name, struct catalog_db_entry *entry);
+
+/**
+ * Remove an entry
+ *
+ * @param db is the catalog
+ * @param path is the path of the entry
+ * @param is_dir is the flag to remove a directory (like rmdir()) and not a file (like unlink())
+ * @return 0 on success, -ENOENT if there is no entry, -EISDIR/-ENOTDIR for the wrong type,
+ *         -ENOTEMPTY for a directory with entries, -EBUSY for the root, other negative value on error
+ */
+int catalog_db_remove(struct catalog_db *db, const char *path, bool is_dir);
+
+/**
+ * Rename an entry like rename() does (an existing target file or empty directory is replaced)
+ *
+ * @param db is the catalog
+ * @param from is the path of the entry
+ * @param to is the new path
+ * @return 0 on success, -ENOENT if there is no entry, -EINVAL for moving a directory into itself,
+ *         -EISDIR/-ENOTDIR/-ENOTEMPTY for a target that can't be replaced, other negative value on error
+ */
+int catalog_db_rename(struct catalog_db *db, const char *from, const char *to);
+
+/**
+ * List entries of the directory in the order of names (bytes)
+ *
+ * @param db is the catalog
+ * @param path is the path of the directory
+ * @param callback is the function called for every entry (it must not change the catalog)
+ * @param ctx is the context for the callback
+ * @return 0 on success (also if the callback stopped listing), -ENOENT/-ENOTDIR if there is
+ *         no such directory, other negative value on error
+ */
+int catalog_db_list(struct catalog_db *db, const char *path, catalog_db_list_cb callback, void *ctx);
+
+/**
+ * Commit all changes now
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+int catalog_db_commit(struct catalog_db *db);
+
+/**
+ * Commit changes if the oldest of them is older than CATALOG_DB_COMMIT_INTERVAL_MS
+ * or too many pages are dirty (group commit), and trim the page cache.
+ * Should be called after every request.
+ *
+ * @param db is the catalog
+ * @return 0 on success, negative value on error
+ */
+int catalog_db_commit_if_due(struct catalog_db *db);
+
+/**
+ * Get counters of the catalog
+ *
+ * @param db is the catalog
+ * @param stats is the target counters
+ */
+void catalog_db_get_stats(struct catalog_db *db, struct catalog_db_stats *stats);
+
+#endif // INC_CATALOGFS_CATALOG_DB_H
@@ -0,0 +1,567 @@
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "compact_dir.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "filestat_parser.h"
+#include "manifest.h"
+#include "storage.h"
+
+/** Initial capacity of entries array */
+#define CATALOG_DIR_INITIAL_CAPACITY (64)
+
+/**
+ * Compare two entries by name for qsort()
+ *
+ * @param a is the first entry
+ * @param b is the second entry
+ * @return result of strcmp() for names
+ */
+static int catalog_dir_entry_compare(const void *a, const void *b)
+{
+	const struct catalog_dir_entry *entry_a = (const struct catalog_dir_entry *)a;
+	const struct catalog_dir_entry *entry_b = (const struct catalog_dir_entry *)b;
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+/**
+ * Read the target of a symlink into a new allocated string
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the symlink in the directory
+ * @param size_hint is the expected length of the target (st_size of symlink)
+ * @return new allocated string, NULL on error
+ */
+static char *read_link_target(int dir_fd, const char *name, off_t size_hint)
+{
+	size_t buf_size = (size_hint > 0) ? (size_t)size_hint + 1 : 256;
+
+	while (true)
+	{
+		char *buf = (char *)malloc(buf_size);
+		if (buf == NULL)
+			return NULL;
+
+		ssize_t res = readlinkat(dir_fd, name, buf, buf_size);
+		if (res == -1)
+		{
+			free(buf);
+			return NULL;
+		}
+
+		if ((size_t)res < buf_size)
+		{
+			buf[res] = '\0';
+			return buf;
+		}
+
+		// Target was changed or truncated, try again with a bigger buffer
+		free(buf);
+		buf_size *= 2;
+	}
+}
+
+/**
+ * Compare two entries by inode number for qsort()
+ *
+ * @param a is the first entry
+ * @param b is the second entry
+ * @return negative, zero or positive value like strcmp()
+ */
+static int catalog_dir_entry_compare_ino(const void *a, const void *b)
+{
+	const struct catalog_dir_entry *entry_a = (const struct catalog_dir_entry *)a;
+	const struct catalog_dir_entry *entry_b = (const struct catalog_dir_entry *)b;
+	if (entry_a->stbuf.st_ino < entry_b->stbuf.st_ino)
+		return -1;
+	if (entry_a->stbuf.st_ino > entry_b->stbuf.st_ino)
+		return 1;
+	return 0;
+}
+
+/**
+ * Fill the entry metadata for the name inside the directory
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param entry is the entry with the name already set
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @return 0 on success, 1 if entry should be skipped, negative value on error
+ */
+static int catalog_dir_fill_entry(int dir_fd, struct catalog_dir_entry *entry, bool read_filestats,
+								  const struct catalog_dir_lookup *lookup)
+{
+	int res = fstatat(dir_fd, entry->name, &entry->stbuf, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+		return -errno;
+
+	if (!S_ISREG(entry->stbuf.st_mode) &&
+		!S_ISDIR(entry->stbuf.st_mode) &&
+		!S_ISLNK(entry->stbuf.st_mode))
+	{
+		return 1;
+	}
+
+	res = fill_filestat_from_stat(&entry->my_stat, &entry->stbuf);
+	if (res != 0)
+		return -EPERM;
+
+	if (read_filestats && S_ISREG(entry->stbuf.st_mode) &&
+		lookup != NULL && lookup->get(lookup->ctx, entry->name, &entry->stbuf, &entry->my_stat))
+	{
+		entry->has_filestat = true;
+		entry->from_lookup = true;
+	}
+	else if (read_filestats && S_ISREG(entry->stbuf.st_mode))
+	{
+		// Same logic as in getattr(): empty files without a record are not released yet
+		res = storage_read_filestat(dir_fd, entry->name, &entry->stbuf, &entry->my_stat);
+		if (res == -ENODATA && entry->stbuf.st_size == 0)
+			return 0;
+		if (res != 0)
+			return res;
+
+		entry->has_filestat = true;
+	}
+	else if (S_ISLNK(entry->stbuf.st_mode))
+	{
+		entry->link_target = read_link_target(dir_fd, entry->name, entry->stbuf.st_size);
+		if (entry->link_target == NULL)
+			return (errno != 0) ? -errno : -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Read names of all entries of the directory (without "." and "..").
+ * Inode numbers from dirent are kept in stbuf.st_ino of entries.
+ *
+ * @param dir_fd is the directory file descriptor (not closed)
+ * @param dir is the target listing
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+static int catalog_dir_read_names(int dir_fd, struct catalog_dir *dir)
+{
+	int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -errno;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	size_t capacity = 0;
+	int res = 0;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (dir->count == capacity)
+		{
+			size_t new_capacity = (capacity == 0) ? CATALOG_DIR_INITIAL_CAPACITY : capacity * 2;
+			struct catalog_dir_entry *new_entries = (struct catalog_dir_entry *)realloc(
+				dir->entries, new_capacity * sizeof(struct catalog_dir_entry));
+			if (new_entries == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			dir->entries = new_entries;
+			capacity = new_capacity;
+		}
+
+		struct catalog_dir_entry *entry = &dir->entries[dir->count];
+		memset(entry, 0, sizeof(struct catalog_dir_entry));
+
+		entry->name = strdup(de->d_name);
+		if (entry->name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+		entry->stbuf.st_ino = de->d_ino;
+
+		dir->count++;
+	}
+
+	/// NOTE: No close(fd) because closedir(dp) will do it
+	(void)closedir(dp);
+
+	return res;
+}
+
+/**
+ * Fill metadata of all entries with a batched loader.
+ * Results of entries are the same as of catalog_dir_fill_entry().
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param dir is the listing with names set
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the loader (must be async)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param results is the array of results for entries
+ * @return 0 on success, nonzero value if entries should be filled one by one
+ */
+static int catalog_dir_fill_entries_batch(int dir_fd, struct catalog_dir *dir, bool read_filestats,
+										  struct batch_loader *loader, const struct catalog_dir_lookup *lookup,
+										  int *results)
+{
+	int res = batch_loader_fill_entries(loader, dir_fd, dir->entries, dir->count, read_filestats, lookup, results);
+	if (res != 0)
+	{
+		for (size_t i = 0; i < dir->count; i++)
+		{
+			dir->entries[i].has_filestat = false;
+			dir->entries[i].from_lookup = false;
+		}
+		return res;
+	}
+
+	// Symlinks are rare in catalogs, their targets are read synchronously
+	for (size_t i = 0; i < dir->count; i++)
+	{
+		struct catalog_dir_entry *entry = &dir->entries[i];
+		if (results[i] != 0 || !S_ISLNK(entry->stbuf.st_mode))
+			continue;
+
+		entry->link_target = read_link_target(dir_fd, entry->name, entry->stbuf.st_size);
+		if (entry->link_target == NULL)
+			results[i] = (errno != 0) ? -errno : -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Drop entries of manifest files from the listing of names (they are never listed)
+ *
+ * @param dir is the listing with names set
+ */
+static void catalog_dir_drop_reserved(struct catalog_dir *dir)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < dir->count; i++)
+	{
+		if (manifest_is_reserved_name(dir->entries[i].name))
+		{
+			free(dir->entries[i].name);
+			continue;
+		}
+
+		dir->entries[kept++] = dir->entries[i];
+	}
+	dir->count = kept;
+}
+
+/**
+ * Add regular files of the manifest of the directory to the sorted listing
+ * (real entries hide manifest entries with the same names)
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir is the sorted listing
+ * @param errors_count is incremented if the manifest is broken (can be NULL)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int catalog_dir_merge_manifest(int dir_fd, struct catalog_dir *dir, size_t *errors_count)
+{
+	struct manifest manifest;
+	int res = manifest_open(dir_fd, &manifest);
+	if (res != 0)
+	{
+		if (res != -ENOENT && errors_count != NULL)
+			(*errors_count)++;
+		return 0;
+	}
+
+	size_t manifest_count = compact_dir_count(manifest.dir);
+	struct catalog_dir_entry *entries = (struct catalog_dir_entry *)calloc(dir->count + manifest_count + 1,
+																			 sizeof(struct catalog_dir_entry));
+	if (entries == NULL)
+	{
+		manifest_free(&manifest);
+		return -ENOMEM;
+	}
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest.dir);
+
+	// Both lists are sorted by name
+	size_t count = 0;
+	size_t i = 0;
+	struct compact_dir_entry manifest_entry;
+	while ((res = compact_dir_cursor_next(&cursor, &manifest_entry)) == 0)
+	{
+		while (i < dir->count && strcmp(dir->entries[i].name, manifest_entry.name) < 0)
+		{
+			entries[count++] = dir->entries[i++];
+		}
+
+		if (i < dir->count && strcmp(dir->entries[i].name, manifest_entry.name) == 0)
+			continue;
+
+		if (!S_ISREG(manifest_entry.my_stat.mode))
+			continue;
+
+		struct catalog_dir_entry *entry = &entries[count];
+		entry->name = strndup(manifest_entry.name, manifest_entry.name_len);
+		if (entry->name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+
+		manifest_fill_stat(&manifest, entry->name, &entry->stbuf);
+		entry->my_stat = manifest_entry.my_stat;
+		entry->has_filestat = true;
+		entry->from_manifest = true;
+		count++;
+	}
+
+	while (i < dir->count)
+	{
+		entries[count++] = dir->entries[i++];
+	}
+
+	compact_dir_cursor_free(&cursor);
+	manifest_free(&manifest);
+
+	if (res < 0 && errors_count != NULL)
+		(*errors_count)++;
+
+	free(dir->entries);
+	dir->entries = entries;
+	dir->count = count;
+
+	return (res == -ENOMEM) ? res : 0;
+}
+
+/**
+ * Fill metadata of all entries of the listing with names set, drop entries
+ * that failed to be filled and sort the rest by name
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param dir is the listing with names set
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ */
+static void catalog_dir_fill_all(int dir_fd, bool read_filestats, struct batch_loader *loader,
+								 const struct catalog_dir_lookup *lookup, struct catalog_dir *dir, size_t *errors_count)
+{
+	if (dir->count > 1)
+	{
+		qsort(dir->entries, dir->count, sizeof(struct catalog_dir_entry), catalog_dir_entry_compare_ino);
+	}
+
+	int *results = NULL;
+	if (batch_loader_is_async(loader) && dir->count > 0)
+	{
+		results = (int *)malloc(dir->count * sizeof(int));
+		if (results != NULL &&
+			catalog_dir_fill_entries_batch(dir_fd, dir, read_filestats, loader, lookup, results) != 0)
+		{
+			free(results);
+			results = NULL;
+		}
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < dir->count; i++)
+	{
+		struct catalog_dir_entry *entry = &dir->entries[i];
+
+		int fill_res = (results != NULL) ? results[i] : catalog_dir_fill_entry(dir_fd, entry, read_filestats, lookup);
+		if (fill_res != 0)
+		{
+			if (fill_res < 0 && errors_count != NULL)
+			{
+				(*errors_count)++;
+			}
+
+			free(entry->link_target);
+			free(entry->name);
+			continue;
+		}
+
+		if (kept != i)
+		{
+			dir->entries[kept] = *entry;
+		}
+		kept++;
+	}
+	dir->count = kept;
+	free(results);
+
+	if (dir->count > 1)
+	{
+		qsort(dir->entries, dir->count, sizeof(struct catalog_dir_entry), catalog_dir_entry_compare);
+	}
+}
+
+/**
+ * Load a sorted listing of a catalog directory with metadata of all entries.
+ *
+ * Entries of unsupported types (not regular files, directories or symlinks)
+ * and entries that failed to be read are skipped and reported via errors_count.
+ *
+ * Entries are stat'ed in the order of inode numbers, that is usually close to
+ * the physical order of inodes on disk (it keeps reads sequential on HDDs).
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ *        (true for catalogs, false for live source directories)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load(int dir_fd, bool read_filestats, struct catalog_dir *dir, size_t *errors_count)
+{
+	return catalog_dir_load_batch(dir_fd, read_filestats, NULL, dir, errors_count);
+}
+
+/**
+ * Same as catalog_dir_load() but metadata of entries is loaded with
+ * the batched loader (io_uring) if it's available.
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_batch(int dir_fd, bool read_filestats, struct batch_loader *loader,
+						   struct catalog_dir *dir, size_t *errors_count)
+{
+	return catalog_dir_load_lookup(dir_fd, read_filestats, loader, NULL, dir, errors_count);
+}
+
+/**
+ * Same as catalog_dir_load_batch() but filestats found by the lookup are used
+ * instead of reading filestat files (entries get from_lookup set).
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_lookup(int dir_fd, bool read_filestats, struct batch_loader *loader,
+							const struct catalog_dir_lookup *lookup, struct catalog_dir *dir, size_t *errors_count)
+{
+	memset(dir, 0, sizeof(struct catalog_dir));
+
+	int res = catalog_dir_read_names(dir_fd, dir);
+	if (res != 0)
+	{
+		catalog_dir_free(dir);
+		return res;
+	}
+
+	if (read_filestats)
+	{
+		catalog_dir_drop_reserved(dir);
+	}
+
+	catalog_dir_fill_all(dir_fd, read_filestats, loader, lookup, dir, errors_count);
+
+	if (read_filestats)
+	{
+		res = catalog_dir_merge_manifest(dir_fd, dir, errors_count);
+		if (res != 0)
+		{
+			catalog_dir_free(dir);
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Free a listing loaded by catalog_dir_load()
+ *
+ * @param dir is the listing to free
+ */
+void catalog_dir_free(struct catalog_dir *dir)
+{
+	if (dir == NULL)
+		return;
+
+	for (size_t i = 0; i < dir->count; i++)
+	{
+		free(dir->entries[i].name);
+		free(dir->entries[i].link_target);
+	}
+
+	free(dir->entries);
+	dir->entries = NULL;
+	dir->count = 0;
+}
+
+/**
+ * Load metadata of the given entries of a catalog directory (names must not
+ * be reserved names of manifests, manifest entries are not looked up).
+ * Entries that failed to be read or have unsupported types are skipped
+ * like by catalog_dir_load().
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param names is the array of names
+ * @param inos is the array of inode numbers of names from readdir() (can be NULL)
+ * @param count is the number of names
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_names(int dir_fd, bool read_filestats, struct batch_loader *loader,
+						   const struct catalog_dir_lookup *lookup, const char *const *names, const ino_t *inos,
+						   size_t count, struct catalog_dir *dir, size_t *errors_count)
+{
+	memset(dir, 0, sizeof(struct catalog_dir));
+	if (count == 0)
+		return 0;
+
+	dir->entries = (struct catalog_dir_entry *)calloc(count, sizeof(struct catalog_dir_entry));
+	if (dir->entries == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		struct catalog_dir_entry *entry = &dir->entries[i];
+		entry->name = strdup(names[i]);
+		if (entry->name == NULL)
+		{
+			catalog_dir_free(dir);
+			return -ENOMEM;
+		}
+		entry->stbuf.st_ino = (inos != NULL) ? inos[i] : 0;
+		dir->count++;
+	}
+
+	catalog_dir_fill_all(dir_fd, read_filestats, loader, lookup, dir, errors_count);
+	return 0;
+}
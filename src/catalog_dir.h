@@ -0,0 +1,169 @@
+#ifndef INC_CATALOGFS_CATALOG_DIR_H
+#define INC_CATALOGFS_CATALOG_DIR_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "filestat.h"
+
+// Forward declaration
+struct batch_loader;
+
+/**
+ * One entry of a catalog directory listing
+ */
+struct catalog_dir_entry
+{
+	/** Name of the entry inside the directory */
+	char *name;
+
+	/** Real stat of the entry inside the catalog (index) */
+	struct stat stbuf;
+
+	/**
+	 * Metadata of the original file.
+	 * For regular files it's read from the filestat file,
+	 * for other types it's filled from the real stat of the entry.
+	 */
+	struct filestat my_stat;
+
+	/** True if my_stat was read from a filestat file or from the manifest */
+	bool has_filestat;
+
+	/**
+	 * True if the entry was read from the manifest of the directory (see manifest.h),
+	 * then stbuf is made by manifest_fill_stat()
+	 */
+	bool from_manifest;
+
+	/** True if my_stat was given by the lookup (see struct catalog_dir_lookup) without reading the filestat file */
+	bool from_lookup;
+
+	/** Target of symlink (NULL for other types) */
+	char *link_target;
+};
+
+/**
+ * Source of filestats that were read before (e.g. the metadata cache),
+ * so filestat files of unchanged index files are not read again
+ */
+struct catalog_dir_lookup
+{
+	/**
+	 * Get the filestat of the entry
+	 *
+	 * @param ctx is the context of the lookup
+	 * @param name is the name of the entry inside the directory
+	 * @param stbuf is the real stat of the index file (used for validation)
+	 * @param my_stat is the target filestat
+	 * @return true if the filestat was found and is still valid
+	 */
+	bool (*get)(void *ctx, const char *name, const struct stat *stbuf, struct filestat *my_stat);
+
+	/** Context of the lookup */
+	void *ctx;
+};
+
+/**
+ * Listing of a catalog (or a live source) directory sorted by name (strcmp order)
+ */
+struct catalog_dir
+{
+	/** Array of entries */
+	struct catalog_dir_entry *entries;
+
+	/** Number of entries */
+	size_t count;
+};
+
+/**
+ * Load a sorted listing of a catalog directory with metadata of all entries.
+ *
+ * Entries of unsupported types (not regular files, directories or symlinks)
+ * and entries that failed to be read are skipped and reported via errors_count.
+ *
+ * Entries are stat'ed in the order of inode numbers, that is usually close to
+ * the physical order of inodes on disk (it keeps reads sequential on HDDs).
+ *
+ * Regular files of the manifest of a catalog directory are listed too,
+ * unless a real entry with the same name hides them.
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ *        (true for catalogs, false for live source directories)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load(int dir_fd, bool read_filestats, struct catalog_dir *dir, size_t *errors_count);
+
+/**
+ * Same as catalog_dir_load() but metadata of entries is loaded with
+ * the batched loader (io_uring) if it's available.
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_batch(int dir_fd, bool read_filestats, struct batch_loader *loader,
+						   struct catalog_dir *dir, size_t *errors_count);
+
+/**
+ * Same as catalog_dir_load_batch() but filestats found by the lookup are used
+ * instead of reading filestat files (entries get from_lookup set).
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_lookup(int dir_fd, bool read_filestats, struct batch_loader *loader,
+							const struct catalog_dir_lookup *lookup, struct catalog_dir *dir, size_t *errors_count);
+
+/**
+ * Load metadata of the given entries of a catalog directory (names must not
+ * be reserved names of manifests, manifest entries are not looked up).
+ * Entries that failed to be read or have unsupported types are skipped
+ * like by catalog_dir_load().
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param names is the array of names
+ * @param inos is the array of inode numbers of names from readdir() (can be NULL)
+ * @param count is the number of names
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int catalog_dir_load_names(int dir_fd, bool read_filestats, struct batch_loader *loader,
+						   const struct catalog_dir_lookup *lookup, const char *const *names, const ino_t *inos,
+						   size_t count, struct catalog_dir *dir, size_t *errors_count);
+
+/**
+ * Free a listing loaded by catalog_dir_load()
+ *
+ * @param dir is the listing to free
+ */
+void catalog_dir_free(struct catalog_dir *dir);
+
+/**
+ * Check if the listing entry is a directory
+ *
+ * @param entry is the entry to check
+ * @return true if the entry is a directory, false otherwise
+ */
+static inline bool catalog_dir_entry_is_dir(const struct catalog_dir_entry *entry)
+{
+	return S_ISDIR(entry->stbuf.st_mode);
+}
+
+#endif // INC_CATALOGFS_CATALOG_DIR_H
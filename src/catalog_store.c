@@ -0,0 +1,1143 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h> /* flock(2) */
+#include <sys/stat.h>
+
+#include "catalog_store.h"
+
+#include "compact_dir.h"
+#include "sha256.h"
+#include "varint.h"
+
+/** Name of the pack of nodes */
+#define STORE_PACK_FILE_NAME "objects.pack"
+
+/** Name of the index of nodes */
+#define STORE_INDEX_FILE_NAME "objects.idx"
+
+/** Name of the directory of snapshots */
+#define STORE_SNAPSHOTS_DIR_NAME "snapshots"
+
+/** Name of the temporary file of a new snapshot (names starting with dots are not snapshots) */
+#define STORE_SNAPSHOT_TMP_NAME ".snapshot.tmp"
+
+/** Header of the index (also the version of the layout) */
+#define STORE_INDEX_MAGIC "CATALOGFS-STORE1"
+
+/** Size of the header of the index */
+#define STORE_INDEX_HEADER_SIZE (16)
+
+/** Size of a record of the index: hash, offset, size and reserved 4 bytes */
+#define STORE_INDEX_RECORD_SIZE (CATALOG_STORE_HASH_SIZE + 16)
+
+/** Magic of nodes ("CFSN") */
+#define STORE_NODE_MAGIC ((uint32_t)0x4E534643)
+
+/** Size of the header of a node: magic, number of children and size of the compact directory */
+#define STORE_NODE_HEADER_SIZE (16)
+
+/** Size of a child record of a node: index of the entry and the hash of its node */
+#define STORE_NODE_CHILD_SIZE (4 + CATALOG_STORE_HASH_SIZE)
+
+/** Maximum size of a node (offsets of compact directories are 32-bit) */
+#define STORE_MAX_NODE_SIZE ((uint64_t)UINT32_MAX)
+
+/** Length of the content of a snapshot file: hex hash and newline */
+#define STORE_SNAPSHOT_FILE_SIZE (CATALOG_STORE_HASH_SIZE * 2 + 1)
+
+/** Initial number of buckets of the table of nodes */
+#define STORE_MIN_BUCKETS (1024)
+
+_Static_assert(sizeof(STORE_INDEX_MAGIC) - 1 == STORE_INDEX_HEADER_SIZE, "magic must fill the header of the index");
+
+/**
+ * Location of a node in the pack
+ */
+struct store_record
+{
+	/** Hash of the node */
+	struct catalog_store_hash hash;
+
+	/** Offset in the pack */
+	uint64_t offset;
+
+	/** Size of the node */
+	uint32_t size;
+};
+
+/**
+ * Decoded node
+ */
+struct catalog_store_node
+{
+	/** Hash of the node */
+	struct catalog_store_hash hash;
+
+	/** Content of the node (the compact directory points into it) */
+	uint8_t *data;
+
+	/** Entries of the directory */
+	struct compact_dir *dir;
+
+	/** Child records (index of the entry and hash), sorted by index */
+	const uint8_t *children;
+
+	/** Number of child records */
+	size_t child_count;
+
+	/** References: the cache and every caller of catalog_store_get_node() */
+	size_t refs;
+};
+
+/**
+ * Versioned store
+ */
+struct catalog_store
+{
+	/** Store directory */
+	int dir_fd;
+
+	/** Pack of nodes */
+	int pack_fd;
+
+	/** Index of nodes (locked by writers) */
+	int index_fd;
+
+	/** Directory of snapshots */
+	int snapshots_fd;
+
+	/** Nodes and snapshots can be added */
+	bool writable;
+
+	/** Lock of the table of nodes, the cache and counters (readers may be multithreaded) */
+	pthread_mutex_t lock;
+
+	/** Records of known nodes (committed first, then added by this process) */
+	struct store_record *records;
+
+	/** Number of records */
+	size_t count;
+
+	/** Allocated records */
+	size_t capacity;
+
+	/** Records already in the index file */
+	size_t committed;
+
+	/** Open-addressing table of records (index + 1, 0 for empty buckets) */
+	uint32_t *buckets;
+
+	/** Number of buckets (power of 2) */
+	size_t bucket_count;
+
+	/** Size of the index file that was read */
+	uint64_t index_size;
+
+	/** End of known nodes in the pack (new nodes are written there) */
+	uint64_t pack_size;
+
+	/** Direct-mapped cache of decoded nodes */
+	struct catalog_store_node *cache[CATALOG_STORE_NODE_CACHE_SIZE];
+
+	/** Counters */
+	struct catalog_store_stats stats;
+};
+
+/**
+ * Read the whole buffer at the offset (retrying partial reads)
+ *
+ * @param fd is the file descriptor
+ * @param buf is the target buffer
+ * @param size is the size to read
+ * @param offset is the offset in the file
+ * @return 0 on success, -EIO on end of file, other negative value (-errno) on error
+ */
+static int read_full(int fd, void *buf, size_t size, off_t offset)
+{
+	uint8_t *pos = (uint8_t *)buf;
+	while (size > 0)
+	{
+		ssize_t res = pread(fd, pos, size, offset);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (res == 0)
+			return -EIO;
+
+		pos += res;
+		size -= (size_t)res;
+		offset += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the whole buffer at the offset (retrying partial writes)
+ *
+ * @param fd is the file descriptor
+ * @param buf is the source buffer
+ * @param size is the size to write
+ * @param offset is the offset in the file
+ * @return 0 on success, negative value (-errno) on error
+ */
+static int write_full(int fd, const void *buf, size_t size, off_t offset)
+{
+	const uint8_t *pos = (const uint8_t *)buf;
+	while (size > 0)
+	{
+		ssize_t res = pwrite(fd, pos, size, offset);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		pos += res;
+		size -= (size_t)res;
+		offset += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the first bucket of a hash (hashes are SHA-256, any bits are uniform)
+ *
+ * @param hash is the hash
+ * @param bucket_count is the number of buckets (power of 2)
+ * @return the bucket
+ */
+static inline size_t hash_bucket(const struct catalog_store_hash *hash, size_t bucket_count)
+{
+	return (size_t)read_le64(hash->bytes) & (bucket_count - 1);
+}
+
+/**
+ * Find a record by hash, the lock must be held
+ *
+ * @param store is the store
+ * @param hash is the hash
+ * @return the record or NULL if the node is unknown
+ */
+static const struct store_record *find_record(const struct catalog_store *store, const struct catalog_store_hash *hash)
+{
+	if (store->bucket_count == 0)
+		return NULL;
+
+	size_t mask = store->bucket_count - 1;
+	for (size_t i = hash_bucket(hash, store->bucket_count);; i = (i + 1) & mask)
+	{
+		uint32_t slot = store->buckets[i];
+		if (slot == 0)
+			return NULL;
+
+		const struct store_record *record = &store->records[slot - 1];
+		if (memcmp(record->hash.bytes, hash->bytes, CATALOG_STORE_HASH_SIZE) == 0)
+			return record;
+	}
+}
+
+/**
+ * Put the record into the table of buckets
+ *
+ * @param buckets is the table
+ * @param bucket_count is the number of buckets
+ * @param records is the array of records
+ * @param index is the index of the record
+ */
+static void insert_bucket(uint32_t *buckets, size_t bucket_count, const struct store_record *records, size_t index)
+{
+	size_t mask = bucket_count - 1;
+	size_t i = hash_bucket(&records[index].hash, bucket_count);
+	while (buckets[i] != 0)
+		i = (i + 1) & mask;
+	buckets[i] = (uint32_t)(index + 1);
+}
+
+/**
+ * Add a record of a node (known nodes are ignored), the lock must be held
+ *
+ * @param store is the store
+ * @param record is the record
+ * @return 0 on success, -ENOMEM on error
+ */
+static int add_record(struct catalog_store *store, const struct store_record *record)
+{
+	if (find_record(store, &record->hash) != NULL)
+		return 0;
+
+	if (store->count >= UINT32_MAX - 1)
+		return -ENOMEM;
+
+	if (store->count == store->capacity)
+	{
+		size_t capacity = (store->capacity > 0) ? store->capacity * 2 : STORE_MIN_BUCKETS / 2;
+		struct store_record *records = realloc(store->records, capacity * sizeof(struct store_record));
+		if (records == NULL)
+			return -ENOMEM;
+		store->records = records;
+		store->capacity = capacity;
+	}
+
+	// The table is kept at most half full
+	if ((store->count + 1) * 2 > store->bucket_count)
+	{
+		size_t bucket_count = (store->bucket_count > 0) ? store->bucket_count * 2 : STORE_MIN_BUCKETS;
+		uint32_t *buckets = calloc(bucket_count, sizeof(uint32_t));
+		if (buckets == NULL)
+			return -ENOMEM;
+		for (size_t i = 0; i < store->count; i++)
+			insert_bucket(buckets, bucket_count, store->records, i);
+		free(store->buckets);
+		store->buckets = buckets;
+		store->bucket_count = bucket_count;
+	}
+
+	store->records[store->count] = *record;
+	insert_bucket(store->buckets, store->bucket_count, store->records, store->count);
+	store->count++;
+	return 0;
+}
+
+/**
+ * Read records appended to the index file since the last read, the lock must be held.
+ * Records of nodes that are not in the pack yet and a partial record at the end are
+ * left for the next read.
+ *
+ * @param store is the store
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int read_index(struct catalog_store *store)
+{
+	struct stat index_stat;
+	struct stat pack_stat;
+	if (fstat(store->index_fd, &index_stat) == -1 || fstat(store->pack_fd, &pack_stat) == -1)
+		return -errno;
+
+	uint64_t file_size = (uint64_t)index_stat.st_size;
+	if (file_size <= store->index_size)
+		return 0;
+
+	size_t available = (size_t)((file_size - store->index_size) / STORE_INDEX_RECORD_SIZE);
+	if (available == 0)
+		return 0;
+
+	uint8_t *buf = malloc(available * STORE_INDEX_RECORD_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	int res = read_full(store->index_fd, buf, available * STORE_INDEX_RECORD_SIZE, (off_t)store->index_size);
+	for (size_t i = 0; res == 0 && i < available; i++)
+	{
+		const uint8_t *pos = buf + i * STORE_INDEX_RECORD_SIZE;
+		struct store_record record;
+		memcpy(record.hash.bytes, pos, CATALOG_STORE_HASH_SIZE);
+		record.offset = read_le64(pos + CATALOG_STORE_HASH_SIZE);
+		record.size = read_le32(pos + CATALOG_STORE_HASH_SIZE + 8);
+
+		// The writer syncs the pack before the index, a record past the end is from a broken pack
+		if (record.offset > (uint64_t)pack_stat.st_size || record.size > (uint64_t)pack_stat.st_size - record.offset)
+			break;
+
+		res = add_record(store, &record);
+		if (res == 0)
+		{
+			store->index_size += STORE_INDEX_RECORD_SIZE;
+			if (record.offset + record.size > store->pack_size)
+				store->pack_size = record.offset + record.size;
+		}
+	}
+
+	store->committed = store->count;
+	free(buf);
+	return res;
+}
+
+/**
+ * Open the files of the store (and create them for writers)
+ *
+ * @param store is the store with dir_fd opened
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int open_files(struct catalog_store *store)
+{
+	int flags = (store->writable) ? (O_RDWR | O_CREAT) : O_RDONLY;
+
+	if (store->writable && mkdirat(store->dir_fd, STORE_SNAPSHOTS_DIR_NAME, 0755) == -1 && errno != EEXIST)
+		return -errno;
+
+	store->snapshots_fd = openat(store->dir_fd, STORE_SNAPSHOTS_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (store->snapshots_fd == -1)
+		return (errno == ENOENT) ? -EINVAL : -errno;
+
+	store->index_fd = openat(store->dir_fd, STORE_INDEX_FILE_NAME, flags | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (store->index_fd == -1)
+		return (errno == ENOENT) ? -EINVAL : -errno;
+
+	// The lock is released by the kernel when the process dies
+	if (store->writable && flock(store->index_fd, LOCK_EX | LOCK_NB) == -1)
+		return (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+
+	store->pack_fd = openat(store->dir_fd, STORE_PACK_FILE_NAME, flags | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (store->pack_fd == -1)
+		return (errno == ENOENT) ? -EINVAL : -errno;
+
+	struct stat stbuf;
+	if (fstat(store->index_fd, &stbuf) == -1)
+		return -errno;
+
+	if (stbuf.st_size == 0 && store->writable)
+	{
+		int res = write_full(store->index_fd, STORE_INDEX_MAGIC, STORE_INDEX_HEADER_SIZE, 0);
+		if (res == 0 && fdatasync(store->index_fd) == -1)
+			res = -errno;
+		if (res != 0)
+			return res;
+	}
+	else
+	{
+		char magic[STORE_INDEX_HEADER_SIZE];
+		int res = read_full(store->index_fd, magic, STORE_INDEX_HEADER_SIZE, 0);
+		if (res != 0)
+			return (res == -EIO) ? -EINVAL : res;
+		if (memcmp(magic, STORE_INDEX_MAGIC, STORE_INDEX_HEADER_SIZE) != 0)
+			return -EINVAL;
+	}
+
+	store->index_size = STORE_INDEX_HEADER_SIZE;
+	int res = read_index(store);
+	if (res != 0 || !store->writable)
+		return res;
+
+	// Writers append right after known data: drop a partial record and nodes that never got into the index
+	if (ftruncate(store->index_fd, (off_t)store->index_size) == -1 ||
+		ftruncate(store->pack_fd, (off_t)store->pack_size) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Open (or create) a store
+ *
+ * @param store is the new store
+ * @param path is the path of the store directory
+ * @param writable determines if nodes and snapshots can be added (the directory is created if missing)
+ * @return 0 on success, -EBUSY if another process adds to the store,
+ *         -EINVAL if it's not a store, other negative value (mostly -errno) on error
+ */
+int catalog_store_open(struct catalog_store **store, const char *path, bool writable)
+{
+	struct catalog_store *new_store = calloc(1, sizeof(struct catalog_store));
+	if (new_store == NULL)
+		return -ENOMEM;
+
+	new_store->dir_fd = -1;
+	new_store->pack_fd = -1;
+	new_store->index_fd = -1;
+	new_store->snapshots_fd = -1;
+	new_store->writable = writable;
+
+	if (pthread_mutex_init(&new_store->lock, NULL) != 0)
+	{
+		free(new_store);
+		return -ENOMEM;
+	}
+
+	int res = 0;
+	if (writable && mkdir(path, 0755) == -1 && errno != EEXIST)
+		res = -errno;
+
+	if (res == 0)
+	{
+		new_store->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (new_store->dir_fd == -1)
+			res = -errno;
+	}
+
+	if (res == 0)
+		res = open_files(new_store);
+
+	if (res != 0)
+	{
+		// Nothing was added, closing does not commit
+		new_store->writable = false;
+		(void)catalog_store_close(new_store);
+		return res;
+	}
+
+	*store = new_store;
+	return 0;
+}
+
+/**
+ * Drop a reference to a node, the lock must be held
+ *
+ * @param node is the node (can be NULL)
+ */
+static void unref_node(struct catalog_store_node *node)
+{
+	if (node == NULL || --node->refs > 0)
+		return;
+
+	compact_dir_free(node->dir);
+	free(node->data);
+	free(node);
+}
+
+/**
+ * Commit added nodes and close the store
+ *
+ * @param store is the store (can be NULL)
+ * @return 0 on success, negative value on error of the commit
+ */
+int catalog_store_close(struct catalog_store *store)
+{
+	if (store == NULL)
+		return 0;
+
+	int res = (store->writable) ? catalog_store_commit(store) : 0;
+
+	for (size_t i = 0; i < CATALOG_STORE_NODE_CACHE_SIZE; i++)
+		unref_node(store->cache[i]);
+
+	if (store->snapshots_fd != -1)
+		(void)close(store->snapshots_fd);
+	if (store->pack_fd != -1)
+		(void)close(store->pack_fd);
+	if (store->index_fd != -1)
+		(void)close(store->index_fd);
+	if (store->dir_fd != -1)
+		(void)close(store->dir_fd);
+
+	pthread_mutex_destroy(&store->lock);
+	free(store->buckets);
+	free(store->records);
+	free(store);
+	return res;
+}
+
+/**
+ * Add a node of a directory (nothing is written if the same node is already stored)
+ *
+ * @param store is the writable store
+ * @param inputs is the array of entries sorted by name (strcmp order, no duplicates)
+ * @param count is the number of entries
+ * @param hash is the hash of the node
+ * @return 0 on success, -EINVAL for unsorted input, other negative value on error
+ */
+int catalog_store_put_node(struct catalog_store *store, const struct catalog_store_input *inputs, size_t count,
+						   struct catalog_store_hash *hash)
+{
+	if (!store->writable)
+		return -EBADF;
+
+	struct compact_dir_input *dir_inputs = malloc(((count > 0) ? count : 1) * sizeof(struct compact_dir_input));
+	if (dir_inputs == NULL)
+		return -ENOMEM;
+
+	size_t child_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		dir_inputs[i].name = inputs[i].name;
+		dir_inputs[i].my_stat = inputs[i].my_stat;
+		dir_inputs[i].link_target = inputs[i].link_target;
+		if (S_ISDIR(inputs[i].my_stat.mode))
+			child_count++;
+	}
+
+	struct compact_dir *dir = NULL;
+	int res = compact_dir_build(dir_inputs, count, &dir);
+	free(dir_inputs);
+	if (res != 0)
+		return res;
+
+	size_t dir_size;
+	const void *dir_data = compact_dir_data(dir, &dir_size);
+	uint64_t node_size = STORE_NODE_HEADER_SIZE + (uint64_t)dir_size + (uint64_t)child_count * STORE_NODE_CHILD_SIZE;
+	if (node_size > STORE_MAX_NODE_SIZE)
+	{
+		compact_dir_free(dir);
+		return -EFBIG;
+	}
+
+	uint8_t *node = malloc((size_t)node_size);
+	if (node == NULL)
+	{
+		compact_dir_free(dir);
+		return -ENOMEM;
+	}
+
+	write_le32(node, STORE_NODE_MAGIC);
+	write_le32(node + 4, (uint32_t)child_count);
+	write_le64(node + 8, dir_size);
+	memcpy(node + STORE_NODE_HEADER_SIZE, dir_data, dir_size);
+	compact_dir_free(dir);
+
+	uint8_t *child = node + STORE_NODE_HEADER_SIZE + dir_size;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!S_ISDIR(inputs[i].my_stat.mode))
+			continue;
+		write_le32(child, (uint32_t)i);
+		memcpy(child + 4, inputs[i].child.bytes, CATALOG_STORE_HASH_SIZE);
+		child += STORE_NODE_CHILD_SIZE;
+	}
+
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, node, (size_t)node_size);
+	sha256_final(&ctx, hash->bytes);
+
+	pthread_mutex_lock(&store->lock);
+	if (find_record(store, hash) != NULL)
+	{
+		store->stats.nodes_reused++;
+	}
+	else
+	{
+		struct store_record record = {*hash, store->pack_size, (uint32_t)node_size};
+		res = write_full(store->pack_fd, node, (size_t)node_size, (off_t)store->pack_size);
+		if (res == 0)
+			res = add_record(store, &record);
+		if (res == 0)
+		{
+			store->pack_size += node_size;
+			store->stats.nodes_added++;
+			store->stats.bytes_added += node_size;
+		}
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	free(node);
+	return res;
+}
+
+/**
+ * Sync added nodes and add them to the index
+ *
+ * @param store is the writable store
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int catalog_store_commit(struct catalog_store *store)
+{
+	if (!store->writable)
+		return -EBADF;
+
+	pthread_mutex_lock(&store->lock);
+	size_t pending = store->count - store->committed;
+	if (pending == 0)
+	{
+		pthread_mutex_unlock(&store->lock);
+		return 0;
+	}
+
+	int res = 0;
+	uint8_t *buf = malloc(pending * STORE_INDEX_RECORD_SIZE);
+	if (buf == NULL)
+		res = -ENOMEM;
+
+	// Readers trust the index, nodes must be on disk before their records
+	if (res == 0 && fdatasync(store->pack_fd) == -1)
+		res = -errno;
+
+	if (res == 0)
+	{
+		for (size_t i = 0; i < pending; i++)
+		{
+			const struct store_record *record = &store->records[store->committed + i];
+			uint8_t *pos = buf + i * STORE_INDEX_RECORD_SIZE;
+			memcpy(pos, record->hash.bytes, CATALOG_STORE_HASH_SIZE);
+			write_le64(pos + CATALOG_STORE_HASH_SIZE, record->offset);
+			write_le32(pos + CATALOG_STORE_HASH_SIZE + 8, record->size);
+			write_le32(pos + CATALOG_STORE_HASH_SIZE + 12, 0);
+		}
+
+		res = write_full(store->index_fd, buf, pending * STORE_INDEX_RECORD_SIZE, (off_t)store->index_size);
+	}
+
+	if (res == 0 && fdatasync(store->index_fd) == -1)
+		res = -errno;
+
+	if (res == 0)
+	{
+		store->index_size += pending * STORE_INDEX_RECORD_SIZE;
+		store->committed = store->count;
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	free(buf);
+	return res;
+}
+
+/**
+ * Check if a name can be a name of a snapshot
+ *
+ * @param name is the name
+ * @return true if the name is not empty, has no slashes, does not start with a dot and fits NAME_MAX with '@'
+ */
+bool catalog_store_is_snapshot_name(const char *name)
+{
+	size_t len = strlen(name);
+	return (len > 0 && len < NAME_MAX && name[0] != '.' && strchr(name, '/') == NULL);
+}
+
+/**
+ * Format a hash as hex
+ *
+ * @param hash is the hash
+ * @param hex is the target buffer of 2 * CATALOG_STORE_HASH_SIZE + 1 chars
+ */
+void catalog_store_hash_to_hex(const struct catalog_store_hash *hash, char *hex)
+{
+	sha256_to_hex(hash->bytes, hex);
+}
+
+/**
+ * Commit added nodes and save a snapshot (an existing one is replaced)
+ *
+ * @param store is the writable store
+ * @param name is the name of the snapshot
+ * @param root is the node of the root directory of the snapshot
+ * @return 0 on success, -EINVAL for bad names, other negative value on error
+ */
+int catalog_store_set_snapshot(struct catalog_store *store, const char *name, const struct catalog_store_hash *root)
+{
+	if (!catalog_store_is_snapshot_name(name))
+		return -EINVAL;
+
+	// The root and all nodes under it must be in the index before the snapshot refers to them
+	int res = catalog_store_commit(store);
+	if (res != 0)
+		return res;
+
+	char content[STORE_SNAPSHOT_FILE_SIZE + 1];
+	catalog_store_hash_to_hex(root, content);
+	content[STORE_SNAPSHOT_FILE_SIZE - 1] = '\n';
+
+	int fd = openat(store->snapshots_fd, STORE_SNAPSHOT_TMP_NAME,
+					O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	res = write_full(fd, content, STORE_SNAPSHOT_FILE_SIZE, 0);
+	if (res == 0 && fdatasync(fd) == -1)
+		res = -errno;
+
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+
+	if (res == 0 && renameat(store->snapshots_fd, STORE_SNAPSHOT_TMP_NAME, store->snapshots_fd, name) == -1)
+		res = -errno;
+
+	if (res != 0)
+	{
+		(void)unlinkat(store->snapshots_fd, STORE_SNAPSHOT_TMP_NAME, 0);
+		return res;
+	}
+
+	// The rename itself must survive a crash
+	if (fsync(store->snapshots_fd) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Find a snapshot
+ *
+ * @param store is the store
+ * @param name is the name of the snapshot
+ * @param root is the node of the root directory of the snapshot
+ * @param mtime is the time the snapshot was saved (can be NULL)
+ * @return 0 on success, -ENOENT if there is no such snapshot, other negative value on error
+ */
+int catalog_store_get_snapshot(struct catalog_store *store, const char *name, struct catalog_store_hash *root,
+							   int64_t *mtime)
+{
+	if (!catalog_store_is_snapshot_name(name))
+		return -ENOENT;
+
+	int fd = openat(store->snapshots_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return (errno == ELOOP) ? -ENOENT : -errno;
+
+	char content[STORE_SNAPSHOT_FILE_SIZE + 1];
+	struct stat stbuf;
+	int res = 0;
+	if (fstat(fd, &stbuf) == -1)
+		res = -errno;
+	else if (!S_ISREG(stbuf.st_mode))
+		res = -ENOENT;
+	else
+		res = read_full(fd, content, STORE_SNAPSHOT_FILE_SIZE, 0);
+	(void)close(fd);
+
+	if (res != 0)
+		return (res == -EIO) ? -EINVAL : res;
+
+	content[STORE_SNAPSHOT_FILE_SIZE - 1] = '\0';
+	if (!sha256_from_hex(content, root->bytes))
+		return -EINVAL;
+
+	if (mtime != NULL)
+		*mtime = (int64_t)stbuf.st_mtime;
+	return 0;
+}
+
+/**
+ * Compare names for qsort()
+ *
+ * @param a is the pointer to the first name
+ * @param b is the pointer to the second name
+ * @return result of strcmp()
+ */
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Get names of all snapshots
+ *
+ * @param store is the store
+ * @param names is the sorted array of names (must be freed by catalog_store_free_names())
+ * @param count is the number of names
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int catalog_store_list_snapshots(struct catalog_store *store, char ***names, size_t *count)
+{
+	*names = NULL;
+	*count = 0;
+
+	// fdopendir() takes the descriptor, the store keeps its own
+	int fd = openat(store->snapshots_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL)
+	{
+		int res = -errno;
+		(void)close(fd);
+		return res;
+	}
+
+	char **result = NULL;
+	size_t result_count = 0;
+	size_t capacity = 0;
+	int res = 0;
+	struct dirent *de;
+	while (res == 0 && (errno = 0, de = readdir(dp)) != NULL)
+	{
+		if (!catalog_store_is_snapshot_name(de->d_name) || (de->d_type != DT_REG && de->d_type != DT_UNKNOWN))
+			continue;
+
+		if (result_count == capacity)
+		{
+			size_t new_capacity = (capacity > 0) ? capacity * 2 : 16;
+			char **new_result = realloc(result, new_capacity * sizeof(char *));
+			if (new_result == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			result = new_result;
+			capacity = new_capacity;
+		}
+
+		result[result_count] = strdup(de->d_name);
+		if (result[result_count] == NULL)
+			res = -ENOMEM;
+		else
+			result_count++;
+	}
+
+	if (res == 0 && errno != 0)
+		res = -errno;
+	(void)closedir(dp);
+
+	if (res != 0)
+	{
+		catalog_store_free_names(result, result_count);
+		return res;
+	}
+
+	if (result_count > 1)
+		qsort(result, result_count, sizeof(char *), compare_names);
+
+	*names = result;
+	*count = result_count;
+	return 0;
+}
+
+/**
+ * Free names of snapshots
+ *
+ * @param names is the array of names (can be NULL)
+ * @param count is the number of names
+ */
+void catalog_store_free_names(char **names, size_t count)
+{
+	if (names == NULL)
+		return;
+
+	for (size_t i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+/**
+ * Read and validate a node, the lock must be held
+ *
+ * @param store is the store
+ * @param record is the record of the node
+ * @param node is the new node with one reference
+ * @return 0 on success, -EINVAL for a broken node, other negative value on error
+ */
+static int load_node(struct catalog_store *store, const struct store_record *record, struct catalog_store_node **node)
+{
+	if (record->size < STORE_NODE_HEADER_SIZE)
+		return -EINVAL;
+
+	struct catalog_store_node *new_node = calloc(1, sizeof(struct catalog_store_node));
+	if (new_node == NULL)
+		return -ENOMEM;
+
+	new_node->hash = record->hash;
+	new_node->refs = 1;
+	new_node->data = malloc(record->size);
+	int res = (new_node->data != NULL) ? 0 : -ENOMEM;
+	if (res == 0)
+		res = read_full(store->pack_fd, new_node->data, record->size, (off_t)record->offset);
+
+	if (res == 0)
+	{
+		struct catalog_store_hash hash;
+		struct sha256_ctx ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, new_node->data, record->size);
+		sha256_final(&ctx, hash.bytes);
+		if (memcmp(hash.bytes, record->hash.bytes, CATALOG_STORE_HASH_SIZE) != 0)
+			res = -EINVAL;
+	}
+
+	uint64_t dir_size = 0;
+	if (res == 0)
+	{
+		new_node->child_count = read_le32(new_node->data + 4);
+		dir_size = read_le64(new_node->data + 8);
+		if (read_le32(new_node->data) != STORE_NODE_MAGIC || dir_size > record->size ||
+			STORE_NODE_HEADER_SIZE + dir_size + (uint64_t)new_node->child_count * STORE_NODE_CHILD_SIZE != record->size)
+			res = -EINVAL;
+	}
+
+	if (res == 0)
+		res = compact_dir_from_buffer(new_node->data + STORE_NODE_HEADER_SIZE, (size_t)dir_size, false, &new_node->dir);
+
+	if (res == 0)
+	{
+		new_node->children = new_node->data + STORE_NODE_HEADER_SIZE + dir_size;
+		size_t entry_count = compact_dir_count(new_node->dir);
+		for (size_t i = 0; res == 0 && i < new_node->child_count; i++)
+		{
+			uint32_t index = read_le32(new_node->children + i * STORE_NODE_CHILD_SIZE);
+			if (index >= entry_count ||
+				(i > 0 && index <= read_le32(new_node->children + (i - 1) * STORE_NODE_CHILD_SIZE)))
+				res = -EINVAL;
+		}
+	}
+
+	if (res != 0)
+	{
+		unref_node(new_node);
+		return (res == -EIO) ? -EINVAL : res;
+	}
+
+	*node = new_node;
+	return 0;
+}
+
+/**
+ * Get a node (decoded nodes are cached)
+ *
+ * @param store is the store
+ * @param hash is the hash of the node
+ * @param node is the node (must be released by catalog_store_release_node())
+ * @return 0 on success, -ENOENT if there is no such node, -EINVAL for a broken node, other negative value on error
+ */
+int catalog_store_get_node(struct catalog_store *store, const struct catalog_store_hash *hash,
+						   struct catalog_store_node **node)
+{
+	size_t slot = hash_bucket(hash, CATALOG_STORE_NODE_CACHE_SIZE);
+
+	pthread_mutex_lock(&store->lock);
+	struct catalog_store_node *cached = store->cache[slot];
+	if (cached != NULL && memcmp(cached->hash.bytes, hash->bytes, CATALOG_STORE_HASH_SIZE) == 0)
+	{
+		cached->refs++;
+		store->stats.cache_hits++;
+		pthread_mutex_unlock(&store->lock);
+		*node = cached;
+		return 0;
+	}
+
+	// Another process may have added snapshots after the index was read
+	int res = 0;
+	const struct store_record *record = find_record(store, hash);
+	if (record == NULL && !store->writable)
+	{
+		res = read_index(store);
+		if (res == 0)
+			record = find_record(store, hash);
+	}
+
+	if (res == 0 && record == NULL)
+		res = -ENOENT;
+
+	struct catalog_store_node *new_node = NULL;
+	if (res == 0)
+		res = load_node(store, record, &new_node);
+
+	if (res == 0)
+	{
+		store->stats.cache_misses++;
+		unref_node(store->cache[slot]);
+		store->cache[slot] = new_node;
+		new_node->refs++;
+		*node = new_node;
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	return res;
+}
+
+/**
+ * Release a node
+ *
+ * @param store is the store
+ * @param node is the node (can be NULL)
+ */
+void catalog_store_release_node(struct catalog_store *store, struct catalog_store_node *node)
+{
+	if (node == NULL)
+		return;
+
+	pthread_mutex_lock(&store->lock);
+	unref_node(node);
+	pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Get the number of entries of a node
+ *
+ * @param node is the node
+ * @return number of entries
+ */
+size_t catalog_store_node_count(const struct catalog_store_node *node)
+{
+	return compact_dir_count(node->dir);
+}
+
+/**
+ * Initialize a cursor at the first entry of a node
+ *
+ * @param node is the node
+ * @param cursor is the cursor (must be freed by compact_dir_cursor_free())
+ */
+void catalog_store_node_cursor_init(const struct catalog_store_node *node, struct compact_dir_cursor *cursor)
+{
+	compact_dir_cursor_init(cursor, node->dir);
+}
+
+/**
+ * Fill the child of a decoded entry (binary search by the index of the entry)
+ *
+ * @param node is the node
+ * @param entry is the entry with the decoded compact directory entry
+ */
+static void fill_child(const struct catalog_store_node *node, struct catalog_store_entry *entry)
+{
+	size_t low = 0;
+	size_t high = node->child_count;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		const uint8_t *child = node->children + mid * STORE_NODE_CHILD_SIZE;
+		uint32_t index = read_le32(child);
+		if (index == entry->entry.index)
+		{
+			entry->has_child = true;
+			memcpy(entry->child.bytes, child + 4, CATALOG_STORE_HASH_SIZE);
+			return;
+		}
+
+		if (index < entry->entry.index)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	entry->has_child = false;
+	memset(entry->child.bytes, 0, CATALOG_STORE_HASH_SIZE);
+}
+
+/**
+ * Decode the next entry of a node and move the cursor
+ *
+ * @param node is the node
+ * @param cursor is the cursor
+ * @param entry is the decoded entry
+ * @return 0 on success, 1 at the end of the node, negative value for broken data
+ */
+int catalog_store_node_next(const struct catalog_store_node *node, struct compact_dir_cursor *cursor,
+							struct catalog_store_entry *entry)
+{
+	int res = compact_dir_cursor_next(cursor, &entry->entry);
+	if (res == 0)
+		fill_child(node, entry);
+	return res;
+}
+
+/**
+ * Find an entry of a node by name
+ *
+ * @param node is the node
+ * @param name is the name
+ * @param cursor is an initialized cursor to use for decoding (entry data points to it)
+ * @param entry is the found entry
+ * @return 0 if found, -ENOENT if not found, other negative value for broken data
+ */
+int catalog_store_node_find(const struct catalog_store_node *node, const char *name,
+							struct compact_dir_cursor *cursor, struct catalog_store_entry *entry)
+{
+	int res = compact_dir_find(node->dir, name, cursor, &entry->entry);
+	if (res == 0)
+		fill_child(node, entry);
+	return res;
+}
+
+/**
+ * Get counters of the store
+ *
+ * @param store is the store
+ * @param stats is the target counters
+ */
+void catalog_store_get_stats(struct catalog_store *store, struct catalog_store_stats *stats)
+{
+	pthread_mutex_lock(&store->lock);
+	*stats = store->stats;
+	stats->nodes = store->count;
+	stats->pack_size = store->pack_size;
+	pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,276 @@
+#ifndef INC_CATALOGFS_CATALOG_STORE_H
+#define INC_CATALOGFS_CATALOG_STORE_H
+
+#include "header_common.h"
+
+#include "compact_dir.h"
+#include "filestat.h"
+#include "sha256.h"
+
+/**
+ * Versioned store of snapshots of catalogs with shared unchanged records.
+ *
+ * Weekly catalogs of the same disk are mostly the same metadata. The store
+ * keeps every directory of a snapshot as a node: a compact directory (see
+ * compact_dir.h) with metadata of its entries plus the hashes of nodes of
+ * its subdirectories. A node is addressed by the SHA-256 of its content, so
+ * a directory whose whole subtree did not change has the same hash in every
+ * snapshot and is stored once; a new snapshot adds only the nodes of changed
+ * directories and of their parents up to the root.
+ *
+ * The store is a directory:
+ *
+ *  - objects.pack: contents of nodes, one after another (append-only);
+ *  - objects.idx: a header and a record (hash, offset, size) per node,
+ *    appended after the new nodes are synced, so nodes are never lost and a
+ *    crash leaves at most unreferenced bytes at the end of the pack;
+ *  - snapshots/<name>: the hash of the root node of the snapshot in hex,
+ *    written (atomically, by rename) after all its nodes are in the index.
+ *
+ * One process adds snapshots at a time (the index is locked), readers (e.g. a
+ * mounted store) may run at the same time and see new nodes and snapshots
+ * when they look them up. Nodes read back are validated, so a broken store
+ * gives errors, not crashes.
+ */
+
+/** Size of hashes of nodes */
+#define CATALOG_STORE_HASH_SIZE (SHA256_DIGEST_SIZE)
+
+/** Number of decoded nodes kept in memory by readers */
+#define CATALOG_STORE_NODE_CACHE_SIZE (1024)
+
+/**
+ * Hash of a node
+ */
+struct catalog_store_hash
+{
+	/** SHA-256 of the content of the node */
+	uint8_t bytes[CATALOG_STORE_HASH_SIZE];
+};
+
+/**
+ * Input entry for catalog_store_put_node()
+ */
+struct catalog_store_input
+{
+	/** Name of the entry */
+	const char *name;
+
+	/** Metadata of the entry (mode includes the type of the entry) */
+	struct filestat my_stat;
+
+	/** Target of symlink (NULL for other types) */
+	const char *link_target;
+
+	/** Node of the directory (used only for directories) */
+	struct catalog_store_hash child;
+};
+
+/**
+ * Decoded entry of a node
+ */
+struct catalog_store_entry
+{
+	/** Entry of the compact directory (name and target point to the cursor and the node) */
+	struct compact_dir_entry entry;
+
+	/** True for directories, then child is the node of the directory */
+	bool has_child;
+
+	/** Node of the directory */
+	struct catalog_store_hash child;
+};
+
+/**
+ * Counters of a store
+ */
+struct catalog_store_stats
+{
+	/** Number of nodes in the store */
+	size_t nodes;
+
+	/** Size of the pack of nodes (in bytes) */
+	uint64_t pack_size;
+
+	/** Nodes added by this process */
+	uint64_t nodes_added;
+
+	/** Bytes of nodes added by this process */
+	uint64_t bytes_added;
+
+	/** Nodes put by this process that were already in the store */
+	uint64_t nodes_reused;
+
+	/** Nodes taken from the cache of decoded nodes */
+	uint64_t cache_hits;
+
+	/** Nodes read from the pack */
+	uint64_t cache_misses;
+};
+
+// Forward declarations
+struct catalog_store;
+struct catalog_store_node;
+
+/**
+ * Open (or create) a store
+ *
+ * @param store is the new store
+ * @param path is the path of the store directory
+ * @param writable determines if nodes and snapshots can be added (the directory is created if missing)
+ * @return 0 on success, -EBUSY if another process adds to the store,
+ *         -EINVAL if it's not a store, other negative value (mostly -errno) on error
+ */
+int catalog_store_open(struct catalog_store **store, const char *path, bool writable);
+
+/**
+ * Commit added nodes and close the store
+ *
+ * @param store is the store (can be NULL)
+ * @return 0 on success, negative value on error of the commit
+ */
+int catalog_store_close(struct catalog_store *store);
+
+/**
+ * Add a node of a directory (nothing is written if the same node is already stored)
+ *
+ * @param store is the writable store
+ * @param inputs is the array of entries sorted by name (strcmp order, no duplicates)
+ * @param count is the number of entries
+ * @param hash is the hash of the node
+ * @return 0 on success, -EINVAL for unsorted input, other negative value on error
+ */
+int catalog_store_put_node(struct catalog_store *store, const struct catalog_store_input *inputs, size_t count,
+						   struct catalog_store_hash *hash);
+
+/**
+ * Sync added nodes and add them to the index
+ *
+ * @param store is the writable store
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int catalog_store_commit(struct catalog_store *store);
+
+/**
+ * Check if a name can be a name of a snapshot
+ *
+ * @param name is the name
+ * @return true if the name is not empty, has no slashes, does not start with a dot and fits NAME_MAX with '@'
+ */
+bool catalog_store_is_snapshot_name(const char *name);
+
+/**
+ * Commit added nodes and save a snapshot (an existing one is replaced)
+ *
+ * @param store is the writable store
+ * @param name is the name of the snapshot
+ * @param root is the node of the root directory of the snapshot
+ * @return 0 on success, -EINVAL for bad names, other negative value on error
+ */
+int catalog_store_set_snapshot(struct catalog_store *store, const char *name, const struct catalog_store_hash *root);
+
+/**
+ * Find a snapshot
+ *
+ * @param store is the store
+ * @param name is the name of the snapshot
+ * @param root is the node of the root directory of the snapshot
+ * @param mtime is the time the snapshot was saved (can be NULL)
+ * @return 0 on success, -ENOENT if there is no such snapshot, other negative value on error
+ */
+int catalog_store_get_snapshot(struct catalog_store *store, const char *name, struct catalog_store_hash *root,
+							   int64_t *mtime);
+
+/**
+ * Get names of all snapshots
+ *
+ * @param store is the store
+ * @param names is the sorted array of names (must be freed by catalog_store_free_names())
+ * @param count is the number of names
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int catalog_store_list_snapshots(struct catalog_store *store, char ***names, size_t *count);
+
+/**
+ * Free names of snapshots
+ *
+ * @param names is the array of names (can be NULL)
+ * @param count is the number of names
+ */
+void catalog_store_free_names(char **names, size_t count);
+
+/**
+ * Get a node (decoded nodes are cached)
+ *
+ * @param store is the store
+ * @param hash is the hash of the node
+ * @param node is the node (must be released by catalog_store_release_node())
+ * @return 0 on success, -ENOENT if there is no such node, -EINVAL for a broken node, other negative value on error
+ */
+int catalog_store_get_node(struct catalog_store *store, const struct catalog_store_hash *hash,
+						   struct catalog_store_node **node);
+
+/**
+ * Release a node
+ *
+ * @param store is the store
+ * @param node is the node (can be NULL)
+ */
+void catalog_store_release_node(struct catalog_store *store, struct catalog_store_node *node);
+
+/**
+ * Get the number of entries of a node
+ *
+ * @param node is the node
+ * @return number of entries
+ */
+size_t catalog_store_node_count(const struct catalog_store_node *node);
+
+/**
+ * Initialize a cursor at the first entry of a node
+ *
+ * @param node is the node
+ * @param cursor is the cursor (must be freed by compact_dir_cursor_free())
+ */
+void catalog_store_node_cursor_init(const struct catalog_store_node *node, struct compact_dir_cursor *cursor);
+
+/**
+ * Decode the next entry of a node and move the cursor
+ *
+ * @param node is the node
+ * @param cursor is the cursor
+ * @param entry is the decoded entry
+ * @return 0 on success, 1 at the end of the node, negative value for broken data
+ */
+int catalog_store_node_next(const struct catalog_store_node *node, struct compact_dir_cursor *cursor,
+							struct catalog_store_entry *entry);
+
+/**
+ * Find an entry of a node by name
+ *
+ * @param node is the node
+ * @param name is the name
+ * @param cursor is an initialized cursor to use for decoding (entry data points to it)
+ * @param entry is the found entry
+ * @return 0 if found, -ENOENT if not found, other negative value for broken data
+ */
+int catalog_store_node_find(const struct catalog_store_node *node, const char *name,
+							struct compact_dir_cursor *cursor, struct catalog_store_entry *entry);
+
+/**
+ * Get counters of the store
+ *
+ * @param store is the store
+ * @param stats is the target counters
+ */
+void catalog_store_get_stats(struct catalog_store *store, struct catalog_store_stats *stats);
+
+/**
+ * Format a hash as hex
+ *
+ * @param hash is the hash
+ * @param hex is the target buffer of 2 * CATALOG_STORE_HASH_SIZE + 1 chars
+ */
+void catalog_store_hash_to_hex(const struct catalog_store_hash *hash, char *hex);
+
+#endif // INC_CATALOGFS_CATALOG_STORE_H
@@ -145,6 +145,21 @@
  * After open()/create() calls the information about size of the content is kept in the memory
  * and is written to the index file only on release() call, so the whole copying process 
  * should take no time on receiving end.
+ *
+ * Missing names are cached per directory (see negative_cache.h) because file managers
+ * keep probing directories for files like .directory, desktop.ini or .hidden.
+ *
+ * A directory can keep metadata of its files in one manifest file instead of
+ * one filestat file per entry (see manifest.h). With --manifests released files
+ * are moved into manifests of their directories.
+ *
+ * Without --watch the kernel does not cache entries and attributes at all, because
+ * the source can be changed directly (e.g. by the lister). With --watch changes of
+ * the source are reported by inotify (see source_watch.h): caches of the filesystem
+ * are invalidated before the next request and attributes in the kernel cache are
+ * invalidated right away, so the kernel keeps attributes for --cache_timeout seconds.
+ * Entries are still looked up every time: the kernel cache can be invalidated only by
+ * inodes, and children of a moved or removed directory would stay cached otherwise.
  * 
  *
  * This filesystem never uses nor relies on MAX_PATH, because MAX_PATH is a terrible thing.
@@ -155,6 +170,8 @@
  * This filesystem works in a single-thread mode because multi-threading is not required because 
  * it is already already super fast in writing and reading as no actual contents of file is used.
  * Single-thread mode may increase FUSE filesystem's stability, and that is way more important.
+ * Optional warm-up threads (see warmup.h) only fill the metadata cache and do not handle
+ * any FUSE requests.
  */
 
 /**
@@ -177,10 +194,12 @@
 #include "header_common.h"
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 #ifdef __FreeBSD__
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -188,10 +207,31 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/file.h> /* flock(2) */
+#include <sys/resource.h>
 
 #include "filestat.h"
 #include "filestat_converter.h"
 #include "filestat_parser.h"
+#include "batch_loader.h"
+#include "byte_buffer.h"
+#include "catalog_db.h"
+#include "catalog_dir.h"
+#include "catalog_store.h"
+#include "compact_dir.h"
+#include "control.h"
+#include "dir_fd_cache.h"
+#include "dir_listing.h"
+#include "ingest.h"
+#include "manifest.h"
+#include "metadata_cache.h"
+#include "negative_cache.h"
+#include "pager.h"
+#include "query_index.h"
+#include "source_watch.h"
+#include "storage.h"
+#include "warmup.h"
+#include "where_filter.h"
+#include "write_behind.h"
 
 #include "log.h"
 
@@ -229,6 +269,108 @@ struct my_private_data
 
 	/** Use gid from filestat files instead of real file's gid */
 	bool use_saved_gid;
+
+	/** Timeout for caching of missing names by the kernel (in seconds) */
+	double negative_timeout;
+
+	/** Watch the source directory for changes made outside of the filesystem */
+	bool watch;
+
+	/** Timeout for caching of attributes by the kernel while watching (in seconds) */
+	double cache_timeout;
+
+	/** Running watcher of the source directory (NULL if not started) */
+	struct source_watch *watch_handle;
+
+	/** FUSE instance to invalidate the kernel cache from the watcher thread (set in init()) */
+	struct fuse *fuse;
+
+	/** Number of paths invalidated in the kernel cache by the watcher */
+	uint64_t watch_invalidations;
+
+	/** Cache of paths that are known to be missing */
+	struct negative_cache negative_cache;
+
+	/** Cache of parsed filestat files */
+	struct metadata_cache metadata_cache;
+
+	/** Cache of descriptors of parent directories */
+	struct dir_fd_cache dir_fd_cache;
+
+	/** Cache of opened manifests of directories */
+	struct manifest_cache manifest_cache;
+
+	/** Cache of listings of directories for readdir() */
+	struct dir_listing_cache dir_listing_cache;
+
+	/** Move released files into manifests of their directories */
+	bool manifests;
+
+	/** Writer of manifests (used only if manifests is set) */
+	struct manifest_writer manifest_writer;
+
+	/** Save metadata of released files in background */
+	bool write_behind;
+
+	/** Durability of metadata saved in background */
+	enum write_behind_durability write_behind_durability;
+
+	/** Running write-behind (NULL if not started, then metadata is saved on release) */
+	struct write_behind *write_behind_handle;
+
+	/** Storage of metadata in written index files */
+	enum catalog_storage storage;
+
+	/** Warm up the metadata cache in background after mount */
+	bool warmup;
+
+	/** Number of warm-up threads */
+	unsigned int warmup_threads;
+
+	/** Running warm-up (NULL if not started) */
+	struct warmup *warmup_handle;
+
+	/** Batched loader of directories for readdirplus (NULL if not allocated) */
+	struct batch_loader *loader;
+
+	/** Single-file catalog used instead of the source directory (NULL if not used) */
+	struct catalog_db *db;
+
+	/** Path of the single-file catalog (used only if db is set) */
+	char *db_path;
+
+	/** Absolute path of the snapshot of the metadata cache (NULL if not used) */
+	char *cache_snapshot_path;
+
+	/** Number of records applied through the ingest control file */
+	uint64_t ingest_records;
+
+	/** Number of records of the ingest control file that failed */
+	uint64_t ingest_errors;
+
+	/** Number of changes of the catalog made through the filesystem (see note_catalog_change()) */
+	uint64_t catalog_generation;
+
+	/** The sidecar of catalogfs-where was removed after the first change of the catalog */
+	bool where_filter_dropped;
+
+	/** Lock of query_snapshot and query counters */
+	pthread_mutex_t query_lock;
+
+	/** Index of the catalog for the query directory (NULL until the first query) */
+	struct my_query_snapshot *query_snapshot;
+
+	/** Number of builds of the query index */
+	uint64_t query_builds;
+
+	/** Number of queries answered by the query directory */
+	uint64_t queries;
+
+	/** Versioned store of snapshots shown read-only instead of a catalog (NULL if not used) */
+	struct catalog_store *store;
+
+	/** Path of the versioned store (used only if store is set) */
+	char *store_path;
 };
 
 /**
@@ -251,6 +393,13 @@ struct my_private_data
 #define RELPATH(path) ( \
 	((path)[0] == '/') ? ((strlen(path) == 1) ? "." : ((path) + 1)) : (((path)[0] == '\0') ? "." : (path)))
 
+/**
+ * Macro to resolve the path to a cached descriptor of its parent directory.
+ * Returns the directory descriptor and sets name to the path relative to it,
+ * so the kernel does not walk all components of a deep path again.
+ */
+#define RESOLVE_AT(path, name) (dir_fd_cache_resolve(&MY_DATA->dir_fd_cache, RELPATH(path), &(name)))
+
 /**
  * Structure to be stored in fh field of fuse_file_info that is allocated and 
  * used for every opened file.
@@ -265,6 +414,111 @@ struct my_fh_fileinfo
 
 	/** File size in bytes */
 	int64_t file_size;
+
+	/** Metadata with file_size was queued for the write-behind by flush() */
+	bool queued;
+
+	/** File size of the queued metadata */
+	int64_t queued_size;
+};
+
+/**
+ * Structure to be stored in fh field of fuse_file_info for files
+ * created in a single-file catalog (there is no index file to keep open)
+ */
+struct my_db_fileinfo
+{
+	/** Id of the entry (a file renamed over it has another one) */
+	uint64_t id;
+
+	/** File size in bytes */
+	int64_t file_size;
+
+	/** The size is saved to the catalog */
+	bool saved;
+};
+
+/**
+ * State of an open ingest control file (see ingest.h),
+ * stored in the state field of its control file
+ */
+struct my_ingest_file
+{
+	/** Stream of records */
+	struct ingest_stream stream;
+
+	/** Writer of index files (not used for single-file catalogs) */
+	struct ingest_writer writer;
+
+	/** Number of applied records already added to the counters of the filesystem */
+	uint64_t counted_records;
+
+	/** Number of failed records already added to the counters of the filesystem */
+	uint64_t counted_errors;
+};
+
+/**
+ * Index of the catalog for the query directory (see control.h).
+ * Open query directories keep references to it, so a rebuilt index replaces
+ * the snapshot in my_private_data while old listings still use the old one.
+ */
+struct my_query_snapshot
+{
+	/** Columnar index of the catalog */
+	struct query_index *index;
+
+	/** Value of catalog_generation when the build started */
+	uint64_t generation;
+
+	/** Number of references (one of my_private_data while it's current), protected by query_lock */
+	unsigned int refs;
+};
+
+/**
+ * Structure to be stored in fh field of fuse_file_info for an opened
+ * directory of predicates (query results are found once on opendir())
+ */
+struct my_query_dir
+{
+	/** Referenced snapshot of the index */
+	struct my_query_snapshot *snapshot;
+
+	/** Found rows sorted by paths */
+	uint32_t *rows;
+
+	/** Number of found rows */
+	size_t count;
+};
+
+/** Number of entries of a directory stream loaded with metadata at once for readdirplus */
+#define DIR_STREAM_CHUNK_SIZE (256)
+
+/**
+ * Structure to be stored in fh field of fuse_file_info for every opened
+ * directory (except the control directory).
+ * The listing is kept between readdir() calls, so every call resumes at its
+ * offset, and metadata of entries is loaded only for a chunk of the listing
+ * around the offset for readdirplus.
+ */
+struct my_dir_stream
+{
+	/** Directory FD */
+	int dir_fd;
+
+	/** Listing of the directory (NULL until the first readdir()) */
+	struct dir_listing *listing;
+
+	/** Entries of the listing from chunk_start to chunk_end with metadata (readdirplus) */
+	struct catalog_dir chunk;
+
+	/** Index of the first entry of the chunk in the listing */
+	size_t chunk_start;
+
+	/** Index after the last entry of the chunk in the listing (equals chunk_start if nothing is loaded) */
+	size_t chunk_end;
+
+	/** Filestat files were read for entries of the chunk */
+	bool chunk_read_filestats;
 };
 
 /**
@@ -319,560 +573,3390 @@ static int save_filestat(const int file_fd, const char *relpath, int64_t file_si
 	my_stat.size = file_size;
 	my_stat.blocks = convert_filesize_to_fileblocks(file_size);
 
-	// Both dirname() and basename() may modify the contents of path,
-	// so it may be desirable to pass a copy when calling one of these functions.
-	char *path_copy = strdup(relpath);
-	if (path_copy == NULL)
-		return -1;
+	return storage_save_filestat(file_fd, MY_DATA->storage, &my_stat, relpath);
+}
+
+/**
+ * Queue filestat of the file to be saved in background by the write-behind,
+ * the filestat is made like by save_filestat() but from the open file itself
+ *
+ * @param file_fd is the file descriptor (owned by the write-behind after the call, even on error)
+ * @param relpath is the relative file path
+ * @param file_size is the file size to use for filestat size and blocks fields
+ * @return 0 on success, nonzero value on error
+ */
+static int queue_filestat(const int file_fd, const char *relpath, int64_t file_size)
+{
+	struct stat stbuf;
+	struct filestat my_stat;
+	memset(&my_stat, 0, sizeof(struct filestat));
+	if (fstat(file_fd, &stbuf) == -1 || fill_filestat_from_stat(&my_stat, &stbuf) != 0)
+	{
+		(void)close(file_fd);
+		return -EPERM;
+	}
+
+	// Copy size from my_fh_fileinfo, as we are ignoring actual filesystem writing
+	my_stat.size = file_size;
+	my_stat.blocks = convert_filesize_to_fileblocks(file_size);
 
-	char *name = strdup(basename(path_copy));
-	free(path_copy);
+	return write_behind_add(MY_DATA->write_behind_handle, relpath, file_fd, &stbuf, &my_stat);
+}
 
-	if (name == NULL)
-		return -1;
+/**
+ * Check if the last component of the path is reserved for manifest files
+ *
+ * @param path is the path
+ * @return true if the name is reserved
+ */
+static bool is_manifest_path(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return manifest_is_reserved_name((slash != NULL) ? slash + 1 : path);
+}
 
-	res = write_filestat(file_fd, &my_stat, name, relpath);
+/**
+ * Open the parent directory of an entry whose name from RESOLVE_AT() is still
+ * a relative path (the descriptor cache is disabled or failed to open the parent),
+ * manifests are files of the parent directory itself
+ *
+ * @param dir_fd is the descriptor from RESOLVE_AT()
+ * @param name is the name from RESOLVE_AT() (set to the last component of the path)
+ * @return descriptor of the parent directory (dir_fd itself for plain names,
+ *         otherwise it should be closed), negative value on error
+ */
+static int open_manifest_dir(int dir_fd, const char **name)
+{
+	const char *slash = strrchr(*name, '/');
+	if (slash == NULL)
+		return dir_fd;
 
-	free(name);
+	char *dir_relpath = strndup(*name, (size_t)(slash - *name));
+	if (dir_relpath == NULL)
+		return -ENOMEM;
 
-	if (res != 0)
-		return res;
+	int fd = openat(dir_fd, dir_relpath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	int errno_stored = errno;
+	free(dir_relpath);
+	if (fd == -1)
+		return -errno_stored;
 
-	return 0;
+	*name = slash + 1;
+	return fd;
 }
 
 /**
- * Free my_private_data struct including its fields
- * 
- * @param my_data is the private data struct
+ * Close the descriptor from open_manifest_dir()
+ *
+ * @param fd is the descriptor of the parent directory
+ * @param dir_fd is the descriptor from RESOLVE_AT()
  */
-static void free_my_private_data(struct my_private_data *my_data)
+static void close_manifest_dir(int fd, int dir_fd)
 {
-	if (my_data == NULL)
-		return;
+	if (fd != dir_fd)
+		(void)close(fd);
+}
 
-	free(my_data->mountpoint_path);
-	my_data->mountpoint_path = NULL;
-	free(my_data->source_dir_path);
-	my_data->source_dir_path = NULL;
+/**
+ * Find the entry of the path in the manifest of its parent directory
+ *
+ * @param path is the path of the entry
+ * @param dir_fd is the descriptor of the parent directory (from RESOLVE_AT())
+ * @param name is the name of the entry (from RESOLVE_AT())
+ * @param stbuf is the target skeleton of real stat (can be NULL)
+ * @param my_stat is the target metadata
+ * @return 0 if found, negative value otherwise
+ */
+static int find_in_manifest(const char *path, int dir_fd, const char *name,
+							struct stat *stbuf, struct filestat *my_stat)
+{
+	int fd = open_manifest_dir(dir_fd, &name);
+	if (fd < 0)
+		return fd;
+
+	// Manifests are cached by the relative path of the directory
+	const char *relpath = RELPATH(path);
+	const char *dir_relpath = (name == relpath) ? "." : relpath;
+	size_t dir_relpath_len = (name == relpath) ? 1 : (size_t)(name - relpath - 1);
+
+	const struct manifest *manifest;
+	int res = manifest_cache_get(&MY_DATA->manifest_cache, fd, dir_relpath, dir_relpath_len, &manifest);
+	close_manifest_dir(fd, dir_fd);
+	if (res != 0)
+		return res;
 
-	if (my_data->source_dir_dir != NULL)
+	res = manifest_find(manifest, name, my_stat);
+	if (res == 0 && stbuf != NULL)
 	{
-		closedir(my_data->source_dir_dir);
-		my_data->source_dir_dir = NULL;
+		manifest_fill_stat(manifest, name, stbuf);
 	}
 
-	if (my_data->logfile != NULL)
-	{
-		(void)fclose(my_data->logfile);
-		my_data->logfile = NULL;
-	}
+	return res;
+}
 
-	free(my_data);
+/**
+ * Check if the entry of the path exists only in the manifest of its parent directory
+ * (should be called after a real operation failed with ENOENT)
+ *
+ * @param path is the path of the entry
+ * @param dir_fd is the descriptor of the parent directory (from RESOLVE_AT())
+ * @param name is the name of the entry (from RESOLVE_AT())
+ * @return true if the entry is in the manifest
+ */
+static bool is_in_manifest(const char *path, int dir_fd, const char *name)
+{
+	struct filestat my_stat;
+	return find_in_manifest(path, dir_fd, name, NULL, &my_stat) == 0;
 }
 
-/* ----------------------------------------------------------- *
- * Implementation of FUSE callbacks.
- * Functions that implement fuse_operations callback functions.
- * NOTE: See FUSE documentation for more details.
- * ----------------------------------------------------------- */
+/**
+ * Remove the entry from the manifest of its parent directory
+ *
+ * @param dir_fd is the descriptor of the parent directory (from RESOLVE_AT())
+ * @param name is the name of the entry (from RESOLVE_AT())
+ * @return 0 on success, negative value on error
+ */
+static int remove_from_manifest(int dir_fd, const char *name)
+{
+	int fd = open_manifest_dir(dir_fd, &name);
+	if (fd < 0)
+		return fd;
+
+	struct manifest_change change;
+	change.name = name;
+	change.my_stat = NULL;
+	int res = manifest_apply(fd, &change, 1);
+	close_manifest_dir(fd, dir_fd);
+	return res;
+}
 
-/** Initialize filesystem */
-static void *catalogfs_init(struct fuse_conn_info *conn,
-							struct fuse_config *cfg)
+/**
+ * Rename an entry that exists only in a manifest: add it to the manifest
+ * of the target directory and remove it from the manifest of the source one
+ * (a real regular file at the target is replaced like rename() does)
+ *
+ * @param from is the path of the entry
+ * @param from_dir_fd is the descriptor of the parent directory of the entry
+ * @param from_name is the name of the entry
+ * @param to is the target path
+ * @param to_dir_fd is the descriptor of the target parent directory
+ * @param to_name is the target name
+ * @return 0 on success, negative value on error (-ENOENT if the entry is not in the manifest)
+ */
+static int rename_manifest_entry(const char *from, int from_dir_fd, const char *from_name,
+								 const char *to, int to_dir_fd, const char *to_name)
 {
-	LOG_START(NULL)
+	struct filestat my_stat;
+	int res = find_in_manifest(from, from_dir_fd, from_name, NULL, &my_stat);
+	if (res != 0)
+		return -ENOENT;
 
-	(void)conn;
-	cfg->use_ino = 1;
+	if (strcmp(RELPATH(from), RELPATH(to)) == 0)
+		return 0;
 
-	/*
-	 * Pick up changes from the lower filesystem right away.
-	 * This is also necessary for better hardlink support.
-	 * When the kernel calls the unlink() handler, it does not 
-	 * know the inode of the to-be-removed entry and can 
-	 * therefore not invalidate the cache of the associated 
-	 * inode - resulting in an incorrect st_nlink value being 
-	 * reported for any remaining hardlinks to this inode. 
-	 */
-	cfg->entry_timeout = 0;
-	cfg->attr_timeout = 0;
-	cfg->negative_timeout = 0;
+	int from_fd = open_manifest_dir(from_dir_fd, &from_name);
+	if (from_fd < 0)
+		return from_fd;
 
-	/*
-	 * NOTE: it's possible to check that all functions actually use provided source_dir_fd
-	 * and they do not rely on the CWD. Something like that is possible:
-	 
-	 //chdir("/home/user/some_completely_different_dir/");
-	 */
+	int to_fd = open_manifest_dir(to_dir_fd, &to_name);
+	if (to_fd < 0)
+	{
+		close_manifest_dir(from_fd, from_dir_fd);
+		return to_fd;
+	}
 
-	/*
-	 * Return pointer to my_private_data stuct, that was allocated in main()
-	 * and passed to fuse_main() as the last argument
-	 */
-	return (void *)MY_DATA;
-}
+	// Names are the last components now, so the parents are the same if the paths before them are
+	size_t from_dir_len = (size_t)(from_name - RELPATH(from));
+	size_t to_dir_len = (size_t)(to_name - RELPATH(to));
+	bool same_dir = (from_dir_len == to_dir_len && strncmp(RELPATH(from), RELPATH(to), from_dir_len) == 0);
 
-/** Clean up filesystem */
-static void catalogfs_destroy(void *private_data)
-{
-	LOG_START(NULL)
+	struct stat stbuf;
+	if (fstatat(to_fd, to_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+	{
+		if (S_ISDIR(stbuf.st_mode))
+			res = -EISDIR;
+		else if (unlinkat(to_fd, to_name, 0) == -1)
+			res = -errno;
+	}
 
-	// Free the private_data memory, that was allocated in main()
-	if (private_data != NULL)
+	struct manifest_change changes[2];
+	changes[0].name = to_name;
+	changes[0].my_stat = &my_stat;
+	changes[1].name = from_name;
+	changes[1].my_stat = NULL;
+
+	if (res == 0 && same_dir)
 	{
-		struct my_private_data *my_data = (struct my_private_data *)private_data;
-		free_my_private_data(my_data);
+		res = manifest_apply(to_fd, changes, 2);
+	}
+	else if (res == 0)
+	{
+		// A crash between two writes leaves a copy, not a lost entry
+		res = manifest_apply(to_fd, &changes[0], 1);
+		if (res == 0)
+			res = manifest_apply(from_fd, &changes[1], 1);
 	}
+
+	close_manifest_dir(to_fd, to_dir_fd);
+	close_manifest_dir(from_fd, from_dir_fd);
+	return res;
 }
 
-/** Get file attributes */
-static int catalogfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+/**
+ * Fill stat struct from an entry of the single-file catalog
+ *
+ * @param stbuf is the target stat struct
+ * @param entry is the entry
+ * @return 0 on success, nonzero value on error
+ */
+static int fill_stat_from_db_entry(struct stat *stbuf, const struct catalog_db_entry *entry)
 {
-	LOG_START(path)
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = (ino_t)entry->id;
+	stbuf->st_nlink = (nlink_t)entry->my_stat.nlink;
+	stbuf->st_blksize = (blksize_t)entry->my_stat.blksize;
 
-	(void)fi;
+	// There are no real files, so saved metadata is shown whatever the options are
+	return fill_stat_from_filestat_with_options(stbuf, &entry->my_stat, true, true, true, true);
+}
 
-	int res = fstatat(MY_DIR_FD, RELPATH(path), stbuf, AT_SYMLINK_NOFOLLOW);
-	if (res == -1)
+/**
+ * Get stat of the root directory (of the source directory or of the single-file catalog)
+ *
+ * @param stbuf is the target stat struct
+ * @return 0 on success, negative value on error
+ */
+static int get_root_stat(struct stat *stbuf)
+{
+	if (MY_DATA->db != NULL)
 	{
-		RETURN_CODE_ERROR(path, -errno)
-	}
+		struct catalog_db_entry entry;
+		int res = catalog_db_lookup(MY_DATA->db, "/", &entry);
+		if (res != 0)
+			return res;
 
-	if (!S_ISREG(stbuf->st_mode) &&
-		!S_ISDIR(stbuf->st_mode) &&
-		!S_ISLNK(stbuf->st_mode))
-	{
-		RETURN_CODE_ERROR(path, -EPERM)
+		return (fill_stat_from_db_entry(stbuf, &entry) == 0) ? 0 : -EPERM;
 	}
 
-	// Replace file size that is visible to user for regular files
-	if (S_ISREG(stbuf->st_mode))
-	{
-		if (stbuf->st_size == 0)
-		{
-			/*
-			* New file, that still was not released, so, there is 
-			* no need to fill its contents with filestat metadata.
-			* Do nothing, let it be as it is for now.
-			*/
-		}
-		else
-		{
-			// Make a skeleton of filestat from a real file
-			struct filestat my_stat;
-			res = fill_filestat_from_stat(&my_stat, stbuf);
-			if (res != 0)
-			{
-				RETURN_CODE_ERROR(path, -EPERM)
-			}
+	if (fstat(MY_DIR_FD, stbuf) == -1)
+		return -errno;
 
-			res = read_filestat(MY_DIR_FD, RELPATH(path), &my_stat);
-			if (res != 0)
-			{
-				RETURN_CODE_ERROR(path, res)
-			}
+	return 0;
+}
 
-			res = fill_stat_from_filestat_with_options(
-				stbuf,
-				&my_stat,
+/**
+ * Note a change of the catalog made through the filesystem,
+ * the query index is rebuilt on the next query after it.
+ * The first change also removes the sidecar of catalogfs-where (see where_filter.h),
+ * records rewritten in place (e.g. by ingest) don't change ctimes of directories.
+ */
+static void note_catalog_change(void)
+{
+	__atomic_add_fetch(&MY_DATA->catalog_generation, 1, __ATOMIC_RELAXED);
+
+	if (MY_DIR_FD != -1 && !__atomic_exchange_n(&MY_DATA->where_filter_dropped, true, __ATOMIC_RELAXED))
+		(void)unlinkat(MY_DIR_FD, WHERE_FILTER_FILE_NAME, 0);
+}
+
+/**
+ * Invalidate the attributes of the path in the kernel cache (called by the watcher thread).
+ * Only the inode is invalidated (attributes and pages), cached entries of its children
+ * are kept, that's why entries are not cached by the kernel while watching (see init).
+ *
+ * @param my_data is the private data struct
+ * @param relpath is the relative path in the source directory (empty for the root)
+ * @param relpath_len is the length of the relative path
+ */
+static void invalidate_kernel_path(struct my_private_data *my_data, const char *relpath, size_t relpath_len)
+{
+	char *path = (char *)malloc(relpath_len + 2);
+	if (path == NULL)
+		return;
+
+	path[0] = '/';
+	memcpy(path + 1, relpath, relpath_len);
+	path[relpath_len + 1] = '\0';
+
+	// Paths that the kernel never looked up are not in the cache (-ENOENT)
+	if (fuse_invalidate_path(my_data->fuse, path) == 0)
+		__atomic_add_fetch(&my_data->watch_invalidations, 1, __ATOMIC_RELAXED);
+	free(path);
+}
+
+/**
+ * Invalidate entries of the manifest of the directory in the kernel cache
+ * (called by the watcher thread when the manifest is replaced)
+ *
+ * @param my_data is the private data struct
+ * @param dir_relpath is the relative path of the directory (empty for the root)
+ * @param dir_relpath_len is the length of the relative path
+ */
+static void invalidate_kernel_manifest(struct my_private_data *my_data, const char *dir_relpath,
+									   size_t dir_relpath_len)
+{
+	char *dir_path = strndup(dir_relpath, dir_relpath_len);
+	if (dir_path == NULL)
+		return;
+
+	int dir_fd = openat(my_data->source_dir_fd, (dir_relpath_len == 0) ? "." : dir_path,
+						O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	free(dir_path);
+	if (dir_fd == -1)
+		return;
+
+	struct manifest manifest;
+	int res = manifest_open(dir_fd, &manifest);
+	(void)close(dir_fd);
+	if (res != 0)
+		return;
+
+	struct byte_buffer relpath;
+	memset(&relpath, 0, sizeof(relpath));
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest.dir);
+
+	struct compact_dir_entry entry;
+	while (compact_dir_cursor_next(&cursor, &entry) == 0)
+	{
+		relpath.len = 0;
+		if ((dir_relpath_len != 0 &&
+			 (byte_buffer_append(&relpath, dir_relpath, dir_relpath_len) != 0 ||
+			  byte_buffer_append(&relpath, "/", 1) != 0)) ||
+			byte_buffer_append(&relpath, entry.name, entry.name_len) != 0)
+		{
+			break;
+		}
+
+		invalidate_kernel_path(my_data, (const char *)relpath.data, relpath.len);
+	}
+
+	compact_dir_cursor_free(&cursor);
+	byte_buffer_free(&relpath);
+	manifest_free(&manifest);
+}
+
+/**
+ * Invalidate all entries of the root directory in the kernel cache
+ * (called by the watcher thread when events were lost).
+ * The kernel drops every cached path below these entries too.
+ *
+ * @param my_data is the private data struct
+ */
+static void invalidate_kernel_root(struct my_private_data *my_data)
+{
+	invalidate_kernel_path(my_data, "", 0);
+
+	struct fuse_session *session = fuse_get_session(my_data->fuse);
+	int dir_fd = openat(my_data->source_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1)
+		return;
+
+	struct manifest manifest;
+	bool has_manifest = (manifest_open(dir_fd, &manifest) == 0);
+
+	DIR *dir = fdopendir(dir_fd);
+	if (dir == NULL)
+	{
+		(void)close(dir_fd);
+	}
+	else
+	{
+		struct dirent *dirent;
+		while ((dirent = readdir(dir)) != NULL)
+		{
+			if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0 ||
+				manifest_is_reserved_name(dirent->d_name))
+				continue;
+
+			if (fuse_lowlevel_notify_inval_entry(session, FUSE_ROOT_ID, dirent->d_name, strlen(dirent->d_name)) == 0)
+				__atomic_add_fetch(&my_data->watch_invalidations, 1, __ATOMIC_RELAXED);
+		}
+		(void)closedir(dir);
+	}
+
+	if (!has_manifest)
+		return;
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest.dir);
+
+	struct compact_dir_entry entry;
+	while (compact_dir_cursor_next(&cursor, &entry) == 0)
+	{
+		if (fuse_lowlevel_notify_inval_entry(session, FUSE_ROOT_ID, entry.name, entry.name_len) == 0)
+			__atomic_add_fetch(&my_data->watch_invalidations, 1, __ATOMIC_RELAXED);
+	}
+
+	compact_dir_cursor_free(&cursor);
+	manifest_free(&manifest);
+}
+
+/**
+ * Invalidate changed paths in the kernel cache (called by the watcher thread, see source_watch.h)
+ *
+ * @param ctx is the private data struct
+ * @param changes is the array of changes
+ * @param count is the number of changes
+ */
+static void invalidate_kernel_changes(void *ctx, const struct source_watch_change *changes, size_t count)
+{
+	struct my_private_data *my_data = (struct my_private_data *)ctx;
+	if (my_data->fuse == NULL)
+		return;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *relpath = changes[i].relpath;
+		if (relpath[0] == '\0')
+		{
+			invalidate_kernel_root(my_data);
+			continue;
+		}
+
+		const char *slash = strrchr(relpath, '/');
+		const char *name = (slash == NULL) ? relpath : slash + 1;
+		size_t dir_len = (slash == NULL) ? 0 : (size_t)(slash - relpath);
+
+		// Hidden files are never seen by the kernel, but a replaced manifest changes its entries
+		if (manifest_is_reserved_name(name))
+		{
+			if (strcmp(name, MANIFEST_FILE_NAME) == 0)
+			{
+				invalidate_kernel_manifest(my_data, relpath, dir_len);
+				invalidate_kernel_path(my_data, relpath, dir_len);
+			}
+			continue;
+		}
+
+		// The parent directory gets new times, size or number of links
+		invalidate_kernel_path(my_data, relpath, strlen(relpath));
+		invalidate_kernel_path(my_data, relpath, dir_len);
+	}
+}
+
+/**
+ * Invalidate caches of the filesystem for paths changed outside of it (see source_watch_take())
+ *
+ * @param ctx is the private data struct
+ * @param changes is the array of changes
+ * @param count is the number of changes
+ */
+static void apply_source_change_batch(void *ctx, const struct source_watch_change *changes, size_t count)
+{
+	struct my_private_data *my_data = (struct my_private_data *)ctx;
+
+	// The metadata cache, manifests and listings are validated by stats of their files themselves
+	for (size_t i = 0; i < count; i++)
+	{
+		if (changes[i].kind == SOURCE_WATCH_TREE)
+		{
+			negative_cache_invalidate_tree(&my_data->negative_cache, changes[i].relpath);
+			dir_fd_cache_invalidate_tree(&my_data->dir_fd_cache, changes[i].relpath);
+		}
+		else
+		{
+			negative_cache_invalidate(&my_data->negative_cache, changes[i].relpath);
+		}
+	}
+
+	__atomic_add_fetch(&my_data->catalog_generation, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Apply changes of the source directory made outside of the filesystem since the
+ * previous request (does nothing without --watch)
+ */
+static void apply_source_changes(void)
+{
+	(void)source_watch_take(MY_DATA->watch_handle, apply_source_change_batch, MY_DATA);
+}
+
+/**
+ * Save the metadata cache to the snapshot file (if it's enabled)
+ *
+ * @param my_data is the private data struct
+ */
+static void save_cache_snapshot(struct my_private_data *my_data)
+{
+	if (my_data->cache_snapshot_path == NULL || my_data->source_dir_fd == -1)
+		return;
+
+	struct stat stbuf;
+	int res = (fstat(my_data->source_dir_fd, &stbuf) == 0) ? 0 : -errno;
+	if (res == 0)
+		res = metadata_cache_save_snapshot(&my_data->metadata_cache, my_data->cache_snapshot_path, stbuf.st_ino);
+
+	if (res != 0)
+	{
+		Log(my_data->logfile, true, __func__, NULL, "failed to save cache snapshot (code: %d)", res);
+	}
+}
+
+/**
+ * Free my_private_data struct including its fields
+ * 
+ * @param my_data is the private data struct
+ */
+static void free_my_private_data(struct my_private_data *my_data)
+{
+	if (my_data == NULL)
+		return;
+
+	// The watcher thread invalidates the kernel cache through FUSE, which is being destroyed
+	source_watch_stop(my_data->watch_handle);
+	my_data->watch_handle = NULL;
+
+	// Warm-up threads use the source directory and the cache, stop them first
+	warmup_stop(my_data->warmup_handle);
+	my_data->warmup_handle = NULL;
+
+	// Queued metadata is saved while the source directory is still open
+	int res = write_behind_stop(my_data->write_behind_handle);
+	if (res != 0)
+	{
+		Log(my_data->logfile, true, __func__, NULL, "failed to save metadata of released files (code: %d)", res);
+	}
+	my_data->write_behind_handle = NULL;
+
+	// Pending files are moved into the manifest while the source directory is still open
+	manifest_writer_free(&my_data->manifest_writer);
+
+	save_cache_snapshot(my_data);
+	free(my_data->cache_snapshot_path);
+	my_data->cache_snapshot_path = NULL;
+
+	free(my_data->mountpoint_path);
+	my_data->mountpoint_path = NULL;
+	free(my_data->source_dir_path);
+	my_data->source_dir_path = NULL;
+
+	if (my_data->source_dir_dir != NULL)
+	{
+		closedir(my_data->source_dir_dir);
+		my_data->source_dir_dir = NULL;
+	}
+
+	res = catalog_db_close(my_data->db);
+	if (res != 0)
+	{
+		Log(my_data->logfile, true, __func__, NULL, "failed to commit catalog (code: %d)", res);
+	}
+	my_data->db = NULL;
+	free(my_data->db_path);
+	my_data->db_path = NULL;
+
+	(void)catalog_store_close(my_data->store);
+	my_data->store = NULL;
+	free(my_data->store_path);
+	my_data->store_path = NULL;
+
+	if (my_data->logfile != NULL)
+	{
+		(void)fclose(my_data->logfile);
+		my_data->logfile = NULL;
+	}
+
+	negative_cache_free(&my_data->negative_cache);
+	metadata_cache_free(&my_data->metadata_cache);
+	dir_fd_cache_free(&my_data->dir_fd_cache);
+	manifest_cache_free(&my_data->manifest_cache);
+	dir_listing_cache_free(&my_data->dir_listing_cache);
+	batch_loader_free(my_data->loader);
+
+	// Query directories are released by FUSE before destroy(), only the current snapshot is left
+	if (my_data->query_snapshot != NULL)
+	{
+		query_index_free(my_data->query_snapshot->index);
+		free(my_data->query_snapshot);
+	}
+	pthread_mutex_destroy(&my_data->query_lock);
+
+	free(my_data);
+}
+
+/**
+ * Format the content of the statistics control file (key=value lines)
+ * 
+ * @param my_data is the private data struct
+ * @param data is the allocated content (must be freed)
+ * @param size is the size of the content
+ * @return 0 on success, nonzero value on error
+ */
+static int format_stats(struct my_private_data *my_data, char **data, size_t *size)
+{
+	struct byte_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+	int res = 0;
+
+	struct metadata_cache_stats cache_stats;
+	metadata_cache_get_stats(&my_data->metadata_cache, &cache_stats);
+
+	res |= byte_buffer_append_format(&buf, "version=%s\n", CATALOGFS_VERSION);
+	res |= byte_buffer_append_format(&buf, "storage=%s\n", storage_name(my_data->storage));
+	res |= byte_buffer_append_format(&buf, "metadata_cache_entries=%zu\n", cache_stats.count);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_memory=%zu\n", cache_stats.memory_usage);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_max_memory=%zu\n", cache_stats.max_memory);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_hits=%" PRIu64 "\n", cache_stats.hits);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_misses=%" PRIu64 "\n", cache_stats.misses);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_snapshot_entries=%zu\n", cache_stats.snapshot_count);
+	res |= byte_buffer_append_format(&buf, "metadata_cache_snapshot_hits=%" PRIu64 "\n", cache_stats.snapshot_hits);
+	res |= byte_buffer_append_format(&buf, "negative_cache_names=%zu\n", my_data->negative_cache.names_count);
+	res |= byte_buffer_append_format(&buf, "negative_cache_hits=%" PRIu64 "\n", my_data->negative_cache.hits);
+	res |= byte_buffer_append_format(&buf, "dir_fd_cache_fds=%zu\n", dir_fd_cache_count(&my_data->dir_fd_cache));
+	res |= byte_buffer_append_format(&buf, "dir_fd_cache_hits=%" PRIu64 "\n", my_data->dir_fd_cache.hits);
+	res |= byte_buffer_append_format(&buf, "dir_fd_cache_misses=%" PRIu64 "\n", my_data->dir_fd_cache.misses);
+	res |= byte_buffer_append_format(&buf, "manifest_cache_dirs=%zu\n", my_data->manifest_cache.dirs.count);
+	res |= byte_buffer_append_format(&buf, "manifest_cache_hits=%" PRIu64 "\n", my_data->manifest_cache.hits);
+	res |= byte_buffer_append_format(&buf, "manifest_cache_misses=%" PRIu64 "\n", my_data->manifest_cache.misses);
+	res |= byte_buffer_append_format(&buf, "dir_listing_cache_dirs=%zu\n", my_data->dir_listing_cache.dirs.count);
+	res |= byte_buffer_append_format(&buf, "dir_listing_cache_memory=%zu\n", my_data->dir_listing_cache.memory_usage);
+	res |= byte_buffer_append_format(&buf, "dir_listing_cache_hits=%" PRIu64 "\n", my_data->dir_listing_cache.hits);
+	res |= byte_buffer_append_format(&buf, "dir_listing_cache_misses=%" PRIu64 "\n", my_data->dir_listing_cache.misses);
+	res |= byte_buffer_append_format(&buf, "manifest_writes=%" PRIu64 "\n", my_data->manifest_writer.writes);
+	res |= byte_buffer_append_format(&buf, "manifest_files_moved=%" PRIu64 "\n", my_data->manifest_writer.files_moved);
+
+	if (my_data->db != NULL)
+	{
+		struct catalog_db_stats db_stats;
+		catalog_db_get_stats(my_data->db, &db_stats);
+
+		res |= byte_buffer_append_format(&buf, "db_entries=%" PRIu64 "\n", db_stats.entries);
+		res |= byte_buffer_append_format(&buf, "db_pages=%" PRIu32 "\n", db_stats.pages);
+		res |= byte_buffer_append_format(&buf, "db_cached_pages=%zu\n", db_stats.cached_pages);
+		res |= byte_buffer_append_format(&buf, "db_dirty_pages=%zu\n", db_stats.dirty_pages);
+		res |= byte_buffer_append_format(&buf, "db_cache_hits=%" PRIu64 "\n", db_stats.cache_hits);
+		res |= byte_buffer_append_format(&buf, "db_cache_misses=%" PRIu64 "\n", db_stats.cache_misses);
+		res |= byte_buffer_append_format(&buf, "db_commits=%" PRIu64 "\n", db_stats.commits);
+		res |= byte_buffer_append_format(&buf, "db_checkpoints=%" PRIu64 "\n", db_stats.checkpoints);
+	}
+
+	if (my_data->write_behind_handle != NULL)
+	{
+		struct write_behind_stats wb_stats;
+		write_behind_get_stats(my_data->write_behind_handle, &wb_stats);
+
+		res |= byte_buffer_append_format(&buf, "write_behind_durability=%s\n",
+										 write_behind_durability_name(my_data->write_behind_durability));
+		res |= byte_buffer_append_format(&buf, "write_behind_pending=%zu\n", wb_stats.pending);
+		res |= byte_buffer_append_format(&buf, "write_behind_saved=%" PRIu64 "\n", wb_stats.saved);
+		res |= byte_buffer_append_format(&buf, "write_behind_batches=%" PRIu64 "\n", wb_stats.batches);
+		res |= byte_buffer_append_format(&buf, "write_behind_errors=%" PRIu64 "\n", wb_stats.errors);
+	}
+
+	if (my_data->watch_handle != NULL)
+	{
+		struct source_watch_stats watch_stats;
+		source_watch_get_stats(my_data->watch_handle, &watch_stats);
+
+		res |= byte_buffer_append_format(&buf, "watch_state=running\n");
+		res |= byte_buffer_append_format(&buf, "watch_dirs=%zu\n", watch_stats.watches);
+		res |= byte_buffer_append_format(&buf, "watch_pending=%zu\n", watch_stats.pending);
+		res |= byte_buffer_append_format(&buf, "watch_events=%" PRIu64 "\n", watch_stats.events);
+		res |= byte_buffer_append_format(&buf, "watch_changes=%" PRIu64 "\n", watch_stats.changes);
+		res |= byte_buffer_append_format(&buf, "watch_overflows=%" PRIu64 "\n", watch_stats.overflows);
+		res |= byte_buffer_append_format(&buf, "watch_errors=%" PRIu64 "\n", watch_stats.errors);
+		res |= byte_buffer_append_format(&buf, "watch_invalidations=%" PRIu64 "\n",
+										 __atomic_load_n(&my_data->watch_invalidations, __ATOMIC_RELAXED));
+	}
+	else
+	{
+		res |= byte_buffer_append_format(&buf, "watch_state=%s\n", (my_data->watch) ? "failed" : "disabled");
+	}
+
+	res |= byte_buffer_append_format(&buf, "ingest_records=%" PRIu64 "\n", my_data->ingest_records);
+	res |= byte_buffer_append_format(&buf, "ingest_errors=%" PRIu64 "\n", my_data->ingest_errors);
+
+	pthread_mutex_lock(&my_data->query_lock);
+	if (my_data->query_snapshot != NULL)
+	{
+		struct query_index_stats query_stats;
+		query_index_get_stats(my_data->query_snapshot->index, &query_stats);
+
+		res |= byte_buffer_append_format(&buf, "query_index_rows=%zu\n", query_stats.rows);
+		res |= byte_buffer_append_format(&buf, "query_index_extensions=%zu\n", query_stats.extensions);
+		res |= byte_buffer_append_format(&buf, "query_index_memory=%zu\n", query_stats.memory_usage);
+		res |= byte_buffer_append_format(&buf, "query_index_errors=%zu\n", query_stats.errors);
+		res |= byte_buffer_append_format(&buf, "query_index_build_seconds=%.3f\n", query_stats.build_seconds);
+	}
+	res |= byte_buffer_append_format(&buf, "query_index_builds=%" PRIu64 "\n", my_data->query_builds);
+	res |= byte_buffer_append_format(&buf, "queries=%" PRIu64 "\n", my_data->queries);
+	pthread_mutex_unlock(&my_data->query_lock);
+
+	if (my_data->warmup_handle != NULL)
+	{
+		struct warmup_progress progress;
+		warmup_get_progress(my_data->warmup_handle, &progress);
+
+		res |= byte_buffer_append_format(&buf, "warmup_state=%s\n", warmup_state_name(progress.state));
+		res |= byte_buffer_append_format(&buf, "warmup_dirs_done=%" PRIu64 "\n", progress.dirs_done);
+		res |= byte_buffer_append_format(&buf, "warmup_dirs_queued=%" PRIu64 "\n", progress.dirs_queued);
+		res |= byte_buffer_append_format(&buf, "warmup_files_cached=%" PRIu64 "\n", progress.files_cached);
+		res |= byte_buffer_append_format(&buf, "warmup_errors=%" PRIu64 "\n", progress.errors);
+		res |= byte_buffer_append_format(&buf, "warmup_seconds=%.1f\n", progress.elapsed);
+	}
+	else
+	{
+		res |= byte_buffer_append_format(&buf, "warmup_state=%s\n", (my_data->warmup) ? "failed" : "disabled");
+	}
+
+	if (res != 0)
+	{
+		byte_buffer_free(&buf);
+		return -ENOMEM;
+	}
+
+	*data = (char *)buf.data;
+	*size = buf.len;
+	return 0;
+}
+
+/**
+ * Create or replace an index file, a directory or a symlink of the ingested record
+ * (see struct ingest_sink)
+ *
+ * @param ctx is the open ingest file (struct my_ingest_file)
+ * @param record is the record
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int ingest_put(void *ctx, const struct ingest_record *record)
+{
+	struct my_ingest_file *ingest = (struct my_ingest_file *)ctx;
+
+	int res = ingest_writer_put(&ingest->writer, record);
+	if (res != 0)
+		return res;
+
+	metadata_cache_remove(&MY_DATA->metadata_cache, record->path);
+
+	// Ingested files are moved into manifests as written ones
+	if (MY_DATA->manifests && S_ISREG(record->my_stat.mode))
+		return manifest_writer_add(&MY_DATA->manifest_writer, record->path);
+
+	return 0;
+}
+
+/**
+ * Finish a batch of ingested records (see struct ingest_sink)
+ *
+ * @param ctx is the open ingest file (struct my_ingest_file)
+ * @param last is true if the writer flushed the file
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int ingest_commit(void *ctx, bool last)
+{
+	struct my_ingest_file *ingest = (struct my_ingest_file *)ctx;
+
+	// A batch can create entries in any directory, so missing names are forgotten at once
+	negative_cache_invalidate_tree(&MY_DATA->negative_cache, "");
+
+	if (!last)
+		return 0;
+
+	// Moving files into manifests changes mtimes of directories, so it goes first
+	int res = 0;
+	if (MY_DATA->manifests)
+		res = manifest_writer_flush(&MY_DATA->manifest_writer);
+
+	int finish_res = ingest_writer_finish(&ingest->writer);
+	return (res != 0) ? res : finish_res;
+}
+
+/**
+ * Add missing parent directories of the path to the single-file catalog
+ *
+ * @param path is the path of the entry
+ * @param my_stat is the metadata of the entry (owner and times are used for new directories)
+ * @return 0 on success, negative value on error
+ */
+static int ingest_db_add_parents(const char *path, const struct filestat *my_stat)
+{
+	char *parent = strdup(path);
+	if (parent == NULL)
+		return -ENOMEM;
+
+	int res = 0;
+	for (char *slash = strchr(parent, '/'); slash != NULL && res == 0; slash = strchr(slash + 1, '/'))
+	{
+		*slash = '\0';
+
+		struct catalog_db_entry entry;
+		res = catalog_db_lookup(MY_DATA->db, parent, &entry);
+		if (res == -ENOENT)
+		{
+			memset(&entry, 0, sizeof(struct catalog_db_entry));
+			entry.my_stat = *my_stat;
+			entry.my_stat.mode = S_IFDIR | 0755;
+			entry.my_stat.size = 0;
+			entry.my_stat.blocks = 0;
+			entry.my_stat.nlink = 2;
+			entry.my_stat.sha256[0] = '\0';
+			res = catalog_db_add(MY_DATA->db, parent, &entry);
+		}
+
+		*slash = '/';
+	}
+
+	free(parent);
+	return res;
+}
+
+/**
+ * Create or replace an entry of the single-file catalog of the ingested record
+ * (see struct ingest_sink)
+ *
+ * @param ctx is the open ingest file (not used)
+ * @param record is the record
+ * @return 0 on success, negative value on error
+ */
+static int ingest_db_put(void *ctx, const struct ingest_record *record)
+{
+	(void)ctx;
+
+	struct catalog_db_entry entry;
+	memset(&entry, 0, sizeof(struct catalog_db_entry));
+	entry.my_stat = record->my_stat;
+	if (record->link_target != NULL)
+	{
+		if (strlen(record->link_target) > CATALOG_DB_MAX_LINK_TARGET)
+			return -ENAMETOOLONG;
+		strcpy(entry.link_target, record->link_target);
+	}
+
+	struct catalog_db_entry existing;
+	int res = catalog_db_lookup(MY_DATA->db, record->path, &existing);
+	if (res == 0)
+	{
+		mode_t existing_type = (mode_t)existing.my_stat.mode & S_IFMT;
+		mode_t type = (mode_t)entry.my_stat.mode & S_IFMT;
+		if (existing_type == type)
+			return catalog_db_update(MY_DATA->db, record->path, &entry);
+
+		// Files and symlinks replace each other as in the source directory, directories are kept
+		if (existing_type == S_IFDIR || type == S_IFDIR)
+			return -EEXIST;
+
+		res = catalog_db_remove(MY_DATA->db, record->path, false);
+		if (res != 0)
+			return res;
+	}
+	else if (res != -ENOENT)
+	{
+		return res;
+	}
+
+	res = catalog_db_add(MY_DATA->db, record->path, &entry);
+	if (res == -ENOENT)
+	{
+		res = ingest_db_add_parents(record->path, &record->my_stat);
+		if (res == 0)
+			res = catalog_db_add(MY_DATA->db, record->path, &entry);
+	}
+
+	return res;
+}
+
+/**
+ * Finish a batch of ingested records of the single-file catalog (see struct ingest_sink)
+ *
+ * @param ctx is the open ingest file (not used)
+ * @param last is true if the writer flushed the file
+ * @return 0 on success, negative value on error
+ */
+static int ingest_db_commit(void *ctx, bool last)
+{
+	(void)ctx;
+	(void)last;
+
+	// Batches are committed in groups like other changes
+	return catalog_db_commit_if_due(MY_DATA->db);
+}
+
+/**
+ * Open the ingest control file for writing
+ *
+ * @param fi is the file info (fh gets the control file)
+ * @return 0 on success, negative value on error
+ */
+static int open_ingest_file(struct fuse_file_info *fi)
+{
+	// Records must not be overwritten later by metadata of files released before
+	int res = write_behind_flush(MY_DATA->write_behind_handle);
+	if (res != 0)
+	{
+		Log(MY_DATA->logfile, true, __func__, NULL, "failed to save metadata of released files (code: %d)", res);
+	}
+
+	struct my_ingest_file *ingest = (struct my_ingest_file *)calloc(1, sizeof(struct my_ingest_file));
+	if (ingest == NULL)
+		return -ENOMEM;
+
+	ingest_writer_init(&ingest->writer, MY_DIR_FD, MY_DATA->storage);
+
+	struct ingest_sink sink;
+	sink.ctx = ingest;
+	sink.put = (MY_DATA->db != NULL) ? ingest_db_put : ingest_put;
+	sink.commit = (MY_DATA->db != NULL) ? ingest_db_commit : ingest_commit;
+
+	// Records without owner and time get ones of the writer and of the opening
+	struct filestat defaults;
+	memset(&defaults, 0, sizeof(struct filestat));
+	struct timespec now;
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+	defaults.uid = (uint32_t)fuse_get_context()->uid;
+	defaults.gid = (uint32_t)fuse_get_context()->gid;
+	defaults.mtime = (int64_t)now.tv_sec;
+	defaults.mtimensec = (int64_t)now.tv_nsec;
+
+	res = ingest_stream_init(&ingest->stream, &sink, &defaults);
+	if (res != 0)
+	{
+		free(ingest);
+		return res;
+	}
+
+	struct control_file *file = control_file_new(CONTROL_NODE_INGEST, NULL, 0);
+	if (file == NULL)
+	{
+		ingest_stream_free(&ingest->stream);
+		free(ingest);
+		return -ENOMEM;
+	}
+
+	file->state = ingest;
+
+	// Writes are not cached, offsets are ignored (the file is a stream)
+	fi->direct_io = 1;
+	fi->fh = (uint64_t)(uintptr_t)file;
+	return 0;
+}
+
+/**
+ * Add counters of the ingest file to counters of the filesystem
+ *
+ * @param ingest is the open ingest file
+ */
+static void count_ingest_file(struct my_ingest_file *ingest)
+{
+	if (ingest->stream.applied != ingest->counted_records)
+		note_catalog_change();
+
+	MY_DATA->ingest_records += ingest->stream.applied - ingest->counted_records;
+	MY_DATA->ingest_errors += ingest->stream.errors - ingest->counted_errors;
+	ingest->counted_records = ingest->stream.applied;
+	ingest->counted_errors = ingest->stream.errors;
+}
+
+/**
+ * Apply the waiting records of the ingest file and log the first error
+ *
+ * @param ingest is the open ingest file
+ * @param path is the path of the file (for the log)
+ * @return 0 on success, the first error since the previous flush otherwise
+ */
+static int flush_ingest_file(struct my_ingest_file *ingest, const char *path)
+{
+	int res = ingest_stream_flush(&ingest->stream);
+	count_ingest_file(ingest);
+	if (res != 0)
+	{
+		Log(MY_DATA->logfile, true, __func__, path, "%" PRIu64 " records failed, first: %s",
+			ingest->stream.errors, ingest->stream.first_error_message);
+	}
+
+	return res;
+}
+
+/**
+ * Release a reference to a snapshot of the query index
+ *
+ * @param snapshot is the snapshot (can be NULL)
+ */
+static void release_query_snapshot(struct my_query_snapshot *snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	pthread_mutex_lock(&MY_DATA->query_lock);
+	bool last = (--snapshot->refs == 0);
+	pthread_mutex_unlock(&MY_DATA->query_lock);
+
+	if (last)
+	{
+		query_index_free(snapshot->index);
+		free(snapshot);
+	}
+}
+
+/**
+ * Take a reference to the current snapshot of the query index.
+ * The index is built on the first query and rebuilt if the catalog was changed
+ * since its build, concurrent queries wait for the build.
+ *
+ * @param snapshot is the referenced snapshot (must be released by release_query_snapshot())
+ * @return 0 on success, negative value on error
+ */
+static int acquire_query_snapshot(struct my_query_snapshot **snapshot)
+{
+	pthread_mutex_lock(&MY_DATA->query_lock);
+
+	uint64_t generation = __atomic_load_n(&MY_DATA->catalog_generation, __ATOMIC_RELAXED);
+	struct my_query_snapshot *current = MY_DATA->query_snapshot;
+	if (current == NULL || current->generation != generation)
+	{
+		// Metadata of released files must be in index files before they are indexed
+		int res = write_behind_flush(MY_DATA->write_behind_handle);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, NULL, "failed to save metadata of released files (code: %d)", res);
+		}
+
+		struct my_query_snapshot *built = (struct my_query_snapshot *)calloc(1, sizeof(struct my_query_snapshot));
+		if (built == NULL)
+		{
+			pthread_mutex_unlock(&MY_DATA->query_lock);
+			return -ENOMEM;
+		}
+
+		// The loader of readdirplus is not shared, the build has its own one
+		struct batch_loader *loader = NULL;
+		if (MY_DATA->db != NULL)
+		{
+			res = query_index_build_db(&built->index, MY_DATA->db);
+		}
+		else
+		{
+			if (batch_loader_new(&loader, BATCH_LOADER_DEFAULT_DEPTH) != 0)
+				loader = NULL;
+			res = query_index_build_dir(&built->index, MY_DIR_FD, loader);
+			batch_loader_free(loader);
+		}
+
+		if (res != 0)
+		{
+			pthread_mutex_unlock(&MY_DATA->query_lock);
+			free(built);
+			Log(MY_DATA->logfile, true, __func__, NULL, "failed to build query index (code: %d)", res);
+			return res;
+		}
+
+		built->generation = generation;
+		built->refs = 1;
+		MY_DATA->query_builds++;
+		MY_DATA->query_snapshot = built;
+
+		// Open query directories keep the old snapshot until they are released
+		if (current != NULL && --current->refs == 0)
+		{
+			query_index_free(current->index);
+			free(current);
+		}
+		current = built;
+	}
+
+	current->refs++;
+	*snapshot = current;
+	pthread_mutex_unlock(&MY_DATA->query_lock);
+	return 0;
+}
+
+/**
+ * Find the entry of a result of the query directory
+ *
+ * @param path is the absolute path of the result (CONTROL_NODE_QUERY_RESULT)
+ * @param target is the new allocated target of the symlink (must be freed)
+ * @return 0 on success, -ENOENT if there is no such result, other negative value on error
+ */
+static int get_query_result_target(const char *path, char **target)
+{
+	struct query query;
+	const char *name;
+	int res = control_parse_query(path, &query, &name);
+	if (res != 0 || name == NULL)
+		return -ENOENT;
+
+	struct my_query_snapshot *snapshot;
+	res = acquire_query_snapshot(&snapshot);
+	if (res != 0)
+		return res;
+
+	uint32_t row;
+	res = control_query_result_find(snapshot->index, name, &row);
+	if (res == 0 && !query_index_match(snapshot->index, &query, row))
+		res = -ENOENT;
+	if (res == 0)
+	{
+		*target = control_query_result_target(snapshot->index, row, query.count);
+		if (*target == NULL)
+			res = -ENOMEM;
+	}
+
+	release_query_snapshot(snapshot);
+	return res;
+}
+
+/**
+ * Find results of the query of a directory of predicates
+ *
+ * @param path is the absolute path of the directory (CONTROL_NODE_QUERY_DIR)
+ * @param query_dir is the new listing (NULL for the query directory itself, it lists nothing)
+ * @return 0 on success, negative value on error
+ */
+static int open_query_dir(const char *path, struct my_query_dir **query_dir)
+{
+	struct query query;
+	const char *name;
+	int res = control_parse_query(path, &query, &name);
+	if (res != 0 || name != NULL)
+		return -ENOTDIR;
+
+	*query_dir = NULL;
+	if (query.count == 0)
+		return 0;
+
+	struct my_query_dir *result = (struct my_query_dir *)calloc(1, sizeof(struct my_query_dir));
+	if (result == NULL)
+		return -ENOMEM;
+
+	res = acquire_query_snapshot(&result->snapshot);
+	if (res == 0)
+		res = query_index_run(result->snapshot->index, &query, &result->rows, &result->count);
+	if (res != 0)
+	{
+		release_query_snapshot(result->snapshot);
+		free(result);
+		return res;
+	}
+
+	pthread_mutex_lock(&MY_DATA->query_lock);
+	MY_DATA->queries++;
+	pthread_mutex_unlock(&MY_DATA->query_lock);
+
+	*query_dir = result;
+	return 0;
+}
+
+/**
+ * Free results of a directory of predicates
+ *
+ * @param query_dir is the listing (can be NULL)
+ */
+static void free_query_dir(struct my_query_dir *query_dir)
+{
+	if (query_dir == NULL)
+		return;
+
+	release_query_snapshot(query_dir->snapshot);
+	free(query_dir->rows);
+	free(query_dir);
+}
+
+/* ----------------------------------------------------------- *
+ * Implementation of FUSE callbacks.
+ * Functions that implement fuse_operations callback functions.
+ * NOTE: See FUSE documentation for more details.
+ * ----------------------------------------------------------- */
+
+/** Initialize filesystem */
+static void *catalogfs_init(struct fuse_conn_info *conn,
+							struct fuse_config *cfg)
+{
+	LOG_START(NULL)
+
+	(void)conn;
+	cfg->use_ino = 1;
+
+	/*
+	 * Pick up changes from the lower filesystem right away.
+	 * This is also necessary for better hardlink support.
+	 * When the kernel calls the unlink() handler, it does not 
+	 * know the inode of the to-be-removed entry and can 
+	 * therefore not invalidate the cache of the associated 
+	 * inode - resulting in an incorrect st_nlink value being 
+	 * reported for any remaining hardlinks to this inode. 
+	 */
+	cfg->entry_timeout = 0;
+	cfg->attr_timeout = 0;
+
+	/*
+	 * Missing names can be cached by the kernel though: names created through
+	 * the filesystem invalidate negative entries in the kernel anyway,
+	 * so the timeout only delays noticing of files created directly in the source.
+	 */
+	cfg->negative_timeout = MY_DATA->negative_timeout;
+
+	/*
+	 * Attributes are cached by the kernel only while every change of the source
+	 * is reported (the watcher thread is started here for the same reason as warm-up
+	 * below). Entries are not: fuse_invalidate_path() invalidates an inode and not
+	 * the entries below it, so paths through a moved or removed directory would keep
+	 * resolving until entry_timeout. A lookup still answers a stat() without a separate
+	 * getattr, and open files don't ask for attributes again. Names created directly
+	 * in the source still appear after negative_timeout, there are no entries of the
+	 * kernel to invalidate for them.
+	 */
+	if (MY_DATA->watch)
+	{
+		MY_DATA->fuse = fuse_get_context()->fuse;
+
+		int res = source_watch_start(&MY_DATA->watch_handle, MY_DIR_FD, invalidate_kernel_changes, MY_DATA);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, NULL,
+				"failed to watch source directory, kernel cache is disabled (code: %d%s)", res,
+				(res == -ENOSPC) ? ", see fs.inotify.max_user_watches" : "");
+			MY_DATA->watch_handle = NULL;
+		}
+		else
+		{
+			cfg->attr_timeout = MY_DATA->cache_timeout;
+			MY_DATA->negative_cache.watched = true;
+			MY_DATA->dir_fd_cache.watched = true;
+		}
+	}
+
+	/*
+	 * Warm-up threads are started here and not in main() because fuse_main()
+	 * may fork to daemonize and threads do not survive fork().
+	 */
+	if (MY_DATA->warmup)
+	{
+		int res = warmup_start(&MY_DATA->warmup_handle, MY_DIR_FD, &MY_DATA->metadata_cache, MY_DATA->warmup_threads);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, NULL, "failed to start warm-up (code: %d)", res);
+		}
+	}
+
+	/*
+	 * The write-behind thread is started here for the same reason,
+	 * without it metadata of released files is saved synchronously.
+	 */
+	if (MY_DATA->write_behind)
+	{
+		int res = write_behind_start(&MY_DATA->write_behind_handle, MY_DATA->storage, MY_DATA->write_behind_durability);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, NULL, "failed to start write-behind (code: %d)", res);
+		}
+	}
+
+	/*
+	 * Changes of a single-file catalog are committed by requests and, after a pause
+	 * of requests, by the commit thread (started here for the same reason as warm-up).
+	 * Removed open files are not renamed to hidden entries, there are no index files to keep.
+	 */
+	if (MY_DATA->db != NULL)
+	{
+		cfg->hard_remove = 1;
+
+		int res = catalog_db_start_commit_thread(MY_DATA->db);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, NULL, "failed to start commit thread (code: %d)", res);
+		}
+	}
+
+	/*
+	 * The loader falls back to usual system calls itself if io_uring is not available,
+	 * only ENOMEM leaves it NULL (then readdirplus loads directories synchronously).
+	 */
+	if (batch_loader_new(&MY_DATA->loader, BATCH_LOADER_DEFAULT_DEPTH) != 0)
+	{
+		MY_DATA->loader = NULL;
+	}
+
+	/*
+	 * NOTE: it's possible to check that all functions actually use provided source_dir_fd
+	 * and they do not rely on the CWD. Something like that is possible:
+	 
+	 //chdir("/home/user/some_completely_different_dir/");
+	 */
+
+	/*
+	 * Return pointer to my_private_data stuct, that was allocated in main()
+	 * and passed to fuse_main() as the last argument
+	 */
+	return (void *)MY_DATA;
+}
+
+/** Clean up filesystem */
+static void catalogfs_destroy(void *private_data)
+{
+	LOG_START(NULL)
+
+	// Free the private_data memory, that was allocated in main()
+	if (private_data != NULL)
+	{
+		struct my_private_data *my_data = (struct my_private_data *)private_data;
+		free_my_private_data(my_data);
+	}
+}
+
+/** Get file attributes */
+static int catalogfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	(void)fi;
+
+	apply_source_changes();
+
+	enum control_node control = control_lookup(path);
+	if (control != CONTROL_NODE_NONE)
+	{
+		if (control == CONTROL_NODE_MISSING)
+		{
+			RETURN_CODE_ERROR(path, -ENOENT)
+		}
+
+		struct stat root_stbuf;
+		int res = get_root_stat(&root_stbuf);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		control_fill_stat(control, &root_stbuf, stbuf);
+
+		if (control == CONTROL_NODE_QUERY_RESULT)
+		{
+			char *target;
+			res = get_query_result_target(path, &target);
+			if (res == -ENOENT)
+			{
+				// Names that are not results are usual missing paths
+				RETURN_CODE_OK(path, -ENOENT)
+			}
+			if (res != 0)
+			{
+				RETURN_CODE_ERROR(path, res)
+			}
+
+			stbuf->st_size = (off_t)strlen(target);
+			free(target);
+		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	if (is_manifest_path(path) ||
+		negative_cache_contains(&MY_DATA->negative_cache, MY_DIR_FD, RELPATH(path)))
+	{
+		// Repeated lookup of a known missing path is not an error of the filesystem
+		RETURN_CODE_OK(path, -ENOENT)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	int res = fstatat(dir_fd, name, stbuf, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+	{
+		res = -errno;
+		if (res == -ENOENT)
+		{
+			struct filestat my_stat;
+			if (find_in_manifest(path, dir_fd, name, stbuf, &my_stat) == 0)
+			{
+				res = fill_stat_from_filestat_with_options(
+					stbuf,
+					&my_stat,
+					!(MY_DATA->ignore_saved_chmod),
+					!(MY_DATA->ignore_saved_times),
+					MY_DATA->use_saved_uid,
+					MY_DATA->use_saved_gid);
+				if (res != 0)
+				{
+					RETURN_CODE_ERROR(path, -EPERM)
+				}
+
+				RETURN_CODE_OK(path, 0)
+			}
+
+			negative_cache_add(&MY_DATA->negative_cache, MY_DIR_FD, RELPATH(path));
+		}
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	if (!S_ISREG(stbuf->st_mode) &&
+		!S_ISDIR(stbuf->st_mode) &&
+		!S_ISLNK(stbuf->st_mode))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	// Replace file size that is visible to user for regular files
+	if (S_ISREG(stbuf->st_mode))
+	{
+		struct filestat queued_stat;
+		if (write_behind_get(MY_DATA->write_behind_handle, RELPATH(path), stbuf, &queued_stat))
+		{
+			// Metadata of the released file is not saved yet
+			res = fill_stat_from_filestat_with_options(
+				stbuf,
+				&queued_stat,
+				!(MY_DATA->ignore_saved_chmod),
+				!(MY_DATA->ignore_saved_times),
+				MY_DATA->use_saved_uid,
+				MY_DATA->use_saved_gid);
+			if (res != 0)
+			{
+				RETURN_CODE_ERROR(path, -EPERM)
+			}
+		}
+		else if (MY_DATA->storage == CATALOG_STORAGE_SPARSE &&
+			storage_is_sparse(stbuf) &&
+			!(MY_DATA->use_saved_uid) && !(MY_DATA->use_saved_gid))
+		{
+			// The index file is a sparse copy of the original stat, there is nothing to read
+			// (text index files of a mixed catalog are read below)
+			storage_fill_stat_sparse(stbuf);
+		}
+		else
+		{
+			struct filestat my_stat;
+			if (!metadata_cache_get(&MY_DATA->metadata_cache, RELPATH(path), stbuf, &my_stat))
+			{
+				// Make a skeleton of filestat from a real file
+				res = fill_filestat_from_stat(&my_stat, stbuf);
+				if (res != 0)
+				{
+					RETURN_CODE_ERROR(path, -EPERM)
+				}
+
+				res = storage_read_filestat(dir_fd, name, stbuf, &my_stat);
+				if (res == -ENODATA && stbuf->st_size == 0)
+				{
+					/*
+					* New file, that still was not released, so, there is 
+					* no need to fill its contents with filestat metadata.
+					* Do nothing, let it be as it is for now.
+					*/
+					RETURN_CODE_OK(path, 0)
+				}
+				if (res != 0)
+				{
+					RETURN_CODE_ERROR(path, res)
+				}
+
+				// The cache is best-effort, a full cache is not an error
+				(void)metadata_cache_put(&MY_DATA->metadata_cache, RELPATH(path), stbuf, &my_stat);
+			}
+
+			res = fill_stat_from_filestat_with_options(
+				stbuf,
+				&my_stat,
 				!(MY_DATA->ignore_saved_chmod),
 				!(MY_DATA->ignore_saved_times),
 				MY_DATA->use_saved_uid,
 				MY_DATA->use_saved_gid);
 			if (res != 0)
 			{
-				RETURN_CODE_ERROR(path, -EPERM)
+				RETURN_CODE_ERROR(path, -EPERM)
+			}
+		}
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Read the target of a symbolic link */
+static int catalogfs_readlink(const char *path, char *buf, size_t size)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	enum control_node control = control_lookup(path);
+	if (control != CONTROL_NODE_NONE)
+	{
+		if (control != CONTROL_NODE_QUERY_RESULT)
+		{
+			RETURN_CODE_ERROR(path, (control == CONTROL_NODE_MISSING) ? -ENOENT : -EINVAL)
+		}
+
+		char *target;
+		int res = get_query_result_target(path, &target);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		// Truncated like readlink() does, but null-terminated
+		size_t len = strlen(target);
+		if (len > size - 1)
+			len = size - 1;
+		memcpy(buf, target, len);
+		buf[len] = '\0';
+		free(target);
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	/// NOTE: Passing (size - 1) was taken from the libfuse reference example passthrough_fh.c
+	ssize_t res = readlinkat(dir_fd, name, buf, size - 1);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	buf[res] = '\0'; // be sure to null-terminate according to documentation
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/**
+ * Make a path relative to the source directory for an entry of the directory
+ *
+ * @param dir_path is the absolute path of the directory inside the mounted filesystem
+ * @param name is the name of the entry
+ * @return new allocated relative path, NULL on error
+ */
+static char *make_entry_relpath(const char *dir_path, const char *name)
+{
+	const char *dir_relpath = RELPATH(dir_path);
+	if (strcmp(dir_relpath, ".") == 0)
+		return strdup(name);
+
+	size_t dir_len = strlen(dir_relpath);
+	size_t name_len = strlen(name);
+	char *relpath = (char *)malloc(dir_len + 1 + name_len + 1);
+	if (relpath == NULL)
+		return NULL;
+
+	memcpy(relpath, dir_relpath, dir_len);
+	relpath[dir_len] = '/';
+	memcpy(relpath + dir_len + 1, name, name_len + 1);
+	return relpath;
+}
+
+/**
+ * Get the filestat of an entry of the directory queued by the write-behind or
+ * from the metadata cache (the lookup of readdirplus, see struct catalog_dir_lookup)
+ *
+ * @param ctx is the absolute path of the directory inside the mounted filesystem
+ * @param name is the name of the entry
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target filestat
+ * @return true if the filestat was found and is still valid
+ */
+static bool lookup_cached_filestat(void *ctx, const char *name, const struct stat *stbuf, struct filestat *my_stat)
+{
+	char *relpath = make_entry_relpath((const char *)ctx, name);
+	if (relpath == NULL)
+		return false;
+
+	bool found = (write_behind_get(MY_DATA->write_behind_handle, relpath, stbuf, my_stat) ||
+				  metadata_cache_get(&MY_DATA->metadata_cache, relpath, stbuf, my_stat));
+	free(relpath);
+	return found;
+}
+
+/**
+ * Drop the listing and the loaded chunk of the directory stream
+ *
+ * @param stream is the directory stream
+ */
+static void dir_stream_clear(struct my_dir_stream *stream)
+{
+	catalog_dir_free(&stream->chunk);
+	stream->chunk_start = 0;
+	stream->chunk_end = 0;
+
+	dir_listing_release(stream->listing);
+	stream->listing = NULL;
+}
+
+/**
+ * Get the current listing of the directory for the stream (at offset 0)
+ *
+ * @param stream is the directory stream
+ * @param path is the path of the directory
+ * @return 0 on success, negative value on error
+ */
+static int dir_stream_rewind(struct my_dir_stream *stream, const char *path)
+{
+	dir_stream_clear(stream);
+
+	const struct manifest *manifest = NULL;
+	const char *relpath = RELPATH(path);
+	if (manifest_cache_get(&MY_DATA->manifest_cache, stream->dir_fd, relpath, strlen(relpath), &manifest) != 0)
+		manifest = NULL;
+
+	return dir_listing_cache_get(&MY_DATA->dir_listing_cache, stream->dir_fd, relpath, strlen(relpath),
+								 manifest, &stream->listing);
+}
+
+/**
+ * Load metadata of a chunk of entries of the listing starting at the index.
+ *
+ * Metadata is loaded with the batched loader (io_uring statx and
+ * openat -> read -> close chains for filestat files) and parsed filestats
+ * are put to the metadata cache, so later getattr() calls of the entries do
+ * not read filestat files again. Filestat files of entries that are already
+ * cached (or are in the snapshot of the cache) are not read.
+ *
+ * @param stream is the directory stream with a listing
+ * @param path is the path of the directory
+ * @param index is the index of the first entry of the chunk
+ * @return 0 on success, negative value on error
+ */
+static int dir_stream_load_chunk(struct my_dir_stream *stream, const char *path, size_t index)
+{
+	catalog_dir_free(&stream->chunk);
+	stream->chunk_start = 0;
+	stream->chunk_end = 0;
+
+	const struct manifest *manifest = NULL;
+	const char *relpath = RELPATH(path);
+	if (manifest_cache_get(&MY_DATA->manifest_cache, stream->dir_fd, relpath, strlen(relpath), &manifest) != 0)
+		manifest = NULL;
+
+	// Sparse index files are the metadata themselves, unless saved owners or a manifest are needed
+	// (text index files of a mixed catalog are still read one by one below)
+	bool read_filestats = (MY_DATA->storage != CATALOG_STORAGE_SPARSE ||
+						   MY_DATA->use_saved_uid || MY_DATA->use_saved_gid ||
+						   manifest != NULL);
+
+	struct catalog_dir_lookup lookup;
+	lookup.get = lookup_cached_filestat;
+	lookup.ctx = (void *)path;
+
+	int res = dir_listing_load_entries(stream->listing, index, DIR_STREAM_CHUNK_SIZE, stream->dir_fd,
+									   read_filestats, MY_DATA->loader, &lookup, manifest, &stream->chunk, NULL);
+	if (res != 0)
+		return res;
+
+	stream->chunk_start = index;
+	stream->chunk_end = index + DIR_STREAM_CHUNK_SIZE;
+	if (stream->chunk_end > stream->listing->count)
+		stream->chunk_end = stream->listing->count;
+	stream->chunk_read_filestats = read_filestats;
+
+	for (size_t i = 0; i < stream->chunk.count; i++)
+	{
+		struct catalog_dir_entry *entry = &stream->chunk.entries[i];
+
+		// Sparse index files are not read, but empty ones can have metadata queued by the write-behind
+		if (!read_filestats && MY_DATA->write_behind_handle != NULL &&
+			S_ISREG(entry->stbuf.st_mode) && entry->stbuf.st_size == 0 &&
+			lookup_cached_filestat((void *)path, entry->name, &entry->stbuf, &entry->my_stat))
+		{
+			entry->has_filestat = true;
+			entry->from_lookup = true;
+		}
+
+		// Text index files (e.g. not migrated yet) are read as in getattr()
+		if (!read_filestats && S_ISREG(entry->stbuf.st_mode) && entry->stbuf.st_size != 0 &&
+			!storage_is_sparse(&entry->stbuf))
+		{
+			if (lookup_cached_filestat((void *)path, entry->name, &entry->stbuf, &entry->my_stat))
+			{
+				entry->has_filestat = true;
+				entry->from_lookup = true;
+			}
+			else if (fill_filestat_from_stat(&entry->my_stat, &entry->stbuf) == 0 &&
+					 storage_read_filestat(stream->dir_fd, entry->name, &entry->stbuf, &entry->my_stat) == 0)
+			{
+				entry->has_filestat = true;
+			}
+		}
+
+		// Entries of manifests are looked up in the cached manifest, not in the metadata cache
+		if (!(entry->has_filestat) || entry->from_manifest || entry->from_lookup)
+			continue;
+
+		char *entry_relpath = make_entry_relpath(path, entry->name);
+		if (entry_relpath != NULL)
+		{
+			// The cache is best-effort, a full cache is not an error
+			(void)metadata_cache_put(&MY_DATA->metadata_cache, entry_relpath, &entry->stbuf, &entry->my_stat);
+			free(entry_relpath);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Find the loaded entry of the listing with metadata, the chunk around it
+ * is loaded if needed
+ *
+ * @param stream is the directory stream with a listing
+ * @param path is the path of the directory
+ * @param index is the index of the entry in the listing
+ * @param entry is the found entry (NULL if it can't be listed with attributes)
+ * @return 0 on success, negative value on error
+ */
+static int dir_stream_get_entry(struct my_dir_stream *stream, const char *path, size_t index,
+								const struct catalog_dir_entry **entry)
+{
+	*entry = NULL;
+
+	if (index < stream->chunk_start || index >= stream->chunk_end)
+	{
+		int res = dir_stream_load_chunk(stream, path, index);
+		if (res != 0)
+			return res;
+	}
+
+	// Entries of the chunk are sorted by name like the listing
+	const char *name = stream->listing->entries[index].name;
+	size_t low = 0;
+	size_t high = stream->chunk.count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		int cmp = strcmp(stream->chunk.entries[middle].name, name);
+		if (cmp == 0)
+		{
+			*entry = &stream->chunk.entries[middle];
+			break;
+		}
+
+		if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return 0;
+}
+
+/**
+ * Add an entry with attributes to the buffer of readdirplus.
+ * Entries that getattr() would fail for (unsupported types, broken filestat
+ * files) are not listed by the loader, entries with filestats that can't be
+ * converted are listed without attributes, so getattr() reports the error.
+ *
+ * @param stream is the directory stream
+ * @param entry is the loaded entry
+ * @param buf is the buffer of filler()
+ * @param filler is the function to add entries
+ * @param next_offset is the offset of the next entry
+ * @return result of filler() (nonzero if the buffer is full)
+ */
+static int dir_stream_fill_plus(const struct my_dir_stream *stream, const struct catalog_dir_entry *entry,
+								void *buf, fuse_fill_dir_t filler, off_t next_offset)
+{
+	struct stat stbuf = entry->stbuf;
+
+	if (entry->has_filestat)
+	{
+		int res = fill_stat_from_filestat_with_options(
+			&stbuf,
+			&entry->my_stat,
+			!(MY_DATA->ignore_saved_chmod),
+			!(MY_DATA->ignore_saved_times),
+			MY_DATA->use_saved_uid,
+			MY_DATA->use_saved_gid);
+		if (res != 0)
+			return filler(buf, entry->name, NULL, next_offset, (enum fuse_fill_dir_flags)0);
+	}
+	else if (!(stream->chunk_read_filestats) && storage_is_sparse(&stbuf))
+	{
+		storage_fill_stat_sparse(&stbuf);
+	}
+	else if (!(stream->chunk_read_filestats) && S_ISREG(stbuf.st_mode) && stbuf.st_size != 0)
+	{
+		// A text index file that failed to be read, getattr() reports the error
+		return filler(buf, entry->name, NULL, next_offset, (enum fuse_fill_dir_flags)0);
+	}
+
+	return filler(buf, entry->name, &stbuf, next_offset, FUSE_FILL_DIR_PLUS);
+}
+
+/** Open directory */
+static int catalogfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	fi->fh = 0;
+
+	enum control_node control = control_lookup(path);
+	if (control != CONTROL_NODE_NONE)
+	{
+		if (control == CONTROL_NODE_QUERY_DIR)
+		{
+			// Results are found once, so the listing is consistent between readdir() calls
+			struct my_query_dir *query_dir;
+			int res = open_query_dir(path, &query_dir);
+			if (res != 0)
+			{
+				RETURN_CODE_ERROR(path, res)
+			}
+
+			fi->fh = (uint64_t)(uintptr_t)query_dir;
+			RETURN_CODE_OK(path, 0)
+		}
+
+		if (control != CONTROL_NODE_DIR)
+		{
+			RETURN_CODE_ERROR(path, (control == CONTROL_NODE_MISSING) ? -ENOENT : -ENOTDIR)
+		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	struct my_dir_stream *stream = (struct my_dir_stream *)calloc(1, sizeof(struct my_dir_stream));
+	if (stream == NULL)
+	{
+		(void)close(fd);
+		RETURN_CODE_ERROR(path, -ENOMEM)
+	}
+
+	stream->dir_fd = fd;
+	fi->fh = (uint64_t)(uintptr_t)stream;
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/**
+ * Read directory.
+ *
+ * Entries are returned from the listing of the directory kept by the stream
+ * of opendir() (see dir_listing.h): offsets of "." and ".." are 1 and 2,
+ * the offset of the entry i of the listing is i + 3, so every call resumes
+ * at its offset and stops as soon as the buffer is full. The listing is taken
+ * again (from the cache if the directory was not changed) at offset 0.
+ * Entries of the manifest of the directory are listed, reserved names are not.
+ */
+static int catalogfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+							 off_t offset, struct fuse_file_info *fi,
+							 enum fuse_readdir_flags flags)
+{
+	LOG_START(path)
+
+	enum control_node control = control_lookup(path);
+	if (control == CONTROL_NODE_QUERY_DIR)
+	{
+		// Offsets are the same as for usual directories: results start at 3
+		struct my_query_dir *query_dir = (fi != NULL) ? (struct my_query_dir *)(uintptr_t)fi->fh : NULL;
+		if (offset < 1 && filler(buf, ".", NULL, 1, (enum fuse_fill_dir_flags)0) != 0)
+		{
+			RETURN_CODE_OK(path, 0)
+		}
+		if (offset < 2 && filler(buf, "..", NULL, 2, (enum fuse_fill_dir_flags)0) != 0)
+		{
+			RETURN_CODE_OK(path, 0)
+		}
+
+		char name[NAME_MAX + 1];
+		for (size_t i = (offset > 2) ? (size_t)offset - 2 : 0; query_dir != NULL && i < query_dir->count; i++)
+		{
+			control_query_result_name(query_dir->snapshot->index, query_dir->rows[i], name);
+			if (filler(buf, name, NULL, (off_t)i + 3, (enum fuse_fill_dir_flags)0) != 0)
+				break;
+		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+	if (control != CONTROL_NODE_NONE)
+	{
+		if (control != CONTROL_NODE_DIR)
+		{
+			RETURN_CODE_ERROR(path, -ENOTDIR)
+		}
+
+		filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
+		filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
+		for (const char *const *name = control_dir_names(); *name != NULL; name++)
+		{
+			filler(buf, *name, NULL, 0, (enum fuse_fill_dir_flags)0);
+		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	struct my_dir_stream *stream = (fi != NULL) ? (struct my_dir_stream *)(uintptr_t)fi->fh : NULL;
+	if (stream == NULL || offset < 0)
+	{
+		RETURN_CODE_ERROR(path, -EBADF)
+	}
+
+	if (offset == 0 || stream->listing == NULL)
+	{
+		int res = dir_stream_rewind(stream, path);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	if (offset < 1 && filler(buf, ".", NULL, 1, (enum fuse_fill_dir_flags)0) != 0)
+	{
+		RETURN_CODE_OK(path, 0)
+	}
+	if (offset < 2 && filler(buf, "..", NULL, 2, (enum fuse_fill_dir_flags)0) != 0)
+	{
+		RETURN_CODE_OK(path, 0)
+	}
+
+	bool plus = ((flags & FUSE_READDIR_PLUS) != 0);
+	const struct dir_listing *listing = stream->listing;
+	for (size_t i = (offset > 2) ? (size_t)offset - 2 : 0; i < listing->count; i++)
+	{
+		off_t next_offset = (off_t)i + 3;
+
+		if (!plus)
+		{
+			/*
+			 * Do not fill mode_t argument of filler() as we have no proper path,
+			 * FUSE will ask for mode_t later itself (on file-by-file basis via getattr())
+			 */
+			if (filler(buf, listing->entries[i].name, NULL, next_offset, (enum fuse_fill_dir_flags)0) != 0)
+				break;
+			continue;
+		}
+
+		const struct catalog_dir_entry *entry;
+		int res = dir_stream_get_entry(stream, path, i, &entry);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		if (entry != NULL && dir_stream_fill_plus(stream, entry, buf, filler, next_offset) != 0)
+			break;
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Release directory */
+static int catalogfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	if (path != NULL && control_is_path(path))
+	{
+		if (fi != NULL)
+		{
+			free_query_dir((struct my_query_dir *)(uintptr_t)fi->fh);
+			fi->fh = 0;
+		}
+		RETURN_CODE_OK(path, 0)
+	}
+
+	struct my_dir_stream *stream = (fi != NULL) ? (struct my_dir_stream *)(uintptr_t)fi->fh : NULL;
+	if (stream != NULL)
+	{
+		dir_stream_clear(stream);
+		(void)close(stream->dir_fd);
+		free(stream);
+		fi->fh = 0;
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Create a directory */
+static int catalogfs_mkdir(const char *path, mode_t mode)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	int res;
+
+	if (control_is_path(path) || is_manifest_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	res = mkdirat(dir_fd, name, mode);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	negative_cache_invalidate(&MY_DATA->negative_cache, RELPATH(path));
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Remove a file */
+static int catalogfs_unlink(const char *path)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	int res;
+
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	res = unlinkat(dir_fd, name, 0);
+	if (res == -1)
+	{
+		res = -errno;
+		if (res == -ENOENT && is_in_manifest(path, dir_fd, name))
+			res = remove_from_manifest(dir_fd, name);
+
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+	else if (is_in_manifest(path, dir_fd, name))
+	{
+		// Otherwise the hidden entry of the manifest would show up instead of the removed file
+		res = remove_from_manifest(dir_fd, name);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	negative_cache_invalidate(&MY_DATA->negative_cache, RELPATH(path));
+	metadata_cache_remove(&MY_DATA->metadata_cache, RELPATH(path));
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Remove a directory */
+static int catalogfs_rmdir(const char *path)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	int res;
+
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	// A manifest without entries must not keep the directory from being removed
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd != -1)
+	{
+		res = manifest_remove_if_empty(fd);
+		(void)close(fd);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	res = unlinkat(dir_fd, name, AT_REMOVEDIR);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	dir_fd_cache_invalidate_tree(&MY_DATA->dir_fd_cache, RELPATH(path));
+
+	negative_cache_invalidate_tree(&MY_DATA->negative_cache, RELPATH(path));
+	metadata_cache_remove_tree(&MY_DATA->metadata_cache, RELPATH(path));
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Create a symbolic link */
+static int catalogfs_symlink(const char *from, const char *to)
+{
+	LOG_START(from)
+
+	apply_source_changes();
+
+	int res;
+
+	if (control_is_path(to) || is_manifest_path(to))
+	{
+		RETURN_CODE_ERROR(from, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(to, name);
+
+	res = symlinkat(from, dir_fd, name);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(from, -errno)
+	}
+
+	negative_cache_invalidate(&MY_DATA->negative_cache, RELPATH(to));
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(from, 0)
+}
+
+/** Rename a file */
+static int catalogfs_rename(const char *from, const char *to, unsigned int flags)
+{
+	LOG_START(from)
+
+	apply_source_changes();
+
+	int res;
+
+	/**
+	 * NOTE: renameat2() supports flags, we can pass them.
+	 * Not sure is it possible to have problems with allowing flags.
+	 * But we will avoid those anyway by not allowing flags for stability.
+	*/
+	if (flags)
+	{
+		RETURN_CODE_ERROR(from, -EINVAL)
+	}
+
+	if (control_is_path(from) || control_is_path(to) ||
+		is_manifest_path(from) || is_manifest_path(to))
+	{
+		RETURN_CODE_ERROR(from, -EPERM)
+	}
+
+	// Pending files are queued by paths that can be changed by this call
+	if (MY_DATA->manifests)
+	{
+		res = manifest_writer_flush(&MY_DATA->manifest_writer);
+		if (res != 0)
+		{
+			Log(MY_DATA->logfile, true, __func__, from, "failed to write manifest (code: %d)", res);
+		}
+	}
+
+	// Both descriptors stay open during two resolutions
+	const char *from_name;
+	int from_dir_fd = RESOLVE_AT(from, from_name);
+	const char *to_name;
+	int to_dir_fd = RESOLVE_AT(to, to_name);
+
+	// Queued records are found by the old paths, so they are saved before the paths change
+	if (MY_DATA->write_behind_handle != NULL)
+	{
+		if (S_ISDIR(get_mode_by_path(from_dir_fd, from_name)))
+		{
+			res = write_behind_flush(MY_DATA->write_behind_handle);
+			if (res != 0)
+			{
+				Log(MY_DATA->logfile, true, __func__, from, "failed to save metadata of released files (code: %d)", res);
+			}
+		}
+		else
+		{
+			write_behind_flush_path(MY_DATA->write_behind_handle, RELPATH(from));
+		}
+	}
+
+	res = renameat2(from_dir_fd, from_name, to_dir_fd, to_name, flags);
+	if (res == -1)
+	{
+		res = -errno;
+		if (res == -ENOENT)
+			res = rename_manifest_entry(from, from_dir_fd, from_name, to, to_dir_fd, to_name);
+
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(from, res)
+		}
+	}
+	else if (is_in_manifest(to, to_dir_fd, to_name))
+	{
+		// Otherwise the replaced entry would show up again after the new one is removed
+		res = remove_from_manifest(to_dir_fd, to_name);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(from, res)
+		}
+	}
+
+	bool is_dir = S_ISDIR(get_mode_by_path(to_dir_fd, to_name));
+
+	// Descriptors of the moved directory and of a replaced one follow them, not the paths
+	dir_fd_cache_invalidate_tree(&MY_DATA->dir_fd_cache, RELPATH(from));
+	dir_fd_cache_invalidate_tree(&MY_DATA->dir_fd_cache, RELPATH(to));
+
+	negative_cache_invalidate_tree(&MY_DATA->negative_cache, RELPATH(from));
+	negative_cache_invalidate_tree(&MY_DATA->negative_cache, RELPATH(to));
+
+	metadata_cache_remove(&MY_DATA->metadata_cache, RELPATH(from));
+	if (is_dir)
+	{
+		metadata_cache_remove_tree(&MY_DATA->metadata_cache, RELPATH(from));
+	}
+
+	/**
+	 * NOTE: we do not change the name field inside filestat file.
+	 * In the latest format there is no name field at all.
+	 * And in older formats it is preserved original for several purposes,
+	 * one of them being - to preserve the original archival information.
+	 */
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(from, 0)
+}
+
+/** Create a hard link to a file */
+static int catalogfs_link(const char *from, const char *to)
+{
+	LOG_START(from)
+
+	apply_source_changes();
+
+	int res;
+
+	if (control_is_path(from) || control_is_path(to) || is_manifest_path(to))
+	{
+		RETURN_CODE_ERROR(from, -EPERM)
+	}
+
+	// Both descriptors stay open during two resolutions
+	const char *from_name;
+	int from_dir_fd = RESOLVE_AT(from, from_name);
+	const char *to_name;
+	int to_dir_fd = RESOLVE_AT(to, to_name);
+
+	res = linkat(from_dir_fd, from_name, to_dir_fd, to_name, 0);
+	if (res == -1)
+	{
+		res = -errno;
+
+		// Entries of manifests have no files to link to
+		if (res == -ENOENT && is_in_manifest(from, from_dir_fd, from_name))
+			res = -EPERM;
+
+		RETURN_CODE_ERROR(from, res)
+	}
+
+	negative_cache_invalidate(&MY_DATA->negative_cache, RELPATH(to));
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(from, 0)
+}
+
+/** Change the permission bits of a file */
+static int catalogfs_chmod(const char *path, mode_t mode,
+						   struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	(void)fi;
+	int res;
+
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	// The queued record of a released file would undo the change when it's saved (e.g. cp -p)
+	write_behind_flush_path(MY_DATA->write_behind_handle, RELPATH(path));
+
+	res = fchmodat(dir_fd, name, mode, 0);
+
+	if (res == -1)
+	{
+		res = -errno;
+
+		// Entries of manifests have no real files, their stored metadata is kept anyway
+		if (res != -ENOENT || !is_in_manifest(path, dir_fd, name))
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	/**
+	 * NOTE: we do not change mode field inside filestat file.
+	 * It's preserved original for several purposes,
+	 * one of them being - to preserve the original archival information.
+	 * 
+	 * To change mode field in the file - one need to reopen or recreate it.
+	 */
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Change the owner and group of a file */
+static int catalogfs_chown(const char *path, uid_t uid, gid_t gid,
+						   struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	(void)fi;
+	int res;
+
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	// The queued record of a released file would undo the change when it's saved (e.g. cp -p)
+	write_behind_flush_path(MY_DATA->write_behind_handle, RELPATH(path));
+
+	res = fchownat(dir_fd, name,
+				   uid, gid, AT_SYMLINK_NOFOLLOW);
+
+	if (res == -1)
+	{
+		res = -errno;
+
+		// Entries of manifests have no real files, their stored metadata is kept anyway
+		if (res != -ENOENT || !is_in_manifest(path, dir_fd, name))
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	/**
+	 * NOTE: we do not change own fields inside filestat file.
+	 * It's preserved original for several purposes,
+	 * one of them being - to preserve the original archival information.
+	 * 
+	 * To change own fields in the file - one need to reopen or recreate it.
+	 */
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Change the access and modification times of a file with nanosecond resolution */
+static int catalogfs_utimens(const char *path, const struct timespec ts[2],
+							 struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	(void)fi;
+	int res;
+
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	/* don't use utime/utimes since they follow symlinks */
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+
+	// The queued record of a released file would undo the change when it's saved (e.g. cp -p)
+	write_behind_flush_path(MY_DATA->write_behind_handle, RELPATH(path));
+
+	res = utimensat(dir_fd, name, ts, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+	{
+		res = -errno;
+
+		// Entries of manifests have no real files, their stored metadata is kept anyway
+		if (res != -ENOENT || !is_in_manifest(path, dir_fd, name))
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	/**
+	 * NOTE: we do not change time fields inside filestat file.
+	 * It's preserved original for several purposes,
+	 * one of them being - to preserve the original archival information.
+	 * 
+	 * To change time fields in the file - one need to reopen or recreate it.
+	 */
+
+	note_catalog_change();
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Create and open a file */
+static int catalogfs_create(const char *path, mode_t mode,
+							struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	if (!S_ISREG(mode) || control_is_path(path) || is_manifest_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	if (fi == NULL)
+	{
+		RETURN_CODE_ERROR(path, -EINVAL)
+	}
+
+	// Store my_fh_fileinfo if needed and it's a regular file
+	if (fi->fh == 0 && S_ISREG(mode))
+	{
+		const char *name;
+		int dir_fd = RESOLVE_AT(path, name);
+
+		int fd = openat(dir_fd, name, fi->flags, mode);
+		if (fd == -1)
+		{
+			RETURN_CODE_ERROR(path, -errno)
+		}
+
+		negative_cache_invalidate(&MY_DATA->negative_cache, RELPATH(path));
+
+		struct my_fh_fileinfo *data = (struct my_fh_fileinfo *)malloc(sizeof(struct my_fh_fileinfo));
+		if (data == NULL)
+		{
+			(void)close(fd);
+			RETURN_CODE_ERROR(path, -ENOMEM)
+		}
+		else
+		{
+			/**
+			 * NOTE: the `else` statement by itself is redundant here, 
+			 * because previous if() has return inside,
+			 * but clang analyzer does not see return in RETURN_CODE macro 
+			 * and provides with a warning that data pointer can be NULL.
+			 */
+
+			memset(data, 0, sizeof(struct my_fh_fileinfo));
+
+			// Keep file descriptor
+			data->file_fd = fd;
+
+			// Set size to zero as it's create() function
+			data->file_size = 0;
+
+			/// NOTE: This FUSE convention causes false cppcheck warning about potential memory leak
+			fi->fh = (uint64_t)data;
+		}
+	}
+
+	note_catalog_change();
+
+	/// NOTE: The FUSE convention above causes false cppcheck warning about potential memory leak
+	// cppcheck-suppress memleak
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Open a file */
+static int catalogfs_open(const char *path, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	// Records written to the ingest file create entries
+	enum control_node control = control_lookup(path);
+	if (control == CONTROL_NODE_INGEST && fi != NULL && (fi->flags & O_ACCMODE) == O_WRONLY)
+	{
+		int res = open_ingest_file(fi);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		// cppcheck-suppress memleak
+		RETURN_CODE_OK(path, 0)
+	}
+
+	// Other control files are generated on open and are read-only
+	if (control == CONTROL_NODE_STATS && fi != NULL && (fi->flags & O_ACCMODE) == O_RDONLY)
+	{
+		char *data;
+		size_t size;
+		int res = format_stats(MY_DATA, &data, &size);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		struct control_file *file = control_file_new(control, data, size);
+		if (file == NULL)
+		{
+			RETURN_CODE_ERROR(path, -ENOMEM)
+		}
+		else
+		{
+			// Size of the file is unknown for getattr(), so the page cache should not be used
+			fi->direct_io = 1;
+			fi->fh = (uint64_t)(uintptr_t)file;
+		}
+
+		// cppcheck-suppress memleak
+		RETURN_CODE_OK(path, 0)
+	}
+
+	// Allow to open file only using create()
+	RETURN_CODE_ERROR(path, -EACCES)
+}
+
+/** Read data from an open file */
+static int catalogfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	if (control_is_path(path) && fi != NULL && fi->fh != 0)
+	{
+		struct control_file *file = (struct control_file *)(uintptr_t)fi->fh;
+		RETURN_BYTES_COUNT(path, (int)control_file_read(file, buf, size, offset))
+	}
+
+	// Do not allow to read anything as files do not have actual data contents
+	RETURN_CODE_ERROR(path, -EPERM)
+}
+
+/** Write data to an open file */
+static int catalogfs_write(const char *path, const char *buf, size_t size,
+						   off_t offset, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	if (control_is_path(path))
+	{
+		struct control_file *file = (fi != NULL) ? (struct control_file *)(uintptr_t)fi->fh : NULL;
+		if (file == NULL || file->state == NULL)
+		{
+			RETURN_CODE_ERROR(path, -EPERM)
+		}
+
+		struct my_ingest_file *ingest = (struct my_ingest_file *)file->state;
+		int res = ingest_stream_write(&ingest->stream, buf, size);
+		count_ingest_file(ingest);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		RETURN_BYTES_COUNT(path, (int)size)
+	}
+
+	// Allow writing only to previously opened or created regular files
+	const char *name;
+	int dir_fd = RESOLVE_AT(path, name);
+	if (!S_ISREG(get_mode_by_path(dir_fd, name)))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	if (fi == NULL || fi->fh == 0)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
+
+	if (data == NULL || data->file_fd == -1)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	ssize_t min_file_size = offset + (ssize_t)size;
+	if (data->file_size < min_file_size)
+	{
+		data->file_size = min_file_size;
+	}
+
+	RETURN_BYTES_COUNT(path, (int)size)
+}
+
+/** Get file system statistics */
+static int catalogfs_statfs(const char *path, struct statvfs *stbuf)
+{
+	LOG_START(path)
+
+	int res;
+	(void)path;
+
+	res = fstatvfs(MY_DIR_FD, stbuf);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Possibly flush cached data */
+static int catalogfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	// Control files have nothing to flush but records of the ingest file
+	if (control_is_path(path))
+	{
+		struct control_file *file = (fi != NULL) ? (struct control_file *)(uintptr_t)fi->fh : NULL;
+		if (file != NULL && file->state != NULL)
+		{
+			int res = flush_ingest_file((struct my_ingest_file *)file->state, path);
+			if (res != 0)
+			{
+				RETURN_CODE_ERROR(path, res)
 			}
 		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	// In fi->fh we have size of file stored
+	if (fi == NULL || fi->fh == 0)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
+	if (data == NULL || data->file_fd == -1)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	/* 
+	 * Note that file descriptors created by dup(2) or fork(2) share the current 
+	 * file position pointer, so seeking on such files may be a subject of race condition.
+	 */
+	int dup_fd = dup(data->file_fd);
+	if (dup_fd == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	// The write-behind saves the metadata and closes the duplicate in background
+	if (MY_DATA->write_behind_handle != NULL)
+	{
+		int res = queue_filestat(dup_fd, RELPATH(path), data->file_size);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		data->queued = true;
+		data->queued_size = data->file_size;
+		RETURN_CODE_OK(path, 0)
+	}
+
+	int res = save_filestat(dup_fd, RELPATH(path), data->file_size);
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	/* 
+	 * This is called from every close() on an open file, so we call
+	 * close() on the underlying filesystem. But since flush may be
+	 * called multiple times for an open file, this must not really
+	 * close the file. This is important if used on a network
+	 * filesystem like NFS which flush the data/metadata on close() 
+	 */
+	res = close(dup_fd);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Release an open file
+ * 
+ * NOTE: 
+ * It is not possible to return an error from release() because the 
+ * return value of release() is ignored.
+ * If you need to return errors on close, you must do that from flush().
+ */
+static int catalogfs_release(const char *path, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	apply_source_changes();
+
+	if (control_is_path(path))
+	{
+		struct control_file *file = (fi != NULL) ? (struct control_file *)(uintptr_t)fi->fh : NULL;
+		if (file != NULL && file->state != NULL)
+		{
+			// Records written after the last flush (e.g. through a duplicate descriptor)
+			struct my_ingest_file *ingest = (struct my_ingest_file *)file->state;
+			(void)flush_ingest_file(ingest, path);
+			ingest_stream_free(&ingest->stream);
+			ingest_writer_free(&ingest->writer);
+			free(ingest);
+		}
+
+		if (fi != NULL)
+		{
+			control_file_free(file);
+			fi->fh = 0;
+		}
+		RETURN_CODE_OK(path, 0)
+	}
+
+	// In fi->fh we have size of file stored
+	if (fi == NULL || fi->fh == 0)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
+	if (data == NULL || data->file_fd == -1)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	// The size of the file is saved below
+	note_catalog_change();
+
+	if (MY_DATA->write_behind_handle != NULL)
+	{
+		// Metadata queued by flush() is not queued again unless the file was written after it
+		int res = 0;
+		if (data->queued && data->queued_size == data->file_size)
+			(void)close(data->file_fd);
+		else
+			res = queue_filestat(data->file_fd, RELPATH(path), data->file_size);
+
+		free(data);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		RETURN_CODE_OK(path, 0)
+	}
+
+	int res = save_filestat(data->file_fd, RELPATH(path), data->file_size);
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	res = close(data->file_fd);
+	if (res == -1)
+	{
+		RETURN_CODE_ERROR(path, -errno)
+	}
+
+	free(data);
+
+	// The filestat file stays until the manifest with its entry is written
+	if (MY_DATA->manifests)
+	{
+		res = manifest_writer_add(&MY_DATA->manifest_writer, RELPATH(path));
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/* ----------------------------------------------------------- *
+ * Implementation of FUSE callbacks for a single-file catalog.
+ * All entries are kept in the catalog (see catalog_db.h) instead of index files,
+ * control files are shared with the callbacks above.
+ * ----------------------------------------------------------- */
+
+/**
+ * Commit changes of the single-file catalog if they are due (group commit),
+ * called after every change (the change is noted for the query index too)
+ */
+static void commit_db_if_due(void)
+{
+	note_catalog_change();
+
+	int res = catalog_db_commit_if_due(MY_DATA->db);
+	if (res != 0)
+	{
+		Log(MY_DATA->logfile, true, __func__, NULL, "failed to commit catalog (code: %d)", res);
+	}
+}
+
+/**
+ * Make a new entry of the single-file catalog owned by the caller with current times
+ *
+ * @param entry is the target entry
+ * @param mode is the mode (including the type)
+ */
+static void init_db_entry(struct catalog_db_entry *entry, mode_t mode)
+{
+	memset(entry, 0, sizeof(struct catalog_db_entry));
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+
+	entry->my_stat.mode = (uint32_t)mode;
+	entry->my_stat.uid = (uint32_t)fuse_get_context()->uid;
+	entry->my_stat.gid = (uint32_t)fuse_get_context()->gid;
+	entry->my_stat.atime = entry->my_stat.mtime = entry->my_stat.ctime = (int64_t)now.tv_sec;
+	entry->my_stat.atimensec = entry->my_stat.mtimensec = entry->my_stat.ctimensec = (int64_t)now.tv_nsec;
+	entry->my_stat.nlink = (S_ISDIR(mode)) ? 2 : 1;
+	entry->my_stat.blksize = 4096;
+}
+
+/**
+ * Check if metadata of the entry can be changed by chmod(), chown() and utimens().
+ * Saved metadata of released files is preserved as for index files,
+ * directories, symlinks and files that are not released yet have only this metadata.
+ *
+ * @param entry is the entry
+ * @return true if the change should be saved
+ */
+static bool is_db_entry_changeable(const struct catalog_db_entry *entry)
+{
+	return !S_ISREG(entry->my_stat.mode) || entry->pending;
+}
+
+/**
+ * Save the size of the created file and mark it as released
+ *
+ * @param path is the path of the file (NULL if it was removed)
+ * @param data is the file info
+ * @return 0 on success, negative value on error
+ */
+static int save_db_file(const char *path, struct my_db_fileinfo *data)
+{
+	if (path == NULL || data->saved)
+		return 0;
+
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+
+	// The file was removed or replaced while it was open, there is nothing to save
+	if (res == -ENOENT || (res == 0 && entry.id != data->id))
+		return 0;
+
+	if (res != 0)
+		return res;
+
+	entry.my_stat.size = data->file_size;
+	entry.my_stat.blocks = convert_filesize_to_fileblocks(data->file_size);
+	entry.pending = false;
+
+	res = catalog_db_update(MY_DATA->db, path, &entry);
+	if (res != 0)
+		return res;
+
+	data->saved = true;
+	return 0;
+}
+
+/** Get file attributes */
+static int catalogfs_db_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	if (control_is_path(path))
+		return catalogfs_getattr(path, stbuf, fi);
+
+	LOG_START(path)
+
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+	if (res == -ENOENT || res == -ENOTDIR)
+	{
+		// Repeated lookup of a missing path is not an error of the filesystem
+		RETURN_CODE_OK(path, res)
+	}
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	if (fill_stat_from_db_entry(stbuf, &entry) != 0)
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Read the target of a symbolic link */
+static int catalogfs_db_readlink(const char *path, char *buf, size_t size)
+{
+	if (control_is_path(path))
+		return catalogfs_readlink(path, buf, size);
+
+	LOG_START(path)
+
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	if (!S_ISLNK(entry.my_stat.mode))
+	{
+		RETURN_CODE_ERROR(path, -EINVAL)
 	}
 
+	// Truncated like readlink() does, but null-terminated
+	size_t len = strlen(entry.link_target);
+	if (len > size - 1)
+		len = size - 1;
+
+	memcpy(buf, entry.link_target, len);
+	buf[len] = '\0';
+
 	RETURN_CODE_OK(path, 0)
 }
 
-/** Read the target of a symbolic link */
-static int catalogfs_readlink(const char *path, char *buf, size_t size)
+/**
+ * Context of listing of a directory of the single-file catalog
+ */
+struct db_readdir_ctx
 {
-	LOG_START(path)
+	/** Buffer of filler() */
+	void *buf;
 
-	/// NOTE: Passing (size - 1) was taken from the libfuse reference example passthrough_fh.c
-	ssize_t res = readlinkat(MY_DIR_FD, RELPATH(path), buf, size - 1);
-	if (res == -1)
-	{
-		RETURN_CODE_ERROR(path, -errno)
-	}
+	/** Function to add entries */
+	fuse_fill_dir_t filler;
 
-	buf[res] = '\0'; // be sure to null-terminate according to documentation
+	/** Attributes of entries are requested (readdirplus) */
+	bool plus;
+};
 
-	RETURN_CODE_OK(path, 0)
+/**
+ * Add the entry of the single-file catalog to the listing
+ *
+ * @param ctx is the listing context
+ * @param name is the name of the entry
+ * @param entry is the entry
+ * @return nonzero value if the buffer is full
+ */
+static int fill_db_dir_entry(void *ctx, const char *name, const struct catalog_db_entry *entry)
+{
+	struct db_readdir_ctx *readdir_ctx = (struct db_readdir_ctx *)ctx;
+
+	struct stat stbuf;
+	if (readdir_ctx->plus && fill_stat_from_db_entry(&stbuf, entry) == 0)
+		return readdir_ctx->filler(readdir_ctx->buf, name, &stbuf, 0, FUSE_FILL_DIR_PLUS);
+
+	return readdir_ctx->filler(readdir_ctx->buf, name, NULL, 0, (enum fuse_fill_dir_flags)0);
 }
 
-/** Read directory */
-static int catalogfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-							 off_t offset, struct fuse_file_info *fi,
-							 enum fuse_readdir_flags flags)
+/** Open directory (only directories of the control directory have state) */
+static int catalogfs_db_opendir(const char *path, struct fuse_file_info *fi)
 {
-	LOG_START(path)
+	if (control_is_path(path))
+		return catalogfs_opendir(path, fi);
 
-	(void)offset;
-	(void)fi;
-	(void)flags;
+	fi->fh = 0;
+	return 0;
+}
 
-	int fd = openat(MY_DIR_FD, RELPATH(path), O_DIRECTORY);
-	if (fd == -1)
-	{
-		RETURN_CODE_ERROR(path, -errno)
-	}
+/** Read directory */
+static int catalogfs_db_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+								off_t offset, struct fuse_file_info *fi,
+								enum fuse_readdir_flags flags)
+{
+	if (control_is_path(path))
+		return catalogfs_readdir(path, buf, filler, offset, fi, flags);
 
-	DIR *dir = fdopendir(fd);
-	if (dir == NULL)
-	{
-		/// NOTE: No close(fd) because closedir(dir) will do it
-		(void)closedir(dir);
-		RETURN_CODE_ERROR(path, -errno)
-	}
+	LOG_START(path)
+
+	filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
+	filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
 
-	struct dirent *de;
-	while ((de = readdir(dir)) != NULL)
+	// Names of control files are reserved, so entries of the root never hide them
+	struct db_readdir_ctx ctx = {buf, filler, (flags & FUSE_READDIR_PLUS) != 0};
+	int res = catalog_db_list(MY_DATA->db, path, fill_db_dir_entry, &ctx);
+	if (res != 0)
 	{
-		/*
-		 * Just enumerate all files.
-		 * Do not fill mode_t argument of filler() as we have no proper path,
-		 * FUSE will ask for mode_t later itself (on file-by-file basis via getattr())
-		 */
-		filler(buf, de->d_name, NULL, 0, (enum fuse_fill_dir_flags)0);
+		RETURN_CODE_ERROR(path, res)
 	}
 
-	/// NOTE: No close(fd) because closedir(dir) will do it
-	(void)closedir(dir);
-
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Create a directory */
-static int catalogfs_mkdir(const char *path, mode_t mode)
+static int catalogfs_db_mkdir(const char *path, mode_t mode)
 {
 	LOG_START(path)
 
-	int res;
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	res = mkdirat(MY_DIR_FD, RELPATH(path), mode);
-	if (res == -1)
+	struct catalog_db_entry entry;
+	init_db_entry(&entry, S_IFDIR | (mode & ~S_IFMT));
+
+	int res = catalog_db_add(MY_DATA->db, path, &entry);
+	commit_db_if_due();
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Remove a file */
-static int catalogfs_unlink(const char *path)
+static int catalogfs_db_unlink(const char *path)
 {
 	LOG_START(path)
 
-	int res;
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	res = unlinkat(MY_DIR_FD, RELPATH(path), 0);
-	if (res == -1)
+	int res = catalog_db_remove(MY_DATA->db, path, false);
+	commit_db_if_due();
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Remove a directory */
-static int catalogfs_rmdir(const char *path)
+static int catalogfs_db_rmdir(const char *path)
 {
 	LOG_START(path)
 
-	int res;
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	res = unlinkat(MY_DIR_FD, RELPATH(path), AT_REMOVEDIR);
-	if (res == -1)
+	int res = catalog_db_remove(MY_DATA->db, path, true);
+	commit_db_if_due();
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Create a symbolic link */
-static int catalogfs_symlink(const char *from, const char *to)
+static int catalogfs_db_symlink(const char *from, const char *to)
 {
 	LOG_START(from)
 
-	int res;
+	if (control_is_path(to))
+	{
+		RETURN_CODE_ERROR(from, -EPERM)
+	}
 
-	res = symlinkat(from, MY_DIR_FD, RELPATH(to));
-	if (res == -1)
+	if (strlen(from) > CATALOG_DB_MAX_LINK_TARGET)
 	{
-		RETURN_CODE_ERROR(from, -errno)
+		RETURN_CODE_ERROR(from, -ENAMETOOLONG)
+	}
+
+	struct catalog_db_entry entry;
+	init_db_entry(&entry, S_IFLNK | 0777);
+	strcpy(entry.link_target, from);
+	entry.my_stat.size = (int64_t)strlen(from);
+
+	int res = catalog_db_add(MY_DATA->db, to, &entry);
+	commit_db_if_due();
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(from, res)
 	}
 
 	RETURN_CODE_OK(from, 0)
 }
 
 /** Rename a file */
-static int catalogfs_rename(const char *from, const char *to, unsigned int flags)
+static int catalogfs_db_rename(const char *from, const char *to, unsigned int flags)
 {
 	LOG_START(from)
 
-	int res;
-
-	/**
-	 * NOTE: renameat2() supports flags, we can pass them.
-	 * Not sure is it possible to have problems with allowing flags.
-	 * But we will avoid those anyway by not allowing flags for stability.
-	*/
+	// Flags are not allowed for stability as for the source directory
 	if (flags)
 	{
 		RETURN_CODE_ERROR(from, -EINVAL)
 	}
 
-	res = renameat2(MY_DIR_FD, RELPATH(from), MY_DIR_FD, RELPATH(to), flags);
-	if (res == -1)
+	if (control_is_path(from) || control_is_path(to))
 	{
-		RETURN_CODE_ERROR(from, -errno)
+		RETURN_CODE_ERROR(from, -EPERM)
 	}
 
-	/**
-	 * NOTE: we do not change the name field inside filestat file.
-	 * In the latest format there is no name field at all.
-	 * And in older formats it is preserved original for several purposes,
-	 * one of them being - to preserve the original archival information.
-	 */
+	int res = catalog_db_rename(MY_DATA->db, from, to);
+	commit_db_if_due();
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(from, res)
+	}
 
 	RETURN_CODE_OK(from, 0)
 }
 
 /** Create a hard link to a file */
-static int catalogfs_link(const char *from, const char *to)
+static int catalogfs_db_link(const char *from, const char *to)
 {
 	LOG_START(from)
 
-	int res;
-
-	res = linkat(MY_DIR_FD, RELPATH(from), MY_DIR_FD, RELPATH(to), 0);
-	if (res == -1)
-	{
-		RETURN_CODE_ERROR(from, -errno)
-	}
+	(void)to;
 
-	RETURN_CODE_OK(from, 0)
+	// Entries have no shared metadata to link to
+	RETURN_CODE_ERROR(from, -EPERM)
 }
 
 /** Change the permission bits of a file */
-static int catalogfs_chmod(const char *path, mode_t mode,
-						   struct fuse_file_info *fi)
+static int catalogfs_db_chmod(const char *path, mode_t mode,
+							  struct fuse_file_info *fi)
 {
 	LOG_START(path)
 
 	(void)fi;
-	int res;
 
-	res = fchmodat(MY_DIR_FD, RELPATH(path), mode, 0);
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	if (res == -1)
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
-	/**
-	 * NOTE: we do not change mode field inside filestat file.
-	 * It's preserved original for several purposes,
-	 * one of them being - to preserve the original archival information.
-	 * 
-	 * To change mode field in the file - one need to reopen or recreate it.
-	 */
+	if (is_db_entry_changeable(&entry))
+	{
+		struct timespec now;
+		(void)clock_gettime(CLOCK_REALTIME, &now);
+
+		entry.my_stat.mode = (entry.my_stat.mode & S_IFMT) | (mode & ~S_IFMT);
+		entry.my_stat.ctime = (int64_t)now.tv_sec;
+		entry.my_stat.ctimensec = (int64_t)now.tv_nsec;
+
+		res = catalog_db_update(MY_DATA->db, path, &entry);
+		commit_db_if_due();
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Change the owner and group of a file */
-static int catalogfs_chown(const char *path, uid_t uid, gid_t gid,
-						   struct fuse_file_info *fi)
+static int catalogfs_db_chown(const char *path, uid_t uid, gid_t gid,
+							  struct fuse_file_info *fi)
 {
 	LOG_START(path)
 
 	(void)fi;
-	int res;
 
-	res = fchownat(MY_DIR_FD, RELPATH(path),
-				   uid, gid, AT_SYMLINK_NOFOLLOW);
+	if (control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	if (res == -1)
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
-	/**
-	 * NOTE: we do not change own fields inside filestat file.
-	 * It's preserved original for several purposes,
-	 * one of them being - to preserve the original archival information.
-	 * 
-	 * To change own fields in the file - one need to reopen or recreate it.
-	 */
+	if (is_db_entry_changeable(&entry))
+	{
+		struct timespec now;
+		(void)clock_gettime(CLOCK_REALTIME, &now);
+
+		// -1 keeps the current value as for chown()
+		if (uid != (uid_t)-1)
+			entry.my_stat.uid = (uint32_t)uid;
+		if (gid != (gid_t)-1)
+			entry.my_stat.gid = (uint32_t)gid;
+		entry.my_stat.ctime = (int64_t)now.tv_sec;
+		entry.my_stat.ctimensec = (int64_t)now.tv_nsec;
+
+		res = catalog_db_update(MY_DATA->db, path, &entry);
+		commit_db_if_due();
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
 /** Change the access and modification times of a file with nanosecond resolution */
-static int catalogfs_utimens(const char *path, const struct timespec ts[2],
-							 struct fuse_file_info *fi)
+static int catalogfs_db_utimens(const char *path, const struct timespec ts[2],
+								struct fuse_file_info *fi)
 {
 	LOG_START(path)
 
 	(void)fi;
-	int res;
-
-	/* don't use utime/utimes since they follow symlinks */
-	res = utimensat(MY_DIR_FD, RELPATH(path), ts, AT_SYMLINK_NOFOLLOW);
-	if (res == -1)
-	{
-		RETURN_CODE_ERROR(path, -errno)
-	}
-
-	/**
-	 * NOTE: we do not change time fields inside filestat file.
-	 * It's preserved original for several purposes,
-	 * one of them being - to preserve the original archival information.
-	 * 
-	 * To change time fields in the file - one need to reopen or recreate it.
-	 */
-
-	RETURN_CODE_OK(path, 0)
-}
-
-/** Create and open a file */
-static int catalogfs_create(const char *path, mode_t mode,
-							struct fuse_file_info *fi)
-{
-	LOG_START(path)
 
-	if (!S_ISREG(mode))
+	if (control_is_path(path))
 	{
 		RETURN_CODE_ERROR(path, -EPERM)
 	}
 
-	if (fi == NULL)
+	struct catalog_db_entry entry;
+	int res = catalog_db_lookup(MY_DATA->db, path, &entry);
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -EINVAL)
+		RETURN_CODE_ERROR(path, res)
 	}
 
-	// Store my_fh_fileinfo if needed and it's a regular file
-	if (fi->fh == 0 && S_ISREG(mode))
+	if (is_db_entry_changeable(&entry))
 	{
-		int fd = openat(MY_DIR_FD, RELPATH(path), fi->flags, mode);
-		if (fd == -1)
+		struct timespec now;
+		(void)clock_gettime(CLOCK_REALTIME, &now);
+
+		// NULL means the current time for both, UTIME_OMIT keeps the time
+		struct timespec times[2] = {now, now};
+		for (int i = 0; ts != NULL && i < 2; i++)
 		{
-			RETURN_CODE_ERROR(path, -errno)
+			if (ts[i].tv_nsec != UTIME_NOW)
+				times[i] = ts[i];
 		}
 
-		struct my_fh_fileinfo *data = (struct my_fh_fileinfo *)malloc(sizeof(struct my_fh_fileinfo));
-		if (data == NULL)
+		if (times[0].tv_nsec != UTIME_OMIT)
 		{
-			(void)close(fd);
-			RETURN_CODE_ERROR(path, -ENOMEM)
+			entry.my_stat.atime = (int64_t)times[0].tv_sec;
+			entry.my_stat.atimensec = (int64_t)times[0].tv_nsec;
 		}
-		else
+		if (times[1].tv_nsec != UTIME_OMIT)
 		{
-			/**
-			 * NOTE: the `else` statement by itself is redundant here, 
-			 * because previous if() has return inside,
-			 * but clang analyzer does not see return in RETURN_CODE macro 
-			 * and provides with a warning that data pointer can be NULL.
-			 */
-
-			memset(data, 0, sizeof(struct my_fh_fileinfo));
-
-			// Keep file descriptor
-			data->file_fd = fd;
-
-			// Set size to zero as it's create() function
-			data->file_size = 0;
+			entry.my_stat.mtime = (int64_t)times[1].tv_sec;
+			entry.my_stat.mtimensec = (int64_t)times[1].tv_nsec;
+		}
+		entry.my_stat.ctime = (int64_t)now.tv_sec;
+		entry.my_stat.ctimensec = (int64_t)now.tv_nsec;
 
-			/// NOTE: This FUSE convention causes false cppcheck warning about potential memory leak
-			fi->fh = (uint64_t)data;
+		res = catalog_db_update(MY_DATA->db, path, &entry);
+		commit_db_if_due();
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
 		}
 	}
 
-	/// NOTE: The FUSE convention above causes false cppcheck warning about potential memory leak
-	// cppcheck-suppress memleak
 	RETURN_CODE_OK(path, 0)
 }
 
-/** Open a file */
-static int catalogfs_open(const char *path, struct fuse_file_info *fi)
+/** Create and open a file */
+static int catalogfs_db_create(const char *path, mode_t mode,
+							   struct fuse_file_info *fi)
 {
 	LOG_START(path)
 
-	(void)fi;
+	if (!S_ISREG(mode) || control_is_path(path))
+	{
+		RETURN_CODE_ERROR(path, -EPERM)
+	}
 
-	// Allow to open file only using create()
-	RETURN_CODE_ERROR(path, -EACCES)
-}
+	if (fi == NULL)
+	{
+		RETURN_CODE_ERROR(path, -EINVAL)
+	}
 
-/** Read data from an open file */
-static int catalogfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
-{
-	LOG_START(path)
+	struct my_db_fileinfo *data = (struct my_db_fileinfo *)calloc(1, sizeof(struct my_db_fileinfo));
+	if (data == NULL)
+	{
+		RETURN_CODE_ERROR(path, -ENOMEM)
+	}
 
-	(void)path;
-	(void)buf;
-	(void)size;
-	(void)offset;
-	(void)fi;
+	// The file is shown as an empty one until it's released
+	struct catalog_db_entry entry;
+	init_db_entry(&entry, mode);
+	entry.pending = true;
 
-	// Do not allow to read anything as files do not have actual data contents
-	RETURN_CODE_ERROR(path, -EPERM)
+	int res = catalog_db_add(MY_DATA->db, path, &entry);
+	commit_db_if_due();
+	if (res != 0)
+	{
+		free(data);
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	data->id = entry.id;
+	data->file_size = 0;
+	data->saved = false;
+
+	/// NOTE: This FUSE convention causes false cppcheck warning about potential memory leak
+	fi->fh = (uint64_t)(uintptr_t)data;
+
+	// cppcheck-suppress memleak
+	RETURN_CODE_OK(path, 0)
 }
 
-/** Write data to an open file */
-static int catalogfs_write(const char *path, const char *buf, size_t size,
-						   off_t offset, struct fuse_file_info *fi)
+/** Write data to an open file */
+static int catalogfs_db_write(const char *path, const char *buf, size_t size,
+							  off_t offset, struct fuse_file_info *fi)
 {
+	if (control_is_path(path))
+		return catalogfs_write(path, buf, size, offset, fi);
+
 	LOG_START(path)
 
 	(void)buf;
 
-	// Allow writing only to previously opened or created regular files
-	if (!S_ISREG(get_mode_by_path(MY_DIR_FD, RELPATH(path))))
-	{
-		RETURN_CODE_ERROR(path, -EPERM)
-	}
-
+	// Allow writing only to created files
 	if (fi == NULL || fi->fh == 0)
 	{
 		RETURN_CODE_ERROR(path, -EPERM)
 	}
 
-	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
-
-	if (data == NULL || data->file_fd == -1)
-	{
-		RETURN_CODE_ERROR(path, -EPERM)
-	}
+	struct my_db_fileinfo *data = (struct my_db_fileinfo *)(uintptr_t)fi->fh;
 
-	ssize_t min_file_size = offset + (ssize_t)size;
+	int64_t min_file_size = (int64_t)offset + (int64_t)size;
 	if (data->file_size < min_file_size)
 	{
 		data->file_size = min_file_size;
+		data->saved = false;
 	}
 
 	RETURN_BYTES_COUNT(path, (int)size)
 }
 
 /** Get file system statistics */
-static int catalogfs_statfs(const char *path, struct statvfs *stbuf)
+static int catalogfs_db_statfs(const char *path, struct statvfs *stbuf)
 {
 	LOG_START(path)
 
-	int res;
-	(void)path;
-
-	res = fstatvfs(MY_DIR_FD, stbuf);
-	if (res == -1)
+	if (statvfs(MY_DATA->db_path, stbuf) == -1)
 	{
 		RETURN_CODE_ERROR(path, -errno)
 	}
@@ -881,90 +3965,404 @@ static int catalogfs_statfs(const char *path, struct statvfs *stbuf)
 }
 
 /** Possibly flush cached data */
-static int catalogfs_flush(const char *path, struct fuse_file_info *fi)
+static int catalogfs_db_flush(const char *path, struct fuse_file_info *fi)
 {
+	if (control_is_path(path))
+		return catalogfs_flush(path, fi);
+
 	LOG_START(path)
 
-	// In fi->fh we have size of file stored
 	if (fi == NULL || fi->fh == 0)
 	{
 		RETURN_CODE_ERROR(path, -EPERM)
 	}
 
-	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
-	if (data == NULL || data->file_fd == -1)
+	// Errors can be returned only from flush(), so the file is saved here already
+	int res = save_db_file(path, (struct my_db_fileinfo *)(uintptr_t)fi->fh);
+	commit_db_if_due();
+	if (res != 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
+
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Release an open file */
+static int catalogfs_db_release(const char *path, struct fuse_file_info *fi)
+{
+	if (path != NULL && control_is_path(path))
+		return catalogfs_release(path, fi);
+
+	LOG_START(path)
+
+	if (fi == NULL || fi->fh == 0)
 	{
 		RETURN_CODE_ERROR(path, -EPERM)
 	}
 
-	/* 
-	 * Note that file descriptors created by dup(2) or fork(2) share the current 
-	 * file position pointer, so seeking on such files may be a subject of race condition.
-	 */
-	int dup_fd = dup(data->file_fd);
-	if (dup_fd == -1)
+	// Nothing is left to save after flush() unless the file was written through another descriptor
+	struct my_db_fileinfo *data = (struct my_db_fileinfo *)(uintptr_t)fi->fh;
+	int res = save_db_file(path, data);
+	commit_db_if_due();
+
+	free(data);
+	fi->fh = 0;
+
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
-	int res = save_filestat(dup_fd, RELPATH(path), data->file_size);
+	RETURN_CODE_OK(path, 0)
+}
+
+/* ----------------------------------------------------------- *
+ * Implementation of FUSE callbacks for a versioned store of snapshots.
+ * The root lists snapshots as @<name> directories, entries under them are
+ * read from nodes of the store (see catalog_store.h). Everything is read-only,
+ * there is no control directory.
+ * ----------------------------------------------------------- */
+
+/** Prefix of names of snapshots in the root */
+#define STORE_SNAPSHOT_PREFIX '@'
+
+/**
+ * Make an inode number of a path of the store (FNV-1a, snapshots have no ids of entries)
+ *
+ * @param path is the path
+ * @return nonzero inode number
+ */
+static ino_t get_store_ino(const char *path)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *p = path; *p != '\0'; p++)
+	{
+		hash ^= (uint8_t)*p;
+		hash *= 1099511628211ULL;
+	}
+
+	return (ino_t)((hash != 0) ? hash : 1);
+}
+
+/**
+ * Fill stat struct of a directory made by the filesystem (the root or a snapshot)
+ *
+ * @param stbuf is the target stat struct
+ * @param path is the path of the directory
+ * @param mtime is the time of the directory
+ */
+static void fill_store_dir_stat(struct stat *stbuf, const char *path, int64_t mtime)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = get_store_ino(path);
+	stbuf->st_mode = S_IFDIR | 0555;
+	stbuf->st_nlink = 2;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atim.tv_sec = (time_t)mtime;
+	stbuf->st_mtim.tv_sec = (time_t)mtime;
+	stbuf->st_ctim.tv_sec = (time_t)mtime;
+}
+
+/**
+ * Fill stat struct from an entry of a snapshot
+ *
+ * @param stbuf is the target stat struct
+ * @param path is the path of the entry
+ * @param entry is the entry
+ * @return 0 on success, nonzero value on error
+ */
+static int fill_stat_from_store_entry(struct stat *stbuf, const char *path, const struct catalog_store_entry *entry)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = get_store_ino(path);
+	stbuf->st_nlink = (nlink_t)entry->entry.my_stat.nlink;
+	stbuf->st_blksize = (blksize_t)entry->entry.my_stat.blksize;
+
+	// There are no real files, so saved metadata is shown whatever the options are
+	return fill_stat_from_filestat_with_options(stbuf, &entry->entry.my_stat, true, true, true, true);
+}
+
+/**
+ * Find an entry of a snapshot by path
+ *
+ * @param path is the path ("/@<name>/...", not the root)
+ * @param stbuf is the target stat struct (can be NULL)
+ * @param dir_node is the node of the directory if the entry is a directory
+ *        (can be NULL, must be released by catalog_store_release_node())
+ * @param link_buf is the target buffer for the target of a symlink (can be NULL)
+ * @param link_size is the size of link_buf (the target is truncated and null-terminated)
+ * @return 0 on success, -ENOENT for missing entries, -ENOTDIR if a parent is not a directory,
+ *         -EINVAL if link_buf is set and the entry is not a symlink, other negative value on error
+ */
+static int lookup_store_path(const char *path, struct stat *stbuf, struct catalog_store_node **dir_node,
+							 char *link_buf, size_t link_size)
+{
+	if (path[0] != '/' || path[1] != STORE_SNAPSHOT_PREFIX)
+		return -ENOENT;
+
+	char name[NAME_MAX + 1];
+	const char *pos = path + 2;
+	size_t len = strcspn(pos, "/");
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	memcpy(name, pos, len);
+	name[len] = '\0';
+	pos += len;
+
+	struct catalog_store_hash hash;
+	int64_t mtime;
+	int res = catalog_store_get_snapshot(MY_DATA->store, name, &hash, &mtime);
+	if (res != 0)
+		return res;
+
+	struct catalog_store_node *node = NULL;
+	res = catalog_store_get_node(MY_DATA->store, &hash, &node);
+	if (res != 0)
+		return res;
+
+	// The snapshot directory itself (FUSE passes paths without trailing slashes)
+	if (*pos == '\0')
+	{
+		if (stbuf != NULL)
+			fill_store_dir_stat(stbuf, path, mtime);
+		if (link_buf != NULL)
+			res = -EINVAL;
+
+		if (res == 0 && dir_node != NULL)
+			*dir_node = node;
+		else
+			catalog_store_release_node(MY_DATA->store, node);
+		return res;
+	}
+
+	struct compact_dir_cursor cursor;
+	struct catalog_store_entry entry;
+	while (res == 0)
+	{
+		pos++;
+		len = strcspn(pos, "/");
+		if (len > NAME_MAX)
+		{
+			res = -ENAMETOOLONG;
+			break;
+		}
+		memcpy(name, pos, len);
+		name[len] = '\0';
+		pos += len;
+
+		catalog_store_node_cursor_init(node, &cursor);
+		res = catalog_store_node_find(node, name, &cursor, &entry);
+		if (res != 0)
+		{
+			compact_dir_cursor_free(&cursor);
+			break;
+		}
+
+		// The last component: the found entry is the result
+		if (*pos == '\0')
+		{
+			if (stbuf != NULL && fill_stat_from_store_entry(stbuf, path, &entry) != 0)
+				res = -EPERM;
+
+			if (res == 0 && link_buf != NULL)
+			{
+				if (!S_ISLNK(entry.entry.my_stat.mode) || entry.entry.link_target == NULL)
+				{
+					res = -EINVAL;
+				}
+				else
+				{
+					// Truncated like readlink() does, but null-terminated
+					size_t target_len = entry.entry.link_target_len;
+					if (target_len > link_size - 1)
+						target_len = link_size - 1;
+					memcpy(link_buf, entry.entry.link_target, target_len);
+					link_buf[target_len] = '\0';
+				}
+			}
+
+			compact_dir_cursor_free(&cursor);
+			struct catalog_store_node *child = NULL;
+			if (res == 0 && dir_node != NULL && entry.has_child)
+				res = catalog_store_get_node(MY_DATA->store, &entry.child, &child);
+
+			catalog_store_release_node(MY_DATA->store, node);
+			if (res == 0 && dir_node != NULL)
+				*dir_node = child;
+			return res;
+		}
+
+		compact_dir_cursor_free(&cursor);
+		if (!entry.has_child)
+		{
+			res = -ENOTDIR;
+			break;
+		}
+
+		struct catalog_store_node *child = NULL;
+		res = catalog_store_get_node(MY_DATA->store, &entry.child, &child);
+		catalog_store_release_node(MY_DATA->store, node);
+		node = child;
+	}
+
+	catalog_store_release_node(MY_DATA->store, node);
+	return res;
+}
+
+/** Get file attributes */
+static int catalogfs_store_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	LOG_START(path)
+
+	(void)fi;
+	if (strcmp(path, "/") == 0)
+	{
+		struct stat store_stat;
+		if (stat(MY_DATA->store_path, &store_stat) == -1)
+		{
+			RETURN_CODE_ERROR(path, -errno)
+		}
+
+		fill_store_dir_stat(stbuf, path, (int64_t)store_stat.st_mtime);
+		RETURN_CODE_OK(path, 0)
+	}
+
+	int res = lookup_store_path(path, stbuf, NULL, NULL, 0);
+	if (res == -ENOENT || res == -ENOTDIR || res == -ENAMETOOLONG)
+	{
+		// Repeated lookup of a missing path is not an error of the filesystem
+		RETURN_CODE_OK(path, res)
+	}
 	if (res != 0)
 	{
 		RETURN_CODE_ERROR(path, res)
 	}
 
-	/* 
-	 * This is called from every close() on an open file, so we call
-	 * close() on the underlying filesystem. But since flush may be
-	 * called multiple times for an open file, this must not really
-	 * close the file. This is important if used on a network
-	 * filesystem like NFS which flush the data/metadata on close() 
-	 */
-	res = close(dup_fd);
-	if (res == -1)
+	RETURN_CODE_OK(path, 0)
+}
+
+/** Read the target of a symbolic link */
+static int catalogfs_store_readlink(const char *path, char *buf, size_t size)
+{
+	LOG_START(path)
+
+	int res = lookup_store_path(path, NULL, NULL, buf, size);
+	if (res != 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		RETURN_CODE_ERROR(path, res)
 	}
 
 	RETURN_CODE_OK(path, 0)
 }
 
-/** Release an open file
- * 
- * NOTE: 
- * It is not possible to return an error from release() because the 
- * return value of release() is ignored.
- * If you need to return errors on close, you must do that from flush().
+/**
+ * List snapshots as @<name> directories of the root
+ *
+ * @param buf is the buffer of filler()
+ * @param filler is the function to add entries
+ * @param plus determines if attributes of entries are requested (readdirplus)
+ * @return 0 on success, negative value on error
  */
-static int catalogfs_release(const char *path, struct fuse_file_info *fi)
+static int fill_store_root(void *buf, fuse_fill_dir_t filler, bool plus)
 {
-	LOG_START(path)
+	char **names = NULL;
+	size_t count = 0;
+	int res = catalog_store_list_snapshots(MY_DATA->store, &names, &count);
+	if (res != 0)
+		return res;
 
-	// In fi->fh we have size of file stored
-	if (fi == NULL || fi->fh == 0)
+	for (size_t i = 0; i < count; i++)
 	{
-		RETURN_CODE_ERROR(path, -EPERM)
+		char entry_name[NAME_MAX + 1];
+		(void)snprintf(entry_name, sizeof(entry_name), "%c%s", STORE_SNAPSHOT_PREFIX, names[i]);
+
+		char entry_path[NAME_MAX + 2];
+		(void)snprintf(entry_path, sizeof(entry_path), "/%s", entry_name);
+
+		struct stat stbuf;
+		if (plus && lookup_store_path(entry_path, &stbuf, NULL, NULL, 0) == 0)
+		{
+			if (filler(buf, entry_name, &stbuf, 0, FUSE_FILL_DIR_PLUS) != 0)
+				break;
+		}
+		else if (filler(buf, entry_name, NULL, 0, (enum fuse_fill_dir_flags)0) != 0)
+		{
+			break;
+		}
 	}
 
-	struct my_fh_fileinfo *data = get_fh_fileinfo(fi->fh);
-	if (data == NULL || data->file_fd == -1)
+	catalog_store_free_names(names, count);
+	return 0;
+}
+
+/** Read directory */
+static int catalogfs_store_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+								   off_t offset, struct fuse_file_info *fi,
+								   enum fuse_readdir_flags flags)
+{
+	LOG_START(path)
+
+	(void)offset;
+	(void)fi;
+	bool plus = ((flags & FUSE_READDIR_PLUS) != 0);
+
+	filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
+	filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
+
+	if (strcmp(path, "/") == 0)
 	{
-		RETURN_CODE_ERROR(path, -EPERM)
+		int res = fill_store_root(buf, filler, plus);
+		if (res != 0)
+		{
+			RETURN_CODE_ERROR(path, res)
+		}
+
+		RETURN_CODE_OK(path, 0)
 	}
 
-	int res = save_filestat(data->file_fd, RELPATH(path), data->file_size);
+	struct catalog_store_node *node = NULL;
+	int res = lookup_store_path(path, NULL, &node, NULL, 0);
+	if (res == 0 && node == NULL)
+		res = -ENOTDIR;
 	if (res != 0)
 	{
 		RETURN_CODE_ERROR(path, res)
 	}
 
-	res = close(data->file_fd);
-	if (res == -1)
+	struct byte_buffer entry_path = {NULL, 0, 0};
+	struct compact_dir_cursor cursor;
+	struct catalog_store_entry entry;
+	catalog_store_node_cursor_init(node, &cursor);
+	while ((res = catalog_store_node_next(node, &cursor, &entry)) == 0)
 	{
-		RETURN_CODE_ERROR(path, -errno)
+		struct stat stbuf;
+		if (plus)
+		{
+			// Inode numbers are hashes of full paths
+			entry_path.len = 0;
+			if (byte_buffer_append_format(&entry_path, "%s/%s", path, entry.entry.name) == 0 &&
+				fill_stat_from_store_entry(&stbuf, (const char *)entry_path.data, &entry) == 0)
+			{
+				if (filler(buf, entry.entry.name, &stbuf, 0, FUSE_FILL_DIR_PLUS) != 0)
+					break;
+				continue;
+			}
+		}
+
+		if (filler(buf, entry.entry.name, NULL, 0, (enum fuse_fill_dir_flags)0) != 0)
+			break;
 	}
 
-	free(data);
+	compact_dir_cursor_free(&cursor);
+	byte_buffer_free(&entry_path);
+	catalog_store_release_node(MY_DATA->store, node);
+
+	if (res < 0)
+	{
+		RETURN_CODE_ERROR(path, res)
+	}
 
 	RETURN_CODE_OK(path, 0)
 }
@@ -982,7 +4380,9 @@ static void set_fuse_operations(struct fuse_operations *oper)
 	oper->getattr = catalogfs_getattr;
 	/* no access() since we always use -o default_permissions */
 	oper->readlink = catalogfs_readlink;
+	oper->opendir = catalogfs_opendir;
 	oper->readdir = catalogfs_readdir;
+	oper->releasedir = catalogfs_releasedir;
 	/* no mknod() since we use create and mkdir for regular files and dirs*/
 	oper->mkdir = catalogfs_mkdir;
 	oper->symlink = catalogfs_symlink;
@@ -1006,6 +4406,70 @@ static void set_fuse_operations(struct fuse_operations *oper)
 	oper->release = catalogfs_release;
 }
 
+/**
+ * Replace FUSE operations callbacks that use the source directory with ones
+ * for a single-file catalog (init, destroy, open and read are shared)
+ *
+ * @param oper is the fuse_operations struct with FUSE callbacks
+ */
+static void set_db_fuse_operations(struct fuse_operations *oper)
+{
+	oper->getattr = catalogfs_db_getattr;
+	oper->readlink = catalogfs_db_readlink;
+	oper->opendir = catalogfs_db_opendir;
+	oper->readdir = catalogfs_db_readdir;
+	oper->releasedir = catalogfs_releasedir;
+	oper->mkdir = catalogfs_db_mkdir;
+	oper->symlink = catalogfs_db_symlink;
+	oper->unlink = catalogfs_db_unlink;
+	oper->rmdir = catalogfs_db_rmdir;
+	oper->rename = catalogfs_db_rename;
+	oper->link = catalogfs_db_link;
+	oper->chmod = catalogfs_db_chmod;
+	oper->chown = catalogfs_db_chown;
+	oper->utimens = catalogfs_db_utimens;
+
+	oper->create = catalogfs_db_create;
+	oper->write = catalogfs_db_write;
+
+	oper->statfs = catalogfs_db_statfs;
+
+	oper->flush = catalogfs_db_flush;
+	oper->release = catalogfs_db_release;
+}
+
+/**
+ * Replace FUSE operations callbacks with read-only ones for a versioned store
+ * of snapshots (init, destroy, open and read are shared, open fails for entries)
+ *
+ * @param oper is the fuse_operations struct with FUSE callbacks
+ */
+static void set_store_fuse_operations(struct fuse_operations *oper)
+{
+	oper->getattr = catalogfs_store_getattr;
+	oper->readlink = catalogfs_store_readlink;
+	oper->opendir = NULL;
+	oper->readdir = catalogfs_store_readdir;
+	oper->releasedir = NULL;
+	oper->mkdir = NULL;
+	oper->symlink = NULL;
+	oper->unlink = NULL;
+	oper->rmdir = NULL;
+	oper->rename = NULL;
+	oper->link = NULL;
+	oper->chmod = NULL;
+	oper->chown = NULL;
+	oper->utimens = NULL;
+
+	oper->create = NULL;
+	oper->write = NULL;
+
+	oper->statfs = NULL;
+
+	oper->flush = NULL;
+	oper->release = NULL;
+}
+
 /**
  * Command line options
  *
@@ -1045,6 +4509,54 @@ static struct options
 	/** Use gid from filestat files instead of real file's gid */
 	int use_saved_gid;
 
+	/** Timeout for caching of missing names by the kernel (in seconds) */
+	double negative_timeout;
+
+	/** Maximum number of missing names cached by the filesystem (0 disables the cache) */
+	unsigned int negative_cache_size;
+
+	/** Watch the source directory for changes made outside of the filesystem */
+	int watch;
+
+	/** Timeout for caching of attributes by the kernel while watching (in seconds) */
+	double cache_timeout;
+
+	/** Maximum memory usage of the metadata cache in megabytes (0 disables the cache) */
+	unsigned int metadata_cache_mb;
+
+	/** Path of the snapshot of the metadata cache to load at mount and to save at unmount */
+	const char *cache_snapshot;
+
+	/** Maximum number of cached descriptors of directories (0 disables the cache) */
+	unsigned int dir_fd_cache_size;
+
+	/** Maximum memory of cached listings of directories in megabytes (0 disables the cache) */
+	unsigned int dir_listing_cache_mb;
+
+	/** Warm up the metadata cache in background after mount */
+	int warmup;
+
+	/** Number of warm-up threads */
+	unsigned int warmup_threads;
+
+	/** Move released files into manifests of their directories */
+	int manifests;
+
+	/** Storage of metadata in written index files ("text", "sparse" or "xattr") */
+	const char *storage;
+
+	/** Save metadata of released files in background with the durability ("none", "batch" or "file") */
+	const char *write_behind;
+
+	/** Path of a single-file catalog to use instead of the source directory */
+	const char *db;
+
+	/** Maximum memory of the page cache of the single-file catalog in megabytes */
+	unsigned int db_cache_mb;
+
+	/** Path of a versioned store of snapshots to show read-only instead of the source directory */
+	const char *store;
+
 } options;
 
 /**
@@ -1091,15 +4603,63 @@ static struct fuse_opt option_spec[] = {
 	/** Ignore a/c/mtimes from filestat files and show real file's times */
 	MY_OPT("--ignore_saved_times", ignore_saved_times, 1),
 
-	/** Use uid from filestat files instead of real file's uid */
-	MY_OPT("-u", use_saved_uid, 1),
-	/** Use uid from filestat files instead of real file's uid */
-	MY_OPT("--use_saved_uid", use_saved_uid, 1),
+	/** Use uid from filestat files instead of real file's uid */
+	MY_OPT("-u", use_saved_uid, 1),
+	/** Use uid from filestat files instead of real file's uid */
+	MY_OPT("--use_saved_uid", use_saved_uid, 1),
+
+	/** Use gid from filestat files instead of real file's gid */
+	MY_OPT("-g", use_saved_gid, 1),
+	/** Use gid from filestat files instead of real file's gid */
+	MY_OPT("--use_saved_gid", use_saved_gid, 1),
+
+	/** Timeout for caching of missing names by the kernel (in seconds) */
+	MY_OPT("--negative_timeout=%lf", negative_timeout, 0),
+
+	/** Maximum number of missing names cached by the filesystem */
+	MY_OPT("--negative_cache_size=%u", negative_cache_size, 0),
+
+	/** Watch the source directory for changes made outside of the filesystem */
+	MY_OPT("--watch", watch, 1),
+
+	/** Timeout for caching of attributes by the kernel while watching (in seconds) */
+	MY_OPT("--cache_timeout=%lf", cache_timeout, 0),
+
+	/** Maximum memory usage of the metadata cache in megabytes */
+	MY_OPT("--metadata_cache_mb=%u", metadata_cache_mb, 0),
+
+	/** Path of the snapshot of the metadata cache */
+	MY_OPT("--cache_snapshot=%s", cache_snapshot, 0),
+
+	/** Maximum number of cached descriptors of directories */
+	MY_OPT("--dir_fd_cache_size=%u", dir_fd_cache_size, 0),
+
+	/** Maximum memory of cached listings of directories in megabytes */
+	MY_OPT("--dir_listing_cache_mb=%u", dir_listing_cache_mb, 0),
+
+	/** Warm up the metadata cache in background after mount */
+	MY_OPT("--warmup", warmup, 1),
+
+	/** Number of warm-up threads */
+	MY_OPT("--warmup_threads=%u", warmup_threads, 0),
+
+	/** Move released files into manifests of their directories */
+	MY_OPT("--manifests", manifests, 1),
+
+	/** Storage of metadata in written index files */
+	MY_OPT("--storage=%s", storage, 0),
+
+	/** Save metadata of released files in background */
+	MY_OPT("--write_behind=%s", write_behind, 0),
 
-	/** Use gid from filestat files instead of real file's gid */
-	MY_OPT("-g", use_saved_gid, 1),
-	/** Use gid from filestat files instead of real file's gid */
-	MY_OPT("--use_saved_gid", use_saved_gid, 1),
+	/** Path of a single-file catalog to use instead of the source directory */
+	MY_OPT("--db=%s", db, 0),
+
+	/** Maximum memory of the page cache of the single-file catalog in megabytes */
+	MY_OPT("--db_cache_mb=%u", db_cache_mb, 0),
+
+	/** Path of a versioned store of snapshots to show read-only instead of the source directory */
+	MY_OPT("--store=%s", store, 0),
 
 	FUSE_OPT_END};
 
@@ -1126,6 +4686,49 @@ static void print_help(const char *program_name)
 	PrintToStdout("                           (default: use underlying file's uid)");
 	PrintToStdout("-g   --use_saved_gid       use saved gid from file instead of underlying file's gid");
 	PrintToStdout("                           (default: use underlying file's gid)");
+	PrintToStdout("     --negative_timeout=<d>");
+	PrintToStdout("                           seconds for kernel to cache missing names");
+	PrintToStdout("                           (default: 1, 0 disables)");
+	PrintToStdout("     --negative_cache_size=<n>");
+	PrintToStdout("                           number of missing names cached by filesystem");
+	PrintToStdoutF("                           (default: %d, 0 disables)", NEGATIVE_CACHE_DEFAULT_SIZE);
+	PrintToStdout("     --watch               watch source directory for external changes");
+	PrintToStdout("                           with inotify and let the kernel cache attributes");
+	PrintToStdout("                           (default: disabled, nothing is cached)");
+	PrintToStdout("     --cache_timeout=<d>   seconds for kernel to cache attributes while");
+	PrintToStdout("                           watching (default: 60)");
+	PrintToStdout("     --metadata_cache_mb=<n>");
+	PrintToStdout("                           memory for cache of parsed filestat files");
+	PrintToStdoutF("                           (default: %d, 0 disables)", METADATA_CACHE_DEFAULT_SIZE_MB);
+	PrintToStdout("     --cache_snapshot=<s>  file to save metadata cache to at unmount and");
+	PrintToStdout("                           to map at mount, outside of the source directory");
+	PrintToStdout("                           (default: not saved)");
+	PrintToStdout("     --dir_fd_cache_size=<n>");
+	PrintToStdout("                           number of open descriptors of directories");
+	PrintToStdoutF("                           (default: %d, 0 disables)", DIR_FD_CACHE_DEFAULT_SIZE);
+	PrintToStdout("     --dir_listing_cache_mb=<n>");
+	PrintToStdout("                           memory for cache of listings of directories");
+	PrintToStdoutF("                           (default: %d, 0 disables)", DIR_LISTING_CACHE_DEFAULT_SIZE_MB);
+	PrintToStdout("     --warmup              fill metadata cache in background after mount");
+	PrintToStdout("                           (default: disabled)");
+	PrintToStdout("     --warmup_threads=<n>  number of warm-up threads");
+	PrintToStdoutF("                           (default: %d, 0 for a thread per core)", WARMUP_DEFAULT_THREADS);
+	PrintToStdout("     --manifests           keep metadata of written files in one manifest");
+	PrintToStdout("                           file per directory (default: a file per file)");
+	PrintToStdout("     --storage=<s>         storage of metadata in index files:");
+	PrintToStdout("                           text (a filestat record), sparse (a sparse file");
+	PrintToStdout("                           with the original size, mode and times) or xattr");
+	PrintToStdout("                           (an empty file with the record in an xattr)");
+	PrintToStdout("                           (default: text)");
+	PrintToStdout("     --write_behind=<s>    save metadata of released files in background");
+	PrintToStdout("                           in batches, synced: none, batch (once per batch)");
+	PrintToStdout("                           or file (every file) (default: on release)");
+	PrintToStdout("     --db=<s>              single-file catalog to use instead of the source");
+	PrintToStdout("                           directory (created if missing, see README)");
+	PrintToStdout("     --db_cache_mb=<n>     memory for page cache of single-file catalog");
+	PrintToStdoutF("                           (default: %d)", PAGER_DEFAULT_CACHE_MB);
+	PrintToStdout("     --store=<s>           versioned store of snapshots to show read-only as");
+	PrintToStdout("                           @<name> directories (see catalogfs-snapshot)");
 }
 
 /**
@@ -1171,6 +4774,209 @@ static int my_opt_proc(void *data, const char *arg, int key, struct fuse_args *o
 	return 1;
 }
 
+/**
+ * Limit the size of the directory descriptors cache by the limit of open files
+ * (descriptors of files opened by create() and of the kernel connection must fit too)
+ *
+ * @param size is the requested size
+ * @return the size to use
+ */
+static size_t limit_dir_fd_cache_size(unsigned int size)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+		return size;
+
+	// Keep at least a half of the limit for everything else
+	rlim_t max_size = limit.rlim_cur / 2;
+	return ((rlim_t)size > max_size) ? (size_t)max_size : size;
+}
+
+/**
+ * Open the source directory (by default: the mountpoint itself)
+ *
+ * @param my_data is the private data struct with the mountpoint path
+ * @return 0 on success, -1 on error (the error is printed)
+ */
+static int open_source_dir(struct my_private_data *my_data)
+{
+	if (options.source == NULL ||
+		strlen(options.source) == 0)
+	{
+		PrintToStdout("No source directory provided, using mountpoint instead (mount over the same directory)");
+
+		char *copy = strdup(my_data->mountpoint_path);
+		if (copy == NULL)
+		{
+			PrintToStderr("Failed to copy string");
+			return -1;
+		}
+		my_data->source_dir_path = copy;
+	}
+	else
+	{
+		my_data->source_dir_path = realpath(options.source, NULL);
+	}
+
+	if (my_data->source_dir_path == NULL ||
+		strlen(my_data->source_dir_path) == 0)
+	{
+		PrintToStderr("Path of source_dir is not valid");
+		return -1;
+	}
+
+	PrintToStdoutF("Source directory path: %s", my_data->source_dir_path);
+
+	my_data->source_dir_dir = opendir(my_data->source_dir_path);
+
+	if (my_data->source_dir_dir == NULL)
+	{
+		PrintToStderr("Call of opendir() for source_dir failed");
+		return -1;
+	}
+
+	my_data->source_dir_fd = dirfd(my_data->source_dir_dir);
+
+	if (my_data->source_dir_fd == -1)
+	{
+		(void)closedir(my_data->source_dir_dir);
+		my_data->source_dir_dir = NULL;
+
+		PrintToStderr("Call of dirfd() for source directory failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Open (or create) the single-file catalog
+ *
+ * @param my_data is the private data struct
+ * @return 0 on success, -1 on error (the error is printed)
+ */
+static int open_db(struct my_private_data *my_data)
+{
+	my_data->source_dir_fd = -1;
+
+	my_data->db_path = strdup(options.db);
+	if (my_data->db_path == NULL)
+	{
+		PrintToStderr("Failed to copy string");
+		return -1;
+	}
+
+	PrintToStdoutF("Single-file catalog path: %s", my_data->db_path);
+
+	int res = catalog_db_open(&my_data->db, my_data->db_path, (size_t)options.db_cache_mb * 1024 * 1024, true);
+	if (res == -EBUSY)
+	{
+		PrintToStderr("Single-file catalog is used by another process");
+		return -1;
+	}
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to open single-file catalog (code: %d)", res);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Open the versioned store of snapshots instead of the source directory
+ *
+ * @param my_data is the private data struct
+ * @return 0 on success, -1 on error (the error is printed)
+ */
+static int open_store(struct my_private_data *my_data)
+{
+	my_data->source_dir_fd = -1;
+
+	my_data->store_path = realpath(options.store, NULL);
+	if (my_data->store_path == NULL)
+	{
+		PrintToStderr("Path of versioned store is not valid");
+		return -1;
+	}
+
+	PrintToStdoutF("Versioned store path: %s", my_data->store_path);
+
+	int res = catalog_store_open(&my_data->store, my_data->store_path, false);
+	if (res == -EINVAL)
+	{
+		PrintToStderr("Path is not a versioned store (see catalogfs-snapshot)");
+		return -1;
+	}
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to open versioned store (code: %d)", res);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Map the snapshot of the metadata cache (if it exists) and remember its path
+ * to save the cache at unmount
+ *
+ * @param my_data is the private data struct with the source directory opened
+ * @return 0 on success, -1 on error
+ */
+static int open_cache_snapshot(struct my_private_data *my_data)
+{
+	// The working directory is changed when the filesystem goes to background
+	if (options.cache_snapshot[0] == '/')
+	{
+		my_data->cache_snapshot_path = strdup(options.cache_snapshot);
+	}
+	else
+	{
+		char *cwd = getcwd(NULL, 0);
+		if (cwd != NULL &&
+			asprintf(&my_data->cache_snapshot_path, "%s/%s", cwd, options.cache_snapshot) == -1)
+		{
+			my_data->cache_snapshot_path = NULL;
+		}
+		free(cwd);
+	}
+
+	if (my_data->cache_snapshot_path == NULL)
+	{
+		PrintToStderr("Failed to make path of cache snapshot");
+		return -1;
+	}
+
+	PrintToStdoutF("Cache snapshot path: %s", my_data->cache_snapshot_path);
+
+	struct stat stbuf;
+	if (fstat(my_data->source_dir_fd, &stbuf) == -1)
+	{
+		PrintToStderr("Failed to stat source directory");
+		return -1;
+	}
+
+	int res = metadata_cache_load_snapshot(&my_data->metadata_cache, my_data->cache_snapshot_path, stbuf.st_ino);
+	if (res == 0)
+	{
+		struct metadata_cache_stats stats;
+		metadata_cache_get_stats(&my_data->metadata_cache, &stats);
+		PrintToStdoutF("Cache snapshot is mapped with %zu entries", stats.snapshot_count);
+	}
+	else if (res == -ENOENT)
+	{
+		PrintToStdout("Cache snapshot does not exist yet, it will be saved at unmount");
+	}
+	else
+	{
+		// A broken or foreign snapshot is only a cold start, it's replaced at unmount
+		PrintToStdoutF("Cache snapshot is not used (code: %d), it will be replaced at unmount", res);
+	}
+
+	return 0;
+}
+
 /**
  * Main (an entry point)
  *
@@ -1189,6 +4995,14 @@ int main(int argc, char *argv[])
 	options.source = NULL;
 	options.logfile = NULL;
 	options.mountpoint = NULL;
+	options.negative_timeout = 1.0;
+	options.cache_timeout = 60.0;
+	options.negative_cache_size = NEGATIVE_CACHE_DEFAULT_SIZE;
+	options.metadata_cache_mb = METADATA_CACHE_DEFAULT_SIZE_MB;
+	options.dir_fd_cache_size = DIR_FD_CACHE_DEFAULT_SIZE;
+	options.dir_listing_cache_mb = DIR_LISTING_CACHE_DEFAULT_SIZE_MB;
+	options.warmup_threads = WARMUP_DEFAULT_THREADS;
+	options.db_cache_mb = PAGER_DEFAULT_CACHE_MB;
 
 	// Parsing arguments using FUSE
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -1231,6 +5045,15 @@ int main(int argc, char *argv[])
 		return -ENOMEM;
 	}
 	memset(my_data, 0, sizeof(struct my_private_data));
+	pthread_mutex_init(&my_data->query_lock, NULL);
+
+	if (metadata_cache_init(&my_data->metadata_cache, (size_t)options.metadata_cache_mb * 1024 * 1024) != 0)
+	{
+		PrintToStderr("Failed to initialize metadata cache");
+		free(my_data);
+		fuse_opt_free_args(&args);
+		return -1;
+	}
 
 	if (options.logfile != NULL &&
 		strlen(options.logfile) != 0)
@@ -1263,66 +5086,179 @@ int main(int argc, char *argv[])
 
 	PrintToStdoutF("Mountpoint path: %s", my_data->mountpoint_path);
 
-	if (options.source == NULL ||
-		strlen(options.source) == 0)
+	bool use_db = (options.db != NULL && strlen(options.db) != 0);
+	bool use_store = (options.store != NULL && strlen(options.store) != 0);
+	if (use_db && use_store)
 	{
-		PrintToStdout("No source directory provided, using mountpoint instead (mount over the same directory)");
-
-		char *copy = strdup(my_data->mountpoint_path);
-		if (copy == NULL)
-		{
-			PrintToStderr("Failed to copy string");
-			free_my_private_data(my_data);
-			fuse_opt_free_args(&args);
-			return -1;
-		}
-		my_data->source_dir_path = copy;
+		PrintToStderr("Options db and store cannot be used together");
+		free_my_private_data(my_data);
+		fuse_opt_free_args(&args);
+		return -1;
 	}
-	else
+
+	int res = (use_db) ? open_db(my_data) : (use_store) ? open_store(my_data) : open_source_dir(my_data);
+	if (res != 0)
 	{
-		my_data->source_dir_path = realpath(options.source, NULL);
+		free_my_private_data(my_data);
+		fuse_opt_free_args(&args);
+		return -1;
 	}
 
-	if (my_data->source_dir_path == NULL ||
-		strlen(my_data->source_dir_path) == 0)
+	my_data->log_only_errors = (options.log_only_errors != 0);
+	my_data->ignore_saved_chmod = (options.ignore_saved_chmod != 0);
+	my_data->ignore_saved_times = (options.ignore_saved_times != 0);
+	my_data->use_saved_uid = (options.use_saved_uid != 0);
+	my_data->use_saved_gid = (options.use_saved_gid != 0);
+
+	if (options.negative_timeout < 0)
 	{
-		PrintToStderr("Path of source_dir is not valid");
+		PrintToStderr("Value of negative_timeout should not be negative");
 		free_my_private_data(my_data);
 		fuse_opt_free_args(&args);
 		return -1;
 	}
 
-	PrintToStdoutF("Source directory path: %s", my_data->source_dir_path);
-
-	my_data->source_dir_dir = opendir(my_data->source_dir_path);
+	my_data->negative_timeout = options.negative_timeout;
 
-	if (my_data->source_dir_dir == NULL)
+	if (options.cache_timeout < 0)
 	{
-		PrintToStderr("Call of opendir() for source_dir failed");
+		PrintToStderr("Value of cache_timeout should not be negative");
 		free_my_private_data(my_data);
 		fuse_opt_free_args(&args);
 		return -1;
 	}
 
-	my_data->source_dir_fd = dirfd(my_data->source_dir_dir);
+	my_data->watch = (options.watch != 0);
+	my_data->cache_timeout = options.cache_timeout;
+	negative_cache_init(&my_data->negative_cache, options.negative_cache_size);
+	dir_fd_cache_init(&my_data->dir_fd_cache, my_data->source_dir_fd, limit_dir_fd_cache_size(options.dir_fd_cache_size));
+	manifest_cache_init(&my_data->manifest_cache, MANIFEST_CACHE_DEFAULT_SIZE);
+	dir_listing_cache_init(&my_data->dir_listing_cache, (size_t)options.dir_listing_cache_mb * 1024 * 1024);
 
-	if (my_data->source_dir_fd == -1)
-	{
-		(void)closedir(my_data->source_dir_dir);
-		my_data->source_dir_dir = NULL;
+	my_data->manifests = (options.manifests != 0);
+	manifest_writer_init(&my_data->manifest_writer, my_data->source_dir_fd, &my_data->metadata_cache);
 
-		PrintToStderr("Call of dirfd() for source directory failed");
+	if (options.warmup && options.warmup_threads > WARMUP_MAX_THREADS)
+	{
+		PrintToStderrF("Value of warmup_threads should not be greater than %d", WARMUP_MAX_THREADS);
+		free_my_private_data(my_data);
+		fuse_opt_free_args(&args);
+		return -1;
+	}
 
+	if (storage_from_name(options.storage, &my_data->storage) != 0)
+	{
+		PrintToStderr("Value of storage should be text, sparse or xattr");
 		free_my_private_data(my_data);
 		fuse_opt_free_args(&args);
 		return -1;
 	}
 
-	my_data->log_only_errors = (options.log_only_errors != 0);
-	my_data->ignore_saved_chmod = (options.ignore_saved_chmod != 0);
-	my_data->ignore_saved_times = (options.ignore_saved_times != 0);
-	my_data->use_saved_uid = (options.use_saved_uid != 0);
-	my_data->use_saved_gid = (options.use_saved_gid != 0);
+	if (my_data->source_dir_fd != -1 &&
+		my_data->storage == CATALOG_STORAGE_XATTR && !storage_xattr_supported(my_data->source_dir_fd))
+	{
+		PrintToStdout("Source directory does not support user xattrs, using text storage");
+		my_data->storage = CATALOG_STORAGE_TEXT;
+	}
+
+	// Empty index files of a text catalog are files that are not released yet, their xattrs are not read
+	storage_set_catalog_storage(my_data->storage);
+
+	if (options.write_behind != NULL)
+	{
+		if (write_behind_durability_from_name(options.write_behind, &my_data->write_behind_durability) != 0)
+		{
+			PrintToStderr("Value of write_behind should be none, batch or file");
+			free_my_private_data(my_data);
+			fuse_opt_free_args(&args);
+			return -1;
+		}
+
+		my_data->write_behind = true;
+	}
+
+	// Manifests read filestat files of released files, so they must be saved on release
+	if (my_data->write_behind && my_data->manifests)
+	{
+		PrintToStdout("Write-behind is not used with manifests, skipping it");
+		my_data->write_behind = false;
+	}
+
+	my_data->warmup = (options.warmup != 0);
+	my_data->warmup_threads = options.warmup_threads;
+
+	// Zero means a thread per core
+	if (my_data->warmup_threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cores > WARMUP_MAX_THREADS)
+			cores = WARMUP_MAX_THREADS;
+		my_data->warmup_threads = (cores > 0) ? (unsigned int)cores : WARMUP_DEFAULT_THREADS;
+	}
+
+	// Sparse index files are never read by getattr(), unless saved owners are needed
+	if (my_data->warmup &&
+		my_data->storage == CATALOG_STORAGE_SPARSE &&
+		!my_data->use_saved_uid && !my_data->use_saved_gid)
+	{
+		PrintToStdout("Warm-up is not needed with sparse storage, skipping it");
+		my_data->warmup = false;
+	}
+
+	// A single-file catalog has no index files to warm up, to collect into manifests or to store
+	if (my_data->db != NULL)
+	{
+		if (my_data->warmup || my_data->manifests || my_data->write_behind)
+		{
+			PrintToStdout("Warm-up, manifests and write-behind are not used with a single-file catalog, skipping them");
+		}
+
+		if (my_data->watch)
+		{
+			PrintToStdout("Watching is not used with a single-file catalog, skipping it");
+		}
+
+		my_data->warmup = false;
+		my_data->manifests = false;
+		my_data->write_behind = false;
+		my_data->watch = false;
+		set_db_fuse_operations(&catalogfs_oper);
+	}
+
+	// Snapshots are never changed, the store is mounted read-only
+	if (my_data->store != NULL)
+	{
+		if (my_data->warmup || my_data->manifests || my_data->write_behind)
+		{
+			PrintToStdout("Warm-up, manifests and write-behind are not used with a versioned store, skipping them");
+		}
+
+		if (my_data->watch)
+		{
+			PrintToStdout("Watching is not used with a versioned store, skipping it");
+		}
+
+		my_data->warmup = false;
+		my_data->manifests = false;
+		my_data->write_behind = false;
+		my_data->watch = false;
+		set_store_fuse_operations(&catalogfs_oper);
+		fuse_opt_add_arg(&args, "-oro");
+	}
+
+	if (options.cache_snapshot != NULL && strlen(options.cache_snapshot) != 0)
+	{
+		if (my_data->db != NULL || my_data->store != NULL)
+		{
+			PrintToStdout("Cache snapshot is not used with a single-file catalog or a versioned store, skipping it");
+		}
+		else if (open_cache_snapshot(my_data) != 0)
+		{
+			free_my_private_data(my_data);
+			fuse_opt_free_args(&args);
+			return -1;
+		}
+	}
 
 	/**
 	 * This filesystem works in a single-thread mode because multi-threading is not required because 
@@ -0,0 +1,802 @@
+#include "header_common.h"
+
+#include "compact_dir.h"
+#include "byte_buffer.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "varint.h"
+
+/** Version of the blob layout */
+#define COMPACT_DIR_VERSION ((uint32_t)1)
+
+/** Flag of the blob: hashes are present */
+#define COMPACT_DIR_FLAG_HASHES ((uint32_t)1)
+
+/** Size of the blob header: version, count, flags and sizes of columns */
+#define COMPACT_DIR_HEADER_SIZE (12 + 4 * COMPACT_DIR_COLUMNS)
+
+/** Size of a binary SHA-256 hash */
+#define COMPACT_DIR_HASH_SIZE (FILESTAT_SHA256_HEX_LENGTH / 2)
+
+/** Columns of the compact directory */
+enum compact_dir_column
+{
+	COLUMN_NAME,
+	COLUMN_SIZE,
+	COLUMN_BLOCKS,
+	COLUMN_MODE,
+	COLUMN_UID,
+	COLUMN_GID,
+	COLUMN_MTIME,
+	COLUMN_MTIMENSEC,
+	COLUMN_ATIME,
+	COLUMN_ATIMENSEC,
+	COLUMN_CTIME,
+	COLUMN_CTIMENSEC,
+	COLUMN_NLINK,
+	COLUMN_BLKSIZE,
+	COLUMN_TARGET,
+	COLUMN_COUNT
+};
+
+_Static_assert(COLUMN_COUNT == COMPACT_DIR_COLUMNS, "COMPACT_DIR_COLUMNS must match the columns enum");
+
+/**
+ * Compact directory (views into the blob)
+ */
+struct compact_dir
+{
+	/** Blob with all data */
+	const uint8_t *data;
+
+	/** Size of the blob */
+	size_t size;
+
+	/** Owned copy of the blob (NULL if the blob is borrowed) */
+	uint8_t *owned_data;
+
+	/** Number of entries */
+	size_t count;
+
+	/** Number of blocks */
+	size_t blocks_count;
+
+	/** Offsets of blocks in columns (blocks_count * COLUMN_COUNT of LE u32) */
+	const uint8_t *block_offsets;
+
+	/** Starts of columns */
+	const uint8_t *column_start[COLUMN_COUNT];
+
+	/** Ends of columns */
+	const uint8_t *column_end[COLUMN_COUNT];
+
+	/** Binary hashes (count * COMPACT_DIR_HASH_SIZE) or NULL */
+	const uint8_t *hashes;
+};
+
+/**
+ * Convert a hex digit to its value
+ *
+ * @param c is the hex digit
+ * @return value of the digit, -1 if it's not a hex digit
+ */
+static int hex_digit_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Convert SHA-256 hex string of filestat to binary (all zeros if unknown or invalid)
+ *
+ * @param hex is the hex string
+ * @param hash is the target binary hash
+ */
+static void hash_from_hex(const char *hex, uint8_t *hash)
+{
+	memset(hash, 0, COMPACT_DIR_HASH_SIZE);
+	if (strlen(hex) != FILESTAT_SHA256_HEX_LENGTH)
+		return;
+
+	for (size_t i = 0; i < COMPACT_DIR_HASH_SIZE; i++)
+	{
+		int high = hex_digit_value(hex[i * 2]);
+		int low = hex_digit_value(hex[i * 2 + 1]);
+		if (high < 0 || low < 0)
+		{
+			memset(hash, 0, COMPACT_DIR_HASH_SIZE);
+			return;
+		}
+		hash[i] = (uint8_t)((high << 4) | low);
+	}
+}
+
+/**
+ * Convert binary SHA-256 to hex string of filestat (empty string for all zeros)
+ *
+ * @param hash is the binary hash
+ * @param hex is the target hex string
+ */
+static void hash_to_hex(const uint8_t *hash, char *hex)
+{
+	static const char hex_chars[] = "0123456789abcdef";
+
+	bool is_zero = true;
+	for (size_t i = 0; i < COMPACT_DIR_HASH_SIZE; i++)
+	{
+		if (hash[i] != 0)
+		{
+			is_zero = false;
+			break;
+		}
+	}
+
+	if (is_zero)
+	{
+		hex[0] = '\0';
+		return;
+	}
+
+	for (size_t i = 0; i < COMPACT_DIR_HASH_SIZE; i++)
+	{
+		hex[i * 2] = hex_chars[hash[i] >> 4];
+		hex[i * 2 + 1] = hex_chars[hash[i] & 0x0f];
+	}
+	hex[FILESTAT_SHA256_HEX_LENGTH] = '\0';
+}
+
+/**
+ * Encode one entry to columns
+ *
+ * @param columns is the array of column buffers
+ * @param input is the entry to encode
+ * @param prev is the previous entry of the block (zeroed at the block start)
+ * @param prev_name is the previous name of the block ("" at the block start)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int compact_dir_encode_entry(struct byte_buffer *columns, const struct compact_dir_input *input,
+									const struct filestat *prev, const char *prev_name)
+{
+	const struct filestat *s = &input->my_stat;
+	int res = 0;
+
+	size_t name_len = strlen(input->name);
+	size_t prefix = 0;
+	while (prev_name[prefix] != '\0' && prev_name[prefix] == input->name[prefix])
+	{
+		prefix++;
+	}
+
+	res |= byte_buffer_append_varint(&columns[COLUMN_NAME], prefix);
+	res |= byte_buffer_append_varint(&columns[COLUMN_NAME], name_len - prefix);
+	res |= byte_buffer_append(&columns[COLUMN_NAME], input->name + prefix, name_len - prefix);
+
+	res |= byte_buffer_append_varint(&columns[COLUMN_SIZE], (uint64_t)s->size);
+	res |= byte_buffer_append_svarint(&columns[COLUMN_BLOCKS], delta_encode(s->blocks, convert_filesize_to_fileblocks(s->size)));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_MODE], delta_encode(s->mode, prev->mode));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_UID], delta_encode(s->uid, prev->uid));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_GID], delta_encode(s->gid, prev->gid));
+
+	res |= byte_buffer_append_svarint(&columns[COLUMN_MTIME], delta_encode(s->mtime, prev->mtime));
+	res |= byte_buffer_append_varint(&columns[COLUMN_MTIMENSEC], (uint64_t)s->mtimensec);
+	res |= byte_buffer_append_svarint(&columns[COLUMN_ATIME], delta_encode(s->atime, s->mtime));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_ATIMENSEC], delta_encode(s->atimensec, s->mtimensec));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_CTIME], delta_encode(s->ctime, s->mtime));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_CTIMENSEC], delta_encode(s->ctimensec, s->mtimensec));
+
+	res |= byte_buffer_append_svarint(&columns[COLUMN_NLINK], delta_encode((int64_t)s->nlink, (int64_t)prev->nlink));
+	res |= byte_buffer_append_svarint(&columns[COLUMN_BLKSIZE], delta_encode(s->blksize, prev->blksize));
+
+	size_t target_len = (input->link_target != NULL) ? strlen(input->link_target) : 0;
+	res |= byte_buffer_append_varint(&columns[COLUMN_TARGET], target_len);
+	res |= byte_buffer_append(&columns[COLUMN_TARGET], input->link_target, target_len);
+
+	return (res != 0) ? -ENOMEM : 0;
+}
+
+/**
+ * Build a compact directory from entries
+ *
+ * @param inputs is the array of entries sorted by name (strcmp order, no duplicates)
+ * @param count is the number of entries
+ * @param dir is the result (must be freed by compact_dir_free())
+ * @return 0 on success, -EINVAL for unsorted input, -ENOMEM on error
+ */
+int compact_dir_build(const struct compact_dir_input *inputs, size_t count, struct compact_dir **dir)
+{
+	*dir = NULL;
+
+	if (count > UINT32_MAX)
+		return -EINVAL;
+
+	for (size_t i = 1; i < count; i++)
+	{
+		if (strcmp(inputs[i - 1].name, inputs[i].name) >= 0)
+			return -EINVAL;
+	}
+
+	bool has_hashes = false;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (inputs[i].my_stat.sha256[0] != '\0')
+		{
+			has_hashes = true;
+			break;
+		}
+	}
+
+	struct byte_buffer columns[COLUMN_COUNT];
+	memset(columns, 0, sizeof(columns));
+
+	struct byte_buffer offsets;
+	memset(&offsets, 0, sizeof(offsets));
+
+	int res = 0;
+	struct filestat prev;
+	const char *prev_name = "";
+
+	for (size_t i = 0; i < count && res == 0; i++)
+	{
+		if (i % COMPACT_DIR_BLOCK_ENTRIES == 0)
+		{
+			// Restart front coding and deltas at the start of every block
+			memset(&prev, 0, sizeof(prev));
+			prev_name = "";
+
+			res = byte_buffer_reserve(&offsets, 4 * COLUMN_COUNT);
+			if (res != 0)
+				break;
+
+			for (int c = 0; c < COLUMN_COUNT; c++)
+			{
+				if (columns[c].len > UINT32_MAX)
+				{
+					res = -ENOMEM;
+					break;
+				}
+				write_le32(offsets.data + offsets.len, (uint32_t)columns[c].len);
+				offsets.len += 4;
+			}
+		}
+
+		if (res == 0)
+			res = compact_dir_encode_entry(columns, &inputs[i], &prev, prev_name);
+
+		prev = inputs[i].my_stat;
+		prev_name = inputs[i].name;
+	}
+
+	struct byte_buffer blob;
+	memset(&blob, 0, sizeof(blob));
+
+	if (res == 0)
+	{
+		size_t total = COMPACT_DIR_HEADER_SIZE + offsets.len;
+		for (int c = 0; c < COLUMN_COUNT; c++)
+		{
+			total += columns[c].len;
+		}
+		if (has_hashes)
+		{
+			total += count * COMPACT_DIR_HASH_SIZE;
+		}
+
+		res = byte_buffer_reserve(&blob, total);
+	}
+
+	if (res == 0)
+	{
+		uint8_t *header = blob.data;
+		write_le32(header, COMPACT_DIR_VERSION);
+		write_le32(header + 4, (uint32_t)count);
+		write_le32(header + 8, (has_hashes) ? COMPACT_DIR_FLAG_HASHES : 0);
+		for (int c = 0; c < COLUMN_COUNT; c++)
+		{
+			write_le32(header + 12 + 4 * c, (uint32_t)columns[c].len);
+		}
+		blob.len = COMPACT_DIR_HEADER_SIZE;
+
+		(void)byte_buffer_append(&blob, offsets.data, offsets.len);
+		for (int c = 0; c < COLUMN_COUNT; c++)
+		{
+			(void)byte_buffer_append(&blob, columns[c].data, columns[c].len);
+		}
+
+		if (has_hashes)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				hash_from_hex(inputs[i].my_stat.sha256, blob.data + blob.len);
+				blob.len += COMPACT_DIR_HASH_SIZE;
+			}
+		}
+	}
+
+	for (int c = 0; c < COLUMN_COUNT; c++)
+	{
+		byte_buffer_free(&columns[c]);
+	}
+	byte_buffer_free(&offsets);
+
+	if (res != 0)
+	{
+		byte_buffer_free(&blob);
+		return res;
+	}
+
+	// Take ownership of the blob without copying it
+	res = compact_dir_from_buffer(blob.data, blob.len, false, dir);
+	if (res != 0)
+	{
+		byte_buffer_free(&blob);
+		return res;
+	}
+	(*dir)->owned_data = blob.data;
+
+	return 0;
+}
+
+/**
+ * Make a compact directory from a serialized blob (see compact_dir_data()).
+ * The blob is validated, so it's safe to use data from files.
+ *
+ * @param data is the blob
+ * @param size is the size of the blob
+ * @param copy determines if the blob should be copied (otherwise it must outlive the directory)
+ * @param dir is the result (must be freed by compact_dir_free())
+ * @return 0 on success, -EINVAL for broken blob, -ENOMEM on error
+ */
+int compact_dir_from_buffer(const void *data, size_t size, bool copy, struct compact_dir **dir)
+{
+	*dir = NULL;
+
+	if (data == NULL || size < COMPACT_DIR_HEADER_SIZE)
+		return -EINVAL;
+
+	const uint8_t *header = (const uint8_t *)data;
+	if (read_le32(header) != COMPACT_DIR_VERSION)
+		return -EINVAL;
+
+	size_t count = read_le32(header + 4);
+	uint32_t flags = read_le32(header + 8);
+	size_t blocks_count = (count + COMPACT_DIR_BLOCK_ENTRIES - 1) / COMPACT_DIR_BLOCK_ENTRIES;
+
+	size_t offsets_size = blocks_count * COLUMN_COUNT * 4;
+	size_t expected = COMPACT_DIR_HEADER_SIZE + offsets_size;
+	size_t column_sizes[COLUMN_COUNT];
+	for (int c = 0; c < COLUMN_COUNT; c++)
+	{
+		column_sizes[c] = read_le32(header + 12 + 4 * c);
+		expected += column_sizes[c];
+	}
+
+	size_t hashes_size = ((flags & COMPACT_DIR_FLAG_HASHES) != 0) ? count * COMPACT_DIR_HASH_SIZE : 0;
+	expected += hashes_size;
+
+	if (expected != size)
+		return -EINVAL;
+
+	struct compact_dir *result = (struct compact_dir *)calloc(1, sizeof(struct compact_dir));
+	if (result == NULL)
+		return -ENOMEM;
+
+	if (copy)
+	{
+		result->owned_data = (uint8_t *)malloc(size);
+		if (result->owned_data == NULL)
+		{
+			free(result);
+			return -ENOMEM;
+		}
+		memcpy(result->owned_data, data, size);
+		result->data = result->owned_data;
+	}
+	else
+	{
+		result->data = (const uint8_t *)data;
+	}
+
+	result->size = size;
+	result->count = count;
+	result->blocks_count = blocks_count;
+	result->block_offsets = result->data + COMPACT_DIR_HEADER_SIZE;
+
+	const uint8_t *pos = result->block_offsets + offsets_size;
+	for (int c = 0; c < COLUMN_COUNT; c++)
+	{
+		result->column_start[c] = pos;
+		pos += column_sizes[c];
+		result->column_end[c] = pos;
+	}
+	result->hashes = (hashes_size > 0) ? pos : NULL;
+
+	// Block offsets must point inside of columns
+	for (size_t b = 0; b < blocks_count; b++)
+	{
+		for (int c = 0; c < COLUMN_COUNT; c++)
+		{
+			if (read_le32(result->block_offsets + (b * COLUMN_COUNT + c) * 4) > column_sizes[c])
+			{
+				// Not freeing with compact_dir_free() to keep borrowed data untouched
+				free(result->owned_data);
+				free(result);
+				return -EINVAL;
+			}
+		}
+	}
+
+	*dir = result;
+	return 0;
+}
+
+/**
+ * Free a compact directory
+ *
+ * @param dir is the directory to free (can be NULL)
+ */
+void compact_dir_free(struct compact_dir *dir)
+{
+	if (dir == NULL)
+		return;
+
+	free(dir->owned_data);
+	free(dir);
+}
+
+/**
+ * Get the number of entries of a compact directory
+ *
+ * @param dir is the directory
+ * @return number of entries
+ */
+size_t compact_dir_count(const struct compact_dir *dir)
+{
+	return dir->count;
+}
+
+/**
+ * Get the serialized blob of a compact directory
+ *
+ * @param dir is the directory
+ * @param size is the size of the blob
+ * @return pointer to the blob
+ */
+const void *compact_dir_data(const struct compact_dir *dir, size_t *size)
+{
+	*size = dir->size;
+	return dir->data;
+}
+
+/**
+ * Get the number of bytes used by a compact directory in memory
+ *
+ * @param dir is the directory
+ * @return number of bytes
+ */
+size_t compact_dir_memory_usage(const struct compact_dir *dir)
+{
+	return sizeof(struct compact_dir) + ((dir->owned_data != NULL) ? dir->size : 0);
+}
+
+/**
+ * Initialize a cursor at the first entry of a compact directory
+ *
+ * @param cursor is the cursor
+ * @param dir is the directory
+ */
+void compact_dir_cursor_init(struct compact_dir_cursor *cursor, const struct compact_dir *dir)
+{
+	memset(cursor, 0, sizeof(struct compact_dir_cursor));
+	cursor->dir = dir;
+	(void)compact_dir_cursor_seek(cursor, 0);
+}
+
+/**
+ * Move a cursor to the start of the block
+ *
+ * @param cursor is the cursor
+ * @param block is the block index
+ */
+static void compact_dir_cursor_set_block(struct compact_dir_cursor *cursor, size_t block)
+{
+	const struct compact_dir *dir = cursor->dir;
+	for (int c = 0; c < COLUMN_COUNT; c++)
+	{
+		uint32_t offset = read_le32(dir->block_offsets + (block * COLUMN_COUNT + c) * 4);
+		cursor->pos[c] = dir->column_start[c] + offset;
+	}
+	cursor->index = block * COMPACT_DIR_BLOCK_ENTRIES;
+	memset(&cursor->prev, 0, sizeof(cursor->prev));
+	cursor->name_len = 0;
+}
+
+/**
+ * Move a cursor to the entry with the index
+ *
+ * @param cursor is the cursor
+ * @param index is the index of the entry (can be equal to count for the end)
+ * @return 0 on success, nonzero value on error
+ */
+int compact_dir_cursor_seek(struct compact_dir_cursor *cursor, size_t index)
+{
+	const struct compact_dir *dir = cursor->dir;
+	if (index > dir->count)
+		return -EINVAL;
+
+	if (index == dir->count)
+	{
+		cursor->index = index;
+		return 0;
+	}
+
+	// Continue from the current position if it's in the same block and before index
+	bool same_block = (cursor->index / COMPACT_DIR_BLOCK_ENTRIES == index / COMPACT_DIR_BLOCK_ENTRIES);
+	if (!same_block || cursor->index > index || cursor->index >= dir->count)
+	{
+		compact_dir_cursor_set_block(cursor, index / COMPACT_DIR_BLOCK_ENTRIES);
+	}
+
+	struct compact_dir_entry entry;
+	while (cursor->index < index)
+	{
+		int res = compact_dir_cursor_next(cursor, &entry);
+		if (res != 0)
+			return (res > 0) ? -EINVAL : res;
+	}
+
+	return 0;
+}
+
+/**
+ * Read unsigned varint from a column of the cursor
+ *
+ * @param cursor is the cursor
+ * @param column is the column
+ * @param value is the read value
+ * @return 0 on success, -EINVAL for broken data
+ */
+static int cursor_read(struct compact_dir_cursor *cursor, int column, uint64_t *value)
+{
+	if (varint_decode(&cursor->pos[column], cursor->dir->column_end[column], value) != 0)
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * Read signed (zigzag) varint from a column of the cursor
+ *
+ * @param cursor is the cursor
+ * @param column is the column
+ * @param value is the read value
+ * @return 0 on success, -EINVAL for broken data
+ */
+static int cursor_read_signed(struct compact_dir_cursor *cursor, int column, int64_t *value)
+{
+	uint64_t raw;
+	if (cursor_read(cursor, column, &raw) != 0)
+		return -EINVAL;
+	*value = zigzag_decode(raw);
+	return 0;
+}
+
+/**
+ * Decode the next entry and move the cursor
+ *
+ * @param cursor is the cursor
+ * @param entry is the decoded entry
+ * @return 0 on success, 1 at the end of directory, negative value for broken data
+ */
+int compact_dir_cursor_next(struct compact_dir_cursor *cursor, struct compact_dir_entry *entry)
+{
+	const struct compact_dir *dir = cursor->dir;
+	if (cursor->index >= dir->count)
+		return 1;
+
+	if (cursor->index % COMPACT_DIR_BLOCK_ENTRIES == 0)
+	{
+		compact_dir_cursor_set_block(cursor, cursor->index / COMPACT_DIR_BLOCK_ENTRIES);
+	}
+
+	// Name
+	uint64_t prefix;
+	uint64_t suffix;
+	if (cursor_read(cursor, COLUMN_NAME, &prefix) != 0 ||
+		cursor_read(cursor, COLUMN_NAME, &suffix) != 0 ||
+		prefix > cursor->name_len ||
+		suffix > (uint64_t)(dir->column_end[COLUMN_NAME] - cursor->pos[COLUMN_NAME]))
+	{
+		return -EINVAL;
+	}
+
+	size_t name_len = (size_t)(prefix + suffix);
+	if (name_len + 1 > cursor->name_capacity)
+	{
+		size_t new_capacity = (cursor->name_capacity == 0) ? 256 : cursor->name_capacity;
+		while (new_capacity < name_len + 1)
+		{
+			new_capacity *= 2;
+		}
+
+		char *new_name = (char *)realloc(cursor->name, new_capacity);
+		if (new_name == NULL)
+			return -ENOMEM;
+
+		cursor->name = new_name;
+		cursor->name_capacity = new_capacity;
+	}
+
+	memcpy(cursor->name + prefix, cursor->pos[COLUMN_NAME], (size_t)suffix);
+	cursor->pos[COLUMN_NAME] += suffix;
+	cursor->name[name_len] = '\0';
+	cursor->name_len = name_len;
+
+	// Metadata
+	struct filestat *s = &entry->my_stat;
+	const struct filestat *prev = &cursor->prev;
+	memset(s, 0, sizeof(struct filestat));
+
+	uint64_t u = 0;
+	int64_t d = 0;
+	int res = 0;
+
+	res |= cursor_read(cursor, COLUMN_SIZE, &u);
+	s->size = (int64_t)u;
+	res |= cursor_read_signed(cursor, COLUMN_BLOCKS, &d);
+	s->blocks = delta_decode(convert_filesize_to_fileblocks(s->size), d);
+	res |= cursor_read_signed(cursor, COLUMN_MODE, &d);
+	s->mode = (uint32_t)delta_decode(prev->mode, d);
+	res |= cursor_read_signed(cursor, COLUMN_UID, &d);
+	s->uid = (uint32_t)delta_decode(prev->uid, d);
+	res |= cursor_read_signed(cursor, COLUMN_GID, &d);
+	s->gid = (uint32_t)delta_decode(prev->gid, d);
+
+	res |= cursor_read_signed(cursor, COLUMN_MTIME, &d);
+	s->mtime = delta_decode(prev->mtime, d);
+	res |= cursor_read(cursor, COLUMN_MTIMENSEC, &u);
+	s->mtimensec = (int64_t)u;
+	res |= cursor_read_signed(cursor, COLUMN_ATIME, &d);
+	s->atime = delta_decode(s->mtime, d);
+	res |= cursor_read_signed(cursor, COLUMN_ATIMENSEC, &d);
+	s->atimensec = delta_decode(s->mtimensec, d);
+	res |= cursor_read_signed(cursor, COLUMN_CTIME, &d);
+	s->ctime = delta_decode(s->mtime, d);
+	res |= cursor_read_signed(cursor, COLUMN_CTIMENSEC, &d);
+	s->ctimensec = delta_decode(s->mtimensec, d);
+
+	res |= cursor_read_signed(cursor, COLUMN_NLINK, &d);
+	s->nlink = (uint64_t)delta_decode((int64_t)prev->nlink, d);
+	res |= cursor_read_signed(cursor, COLUMN_BLKSIZE, &d);
+	s->blksize = delta_decode(prev->blksize, d);
+
+	uint64_t target_len = 0;
+	res |= cursor_read(cursor, COLUMN_TARGET, &target_len);
+	if (res != 0 ||
+		target_len > (uint64_t)(dir->column_end[COLUMN_TARGET] - cursor->pos[COLUMN_TARGET]))
+	{
+		return -EINVAL;
+	}
+
+	entry->link_target = (target_len > 0) ? (const char *)cursor->pos[COLUMN_TARGET] : NULL;
+	entry->link_target_len = (size_t)target_len;
+	cursor->pos[COLUMN_TARGET] += target_len;
+
+	if (dir->hashes != NULL)
+	{
+		hash_to_hex(dir->hashes + cursor->index * COMPACT_DIR_HASH_SIZE, s->sha256);
+	}
+
+	entry->index = cursor->index;
+	entry->name = cursor->name;
+	entry->name_len = cursor->name_len;
+
+	cursor->prev = *s;
+	cursor->index++;
+
+	return 0;
+}
+
+/**
+ * Free resources of a cursor
+ *
+ * @param cursor is the cursor
+ */
+void compact_dir_cursor_free(struct compact_dir_cursor *cursor)
+{
+	free(cursor->name);
+	cursor->name = NULL;
+	cursor->name_capacity = 0;
+	cursor->name_len = 0;
+}
+
+/**
+ * Compare the first name of the block with the name
+ *
+ * @param dir is the directory
+ * @param block is the block index
+ * @param name is the name to compare with
+ * @param cmp is the result of comparison (like strcmp(first_name, name))
+ * @return 0 on success, -EINVAL for broken data
+ */
+static int compact_dir_compare_block_name(const struct compact_dir *dir, size_t block, const char *name, int *cmp)
+{
+	const uint8_t *pos = dir->column_start[COLUMN_NAME] +
+						 read_le32(dir->block_offsets + (block * COLUMN_COUNT + COLUMN_NAME) * 4);
+	const uint8_t *end = dir->column_end[COLUMN_NAME];
+
+	uint64_t prefix;
+	uint64_t len;
+	if (varint_decode(&pos, end, &prefix) != 0 ||
+		varint_decode(&pos, end, &len) != 0 ||
+		prefix != 0 ||
+		len > (uint64_t)(end - pos))
+	{
+		return -EINVAL;
+	}
+
+	size_t name_len = strlen(name);
+	size_t min_len = ((size_t)len < name_len) ? (size_t)len : name_len;
+	int res = memcmp(pos, name, min_len);
+	if (res == 0)
+	{
+		res = ((size_t)len < name_len) ? -1 : (((size_t)len > name_len) ? 1 : 0);
+	}
+
+	*cmp = res;
+	return 0;
+}
+
+/**
+ * Find an entry by name
+ *
+ * @param dir is the directory
+ * @param name is the name to find
+ * @param cursor is an initialized cursor to use for decoding (entry data points to it)
+ * @param entry is the found entry
+ * @return 0 if found, -ENOENT if not found, other negative value for broken data
+ */
+int compact_dir_find(const struct compact_dir *dir, const char *name,
+					 struct compact_dir_cursor *cursor, struct compact_dir_entry *entry)
+{
+	if (dir->count == 0)
+		return -ENOENT;
+
+	// Find the last block with the first name <= name
+	size_t low = 0;
+	size_t high = dir->blocks_count;
+	while (high - low > 1)
+	{
+		size_t mid = low + (high - low) / 2;
+		int cmp;
+		if (compact_dir_compare_block_name(dir, mid, name, &cmp) != 0)
+			return -EINVAL;
+
+		if (cmp <= 0)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	cursor->dir = dir;
+	compact_dir_cursor_set_block(cursor, low);
+
+	size_t block_end = (low + 1) * COMPACT_DIR_BLOCK_ENTRIES;
+	while (cursor->index < dir->count && cursor->index < block_end)
+	{
+		int res = compact_dir_cursor_next(cursor, entry);
+		if (res != 0)
+			return (res > 0) ? -ENOENT : res;
+
+		int cmp = strcmp(entry->name, name);
+		if (cmp == 0)
+			return 0;
+		if (cmp > 0)
+			break;
+	}
+
+	return -ENOENT;
+}
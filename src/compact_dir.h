@@ -0,0 +1,203 @@
+#ifndef INC_CATALOGFS_COMPACT_DIR_H
+#define INC_CATALOGFS_COMPACT_DIR_H
+
+#include "header_common.h"
+
+#include "filestat.h"
+
+/**
+ * Compact in-memory representation of one directory of a catalog.
+ *
+ * Holding a huge catalog in memory as one C string per path and one struct
+ * filestat per entry costs hundreds of bytes per entry. This representation
+ * keeps all entries of a directory in one position-independent blob:
+ *
+ *  - names are sorted and front-coded (shared prefix length with the previous
+ *    name + the rest of the name), so names are interned per directory;
+ *  - metadata is stored as struct-of-arrays columns (sizes, modes, times, ...)
+ *    of varints, most of them delta-encoded with the previous entry
+ *    (modes, uid, gid, mtime) or with mtime of the same entry (atime, ctime);
+ *  - entries are grouped in blocks of COMPACT_DIR_BLOCK_ENTRIES, every block
+ *    restarts front coding and deltas and has offsets into every column,
+ *    so lookup by name is a binary search over blocks plus a short scan.
+ *
+ * Typical entry takes about 20-35 bytes (plus the unshared part of its name).
+ * The blob has little-endian fixed-size fields and can be saved to a file and
+ * used directly from mmap()-ed memory (see compact_dir_from_buffer()).
+ */
+
+/** Number of entries in one block */
+#define COMPACT_DIR_BLOCK_ENTRIES (32)
+
+/** Number of columns (name, size, blocks, mode, uid, gid, 3 times with nsecs, nlink, blksize, target) */
+#define COMPACT_DIR_COLUMNS (15)
+
+/**
+ * Input entry for compact_dir_build()
+ */
+struct compact_dir_input
+{
+	/** Name of the entry */
+	const char *name;
+
+	/** Metadata of the entry (mode includes the type of the entry) */
+	struct filestat my_stat;
+
+	/** Target of symlink (NULL for other types) */
+	const char *link_target;
+};
+
+/**
+ * Decoded entry of a compact directory
+ */
+struct compact_dir_entry
+{
+	/** Index of the entry in the directory */
+	size_t index;
+
+	/** Name of the entry (valid until the next call with the same cursor) */
+	const char *name;
+
+	/** Length of the name */
+	size_t name_len;
+
+	/** Metadata of the entry */
+	struct filestat my_stat;
+
+	/** Target of symlink, not null-terminated (NULL for other types) */
+	const char *link_target;
+
+	/** Length of the symlink target */
+	size_t link_target_len;
+};
+
+// Forward declaration
+struct compact_dir;
+
+/**
+ * Sequential decoder of entries of a compact directory
+ */
+struct compact_dir_cursor
+{
+	/** Directory being decoded */
+	const struct compact_dir *dir;
+
+	/** Index of the next entry */
+	size_t index;
+
+	/** Current positions in columns */
+	const uint8_t *pos[COMPACT_DIR_COLUMNS];
+
+	/** Previous entry (base for deltas) */
+	struct filestat prev;
+
+	/** Buffer with the current name */
+	char *name;
+
+	/** Length of the current name */
+	size_t name_len;
+
+	/** Allocated size of the name buffer */
+	size_t name_capacity;
+};
+
+/**
+ * Build a compact directory from entries
+ *
+ * @param inputs is the array of entries sorted by name (strcmp order, no duplicates)
+ * @param count is the number of entries
+ * @param dir is the result (must be freed by compact_dir_free())
+ * @return 0 on success, -EINVAL for unsorted input, -ENOMEM on error
+ */
+int compact_dir_build(const struct compact_dir_input *inputs, size_t count, struct compact_dir **dir);
+
+/**
+ * Make a compact directory from a serialized blob (see compact_dir_data()).
+ * The blob is validated, so it's safe to use data from files.
+ *
+ * @param data is the blob
+ * @param size is the size of the blob
+ * @param copy determines if the blob should be copied (otherwise it must outlive the directory)
+ * @param dir is the result (must be freed by compact_dir_free())
+ * @return 0 on success, -EINVAL for broken blob, -ENOMEM on error
+ */
+int compact_dir_from_buffer(const void *data, size_t size, bool copy, struct compact_dir **dir);
+
+/**
+ * Free a compact directory
+ *
+ * @param dir is the directory to free (can be NULL)
+ */
+void compact_dir_free(struct compact_dir *dir);
+
+/**
+ * Get the number of entries of a compact directory
+ *
+ * @param dir is the directory
+ * @return number of entries
+ */
+size_t compact_dir_count(const struct compact_dir *dir);
+
+/**
+ * Get the serialized blob of a compact directory
+ *
+ * @param dir is the directory
+ * @param size is the size of the blob
+ * @return pointer to the blob
+ */
+const void *compact_dir_data(const struct compact_dir *dir, size_t *size);
+
+/**
+ * Get the number of bytes used by a compact directory in memory
+ *
+ * @param dir is the directory
+ * @return number of bytes
+ */
+size_t compact_dir_memory_usage(const struct compact_dir *dir);
+
+/**
+ * Initialize a cursor at the first entry of a compact directory
+ *
+ * @param cursor is the cursor
+ * @param dir is the directory
+ */
+void compact_dir_cursor_init(struct compact_dir_cursor *cursor, const struct compact_dir *dir);
+
+/**
+ * Move a cursor to the entry with the index
+ *
+ * @param cursor is the cursor
+ * @param index is the index of the entry (can be equal to count for the end)
+ * @return 0 on success, nonzero value on error
+ */
+int compact_dir_cursor_seek(struct compact_dir_cursor *cursor, size_t index);
+
+/**
+ * Decode the next entry and move the cursor
+ *
+ * @param cursor is the cursor
+ * @param entry is the decoded entry
+ * @return 0 on success, 1 at the end of directory, negative value for broken data
+ */
+int compact_dir_cursor_next(struct compact_dir_cursor *cursor, struct compact_dir_entry *entry);
+
+/**
+ * Free resources of a cursor
+ *
+ * @param cursor is the cursor
+ */
+void compact_dir_cursor_free(struct compact_dir_cursor *cursor);
+
+/**
+ * Find an entry by name
+ *
+ * @param dir is the directory
+ * @param name is the name to find
+ * @param cursor is an initialized cursor to use for decoding (entry data points to it)
+ * @param entry is the found entry
+ * @return 0 if found, -ENOENT if not found, other negative value for broken data
+ */
+int compact_dir_find(const struct compact_dir *dir, const char *name,
+					 struct compact_dir_cursor *cursor, struct compact_dir_entry *entry);
+
+#endif // INC_CATALOGFS_COMPACT_DIR_H
@@ -0,0 +1,381 @@
+#include "header_common.h"
+
+#include "control.h"
+
+/** Names of entries of the control directory */
+static const char *const control_names[] = {
+	CONTROL_STATS_NAME,
+	CONTROL_INGEST_NAME,
+	CONTROL_QUERY_NAME,
+	NULL};
+
+/** Prefix of names of results that are made of rows */
+#define CONTROL_QUERY_ROW_PREFIX "%R"
+
+/**
+ * Find the control node by the path
+ *
+ * @param path is the absolute path inside the mounted filesystem
+ * @return the node, CONTROL_NODE_NONE if the path is not inside the control directory
+ */
+enum control_node control_lookup(const char *path)
+{
+	static const size_t dir_len = sizeof(CONTROL_DIR_NAME) - 1;
+
+	if (path[0] != '/' || strncmp(path + 1, CONTROL_DIR_NAME, dir_len) != 0)
+		return CONTROL_NODE_NONE;
+
+	const char *rest = path + 1 + dir_len;
+	if (rest[0] == '\0')
+		return CONTROL_NODE_DIR;
+
+	if (rest[0] != '/')
+		return CONTROL_NODE_NONE;
+
+	if (strcmp(rest + 1, CONTROL_STATS_NAME) == 0)
+		return CONTROL_NODE_STATS;
+
+	if (strcmp(rest + 1, CONTROL_INGEST_NAME) == 0)
+		return CONTROL_NODE_INGEST;
+
+	static const size_t query_len = sizeof(CONTROL_QUERY_NAME) - 1;
+	if (strncmp(rest + 1, CONTROL_QUERY_NAME, query_len) == 0)
+	{
+		if (rest[1 + query_len] == '\0')
+			return CONTROL_NODE_QUERY_DIR;
+
+		struct query query;
+		const char *name;
+		if (rest[1 + query_len] == '/' && control_parse_query(path, &query, &name) == 0)
+			return (name == NULL) ? CONTROL_NODE_QUERY_DIR : CONTROL_NODE_QUERY_RESULT;
+	}
+
+	return CONTROL_NODE_MISSING;
+}
+
+/**
+ * Fill stat of the control node
+ *
+ * @param node is the node (not CONTROL_NODE_NONE or CONTROL_NODE_MISSING)
+ * @param root_stbuf is the stat of the source directory (owner and times are taken from it)
+ * @param stbuf is the target stat
+ */
+void control_fill_stat(enum control_node node, const struct stat *root_stbuf, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+
+	stbuf->st_uid = root_stbuf->st_uid;
+	stbuf->st_gid = root_stbuf->st_gid;
+	stbuf->st_atim = root_stbuf->st_atim;
+	stbuf->st_mtim = root_stbuf->st_mtim;
+	stbuf->st_ctim = root_stbuf->st_ctim;
+	stbuf->st_blksize = root_stbuf->st_blksize;
+
+	if (node == CONTROL_NODE_DIR || node == CONTROL_NODE_QUERY_DIR)
+	{
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	}
+	else if (node == CONTROL_NODE_QUERY_RESULT)
+	{
+		// The size is the length of the target, it's filled by the filesystem
+		stbuf->st_mode = S_IFLNK | 0777;
+		stbuf->st_nlink = 1;
+	}
+	else if (node == CONTROL_NODE_INGEST)
+	{
+		// Only the owner of the source directory can create entries in it
+		stbuf->st_mode = S_IFREG | 0200;
+		stbuf->st_nlink = 1;
+	}
+	else
+	{
+		/*
+		 * Content is generated on open() and read with direct_io,
+		 * so the size is not known in advance and is shown as zero.
+		 */
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+	}
+}
+
+/**
+ * Get names of entries of the control directory
+ *
+ * @return NULL-terminated array of names
+ */
+const char *const *control_dir_names(void)
+{
+	return control_names;
+}
+
+/**
+ * Parse the query of a path inside the query directory
+ *
+ * @param path is the absolute path of CONTROL_NODE_QUERY_DIR or CONTROL_NODE_QUERY_RESULT
+ * @param query is the parsed query (predicates of all directories)
+ * @param name is the name of the result (NULL for directories)
+ * @return 0 on success, -ENOENT if the path is not a query path
+ */
+int control_parse_query(const char *path, struct query *query, const char **name)
+{
+	static const char prefix[] = "/" CONTROL_DIR_NAME "/" CONTROL_QUERY_NAME;
+
+	memset(query, 0, sizeof(struct query));
+	*name = NULL;
+
+	if (strncmp(path, prefix, sizeof(prefix) - 1) != 0)
+		return -ENOENT;
+
+	const char *component = path + sizeof(prefix) - 1;
+	if (component[0] == '\0')
+		return 0;
+	if (component[0] != '/')
+		return -ENOENT;
+
+	char predicate[NAME_MAX + 1];
+	while (component[0] == '/')
+	{
+		component++;
+		size_t len = strcspn(component, "/");
+		if (len == 0 || len > NAME_MAX)
+			return -ENOENT;
+
+		memcpy(predicate, component, len);
+		predicate[len] = '\0';
+		if (query_add_predicate(query, predicate) != 0)
+		{
+			// Only the last component of a query with predicates can be a result
+			if (component[len] != '\0' || query->count == 0)
+				return -ENOENT;
+
+			*name = component;
+			return 0;
+		}
+
+		component += len;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the length of an escaped part of a path
+ *
+ * @param path is the part of the path
+ * @param len is the length of the part
+ * @return the length of the escaped part
+ */
+static size_t escaped_length(const char *path, size_t len)
+{
+	size_t escaped = len;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (path[i] == '%' || path[i] == '/')
+			escaped += 2;
+	}
+	return escaped;
+}
+
+/**
+ * Escape a part of a path ('%' is "%25", '/' is "%2F")
+ *
+ * @param path is the part of the path
+ * @param len is the length of the part
+ * @param target is the target buffer (large enough, see escaped_length())
+ */
+static void escape_path(const char *path, size_t len, char *target)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (path[i] == '%' || path[i] == '/')
+		{
+			*target++ = '%';
+			*target++ = '2';
+			*target++ = (path[i] == '%') ? '5' : 'F';
+		}
+		else
+		{
+			*target++ = path[i];
+		}
+	}
+	*target = '\0';
+}
+
+/**
+ * Make the name of a result of a query
+ *
+ * @param index is the index
+ * @param row is the row of the found entry
+ * @param name is the target buffer
+ */
+void control_query_result_name(const struct query_index *index, uint32_t row, char name[NAME_MAX + 1])
+{
+	const char *path = query_index_path(index, row);
+	size_t len = strlen(path);
+	if (escaped_length(path, len) <= NAME_MAX)
+	{
+		escape_path(path, len, name);
+		return;
+	}
+
+	// The row makes the name unique, the end of the path is only for people
+	int prefix_len = snprintf(name, NAME_MAX + 1, "%s%" PRIu32 "%%", CONTROL_QUERY_ROW_PREFIX, row);
+	size_t budget = NAME_MAX - (size_t)prefix_len;
+	size_t start = len;
+	size_t used = 0;
+	while (start > 0)
+	{
+		size_t cost = (path[start - 1] == '%' || path[start - 1] == '/') ? 3 : 1;
+		if (used + cost > budget)
+			break;
+		used += cost;
+		start--;
+	}
+
+	// Do not start in the middle of a UTF-8 sequence
+	while (start < len && ((unsigned char)path[start] & 0xC0) == 0x80)
+		start++;
+
+	escape_path(path + start, len - start, name + prefix_len);
+}
+
+/**
+ * Find the row of a result of a query by its name
+ *
+ * @param index is the index
+ * @param name is the name of the result
+ * @param row is the found row
+ * @return 0 on success, -ENOENT if there is no such entry in the index
+ */
+int control_query_result_find(const struct query_index *index, const char *name, uint32_t *row)
+{
+	size_t len = strlen(name);
+	if (len > NAME_MAX)
+		return -ENOENT;
+
+	if (strncmp(name, CONTROL_QUERY_ROW_PREFIX, sizeof(CONTROL_QUERY_ROW_PREFIX) - 1) == 0)
+	{
+		char *end = NULL;
+		errno = 0;
+		unsigned long long parsed = strtoull(name + sizeof(CONTROL_QUERY_ROW_PREFIX) - 1, &end, 10);
+		if (errno != 0 || *end != '%' || parsed >= query_index_count(index))
+			return -ENOENT;
+
+		// The whole name must be the same as the one of the row in the current index
+		char expected[NAME_MAX + 1];
+		control_query_result_name(index, (uint32_t)parsed, expected);
+		if (strcmp(expected, name) != 0)
+			return -ENOENT;
+
+		*row = (uint32_t)parsed;
+		return 0;
+	}
+
+	char path[NAME_MAX + 1];
+	size_t path_len = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (name[i] != '%')
+		{
+			path[path_len++] = name[i];
+			continue;
+		}
+
+		if (strncmp(name + i, "%25", 3) == 0)
+			path[path_len++] = '%';
+		else if (strncmp(name + i, "%2F", 3) == 0)
+			path[path_len++] = '/';
+		else
+			return -ENOENT;
+		i += 2;
+	}
+	path[path_len] = '\0';
+
+	return query_index_find(index, path, row);
+}
+
+/**
+ * Make the target of the symlink of a result of a query
+ *
+ * @param index is the index
+ * @param row is the row of the found entry
+ * @param depth is the number of predicates of the query
+ * @return new allocated target, NULL on error
+ */
+char *control_query_result_target(const struct query_index *index, uint32_t row, size_t depth)
+{
+	// Symlinks are in /.catalogfs/query/<predicates>, so it's depth + 2 levels up to the root
+	size_t ups = depth + 2;
+	const char *path = query_index_path(index, row);
+	size_t len = strlen(path);
+
+	char *target = (char *)malloc(ups * 3 + len + 1);
+	if (target == NULL)
+		return NULL;
+
+	for (size_t i = 0; i < ups; i++)
+	{
+		memcpy(target + i * 3, "../", 3);
+	}
+	memcpy(target + ups * 3, path, len + 1);
+	return target;
+}
+
+/**
+ * Make a control file with the content (ownership of data is taken)
+ *
+ * @param node is the node of the file
+ * @param data is the content
+ * @param size is the size of the content
+ * @return the file, NULL on error (data is freed)
+ */
+struct control_file *control_file_new(enum control_node node, char *data, size_t size)
+{
+	struct control_file *file = (struct control_file *)malloc(sizeof(struct control_file));
+	if (file == NULL)
+	{
+		free(data);
+		return NULL;
+	}
+
+	file->node = node;
+	file->data = data;
+	file->size = size;
+	file->state = NULL;
+	return file;
+}
+
+/**
+ * Read the content of a control file
+ *
+ * @param file is the file
+ * @param buf is the target buffer
+ * @param size is the size of the buffer
+ * @param offset is the offset in the file
+ * @return number of read bytes
+ */
+size_t control_file_read(const struct control_file *file, char *buf, size_t size, off_t offset)
+{
+	if (offset < 0 || (uint64_t)offset >= file->size)
+		return 0;
+
+	size_t available = file->size - (size_t)offset;
+	size_t count = (size < available) ? size : available;
+	memcpy(buf, file->data + offset, count);
+	return count;
+}
+
+/**
+ * Free a control file (its state must be freed before)
+ *
+ * @param file is the file (can be NULL)
+ */
+void control_file_free(struct control_file *file)
+{
+	if (file == NULL)
+		return;
+
+	free(file->data);
+	free(file);
+}
@@ -0,0 +1,193 @@
+#ifndef INC_CATALOGFS_CONTROL_H
+#define INC_CATALOGFS_CONTROL_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "query_index.h"
+
+/**
+ * Virtual control directory of the mounted filesystem.
+ *
+ * The directory /.catalogfs is not listed in the root directory (like .zfs
+ * snapshot directories) but can be accessed by its path. It contains
+ * virtual files that are generated by the filesystem itself, e.g.
+ * `stats` with counters of caches and progress of the warm-up, and
+ * write-only files that take commands, e.g. `ingest` with records of
+ * entries to create (see ingest.h).
+ *
+ * The directory `query` answers queries of metadata (see query_index.h):
+ * every component of a path under it is a predicate, e.g.
+ * /.catalogfs/query/size>1G/mtime<2015, and a directory of predicates lists
+ * matching entries as symlinks to them. Names of the symlinks are relative
+ * paths of entries with '%' and '/' escaped as "%25" and "%2F". Names that
+ * would be longer than NAME_MAX are "%R<row>%" and the end of the escaped
+ * path instead (rows are numbers of entries in the current index, so such
+ * names are valid only until the catalog is changed). The query directory
+ * itself lists nothing.
+ *
+ * A real file or directory with the same name in the root of the source
+ * directory is hidden by the control directory.
+ */
+
+/** Name of the control directory in the root of the filesystem */
+#define CONTROL_DIR_NAME ".catalogfs"
+
+/** Name of the statistics file in the control directory */
+#define CONTROL_STATS_NAME "stats"
+
+/** Name of the bulk ingestion file in the control directory */
+#define CONTROL_INGEST_NAME "ingest"
+
+/** Name of the query directory in the control directory */
+#define CONTROL_QUERY_NAME "query"
+
+/**
+ * Nodes of the control directory
+ */
+enum control_node
+{
+	/** Not a path inside of the control directory */
+	CONTROL_NODE_NONE,
+
+	/** Unknown path inside of the control directory */
+	CONTROL_NODE_MISSING,
+
+	/** The control directory itself */
+	CONTROL_NODE_DIR,
+
+	/** Statistics file */
+	CONTROL_NODE_STATS,
+
+	/** Bulk ingestion file (write-only) */
+	CONTROL_NODE_INGEST,
+
+	/** Query directory or its subdirectory of predicates */
+	CONTROL_NODE_QUERY_DIR,
+
+	/** Name in a subdirectory of predicates (a found entry if it's in the results) */
+	CONTROL_NODE_QUERY_RESULT
+};
+
+/**
+ * Content of an opened control file (stored in fh field of fuse_file_info)
+ */
+struct control_file
+{
+	/** Node of the file */
+	enum control_node node;
+
+	/** Content of the file */
+	char *data;
+
+	/** Size of the content */
+	size_t size;
+
+	/** State of a write-only file (owned and freed by the filesystem, NULL for read-only files) */
+	void *state;
+};
+
+/**
+ * Find the control node by the path
+ *
+ * @param path is the absolute path inside the mounted filesystem
+ * @return the node, CONTROL_NODE_NONE if the path is not inside the control directory
+ */
+enum control_node control_lookup(const char *path);
+
+/**
+ * Check if the path is inside the control directory (or is the directory itself)
+ *
+ * @param path is the absolute path inside the mounted filesystem
+ * @return true if the path is a control path
+ */
+static inline bool control_is_path(const char *path)
+{
+	return control_lookup(path) != CONTROL_NODE_NONE;
+}
+
+/**
+ * Fill stat of the control node
+ *
+ * @param node is the node (not CONTROL_NODE_NONE or CONTROL_NODE_MISSING)
+ * @param root_stbuf is the stat of the source directory (owner and times are taken from it)
+ * @param stbuf is the target stat
+ */
+void control_fill_stat(enum control_node node, const struct stat *root_stbuf, struct stat *stbuf);
+
+/**
+ * Get names of entries of the control directory
+ *
+ * @return NULL-terminated array of names
+ */
+const char *const *control_dir_names(void);
+
+/**
+ * Parse the query of a path inside the query directory
+ *
+ * @param path is the absolute path of CONTROL_NODE_QUERY_DIR or CONTROL_NODE_QUERY_RESULT
+ * @param query is the parsed query (predicates of all directories)
+ * @param name is the name of the result (NULL for directories)
+ * @return 0 on success, -ENOENT if the path is not a query path
+ */
+int control_parse_query(const char *path, struct query *query, const char **name);
+
+/**
+ * Make the name of a result of a query
+ *
+ * @param index is the index
+ * @param row is the row of the found entry
+ * @param name is the target buffer
+ */
+void control_query_result_name(const struct query_index *index, uint32_t row, char name[NAME_MAX + 1]);
+
+/**
+ * Find the row of a result of a query by its name
+ *
+ * @param index is the index
+ * @param name is the name of the result
+ * @param row is the found row
+ * @return 0 on success, -ENOENT if there is no such entry in the index
+ */
+int control_query_result_find(const struct query_index *index, const char *name, uint32_t *row);
+
+/**
+ * Make the target of the symlink of a result of a query
+ *
+ * @param index is the index
+ * @param row is the row of the found entry
+ * @param depth is the number of predicates of the query
+ * @return new allocated target, NULL on error
+ */
+char *control_query_result_target(const struct query_index *index, uint32_t row, size_t depth);
+
+/**
+ * Make a control file with the content (ownership of data is taken)
+ *
+ * @param node is the node of the file
+ * @param data is the content
+ * @param size is the size of the content
+ * @return the file, NULL on error (data is freed)
+ */
+struct control_file *control_file_new(enum control_node node, char *data, size_t size);
+
+/**
+ * Read the content of a control file
+ *
+ * @param file is the file
+ * @param buf is the target buffer
+ * @param size is the size of the buffer
+ * @param offset is the offset in the file
+ * @return number of read bytes
+ */
+size_t control_file_read(const struct control_file *file, char *buf, size_t size, off_t offset);
+
+/**
+ * Free a control file (its state must be freed before)
+ *
+ * @param file is the file (can be NULL)
+ */
+void control_file_free(struct control_file *file);
+
+#endif // INC_CATALOGFS_CONTROL_H
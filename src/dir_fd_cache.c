@@ -0,0 +1,358 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dir_fd_cache.h"
+
+#ifndef O_PATH
+// Systems without O_PATH need read permission of cached directories
+#define O_PATH (O_RDONLY)
+#endif
+
+/**
+ * Cached directory descriptor
+ */
+struct dir_fd_cache_entry
+{
+	/** Relative path of the directory (the key in the table) */
+	char *path;
+
+	/** Length of the path */
+	size_t path_len;
+
+	/** O_PATH descriptor of the directory */
+	int fd;
+
+	/** Device of the directory */
+	dev_t dev;
+
+	/** Inode of the directory */
+	ino_t ino;
+
+	/** Time (monotonic) of the last check of the path */
+	struct timespec checked_at;
+
+	/** More recently used entry */
+	struct dir_fd_cache_entry *prev;
+
+	/** Less recently used entry */
+	struct dir_fd_cache_entry *next;
+};
+
+/**
+ * Get milliseconds passed since the time (monotonic clock)
+ *
+ * @param since is the time
+ * @param now is the current time
+ * @return milliseconds passed
+ */
+static int64_t elapsed_ms(const struct timespec *since, const struct timespec *now)
+{
+	return (int64_t)(now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Unlink the entry from the LRU list
+ *
+ * @param cache is the cache
+ * @param entry is the entry
+ */
+static void lru_unlink(struct dir_fd_cache *cache, struct dir_fd_cache_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->lru_head = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->lru_tail = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+/**
+ * Put the entry to the head of the LRU list
+ *
+ * @param cache is the cache
+ * @param entry is the entry (not in the list)
+ */
+static void lru_push_head(struct dir_fd_cache *cache, struct dir_fd_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->lru_head;
+	if (cache->lru_head != NULL)
+		cache->lru_head->prev = entry;
+	cache->lru_head = entry;
+	if (cache->lru_tail == NULL)
+		cache->lru_tail = entry;
+}
+
+/**
+ * Close the descriptor and free the entry (must be already removed from the table and the list)
+ *
+ * @param entry is the entry
+ */
+static void free_entry(struct dir_fd_cache_entry *entry)
+{
+	(void)close(entry->fd);
+	free(entry->path);
+	free(entry);
+}
+
+/**
+ * Remove the entry from the cache and free it
+ *
+ * @param cache is the cache
+ * @param entry is the entry
+ */
+static void drop_entry(struct dir_fd_cache *cache, struct dir_fd_cache_entry *entry)
+{
+	(void)path_hash_remove(&cache->dirs, entry->path, entry->path_len);
+	lru_unlink(cache, entry);
+	free_entry(entry);
+}
+
+/**
+ * Check that the path still leads to the cached directory
+ *
+ * @param cache is the cache
+ * @param entry is the entry
+ * @return true if the entry is valid
+ */
+static bool revalidate_entry(struct dir_fd_cache *cache, struct dir_fd_cache_entry *entry)
+{
+	if (cache->watched)
+		return true;
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (elapsed_ms(&entry->checked_at, &now) < DIR_FD_CACHE_REVALIDATE_MS)
+		return true;
+
+	// Intermediate symlinks are followed just like openat() did
+	struct stat st;
+	if (fstatat(cache->root_fd, entry->path, &st, 0) == -1 ||
+		st.st_dev != entry->dev ||
+		st.st_ino != entry->ino)
+	{
+		return false;
+	}
+
+	entry->checked_at = now;
+	return true;
+}
+
+/**
+ * Open the directory and add it to the cache
+ *
+ * @param cache is the cache
+ * @param path is the relative path of the directory (does not need to be null-terminated)
+ * @param path_len is the length of the path
+ * @return the entry, NULL on error
+ */
+static struct dir_fd_cache_entry *open_entry(struct dir_fd_cache *cache, const char *path, size_t path_len)
+{
+	struct dir_fd_cache_entry *entry = (struct dir_fd_cache_entry *)calloc(1, sizeof(struct dir_fd_cache_entry));
+	if (entry == NULL)
+		return NULL;
+
+	entry->path = strndup(path, path_len);
+	if (entry->path == NULL)
+	{
+		free(entry);
+		return NULL;
+	}
+	entry->path_len = path_len;
+
+	entry->fd = openat(cache->root_fd, entry->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (entry->fd == -1)
+	{
+		free(entry->path);
+		free(entry);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(entry->fd, &st) == -1 ||
+		path_hash_put(&cache->dirs, entry->path, entry->path_len, entry, NULL) != 0)
+	{
+		free_entry(entry);
+		return NULL;
+	}
+
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	(void)clock_gettime(CLOCK_MONOTONIC, &entry->checked_at);
+	lru_push_head(cache, entry);
+
+	// Close the least recently used descriptors over the limit
+	while (cache->dirs.count > cache->max_fds && cache->lru_tail != entry)
+	{
+		drop_entry(cache, cache->lru_tail);
+	}
+
+	return entry;
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param max_fds is the maximum number of cached descriptors (0 disables the cache,
+ *        at least two are kept otherwise, so both paths of rename() can be resolved)
+ */
+void dir_fd_cache_init(struct dir_fd_cache *cache, int root_fd, size_t max_fds)
+{
+	memset(cache, 0, sizeof(struct dir_fd_cache));
+	path_hash_init(&cache->dirs);
+	cache->root_fd = root_fd;
+	cache->max_fds = (max_fds == 1) ? 2 : max_fds;
+}
+
+/**
+ * Resolve the relative path to a directory descriptor and a name inside it.
+ *
+ * Never fails: if the parent directory can't be opened (e.g. it does not exist),
+ * the source directory descriptor and the whole path are returned, so the
+ * following *at() call reports the proper error itself.
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ * @param name is the path relative to the returned descriptor (points inside relpath)
+ * @return the directory descriptor (owned by the cache, it can be closed by
+ *         dir_fd_cache_invalidate_tree() or by the second resolution after this one,
+ *         so both paths of rename() can be resolved before the call)
+ */
+int dir_fd_cache_resolve(struct dir_fd_cache *cache, const char *relpath, const char **name)
+{
+	*name = relpath;
+
+	// Top-level paths are already relative to their parent
+	const char *slash = strrchr(relpath, '/');
+	if (cache->max_fds == 0 || slash == NULL || slash == relpath || slash[1] == '\0')
+		return cache->root_fd;
+
+	size_t dir_len = (size_t)(slash - relpath);
+	struct dir_fd_cache_entry *entry = (struct dir_fd_cache_entry *)path_hash_get(&cache->dirs, relpath, dir_len);
+	if (entry != NULL && !revalidate_entry(cache, entry))
+	{
+		drop_entry(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL)
+	{
+		cache->hits++;
+		lru_unlink(cache, entry);
+		lru_push_head(cache, entry);
+	}
+	else
+	{
+		cache->misses++;
+		entry = open_entry(cache, relpath, dir_len);
+		if (entry == NULL)
+			return cache->root_fd;
+	}
+
+	*name = slash + 1;
+	return entry->fd;
+}
+
+/**
+ * Arguments of the predicate of dir_fd_cache_invalidate_tree()
+ */
+struct invalidate_tree_arg
+{
+	/** Cache */
+	struct dir_fd_cache *cache;
+
+	/** Relative path of the directory */
+	const char *path;
+
+	/** Length of the path */
+	size_t path_len;
+};
+
+/**
+ * Check if the entry is the directory or is below it (and unlink matching entries from the list)
+ */
+static bool is_in_tree(const char *key, size_t key_len, void *value, void *arg)
+{
+	struct invalidate_tree_arg *tree = (struct invalidate_tree_arg *)arg;
+
+	if (key_len < tree->path_len ||
+		memcmp(key, tree->path, tree->path_len) != 0 ||
+		(key_len > tree->path_len && key[tree->path_len] != '/'))
+	{
+		return false;
+	}
+
+	lru_unlink(tree->cache, (struct dir_fd_cache_entry *)value);
+	return true;
+}
+
+/**
+ * Close the descriptor of a removed entry
+ *
+ * @param value is the entry
+ */
+static void free_entry_value(void *value)
+{
+	free_entry((struct dir_fd_cache_entry *)value);
+}
+
+/**
+ * Close descriptors of the directory and of all directories below it
+ * (must be called after renaming or removing a directory)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the directory
+ */
+void dir_fd_cache_invalidate_tree(struct dir_fd_cache *cache, const char *relpath)
+{
+	if (cache->dirs.count == 0)
+		return;
+
+	if (relpath[0] == '\0' || strcmp(relpath, ".") == 0)
+	{
+		dir_fd_cache_free(cache);
+		return;
+	}
+
+	struct invalidate_tree_arg arg;
+	arg.cache = cache;
+	arg.path = relpath;
+	arg.path_len = strlen(relpath);
+
+	(void)path_hash_remove_if(&cache->dirs, is_in_tree, &arg, free_entry_value);
+}
+
+/**
+ * Get the number of cached descriptors
+ *
+ * @param cache is the cache
+ * @return number of open descriptors
+ */
+size_t dir_fd_cache_count(const struct dir_fd_cache *cache)
+{
+	return cache->dirs.count;
+}
+
+/**
+ * Close all descriptors and free memory of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void dir_fd_cache_free(struct dir_fd_cache *cache)
+{
+	path_hash_clear(&cache->dirs, free_entry_value);
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+}
@@ -0,0 +1,119 @@
+#ifndef INC_CATALOGFS_DIR_FD_CACHE_H
+#define INC_CATALOGFS_DIR_FD_CACHE_H
+
+#include "header_common.h"
+
+#include "path_hash.h"
+
+/**
+ * Cache of file descriptors of directories of the source directory.
+ *
+ * All operations use relative paths from the source directory descriptor,
+ * so the kernel walks every component of a deep path again and again for
+ * every getattr(), readlink() or open(). The cache keeps O_PATH descriptors
+ * of recently used parent directories, so operations can use *at() calls
+ * relative to the immediate parent and the kernel resolves only one name.
+ *
+ * The number of open descriptors is bounded, the least recently used one is
+ * closed when the limit is reached. A cached descriptor follows the directory
+ * itself and not its path, so changes made through the filesystem must call
+ * dir_fd_cache_invalidate_tree() (rename, rmdir) and every descriptor is
+ * rechecked against its path at most once per DIR_FD_CACHE_REVALIDATE_MS to
+ * notice directories renamed directly in the source (unless the cache is
+ * marked as watched, then such renames are reported by a watcher of the
+ * source, see source_watch.h).
+ *
+ * Paths are relative paths inside the source directory (like RELPATH() in catalogfs.c).
+ * The cache is not thread-safe, callers must serialize access.
+ */
+
+/** Interval of revalidation of a cached descriptor by its path (in milliseconds) */
+#define DIR_FD_CACHE_REVALIDATE_MS (1000)
+
+/** Default maximum number of cached descriptors */
+#define DIR_FD_CACHE_DEFAULT_SIZE (256)
+
+// Forward declaration
+struct dir_fd_cache_entry;
+
+/**
+ * Cache of directory file descriptors
+ */
+struct dir_fd_cache
+{
+	/** Source directory file descriptor (not owned) */
+	int root_fd;
+
+	/** Cached directories: relative path -> struct dir_fd_cache_entry */
+	struct path_hash dirs;
+
+	/** Most recently used entry */
+	struct dir_fd_cache_entry *lru_head;
+
+	/** Least recently used entry */
+	struct dir_fd_cache_entry *lru_tail;
+
+	/** Maximum number of cached descriptors (0 disables the cache) */
+	size_t max_fds;
+
+	/** Number of resolutions answered from the cache */
+	uint64_t hits;
+
+	/** Number of resolutions that opened a directory */
+	uint64_t misses;
+
+	/** External changes are invalidated by the caller, descriptors are not rechecked */
+	bool watched;
+};
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param max_fds is the maximum number of cached descriptors (0 disables the cache,
+ *        at least two are kept otherwise, so both paths of rename() can be resolved)
+ */
+void dir_fd_cache_init(struct dir_fd_cache *cache, int root_fd, size_t max_fds);
+
+/**
+ * Resolve the relative path to a directory descriptor and a name inside it.
+ *
+ * Never fails: if the parent directory can't be opened (e.g. it does not exist),
+ * the source directory descriptor and the whole path are returned, so the
+ * following *at() call reports the proper error itself.
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ * @param name is the path relative to the returned descriptor (points inside relpath)
+ * @return the directory descriptor (owned by the cache, it can be closed by
+ *         dir_fd_cache_invalidate_tree() or by the second resolution after this one,
+ *         so both paths of rename() can be resolved before the call)
+ */
+int dir_fd_cache_resolve(struct dir_fd_cache *cache, const char *relpath, const char **name);
+
+/**
+ * Close descriptors of the directory and of all directories below it
+ * (must be called after renaming or removing a directory)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the directory
+ */
+void dir_fd_cache_invalidate_tree(struct dir_fd_cache *cache, const char *relpath);
+
+/**
+ * Get the number of cached descriptors
+ *
+ * @param cache is the cache
+ * @return number of open descriptors
+ */
+size_t dir_fd_cache_count(const struct dir_fd_cache *cache);
+
+/**
+ * Close all descriptors and free memory of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void dir_fd_cache_free(struct dir_fd_cache *cache);
+
+#endif // INC_CATALOGFS_DIR_FD_CACHE_H
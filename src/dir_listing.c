@@ -0,0 +1,575 @@
+#include "header_common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dir_listing.h"
+#include "catalog_dir.h"
+#include "compact_dir.h"
+#include "manifest.h"
+
+/** Initial capacity of the array of names read from a directory */
+#define DIR_LISTING_INITIAL_CAPACITY (64)
+
+/**
+ * Compare two entries by name for qsort() and bsearch()
+ *
+ * @param a is the first entry
+ * @param b is the second entry
+ * @return result of strcmp() for names
+ */
+static int dir_listing_entry_compare(const void *a, const void *b)
+{
+	const struct dir_listing_entry *entry_a = (const struct dir_listing_entry *)a;
+	const struct dir_listing_entry *entry_b = (const struct dir_listing_entry *)b;
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+/**
+ * Free names of entries allocated while reading a directory
+ *
+ * @param entries is the array of entries with allocated names
+ * @param count is the number of entries
+ */
+static void dir_listing_free_names(struct dir_listing_entry *entries, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		free((char *)entries[i].name);
+	}
+	free(entries);
+}
+
+/**
+ * Append an entry with a copy of the name to the growing array
+ *
+ * @param entries is the array of entries
+ * @param count is the number of entries
+ * @param capacity is the allocated size of the array
+ * @param name is the name (does not need to be null-terminated)
+ * @param name_len is the length of the name
+ * @param ino is the inode number from readdir()
+ * @param from_manifest is the flag of an entry of the manifest
+ * @return 0 on success, -ENOMEM on error
+ */
+static int dir_listing_append(struct dir_listing_entry **entries, size_t *count, size_t *capacity,
+							  const char *name, size_t name_len, ino_t ino, bool from_manifest)
+{
+	if (*count == *capacity)
+	{
+		size_t new_capacity = (*capacity == 0) ? DIR_LISTING_INITIAL_CAPACITY : *capacity * 2;
+		struct dir_listing_entry *new_entries = (struct dir_listing_entry *)realloc(
+			*entries, new_capacity * sizeof(struct dir_listing_entry));
+		if (new_entries == NULL)
+			return -ENOMEM;
+		*entries = new_entries;
+		*capacity = new_capacity;
+	}
+
+	char *copy = strndup(name, name_len);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	struct dir_listing_entry *entry = &(*entries)[*count];
+	entry->name = copy;
+	entry->ino = ino;
+	entry->from_manifest = from_manifest;
+	(*count)++;
+	return 0;
+}
+
+/**
+ * Add regular files of the manifest that are not hidden by real entries
+ *
+ * @param manifest is the manifest of the directory
+ * @param entries is the array of entries with real entries sorted by name
+ * @param count is the number of entries
+ * @param capacity is the allocated size of the array
+ * @return 0 on success, -ENOMEM on error (a broken manifest is listed up to the broken entry)
+ */
+static int dir_listing_append_manifest(const struct manifest *manifest, struct dir_listing_entry **entries,
+									   size_t *count, size_t *capacity)
+{
+	size_t real_count = *count;
+	int res = 0;
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest->dir);
+
+	struct compact_dir_entry manifest_entry;
+	while (compact_dir_cursor_next(&cursor, &manifest_entry) == 0)
+	{
+		if (!S_ISREG(manifest_entry.my_stat.mode))
+			continue;
+
+		char *name = strndup(manifest_entry.name, manifest_entry.name_len);
+		if (name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+
+		struct dir_listing_entry key;
+		key.name = name;
+		bool hidden = (real_count > 0 &&
+					   bsearch(&key, *entries, real_count, sizeof(struct dir_listing_entry), dir_listing_entry_compare) != NULL);
+		if (!hidden)
+			res = dir_listing_append(entries, count, capacity, name, manifest_entry.name_len, 0, true);
+
+		free(name);
+		if (res != 0)
+			break;
+	}
+
+	compact_dir_cursor_free(&cursor);
+	return res;
+}
+
+/**
+ * Read a new listing of the directory
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir_stbuf is the current stat of the directory
+ * @param manifest is the manifest of the directory (can be NULL)
+ * @param listing is the new listing with one reference
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int dir_listing_read(int dir_fd, const struct stat *dir_stbuf, const struct manifest *manifest,
+							struct dir_listing **listing)
+{
+	int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	struct dir_listing_entry *entries = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	int res = 0;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0 ||
+			manifest_is_reserved_name(de->d_name))
+		{
+			continue;
+		}
+
+		res = dir_listing_append(&entries, &count, &capacity, de->d_name, strlen(de->d_name), de->d_ino, false);
+		if (res != 0)
+			break;
+	}
+
+	/// NOTE: No close(fd) because closedir(dp) will do it
+	(void)closedir(dp);
+
+	if (res == 0 && count > 1)
+		qsort(entries, count, sizeof(struct dir_listing_entry), dir_listing_entry_compare);
+
+	if (res == 0 && manifest != NULL)
+	{
+		size_t real_count = count;
+		res = dir_listing_append_manifest(manifest, &entries, &count, &capacity);
+		if (res == 0 && count > real_count)
+			qsort(entries, count, sizeof(struct dir_listing_entry), dir_listing_entry_compare);
+	}
+
+	if (res != 0)
+	{
+		dir_listing_free_names(entries, count);
+		return res;
+	}
+
+	// Names are packed into one block after the array of entries
+	size_t names_size = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		names_size += strlen(entries[i].name) + 1;
+	}
+
+	size_t block_size = sizeof(struct dir_listing) + count * sizeof(struct dir_listing_entry) + names_size;
+	struct dir_listing *new_listing = (struct dir_listing *)malloc(block_size);
+	if (new_listing == NULL)
+	{
+		dir_listing_free_names(entries, count);
+		return -ENOMEM;
+	}
+
+	memset(new_listing, 0, sizeof(struct dir_listing));
+	new_listing->entries = (struct dir_listing_entry *)(new_listing + 1);
+	new_listing->count = count;
+	new_listing->dir_stbuf = *dir_stbuf;
+	new_listing->has_manifest = (manifest != NULL);
+	if (manifest != NULL)
+		new_listing->manifest_stbuf = manifest->stbuf;
+	new_listing->memory_usage = block_size;
+	new_listing->refs = 1;
+
+	char *names = (char *)(new_listing->entries + count);
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t name_size = strlen(entries[i].name) + 1;
+		memcpy(names, entries[i].name, name_size);
+
+		new_listing->entries[i] = entries[i];
+		new_listing->entries[i].name = names;
+		names += name_size;
+	}
+
+	dir_listing_free_names(entries, count);
+	*listing = new_listing;
+	return 0;
+}
+
+/**
+ * Check that two stats are of the same unchanged file
+ *
+ * @param old is the stat taken before
+ * @param stbuf is the current stat
+ * @return true if the file was not replaced or changed
+ */
+static bool dir_listing_same_stat(const struct stat *old, const struct stat *stbuf)
+{
+	return old->st_dev == stbuf->st_dev &&
+		   old->st_ino == stbuf->st_ino &&
+		   old->st_size == stbuf->st_size &&
+		   old->st_mtim.tv_sec == stbuf->st_mtim.tv_sec &&
+		   old->st_mtim.tv_nsec == stbuf->st_mtim.tv_nsec &&
+		   old->st_ctim.tv_sec == stbuf->st_ctim.tv_sec &&
+		   old->st_ctim.tv_nsec == stbuf->st_ctim.tv_nsec;
+}
+
+/**
+ * Check that the listing is still valid for the directory
+ *
+ * @param listing is the cached listing
+ * @param dir_stbuf is the current stat of the directory
+ * @param manifest is the current manifest of the directory (can be NULL)
+ * @return true if neither the directory nor its manifest were changed
+ */
+static bool dir_listing_is_current(const struct dir_listing *listing, const struct stat *dir_stbuf,
+								   const struct manifest *manifest)
+{
+	if (!dir_listing_same_stat(&listing->dir_stbuf, dir_stbuf))
+		return false;
+
+	if (manifest == NULL)
+		return !(listing->has_manifest);
+
+	return listing->has_manifest && dir_listing_same_stat(&listing->manifest_stbuf, &manifest->stbuf);
+}
+
+/**
+ * Check if the change time is too recent for changes to be noticed by timestamps
+ *
+ * @param ctim is the status change time of a file
+ * @param now is the current time
+ * @return true if the file was changed less than DIR_LISTING_MIN_AGE_MS ago (or in the future)
+ */
+static bool dir_listing_is_recent(const struct timespec *ctim, const struct timespec *now)
+{
+	int64_t age_ms = ((int64_t)now->tv_sec - (int64_t)ctim->tv_sec) * 1000 +
+					 ((int64_t)now->tv_nsec - (int64_t)ctim->tv_nsec) / 1000000;
+	return age_ms < DIR_LISTING_MIN_AGE_MS;
+}
+
+/**
+ * Release the reference of the cache to the listing (free function of the hash table)
+ *
+ * @param value is the listing
+ */
+static void dir_listing_cache_free_listing(void *value)
+{
+	dir_listing_release((struct dir_listing *)value);
+}
+
+/**
+ * Drop the cached listing of the directory
+ *
+ * @param cache is the cache
+ * @param dir_relpath is the relative path of the directory
+ * @param dir_relpath_len is the length of the relative path
+ */
+static void dir_listing_cache_drop(struct dir_listing_cache *cache, const char *dir_relpath, size_t dir_relpath_len)
+{
+	struct dir_listing *listing = (struct dir_listing *)path_hash_remove(&cache->dirs, dir_relpath, dir_relpath_len);
+	if (listing == NULL)
+		return;
+
+	cache->memory_usage -= listing->memory_usage;
+	dir_listing_release(listing);
+}
+
+/**
+ * Drop the least recently used listing
+ *
+ * @param cache is the cache
+ * @return true if a listing was dropped, false if the cache is empty
+ */
+static bool dir_listing_cache_evict(struct dir_listing_cache *cache)
+{
+	struct path_hash_node *oldest = NULL;
+	uint64_t oldest_used = UINT64_MAX;
+
+	for (size_t b = 0; b < cache->dirs.buckets_count; b++)
+	{
+		for (struct path_hash_node *node = cache->dirs.buckets[b]; node != NULL; node = node->next)
+		{
+			const struct dir_listing *listing = (const struct dir_listing *)node->value;
+			if (listing->last_used < oldest_used)
+			{
+				oldest = node;
+				oldest_used = listing->last_used;
+			}
+		}
+	}
+
+	if (oldest == NULL)
+		return false;
+
+	dir_listing_cache_drop(cache, oldest->key, oldest->key_len);
+	return true;
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_memory is the maximum memory of cached listings in bytes (0 disables the cache)
+ */
+void dir_listing_cache_init(struct dir_listing_cache *cache, size_t max_memory)
+{
+	memset(cache, 0, sizeof(struct dir_listing_cache));
+	path_hash_init(&cache->dirs);
+	cache->max_memory = max_memory;
+}
+
+/**
+ * Get the listing of the directory: the cached one if the directory and its
+ * manifest were not changed, a new one read from the directory otherwise
+ *
+ * @param cache is the cache
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir_relpath is the relative path of the directory (the key, does not need to be null-terminated)
+ * @param dir_relpath_len is the length of the relative path
+ * @param manifest is the current manifest of the directory (NULL if there is no manifest)
+ * @param listing is the listing (must be released by dir_listing_release())
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int dir_listing_cache_get(struct dir_listing_cache *cache, int dir_fd, const char *dir_relpath, size_t dir_relpath_len,
+						  const struct manifest *manifest, struct dir_listing **listing)
+{
+	*listing = NULL;
+
+	struct stat dir_stbuf;
+	if (fstat(dir_fd, &dir_stbuf) == -1)
+		return -errno;
+
+	struct dir_listing *cached = (struct dir_listing *)path_hash_get(&cache->dirs, dir_relpath, dir_relpath_len);
+	if (cached != NULL && dir_listing_is_current(cached, &dir_stbuf, manifest))
+	{
+		cache->hits++;
+		cached->last_used = ++cache->clock;
+		cached->refs++;
+		*listing = cached;
+		return 0;
+	}
+
+	cache->misses++;
+	if (cached != NULL)
+		dir_listing_cache_drop(cache, dir_relpath, dir_relpath_len);
+
+	struct dir_listing *new_listing = NULL;
+	int res = dir_listing_read(dir_fd, &dir_stbuf, manifest, &new_listing);
+	if (res != 0)
+		return res;
+
+	*listing = new_listing;
+
+	// Listings of directories that are being changed right now are used only once
+	struct timespec now;
+	if (new_listing->memory_usage > cache->max_memory ||
+		clock_gettime(CLOCK_REALTIME, &now) != 0 ||
+		dir_listing_is_recent(&dir_stbuf.st_ctim, &now) ||
+		(manifest != NULL && dir_listing_is_recent(&manifest->stbuf.st_ctim, &now)))
+	{
+		return 0;
+	}
+
+	while (cache->memory_usage + new_listing->memory_usage > cache->max_memory &&
+		   dir_listing_cache_evict(cache))
+	{
+	}
+
+	// The cache is best-effort, the listing is used anyway
+	if (path_hash_put(&cache->dirs, dir_relpath, dir_relpath_len, new_listing, NULL) == 0)
+	{
+		new_listing->refs++;
+		new_listing->last_used = ++cache->clock;
+		cache->memory_usage += new_listing->memory_usage;
+	}
+
+	return 0;
+}
+
+/**
+ * Drop all listings of the cache (the cache can be reused after that,
+ * listings still used by streams are freed by their last release)
+ *
+ * @param cache is the cache
+ */
+void dir_listing_cache_free(struct dir_listing_cache *cache)
+{
+	path_hash_clear(&cache->dirs, dir_listing_cache_free_listing);
+	cache->memory_usage = 0;
+}
+
+/**
+ * Release a reference to the listing (the listing is freed with the last one)
+ *
+ * @param listing is the listing (can be NULL)
+ */
+void dir_listing_release(struct dir_listing *listing)
+{
+	if (listing == NULL)
+		return;
+
+	if (--listing->refs == 0)
+		free(listing);
+}
+
+/**
+ * Load metadata of a range of entries of the listing (see catalog_dir_load_lookup()).
+ * Entries that do not exist anymore or can't be read are skipped, so the result
+ * can have fewer entries than the range, entries are sorted by name.
+ *
+ * @param listing is the listing
+ * @param start is the index of the first entry
+ * @param count is the number of entries (the range is clamped to the listing)
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param manifest is the current manifest of the directory for entries of the manifest (can be NULL)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int dir_listing_load_entries(const struct dir_listing *listing, size_t start, size_t count, int dir_fd,
+							 bool read_filestats, struct batch_loader *loader,
+							 const struct catalog_dir_lookup *lookup, const struct manifest *manifest,
+							 struct catalog_dir *dir, size_t *errors_count)
+{
+	memset(dir, 0, sizeof(struct catalog_dir));
+
+	if (start >= listing->count)
+		return 0;
+	if (count > listing->count - start)
+		count = listing->count - start;
+
+	const char **names = (const char **)malloc(count * sizeof(const char *));
+	ino_t *inos = (ino_t *)malloc(count * sizeof(ino_t));
+	if (names == NULL || inos == NULL)
+	{
+		free(names);
+		free(inos);
+		return -ENOMEM;
+	}
+
+	size_t real_count = 0;
+	for (size_t i = start; i < start + count; i++)
+	{
+		if (listing->entries[i].from_manifest)
+			continue;
+
+		names[real_count] = listing->entries[i].name;
+		inos[real_count] = listing->entries[i].ino;
+		real_count++;
+	}
+
+	struct catalog_dir real;
+	int res = catalog_dir_load_names(dir_fd, read_filestats, loader, lookup, names, inos, real_count, &real, errors_count);
+	free(names);
+	free(inos);
+	if (res != 0)
+		return res;
+
+	size_t manifest_count = count - real_count;
+	if (manifest_count == 0 || manifest == NULL)
+	{
+		*dir = real;
+		return 0;
+	}
+
+	dir->entries = (struct catalog_dir_entry *)calloc(real.count + manifest_count, sizeof(struct catalog_dir_entry));
+	if (dir->entries == NULL)
+	{
+		catalog_dir_free(&real);
+		return -ENOMEM;
+	}
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest->dir);
+
+	// Both the real entries and the range of the listing are sorted by name
+	size_t r = 0;
+	for (size_t i = start; i < start + count && res == 0; i++)
+	{
+		const struct dir_listing_entry *listing_entry = &listing->entries[i];
+		if (!(listing_entry->from_manifest))
+			continue;
+
+		while (r < real.count && strcmp(real.entries[r].name, listing_entry->name) < 0)
+		{
+			dir->entries[dir->count++] = real.entries[r++];
+		}
+
+		struct compact_dir_entry manifest_entry;
+		if (compact_dir_find(manifest->dir, listing_entry->name, &cursor, &manifest_entry) != 0 ||
+			!S_ISREG(manifest_entry.my_stat.mode))
+		{
+			// The manifest was changed after the directory was listed
+			continue;
+		}
+
+		struct catalog_dir_entry *entry = &dir->entries[dir->count];
+		entry->name = strdup(listing_entry->name);
+		if (entry->name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+
+		manifest_fill_stat(manifest, entry->name, &entry->stbuf);
+		entry->my_stat = manifest_entry.my_stat;
+		entry->has_filestat = true;
+		entry->from_manifest = true;
+		dir->count++;
+	}
+
+	while (r < real.count)
+	{
+		dir->entries[dir->count++] = real.entries[r++];
+	}
+
+	compact_dir_cursor_free(&cursor);
+
+	// Entries were moved to the result, only the array is freed
+	free(real.entries);
+
+	if (res != 0)
+		catalog_dir_free(dir);
+	return res;
+}
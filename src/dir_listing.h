@@ -0,0 +1,177 @@
+#ifndef INC_CATALOGFS_DIR_LISTING_H
+#define INC_CATALOGFS_DIR_LISTING_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "path_hash.h"
+
+/**
+ * Cached listings of names of catalog directories for streaming readdir().
+ *
+ * Without offsets in readdir() every opendir() lists the whole directory
+ * (and loads metadata of every entry for readdirplus) and FUSE keeps the
+ * result in memory until releasedir(), even if the reader stops after the
+ * first page. A listing keeps only names of a directory, already filtered
+ * (reserved names of manifests are dropped) and merged with regular files of
+ * the manifest of the directory, sorted by name (strcmp order), so:
+ *
+ *  - readdir() resumes at any offset: the offset is the position in the listing;
+ *  - metadata of entries is loaded only for the part of the listing that is
+ *    returned (see dir_listing_load_entries());
+ *  - repeated listings of an unchanged directory do not read it again.
+ *
+ * A listing is validated by the stat of the directory and of its manifest
+ * file. Listings of directories (or manifests) changed less than
+ * DIR_LISTING_MIN_AGE_MS ago are not cached, since a change within the same
+ * tick of the file timestamps would not be noticed.
+ *
+ * Listings are reference-counted, so an open directory stream keeps its
+ * listing after it was evicted or replaced in the cache.
+ * Neither the cache nor listings are thread-safe, callers must serialize access.
+ */
+
+/** Default maximum memory of cached listings in megabytes */
+#define DIR_LISTING_CACHE_DEFAULT_SIZE_MB (16)
+
+/** Minimum age of the last change of a directory to cache its listing (in milliseconds) */
+#define DIR_LISTING_MIN_AGE_MS (1000)
+
+// Forward declarations
+struct batch_loader;
+struct catalog_dir;
+struct catalog_dir_lookup;
+struct manifest;
+
+/**
+ * One name of a listing
+ */
+struct dir_listing_entry
+{
+	/** Name of the entry (points into the listing) */
+	const char *name;
+
+	/** Inode number from readdir() (0 for entries of the manifest) */
+	ino_t ino;
+
+	/** True if the entry is a regular file of the manifest of the directory */
+	bool from_manifest;
+};
+
+/**
+ * Sorted names of a directory
+ */
+struct dir_listing
+{
+	/** Array of entries sorted by name */
+	struct dir_listing_entry *entries;
+
+	/** Number of entries */
+	size_t count;
+
+	/** Real stat of the directory when it was listed */
+	struct stat dir_stbuf;
+
+	/** Real stat of the manifest file (valid if has_manifest is set) */
+	struct stat manifest_stbuf;
+
+	/** True if the directory had a manifest */
+	bool has_manifest;
+
+	/** Memory used by the listing in bytes */
+	size_t memory_usage;
+
+	/** Number of references (the cache and open directory streams) */
+	unsigned int refs;
+
+	/** Counter value of the last use for finding the least recently used listing */
+	uint64_t last_used;
+};
+
+/**
+ * Cache of listings by relative paths of directories
+ * (not thread-safe, callers must serialize access)
+ */
+struct dir_listing_cache
+{
+	/** Cached listings: relative path of the directory -> struct dir_listing */
+	struct path_hash dirs;
+
+	/** Maximum memory of cached listings in bytes (0 disables the cache) */
+	size_t max_memory;
+
+	/** Memory of cached listings in bytes */
+	size_t memory_usage;
+
+	/** Counter of uses for finding the least recently used listing */
+	uint64_t clock;
+
+	/** Number of listings answered from the cache */
+	uint64_t hits;
+
+	/** Number of listings read from the directory */
+	uint64_t misses;
+};
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_memory is the maximum memory of cached listings in bytes (0 disables the cache)
+ */
+void dir_listing_cache_init(struct dir_listing_cache *cache, size_t max_memory);
+
+/**
+ * Get the listing of the directory: the cached one if the directory and its
+ * manifest were not changed, a new one read from the directory otherwise
+ *
+ * @param cache is the cache
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir_relpath is the relative path of the directory (the key, does not need to be null-terminated)
+ * @param dir_relpath_len is the length of the relative path
+ * @param manifest is the current manifest of the directory (NULL if there is no manifest)
+ * @param listing is the listing (must be released by dir_listing_release())
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int dir_listing_cache_get(struct dir_listing_cache *cache, int dir_fd, const char *dir_relpath, size_t dir_relpath_len,
+						  const struct manifest *manifest, struct dir_listing **listing);
+
+/**
+ * Drop all listings of the cache (the cache can be reused after that,
+ * listings still used by streams are freed by their last release)
+ *
+ * @param cache is the cache
+ */
+void dir_listing_cache_free(struct dir_listing_cache *cache);
+
+/**
+ * Release a reference to the listing (the listing is freed with the last one)
+ *
+ * @param listing is the listing (can be NULL)
+ */
+void dir_listing_release(struct dir_listing *listing);
+
+/**
+ * Load metadata of a range of entries of the listing (see catalog_dir_load_lookup()).
+ * Entries that do not exist anymore or can't be read are skipped, so the result
+ * can have fewer entries than the range, entries are sorted by name.
+ *
+ * @param listing is the listing
+ * @param start is the index of the first entry
+ * @param count is the number of entries (the range is clamped to the listing)
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param read_filestats determines if filestat files should be read for regular files
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param lookup is the source of filestats read before (can be NULL)
+ * @param manifest is the current manifest of the directory for entries of the manifest (can be NULL)
+ * @param dir is the target listing (must be freed by catalog_dir_free())
+ * @param errors_count is incremented for every skipped broken entry (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int dir_listing_load_entries(const struct dir_listing *listing, size_t start, size_t count, int dir_fd,
+							 bool read_filestats, struct batch_loader *loader,
+							 const struct catalog_dir_lookup *lookup, const struct manifest *manifest,
+							 struct catalog_dir *dir, size_t *errors_count);
+
+#endif // INC_CATALOGFS_DIR_LISTING_H
@@ -5,6 +5,9 @@
 
 #include <stdint.h>
 
+/** Length of SHA-256 hash in hex representation (without null-terminator) */
+#define FILESTAT_SHA256_HEX_LENGTH (64)
+
 /**
  * Information that is actually stored inside filestat files as contents
  */
@@ -55,6 +58,10 @@ struct filestat
 	/** Optimal block size for I/O. */
 	// cppcheck-suppress unusedStructMember
 	int64_t blksize;
+
+	/** SHA-256 hash of file contents in hex (empty string if unknown). */
+	// cppcheck-suppress unusedStructMember
+	char sha256[FILESTAT_SHA256_HEX_LENGTH + 1];
 };
 
 #endif // INC_CATALOGFS_FILESTAT_H
@@ -36,6 +36,9 @@ int fill_filestat_from_stat(struct filestat *my_stat, const struct stat *const s
 	my_stat->nlink = stbuf->st_nlink;
 	my_stat->blksize = stbuf->st_blksize;
 
+	// Hash is not a part of stat and stays unknown
+	my_stat->sha256[0] = '\0';
+
 	return 0;
 }
 
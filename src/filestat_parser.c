@@ -91,6 +91,37 @@ int read_filestat(const int dir_fd, const char *relpath, struct filestat *my_sta
 	return 0;
 }
 
+/** 
+ * Read filestat from the content of a filestat file that is already in memory
+ * 
+ * @param data is the content of the filestat file
+ * @param size is the size of the content
+ * @param my_stat is a target filestat struct for storing read data (not zeroed before use!)
+ * @return 0 on success, nonzero value on error
+ */
+int read_filestat_from_buffer(const char *data, size_t size, struct filestat *my_stat)
+{
+	if (data == NULL || my_stat == NULL)
+		return -EINVAL;
+
+	if (size > FILESTAT_MAXSIZE)
+		return -EPERM;
+
+	if (size == 0)
+		return -EINVAL;
+
+	// fmemopen() does not modify the buffer in read mode
+	FILE *fp = fmemopen((void *)data, size, "rb");
+	if (fp == NULL)
+		return -errno;
+
+	int res = filestat_parser_format_read(fp, my_stat);
+
+	(void)fclose(fp);
+
+	return res;
+}
+
 /** 
  * Write filestat to a file by file descriptor
  * 
@@ -120,3 +151,16 @@ int write_filestat(const int file_fd,
 
 	return 0;
 }
+
+/** 
+ * Format filestat in the current format (the content of a filestat file)
+ * 
+ * @param my_stat is a filestat struct to be formatted
+ * @param buf is the target buffer (the text is appended, without null-terminator)
+ * @return 0 on success, nonzero value on error
+ */
+int format_filestat(const struct filestat *const my_stat,
+					struct byte_buffer *buf)
+{
+	return filestat_parser_format_to_buffer(my_stat, buf);
+}
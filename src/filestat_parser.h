@@ -5,8 +5,9 @@
 
 #include <stdio.h>
 
-// Forward declaration
+// Forward declarations
 struct filestat;
+struct byte_buffer;
 
 /** 
  * Read filestat from a real file with relative path in the provided directory
@@ -20,6 +21,18 @@ int read_filestat(const int dir_fd,
 				  const char *relpath,
 				  struct filestat *my_stat);
 
+/** 
+ * Read filestat from the content of a filestat file that is already in memory
+ * 
+ * @param data is the content of the filestat file
+ * @param size is the size of the content
+ * @param my_stat is a target filestat struct for storing read data (not zeroed before use!)
+ * @return 0 on success, nonzero value on error
+ */
+int read_filestat_from_buffer(const char *data,
+							  size_t size,
+							  struct filestat *my_stat);
+
 /** 
  * Write filestat to a file by file descriptor
  * 
@@ -34,4 +47,14 @@ int write_filestat(const int file_fd,
 				   const char *const name,
 				   const char *const path);
 
+/** 
+ * Format filestat in the current format (the content of a filestat file)
+ * 
+ * @param my_stat is a filestat struct to be formatted
+ * @param buf is the target buffer (the text is appended, without null-terminator)
+ * @return 0 on success, nonzero value on error
+ */
+int format_filestat(const struct filestat *const my_stat,
+					struct byte_buffer *buf);
+
 #endif // INC_CATALOGFS_FILESTAT_PARSER_H
@@ -4,6 +4,7 @@
 
 #include "filestat_parser_format.h"
 
+#include "byte_buffer.h"
 #include "filestat.h"
 #include "filestat_format_constants.h"
 
@@ -432,6 +433,36 @@ static int filestat_get_next_option_pair(bool *eof_file_finished, char **option,
 	}
 }
 
+/** 
+ * Copy SHA-256 hex value to the provided place if it's a valid hash.
+ * Empty value is allowed and means the hash is unknown.
+ * 
+ * @param str_value is a string with a hex value
+ * @param place is a target buffer of FILESTAT_SHA256_HEX_LENGTH + 1 chars
+ * @return 0 on success, nonzero value on error
+ */
+static int filestat_copy_sha256_value(const char *str_value, char *place)
+{
+	size_t len = strlen(str_value);
+	if (len != 0 && len != FILESTAT_SHA256_HEX_LENGTH)
+	{
+		return -EIO;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (!isxdigit((unsigned char)str_value[i]))
+		{
+			return -EIO;
+		}
+
+		place[i] = (char)tolower((unsigned char)str_value[i]);
+	}
+	place[len] = '\0';
+
+	return 0;
+}
+
 /** 
  * Process option-value pair from the filestat file to overwrite 
  * the corresponding field in the filestat struct.
@@ -498,6 +529,10 @@ static int filestat_process_option_pair(const char *const option, const char *co
 	{
 		res = filestat_sscanf_value(value, "%" SCNd64, &my_stat->blksize);
 	}
+	else if (strcmp(option, "sha256") == 0)
+	{
+		res = filestat_copy_sha256_value(value, my_stat->sha256);
+	}
 	else
 	{
 		// Ignore not-used and unknown fields (it's OK to have them)
@@ -681,6 +716,49 @@ int filestat_parser_format_read(FILE *fp, struct filestat *my_stat)
 	return 0;
 }
 
+/** 
+ * Format filestat in the current format and append it to the buffer
+ * 
+ * @param my_stat is a filestat struct to be formatted
+ * @param buf is the target buffer
+ * @return 0 on success, nonzero value on error
+ */
+int filestat_parser_format_to_buffer(const struct filestat *const my_stat, struct byte_buffer *buf)
+{
+	if (my_stat == NULL || buf == NULL)
+	{
+		return -EPERM;
+	}
+
+	int res = 0;
+
+	// Header
+	res |= byte_buffer_append_format(buf, "%s=%" PRIu32 "\n", FILESTAT_HEADER_OPTION, FILESTAT_VERSION_3);
+
+	// Options
+	res |= byte_buffer_append_format(buf, "size=%" PRId64 "\n", my_stat->size);
+	res |= byte_buffer_append_format(buf, "blocks=%" PRId64 "\n", my_stat->blocks);
+	res |= byte_buffer_append_format(buf, "mode=%" PRIu32 "\n", my_stat->mode);
+	res |= byte_buffer_append_format(buf, "uid=%" PRIu32 "\n", my_stat->uid);
+	res |= byte_buffer_append_format(buf, "gid=%" PRIu32 "\n", my_stat->gid);
+	res |= byte_buffer_append_format(buf, "atime=%" PRId64 "\n", my_stat->atime);
+	res |= byte_buffer_append_format(buf, "mtime=%" PRId64 "\n", my_stat->mtime);
+	res |= byte_buffer_append_format(buf, "ctime=%" PRId64 "\n", my_stat->ctime);
+	res |= byte_buffer_append_format(buf, "atimensec=%" PRId64 "\n", my_stat->atimensec);
+	res |= byte_buffer_append_format(buf, "mtimensec=%" PRId64 "\n", my_stat->mtimensec);
+	res |= byte_buffer_append_format(buf, "ctimensec=%" PRId64 "\n", my_stat->ctimensec);
+	res |= byte_buffer_append_format(buf, "nlink=%" PRIu64 "\n", my_stat->nlink);
+	res |= byte_buffer_append_format(buf, "blksize=%" PRId64 "\n", my_stat->blksize);
+
+	// Hash is optional and written only if known
+	if (my_stat->sha256[0] != '\0')
+	{
+		res |= byte_buffer_append_format(buf, "sha256=%s\n", my_stat->sha256);
+	}
+
+	return (res != 0) ? -ENOMEM : 0;
+}
+
 /** 
  * Write filestat to a file by file descriptor
  * 
@@ -705,105 +783,40 @@ int filestat_parser_format_write(const int file_fd,
 		return -EPERM;
 	}
 
-	ssize_t res;
+	struct byte_buffer buf;
+	memset(&buf, 0, sizeof(buf));
 
-	res = ftruncate(file_fd, 0);
+	int res = filestat_parser_format_to_buffer(my_stat, &buf);
 	if (res != 0)
 	{
-		return -errno;
+		byte_buffer_free(&buf);
+		return res;
 	}
 
-	res = lseek(file_fd, 0, SEEK_SET);
+	res = ftruncate(file_fd, 0);
 	if (res != 0)
 	{
+		byte_buffer_free(&buf);
 		return -errno;
 	}
 
-	// Header
-	res = dprintf(file_fd, "%s=%" PRIu32 "\n", FILESTAT_HEADER_OPTION, FILESTAT_VERSION_3);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	// Options
-	res = dprintf(file_fd, "size=%" PRId64 "\n", my_stat->size);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "blocks=%" PRId64 "\n", my_stat->blocks);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "mode=%" PRIu32 "\n", my_stat->mode);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "uid=%" PRIu32 "\n", my_stat->uid);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "gid=%" PRIu32 "\n", my_stat->gid);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "atime=%" PRId64 "\n", my_stat->atime);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "mtime=%" PRId64 "\n", my_stat->mtime);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "ctime=%" PRId64 "\n", my_stat->ctime);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "atimensec=%" PRId64 "\n", my_stat->atimensec);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "mtimensec=%" PRId64 "\n", my_stat->mtimensec);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "ctimensec=%" PRId64 "\n", my_stat->ctimensec);
-	if (res < 0)
-	{
-		return -errno;
-	}
-
-	res = dprintf(file_fd, "nlink=%" PRIu64 "\n", my_stat->nlink);
-	if (res < 0)
+	// The whole record is written with one call at offset 0 (like dprintf() after lseek() did)
+	size_t written = 0;
+	while (written < buf.len)
 	{
-		return -errno;
-	}
+		ssize_t count = pwrite(file_fd, buf.data + written, buf.len - written, (off_t)written);
+		if (count == -1)
+		{
+			if (errno == EINTR)
+				continue;
 
-	res = dprintf(file_fd, "blksize=%" PRId64 "\n", my_stat->blksize);
-	if (res < 0)
-	{
-		return -errno;
+			int errno_stored = errno;
+			byte_buffer_free(&buf);
+			return -errno_stored;
+		}
+		written += (size_t)count;
 	}
 
+	byte_buffer_free(&buf);
 	return 0;
 }
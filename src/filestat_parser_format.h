@@ -5,8 +5,9 @@
 
 #include <stdio.h>
 
-// Forward declaration
+// Forward declarations
 struct filestat;
+struct byte_buffer;
 
 /** 
  * Read filestat struct from a file with filestat format
@@ -17,6 +18,15 @@ struct filestat;
  */
 int filestat_parser_format_read(FILE *fp, struct filestat *my_stat);
 
+/** 
+ * Format filestat in the current format and append it to the buffer
+ * 
+ * @param my_stat is a filestat struct to be formatted
+ * @param buf is the target buffer
+ * @return 0 on success, nonzero value on error
+ */
+int filestat_parser_format_to_buffer(const struct filestat *const my_stat, struct byte_buffer *buf);
+
 /** 
  * Write filestat to file by file descriptor
  * 
@@ -0,0 +1,312 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "index_state.h"
+
+#include "varint.h"
+
+/** Length of the header of the state file */
+#define INDEX_STATE_HEADER_LENGTH (sizeof(INDEX_STATE_HEADER) - 1)
+
+/**
+ * Fill the state of a directory from its stat
+ *
+ * @param dir is the target state
+ * @param stbuf is the stat of the source directory
+ */
+void index_state_dir_from_stat(struct index_state_dir *dir, const struct stat *stbuf)
+{
+	dir->dev = (uint64_t)stbuf->st_dev;
+	dir->ino = (uint64_t)stbuf->st_ino;
+	dir->mtime = (int64_t)stbuf->st_mtim.tv_sec;
+	dir->mtimensec = (int64_t)stbuf->st_mtim.tv_nsec;
+	dir->ctime = (int64_t)stbuf->st_ctim.tv_sec;
+	dir->ctimensec = (int64_t)stbuf->st_ctim.tv_nsec;
+}
+
+/**
+ * Check if a source directory is the same as when it was indexed
+ *
+ * @param dir is the state of the directory
+ * @param stbuf is the current stat of the source directory
+ * @return true if the device, inode, mtime and ctime are the same
+ */
+bool index_state_dir_matches(const struct index_state_dir *dir, const struct stat *stbuf)
+{
+	struct index_state_dir current;
+	index_state_dir_from_stat(&current, stbuf);
+	return dir->dev == current.dev && dir->ino == current.ino &&
+		   dir->mtime == current.mtime && dir->mtimensec == current.mtimensec &&
+		   dir->ctime == current.ctime && dir->ctimensec == current.ctimensec;
+}
+
+/**
+ * Free a value of the table of directories
+ *
+ * @param value is the value
+ */
+static void free_dir_value(void *value)
+{
+	free(value);
+}
+
+/**
+ * Parse records of the state file
+ *
+ * @param state is the state
+ * @param data is the content after the header
+ * @param size is the size of the content
+ * @return 0 on success, -EINVAL for broken records, -ENOMEM on error
+ */
+static int parse_records(struct index_state *state, const uint8_t *data, size_t size)
+{
+	const uint8_t *pos = data;
+	const uint8_t *end = data + size;
+	while (pos < end)
+	{
+		if ((size_t)(end - pos) < INDEX_STATE_RECORD_SIZE)
+			return -EINVAL;
+
+		size_t path_len = read_le32(pos);
+		if (path_len > (size_t)(end - pos) - INDEX_STATE_RECORD_SIZE)
+			return -EINVAL;
+
+		struct index_state_dir *dir = (struct index_state_dir *)malloc(sizeof(struct index_state_dir));
+		if (dir == NULL)
+			return -ENOMEM;
+
+		dir->dev = read_le64(pos + 4);
+		dir->ino = read_le64(pos + 12);
+		dir->mtime = (int64_t)read_le64(pos + 20);
+		dir->mtimensec = read_le32(pos + 28);
+		dir->ctime = (int64_t)read_le64(pos + 32);
+		dir->ctimensec = read_le32(pos + 40);
+
+		void *old = NULL;
+		int res = path_hash_put(&state->dirs, (const char *)pos + INDEX_STATE_RECORD_SIZE, path_len, dir, &old);
+		free(old);
+		if (res != 0)
+		{
+			free(dir);
+			return res;
+		}
+
+		pos += INDEX_STATE_RECORD_SIZE + path_len;
+	}
+
+	return 0;
+}
+
+/**
+ * Load the state of a catalog (a missing state file gives an empty state)
+ *
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param state is the loaded state (must be freed by index_state_free())
+ * @return 0 on success, -EINVAL for a broken file, other negative value (mostly -errno) on error
+ */
+int index_state_load(int catalog_fd, struct index_state *state)
+{
+	path_hash_init(&state->dirs);
+
+	int fd = openat(catalog_fd, INDEX_STATE_FILE_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) == -1)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	if (!S_ISREG(stbuf.st_mode) || stbuf.st_size < (off_t)INDEX_STATE_HEADER_LENGTH)
+	{
+		(void)close(fd);
+		return -EINVAL;
+	}
+
+	size_t size = (size_t)stbuf.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	// Records are read once from start to end
+	(void)madvise(map, size, MADV_SEQUENTIAL);
+
+	int res = -EINVAL;
+	if (memcmp(map, INDEX_STATE_HEADER, INDEX_STATE_HEADER_LENGTH) == 0)
+	{
+		res = parse_records(state, (const uint8_t *)map + INDEX_STATE_HEADER_LENGTH,
+							size - INDEX_STATE_HEADER_LENGTH);
+	}
+
+	(void)munmap(map, size);
+	if (res != 0)
+		index_state_free(state);
+	return res;
+}
+
+/**
+ * Find the state of a directory
+ *
+ * @param state is the state
+ * @param path is the relative path of the directory (empty for the root)
+ * @param path_len is the length of the path
+ * @return the state of the directory, NULL if it was not indexed
+ */
+const struct index_state_dir *index_state_find(const struct index_state *state, const char *path, size_t path_len)
+{
+	return (const struct index_state_dir *)path_hash_get(&state->dirs, path, path_len);
+}
+
+/**
+ * Free the state
+ *
+ * @param state is the state
+ */
+void index_state_free(struct index_state *state)
+{
+	path_hash_clear(&state->dirs, free_dir_value);
+}
+
+/**
+ * Write the whole buffer to the file
+ *
+ * @param fd is the file descriptor
+ * @param data is the buffer
+ * @param size is the size of the buffer
+ * @return 0 on success, negative value on error
+ */
+static int write_all(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0)
+	{
+		ssize_t res = write(fd, p, size);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += res;
+		size -= (size_t)res;
+	}
+
+	return 0;
+}
+
+/**
+ * Start writing a new state file
+ *
+ * @param writer is the writer
+ * @param catalog_fd is the file descriptor of the catalog directory (not closed)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_open(struct index_state_writer *writer, int catalog_fd)
+{
+	memset(writer, 0, sizeof(struct index_state_writer));
+	writer->catalog_fd = catalog_fd;
+	writer->fd = openat(catalog_fd, INDEX_STATE_TMP_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+						0644);
+	if (writer->fd == -1)
+		return -errno;
+
+	if (byte_buffer_append(&writer->buffer, INDEX_STATE_HEADER, INDEX_STATE_HEADER_LENGTH) != 0)
+	{
+		index_state_writer_abort(writer);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Add a record of an indexed directory
+ *
+ * @param writer is the writer
+ * @param path is the relative path of the directory (empty for the root)
+ * @param path_len is the length of the path
+ * @param dir is the state of the directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_add(struct index_state_writer *writer, const char *path, size_t path_len,
+						   const struct index_state_dir *dir)
+{
+	if (path_len > UINT32_MAX)
+		return -ENAMETOOLONG;
+
+	uint8_t record[INDEX_STATE_RECORD_SIZE];
+	write_le32(record, (uint32_t)path_len);
+	write_le64(record + 4, dir->dev);
+	write_le64(record + 12, dir->ino);
+	write_le64(record + 20, (uint64_t)dir->mtime);
+	write_le32(record + 28, (uint32_t)dir->mtimensec);
+	write_le64(record + 32, (uint64_t)dir->ctime);
+	write_le32(record + 40, (uint32_t)dir->ctimensec);
+
+	if (byte_buffer_append(&writer->buffer, record, INDEX_STATE_RECORD_SIZE) != 0 ||
+		byte_buffer_append(&writer->buffer, path, path_len) != 0)
+		return -ENOMEM;
+
+	writer->count++;
+	if (writer->buffer.len < INDEX_STATE_WRITE_BUFFER_SIZE)
+		return 0;
+
+	int res = write_all(writer->fd, writer->buffer.data, writer->buffer.len);
+	writer->buffer.len = 0;
+	return res;
+}
+
+/**
+ * Sync the new state file and replace the old one with it
+ *
+ * @param writer is the writer (freed by the call)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_commit(struct index_state_writer *writer)
+{
+	int res = write_all(writer->fd, writer->buffer.data, writer->buffer.len);
+
+	// The state must not claim directories whose index files are not on disk yet
+	if (res == 0 && (syncfs(writer->fd) == -1 || fdatasync(writer->fd) == -1))
+		res = -errno;
+
+	if (close(writer->fd) == -1 && res == 0)
+		res = -errno;
+	writer->fd = -1;
+
+	if (res == 0 && renameat(writer->catalog_fd, INDEX_STATE_TMP_FILE_NAME,
+							 writer->catalog_fd, INDEX_STATE_FILE_NAME) == -1)
+		res = -errno;
+
+	if (res != 0)
+		(void)unlinkat(writer->catalog_fd, INDEX_STATE_TMP_FILE_NAME, 0);
+
+	byte_buffer_free(&writer->buffer);
+	return res;
+}
+
+/**
+ * Drop the new state file (the old one is kept)
+ *
+ * @param writer is the writer (freed by the call)
+ */
+void index_state_writer_abort(struct index_state_writer *writer)
+{
+	if (writer->fd != -1)
+	{
+		(void)close(writer->fd);
+		writer->fd = -1;
+		(void)unlinkat(writer->catalog_fd, INDEX_STATE_TMP_FILE_NAME, 0);
+	}
+
+	byte_buffer_free(&writer->buffer);
+}
@@ -0,0 +1,175 @@
+#ifndef INC_CATALOGFS_INDEX_STATE_H
+#define INC_CATALOGFS_INDEX_STATE_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "byte_buffer.h"
+#include "path_hash.h"
+
+/**
+ * State of incremental indexing of a live source into a catalog directory.
+ *
+ * A directory's mtime and ctime change whenever entries are created, removed
+ * or renamed in it or its own metadata changes, so a directory whose
+ * (dev, ino, mtime, ctime) are the same as at the previous indexing has the
+ * same entries and does not need to be listed again. The catalog directory
+ * cannot keep the ctime and identity of its source directory, so they are kept
+ * in one state file in the root of the catalog (hidden like manifests):
+ *
+ *   "CatalogFS.IndexState.1\n", then a record per indexed directory:
+ *   u32 path length, u64 dev, u64 ino, i64 mtime, u32 mtime nsec,
+ *   i64 ctime, u32 ctime nsec, relative path (empty for the root)
+ *
+ * (little-endian). The file is written anew by every indexing through a
+ * temporary file and rename(), so an interrupted indexing keeps the old state
+ * (directories indexed since then are listed again next time).
+ */
+
+/** Name of the state file in the root of the catalog */
+#define INDEX_STATE_FILE_NAME ".catalogfs-index"
+
+/** Name of the temporary file of the new state */
+#define INDEX_STATE_TMP_FILE_NAME ".catalogfs-index.tmp"
+
+/** Header of the state file (also the version of the layout) */
+#define INDEX_STATE_HEADER "CatalogFS.IndexState.1\n"
+
+/** Size of a record without the path */
+#define INDEX_STATE_RECORD_SIZE (4 + 8 + 8 + 8 + 4 + 8 + 4)
+
+/** Size of the buffer of the writer flushed to the file */
+#define INDEX_STATE_WRITE_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Identity and times of a source directory at the time it was indexed
+ */
+struct index_state_dir
+{
+	/** Device of the directory */
+	uint64_t dev;
+
+	/** Inode of the directory */
+	uint64_t ino;
+
+	/** Modification time */
+	int64_t mtime;
+
+	/** Nanoseconds of the modification time */
+	int64_t mtimensec;
+
+	/** Change time */
+	int64_t ctime;
+
+	/** Nanoseconds of the change time */
+	int64_t ctimensec;
+};
+
+/**
+ * Loaded state: relative path of a directory -> struct index_state_dir
+ */
+struct index_state
+{
+	/** Indexed directories */
+	struct path_hash dirs;
+};
+
+/**
+ * Writer of a new state file
+ */
+struct index_state_writer
+{
+	/** File descriptor of the catalog directory (not owned) */
+	int catalog_fd;
+
+	/** File descriptor of the temporary file */
+	int fd;
+
+	/** Records not written yet */
+	struct byte_buffer buffer;
+
+	/** Number of added records */
+	uint64_t count;
+};
+
+/**
+ * Fill the state of a directory from its stat
+ *
+ * @param dir is the target state
+ * @param stbuf is the stat of the source directory
+ */
+void index_state_dir_from_stat(struct index_state_dir *dir, const struct stat *stbuf);
+
+/**
+ * Check if a source directory is the same as when it was indexed
+ *
+ * @param dir is the state of the directory
+ * @param stbuf is the current stat of the source directory
+ * @return true if the device, inode, mtime and ctime are the same
+ */
+bool index_state_dir_matches(const struct index_state_dir *dir, const struct stat *stbuf);
+
+/**
+ * Load the state of a catalog (a missing state file gives an empty state)
+ *
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param state is the loaded state (must be freed by index_state_free())
+ * @return 0 on success, -EINVAL for a broken file, other negative value (mostly -errno) on error
+ */
+int index_state_load(int catalog_fd, struct index_state *state);
+
+/**
+ * Find the state of a directory
+ *
+ * @param state is the state
+ * @param path is the relative path of the directory (empty for the root)
+ * @param path_len is the length of the path
+ * @return the state of the directory, NULL if it was not indexed
+ */
+const struct index_state_dir *index_state_find(const struct index_state *state, const char *path, size_t path_len);
+
+/**
+ * Free the state
+ *
+ * @param state is the state
+ */
+void index_state_free(struct index_state *state);
+
+/**
+ * Start writing a new state file
+ *
+ * @param writer is the writer
+ * @param catalog_fd is the file descriptor of the catalog directory (not closed)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_open(struct index_state_writer *writer, int catalog_fd);
+
+/**
+ * Add a record of an indexed directory
+ *
+ * @param writer is the writer
+ * @param path is the relative path of the directory (empty for the root)
+ * @param path_len is the length of the path
+ * @param dir is the state of the directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_add(struct index_state_writer *writer, const char *path, size_t path_len,
+						   const struct index_state_dir *dir);
+
+/**
+ * Sync the new state file and replace the old one with it
+ *
+ * @param writer is the writer (freed by the call)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int index_state_writer_commit(struct index_state_writer *writer);
+
+/**
+ * Drop the new state file (the old one is kept)
+ *
+ * @param writer is the writer (freed by the call)
+ */
+void index_state_writer_abort(struct index_state_writer *writer);
+
+#endif // INC_CATALOGFS_INDEX_STATE_H
@@ -0,0 +1,1080 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ingest.h"
+#include "control.h"
+#include "filestat_converter.h"
+#include "json.h"
+#include "manifest.h"
+
+/**
+ * Format the message of an error of a record
+ *
+ * @param message is the target (can be NULL)
+ * @param message_size is the size of the target
+ * @param format is the format of the message
+ * @return -EINVAL
+ */
+static int parse_error(char *message, size_t message_size, const char *format, ...)
+{
+	if (message != NULL && message_size > 0)
+	{
+		va_list args;
+		va_start(args, format);
+		(void)vsnprintf(message, message_size, format, args);
+		va_end(args);
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Normalize a relative path in place: leading, trailing and repeated slashes
+ * and "." components are dropped
+ *
+ * @param path is the path
+ * @return 0 on success, -EINVAL for ".." components
+ */
+static int normalize_path(char *path)
+{
+	char *out = path;
+	const char *in = path;
+
+	while (*in != '\0')
+	{
+		while (*in == '/')
+			in++;
+		if (*in == '\0')
+			break;
+
+		const char *component = in;
+		while (*in != '\0' && *in != '/')
+			in++;
+		size_t len = (size_t)(in - component);
+
+		if (len == 1 && component[0] == '.')
+			continue;
+		if (len == 2 && component[0] == '.' && component[1] == '.')
+			return -EINVAL;
+
+		if (out != path)
+			*out++ = '/';
+		memmove(out, component, len);
+		out += len;
+	}
+
+	*out = '\0';
+	return 0;
+}
+
+/**
+ * Parse the value of "mode" (a number or an octal string)
+ *
+ * @param cur is the cursor
+ * @param buf is a temporary buffer
+ * @param mode is the parsed mode
+ * @return 0 on success, -EINVAL for broken values, -ENOMEM on error
+ */
+static int parse_mode(struct json_cursor *cur, struct byte_buffer *buf, uint32_t *mode)
+{
+	if (cur->pos < cur->end && *cur->pos == '"')
+	{
+		int res = json_parse_string(cur, buf);
+		if (res != 0)
+			return res;
+
+		const char *text = (const char *)buf->data;
+		char *end;
+		errno = 0;
+		unsigned long value = strtoul(text, &end, 8);
+		if (errno != 0 || end == text || *end != '\0' || value > UINT32_MAX)
+			return -EINVAL;
+		*mode = (uint32_t)value;
+		return 0;
+	}
+
+	int64_t value;
+	int64_t nsec;
+	bool has_fraction;
+	if (json_parse_number(cur, &value, &nsec, &has_fraction) != 0 || has_fraction ||
+		value < 0 || value > UINT32_MAX)
+	{
+		return -EINVAL;
+	}
+
+	*mode = (uint32_t)value;
+	return 0;
+}
+
+/**
+ * Normalize the path of a record and check the record
+ * (used for records parsed by callers, e.g. from archives)
+ *
+ * @param record is the record
+ * @param message is the target for the description of an error (can be NULL)
+ * @param message_size is the size of the message buffer
+ * @return 0 on success, -EINVAL for broken paths, reserved names, unsupported types
+ *         and symlinks without targets
+ */
+int ingest_record_check(struct ingest_record *record, char *message, size_t message_size)
+{
+	if (normalize_path(record->path) != 0)
+		return parse_error(message, message_size, "\"..\" in path \"%s\"", record->path);
+
+	if (strlen(record->path) >= PATH_MAX)
+		return parse_error(message, message_size, "too long path");
+
+	const char *slash = strrchr(record->path, '/');
+	const char *base = (slash != NULL) ? slash + 1 : record->path;
+	size_t control_len = sizeof(CONTROL_DIR_NAME) - 1;
+	if (manifest_is_reserved_name(base) ||
+		(strncmp(record->path, CONTROL_DIR_NAME, control_len) == 0 &&
+		 (record->path[control_len] == '\0' || record->path[control_len] == '/')))
+	{
+		return parse_error(message, message_size, "reserved path \"%s\"", record->path);
+	}
+
+	mode_t type = (mode_t)record->my_stat.mode & S_IFMT;
+	if (type != S_IFREG && type != S_IFDIR && type != S_IFLNK)
+		return parse_error(message, message_size, "unsupported type of \"%s\"", record->path);
+
+	if (type == S_IFLNK && (record->link_target == NULL || record->link_target[0] == '\0'))
+		return parse_error(message, message_size, "missing target of symlink \"%s\"", record->path);
+
+	if (type != S_IFLNK)
+	{
+		free(record->link_target);
+		record->link_target = NULL;
+	}
+
+	return 0;
+}
+
+/**
+ * Flags of keys found in a record
+ */
+enum record_key
+{
+	KEY_MODE = 1 << 0,
+	KEY_SIZE = 1 << 1,
+	KEY_BLOCKS = 1 << 2,
+	KEY_UID = 1 << 3,
+	KEY_GID = 1 << 4,
+	KEY_NLINK = 1 << 5,
+	KEY_BLKSIZE = 1 << 6,
+	KEY_ATIME = 1 << 7,
+	KEY_MTIME = 1 << 8,
+	KEY_CTIME = 1 << 9,
+	KEY_ATIME_NSEC = 1 << 10,
+	KEY_MTIME_NSEC = 1 << 11,
+	KEY_CTIME_NSEC = 1 << 12
+};
+
+/**
+ * Key of a record with a numeric value
+ */
+struct numeric_key
+{
+	/** Name of the key */
+	const char *name;
+
+	/** Flag of the key */
+	enum record_key key;
+
+	/** True if the value is a time in seconds (can be negative and have a fraction) */
+	bool is_time;
+
+	/** Maximum value (for keys that are not times) */
+	int64_t max;
+};
+
+/** Keys of records with numeric values */
+static const struct numeric_key numeric_keys[] = {
+	{"size", KEY_SIZE, false, INT64_MAX},
+	{"blocks", KEY_BLOCKS, false, INT64_MAX},
+	{"uid", KEY_UID, false, UINT32_MAX},
+	{"gid", KEY_GID, false, UINT32_MAX},
+	{"nlink", KEY_NLINK, false, INT64_MAX},
+	{"blksize", KEY_BLKSIZE, false, INT64_MAX},
+	{"atime", KEY_ATIME, true, 0},
+	{"mtime", KEY_MTIME, true, 0},
+	{"ctime", KEY_CTIME, true, 0},
+	{"atime_nsec", KEY_ATIME_NSEC, false, 999999999},
+	{"mtime_nsec", KEY_MTIME_NSEC, false, 999999999},
+	{"ctime_nsec", KEY_CTIME_NSEC, false, 999999999},
+};
+
+/**
+ * Find the numeric key by its name
+ *
+ * @param name is the name of the key
+ * @return the key, NULL if the key is not numeric
+ */
+static const struct numeric_key *get_numeric_key(const char *name)
+{
+	for (size_t i = 0; i < sizeof(numeric_keys) / sizeof(numeric_keys[0]); i++)
+	{
+		if (strcmp(numeric_keys[i].name, name) == 0)
+			return &numeric_keys[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Set the field of a numeric key
+ *
+ * @param my_stat is the target metadata
+ * @param key is the key
+ * @param number is the value (seconds for times)
+ * @param nsec is the fraction of times in nanoseconds
+ */
+static void set_numeric_key(struct filestat *my_stat, enum record_key key, int64_t number, int64_t nsec)
+{
+	switch (key)
+	{
+	case KEY_SIZE:
+		my_stat->size = number;
+		break;
+	case KEY_BLOCKS:
+		my_stat->blocks = number;
+		break;
+	case KEY_UID:
+		my_stat->uid = (uint32_t)number;
+		break;
+	case KEY_GID:
+		my_stat->gid = (uint32_t)number;
+		break;
+	case KEY_NLINK:
+		my_stat->nlink = (uint64_t)number;
+		break;
+	case KEY_BLKSIZE:
+		my_stat->blksize = number;
+		break;
+	case KEY_ATIME:
+		my_stat->atime = number;
+		my_stat->atimensec = nsec;
+		break;
+	case KEY_MTIME:
+		my_stat->mtime = number;
+		my_stat->mtimensec = nsec;
+		break;
+	case KEY_CTIME:
+		my_stat->ctime = number;
+		my_stat->ctimensec = nsec;
+		break;
+	case KEY_ATIME_NSEC:
+		my_stat->atimensec = number;
+		break;
+	case KEY_MTIME_NSEC:
+		my_stat->mtimensec = number;
+		break;
+	case KEY_CTIME_NSEC:
+		my_stat->ctimensec = number;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Parse one NDJSON record
+ *
+ * @param line is the line (does not need to be null-terminated)
+ * @param len is the length of the line
+ * @param defaults is the metadata that is used for missing keys (uid, gid, mtime and mtimensec)
+ * @param record is the target record (must be freed by ingest_record_free())
+ * @param message is the target for the description of an error (can be NULL)
+ * @param message_size is the size of the message buffer
+ * @return 0 on success, -EINVAL for broken records, -ENOMEM on error
+ */
+int ingest_parse_record(const char *line, size_t len, const struct filestat *defaults,
+						struct ingest_record *record, char *message, size_t message_size)
+{
+	memset(record, 0, sizeof(struct ingest_record));
+
+	struct json_cursor cur;
+	cur.pos = line;
+	cur.end = line + len;
+
+	struct byte_buffer key = {NULL, 0, 0};
+	struct byte_buffer value = {NULL, 0, 0};
+	unsigned int keys = 0;
+	mode_t type = 0;
+	int res = 0;
+
+	json_skip_spaces(&cur);
+	if (cur.pos >= cur.end || *cur.pos != '{')
+	{
+		res = parse_error(message, message_size, "not a JSON object");
+		goto out;
+	}
+	cur.pos++;
+	json_skip_spaces(&cur);
+
+	bool first = true;
+	while (!(first && cur.pos < cur.end && *cur.pos == '}'))
+	{
+		res = json_parse_string(&cur, &key);
+		if (res != 0)
+		{
+			res = (res == -ENOMEM) ? res : parse_error(message, message_size, "broken key");
+			goto out;
+		}
+
+		json_skip_spaces(&cur);
+		if (cur.pos >= cur.end || *cur.pos != ':')
+		{
+			res = parse_error(message, message_size, "missing ':' after \"%s\"", (const char *)key.data);
+			goto out;
+		}
+		cur.pos++;
+		json_skip_spaces(&cur);
+
+		const char *name = (const char *)key.data;
+		if (strcmp(name, "path") == 0 || strcmp(name, "target") == 0 ||
+			strcmp(name, "type") == 0 || strcmp(name, "sha256") == 0)
+		{
+			res = json_parse_string(&cur, &value);
+			if (res != 0)
+			{
+				res = (res == -ENOMEM) ? res : parse_error(message, message_size, "broken string of \"%s\"", name);
+				goto out;
+			}
+
+			const char *text = (const char *)value.data;
+			if (strcmp(name, "path") == 0 || strcmp(name, "target") == 0)
+			{
+				char **target = (name[0] == 'p') ? &record->path : &record->link_target;
+				free(*target);
+				*target = strdup(text);
+				if (*target == NULL)
+				{
+					res = -ENOMEM;
+					goto out;
+				}
+			}
+			else if (strcmp(name, "type") == 0)
+			{
+				if (strcmp(text, "file") == 0)
+					type = S_IFREG;
+				else if (strcmp(text, "dir") == 0)
+					type = S_IFDIR;
+				else if (strcmp(text, "symlink") == 0)
+					type = S_IFLNK;
+				else
+				{
+					res = parse_error(message, message_size, "unknown type \"%s\"", text);
+					goto out;
+				}
+			}
+			else
+			{
+				size_t hash_len = strlen(text);
+				if (hash_len != 0 && hash_len != FILESTAT_SHA256_HEX_LENGTH)
+				{
+					res = parse_error(message, message_size, "sha256 must have %d hex digits", FILESTAT_SHA256_HEX_LENGTH);
+					goto out;
+				}
+
+				for (size_t i = 0; i < hash_len; i++)
+				{
+					if (!isxdigit((unsigned char)text[i]))
+					{
+						res = parse_error(message, message_size, "sha256 must have %d hex digits", FILESTAT_SHA256_HEX_LENGTH);
+						goto out;
+					}
+					record->my_stat.sha256[i] = (char)tolower((unsigned char)text[i]);
+				}
+				record->my_stat.sha256[hash_len] = '\0';
+			}
+		}
+		else if (strcmp(name, "mode") == 0)
+		{
+			res = parse_mode(&cur, &value, &record->my_stat.mode);
+			if (res != 0)
+			{
+				res = (res == -ENOMEM) ? res : parse_error(message, message_size, "broken mode");
+				goto out;
+			}
+			keys |= KEY_MODE;
+		}
+		else if (get_numeric_key(name) != NULL)
+		{
+			const struct numeric_key *numeric = get_numeric_key(name);
+			int64_t number;
+			int64_t nsec;
+			bool has_fraction;
+			if (json_parse_number(&cur, &number, &nsec, &has_fraction) != 0 ||
+				(!(numeric->is_time) && (has_fraction || number < 0 || number > numeric->max)))
+			{
+				res = parse_error(message, message_size, "broken number of \"%s\"", name);
+				goto out;
+			}
+
+			set_numeric_key(&record->my_stat, numeric->key, number, nsec);
+			keys |= numeric->key;
+		}
+		else if (json_skip_value(&cur, 0) != 0)
+		{
+			res = parse_error(message, message_size, "broken value of \"%s\"", name);
+			goto out;
+		}
+
+		first = false;
+		json_skip_spaces(&cur);
+		if (cur.pos < cur.end && *cur.pos == ',')
+		{
+			cur.pos++;
+			json_skip_spaces(&cur);
+			continue;
+		}
+		break;
+	}
+
+	if (cur.pos >= cur.end || *cur.pos != '}')
+	{
+		res = parse_error(message, message_size, "broken JSON object");
+		goto out;
+	}
+	cur.pos++;
+	json_skip_spaces(&cur);
+	if (cur.pos != cur.end)
+	{
+		res = parse_error(message, message_size, "extra data after the JSON object");
+		goto out;
+	}
+
+	if (record->path == NULL)
+	{
+		res = parse_error(message, message_size, "missing \"path\"");
+		goto out;
+	}
+
+	// Type and mode
+	mode_t mode_type = (mode_t)record->my_stat.mode & S_IFMT;
+	if (type == 0)
+		type = (mode_type != 0) ? mode_type : S_IFREG;
+	if ((mode_type != 0 && mode_type != type) || (type != S_IFREG && type != S_IFDIR && type != S_IFLNK))
+	{
+		res = parse_error(message, message_size, "type does not match mode");
+		goto out;
+	}
+
+	if (!(keys & KEY_MODE))
+		record->my_stat.mode = (type == S_IFDIR) ? 0755 : (type == S_IFLNK) ? 0777 : 0644;
+	record->my_stat.mode = (uint32_t)type | (record->my_stat.mode & 07777);
+
+	if (type == S_IFLNK && record->link_target != NULL && !(keys & KEY_SIZE))
+		record->my_stat.size = (int64_t)strlen(record->link_target);
+
+	// Defaults
+	struct filestat *st = &record->my_stat;
+	if (!(keys & KEY_BLOCKS))
+		st->blocks = convert_filesize_to_fileblocks(st->size);
+	if (!(keys & KEY_UID))
+		st->uid = defaults->uid;
+	if (!(keys & KEY_GID))
+		st->gid = defaults->gid;
+	if (!(keys & KEY_MTIME))
+	{
+		st->mtime = defaults->mtime;
+		st->mtimensec = defaults->mtimensec;
+	}
+	if (!(keys & KEY_ATIME))
+	{
+		st->atime = st->mtime;
+		st->atimensec = st->mtimensec;
+	}
+	if (!(keys & KEY_CTIME))
+	{
+		st->ctime = st->mtime;
+		st->ctimensec = st->mtimensec;
+	}
+	if (!(keys & KEY_NLINK))
+		st->nlink = (type == S_IFDIR) ? 2 : 1;
+	if (!(keys & KEY_BLKSIZE))
+		st->blksize = 4096;
+
+	res = ingest_record_check(record, message, message_size);
+
+out:
+	byte_buffer_free(&key);
+	byte_buffer_free(&value);
+	if (res != 0)
+		ingest_record_free(record);
+	return res;
+}
+
+/**
+ * Free memory of the record
+ *
+ * @param record is the record
+ */
+void ingest_record_free(struct ingest_record *record)
+{
+	free(record->path);
+	record->path = NULL;
+	free(record->link_target);
+	record->link_target = NULL;
+}
+
+/**
+ * Initialize a writer of index files
+ *
+ * @param writer is the writer
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param storage is the storage of records in index files
+ */
+void ingest_writer_init(struct ingest_writer *writer, int root_fd, enum catalog_storage storage)
+{
+	memset(writer, 0, sizeof(struct ingest_writer));
+	writer->root_fd = root_fd;
+	writer->storage = storage;
+	writer->dir_fd = root_fd;
+}
+
+/**
+ * Open a directory by its relative path without following symlinks
+ *
+ * @param start_fd is the directory to start from (not closed)
+ * @param relpath is the path relative to start_fd (does not need to be null-terminated)
+ * @param len is the length of the path (not 0)
+ * @param create determines if missing directories should be created
+ * @return the new descriptor, negative value (mostly -errno) on error
+ */
+static int open_dir_nofollow(int start_fd, const char *relpath, size_t len, bool create)
+{
+	char *path = strndup(relpath, len);
+	if (path == NULL)
+		return -ENOMEM;
+
+	int fd = start_fd;
+	char *component = path;
+	while (component != NULL)
+	{
+		char *slash = strchr(component, '/');
+		if (slash != NULL)
+			*slash = '\0';
+
+		int next_fd = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (next_fd == -1 && errno == ENOENT && create)
+		{
+			if (mkdirat(fd, component, 0755) == 0 || errno == EEXIST)
+				next_fd = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		}
+
+		int res = (next_fd == -1) ? -errno : 0;
+		if (fd != start_fd)
+			(void)close(fd);
+		if (res != 0)
+		{
+			free(path);
+			return res;
+		}
+
+		fd = next_fd;
+		component = (slash != NULL) ? slash + 1 : NULL;
+	}
+
+	free(path);
+	return fd;
+}
+
+/**
+ * Make the directory the current one of the writer (missing directories are created)
+ *
+ * @param writer is the writer
+ * @param relpath is the relative path of the directory (does not need to be null-terminated)
+ * @param len is the length of the path (0 for the root)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int ingest_writer_enter_dir(struct ingest_writer *writer, const char *relpath, size_t len)
+{
+	size_t current_len = (writer->dir_relpath != NULL) ? strlen(writer->dir_relpath) : 0;
+	if (len == current_len && (len == 0 || memcmp(writer->dir_relpath, relpath, len) == 0))
+		return 0;
+
+	// Records are sorted by path, so the next directory is often below the current one
+	int start_fd = writer->root_fd;
+	size_t start_len = 0;
+	if (current_len != 0 && len > current_len && relpath[current_len] == '/' &&
+		memcmp(writer->dir_relpath, relpath, current_len) == 0)
+	{
+		start_fd = writer->dir_fd;
+		start_len = current_len + 1;
+	}
+
+	int fd = writer->root_fd;
+	char *dir_relpath = NULL;
+	if (len != 0)
+	{
+		dir_relpath = strndup(relpath, len);
+		if (dir_relpath == NULL)
+			return -ENOMEM;
+
+		fd = open_dir_nofollow(start_fd, relpath + start_len, len - start_len, true);
+		if (fd < 0)
+		{
+			free(dir_relpath);
+			return fd;
+		}
+	}
+
+	if (writer->dir_fd != writer->root_fd)
+		(void)close(writer->dir_fd);
+	free(writer->dir_relpath);
+
+	writer->dir_fd = fd;
+	writer->dir_relpath = dir_relpath;
+	return 0;
+}
+
+/**
+ * Remember metadata of a directory for ingest_writer_finish()
+ *
+ * @param writer is the writer
+ * @param record is the record of the directory
+ * @return 0 on success, -ENOMEM on error
+ */
+static int ingest_writer_add_dir(struct ingest_writer *writer, const struct ingest_record *record)
+{
+	if (writer->dirs_count == writer->dirs_capacity)
+	{
+		size_t capacity = (writer->dirs_capacity == 0) ? 64 : writer->dirs_capacity * 2;
+		struct ingest_dir_meta *dirs = (struct ingest_dir_meta *)realloc(writer->dirs, capacity * sizeof(struct ingest_dir_meta));
+		if (dirs == NULL)
+			return -ENOMEM;
+
+		writer->dirs = dirs;
+		writer->dirs_capacity = capacity;
+	}
+
+	char *path = strdup(record->path);
+	if (path == NULL)
+		return -ENOMEM;
+
+	writer->dirs[writer->dirs_count].path = path;
+	writer->dirs[writer->dirs_count].my_stat = record->my_stat;
+	writer->dirs_count++;
+	return 0;
+}
+
+/**
+ * Fill access and modification times for utimensat() and futimens()
+ *
+ * @param my_stat is the metadata
+ * @param times is the target array of 2 times
+ */
+static void fill_times(const struct filestat *my_stat, struct timespec times[2])
+{
+	times[0].tv_sec = (time_t)my_stat->atime;
+	times[0].tv_nsec = (long)my_stat->atimensec;
+	times[1].tv_sec = (time_t)my_stat->mtime;
+	times[1].tv_nsec = (long)my_stat->mtimensec;
+}
+
+/**
+ * Create or replace the entry of the record (see struct ingest_sink)
+ *
+ * @param ctx is the writer
+ * @param record is the record
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int ingest_writer_put(void *ctx, const struct ingest_record *record)
+{
+	struct ingest_writer *writer = (struct ingest_writer *)ctx;
+
+	const char *slash = strrchr(record->path, '/');
+	const char *name = (slash != NULL) ? slash + 1 : record->path;
+	size_t dir_len = (slash != NULL) ? (size_t)(slash - record->path) : 0;
+
+	int res = ingest_writer_enter_dir(writer, record->path, dir_len);
+	if (res != 0)
+		return res;
+
+	mode_t mode = (mode_t)record->my_stat.mode;
+	if (S_ISDIR(mode))
+	{
+		// Permissions are applied by ingest_writer_finish(), entries are created inside first
+		if (mkdirat(writer->dir_fd, name, (mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)
+			return -errno;
+
+		return ingest_writer_add_dir(writer, record);
+	}
+
+	if (S_ISLNK(mode))
+	{
+		res = symlinkat(record->link_target, writer->dir_fd, name);
+		if (res == -1 && errno == EEXIST)
+		{
+			if (unlinkat(writer->dir_fd, name, 0) == -1)
+				return -errno;
+			res = symlinkat(record->link_target, writer->dir_fd, name);
+		}
+		if (res == -1)
+			return -errno;
+
+		struct timespec times[2];
+		fill_times(&record->my_stat, times);
+		if (utimensat(writer->dir_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+			return -errno;
+
+		// The owner of a symlink is its real owner, it can be set only by root
+		if (geteuid() == 0 &&
+			fchownat(writer->dir_fd, name, (uid_t)record->my_stat.uid, (gid_t)record->my_stat.gid, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	int fd = openat(writer->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+	if (fd == -1)
+		return -errno;
+
+	res = storage_save_filestat(fd, writer->storage, &record->my_stat, record->path);
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+
+	return res;
+}
+
+/**
+ * Apply metadata of directories created since the previous call
+ * (creating entries inside a directory changes its mtime)
+ *
+ * @param writer is the writer
+ * @return 0 on success, the first error otherwise
+ */
+int ingest_writer_finish(struct ingest_writer *writer)
+{
+	int first_error = 0;
+
+	for (size_t i = 0; i < writer->dirs_count; i++)
+	{
+		const struct ingest_dir_meta *dir = &writer->dirs[i];
+
+		int fd = open_dir_nofollow(writer->root_fd, dir->path, strlen(dir->path), false);
+		int res = (fd < 0) ? fd : 0;
+		if (res == 0)
+		{
+			struct timespec times[2];
+			fill_times(&dir->my_stat, times);
+			if (fchmod(fd, (mode_t)dir->my_stat.mode & 07777) == -1 || futimens(fd, times) == -1)
+				res = -errno;
+			else if (geteuid() == 0 && fchown(fd, (uid_t)dir->my_stat.uid, (gid_t)dir->my_stat.gid) == -1)
+				res = -errno;
+			(void)close(fd);
+		}
+
+		if (res != 0 && first_error == 0)
+			first_error = res;
+	}
+
+	ingest_writer_free(writer);
+	return first_error;
+}
+
+/**
+ * Free memory of the writer (without ingest_writer_finish())
+ *
+ * @param writer is the writer
+ */
+void ingest_writer_free(struct ingest_writer *writer)
+{
+	if (writer->dir_fd != writer->root_fd)
+		(void)close(writer->dir_fd);
+	writer->dir_fd = writer->root_fd;
+	free(writer->dir_relpath);
+	writer->dir_relpath = NULL;
+
+	for (size_t i = 0; i < writer->dirs_count; i++)
+		free(writer->dirs[i].path);
+	free(writer->dirs);
+	writer->dirs = NULL;
+	writer->dirs_count = 0;
+	writer->dirs_capacity = 0;
+}
+
+/**
+ * Initialize a stream
+ *
+ * @param stream is the stream
+ * @param sink is the target of records
+ * @param defaults is the metadata that is used for missing keys (uid, gid, mtime and mtimensec)
+ * @return 0 on success, -ENOMEM on error
+ */
+int ingest_stream_init(struct ingest_stream *stream, const struct ingest_sink *sink, const struct filestat *defaults)
+{
+	memset(stream, 0, sizeof(struct ingest_stream));
+
+	stream->records = (struct ingest_record *)malloc(INGEST_BATCH_SIZE * sizeof(struct ingest_record));
+	if (stream->records == NULL)
+		return -ENOMEM;
+
+	stream->sink = *sink;
+	stream->defaults = *defaults;
+	return 0;
+}
+
+/**
+ * Count an error of the stream and keep the message of the first one
+ *
+ * @param stream is the stream
+ * @param error is the error
+ * @param format is the format of the message
+ */
+static void ingest_stream_error(struct ingest_stream *stream, int error, const char *format, ...)
+{
+	stream->errors++;
+	if (stream->first_error != 0)
+		return;
+
+	stream->first_error = error;
+
+	va_list args;
+	va_start(args, format);
+	(void)vsnprintf(stream->first_error_message, sizeof(stream->first_error_message), format, args);
+	va_end(args);
+}
+
+/**
+ * Compare records by path (and by line for records of the same path)
+ */
+static int compare_records(const void *a, const void *b)
+{
+	const struct ingest_record *left = (const struct ingest_record *)a;
+	const struct ingest_record *right = (const struct ingest_record *)b;
+
+	int res = strcmp(left->path, right->path);
+	if (res != 0)
+		return res;
+
+	return (left->line < right->line) ? -1 : (left->line > right->line) ? 1 : 0;
+}
+
+/**
+ * Apply waiting records sorted by path (parents go before their entries)
+ *
+ * @param stream is the stream
+ * @param last is true if the stream is flushed
+ */
+static void ingest_stream_apply(struct ingest_stream *stream, bool last)
+{
+	qsort(stream->records, stream->count, sizeof(struct ingest_record), compare_records);
+
+	for (size_t i = 0; i < stream->count; i++)
+	{
+		struct ingest_record *record = &stream->records[i];
+
+		int res = stream->sink.put(stream->sink.ctx, record);
+		if (res != 0)
+			ingest_stream_error(stream, res, "line %" PRIu64 ": %s: %s", record->line, record->path, strerror(-res));
+		else
+			stream->applied++;
+
+		ingest_record_free(record);
+	}
+	stream->count = 0;
+
+	if (stream->sink.commit != NULL)
+	{
+		int res = stream->sink.commit(stream->sink.ctx, last);
+		if (res != 0)
+			ingest_stream_error(stream, res, "commit: %s", strerror(-res));
+	}
+}
+
+/**
+ * Queue a checked record and apply the batch if it's full
+ *
+ * @param stream is the stream
+ * @param record is the record (ownership of its strings is taken)
+ */
+static void ingest_stream_queue(struct ingest_stream *stream, struct ingest_record *record)
+{
+	// The root directory always exists
+	if (record->path[0] == '\0')
+	{
+		ingest_record_free(record);
+		stream->applied++;
+		return;
+	}
+
+	stream->records[stream->count] = *record;
+	stream->count++;
+	if (stream->count == INGEST_BATCH_SIZE)
+		ingest_stream_apply(stream, false);
+}
+
+/**
+ * Add a record parsed by the caller (e.g. from an archive) and apply the batch if it's full.
+ * Broken records are counted and skipped (see ingest_record_check()).
+ *
+ * @param stream is the stream
+ * @param record is the record (ownership of its strings is taken, line is set by the caller)
+ */
+void ingest_stream_add_record(struct ingest_stream *stream, struct ingest_record *record)
+{
+	char message[INGEST_ERROR_MESSAGE_SIZE];
+	int res = ingest_record_check(record, message, sizeof(message));
+	if (res != 0)
+	{
+		ingest_stream_error(stream, res, "record %" PRIu64 ": %s", record->line, message);
+		ingest_record_free(record);
+		return;
+	}
+
+	ingest_stream_queue(stream, record);
+}
+
+/**
+ * Parse a complete line and apply the batch if it's full
+ *
+ * @param stream is the stream
+ * @param line is the line (without the newline)
+ * @param len is the length of the line
+ * @return 0 on success, -ENOMEM on error
+ */
+static int ingest_stream_add_line(struct ingest_stream *stream, const char *line, size_t len)
+{
+	stream->lines++;
+
+	// Empty lines are allowed
+	size_t i = 0;
+	while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r'))
+		i++;
+	if (i == len)
+		return 0;
+
+	struct ingest_record record;
+	char message[INGEST_ERROR_MESSAGE_SIZE];
+	int res = ingest_parse_record(line, len, &stream->defaults, &record, message, sizeof(message));
+	if (res == -ENOMEM)
+		return res;
+
+	if (res != 0)
+	{
+		ingest_stream_error(stream, res, "line %" PRIu64 ": %s", stream->lines, message);
+		return 0;
+	}
+
+	record.line = stream->lines;
+	ingest_stream_queue(stream, &record);
+	return 0;
+}
+
+/**
+ * Parse data of the stream and apply full batches of records.
+ * Broken records and records that can't be applied are counted and skipped.
+ *
+ * @param stream is the stream
+ * @param data is the data
+ * @param size is the size of data
+ * @return 0 on success, -ENOMEM on error
+ */
+int ingest_stream_write(struct ingest_stream *stream, const char *data, size_t size)
+{
+	const char *pos = data;
+	const char *end = data + size;
+
+	while (pos < end)
+	{
+		const char *newline = (const char *)memchr(pos, '\n', (size_t)(end - pos));
+		size_t chunk = (size_t)(((newline != NULL) ? newline : end) - pos);
+
+		if (!(stream->skipping_line))
+		{
+			if (stream->line.len + chunk > INGEST_MAX_LINE_LENGTH)
+			{
+				stream->skipping_line = true;
+				stream->line.len = 0;
+			}
+			else if (newline != NULL && stream->line.len == 0)
+			{
+				// Complete lines are parsed in place
+				int res = ingest_stream_add_line(stream, pos, chunk);
+				if (res != 0)
+					return res;
+				pos = newline + 1;
+				continue;
+			}
+			else if (byte_buffer_append(&stream->line, pos, chunk) != 0)
+			{
+				return -ENOMEM;
+			}
+		}
+
+		if (newline == NULL)
+			break;
+
+		if (stream->skipping_line)
+		{
+			stream->lines++;
+			stream->skipping_line = false;
+			ingest_stream_error(stream, -EINVAL, "line %" PRIu64 ": too long line", stream->lines);
+		}
+		else
+		{
+			int res = ingest_stream_add_line(stream, (const char *)stream->line.data, stream->line.len);
+			stream->line.len = 0;
+			if (res != 0)
+				return res;
+		}
+
+		pos = newline + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Apply all waiting records (the incomplete last line is parsed as a record too)
+ *
+ * @param stream is the stream
+ * @return 0 on success, the first error since the previous flush otherwise
+ *         (see first_error_message)
+ */
+int ingest_stream_flush(struct ingest_stream *stream)
+{
+	if (stream->skipping_line)
+	{
+		stream->lines++;
+		stream->skipping_line = false;
+		ingest_stream_error(stream, -EINVAL, "line %" PRIu64 ": too long line", stream->lines);
+	}
+	else if (stream->line.len > 0)
+	{
+		int res = ingest_stream_add_line(stream, (const char *)stream->line.data, stream->line.len);
+		stream->line.len = 0;
+		if (res != 0)
+			ingest_stream_error(stream, res, "line %" PRIu64 ": %s", stream->lines, strerror(-res));
+	}
+
+	ingest_stream_apply(stream, true);
+
+	int res = stream->first_error;
+	stream->first_error = 0;
+	return res;
+}
+
+/**
+ * Free memory of the stream (waiting records are dropped)
+ *
+ * @param stream is the stream
+ */
+void ingest_stream_free(struct ingest_stream *stream)
+{
+	for (size_t i = 0; i < stream->count; i++)
+		ingest_record_free(&stream->records[i]);
+	free(stream->records);
+	stream->records = NULL;
+	stream->count = 0;
+	byte_buffer_free(&stream->line);
+}
@@ -0,0 +1,286 @@
+#ifndef INC_CATALOGFS_INGEST_H
+#define INC_CATALOGFS_INGEST_H
+
+#include "header_common.h"
+
+#include "byte_buffer.h"
+#include "filestat.h"
+#include "storage.h"
+
+/**
+ * Bulk ingestion of entries into a catalog.
+ *
+ * Creating a catalog through the mount costs create(), write(), flush() and
+ * release() per file. An ingest stream takes records of entries as NDJSON
+ * (one JSON object per line) and creates entries in batches of
+ * INGEST_BATCH_SIZE records, sorted by path, so entries of a directory are
+ * created one after another with one descriptor of the directory:
+ *
+ *   {"path":"music/a.flac","size":31457280,"mtime":1589000000.25,"mode":"0644"}
+ *   {"path":"music","type":"dir","mtime":1589000000}
+ *   {"path":"music/latest","type":"symlink","target":"a.flac"}
+ *
+ * Keys of a record:
+ *  - "path" (required): path of the entry relative to the root of the catalog;
+ *  - "type": "file" (default), "dir" or "symlink";
+ *  - "target": target of a symlink (required for symlinks);
+ *  - "mode": permission bits, a number (as st_mode) or an octal string;
+ *  - "size", "blocks", "uid", "gid", "nlink", "blksize": integers;
+ *  - "atime", "mtime", "ctime": seconds, integers or decimals with nanoseconds
+ *    ("atime_nsec", "mtime_nsec" and "ctime_nsec" can be given separately);
+ *  - "sha256": hash of contents in hex.
+ * Unknown keys are ignored. "mtime" defaults to the time of the stream, "atime"
+ * and "ctime" default to "mtime", "blocks" is computed from "size". Missing parent
+ * directories are created, existing files and symlinks are replaced. Records
+ * of the root directory itself are accepted and ignored.
+ *
+ * Streams are not thread-safe, callers must serialize access.
+ */
+
+/** Maximum number of records applied at once */
+#define INGEST_BATCH_SIZE (4096)
+
+/** Maximum length of a line of a stream */
+#define INGEST_MAX_LINE_LENGTH (65536)
+
+/** Maximum length of the message of the first error of a stream */
+#define INGEST_ERROR_MESSAGE_SIZE (256)
+
+/**
+ * Parsed record of an entry
+ */
+struct ingest_record
+{
+	/** Normalized relative path (no leading, trailing or repeated slashes, empty for the root) */
+	char *path;
+
+	/** Metadata of the entry (mode includes the type) */
+	struct filestat my_stat;
+
+	/** Target of the symlink (NULL for other types) */
+	char *link_target;
+
+	/** Number of the line of the record in the stream (or of the record in an archive) */
+	uint64_t line;
+};
+
+/**
+ * Target of records of a stream
+ */
+struct ingest_sink
+{
+	/**
+	 * Create or replace the entry of the record
+	 *
+	 * @param ctx is the context of the sink
+	 * @param record is the record (not the root directory)
+	 * @return 0 on success, negative value (mostly -errno) on error
+	 */
+	int (*put)(void *ctx, const struct ingest_record *record);
+
+	/**
+	 * Finish a batch of records (can be NULL)
+	 *
+	 * @param ctx is the context of the sink
+	 * @param last is true if the writer of the stream flushed it (e.g. closed the file)
+	 * @return 0 on success, negative value (mostly -errno) on error
+	 */
+	int (*commit)(void *ctx, bool last);
+
+	/** Context of the sink */
+	void *ctx;
+};
+
+/**
+ * Metadata of a directory applied after entries inside it are created
+ */
+struct ingest_dir_meta
+{
+	/** Relative path of the directory */
+	char *path;
+
+	/** Metadata of the directory */
+	struct filestat my_stat;
+};
+
+/**
+ * Sink that creates entries as index files of a catalog directory
+ * (not thread-safe, callers must serialize access)
+ */
+struct ingest_writer
+{
+	/** Source directory file descriptor (not owned) */
+	int root_fd;
+
+	/** Storage of records in index files */
+	enum catalog_storage storage;
+
+	/** Descriptor of the directory of the previous record (root_fd or owned) */
+	int dir_fd;
+
+	/** Relative path of the directory of the previous record (NULL for the root) */
+	char *dir_relpath;
+
+	/** Directories to get their metadata by ingest_writer_finish() */
+	struct ingest_dir_meta *dirs;
+
+	/** Number of directories */
+	size_t dirs_count;
+
+	/** Allocated size of dirs */
+	size_t dirs_capacity;
+};
+
+/**
+ * Stream of NDJSON records
+ */
+struct ingest_stream
+{
+	/** Target of records */
+	struct ingest_sink sink;
+
+	/** Metadata that is used for missing keys of records (uid, gid, mtime and mtimensec) */
+	struct filestat defaults;
+
+	/** Incomplete line of the stream */
+	struct byte_buffer line;
+
+	/** The current line is too long and is skipped up to its end */
+	bool skipping_line;
+
+	/** Number of lines of the stream */
+	uint64_t lines;
+
+	/** Parsed records waiting to be applied */
+	struct ingest_record *records;
+
+	/** Number of waiting records */
+	size_t count;
+
+	/** Number of applied records */
+	uint64_t applied;
+
+	/** Number of records that could not be parsed or applied */
+	uint64_t errors;
+
+	/** First error since the last flush */
+	int first_error;
+
+	/** Message of the first error since the last flush (empty if there is no error) */
+	char first_error_message[INGEST_ERROR_MESSAGE_SIZE];
+};
+
+/**
+ * Parse one NDJSON record
+ *
+ * @param line is the line (does not need to be null-terminated)
+ * @param len is the length of the line
+ * @param defaults is the metadata that is used for missing keys (uid, gid, mtime and mtimensec)
+ * @param record is the target record (must be freed by ingest_record_free())
+ * @param message is the target for the description of an error (can be NULL)
+ * @param message_size is the size of the message buffer
+ * @return 0 on success, -EINVAL for broken records, -ENOMEM on error
+ */
+int ingest_parse_record(const char *line, size_t len, const struct filestat *defaults,
+						struct ingest_record *record, char *message, size_t message_size);
+
+/**
+ * Normalize the path of a record and check the record
+ * (used for records parsed by callers, e.g. from archives)
+ *
+ * @param record is the record
+ * @param message is the target for the description of an error (can be NULL)
+ * @param message_size is the size of the message buffer
+ * @return 0 on success, -EINVAL for broken paths, reserved names, unsupported types
+ *         and symlinks without targets
+ */
+int ingest_record_check(struct ingest_record *record, char *message, size_t message_size);
+
+/**
+ * Free memory of the record
+ *
+ * @param record is the record
+ */
+void ingest_record_free(struct ingest_record *record);
+
+/**
+ * Initialize a writer of index files
+ *
+ * @param writer is the writer
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param storage is the storage of records in index files
+ */
+void ingest_writer_init(struct ingest_writer *writer, int root_fd, enum catalog_storage storage);
+
+/**
+ * Create or replace the entry of the record (see struct ingest_sink)
+ *
+ * @param ctx is the writer
+ * @param record is the record
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int ingest_writer_put(void *ctx, const struct ingest_record *record);
+
+/**
+ * Apply metadata of directories created since the previous call
+ * (creating entries inside a directory changes its mtime)
+ *
+ * @param writer is the writer
+ * @return 0 on success, the first error otherwise
+ */
+int ingest_writer_finish(struct ingest_writer *writer);
+
+/**
+ * Free memory of the writer (without ingest_writer_finish())
+ *
+ * @param writer is the writer
+ */
+void ingest_writer_free(struct ingest_writer *writer);
+
+/**
+ * Initialize a stream
+ *
+ * @param stream is the stream
+ * @param sink is the target of records
+ * @param defaults is the metadata that is used for missing keys (uid, gid, mtime and mtimensec)
+ * @return 0 on success, -ENOMEM on error
+ */
+int ingest_stream_init(struct ingest_stream *stream, const struct ingest_sink *sink, const struct filestat *defaults);
+
+/**
+ * Parse data of the stream and apply full batches of records.
+ * Broken records and records that can't be applied are counted and skipped.
+ *
+ * @param stream is the stream
+ * @param data is the data
+ * @param size is the size of data
+ * @return 0 on success, -ENOMEM on error
+ */
+int ingest_stream_write(struct ingest_stream *stream, const char *data, size_t size);
+
+/**
+ * Add a record parsed by the caller (e.g. from an archive) and apply the batch if it's full.
+ * Broken records are counted and skipped (see ingest_record_check()).
+ *
+ * @param stream is the stream
+ * @param record is the record (ownership of its strings is taken, line is set by the caller)
+ */
+void ingest_stream_add_record(struct ingest_stream *stream, struct ingest_record *record);
+
+/**
+ * Apply all waiting records (the incomplete last line is parsed as a record too)
+ *
+ * @param stream is the stream
+ * @return 0 on success, the first error since the previous flush otherwise
+ *         (see first_error_message)
+ */
+int ingest_stream_flush(struct ingest_stream *stream);
+
+/**
+ * Free memory of the stream (waiting records are dropped)
+ *
+ * @param stream is the stream
+ */
+void ingest_stream_free(struct ingest_stream *stream);
+
+#endif // INC_CATALOGFS_INGEST_H
@@ -0,0 +1,372 @@
+#include "header_common.h"
+
+#include "json.h"
+
+/**
+ * Skip JSON whitespace
+ *
+ * @param cur is the cursor
+ */
+void json_skip_spaces(struct json_cursor *cur)
+{
+	while (cur->pos < cur->end &&
+		   (*cur->pos == ' ' || *cur->pos == '\t' || *cur->pos == '\r' || *cur->pos == '\n'))
+	{
+		cur->pos++;
+	}
+}
+
+/**
+ * Parse 4 hex digits of a \u escape
+ *
+ * @param cur is the cursor (after "\u")
+ * @param value is the parsed code unit
+ * @return true on success
+ */
+static bool json_parse_hex4(struct json_cursor *cur, uint32_t *value)
+{
+	if (cur->end - cur->pos < 4)
+		return false;
+
+	*value = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		char c = *cur->pos++;
+		uint32_t digit;
+		if (c >= '0' && c <= '9')
+			digit = (uint32_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			digit = (uint32_t)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			digit = (uint32_t)(c - 'A' + 10);
+		else
+			return false;
+		*value = (*value << 4) | digit;
+	}
+
+	return true;
+}
+
+/**
+ * Append a code point encoded in UTF-8
+ *
+ * @param out is the target buffer
+ * @param code is the code point
+ * @return 0 on success, -ENOMEM on error
+ */
+static int append_utf8(struct byte_buffer *out, uint32_t code)
+{
+	uint8_t bytes[4];
+	size_t len;
+
+	if (code < 0x80)
+	{
+		bytes[0] = (uint8_t)code;
+		len = 1;
+	}
+	else if (code < 0x800)
+	{
+		bytes[0] = (uint8_t)(0xC0 | (code >> 6));
+		bytes[1] = (uint8_t)(0x80 | (code & 0x3F));
+		len = 2;
+	}
+	else if (code < 0x10000)
+	{
+		bytes[0] = (uint8_t)(0xE0 | (code >> 12));
+		bytes[1] = (uint8_t)(0x80 | ((code >> 6) & 0x3F));
+		bytes[2] = (uint8_t)(0x80 | (code & 0x3F));
+		len = 3;
+	}
+	else
+	{
+		bytes[0] = (uint8_t)(0xF0 | (code >> 18));
+		bytes[1] = (uint8_t)(0x80 | ((code >> 12) & 0x3F));
+		bytes[2] = (uint8_t)(0x80 | ((code >> 6) & 0x3F));
+		bytes[3] = (uint8_t)(0x80 | (code & 0x3F));
+		len = 4;
+	}
+
+	return byte_buffer_append(out, bytes, len);
+}
+
+/**
+ * Parse a JSON string (bytes that are not valid UTF-8 are kept as they are)
+ *
+ * @param cur is the cursor (at the opening quote)
+ * @param out is the target buffer (cleared, gets the null-terminated string)
+ * @return 0 on success, -EINVAL for broken strings and strings with null characters, -ENOMEM on error
+ */
+int json_parse_string(struct json_cursor *cur, struct byte_buffer *out)
+{
+	out->len = 0;
+	if (cur->pos >= cur->end || *cur->pos != '"')
+		return -EINVAL;
+	cur->pos++;
+
+	while (cur->pos < cur->end)
+	{
+		// Unescaped runs are copied at once
+		const char *start = cur->pos;
+		while (cur->pos < cur->end && *cur->pos != '"' && *cur->pos != '\\' && *cur->pos != '\0')
+			cur->pos++;
+		if (cur->pos > start && byte_buffer_append(out, start, (size_t)(cur->pos - start)) != 0)
+			return -ENOMEM;
+
+		if (cur->pos >= cur->end || *cur->pos == '\0')
+			return -EINVAL;
+
+		if (*cur->pos == '"')
+		{
+			cur->pos++;
+			return (byte_buffer_append(out, "", 1) == 0) ? 0 : -ENOMEM;
+		}
+
+		// Escape sequence
+		cur->pos++;
+		if (cur->pos >= cur->end)
+			return -EINVAL;
+
+		char c = *cur->pos++;
+		char decoded;
+		switch (c)
+		{
+		case '"':
+		case '\\':
+		case '/':
+			decoded = c;
+			break;
+		case 'b':
+			decoded = '\b';
+			break;
+		case 'f':
+			decoded = '\f';
+			break;
+		case 'n':
+			decoded = '\n';
+			break;
+		case 'r':
+			decoded = '\r';
+			break;
+		case 't':
+			decoded = '\t';
+			break;
+		case 'u':
+		{
+			uint32_t code;
+			if (!json_parse_hex4(cur, &code) || code == 0)
+				return -EINVAL;
+
+			// Surrogate pair
+			if (code >= 0xD800 && code <= 0xDBFF)
+			{
+				uint32_t low;
+				if (cur->end - cur->pos < 2 || cur->pos[0] != '\\' || cur->pos[1] != 'u')
+					return -EINVAL;
+				cur->pos += 2;
+				if (!json_parse_hex4(cur, &low) || low < 0xDC00 || low > 0xDFFF)
+					return -EINVAL;
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			}
+			else if (code >= 0xDC00 && code <= 0xDFFF)
+			{
+				return -EINVAL;
+			}
+
+			if (append_utf8(out, code) != 0)
+				return -ENOMEM;
+			continue;
+		}
+		default:
+			return -EINVAL;
+		}
+
+		if (byte_buffer_append(out, &decoded, 1) != 0)
+			return -ENOMEM;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Parse a JSON number as seconds with an optional fraction (exponents are not supported)
+ *
+ * @param cur is the cursor
+ * @param value is the integer part (rounded down for negative numbers with fractions)
+ * @param nsec is the fraction in nanoseconds (0 to 999999999, digits after the 9th are dropped)
+ * @param has_fraction is set if the number has a fraction
+ * @return 0 on success, -EINVAL for broken and too big numbers
+ */
+int json_parse_number(struct json_cursor *cur, int64_t *value, int64_t *nsec, bool *has_fraction)
+{
+	bool negative = false;
+	if (cur->pos < cur->end && *cur->pos == '-')
+	{
+		negative = true;
+		cur->pos++;
+	}
+
+	if (cur->pos >= cur->end || !isdigit((unsigned char)*cur->pos))
+		return -EINVAL;
+
+	uint64_t integer = 0;
+	while (cur->pos < cur->end && isdigit((unsigned char)*cur->pos))
+	{
+		uint64_t digit = (uint64_t)(*cur->pos - '0');
+		if (integer > ((uint64_t)INT64_MAX - digit) / 10)
+			return -EINVAL;
+		integer = integer * 10 + digit;
+		cur->pos++;
+	}
+
+	int64_t fraction = 0;
+	*has_fraction = false;
+	if (cur->pos < cur->end && *cur->pos == '.')
+	{
+		cur->pos++;
+		if (cur->pos >= cur->end || !isdigit((unsigned char)*cur->pos))
+			return -EINVAL;
+
+		*has_fraction = true;
+		int64_t scale = 100000000;
+		while (cur->pos < cur->end && isdigit((unsigned char)*cur->pos))
+		{
+			fraction += (int64_t)(*cur->pos - '0') * scale;
+			scale /= 10;
+			cur->pos++;
+		}
+	}
+
+	if (cur->pos < cur->end && (*cur->pos == 'e' || *cur->pos == 'E'))
+		return -EINVAL;
+
+	if (!negative)
+	{
+		*value = (int64_t)integer;
+		*nsec = fraction;
+	}
+	else if (fraction == 0)
+	{
+		*value = -(int64_t)integer;
+		*nsec = 0;
+	}
+	else
+	{
+		*value = -(int64_t)integer - 1;
+		*nsec = 1000000000 - fraction;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a JSON literal true or false
+ *
+ * @param cur is the cursor
+ * @param value is the parsed value
+ * @return 0 on success, -EINVAL for other values
+ */
+int json_parse_bool(struct json_cursor *cur, bool *value)
+{
+	size_t available = (size_t)(cur->end - cur->pos);
+	if (available >= 4 && memcmp(cur->pos, "true", 4) == 0)
+	{
+		cur->pos += 4;
+		*value = true;
+		return 0;
+	}
+	if (available >= 5 && memcmp(cur->pos, "false", 5) == 0)
+	{
+		cur->pos += 5;
+		*value = false;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Skip a JSON value (e.g. of an unknown key)
+ *
+ * @param cur is the cursor
+ * @param depth is the depth of nesting
+ * @return 0 on success, -EINVAL for broken values
+ */
+int json_skip_value(struct json_cursor *cur, int depth)
+{
+	if (depth > JSON_MAX_DEPTH || cur->pos >= cur->end)
+		return -EINVAL;
+
+	char c = *cur->pos;
+	if (c == '"')
+	{
+		cur->pos++;
+		while (cur->pos < cur->end && *cur->pos != '"')
+			cur->pos += (*cur->pos == '\\') ? 2 : 1;
+		if (cur->pos >= cur->end)
+			return -EINVAL;
+		cur->pos++;
+		return 0;
+	}
+
+	if (c == '{' || c == '[')
+	{
+		char close = (c == '{') ? '}' : ']';
+		cur->pos++;
+		json_skip_spaces(cur);
+		if (cur->pos < cur->end && *cur->pos == close)
+		{
+			cur->pos++;
+			return 0;
+		}
+
+		while (true)
+		{
+			if (c == '{')
+			{
+				if (json_skip_value(cur, depth + 1) != 0)
+					return -EINVAL;
+				json_skip_spaces(cur);
+				if (cur->pos >= cur->end || *cur->pos != ':')
+					return -EINVAL;
+				cur->pos++;
+				json_skip_spaces(cur);
+			}
+
+			if (json_skip_value(cur, depth + 1) != 0)
+				return -EINVAL;
+			json_skip_spaces(cur);
+			if (cur->pos >= cur->end)
+				return -EINVAL;
+			if (*cur->pos == close)
+			{
+				cur->pos++;
+				return 0;
+			}
+			if (*cur->pos != ',')
+				return -EINVAL;
+			cur->pos++;
+			json_skip_spaces(cur);
+		}
+	}
+
+	if (c == '-' || isdigit((unsigned char)c))
+	{
+		// Numbers of unknown keys can have exponents
+		while (cur->pos < cur->end && strchr("+-.eE0123456789", *cur->pos) != NULL)
+			cur->pos++;
+		return 0;
+	}
+
+	static const char *const literals[] = {"true", "false", "null"};
+	for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++)
+	{
+		size_t len = strlen(literals[i]);
+		if ((size_t)(cur->end - cur->pos) >= len && memcmp(cur->pos, literals[i], len) == 0)
+		{
+			cur->pos += len;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
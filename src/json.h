@@ -0,0 +1,74 @@
+#ifndef INC_CATALOGFS_JSON_H
+#define INC_CATALOGFS_JSON_H
+
+#include "header_common.h"
+
+#include "byte_buffer.h"
+
+/**
+ * Minimal JSON scanner for records of ingest streams and imported listings.
+ * Values are parsed in place from a cursor over a buffer, nothing is
+ * allocated except the decoded strings.
+ */
+
+/** Maximum depth of nested values that are skipped */
+#define JSON_MAX_DEPTH (64)
+
+/**
+ * Position inside a buffer being parsed
+ */
+struct json_cursor
+{
+	/** Current character */
+	const char *pos;
+
+	/** End of the buffer */
+	const char *end;
+};
+
+/**
+ * Skip JSON whitespace
+ *
+ * @param cur is the cursor
+ */
+void json_skip_spaces(struct json_cursor *cur);
+
+/**
+ * Parse a JSON string (bytes that are not valid UTF-8 are kept as they are)
+ *
+ * @param cur is the cursor (at the opening quote)
+ * @param out is the target buffer (cleared, gets the null-terminated string)
+ * @return 0 on success, -EINVAL for broken strings and strings with null characters, -ENOMEM on error
+ */
+int json_parse_string(struct json_cursor *cur, struct byte_buffer *out);
+
+/**
+ * Parse a JSON number as seconds with an optional fraction (exponents are not supported)
+ *
+ * @param cur is the cursor
+ * @param value is the integer part (rounded down for negative numbers with fractions)
+ * @param nsec is the fraction in nanoseconds (0 to 999999999, digits after the 9th are dropped)
+ * @param has_fraction is set if the number has a fraction
+ * @return 0 on success, -EINVAL for broken and too big numbers
+ */
+int json_parse_number(struct json_cursor *cur, int64_t *value, int64_t *nsec, bool *has_fraction);
+
+/**
+ * Parse a JSON literal true or false
+ *
+ * @param cur is the cursor
+ * @param value is the parsed value
+ * @return 0 on success, -EINVAL for other values
+ */
+int json_parse_bool(struct json_cursor *cur, bool *value);
+
+/**
+ * Skip a JSON value (e.g. of an unknown key)
+ *
+ * @param cur is the cursor
+ * @param depth is the depth of nesting (0 for top-level values)
+ * @return 0 on success, -EINVAL for broken values and values nested deeper than JSON_MAX_DEPTH
+ */
+int json_skip_value(struct json_cursor *cur, int depth);
+
+#endif // INC_CATALOGFS_JSON_H
@@ -0,0 +1,849 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "compact_dir.h"
+#include "index_state.h"
+#include "filestat_converter.h"
+#include "filestat_parser.h"
+#include "metadata_cache.h"
+#include "storage.h"
+#include "where_filter.h"
+
+/** Length of the manifest header */
+#define MANIFEST_HEADER_LENGTH (sizeof(MANIFEST_HEADER) - 1)
+
+/** Inode numbers of manifest entries have the highest bit set, so they do not collide with real ones */
+#define MANIFEST_INO_FLAG (UINT64_C(1) << 63)
+
+/**
+ * Cached manifest
+ */
+struct manifest_cache_entry
+{
+	/** Opened manifest */
+	struct manifest manifest;
+
+	/** Value of the cache clock at the last use */
+	uint64_t last_used;
+};
+
+/**
+ * Check if the name is reserved for manifest files, the indexing state or the where filter (such entries are hidden)
+ *
+ * @param name is the name of an entry
+ * @return true if the name is reserved
+ */
+bool manifest_is_reserved_name(const char *name)
+{
+	return strcmp(name, MANIFEST_FILE_NAME) == 0 ||
+		   strcmp(name, MANIFEST_TMP_FILE_NAME) == 0 ||
+		   strcmp(name, INDEX_STATE_FILE_NAME) == 0 ||
+		   strcmp(name, INDEX_STATE_TMP_FILE_NAME) == 0 ||
+		   strcmp(name, WHERE_FILTER_FILE_NAME) == 0 ||
+		   strcmp(name, WHERE_FILTER_TMP_FILE_NAME) == 0;
+}
+
+/**
+ * Open the manifest of the directory
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param manifest is the target manifest (must be freed by manifest_free())
+ * @return 0 on success, -ENOENT if there is no manifest, other negative value on error
+ */
+int manifest_open(int dir_fd, struct manifest *manifest)
+{
+	memset(manifest, 0, sizeof(struct manifest));
+
+	int fd = openat(dir_fd, MANIFEST_FILE_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &manifest->stbuf) == -1)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	if (!S_ISREG(manifest->stbuf.st_mode) ||
+		manifest->stbuf.st_size <= (off_t)MANIFEST_HEADER_LENGTH)
+	{
+		(void)close(fd);
+		return -EINVAL;
+	}
+
+	manifest->map_size = (size_t)manifest->stbuf.st_size;
+	manifest->map = mmap(NULL, manifest->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (manifest->map == MAP_FAILED)
+	{
+		manifest->map = NULL;
+		return -errno;
+	}
+
+	const uint8_t *data = (const uint8_t *)manifest->map;
+	int res = -EINVAL;
+	if (memcmp(data, MANIFEST_HEADER, MANIFEST_HEADER_LENGTH) == 0)
+	{
+		res = compact_dir_from_buffer(data + MANIFEST_HEADER_LENGTH, manifest->map_size - MANIFEST_HEADER_LENGTH,
+									  false, &manifest->dir);
+	}
+
+	if (res != 0)
+		manifest_free(manifest);
+
+	return res;
+}
+
+/**
+ * Free the opened manifest
+ *
+ * @param manifest is the manifest
+ */
+void manifest_free(struct manifest *manifest)
+{
+	compact_dir_free(manifest->dir);
+	manifest->dir = NULL;
+
+	if (manifest->map != NULL)
+	{
+		(void)munmap(manifest->map, manifest->map_size);
+		manifest->map = NULL;
+	}
+	manifest->map_size = 0;
+}
+
+/**
+ * Find a regular file in the manifest
+ *
+ * @param manifest is the manifest
+ * @param name is the name of the file
+ * @param my_stat is the target metadata of the file
+ * @return 0 if found, -ENOENT if not found, other negative value on error
+ */
+int manifest_find(const struct manifest *manifest, const char *name, struct filestat *my_stat)
+{
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest->dir);
+
+	struct compact_dir_entry entry;
+	int res = compact_dir_find(manifest->dir, name, &cursor, &entry);
+	if (res == 0)
+	{
+		if (S_ISREG(entry.my_stat.mode))
+			*my_stat = entry.my_stat;
+		else
+			res = -ENOENT;
+	}
+
+	compact_dir_cursor_free(&cursor);
+	return res;
+}
+
+/**
+ * Make an inode number for an entry of the manifest (FNV-1a of the name
+ * mixed with the inode number of the manifest file)
+ *
+ * @param manifest is the manifest
+ * @param name is the name of the entry
+ * @return inode number
+ */
+static uint64_t manifest_entry_ino(const struct manifest *manifest, const char *name)
+{
+	uint64_t hash = UINT64_C(14695981039346656037);
+	for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+	{
+		hash ^= *p;
+		hash *= UINT64_C(1099511628211);
+	}
+
+	hash ^= (uint64_t)manifest->stbuf.st_ino * UINT64_C(0x9E3779B97F4A7C15);
+	return hash | MANIFEST_INO_FLAG;
+}
+
+/**
+ * Make a skeleton of real stat for an entry of the manifest (like fstatat() of
+ * a filestat file gives for usual entries): the type and nlink of a regular file,
+ * an inode number made of the name and other fields of the manifest file.
+ *
+ * @param manifest is the manifest
+ * @param name is the name of the entry
+ * @param stbuf is the target stat
+ */
+void manifest_fill_stat(const struct manifest *manifest, const char *name, struct stat *stbuf)
+{
+	*stbuf = manifest->stbuf;
+	stbuf->st_ino = (ino_t)manifest_entry_ino(manifest, name);
+	stbuf->st_mode = S_IFREG | (manifest->stbuf.st_mode & 07777);
+	stbuf->st_nlink = 1;
+	stbuf->st_size = 0;
+	stbuf->st_blocks = 0;
+}
+
+/**
+ * Entries of a manifest decoded for rewriting
+ */
+struct manifest_inputs
+{
+	/** Array of entries (names and link targets are owned) */
+	struct compact_dir_input *inputs;
+
+	/** Number of entries */
+	size_t count;
+};
+
+/**
+ * Free decoded entries
+ *
+ * @param list is the list of entries
+ */
+static void manifest_inputs_free(struct manifest_inputs *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+	{
+		free((char *)list->inputs[i].name);
+		free((char *)list->inputs[i].link_target);
+	}
+	free(list->inputs);
+	list->inputs = NULL;
+	list->count = 0;
+}
+
+/**
+ * Decode all entries of the manifest
+ *
+ * @param manifest is the manifest (can be NULL for an empty list)
+ * @param list is the target list (must be freed by manifest_inputs_free())
+ * @return 0 on success, negative value on error
+ */
+static int manifest_decode_all(const struct manifest *manifest, struct manifest_inputs *list)
+{
+	size_t count = (manifest != NULL) ? compact_dir_count(manifest->dir) : 0;
+
+	list->count = 0;
+	list->inputs = (struct compact_dir_input *)calloc(count + 1, sizeof(struct compact_dir_input));
+	if (list->inputs == NULL)
+		return -ENOMEM;
+
+	if (count == 0)
+		return 0;
+
+	struct compact_dir_cursor cursor;
+	compact_dir_cursor_init(&cursor, manifest->dir);
+
+	int res;
+	struct compact_dir_entry entry;
+	while ((res = compact_dir_cursor_next(&cursor, &entry)) == 0)
+	{
+		struct compact_dir_input *input = &list->inputs[list->count];
+
+		input->name = strndup(entry.name, entry.name_len);
+		input->my_stat = entry.my_stat;
+		input->link_target = (entry.link_target != NULL) ? strndup(entry.link_target, entry.link_target_len) : NULL;
+		if (input->name == NULL || (entry.link_target != NULL && input->link_target == NULL))
+		{
+			free((char *)input->name);
+			free((char *)input->link_target);
+			res = -ENOMEM;
+			break;
+		}
+		list->count++;
+	}
+
+	compact_dir_cursor_free(&cursor);
+	return (res > 0) ? 0 : res;
+}
+
+/**
+ * Compare pointers to changes by name and then by position for qsort()
+ * (so the last change of a name is the last one of its run)
+ *
+ * @param a is the first pointer
+ * @param b is the second pointer
+ * @return negative, zero or positive value like strcmp()
+ */
+static int manifest_change_compare(const void *a, const void *b)
+{
+	const struct manifest_change *change_a = *(const struct manifest_change *const *)a;
+	const struct manifest_change *change_b = *(const struct manifest_change *const *)b;
+
+	int cmp = strcmp(change_a->name, change_b->name);
+	if (cmp != 0)
+		return cmp;
+
+	return (change_a < change_b) ? -1 : ((change_a > change_b) ? 1 : 0);
+}
+
+/**
+ * Write the whole buffer to the file
+ *
+ * @param fd is the file descriptor
+ * @param data is the buffer
+ * @param size is the size of the buffer
+ * @return 0 on success, negative value on error
+ */
+static int write_all(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0)
+	{
+		ssize_t res = write(fd, p, size);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += res;
+		size -= (size_t)res;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the manifest file through a temporary file and rename() over the old one
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir is the content of the manifest
+ * @return 0 on success, negative value on error
+ */
+static int manifest_write(int dir_fd, const struct compact_dir *dir)
+{
+	size_t size;
+	const void *data = compact_dir_data(dir, &size);
+
+	int fd = openat(dir_fd, MANIFEST_TMP_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	int res = write_all(fd, MANIFEST_HEADER, MANIFEST_HEADER_LENGTH);
+	if (res == 0)
+		res = write_all(fd, data, size);
+
+	// Filestat files of moved entries are removed after that, the manifest must be on disk first
+	if (res == 0 && fdatasync(fd) == -1)
+		res = -errno;
+
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+
+	if (res == 0 && renameat(dir_fd, MANIFEST_TMP_FILE_NAME, dir_fd, MANIFEST_FILE_NAME) == -1)
+		res = -errno;
+
+	if (res != 0)
+		(void)unlinkat(dir_fd, MANIFEST_TMP_FILE_NAME, 0);
+
+	return res;
+}
+
+/**
+ * Change entries of the manifest of the directory and replace the manifest file
+ * atomically (the manifest is created if needed and removed when it becomes empty)
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param changes is the array of changes (sorted by the function, last change of a name wins)
+ * @param count is the number of changes
+ * @return 0 on success, negative value on error
+ */
+int manifest_apply(int dir_fd, struct manifest_change *changes, size_t count)
+{
+	if (count == 0)
+		return 0;
+
+	struct manifest old_manifest;
+	int res = manifest_open(dir_fd, &old_manifest);
+	if (res != 0 && res != -ENOENT)
+		return res;
+
+	bool has_old = (res == 0);
+
+	struct manifest_inputs old_list;
+	res = manifest_decode_all(has_old ? &old_manifest : NULL, &old_list);
+	if (has_old)
+		manifest_free(&old_manifest);
+	if (res != 0)
+	{
+		manifest_inputs_free(&old_list);
+		return res;
+	}
+
+	const struct manifest_change **sorted = (const struct manifest_change **)malloc(count * sizeof(struct manifest_change *));
+	struct compact_dir_input *merged = (struct compact_dir_input *)calloc(old_list.count + count + 1, sizeof(struct compact_dir_input));
+	if (sorted == NULL || merged == NULL)
+	{
+		free(sorted);
+		free(merged);
+		manifest_inputs_free(&old_list);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		sorted[i] = &changes[i];
+	}
+	qsort(sorted, count, sizeof(struct manifest_change *), manifest_change_compare);
+
+	// Both lists are sorted by name, entries are only borrowed by the merged list
+	size_t merged_count = 0;
+	size_t i = 0;
+	size_t j = 0;
+	while (i < old_list.count || j < count)
+	{
+		int cmp;
+		if (i >= old_list.count)
+			cmp = 1;
+		else if (j >= count)
+			cmp = -1;
+		else
+			cmp = strcmp(old_list.inputs[i].name, sorted[j]->name);
+
+		if (cmp < 0)
+		{
+			merged[merged_count++] = old_list.inputs[i++];
+			continue;
+		}
+
+		// Only the last change of the name matters
+		while (j + 1 < count && strcmp(sorted[j]->name, sorted[j + 1]->name) == 0)
+		{
+			j++;
+		}
+
+		if (sorted[j]->my_stat != NULL)
+		{
+			struct compact_dir_input *input = &merged[merged_count++];
+			input->name = sorted[j]->name;
+			input->my_stat = *sorted[j]->my_stat;
+			input->link_target = NULL;
+		}
+
+		if (cmp == 0)
+			i++;
+		j++;
+	}
+
+	if (merged_count == 0)
+	{
+		res = (unlinkat(dir_fd, MANIFEST_FILE_NAME, 0) == -1 && errno != ENOENT) ? -errno : 0;
+	}
+	else
+	{
+		struct compact_dir *dir;
+		res = compact_dir_build(merged, merged_count, &dir);
+		if (res == 0)
+		{
+			res = manifest_write(dir_fd, dir);
+			compact_dir_free(dir);
+		}
+	}
+
+	free(merged);
+	free(sorted);
+	manifest_inputs_free(&old_list);
+	return res;
+}
+
+/**
+ * Remove the manifest of the directory if it has no entries
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @return 0 if there is no manifest now, -ENOTEMPTY if it has entries, other negative value on error
+ */
+int manifest_remove_if_empty(int dir_fd)
+{
+	struct manifest manifest;
+	int res = manifest_open(dir_fd, &manifest);
+	if (res == -ENOENT)
+		return 0;
+	if (res != 0)
+		return res;
+
+	size_t count = compact_dir_count(manifest.dir);
+	manifest_free(&manifest);
+	if (count != 0)
+		return -ENOTEMPTY;
+
+	if (unlinkat(dir_fd, MANIFEST_FILE_NAME, 0) == -1 && errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Close the manifest and free the cache entry
+ *
+ * @param value is the entry
+ */
+static void manifest_cache_free_entry(void *value)
+{
+	struct manifest_cache_entry *entry = (struct manifest_cache_entry *)value;
+	manifest_free(&entry->manifest);
+	free(entry);
+}
+
+/**
+ * Close the least recently used manifest
+ *
+ * @param cache is the cache
+ */
+static void manifest_cache_evict(struct manifest_cache *cache)
+{
+	struct path_hash_node *oldest = NULL;
+	uint64_t oldest_used = UINT64_MAX;
+
+	for (size_t b = 0; b < cache->dirs.buckets_count; b++)
+	{
+		for (struct path_hash_node *node = cache->dirs.buckets[b]; node != NULL; node = node->next)
+		{
+			const struct manifest_cache_entry *entry = (const struct manifest_cache_entry *)node->value;
+			if (entry->last_used < oldest_used)
+			{
+				oldest = node;
+				oldest_used = entry->last_used;
+			}
+		}
+	}
+
+	if (oldest != NULL)
+		manifest_cache_free_entry(path_hash_remove(&cache->dirs, oldest->key, oldest->key_len));
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_dirs is the maximum number of cached manifests (at least one is kept)
+ */
+void manifest_cache_init(struct manifest_cache *cache, size_t max_dirs)
+{
+	memset(cache, 0, sizeof(struct manifest_cache));
+	path_hash_init(&cache->dirs);
+	cache->max_dirs = (max_dirs == 0) ? 1 : max_dirs;
+}
+
+/**
+ * Check that the cached manifest was read from the same file
+ *
+ * @param manifest is the cached manifest
+ * @param stbuf is the current stat of the manifest file
+ * @return true if the file was not replaced or changed
+ */
+static bool manifest_is_current(const struct manifest *manifest, const struct stat *stbuf)
+{
+	const struct stat *old = &manifest->stbuf;
+	return old->st_dev == stbuf->st_dev &&
+		   old->st_ino == stbuf->st_ino &&
+		   old->st_size == stbuf->st_size &&
+		   old->st_mtim.tv_sec == stbuf->st_mtim.tv_sec &&
+		   old->st_mtim.tv_nsec == stbuf->st_mtim.tv_nsec &&
+		   old->st_ctim.tv_sec == stbuf->st_ctim.tv_sec &&
+		   old->st_ctim.tv_nsec == stbuf->st_ctim.tv_nsec;
+}
+
+/**
+ * Get the manifest of the directory, the manifest file is checked by fstatat()
+ * on every call and is opened again if it was replaced
+ *
+ * @param cache is the cache
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir_relpath is the relative path of the directory (the key, does not need to be null-terminated)
+ * @param dir_relpath_len is the length of the relative path
+ * @param manifest is the found manifest (owned by the cache, valid until the next call)
+ * @return 0 on success, -ENOENT if there is no manifest, other negative value on error
+ */
+int manifest_cache_get(struct manifest_cache *cache, int dir_fd, const char *dir_relpath, size_t dir_relpath_len,
+					   const struct manifest **manifest)
+{
+	*manifest = NULL;
+
+	struct manifest_cache_entry *entry = (struct manifest_cache_entry *)path_hash_get(&cache->dirs, dir_relpath, dir_relpath_len);
+
+	struct stat stbuf;
+	if (fstatat(dir_fd, MANIFEST_FILE_NAME, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+	{
+		int res = -errno;
+		if (entry != NULL)
+			manifest_cache_free_entry(path_hash_remove(&cache->dirs, dir_relpath, dir_relpath_len));
+		return res;
+	}
+
+	if (entry != NULL && manifest_is_current(&entry->manifest, &stbuf))
+	{
+		cache->hits++;
+		entry->last_used = ++cache->clock;
+		*manifest = &entry->manifest;
+		return 0;
+	}
+
+	cache->misses++;
+	if (entry != NULL)
+	{
+		manifest_cache_free_entry(path_hash_remove(&cache->dirs, dir_relpath, dir_relpath_len));
+	}
+	else if (cache->dirs.count >= cache->max_dirs)
+	{
+		manifest_cache_evict(cache);
+	}
+
+	entry = (struct manifest_cache_entry *)calloc(1, sizeof(struct manifest_cache_entry));
+	if (entry == NULL)
+		return -ENOMEM;
+
+	int res = manifest_open(dir_fd, &entry->manifest);
+	if (res == 0)
+		res = path_hash_put(&cache->dirs, dir_relpath, dir_relpath_len, entry, NULL);
+	if (res != 0)
+	{
+		manifest_cache_free_entry(entry);
+		return res;
+	}
+
+	entry->last_used = ++cache->clock;
+	*manifest = &entry->manifest;
+	return 0;
+}
+
+/**
+ * Close all manifests of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void manifest_cache_free(struct manifest_cache *cache)
+{
+	path_hash_clear(&cache->dirs, manifest_cache_free_entry);
+}
+
+/**
+ * Initialize a writer without pending files
+ *
+ * @param writer is the writer
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param metadata_cache is the cache of parsed filestat files (can be NULL)
+ */
+void manifest_writer_init(struct manifest_writer *writer, int root_fd, struct metadata_cache *metadata_cache)
+{
+	memset(writer, 0, sizeof(struct manifest_writer));
+	writer->root_fd = root_fd;
+	writer->metadata_cache = metadata_cache;
+}
+
+/**
+ * Drop all pending files
+ *
+ * @param writer is the writer
+ */
+static void manifest_writer_clear(struct manifest_writer *writer)
+{
+	for (size_t i = 0; i < writer->count; i++)
+	{
+		free(writer->names[i]);
+	}
+	writer->count = 0;
+
+	free(writer->dir_relpath);
+	writer->dir_relpath = NULL;
+}
+
+/**
+ * Queue a released file to be moved into the manifest of its directory.
+ * Files of the previous directory are moved first if the directory differs.
+ *
+ * @param writer is the writer
+ * @param relpath is the relative path of the released filestat file
+ * @return 0 on success, negative value if moving of earlier files failed
+ */
+int manifest_writer_add(struct manifest_writer *writer, const char *relpath)
+{
+	const char *slash = strrchr(relpath, '/');
+	const char *name = (slash != NULL) ? slash + 1 : relpath;
+	const char *dir = (slash != NULL) ? relpath : ".";
+	size_t dir_len = (slash != NULL) ? (size_t)(slash - relpath) : 1;
+
+	int res = 0;
+	if (writer->dir_relpath != NULL &&
+		(strlen(writer->dir_relpath) != dir_len || memcmp(writer->dir_relpath, dir, dir_len) != 0))
+	{
+		res = manifest_writer_flush(writer);
+	}
+
+	if (writer->dir_relpath == NULL)
+	{
+		writer->dir_relpath = strndup(dir, dir_len);
+		if (writer->dir_relpath == NULL)
+			return -ENOMEM;
+	}
+
+	if (writer->count == writer->capacity)
+	{
+		size_t new_capacity = (writer->capacity == 0) ? 64 : writer->capacity * 2;
+		char **new_names = (char **)realloc(writer->names, new_capacity * sizeof(char *));
+		if (new_names == NULL)
+			return -ENOMEM;
+
+		writer->names = new_names;
+		writer->capacity = new_capacity;
+	}
+
+	writer->names[writer->count] = strdup(name);
+	if (writer->names[writer->count] == NULL)
+		return -ENOMEM;
+	writer->count++;
+
+	if (writer->count >= MANIFEST_WRITER_MAX_PENDING)
+	{
+		int flush_res = manifest_writer_flush(writer);
+		if (res == 0)
+			res = flush_res;
+	}
+
+	return res;
+}
+
+/**
+ * Check if the pending file can be moved into the manifest
+ * (empty files are moved only if their record is in the xattr, see storage.h)
+ *
+ * @param stbuf is the real stat of the file
+ * @return true if the file can be moved
+ */
+static bool manifest_writer_is_movable(const struct stat *stbuf)
+{
+	return S_ISREG(stbuf->st_mode) && stbuf->st_nlink == 1;
+}
+
+/**
+ * Move all pending files into the manifest of their directory.
+ * Files that were removed, replaced or hard-linked meanwhile stay as they are.
+ *
+ * @param writer is the writer
+ * @return 0 on success, negative value on error (pending files are dropped anyway)
+ */
+int manifest_writer_flush(struct manifest_writer *writer)
+{
+	if (writer->dir_relpath == NULL || writer->count == 0)
+	{
+		manifest_writer_clear(writer);
+		return 0;
+	}
+
+	int dir_fd = openat(writer->root_fd, writer->dir_relpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1)
+	{
+		// Pending files of a removed directory are removed too
+		int res = (errno == ENOENT) ? 0 : -errno;
+		manifest_writer_clear(writer);
+		return res;
+	}
+
+	struct filestat *stats = (struct filestat *)malloc(writer->count * sizeof(struct filestat));
+	struct stat *stbufs = (struct stat *)malloc(writer->count * sizeof(struct stat));
+	struct manifest_change *changes = (struct manifest_change *)malloc(writer->count * sizeof(struct manifest_change));
+	if (stats == NULL || stbufs == NULL || changes == NULL)
+	{
+		free(stats);
+		free(stbufs);
+		free(changes);
+		(void)close(dir_fd);
+		manifest_writer_clear(writer);
+		return -ENOMEM;
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < writer->count; i++)
+	{
+		const char *name = writer->names[i];
+		if (fstatat(dir_fd, name, &stbufs[count], AT_SYMLINK_NOFOLLOW) == -1 ||
+			!manifest_writer_is_movable(&stbufs[count]))
+		{
+			continue;
+		}
+
+		if (fill_filestat_from_stat(&stats[count], &stbufs[count]) != 0 ||
+			storage_read_filestat(dir_fd, name, &stbufs[count], &stats[count]) != 0)
+		{
+			continue;
+		}
+
+		// Manifests keep only regular files whatever mode was saved
+		stats[count].mode = (stats[count].mode & ~(uint32_t)S_IFMT) | S_IFREG;
+
+		changes[count].name = name;
+		changes[count].my_stat = &stats[count];
+		count++;
+	}
+
+	int res = manifest_apply(dir_fd, changes, count);
+	if (res == 0 && count > 0)
+	{
+		writer->writes++;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			// A file that was changed after it was read stays and hides the manifest entry
+			struct stat stbuf;
+			if (fstatat(dir_fd, changes[i].name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1 ||
+				stbuf.st_ino != stbufs[i].st_ino ||
+				stbuf.st_size != stbufs[i].st_size ||
+				stbuf.st_mtim.tv_sec != stbufs[i].st_mtim.tv_sec ||
+				stbuf.st_mtim.tv_nsec != stbufs[i].st_mtim.tv_nsec ||
+				stbuf.st_ctim.tv_sec != stbufs[i].st_ctim.tv_sec ||
+				stbuf.st_ctim.tv_nsec != stbufs[i].st_ctim.tv_nsec ||
+				unlinkat(dir_fd, changes[i].name, 0) == -1)
+			{
+				continue;
+			}
+
+			writer->files_moved++;
+
+			if (writer->metadata_cache != NULL)
+			{
+				size_t dir_len = strlen(writer->dir_relpath);
+				size_t name_len = strlen(changes[i].name);
+				char *relpath = (char *)malloc(dir_len + 1 + name_len + 1);
+				if (relpath != NULL)
+				{
+					if (strcmp(writer->dir_relpath, ".") == 0)
+					{
+						memcpy(relpath, changes[i].name, name_len + 1);
+					}
+					else
+					{
+						memcpy(relpath, writer->dir_relpath, dir_len);
+						relpath[dir_len] = '/';
+						memcpy(relpath + dir_len + 1, changes[i].name, name_len + 1);
+					}
+					metadata_cache_remove(writer->metadata_cache, relpath);
+					free(relpath);
+				}
+			}
+		}
+	}
+
+	free(stats);
+	free(stbufs);
+	free(changes);
+	(void)close(dir_fd);
+	manifest_writer_clear(writer);
+	return res;
+}
+
+/**
+ * Move pending files and free memory of the writer
+ *
+ * @param writer is the writer
+ */
+void manifest_writer_free(struct manifest_writer *writer)
+{
+	(void)manifest_writer_flush(writer);
+
+	free(writer->names);
+	writer->names = NULL;
+	writer->capacity = 0;
+}
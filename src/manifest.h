@@ -0,0 +1,261 @@
+#ifndef INC_CATALOGFS_MANIFEST_H
+#define INC_CATALOGFS_MANIFEST_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "filestat.h"
+#include "path_hash.h"
+
+/**
+ * Per-directory manifest files (hybrid layout of a catalog).
+ *
+ * One filestat file per entry means that a directory of 100k photos costs
+ * 100k inodes and 100k opens to be listed with sizes. A directory can keep
+ * metadata of its regular files in one manifest file instead: a header line
+ * followed by a compact directory blob (see compact_dir.h), so the whole
+ * directory is read with one mmap() and a lookup is a binary search.
+ *
+ * Manifests coexist with usual entries: a real entry (filestat file,
+ * directory or symlink) always hides a manifest entry with the same name,
+ * directories and symlinks are never stored in manifests. Catalogs without
+ * manifests are read exactly as before.
+ *
+ * Manifests are created by the filesystem (see struct manifest_writer):
+ * released files are first written as usual filestat files and are moved
+ * into the manifest of their directory in batches, so a crash leaves either
+ * the filestat file or the manifest entry.
+ */
+
+/** Name of the manifest file inside a directory */
+#define MANIFEST_FILE_NAME ".catalogfs-manifest"
+
+/** Name of the temporary file used to replace the manifest atomically */
+#define MANIFEST_TMP_FILE_NAME ".catalogfs-manifest.tmp"
+
+/** Header of the manifest file (followed by the compact directory blob) */
+#define MANIFEST_HEADER "CatalogFS.Manifest.1\n"
+
+/** Default number of manifests kept by the cache */
+#define MANIFEST_CACHE_DEFAULT_SIZE (64)
+
+/** Maximum number of released files waiting to be moved into a manifest */
+#define MANIFEST_WRITER_MAX_PENDING (4096)
+
+// Forward declarations
+struct compact_dir;
+struct metadata_cache;
+
+/**
+ * Opened manifest of a directory
+ */
+struct manifest
+{
+	/** Mapped content of the manifest file */
+	void *map;
+
+	/** Size of the mapped content */
+	size_t map_size;
+
+	/** Entries of the manifest (borrow the mapped content) */
+	struct compact_dir *dir;
+
+	/** Real stat of the manifest file */
+	struct stat stbuf;
+};
+
+/**
+ * Change of one entry for manifest_apply()
+ */
+struct manifest_change
+{
+	/** Name of the entry */
+	const char *name;
+
+	/** New metadata of the entry (NULL removes the entry) */
+	const struct filestat *my_stat;
+};
+
+/**
+ * Cache of opened manifests by relative paths of directories
+ * (not thread-safe, callers must serialize access)
+ */
+struct manifest_cache
+{
+	/** Cached manifests: relative path of the directory -> struct manifest_cache_entry */
+	struct path_hash dirs;
+
+	/** Maximum number of cached manifests (0 disables the cache) */
+	size_t max_dirs;
+
+	/** Counter of uses for finding the least recently used manifest */
+	uint64_t clock;
+
+	/** Number of lookups answered by a cached manifest */
+	uint64_t hits;
+
+	/** Number of lookups that opened a manifest */
+	uint64_t misses;
+};
+
+/**
+ * Moves released files into manifests of their directories in batches
+ * (not thread-safe, callers must serialize access)
+ */
+struct manifest_writer
+{
+	/** Source directory file descriptor (not owned) */
+	int root_fd;
+
+	/** Cache of parsed filestat files to drop moved files from (can be NULL) */
+	struct metadata_cache *metadata_cache;
+
+	/** Relative path of the directory of pending files (NULL if nothing is pending) */
+	char *dir_relpath;
+
+	/** Names of pending files */
+	char **names;
+
+	/** Number of pending files */
+	size_t count;
+
+	/** Allocated size of names */
+	size_t capacity;
+
+	/** Number of written manifests */
+	uint64_t writes;
+
+	/** Number of files moved into manifests */
+	uint64_t files_moved;
+};
+
+/**
+ * Check if the name is reserved for manifest files, the indexing state or the where filter (such entries are hidden)
+ *
+ * @param name is the name of an entry
+ * @return true if the name is reserved
+ */
+bool manifest_is_reserved_name(const char *name);
+
+/**
+ * Open the manifest of the directory
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param manifest is the target manifest (must be freed by manifest_free())
+ * @return 0 on success, -ENOENT if there is no manifest, other negative value on error
+ */
+int manifest_open(int dir_fd, struct manifest *manifest);
+
+/**
+ * Free the opened manifest
+ *
+ * @param manifest is the manifest
+ */
+void manifest_free(struct manifest *manifest);
+
+/**
+ * Find a regular file in the manifest
+ *
+ * @param manifest is the manifest
+ * @param name is the name of the file
+ * @param my_stat is the target metadata of the file
+ * @return 0 if found, -ENOENT if not found, other negative value on error
+ */
+int manifest_find(const struct manifest *manifest, const char *name, struct filestat *my_stat);
+
+/**
+ * Make a skeleton of real stat for an entry of the manifest (like fstatat() of
+ * a filestat file gives for usual entries): the type and nlink of a regular file,
+ * an inode number made of the name and other fields of the manifest file.
+ *
+ * @param manifest is the manifest
+ * @param name is the name of the entry
+ * @param stbuf is the target stat
+ */
+void manifest_fill_stat(const struct manifest *manifest, const char *name, struct stat *stbuf);
+
+/**
+ * Change entries of the manifest of the directory and replace the manifest file
+ * atomically (the manifest is created if needed and removed when it becomes empty)
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param changes is the array of changes (sorted by the function, last change of a name wins)
+ * @param count is the number of changes
+ * @return 0 on success, negative value on error
+ */
+int manifest_apply(int dir_fd, struct manifest_change *changes, size_t count);
+
+/**
+ * Remove the manifest of the directory if it has no entries
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @return 0 if there is no manifest now, -ENOTEMPTY if it has entries, other negative value on error
+ */
+int manifest_remove_if_empty(int dir_fd);
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_dirs is the maximum number of cached manifests (0 disables the cache)
+ */
+void manifest_cache_init(struct manifest_cache *cache, size_t max_dirs);
+
+/**
+ * Get the manifest of the directory, the manifest file is checked by fstatat()
+ * on every call and is opened again if it was replaced
+ *
+ * @param cache is the cache
+ * @param dir_fd is the file descriptor of the directory
+ * @param dir_relpath is the relative path of the directory (the key, does not need to be null-terminated)
+ * @param dir_relpath_len is the length of the relative path
+ * @param manifest is the found manifest (owned by the cache, valid until the next call)
+ * @return 0 on success, -ENOENT if there is no manifest, other negative value on error
+ */
+int manifest_cache_get(struct manifest_cache *cache, int dir_fd, const char *dir_relpath, size_t dir_relpath_len,
+					   const struct manifest **manifest);
+
+/**
+ * Close all manifests of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void manifest_cache_free(struct manifest_cache *cache);
+
+/**
+ * Initialize a writer without pending files
+ *
+ * @param writer is the writer
+ * @param root_fd is the source directory file descriptor (not owned)
+ * @param metadata_cache is the cache of parsed filestat files (can be NULL)
+ */
+void manifest_writer_init(struct manifest_writer *writer, int root_fd, struct metadata_cache *metadata_cache);
+
+/**
+ * Queue a released file to be moved into the manifest of its directory.
+ * Files of the previous directory are moved first if the directory differs.
+ *
+ * @param writer is the writer
+ * @param relpath is the relative path of the released filestat file
+ * @return 0 on success, negative value if moving of earlier files failed
+ */
+int manifest_writer_add(struct manifest_writer *writer, const char *relpath);
+
+/**
+ * Move all pending files into the manifest of their directory.
+ * Files that were removed, replaced or hard-linked meanwhile stay as they are.
+ *
+ * @param writer is the writer
+ * @return 0 on success, negative value on error (pending files are dropped anyway)
+ */
+int manifest_writer_flush(struct manifest_writer *writer);
+
+/**
+ * Move pending files and free memory of the writer
+ *
+ * @param writer is the writer
+ */
+void manifest_writer_free(struct manifest_writer *writer);
+
+#endif // INC_CATALOGFS_MANIFEST_H
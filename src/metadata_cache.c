@@ -0,0 +1,537 @@
+#include "header_common.h"
+
+#include "metadata_cache.h"
+
+/**
+ * Get the approximate memory usage of one entry
+ *
+ * @param key_len is the length of the key of the entry
+ * @return memory usage in bytes
+ */
+static size_t entry_memory_usage(size_t key_len)
+{
+	// Entry, node with the key and about two bucket pointers per entry
+	return sizeof(struct cache_snapshot_record) + sizeof(struct path_hash_node) + key_len + 1 + 2 * sizeof(void *);
+}
+
+/**
+ * Check that the cached entry was read from the same version of the index file
+ *
+ * @param entry is the cached entry
+ * @param stbuf is the current real stat of the index file
+ * @return true if the entry is valid
+ */
+static bool entry_is_valid(const struct cache_snapshot_record *entry, const struct stat *stbuf)
+{
+	return entry->ino == stbuf->st_ino &&
+		   entry->size == stbuf->st_size &&
+		   entry->mtim.tv_sec == stbuf->st_mtim.tv_sec &&
+		   entry->mtim.tv_nsec == stbuf->st_mtim.tv_nsec &&
+		   entry->ctim.tv_sec == stbuf->st_ctim.tv_sec &&
+		   entry->ctim.tv_nsec == stbuf->st_ctim.tv_nsec;
+}
+
+/**
+ * Remember that records of the snapshot for the path are outdated (the lock must be held)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ * @param key_len is the length of the path
+ * @param value is METADATA_CACHE_REMOVED_PATH or METADATA_CACHE_REMOVED_TREE
+ */
+static void mark_removed(struct metadata_cache *cache, const char *relpath, size_t key_len, void *value)
+{
+	if (cache->snapshot == NULL)
+		return;
+
+	// A removed tree covers the path itself too
+	if (path_hash_get(&cache->removed, relpath, key_len) == METADATA_CACHE_REMOVED_TREE)
+		return;
+
+	// The set is best-effort, a forgotten path only keeps a record that never validates
+	(void)path_hash_put(&cache->removed, relpath, key_len, value, NULL);
+}
+
+/**
+ * Check if records of the snapshot for the path are outdated (the lock must be held)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path (does not need to be null-terminated)
+ * @param key_len is the length of the path
+ * @return true if the path or one of its parents was removed
+ */
+static bool is_removed(const struct metadata_cache *cache, const char *relpath, size_t key_len)
+{
+	if (cache->removed.count == 0)
+		return false;
+
+	if (path_hash_get(&cache->removed, relpath, key_len) != NULL)
+		return true;
+
+	for (size_t i = 0; i < key_len; i++)
+	{
+		if (relpath[i] == '/' && path_hash_get(&cache->removed, relpath, i) == METADATA_CACHE_REMOVED_TREE)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_memory is the maximum memory usage (in bytes, 0 disables the cache)
+ * @return 0 on success, nonzero value on error
+ */
+int metadata_cache_init(struct metadata_cache *cache, size_t max_memory)
+{
+	memset(cache, 0, sizeof(struct metadata_cache));
+	path_hash_init(&cache->entries);
+	path_hash_init(&cache->removed);
+	cache->max_memory = max_memory;
+
+	int res = pthread_mutex_init(&cache->lock, NULL);
+	if (res != 0)
+		return -res;
+
+	return 0;
+}
+
+/**
+ * Get the cached filestat of the index file
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the current real stat of the index file (used for validation)
+ * @param my_stat is the target filestat
+ * @return true if the filestat was found and is still valid
+ */
+bool metadata_cache_get(struct metadata_cache *cache, const char *relpath, const struct stat *stbuf,
+						struct filestat *my_stat)
+{
+	if (cache->max_memory == 0)
+		return false;
+
+	bool found = false;
+	size_t key_len = strlen(relpath);
+
+	pthread_mutex_lock(&cache->lock);
+
+	struct cache_snapshot_record *entry =
+		(struct cache_snapshot_record *)path_hash_get(&cache->entries, relpath, key_len);
+	if (entry != NULL)
+	{
+		if (entry_is_valid(entry, stbuf))
+		{
+			*my_stat = entry->my_stat;
+			found = true;
+		}
+		else
+		{
+			// The index file was changed, the entry will be replaced by the caller
+			(void)path_hash_remove(&cache->entries, relpath, key_len);
+			cache->memory_usage -= entry_memory_usage(key_len);
+			free(entry);
+		}
+	}
+
+	if (found)
+		cache->hits++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (found)
+		return true;
+
+	// The snapshot is never changed, its pages are read without the lock
+	bool snapshot_found = false;
+	bool snapshot_outdated = false;
+	if (cache->snapshot != NULL)
+	{
+		struct cache_snapshot_record record;
+		if (cache_snapshot_get(cache->snapshot, relpath, key_len, &record))
+		{
+			snapshot_found = entry_is_valid(&record, stbuf);
+			snapshot_outdated = !snapshot_found;
+			if (snapshot_found)
+				*my_stat = record.my_stat;
+		}
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (snapshot_found)
+	{
+		cache->hits++;
+		cache->snapshot_hits++;
+	}
+	else
+	{
+		cache->misses++;
+	}
+
+	if (snapshot_outdated)
+		mark_removed(cache, relpath, key_len, METADATA_CACHE_REMOVED_PATH);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return snapshot_found;
+}
+
+/**
+ * Put the filestat of the index file to the cache
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the real stat of the index file the filestat was read from
+ * @param my_stat is the filestat
+ * @return 0 on success, -ENOSPC if the cache is full, other nonzero value on error
+ */
+int metadata_cache_put(struct metadata_cache *cache, const char *relpath, const struct stat *stbuf,
+					   const struct filestat *my_stat)
+{
+	struct metadata_cache_item item;
+	item.relpath = relpath;
+	item.stbuf = stbuf;
+	item.my_stat = my_stat;
+
+	size_t put_count;
+	return metadata_cache_put_many(cache, &item, 1, &put_count);
+}
+
+/**
+ * Put filestats of many index files to the cache with one lock
+ * (e.g. all files of a directory, so threads filling the cache rarely wait for each other)
+ *
+ * @param cache is the cache
+ * @param items is the array of filestats
+ * @param count is the number of filestats
+ * @param put_count is the number of filestats put before the cache got full or an error
+ * @return 0 on success, -ENOSPC if the cache is full, other nonzero value on error
+ */
+int metadata_cache_put_many(struct metadata_cache *cache, const struct metadata_cache_item *items, size_t count,
+							size_t *put_count)
+{
+	*put_count = 0;
+	if (count == 0)
+		return 0;
+
+	// Entries are made before taking the lock, only the table is changed under it
+	struct cache_snapshot_record **entries =
+		(struct cache_snapshot_record **)calloc(count, sizeof(struct cache_snapshot_record *));
+	if (entries == NULL)
+		return -ENOMEM;
+
+	int res = 0;
+	for (size_t i = 0; i < count && res == 0; i++)
+	{
+		struct cache_snapshot_record *entry =
+			(struct cache_snapshot_record *)malloc(sizeof(struct cache_snapshot_record));
+		if (entry == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+
+		entry->ino = items[i].stbuf->st_ino;
+		entry->size = items[i].stbuf->st_size;
+		entry->mtim = items[i].stbuf->st_mtim;
+		entry->ctim = items[i].stbuf->st_ctim;
+		entry->my_stat = *items[i].my_stat;
+		entries[i] = entry;
+	}
+
+	size_t i = 0;
+	if (res == 0)
+	{
+		pthread_mutex_lock(&cache->lock);
+
+		for (; i < count; i++)
+		{
+			size_t key_len = strlen(items[i].relpath);
+			size_t usage = entry_memory_usage(key_len);
+
+			void *old_value = path_hash_get(&cache->entries, items[i].relpath, key_len);
+			if (old_value == NULL && cache->memory_usage + usage > cache->max_memory)
+			{
+				res = -ENOSPC;
+				break;
+			}
+
+			res = path_hash_put(&cache->entries, items[i].relpath, key_len, entries[i], &old_value);
+			if (res != 0)
+				break;
+
+			if (old_value != NULL)
+				free(old_value);
+			else
+				cache->memory_usage += usage;
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	*put_count = i;
+
+	// Entries that were not put
+	for (size_t j = i; j < count; j++)
+	{
+		free(entries[j]);
+	}
+	free(entries);
+
+	return res;
+}
+
+/**
+ * Argument of is_in_tree()
+ */
+struct tree_predicate_arg
+{
+	/** Relative path of the root of the tree */
+	const char *path;
+
+	/** Length of the path */
+	size_t path_len;
+
+	/** Memory usage of removed entries */
+	size_t memory_usage;
+};
+
+/**
+ * Predicate for path_hash_remove_if() that matches the path and paths below it
+ *
+ * @param key is the relative path of a cached entry
+ * @param key_len is the length of the key
+ * @param value is the cached entry
+ * @param arg is the tree_predicate_arg
+ * @return true if the cached entry is inside the tree
+ */
+static bool is_in_tree(const char *key, size_t key_len, void *value, void *arg)
+{
+	(void)value;
+
+	struct tree_predicate_arg *tree = (struct tree_predicate_arg *)arg;
+
+	if (key_len < tree->path_len ||
+		memcmp(key, tree->path, tree->path_len) != 0 ||
+		(key_len > tree->path_len && key[tree->path_len] != '/'))
+	{
+		return false;
+	}
+
+	tree->memory_usage += entry_memory_usage(key_len);
+	return true;
+}
+
+/**
+ * Remove the entry of the path
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void metadata_cache_remove(struct metadata_cache *cache, const char *relpath)
+{
+	size_t key_len = strlen(relpath);
+
+	pthread_mutex_lock(&cache->lock);
+
+	void *entry = path_hash_remove(&cache->entries, relpath, key_len);
+	if (entry != NULL)
+	{
+		cache->memory_usage -= entry_memory_usage(key_len);
+		free(entry);
+	}
+
+	mark_removed(cache, relpath, key_len, METADATA_CACHE_REMOVED_PATH);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Remove the entry of the path and entries of all paths below it
+ * (scans the whole cache, so it's meant for directories)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void metadata_cache_remove_tree(struct metadata_cache *cache, const char *relpath)
+{
+	pthread_mutex_lock(&cache->lock);
+
+	if (cache->entries.count > 0)
+	{
+		struct tree_predicate_arg tree;
+		tree.path = relpath;
+		tree.path_len = strlen(relpath);
+		tree.memory_usage = 0;
+
+		(void)path_hash_remove_if(&cache->entries, is_in_tree, &tree, free);
+		cache->memory_usage -= tree.memory_usage;
+	}
+
+	mark_removed(cache, relpath, strlen(relpath), METADATA_CACHE_REMOVED_TREE);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Map the snapshot saved by metadata_cache_save_snapshot() at the previous unmount
+ *
+ * @param cache is the cache (without a snapshot)
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value of cache_snapshot_open() on error
+ */
+int metadata_cache_load_snapshot(struct metadata_cache *cache, const char *path, ino_t source_ino)
+{
+	struct cache_snapshot *snapshot;
+	int res = cache_snapshot_open(&snapshot, path, source_ino);
+	if (res != 0)
+		return res;
+
+	pthread_mutex_lock(&cache->lock);
+	cache_snapshot_close(cache->snapshot);
+	cache->snapshot = snapshot;
+	path_hash_clear(&cache->removed, NULL);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+/**
+ * Context of saving entries to a snapshot
+ */
+struct save_ctx
+{
+	/** Cache */
+	struct metadata_cache *cache;
+
+	/** Writer of the new snapshot */
+	struct cache_snapshot_writer *writer;
+};
+
+/**
+ * Add a cached entry to the new snapshot (a visitor of path_hash_for_each())
+ *
+ * @param key is the relative path of the entry
+ * @param key_len is the length of the path
+ * @param value is the entry
+ * @param arg is the save_ctx
+ * @return 0 on success, negative value on error
+ */
+static int save_entry(const char *key, size_t key_len, void *value, void *arg)
+{
+	struct save_ctx *ctx = (struct save_ctx *)arg;
+
+	int res = cache_snapshot_writer_add(ctx->writer, key, key_len, (const struct cache_snapshot_record *)value);
+	return (res == -ENAMETOOLONG) ? 0 : res;
+}
+
+/**
+ * Carry a record of the mapped snapshot to the new one, unless it's outdated or cached
+ * (a callback of cache_snapshot_for_each())
+ *
+ * @param arg is the save_ctx
+ * @param path is the relative path of the record
+ * @param path_len is the length of the path
+ * @param record is the record
+ * @return 0 on success, negative value on error
+ */
+static int save_record(void *arg, const char *path, size_t path_len, const struct cache_snapshot_record *record)
+{
+	struct save_ctx *ctx = (struct save_ctx *)arg;
+
+	if (path_hash_get(&ctx->cache->entries, path, path_len) != NULL ||
+		is_removed(ctx->cache, path, path_len))
+		return 0;
+
+	return cache_snapshot_writer_add(ctx->writer, path, path_len, record);
+}
+
+/**
+ * Save cached entries and still valid records of the mapped snapshot to a new snapshot
+ *
+ * @param cache is the cache
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int metadata_cache_save_snapshot(struct metadata_cache *cache, const char *path, ino_t source_ino)
+{
+	struct save_ctx ctx;
+	ctx.cache = cache;
+
+	int res = cache_snapshot_writer_open(&ctx.writer, path, source_ino);
+	if (res != 0)
+		return res;
+
+	pthread_mutex_lock(&cache->lock);
+
+	res = path_hash_for_each(&cache->entries, save_entry, &ctx);
+	if (res == 0 && cache->snapshot != NULL)
+	{
+		// The old snapshot is read sequentially once, its pages are not needed after that
+		res = cache_snapshot_for_each(cache->snapshot, save_record, &ctx);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (res != 0)
+	{
+		cache_snapshot_writer_abort(ctx.writer);
+		return res;
+	}
+
+	return cache_snapshot_writer_finish(ctx.writer);
+}
+
+/**
+ * Check if the cache has reached its maximum memory usage
+ *
+ * @param cache is the cache
+ * @return true if the cache is full
+ */
+bool metadata_cache_is_full(struct metadata_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	bool full = (cache->memory_usage + entry_memory_usage(0) > cache->max_memory);
+	pthread_mutex_unlock(&cache->lock);
+
+	return full;
+}
+
+/**
+ * Get counters of the cache
+ *
+ * @param cache is the cache
+ * @param stats is the target counters
+ */
+void metadata_cache_get_stats(struct metadata_cache *cache, struct metadata_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	stats->count = cache->entries.count;
+	stats->memory_usage = cache->memory_usage;
+	stats->max_memory = cache->max_memory;
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->snapshot_count = cache_snapshot_count(cache->snapshot);
+	stats->snapshot_hits = cache->snapshot_hits;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Free all memory of the cache and unmap the snapshot
+ *
+ * @param cache is the cache
+ */
+void metadata_cache_free(struct metadata_cache *cache)
+{
+	path_hash_clear(&cache->entries, free);
+	path_hash_clear(&cache->removed, NULL);
+	cache_snapshot_close(cache->snapshot);
+	cache->snapshot = NULL;
+	cache->memory_usage = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,226 @@
+#ifndef INC_CATALOGFS_METADATA_CACHE_H
+#define INC_CATALOGFS_METADATA_CACHE_H
+
+#include "header_common.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cache_snapshot.h"
+#include "filestat.h"
+#include "path_hash.h"
+
+/**
+ * Cache of parsed filestat files.
+ *
+ * Reading a filestat file means open(), read() and close() of a tiny file,
+ * that is a random seek on HDDs for every file of a catalog. The cache keeps
+ * parsed filestats by relative paths together with validators of the index
+ * file (inode, size, mtime and ctime), so a cached filestat is used only if
+ * the index file was not changed since it was read.
+ *
+ * The cache is thread-safe, it's filled both by FUSE callbacks and by
+ * the warm-up threads (see warmup.h).
+ *
+ * The cache can be saved to a snapshot file at unmount and the snapshot is
+ * mapped at the next mount (see cache_snapshot.h). Lookups that miss
+ * the memory fall back to records of the snapshot, which are validated
+ * the same way when they are used, so a remount needs no warm-up.
+ * Paths removed or changed since the snapshot was mapped are not carried
+ * into the next snapshot.
+ */
+
+/** Default maximum memory usage of the cache (in megabytes) */
+#define METADATA_CACHE_DEFAULT_SIZE_MB (256)
+
+/** Value of metadata_cache.removed for a removed path */
+#define METADATA_CACHE_REMOVED_PATH ((void *)1)
+
+/** Value of metadata_cache.removed for a removed path with all paths below it */
+#define METADATA_CACHE_REMOVED_TREE ((void *)2)
+
+/**
+ * Counters of the cache
+ */
+struct metadata_cache_stats
+{
+	/** Number of cached entries */
+	size_t count;
+
+	/** Approximate memory usage of the cache (in bytes) */
+	size_t memory_usage;
+
+	/** Maximum memory usage of the cache (in bytes) */
+	size_t max_memory;
+
+	/** Number of lookups answered from the cache */
+	uint64_t hits;
+
+	/** Number of lookups that were not answered from the cache */
+	uint64_t misses;
+
+	/** Number of records of the mapped snapshot */
+	size_t snapshot_count;
+
+	/** Number of lookups answered from the snapshot (included in hits) */
+	uint64_t snapshot_hits;
+};
+
+/**
+ * Filestat to put to the cache with metadata_cache_put_many()
+ */
+struct metadata_cache_item
+{
+	/** Relative path of the index file */
+	const char *relpath;
+
+	/** Real stat of the index file the filestat was read from */
+	const struct stat *stbuf;
+
+	/** Filestat */
+	const struct filestat *my_stat;
+};
+
+/**
+ * Cache of parsed filestat files
+ */
+struct metadata_cache
+{
+	/** Lock for all fields */
+	pthread_mutex_t lock;
+
+	/** Cached entries: relative path -> struct cache_snapshot_record */
+	struct path_hash entries;
+
+	/** Approximate memory usage of the cache (in bytes) */
+	size_t memory_usage;
+
+	/** Maximum memory usage of the cache (in bytes, 0 disables the cache) */
+	size_t max_memory;
+
+	/** Number of lookups answered from the cache */
+	uint64_t hits;
+
+	/** Number of lookups that were not answered from the cache */
+	uint64_t misses;
+
+	/** Mapped snapshot of the previous mount (NULL if not loaded) */
+	struct cache_snapshot *snapshot;
+
+	/**
+	 * Paths whose records of the snapshot are outdated:
+	 * relative path -> METADATA_CACHE_REMOVED_PATH or METADATA_CACHE_REMOVED_TREE
+	 */
+	struct path_hash removed;
+
+	/** Number of lookups answered from the snapshot */
+	uint64_t snapshot_hits;
+};
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_memory is the maximum memory usage (in bytes, 0 disables the cache)
+ * @return 0 on success, nonzero value on error
+ */
+int metadata_cache_init(struct metadata_cache *cache, size_t max_memory);
+
+/**
+ * Get the cached filestat of the index file
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the current real stat of the index file (used for validation)
+ * @param my_stat is the target filestat
+ * @return true if the filestat was found and is still valid
+ */
+bool metadata_cache_get(struct metadata_cache *cache, const char *relpath, const struct stat *stbuf,
+						struct filestat *my_stat);
+
+/**
+ * Put the filestat of the index file to the cache
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the real stat of the index file the filestat was read from
+ * @param my_stat is the filestat
+ * @return 0 on success, -ENOSPC if the cache is full, other nonzero value on error
+ */
+int metadata_cache_put(struct metadata_cache *cache, const char *relpath, const struct stat *stbuf,
+					   const struct filestat *my_stat);
+
+/**
+ * Put filestats of many index files to the cache with one lock
+ * (e.g. all files of a directory, so threads filling the cache rarely wait for each other)
+ *
+ * @param cache is the cache
+ * @param items is the array of filestats
+ * @param count is the number of filestats
+ * @param put_count is the number of filestats put before the cache got full or an error
+ * @return 0 on success, -ENOSPC if the cache is full, other nonzero value on error
+ */
+int metadata_cache_put_many(struct metadata_cache *cache, const struct metadata_cache_item *items, size_t count,
+							size_t *put_count);
+
+/**
+ * Remove the entry of the path
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void metadata_cache_remove(struct metadata_cache *cache, const char *relpath);
+
+/**
+ * Remove the entry of the path and entries of all paths below it
+ * (scans the whole cache, so it's meant for directories)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void metadata_cache_remove_tree(struct metadata_cache *cache, const char *relpath);
+
+/**
+ * Map the snapshot saved by metadata_cache_save_snapshot() at the previous unmount
+ *
+ * @param cache is the cache (without a snapshot)
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value of cache_snapshot_open() on error
+ */
+int metadata_cache_load_snapshot(struct metadata_cache *cache, const char *path, ino_t source_ino);
+
+/**
+ * Save cached entries and still valid records of the mapped snapshot to a new snapshot
+ *
+ * @param cache is the cache
+ * @param path is the path of the snapshot file
+ * @param source_ino is the inode of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int metadata_cache_save_snapshot(struct metadata_cache *cache, const char *path, ino_t source_ino);
+
+/**
+ * Check if the cache has reached its maximum memory usage
+ *
+ * @param cache is the cache
+ * @return true if the cache is full
+ */
+bool metadata_cache_is_full(struct metadata_cache *cache);
+
+/**
+ * Get counters of the cache
+ *
+ * @param cache is the cache
+ * @param stats is the target counters
+ */
+void metadata_cache_get_stats(struct metadata_cache *cache, struct metadata_cache_stats *stats);
+
+/**
+ * Free all memory of the cache and unmap the snapshot
+ *
+ * @param cache is the cache
+ */
+void metadata_cache_free(struct metadata_cache *cache);
+
+#endif // INC_CATALOGFS_METADATA_CACHE_H
@@ -0,0 +1,373 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "negative_cache.h"
+
+/**
+ * Cached directory with its missing names
+ */
+struct negative_cache_dir
+{
+	/** Relative path of the directory */
+	char *path;
+
+	/** Device of the directory */
+	dev_t dev;
+
+	/** Inode of the directory */
+	ino_t ino;
+
+	/** Modification time of the directory */
+	struct timespec mtim;
+
+	/** Status change time of the directory */
+	struct timespec ctim;
+
+	/** Time (monotonic) of the last check of validators */
+	struct timespec checked_at;
+
+	/** Missing names (values are not used) */
+	struct path_hash names;
+};
+
+/**
+ * Split the relative path into the parent directory and the name
+ *
+ * @param relpath is the relative path
+ * @param dir is the parent directory (not null-terminated, "." for top-level paths)
+ * @param dir_len is the length of the parent directory
+ * @param name is the name
+ * @return true on success, false if the path has no parent (the source directory itself)
+ */
+static bool split_relpath(const char *relpath, const char **dir, size_t *dir_len, const char **name)
+{
+	if (relpath[0] == '\0' || strcmp(relpath, ".") == 0)
+		return false;
+
+	const char *slash = strrchr(relpath, '/');
+	if (slash == NULL)
+	{
+		*dir = ".";
+		*dir_len = 1;
+		*name = relpath;
+	}
+	else
+	{
+		*dir = relpath;
+		*dir_len = (size_t)(slash - relpath);
+		*name = slash + 1;
+	}
+
+	return (*name)[0] != '\0';
+}
+
+/**
+ * Get milliseconds passed since the time (monotonic clock)
+ *
+ * @param since is the time
+ * @param now is the current time
+ * @return milliseconds passed
+ */
+static int64_t elapsed_ms(const struct timespec *since, const struct timespec *now)
+{
+	return (int64_t)(now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Read validators of the cached directory
+ *
+ * @param dir is the cached directory
+ * @param dir_fd is the source directory file descriptor
+ * @param st is the stat of the directory
+ * @return 0 on success, nonzero value on error
+ */
+static int stat_cached_dir(const struct negative_cache_dir *dir, int dir_fd, struct stat *st)
+{
+	if (fstatat(dir_fd, dir->path, st, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+
+	if (!S_ISDIR(st->st_mode))
+		return -ENOTDIR;
+
+	return 0;
+}
+
+/**
+ * Free a cached directory
+ *
+ * @param value is the cached directory
+ */
+static void free_cached_dir(void *value)
+{
+	struct negative_cache_dir *dir = (struct negative_cache_dir *)value;
+	if (dir == NULL)
+		return;
+
+	path_hash_clear(&dir->names, NULL);
+	free(dir->path);
+	free(dir);
+}
+
+/**
+ * Drop the cached directory by its path
+ *
+ * @param cache is the cache
+ * @param path is the relative path of the directory
+ * @param path_len is the length of the path
+ */
+static void drop_cached_dir(struct negative_cache *cache, const char *path, size_t path_len)
+{
+	struct negative_cache_dir *dir = (struct negative_cache_dir *)path_hash_remove(&cache->dirs, path, path_len);
+	if (dir == NULL)
+		return;
+
+	cache->names_count -= dir->names.count;
+	free_cached_dir(dir);
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_names is the maximum number of cached missing names (0 disables the cache)
+ */
+void negative_cache_init(struct negative_cache *cache, size_t max_names)
+{
+	memset(cache, 0, sizeof(struct negative_cache));
+	path_hash_init(&cache->dirs);
+	cache->max_names = max_names;
+}
+
+/**
+ * Check if the path is known to be missing
+ *
+ * @param cache is the cache
+ * @param dir_fd is the source directory file descriptor
+ * @param relpath is the relative path
+ * @return true if the path is known to be missing
+ */
+bool negative_cache_contains(struct negative_cache *cache, int dir_fd, const char *relpath)
+{
+	if (cache->names_count == 0)
+		return false;
+
+	const char *dir_path;
+	size_t dir_len;
+	const char *name;
+	if (!split_relpath(relpath, &dir_path, &dir_len, &name))
+		return false;
+
+	struct negative_cache_dir *dir = (struct negative_cache_dir *)path_hash_get(&cache->dirs, dir_path, dir_len);
+	if (dir == NULL)
+		return false;
+
+	if (path_hash_get(&dir->names, name, strlen(name)) == NULL)
+		return false;
+
+	// Changes of watched directories are invalidated by the caller
+	if (cache->watched)
+	{
+		cache->hits++;
+		return true;
+	}
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (elapsed_ms(&dir->checked_at, &now) >= NEGATIVE_CACHE_REVALIDATE_MS)
+	{
+		struct stat st;
+		if (stat_cached_dir(dir, dir_fd, &st) != 0 ||
+			st.st_dev != dir->dev ||
+			st.st_ino != dir->ino ||
+			st.st_mtim.tv_sec != dir->mtim.tv_sec ||
+			st.st_mtim.tv_nsec != dir->mtim.tv_nsec ||
+			st.st_ctim.tv_sec != dir->ctim.tv_sec ||
+			st.st_ctim.tv_nsec != dir->ctim.tv_nsec)
+		{
+			// The directory was changed outside, forget everything about it
+			drop_cached_dir(cache, dir_path, dir_len);
+			return false;
+		}
+
+		dir->checked_at = now;
+	}
+
+	cache->hits++;
+	return true;
+}
+
+/**
+ * Remember that the path is missing (failures are silently ignored)
+ *
+ * @param cache is the cache
+ * @param dir_fd is the source directory file descriptor
+ * @param relpath is the relative path
+ */
+void negative_cache_add(struct negative_cache *cache, int dir_fd, const char *relpath)
+{
+	if (cache->max_names == 0)
+		return;
+
+	const char *dir_path;
+	size_t dir_len;
+	const char *name;
+	if (!split_relpath(relpath, &dir_path, &dir_len, &name))
+		return;
+
+	// Simple eviction: start from scratch when the cache is full
+	if (cache->names_count >= cache->max_names)
+	{
+		path_hash_clear(&cache->dirs, free_cached_dir);
+		cache->names_count = 0;
+	}
+
+	struct negative_cache_dir *dir = (struct negative_cache_dir *)path_hash_get(&cache->dirs, dir_path, dir_len);
+	if (dir == NULL)
+	{
+		dir = (struct negative_cache_dir *)calloc(1, sizeof(struct negative_cache_dir));
+		if (dir == NULL)
+			return;
+
+		path_hash_init(&dir->names);
+		dir->path = strndup(dir_path, dir_len);
+		if (dir->path == NULL)
+		{
+			free_cached_dir(dir);
+			return;
+		}
+
+		struct stat st;
+		if (stat_cached_dir(dir, dir_fd, &st) != 0)
+		{
+			// Parent directory is missing too, nothing to validate the name with
+			free_cached_dir(dir);
+			return;
+		}
+
+		dir->dev = st.st_dev;
+		dir->ino = st.st_ino;
+		dir->mtim = st.st_mtim;
+		dir->ctim = st.st_ctim;
+		(void)clock_gettime(CLOCK_MONOTONIC, &dir->checked_at);
+
+		if (path_hash_put(&cache->dirs, dir_path, dir_len, dir, NULL) != 0)
+		{
+			free_cached_dir(dir);
+			return;
+		}
+	}
+
+	size_t name_len = strlen(name);
+	if (path_hash_get(&dir->names, name, name_len) != NULL)
+		return;
+
+	if (path_hash_put(&dir->names, name, name_len, dir, NULL) == 0)
+	{
+		cache->names_count++;
+	}
+}
+
+/**
+ * Forget missing names of the parent directory of the path
+ * (must be called after creating or removing the path)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void negative_cache_invalidate(struct negative_cache *cache, const char *relpath)
+{
+	if (cache->dirs.count == 0)
+		return;
+
+	const char *dir_path;
+	size_t dir_len;
+	const char *name;
+	if (!split_relpath(relpath, &dir_path, &dir_len, &name))
+		return;
+
+	drop_cached_dir(cache, dir_path, dir_len);
+}
+
+/**
+ * Argument of is_in_tree()
+ */
+struct tree_predicate_arg
+{
+	/** Relative path of the root of the tree */
+	const char *path;
+
+	/** Length of the path */
+	size_t path_len;
+
+	/** Number of names in removed directories */
+	size_t names_count;
+};
+
+/**
+ * Predicate for path_hash_remove_if() that matches the directory and its subdirectories
+ *
+ * @param key is the relative path of a cached directory
+ * @param key_len is the length of the key
+ * @param value is the cached directory
+ * @param arg is the tree_predicate_arg
+ * @return true if the cached directory is inside the tree
+ */
+static bool is_in_tree(const char *key, size_t key_len, void *value, void *arg)
+{
+	struct tree_predicate_arg *tree = (struct tree_predicate_arg *)arg;
+
+	if (key_len < tree->path_len ||
+		memcmp(key, tree->path, tree->path_len) != 0 ||
+		(key_len > tree->path_len && key[tree->path_len] != '/'))
+	{
+		return false;
+	}
+
+	tree->names_count += ((struct negative_cache_dir *)value)->names.count;
+	return true;
+}
+
+/**
+ * Forget missing names of the parent directory of the path, of the path itself
+ * and of all directories below it (must be called after renaming or removing a directory)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void negative_cache_invalidate_tree(struct negative_cache *cache, const char *relpath)
+{
+	if (cache->dirs.count == 0)
+		return;
+
+	if (relpath[0] == '\0' || strcmp(relpath, ".") == 0)
+	{
+		path_hash_clear(&cache->dirs, free_cached_dir);
+		cache->names_count = 0;
+		return;
+	}
+
+	negative_cache_invalidate(cache, relpath);
+
+	struct tree_predicate_arg tree;
+	tree.path = relpath;
+	tree.path_len = strlen(relpath);
+	tree.names_count = 0;
+
+	(void)path_hash_remove_if(&cache->dirs, is_in_tree, &tree, free_cached_dir);
+	cache->names_count -= tree.names_count;
+}
+
+/**
+ * Free all memory of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void negative_cache_free(struct negative_cache *cache)
+{
+	path_hash_clear(&cache->dirs, free_cached_dir);
+	cache->names_count = 0;
+}
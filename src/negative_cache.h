@@ -0,0 +1,105 @@
+#ifndef INC_CATALOGFS_NEGATIVE_CACHE_H
+#define INC_CATALOGFS_NEGATIVE_CACHE_H
+
+#include "header_common.h"
+
+#include "path_hash.h"
+
+/**
+ * Cache of paths that are known to be missing in the source directory.
+ *
+ * File managers probe every directory for files like `.directory`,
+ * `desktop.ini` or `.hidden`, so the same failed lookups are repeated
+ * over and over. Missing names are kept per parent directory together
+ * with validators of that directory (device, inode, mtime and ctime).
+ * Validators are rechecked at most once per NEGATIVE_CACHE_REVALIDATE_MS,
+ * so external changes of the source directory are noticed within that time,
+ * while changes made through the filesystem itself invalidate the cache
+ * right away (see negative_cache_invalidate() and negative_cache_invalidate_tree()).
+ * If external changes are reported by a watcher of the source (see source_watch.h),
+ * the cache is marked as watched and validators are not rechecked at all.
+ *
+ * Paths are relative paths inside the source directory (like RELPATH() in catalogfs.c).
+ * The cache is not thread-safe, callers must serialize access.
+ */
+
+/** Interval of revalidation of a cached directory by its mtime (in milliseconds) */
+#define NEGATIVE_CACHE_REVALIDATE_MS (1000)
+
+/** Default maximum number of cached missing names */
+#define NEGATIVE_CACHE_DEFAULT_SIZE (65536)
+
+/**
+ * Cache of missing paths
+ */
+struct negative_cache
+{
+	/** Cached directories: relative path -> struct negative_cache_dir */
+	struct path_hash dirs;
+
+	/** Number of cached missing names in all directories */
+	size_t names_count;
+
+	/** Maximum number of cached missing names (0 disables the cache) */
+	size_t max_names;
+
+	/** Number of lookups answered from the cache */
+	uint64_t hits;
+
+	/** External changes are invalidated by the caller, validators are not rechecked */
+	bool watched;
+};
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache is the cache
+ * @param max_names is the maximum number of cached missing names (0 disables the cache)
+ */
+void negative_cache_init(struct negative_cache *cache, size_t max_names);
+
+/**
+ * Check if the path is known to be missing
+ *
+ * @param cache is the cache
+ * @param dir_fd is the source directory file descriptor
+ * @param relpath is the relative path
+ * @return true if the path is known to be missing
+ */
+bool negative_cache_contains(struct negative_cache *cache, int dir_fd, const char *relpath);
+
+/**
+ * Remember that the path is missing (failures are silently ignored)
+ *
+ * @param cache is the cache
+ * @param dir_fd is the source directory file descriptor
+ * @param relpath is the relative path
+ */
+void negative_cache_add(struct negative_cache *cache, int dir_fd, const char *relpath);
+
+/**
+ * Forget missing names of the parent directory of the path
+ * (must be called after creating or removing the path)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void negative_cache_invalidate(struct negative_cache *cache, const char *relpath);
+
+/**
+ * Forget missing names of the parent directory of the path, of the path itself
+ * and of all directories below it (must be called after renaming or removing a directory)
+ *
+ * @param cache is the cache
+ * @param relpath is the relative path
+ */
+void negative_cache_invalidate_tree(struct negative_cache *cache, const char *relpath);
+
+/**
+ * Free all memory of the cache (the cache can be reused after that)
+ *
+ * @param cache is the cache
+ */
+void negative_cache_free(struct negative_cache *cache);
+
+#endif // INC_CATALOGFS_NEGATIVE_CACHE_H
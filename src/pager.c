@@ -0,0 +1,952 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h> /* flock(2) */
+#include <sys/stat.h>
+#include <time.h>
+
+#include "pager.h"
+
+#include "varint.h"
+
+/** Magic of page 0 of the main file */
+#define PAGER_MAGIC "CatalogFS.DB.1\0"
+
+/** Magic of the journal header */
+#define PAGER_WAL_MAGIC "CatalogFS.WAL.1"
+
+/** Length of magics (with the null terminator) */
+#define PAGER_MAGIC_LENGTH (16)
+
+/** Size of the journal header (magic, page size, salt) */
+#define PAGER_WAL_HEADER_SIZE (32)
+
+/** Size of the header of a journal frame (page number, commit mark, salt, checksum) */
+#define PAGER_FRAME_HEADER_SIZE (24)
+
+/** Size of a journal frame */
+#define PAGER_FRAME_SIZE (PAGER_FRAME_HEADER_SIZE + PAGER_PAGE_SIZE)
+
+/** Number of frames written to the journal with one write() */
+#define PAGER_FRAMES_PER_WRITE (64)
+
+/** Minimum number of clean pages kept by the cache */
+#define PAGER_MIN_CACHED_PAGES (64)
+
+/** Offset of the number of pages in page 0 */
+#define PAGER_PAGE_COUNT_OFFSET (20)
+
+/**
+ * Cached page
+ */
+struct pager_page
+{
+	/** Number of the page */
+	uint32_t page_no;
+
+	/** The page was changed since the last commit */
+	bool dirty;
+
+	/** Next page in the hash bucket */
+	struct pager_page *hash_next;
+
+	/** Previous page in the LRU list (clean pages) or in the dirty list */
+	struct pager_page *prev;
+
+	/** Next page in the LRU list (clean pages) or in the dirty list */
+	struct pager_page *next;
+
+	/** Content of the page */
+	uint8_t data[];
+};
+
+/**
+ * List of pages (LRU list of clean pages or list of dirty pages)
+ */
+struct pager_list
+{
+	/** First page (the most recently used one for the LRU list) */
+	struct pager_page *head;
+
+	/** Last page */
+	struct pager_page *tail;
+
+	/** Number of pages */
+	size_t count;
+};
+
+/**
+ * File of pages
+ */
+struct pager
+{
+	/** Descriptor of the main file */
+	int fd;
+
+	/** Descriptor of the journal */
+	int wal_fd;
+
+	/** Size of the journal (offset of the next frame) */
+	uint64_t wal_size;
+
+	/** Salt of frames of the current journal */
+	uint64_t wal_salt;
+
+	/** Checksum of the last frame of the journal */
+	uint64_t wal_checksum;
+
+	/** Sync the journal on every commit */
+	bool sync;
+
+	/** Number of pages in the file (including pages that are not committed) */
+	uint32_t page_count;
+
+	/** Number of pages in page 0 (committed) */
+	uint32_t committed_page_count;
+
+	/** Hash buckets of cached pages by page number */
+	struct pager_page **buckets;
+
+	/** Number of buckets (power of 2) */
+	size_t buckets_count;
+
+	/** Clean pages in LRU order */
+	struct pager_list clean;
+
+	/** Dirty pages */
+	struct pager_list dirty;
+
+	/** Maximum number of clean cached pages */
+	size_t max_clean_pages;
+
+	/** Counters */
+	struct pager_stats stats;
+};
+
+/**
+ * Calculate the chained checksum of a journal frame
+ * (64-bit words are mixed in order, so reordered or torn frames do not match)
+ *
+ * @param seed is the checksum of the previous frame (or the salt for the first one)
+ * @param header is the frame header (the first 16 bytes are used)
+ * @param data is the content of the page
+ * @return the checksum
+ */
+static uint64_t frame_checksum(uint64_t seed, const uint8_t *header, const uint8_t *data)
+{
+	uint64_t s0 = seed ^ 0x9e3779b97f4a7c15ULL;
+	uint64_t s1 = seed;
+
+	s0 += read_le64(header) + s1;
+	s1 += read_le64(header + 8) + s0;
+
+	for (size_t i = 0; i < PAGER_PAGE_SIZE; i += 16)
+	{
+		s0 += read_le64(data + i) + s1;
+		s1 += read_le64(data + i + 8) + s0;
+		s0 = (s0 << 13) | (s0 >> 51);
+	}
+
+	return s0 ^ (s1 * 0xff51afd7ed558ccdULL);
+}
+
+/**
+ * Read the whole buffer at the offset (retrying partial reads)
+ *
+ * @param fd is the file descriptor
+ * @param buf is the target buffer
+ * @param size is the size to read
+ * @param offset is the offset in the file
+ * @return 0 on success, -EIO on end of file, other negative value (-errno) on error
+ */
+static int read_full(int fd, void *buf, size_t size, off_t offset)
+{
+	uint8_t *pos = (uint8_t *)buf;
+	while (size > 0)
+	{
+		ssize_t res = pread(fd, pos, size, offset);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (res == 0)
+			return -EIO;
+
+		pos += res;
+		size -= (size_t)res;
+		offset += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the whole buffer at the offset (retrying partial writes)
+ *
+ * @param fd is the file descriptor
+ * @param buf is the source buffer
+ * @param size is the size to write
+ * @param offset is the offset in the file
+ * @return 0 on success, negative value (-errno) on error
+ */
+static int write_full(int fd, const void *buf, size_t size, off_t offset)
+{
+	const uint8_t *pos = (const uint8_t *)buf;
+	while (size > 0)
+	{
+		ssize_t res = pwrite(fd, pos, size, offset);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		pos += res;
+		size -= (size_t)res;
+		offset += res;
+	}
+
+	return 0;
+}
+
+/**
+ * Remove the page from the list
+ *
+ * @param list is the list
+ * @param page is the page
+ */
+static void list_remove(struct pager_list *list, struct pager_page *page)
+{
+	if (page->prev != NULL)
+		page->prev->next = page->next;
+	else
+		list->head = page->next;
+
+	if (page->next != NULL)
+		page->next->prev = page->prev;
+	else
+		list->tail = page->prev;
+
+	page->prev = NULL;
+	page->next = NULL;
+	list->count--;
+}
+
+/**
+ * Add the page to the head of the list
+ *
+ * @param list is the list
+ * @param page is the page
+ */
+static void list_push_head(struct pager_list *list, struct pager_page *page)
+{
+	page->prev = NULL;
+	page->next = list->head;
+	if (list->head != NULL)
+		list->head->prev = page;
+	else
+		list->tail = page;
+
+	list->head = page;
+	list->count++;
+}
+
+/**
+ * Find the cached page
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @return the page, NULL if it's not cached
+ */
+static struct pager_page *find_page(const struct pager *pager, uint32_t page_no)
+{
+	struct pager_page *page = pager->buckets[page_no & (pager->buckets_count - 1)];
+	while (page != NULL && page->page_no != page_no)
+		page = page->hash_next;
+
+	return page;
+}
+
+/**
+ * Double the number of hash buckets
+ *
+ * @param pager is the pager
+ * @return 0 on success, -ENOMEM on error
+ */
+static int grow_buckets(struct pager *pager)
+{
+	size_t count = pager->buckets_count * 2;
+	struct pager_page **buckets = (struct pager_page **)calloc(count, sizeof(struct pager_page *));
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < pager->buckets_count; i++)
+	{
+		struct pager_page *page = pager->buckets[i];
+		while (page != NULL)
+		{
+			struct pager_page *next = page->hash_next;
+			size_t bucket = page->page_no & (count - 1);
+			page->hash_next = buckets[bucket];
+			buckets[bucket] = page;
+			page = next;
+		}
+	}
+
+	free(pager->buckets);
+	pager->buckets = buckets;
+	pager->buckets_count = count;
+	return 0;
+}
+
+/**
+ * Add a new page to the cache (as a clean one)
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @return the page (with uninitialized content), NULL on error
+ */
+static struct pager_page *add_page(struct pager *pager, uint32_t page_no)
+{
+	size_t count = pager->clean.count + pager->dirty.count;
+	if (count >= pager->buckets_count && grow_buckets(pager) != 0)
+		return NULL;
+
+	struct pager_page *page = (struct pager_page *)malloc(sizeof(struct pager_page) + PAGER_PAGE_SIZE);
+	if (page == NULL)
+		return NULL;
+
+	page->page_no = page_no;
+	page->dirty = false;
+
+	size_t bucket = page_no & (pager->buckets_count - 1);
+	page->hash_next = pager->buckets[bucket];
+	pager->buckets[bucket] = page;
+
+	list_push_head(&pager->clean, page);
+	return page;
+}
+
+/**
+ * Remove a clean page from the cache and free it
+ *
+ * @param pager is the pager
+ * @param page is the page
+ */
+static void evict_page(struct pager *pager, struct pager_page *page)
+{
+	struct pager_page **link = &pager->buckets[page->page_no & (pager->buckets_count - 1)];
+	while (*link != page)
+		link = &(*link)->hash_next;
+	*link = page->hash_next;
+
+	list_remove(&pager->clean, page);
+	free(page);
+}
+
+/**
+ * Make the cached page dirty
+ *
+ * @param pager is the pager
+ * @param page is the page
+ */
+static void mark_dirty(struct pager *pager, struct pager_page *page)
+{
+	if (page->dirty)
+		return;
+
+	list_remove(&pager->clean, page);
+	list_push_head(&pager->dirty, page);
+	page->dirty = true;
+}
+
+/**
+ * Get the page into the cache
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @param page is the cached page
+ * @return 0 on success, -EINVAL if there is no such page, other negative value on error
+ */
+static int load_page(struct pager *pager, uint32_t page_no, struct pager_page **page)
+{
+	if (page_no >= pager->page_count)
+		return -EINVAL;
+
+	struct pager_page *cached = find_page(pager, page_no);
+	if (cached != NULL)
+	{
+		if (!cached->dirty && cached != pager->clean.head)
+		{
+			list_remove(&pager->clean, cached);
+			list_push_head(&pager->clean, cached);
+		}
+
+		pager->stats.hits++;
+		*page = cached;
+		return 0;
+	}
+
+	cached = add_page(pager, page_no);
+	if (cached == NULL)
+		return -ENOMEM;
+
+	int res = read_full(pager->fd, cached->data, PAGER_PAGE_SIZE, (off_t)page_no * PAGER_PAGE_SIZE);
+	if (res != 0)
+	{
+		evict_page(pager, cached);
+		return res;
+	}
+
+	pager->stats.misses++;
+	*page = cached;
+	return 0;
+}
+
+/**
+ * Start the journal over with a new salt (all its frames are in the main file)
+ *
+ * @param pager is the pager
+ * @return 0 on success, negative value (-errno) on error
+ */
+static int reset_wal(struct pager *pager)
+{
+	uint8_t header[PAGER_WAL_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, PAGER_WAL_MAGIC, PAGER_MAGIC_LENGTH);
+	write_le32(header + 16, PAGER_PAGE_SIZE);
+
+	// A new salt makes frames of the old journal invalid even if truncation is lost
+	pager->wal_salt++;
+	write_le64(header + 24, pager->wal_salt);
+
+	if (ftruncate(pager->wal_fd, 0) == -1)
+		return -errno;
+
+	int res = write_full(pager->wal_fd, header, sizeof(header), 0);
+	if (res != 0)
+		return res;
+
+	if (pager->sync && fdatasync(pager->wal_fd) == -1)
+		return -errno;
+
+	pager->wal_size = PAGER_WAL_HEADER_SIZE;
+	pager->wal_checksum = pager->wal_salt;
+	return 0;
+}
+
+/**
+ * Copy pages of complete transactions from the journal to the main file
+ * (frames after the first invalid one are ignored, they were never committed)
+ *
+ * @param pager is the pager
+ * @return 0 on success, negative value on error
+ */
+static int recover_wal(struct pager *pager)
+{
+	struct stat stbuf;
+	if (fstat(pager->wal_fd, &stbuf) == -1)
+		return -errno;
+
+	uint8_t header[PAGER_WAL_HEADER_SIZE];
+	if (stbuf.st_size < PAGER_WAL_HEADER_SIZE ||
+		read_full(pager->wal_fd, header, sizeof(header), 0) != 0 ||
+		memcmp(header, PAGER_WAL_MAGIC, PAGER_MAGIC_LENGTH) != 0 ||
+		read_le32(header + 16) != PAGER_PAGE_SIZE)
+	{
+		pager->wal_salt = (uint64_t)time(NULL);
+		return reset_wal(pager);
+	}
+
+	pager->wal_salt = read_le64(header + 24);
+
+	uint8_t *frame = (uint8_t *)malloc(PAGER_FRAME_SIZE);
+	if (frame == NULL)
+		return -ENOMEM;
+
+	// Offsets of frames of the transaction that is not complete yet
+	uint64_t *pending = NULL;
+	size_t pending_count = 0;
+	size_t pending_size = 0;
+
+	uint64_t checksum = pager->wal_salt;
+	uint64_t offset = PAGER_WAL_HEADER_SIZE;
+	bool recovered = false;
+	int res = 0;
+
+	while (offset + PAGER_FRAME_SIZE <= (uint64_t)stbuf.st_size)
+	{
+		if (read_full(pager->wal_fd, frame, PAGER_FRAME_SIZE, (off_t)offset) != 0)
+			break;
+
+		if (read_le64(frame + 8) != pager->wal_salt)
+			break;
+
+		uint64_t frame_sum = frame_checksum(checksum, frame, frame + PAGER_FRAME_HEADER_SIZE);
+		if (frame_sum != read_le64(frame + 16))
+			break;
+
+		checksum = frame_sum;
+
+		if (pending_count == pending_size)
+		{
+			size_t size = (pending_size == 0) ? 64 : pending_size * 2;
+			uint64_t *grown = (uint64_t *)realloc(pending, size * sizeof(uint64_t));
+			if (grown == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			pending = grown;
+			pending_size = size;
+		}
+		pending[pending_count++] = offset;
+
+		uint32_t commit_page_count = read_le32(frame + 4);
+		if (commit_page_count != 0)
+		{
+			// The transaction is complete, its pages are copied in the order of frames
+			for (size_t i = 0; i < pending_count && res == 0; i++)
+			{
+				res = read_full(pager->wal_fd, frame, PAGER_FRAME_SIZE, (off_t)pending[i]);
+				if (res == 0)
+				{
+					uint32_t page_no = read_le32(frame);
+					res = write_full(pager->fd, frame + PAGER_FRAME_HEADER_SIZE, PAGER_PAGE_SIZE, (off_t)page_no * PAGER_PAGE_SIZE);
+				}
+			}
+
+			if (res != 0)
+				break;
+
+			pending_count = 0;
+			recovered = true;
+		}
+
+		offset += PAGER_FRAME_SIZE;
+	}
+
+	free(pending);
+	free(frame);
+
+	if (res != 0)
+		return res;
+
+	// The journal can be dropped only when its pages are in the main file for sure
+	if (recovered && fdatasync(pager->fd) == -1)
+		return -errno;
+
+	return reset_wal(pager);
+}
+
+/**
+ * Read page 0 of the main file or create it for an empty file
+ *
+ * @param pager is the pager
+ * @param created is set if the file was empty
+ * @return 0 on success, -EINVAL if it's not a file of pages, other negative value on error
+ */
+static int load_header(struct pager *pager, bool *created)
+{
+	struct stat stbuf;
+	if (fstat(pager->fd, &stbuf) == -1)
+		return -errno;
+
+	struct pager_page *page;
+	if (stbuf.st_size == 0)
+	{
+		pager->page_count = 1;
+		page = add_page(pager, 0);
+		if (page == NULL)
+			return -ENOMEM;
+
+		memset(page->data, 0, PAGER_PAGE_SIZE);
+		memcpy(page->data, PAGER_MAGIC, PAGER_MAGIC_LENGTH);
+		write_le32(page->data + 16, PAGER_PAGE_SIZE);
+		write_le32(page->data + PAGER_PAGE_COUNT_OFFSET, 1);
+		mark_dirty(pager, page);
+
+		*created = true;
+		return 0;
+	}
+
+	if (stbuf.st_size < PAGER_PAGE_SIZE)
+		return -EINVAL;
+
+	pager->page_count = 1;
+	int res = load_page(pager, 0, &page);
+	if (res != 0)
+		return res;
+
+	if (memcmp(page->data, PAGER_MAGIC, PAGER_MAGIC_LENGTH) != 0 ||
+		read_le32(page->data + 16) != PAGER_PAGE_SIZE)
+		return -EINVAL;
+
+	pager->page_count = read_le32(page->data + PAGER_PAGE_COUNT_OFFSET);
+	pager->committed_page_count = pager->page_count;
+	if (pager->page_count == 0 || (off_t)pager->page_count * PAGER_PAGE_SIZE > stbuf.st_size)
+		return -EINVAL;
+
+	*created = false;
+	return 0;
+}
+
+/**
+ * Open (or create) the file of pages, recover committed transactions from the journal
+ * and lock the file, so it can't be opened twice
+ *
+ * @param pager is the new pager
+ * @param path is the path of the main file
+ * @param cache_size is the maximum memory of clean cached pages (in bytes)
+ * @param sync is the flag to sync the journal on every commit
+ * @param created is set if the file was created (can be NULL)
+ * @return 0 on success, -EBUSY if the file is used by another process,
+ *         -EINVAL if it's not a file of pages, other negative value (mostly -errno) on error
+ */
+int pager_open(struct pager **pager, const char *path, size_t cache_size, bool sync, bool *created)
+{
+	struct pager *new_pager = (struct pager *)calloc(1, sizeof(struct pager));
+	if (new_pager == NULL)
+		return -ENOMEM;
+
+	new_pager->fd = -1;
+	new_pager->wal_fd = -1;
+	new_pager->sync = sync;
+	new_pager->max_clean_pages = cache_size / (sizeof(struct pager_page) + PAGER_PAGE_SIZE);
+	if (new_pager->max_clean_pages < PAGER_MIN_CACHED_PAGES)
+		new_pager->max_clean_pages = PAGER_MIN_CACHED_PAGES;
+
+	new_pager->buckets_count = 1024;
+	new_pager->buckets = (struct pager_page **)calloc(new_pager->buckets_count, sizeof(struct pager_page *));
+	if (new_pager->buckets == NULL)
+	{
+		pager_close(new_pager);
+		return -ENOMEM;
+	}
+
+	int res = 0;
+	char *wal_path = NULL;
+	if (asprintf(&wal_path, "%s-wal", path) == -1)
+	{
+		pager_close(new_pager);
+		return -ENOMEM;
+	}
+
+	new_pager->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (new_pager->fd == -1)
+		res = -errno;
+
+	// The lock is released by the kernel when the process dies
+	if (res == 0 && flock(new_pager->fd, LOCK_EX | LOCK_NB) == -1)
+		res = (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+
+	if (res == 0)
+	{
+		new_pager->wal_fd = open(wal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (new_pager->wal_fd == -1)
+			res = -errno;
+	}
+
+	free(wal_path);
+
+	if (res == 0)
+		res = recover_wal(new_pager);
+
+	bool is_created = false;
+	if (res == 0)
+		res = load_header(new_pager, &is_created);
+
+	if (res != 0)
+	{
+		pager_close(new_pager);
+		return res;
+	}
+
+	if (created != NULL)
+		*created = is_created;
+
+	*pager = new_pager;
+	return 0;
+}
+
+/**
+ * Close the file of pages (changes that were not committed are lost)
+ *
+ * @param pager is the pager (can be NULL)
+ */
+void pager_close(struct pager *pager)
+{
+	if (pager == NULL)
+		return;
+
+	struct pager_list *lists[2] = {&pager->clean, &pager->dirty};
+	for (size_t i = 0; i < 2; i++)
+	{
+		struct pager_page *page = lists[i]->head;
+		while (page != NULL)
+		{
+			struct pager_page *next = page->next;
+			free(page);
+			page = next;
+		}
+	}
+
+	free(pager->buckets);
+
+	if (pager->wal_fd != -1)
+		(void)close(pager->wal_fd);
+
+	// Closing the descriptor releases the lock
+	if (pager->fd != -1)
+		(void)close(pager->fd);
+
+	free(pager);
+}
+
+/**
+ * Get the page for reading
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, -EINVAL if there is no such page, other negative value on error
+ */
+int pager_get(struct pager *pager, uint32_t page_no, uint8_t **data)
+{
+	struct pager_page *page;
+	int res = load_page(pager, page_no, &page);
+	if (res != 0)
+		return res;
+
+	*data = page->data;
+	return 0;
+}
+
+/**
+ * Get the page for changing (the page becomes a part of the next commit)
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, -EINVAL if there is no such page, other negative value on error
+ */
+int pager_get_for_write(struct pager *pager, uint32_t page_no, uint8_t **data)
+{
+	struct pager_page *page;
+	int res = load_page(pager, page_no, &page);
+	if (res != 0)
+		return res;
+
+	mark_dirty(pager, page);
+	*data = page->data;
+	return 0;
+}
+
+/**
+ * Append a new zeroed page to the file (the page becomes a part of the next commit)
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the new page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, negative value on error
+ */
+int pager_allocate(struct pager *pager, uint32_t *page_no, uint8_t **data)
+{
+	if (pager->page_count == UINT32_MAX)
+		return -EFBIG;
+
+	struct pager_page *page = add_page(pager, pager->page_count);
+	if (page == NULL)
+		return -ENOMEM;
+
+	memset(page->data, 0, PAGER_PAGE_SIZE);
+	mark_dirty(pager, page);
+
+	*page_no = pager->page_count++;
+	*data = page->data;
+	return 0;
+}
+
+/**
+ * Get the number of dirty pages (to decide when to commit)
+ *
+ * @param pager is the pager
+ * @return number of dirty pages
+ */
+size_t pager_dirty_count(const struct pager *pager)
+{
+	return pager->dirty.count;
+}
+
+/**
+ * Compare pages by numbers for qsort()
+ *
+ * @param a is the pointer to the first page pointer
+ * @param b is the pointer to the second page pointer
+ * @return negative, zero or positive value as for qsort()
+ */
+static int compare_pages(const void *a, const void *b)
+{
+	uint32_t no_a = (*(struct pager_page *const *)a)->page_no;
+	uint32_t no_b = (*(struct pager_page *const *)b)->page_no;
+	return (no_a > no_b) - (no_a < no_b);
+}
+
+/**
+ * Append frames of the pages to the journal (the last frame gets the commit mark)
+ *
+ * @param pager is the pager
+ * @param pages is the array of pages
+ * @param count is the number of pages
+ * @return 0 on success, negative value on error
+ */
+static int write_frames(struct pager *pager, struct pager_page **pages, size_t count)
+{
+	uint8_t *buf = (uint8_t *)malloc((size_t)PAGER_FRAMES_PER_WRITE * PAGER_FRAME_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	uint64_t offset = pager->wal_size;
+	uint64_t checksum = pager->wal_checksum;
+	int res = 0;
+
+	for (size_t i = 0; i < count && res == 0; i += PAGER_FRAMES_PER_WRITE)
+	{
+		size_t chunk = (count - i < PAGER_FRAMES_PER_WRITE) ? count - i : PAGER_FRAMES_PER_WRITE;
+		for (size_t j = 0; j < chunk; j++)
+		{
+			struct pager_page *page = pages[i + j];
+			uint8_t *frame = buf + j * PAGER_FRAME_SIZE;
+
+			write_le32(frame, page->page_no);
+			write_le32(frame + 4, (i + j == count - 1) ? pager->page_count : 0);
+			write_le64(frame + 8, pager->wal_salt);
+			memcpy(frame + PAGER_FRAME_HEADER_SIZE, page->data, PAGER_PAGE_SIZE);
+
+			checksum = frame_checksum(checksum, frame, frame + PAGER_FRAME_HEADER_SIZE);
+			write_le64(frame + 16, checksum);
+		}
+
+		res = write_full(pager->wal_fd, buf, chunk * PAGER_FRAME_SIZE, (off_t)offset);
+		offset += chunk * PAGER_FRAME_SIZE;
+	}
+
+	free(buf);
+
+	if (res != 0)
+		return res;
+
+	if (pager->sync && fdatasync(pager->wal_fd) == -1)
+		return -errno;
+
+	// Frames of a failed commit are overwritten by the next one
+	pager->wal_size = offset;
+	pager->wal_checksum = checksum;
+	return 0;
+}
+
+/**
+ * Commit all dirty pages: write them to the journal, sync it (if enabled),
+ * write them to the main file and make a checkpoint if the journal is too big
+ *
+ * @param pager is the pager
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int pager_commit(struct pager *pager)
+{
+	int res;
+
+	if (pager->page_count != pager->committed_page_count)
+	{
+		uint8_t *header;
+		res = pager_get_for_write(pager, 0, &header);
+		if (res != 0)
+			return res;
+
+		write_le32(header + PAGER_PAGE_COUNT_OFFSET, pager->page_count);
+	}
+
+	size_t count = pager->dirty.count;
+	if (count == 0)
+		return 0;
+
+	struct pager_page **pages = (struct pager_page **)malloc(count * sizeof(struct pager_page *));
+	if (pages == NULL)
+		return -ENOMEM;
+
+	size_t i = 0;
+	for (struct pager_page *page = pager->dirty.head; page != NULL; page = page->next)
+		pages[i++] = page;
+
+	// Pages are written to the main file in order, so the writes are mostly sequential
+	qsort(pages, count, sizeof(struct pager_page *), compare_pages);
+
+	res = write_frames(pager, pages, count);
+
+	// The transaction is durable now, a failure below is repaired by recovery on the next open
+	for (i = 0; i < count && res == 0; i++)
+		res = write_full(pager->fd, pages[i]->data, PAGER_PAGE_SIZE, (off_t)pages[i]->page_no * PAGER_PAGE_SIZE);
+
+	if (res == 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			list_remove(&pager->dirty, pages[i]);
+			list_push_head(&pager->clean, pages[i]);
+			pages[i]->dirty = false;
+		}
+
+		pager->committed_page_count = pager->page_count;
+		pager->stats.commits++;
+		pager->stats.pages_written += count;
+	}
+
+	free(pages);
+
+	if (res != 0)
+		return res;
+
+	if (pager->wal_size >= PAGER_CHECKPOINT_SIZE)
+	{
+		if (pager->sync && fdatasync(pager->fd) == -1)
+			return -errno;
+
+		res = reset_wal(pager);
+		if (res != 0)
+			return res;
+
+		pager->stats.checkpoints++;
+	}
+
+	return 0;
+}
+
+/**
+ * Evict clean pages in LRU order until the cache fits its memory limit
+ *
+ * @param pager is the pager
+ */
+void pager_shrink(struct pager *pager)
+{
+	while (pager->clean.count > pager->max_clean_pages && pager->clean.tail != NULL)
+		evict_page(pager, pager->clean.tail);
+}
+
+/**
+ * Get counters of the pager
+ *
+ * @param pager is the pager
+ * @param stats is the target counters
+ */
+void pager_get_stats(const struct pager *pager, struct pager_stats *stats)
+{
+	*stats = pager->stats;
+	stats->page_count = pager->page_count;
+	stats->cached_pages = pager->clean.count + pager->dirty.count;
+	stats->dirty_pages = pager->dirty.count;
+}
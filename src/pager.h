@@ -0,0 +1,160 @@
+#ifndef INC_CATALOGFS_PAGER_H
+#define INC_CATALOGFS_PAGER_H
+
+#include "header_common.h"
+
+/**
+ * File of fixed-size pages with a page cache and a write-ahead journal.
+ *
+ * Pages are read into the cache on demand and changed only in memory.
+ * A commit appends all changed (dirty) pages of the transaction to the
+ * journal file (<path>-wal) with a checksum chain and a commit mark, syncs
+ * the journal and only then writes the pages to the main file (without
+ * syncing it). So a crash at any moment leaves either the old or the new
+ * version of every committed transaction: on open, frames of complete
+ * transactions are copied from the journal to the main file again.
+ * When the journal grows over PAGER_CHECKPOINT_SIZE, the main file is synced
+ * and the journal is started over (checkpoint).
+ *
+ * Many changes are committed together (group commit), so the cost of sync
+ * is shared by all of them, callers decide when to commit.
+ *
+ * The first PAGER_HEADER_SIZE bytes of page 0 belong to the pager (magic,
+ * page size and number of pages), the rest of page 0 can be used by the caller.
+ *
+ * Dirty pages are never evicted, clean ones are evicted in LRU order by
+ * pager_shrink(), so pointers returned by pager_get() stay valid until the
+ * next call of pager_shrink() or pager_commit().
+ *
+ * The pager is not thread-safe, callers must serialize access.
+ */
+
+/** Size of a page in bytes */
+#define PAGER_PAGE_SIZE (4096)
+
+/** Size of the part of page 0 used by the pager */
+#define PAGER_HEADER_SIZE (32)
+
+/** Size of the journal that triggers a checkpoint (in bytes) */
+#define PAGER_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+/** Default memory of the page cache (in megabytes) */
+#define PAGER_DEFAULT_CACHE_MB (64)
+
+// Forward declaration
+struct pager;
+
+/**
+ * Counters of the pager
+ */
+struct pager_stats
+{
+	/** Number of pages in the file */
+	uint32_t page_count;
+
+	/** Number of cached pages */
+	size_t cached_pages;
+
+	/** Number of dirty (not committed) pages */
+	size_t dirty_pages;
+
+	/** Number of page reads answered from the cache */
+	uint64_t hits;
+
+	/** Number of pages read from the file */
+	uint64_t misses;
+
+	/** Number of commits */
+	uint64_t commits;
+
+	/** Number of pages written to the journal */
+	uint64_t pages_written;
+
+	/** Number of checkpoints */
+	uint64_t checkpoints;
+};
+
+/**
+ * Open (or create) the file of pages, recover committed transactions from the journal
+ * and lock the file, so it can't be opened twice
+ *
+ * @param pager is the new pager
+ * @param path is the path of the main file
+ * @param cache_size is the maximum memory of clean cached pages (in bytes)
+ * @param sync is the flag to sync the journal on every commit
+ * @param created is set if the file was created (can be NULL)
+ * @return 0 on success, -EBUSY if the file is used by another process,
+ *         -EINVAL if it's not a file of pages, other negative value (mostly -errno) on error
+ */
+int pager_open(struct pager **pager, const char *path, size_t cache_size, bool sync, bool *created);
+
+/**
+ * Close the file of pages (changes that were not committed are lost)
+ *
+ * @param pager is the pager (can be NULL)
+ */
+void pager_close(struct pager *pager);
+
+/**
+ * Get the page for reading
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, -EINVAL if there is no such page, other negative value on error
+ */
+int pager_get(struct pager *pager, uint32_t page_no, uint8_t **data);
+
+/**
+ * Get the page for changing (the page becomes a part of the next commit)
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, -EINVAL if there is no such page, other negative value on error
+ */
+int pager_get_for_write(struct pager *pager, uint32_t page_no, uint8_t **data);
+
+/**
+ * Append a new zeroed page to the file (the page becomes a part of the next commit)
+ *
+ * @param pager is the pager
+ * @param page_no is the number of the new page
+ * @param data is the content of the page (PAGER_PAGE_SIZE bytes)
+ * @return 0 on success, negative value on error
+ */
+int pager_allocate(struct pager *pager, uint32_t *page_no, uint8_t **data);
+
+/**
+ * Get the number of dirty pages (to decide when to commit)
+ *
+ * @param pager is the pager
+ * @return number of dirty pages
+ */
+size_t pager_dirty_count(const struct pager *pager);
+
+/**
+ * Commit all dirty pages: write them to the journal, sync it (if enabled),
+ * write them to the main file and make a checkpoint if the journal is too big
+ *
+ * @param pager is the pager
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int pager_commit(struct pager *pager);
+
+/**
+ * Evict clean pages in LRU order until the cache fits its memory limit
+ *
+ * @param pager is the pager
+ */
+void pager_shrink(struct pager *pager);
+
+/**
+ * Get counters of the pager
+ *
+ * @param pager is the pager
+ * @param stats is the target counters
+ */
+void pager_get_stats(const struct pager *pager, struct pager_stats *stats);
+
+#endif // INC_CATALOGFS_PAGER_H
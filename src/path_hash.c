@@ -0,0 +1,270 @@
+#include "header_common.h"
+
+#include "path_hash.h"
+
+/** Initial number of chains */
+#define PATH_HASH_INITIAL_BUCKETS (64)
+
+/**
+ * Calculate hash of a key (64-bit FNV-1a)
+ *
+ * @param key is the key
+ * @param key_len is the length of the key
+ * @return hash of the key
+ */
+static uint64_t path_hash_calc(const char *key, size_t key_len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < key_len; i++)
+	{
+		hash ^= (uint8_t)key[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Find the link pointing to the node with the key
+ *
+ * @param table is the table (must have buckets)
+ * @param key is the key
+ * @param key_len is the length of the key
+ * @param hash is the hash of the key
+ * @return pointer to the link (points to NULL if there is no such key)
+ */
+static struct path_hash_node **path_hash_find_link(const struct path_hash *table, const char *key,
+												   size_t key_len, uint64_t hash)
+{
+	struct path_hash_node **link = &table->buckets[hash & (table->buckets_count - 1)];
+	while (*link != NULL)
+	{
+		struct path_hash_node *node = *link;
+		if (node->hash == hash &&
+			node->key_len == key_len &&
+			memcmp(node->key, key, key_len) == 0)
+		{
+			break;
+		}
+		link = &node->next;
+	}
+	return link;
+}
+
+/**
+ * Grow the array of chains and redistribute nodes
+ *
+ * @param table is the table
+ * @return 0 on success, -ENOMEM on error
+ */
+static int path_hash_grow(struct path_hash *table)
+{
+	size_t new_count = (table->buckets_count == 0) ? PATH_HASH_INITIAL_BUCKETS : table->buckets_count * 2;
+	struct path_hash_node **new_buckets = (struct path_hash_node **)calloc(new_count, sizeof(struct path_hash_node *));
+	if (new_buckets == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < table->buckets_count; i++)
+	{
+		struct path_hash_node *node = table->buckets[i];
+		while (node != NULL)
+		{
+			struct path_hash_node *next = node->next;
+			size_t index = node->hash & (new_count - 1);
+			node->next = new_buckets[index];
+			new_buckets[index] = node;
+			node = next;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = new_buckets;
+	table->buckets_count = new_count;
+	return 0;
+}
+
+/**
+ * Initialize an empty hash table
+ *
+ * @param table is the table
+ */
+void path_hash_init(struct path_hash *table)
+{
+	memset(table, 0, sizeof(struct path_hash));
+}
+
+/**
+ * Find a value by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated)
+ * @param key_len is the length of the key
+ * @return the value, NULL if there is no such key
+ */
+void *path_hash_get(const struct path_hash *table, const char *key, size_t key_len)
+{
+	if (table->count == 0)
+		return NULL;
+
+	struct path_hash_node **link = path_hash_find_link(table, key, key_len, path_hash_calc(key, key_len));
+	return (*link != NULL) ? (*link)->value : NULL;
+}
+
+/**
+ * Insert or replace a value by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated, it's copied)
+ * @param key_len is the length of the key
+ * @param value is the value (should not be NULL to be distinguishable by path_hash_get())
+ * @param old_value is the replaced value, NULL if the key was not present (can be NULL)
+ * @return 0 on success, -ENOMEM on error
+ */
+int path_hash_put(struct path_hash *table, const char *key, size_t key_len, void *value, void **old_value)
+{
+	if (old_value != NULL)
+		*old_value = NULL;
+
+	// Keep load factor under 1
+	if (table->count >= table->buckets_count)
+	{
+		int res = path_hash_grow(table);
+		if (res != 0)
+			return res;
+	}
+
+	uint64_t hash = path_hash_calc(key, key_len);
+	struct path_hash_node **link = path_hash_find_link(table, key, key_len, hash);
+	if (*link != NULL)
+	{
+		if (old_value != NULL)
+			*old_value = (*link)->value;
+		(*link)->value = value;
+		return 0;
+	}
+
+	struct path_hash_node *node = (struct path_hash_node *)malloc(sizeof(struct path_hash_node) + key_len + 1);
+	if (node == NULL)
+		return -ENOMEM;
+
+	node->next = NULL;
+	node->hash = hash;
+	node->value = value;
+	node->key_len = key_len;
+	memcpy(node->key, key, key_len);
+	node->key[key_len] = '\0';
+
+	*link = node;
+	table->count++;
+	return 0;
+}
+
+/**
+ * Remove an entry by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated)
+ * @param key_len is the length of the key
+ * @return the value of the removed entry, NULL if there is no such key
+ */
+void *path_hash_remove(struct path_hash *table, const char *key, size_t key_len)
+{
+	if (table->count == 0)
+		return NULL;
+
+	struct path_hash_node **link = path_hash_find_link(table, key, key_len, path_hash_calc(key, key_len));
+	struct path_hash_node *node = *link;
+	if (node == NULL)
+		return NULL;
+
+	void *value = node->value;
+	*link = node->next;
+	free(node);
+	table->count--;
+	return value;
+}
+
+/**
+ * Remove all entries matching a predicate
+ *
+ * @param table is the table
+ * @param predicate is the function that decides if the entry should be removed
+ * @param arg is the user argument for the predicate
+ * @param free_value is the function to free values of removed entries (can be NULL)
+ * @return number of removed entries
+ */
+size_t path_hash_remove_if(struct path_hash *table, path_hash_predicate_t predicate, void *arg,
+						   path_hash_free_value_t free_value)
+{
+	size_t removed = 0;
+	for (size_t i = 0; i < table->buckets_count; i++)
+	{
+		struct path_hash_node **link = &table->buckets[i];
+		while (*link != NULL)
+		{
+			struct path_hash_node *node = *link;
+			if (predicate(node->key, node->key_len, node->value, arg))
+			{
+				*link = node->next;
+				if (free_value != NULL)
+					free_value(node->value);
+				free(node);
+				removed++;
+			}
+			else
+			{
+				link = &node->next;
+			}
+		}
+	}
+
+	table->count -= removed;
+	return removed;
+}
+
+/**
+ * Call a function for every entry in no particular order (the table must not be changed by it)
+ *
+ * @param table is the table
+ * @param visitor is the function called for every entry
+ * @param arg is the user argument for the visitor
+ * @return 0 if all entries were visited, the nonzero value of the visitor if it stopped
+ */
+int path_hash_for_each(const struct path_hash *table, path_hash_visitor_t visitor, void *arg)
+{
+	for (size_t i = 0; i < table->buckets_count; i++)
+	{
+		for (const struct path_hash_node *node = table->buckets[i]; node != NULL; node = node->next)
+		{
+			int res = visitor(node->key, node->key_len, node->value, arg);
+			if (res != 0)
+				return res;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Remove all entries and free memory of the table (the table can be reused after that)
+ *
+ * @param table is the table
+ * @param free_value is the function to free values (can be NULL)
+ */
+void path_hash_clear(struct path_hash *table, path_hash_free_value_t free_value)
+{
+	for (size_t i = 0; i < table->buckets_count; i++)
+	{
+		struct path_hash_node *node = table->buckets[i];
+		while (node != NULL)
+		{
+			struct path_hash_node *next = node->next;
+			if (free_value != NULL)
+				free_value(node->value);
+			free(node);
+			node = next;
+		}
+	}
+
+	free(table->buckets);
+	path_hash_init(table);
+}
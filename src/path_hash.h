@@ -0,0 +1,149 @@
+#ifndef INC_CATALOGFS_PATH_HASH_H
+#define INC_CATALOGFS_PATH_HASH_H
+
+#include "header_common.h"
+
+/**
+ * Hash table with string keys (paths or names) and pointer values.
+ *
+ * Keys are copied into the table, values are owned by the caller
+ * (a function to free values can be passed to functions that drop entries).
+ * Functions take keys with explicit length, so a part of a path
+ * (e.g. the parent directory) can be used without copying it.
+ *
+ * The table is not thread-safe, callers must serialize access.
+ */
+
+/**
+ * Node of a hash table chain
+ */
+struct path_hash_node
+{
+	/** Next node in the chain */
+	struct path_hash_node *next;
+
+	/** Hash of the key */
+	uint64_t hash;
+
+	/** Value */
+	void *value;
+
+	/** Length of the key */
+	size_t key_len;
+
+	/** Null-terminated key */
+	char key[];
+};
+
+/**
+ * Hash table
+ */
+struct path_hash
+{
+	/** Array of chains */
+	struct path_hash_node **buckets;
+
+	/** Number of chains (power of two or zero) */
+	size_t buckets_count;
+
+	/** Number of entries */
+	size_t count;
+};
+
+/**
+ * Function to free a value of a dropped entry
+ */
+typedef void (*path_hash_free_value_t)(void *value);
+
+/**
+ * Function to decide if an entry should be removed by path_hash_remove_if()
+ *
+ * @param key is the key of the entry
+ * @param key_len is the length of the key
+ * @param value is the value of the entry
+ * @param arg is the user argument
+ * @return true if the entry should be removed
+ */
+typedef bool (*path_hash_predicate_t)(const char *key, size_t key_len, void *value, void *arg);
+
+/**
+ * Function called for every entry by path_hash_for_each()
+ *
+ * @param key is the key of the entry
+ * @param key_len is the length of the key
+ * @param value is the value of the entry
+ * @param arg is the user argument
+ * @return 0 to continue, nonzero value to stop
+ */
+typedef int (*path_hash_visitor_t)(const char *key, size_t key_len, void *value, void *arg);
+
+/**
+ * Initialize an empty hash table
+ *
+ * @param table is the table
+ */
+void path_hash_init(struct path_hash *table);
+
+/**
+ * Find a value by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated)
+ * @param key_len is the length of the key
+ * @return the value, NULL if there is no such key
+ */
+void *path_hash_get(const struct path_hash *table, const char *key, size_t key_len);
+
+/**
+ * Insert or replace a value by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated, it's copied)
+ * @param key_len is the length of the key
+ * @param value is the value (should not be NULL to be distinguishable by path_hash_get())
+ * @param old_value is the replaced value, NULL if the key was not present (can be NULL)
+ * @return 0 on success, -ENOMEM on error
+ */
+int path_hash_put(struct path_hash *table, const char *key, size_t key_len, void *value, void **old_value);
+
+/**
+ * Remove an entry by the key
+ *
+ * @param table is the table
+ * @param key is the key (does not need to be null-terminated)
+ * @param key_len is the length of the key
+ * @return the value of the removed entry, NULL if there is no such key
+ */
+void *path_hash_remove(struct path_hash *table, const char *key, size_t key_len);
+
+/**
+ * Remove all entries matching a predicate
+ *
+ * @param table is the table
+ * @param predicate is the function that decides if the entry should be removed
+ * @param arg is the user argument for the predicate
+ * @param free_value is the function to free values of removed entries (can be NULL)
+ * @return number of removed entries
+ */
+size_t path_hash_remove_if(struct path_hash *table, path_hash_predicate_t predicate, void *arg,
+						   path_hash_free_value_t free_value);
+
+/**
+ * Call a function for every entry in no particular order (the table must not be changed by it)
+ *
+ * @param table is the table
+ * @param visitor is the function called for every entry
+ * @param arg is the user argument for the visitor
+ * @return 0 if all entries were visited, the nonzero value of the visitor if it stopped
+ */
+int path_hash_for_each(const struct path_hash *table, path_hash_visitor_t visitor, void *arg);
+
+/**
+ * Remove all entries and free memory of the table (the table can be reused after that)
+ *
+ * @param table is the table
+ * @param free_value is the function to free values (can be NULL)
+ */
+void path_hash_clear(struct path_hash *table, path_hash_free_value_t free_value);
+
+#endif // INC_CATALOGFS_PATH_HASH_H
@@ -0,0 +1,1418 @@
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "query_index.h"
+
+#include "byte_buffer.h"
+#include "catalog_db.h"
+#include "catalog_dir.h"
+
+/** Value of empty slots of hash tables */
+#define QUERY_INDEX_EMPTY_SLOT (UINT32_MAX)
+
+/** Id of extensions that are not in the index (never matches) */
+#define QUERY_INDEX_UNKNOWN_EXTENSION (UINT32_MAX)
+
+/** Values of the type column */
+#define QUERY_TYPE_FILE (1)
+#define QUERY_TYPE_DIR (2)
+#define QUERY_TYPE_SYMLINK (3)
+
+/**
+ * Columnar index (see query_index.h)
+ */
+struct query_index
+{
+	/** Number of rows */
+	size_t count;
+
+	/** Allocated number of rows of columns */
+	size_t capacity;
+
+	/** Null-terminated relative paths of rows, one after another */
+	struct byte_buffer paths;
+
+	/** Offset of the path of every row in paths */
+	uint64_t *path_offsets;
+
+	/** Column of sizes */
+	int64_t *size;
+
+	/** Column of modification times (seconds) */
+	int64_t *mtime;
+
+	/** Column of owners */
+	uint32_t *uid;
+
+	/** Column of groups */
+	uint32_t *gid;
+
+	/** Column of ids of extensions (0 for names without extensions) */
+	uint32_t *ext;
+
+	/** Column of types (QUERY_TYPE_*) */
+	uint8_t *type;
+
+	/** Rows sorted by size */
+	uint32_t *by_size;
+
+	/** Rows sorted by mtime */
+	uint32_t *by_mtime;
+
+	/** Hash table of rows by paths (open addressing) */
+	uint32_t *path_slots;
+
+	/** Number of slots of path_slots minus one */
+	size_t path_slots_mask;
+
+	/** Extensions by ids (the id 0 is the empty extension) */
+	char (*extensions)[QUERY_MAX_EXTENSION + 1];
+
+	/** Number of extensions */
+	size_t extensions_count;
+
+	/** Allocated number of extensions */
+	size_t extensions_capacity;
+
+	/** Hash table of ids of extensions (open addressing) */
+	uint32_t *ext_slots;
+
+	/** Number of slots of ext_slots minus one */
+	size_t ext_slots_mask;
+
+	/** Entries that failed to be read while building */
+	size_t errors;
+
+	/** Time of building in seconds */
+	double build_seconds;
+};
+
+/**
+ * Hash a string (FNV-1a)
+ *
+ * @param text is the string
+ * @param len is the length of the string
+ * @return the hash
+ */
+static uint64_t hash_string(const char *text, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Parse a decimal number
+ *
+ * @param text is the text
+ * @param end is the position after the number
+ * @param value is the parsed value
+ * @return true on success
+ */
+static bool parse_number(const char *text, const char **end, int64_t *value)
+{
+	if (*text < '0' || *text > '9')
+		return false;
+
+	int64_t result = 0;
+	while (*text >= '0' && *text <= '9')
+	{
+		int digit = *text - '0';
+		if (result > (INT64_MAX - digit) / 10)
+			return false;
+		result = result * 10 + digit;
+		text++;
+	}
+
+	*end = text;
+	*value = result;
+	return true;
+}
+
+/**
+ * Parse a size with an optional suffix ("1G", "512K", "100")
+ *
+ * @param text is the text
+ * @param value is the size in bytes
+ * @return true on success
+ */
+static bool parse_size(const char *text, int64_t *value)
+{
+	const char *end;
+	int64_t number;
+	if (!parse_number(text, &end, &number))
+		return false;
+
+	int shift = 0;
+	switch (toupper((unsigned char)*end))
+	{
+	case '\0':
+		break;
+	case 'K':
+		shift = 10;
+		break;
+	case 'M':
+		shift = 20;
+		break;
+	case 'G':
+		shift = 30;
+		break;
+	case 'T':
+		shift = 40;
+		break;
+	case 'P':
+		shift = 50;
+		break;
+	default:
+		return false;
+	}
+	if (shift > 0)
+		end++;
+	if (toupper((unsigned char)*end) == 'B')
+		end++;
+	if (*end != '\0' || number > (INT64_MAX >> shift))
+		return false;
+
+	*value = number << shift;
+	return true;
+}
+
+/**
+ * Parse a time: @<seconds> or a date in UTC (YYYY, YYYY-MM or YYYY-MM-DD)
+ *
+ * @param text is the text
+ * @param min is the first second of the period
+ * @param max is the last second of the period
+ * @return true on success
+ */
+static bool parse_time_range(const char *text, int64_t *min, int64_t *max)
+{
+	const char *end;
+	int64_t number;
+	if (text[0] == '@')
+	{
+		bool negative = (text[1] == '-');
+		if (!parse_number(text + 1 + (negative ? 1 : 0), &end, &number) || *end != '\0')
+			return false;
+		*min = *max = (negative) ? -number : number;
+		return true;
+	}
+
+	int64_t parts[3] = {0, 1, 1};
+	size_t count = 0;
+	const char *pos = text;
+	while (count < 3)
+	{
+		if (!parse_number(pos, &end, &parts[count]))
+			return false;
+		count++;
+		if (*end == '\0')
+			break;
+		if (*end != '-')
+			return false;
+		pos = end + 1;
+	}
+	if (*end != '\0' || parts[0] < 1 || parts[0] > 9999 || parts[1] < 1 || parts[1] > 12 ||
+		parts[2] < 1 || parts[2] > 31)
+	{
+		return false;
+	}
+
+	struct tm start;
+	memset(&start, 0, sizeof(struct tm));
+	start.tm_year = (int)parts[0] - 1900;
+	start.tm_mon = (int)parts[1] - 1;
+	start.tm_mday = (int)parts[2];
+
+	// The next period starts after a year, a month or a day
+	struct tm next = start;
+	if (count == 1)
+		next.tm_year++;
+	else if (count == 2)
+		next.tm_mon++;
+	else
+		next.tm_mday++;
+
+	*min = (int64_t)timegm(&start);
+	*max = (int64_t)timegm(&next) - 1;
+	return true;
+}
+
+/**
+ * Parse a predicate ("size>1G")
+ *
+ * @param text is the text of the predicate
+ * @param predicate is the parsed predicate
+ * @return 0 on success, -EINVAL for unknown fields, operators and broken values
+ */
+int query_parse_predicate(const char *text, struct query_predicate *predicate)
+{
+	static const struct
+	{
+		const char *name;
+		enum query_field field;
+	} fields[] = {
+		{"size", QUERY_FIELD_SIZE},
+		{"mtime", QUERY_FIELD_MTIME},
+		{"uid", QUERY_FIELD_UID},
+		{"gid", QUERY_FIELD_GID},
+		{"ext", QUERY_FIELD_EXT},
+		{"type", QUERY_FIELD_TYPE},
+	};
+
+	memset(predicate, 0, sizeof(struct query_predicate));
+
+	size_t name_len = strcspn(text, "<>=!");
+	bool found = false;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+	{
+		if (strlen(fields[i].name) == name_len && strncmp(text, fields[i].name, name_len) == 0)
+		{
+			predicate->field = fields[i].field;
+			found = true;
+			break;
+		}
+	}
+	if (!found)
+		return -EINVAL;
+
+	const char *op = text + name_len;
+	size_t op_len = (op[0] != '\0' && op[1] == '=') ? 2 : 1;
+	if (op[0] == '\0' || (op[0] == '!' && op_len != 2) || (op[0] == '=' && op_len != 1))
+		return -EINVAL;
+	const char *value = op + op_len;
+
+	// The value is a range [lo, hi]: a point for numbers, a period for dates
+	int64_t lo = 0, hi = 0;
+	bool ordered = true;
+	switch (predicate->field)
+	{
+	case QUERY_FIELD_SIZE:
+		if (!parse_size(value, &lo))
+			return -EINVAL;
+		hi = lo;
+		break;
+	case QUERY_FIELD_MTIME:
+		if (!parse_time_range(value, &lo, &hi))
+			return -EINVAL;
+		break;
+	case QUERY_FIELD_UID:
+	case QUERY_FIELD_GID:
+	{
+		const char *end;
+		if (!parse_number(value, &end, &lo) || *end != '\0' || lo > UINT32_MAX)
+			return -EINVAL;
+		hi = lo;
+		break;
+	}
+	case QUERY_FIELD_EXT:
+	{
+		size_t len = strlen(value);
+		if (len > QUERY_MAX_EXTENSION || strchr(value, '/') != NULL || strchr(value, '.') != NULL)
+			return -EINVAL;
+		for (size_t i = 0; i <= len; i++)
+		{
+			predicate->ext[i] = (char)tolower((unsigned char)value[i]);
+		}
+		ordered = false;
+		break;
+	}
+	case QUERY_FIELD_TYPE:
+		if (strcmp(value, "file") == 0)
+			lo = QUERY_TYPE_FILE;
+		else if (strcmp(value, "dir") == 0)
+			lo = QUERY_TYPE_DIR;
+		else if (strcmp(value, "symlink") == 0)
+			lo = QUERY_TYPE_SYMLINK;
+		else
+			return -EINVAL;
+		hi = lo;
+		ordered = false;
+		break;
+	}
+
+	predicate->min = lo;
+	predicate->max = hi;
+	if (op[0] == '=' || op[0] == '!')
+	{
+		predicate->negate = (op[0] == '!');
+		return 0;
+	}
+	if (!ordered)
+		return -EINVAL;
+
+	// An empty range is min > max
+	if (op[0] == '<')
+	{
+		predicate->min = INT64_MIN;
+		predicate->max = (op_len == 2) ? hi : (lo == INT64_MIN) ? INT64_MIN : lo - 1;
+		if (op_len == 1 && lo == INT64_MIN)
+			predicate->min = INT64_MAX;
+	}
+	else
+	{
+		predicate->min = (op_len == 2) ? lo : (hi == INT64_MAX) ? INT64_MAX : hi + 1;
+		predicate->max = INT64_MAX;
+		if (op_len == 1 && hi == INT64_MAX)
+			predicate->max = INT64_MIN;
+	}
+	return 0;
+}
+
+/**
+ * Add a parsed predicate to the query
+ *
+ * @param query is the query (zeroed before the first predicate)
+ * @param text is the text of the predicate
+ * @return 0 on success, -EINVAL for broken predicates, -E2BIG if the query is full
+ */
+int query_add_predicate(struct query *query, const char *text)
+{
+	if (query->count == QUERY_MAX_PREDICATES)
+		return -E2BIG;
+
+	int res = query_parse_predicate(text, &query->predicates[query->count]);
+	if (res != 0)
+		return res;
+
+	query->count++;
+	return 0;
+}
+
+/**
+ * Get the extension of the name of a path (lowercase)
+ *
+ * @param path is the path
+ * @param len is the length of the path
+ * @param ext is the target buffer
+ * @return length of the extension (0 if the name has none)
+ */
+static size_t get_extension(const char *path, size_t len, char ext[QUERY_MAX_EXTENSION + 1])
+{
+	const char *dot = memrchr(path, '.', len);
+	const char *slash = memrchr(path, '/', len);
+	const char *name = (slash != NULL) ? slash + 1 : path;
+
+	// Names of dot files (".bashrc") have no extension
+	size_t ext_len = (dot != NULL) ? (size_t)(path + len - dot - 1) : 0;
+	if (dot == NULL || dot <= name || ext_len == 0 || ext_len > QUERY_MAX_EXTENSION)
+	{
+		ext[0] = '\0';
+		return 0;
+	}
+
+	for (size_t i = 0; i < ext_len; i++)
+	{
+		ext[i] = (char)tolower((unsigned char)dot[1 + i]);
+	}
+	ext[ext_len] = '\0';
+	return ext_len;
+}
+
+/**
+ * Find the id of an extension
+ *
+ * @param index is the index
+ * @param ext is the extension
+ * @return the id, QUERY_INDEX_UNKNOWN_EXTENSION if it's not in the index
+ */
+static uint32_t find_extension(const struct query_index *index, const char *ext)
+{
+	if (ext[0] == '\0')
+		return 0;
+	if (index->ext_slots == NULL)
+		return QUERY_INDEX_UNKNOWN_EXTENSION;
+
+	for (size_t slot = hash_string(ext, strlen(ext)) & index->ext_slots_mask;; slot = (slot + 1) & index->ext_slots_mask)
+	{
+		uint32_t id = index->ext_slots[slot];
+		if (id == QUERY_INDEX_EMPTY_SLOT)
+			return QUERY_INDEX_UNKNOWN_EXTENSION;
+		if (strcmp(index->extensions[id], ext) == 0)
+			return id;
+	}
+}
+
+/**
+ * Get the id of an extension, adding it to the index if needed
+ *
+ * @param index is the index
+ * @param ext is the extension
+ * @param id is the id
+ * @return 0 on success, -ENOMEM on error
+ */
+static int add_extension(struct query_index *index, const char *ext, uint32_t *id)
+{
+	*id = find_extension(index, ext);
+	if (*id != QUERY_INDEX_UNKNOWN_EXTENSION)
+		return 0;
+
+	if (index->extensions_count == index->extensions_capacity)
+	{
+		size_t capacity = index->extensions_capacity * 2;
+		void *extensions = realloc(index->extensions, capacity * sizeof(index->extensions[0]));
+		if (extensions == NULL)
+			return -ENOMEM;
+		index->extensions = extensions;
+		index->extensions_capacity = capacity;
+	}
+
+	// The table is kept at most half full
+	if (index->ext_slots == NULL || (index->extensions_count + 1) * 2 > index->ext_slots_mask + 1)
+	{
+		size_t slots = (index->ext_slots == NULL) ? 64 : (index->ext_slots_mask + 1) * 2;
+		uint32_t *ext_slots = (uint32_t *)malloc(slots * sizeof(uint32_t));
+		if (ext_slots == NULL)
+			return -ENOMEM;
+		memset(ext_slots, 0xff, slots * sizeof(uint32_t));
+		for (uint32_t i = 1; i < index->extensions_count; i++)
+		{
+			size_t slot = hash_string(index->extensions[i], strlen(index->extensions[i])) & (slots - 1);
+			while (ext_slots[slot] != QUERY_INDEX_EMPTY_SLOT)
+				slot = (slot + 1) & (slots - 1);
+			ext_slots[slot] = i;
+		}
+		free(index->ext_slots);
+		index->ext_slots = ext_slots;
+		index->ext_slots_mask = slots - 1;
+	}
+
+	*id = (uint32_t)index->extensions_count++;
+	strcpy(index->extensions[*id], ext);
+	size_t slot = hash_string(ext, strlen(ext)) & index->ext_slots_mask;
+	while (index->ext_slots[slot] != QUERY_INDEX_EMPTY_SLOT)
+		slot = (slot + 1) & index->ext_slots_mask;
+	index->ext_slots[slot] = *id;
+	return 0;
+}
+
+/**
+ * Make an empty index
+ *
+ * @return the index, NULL on error
+ */
+static struct query_index *query_index_new(void)
+{
+	struct query_index *index = (struct query_index *)calloc(1, sizeof(struct query_index));
+	if (index == NULL)
+		return NULL;
+
+	index->extensions_capacity = 64;
+	index->extensions = calloc(index->extensions_capacity, sizeof(index->extensions[0]));
+	if (index->extensions == NULL)
+	{
+		free(index);
+		return NULL;
+	}
+
+	// The id 0 is the empty extension
+	index->extensions_count = 1;
+	return index;
+}
+
+/**
+ * Grow a column
+ *
+ * @param column is the column (replaced on success)
+ * @param item_size is the size of a value
+ * @param capacity is the new number of rows
+ * @return true on success
+ */
+static bool grow_column(void **column, size_t item_size, size_t capacity)
+{
+	void *grown = realloc(*column, capacity * item_size);
+	if (grown == NULL)
+		return false;
+
+	*column = grown;
+	return true;
+}
+
+/**
+ * Add a row
+ *
+ * @param index is the index
+ * @param path is the relative path
+ * @param path_len is the length of the path
+ * @param my_stat is the metadata of the entry
+ * @return 0 on success, -ENOMEM on error, -EOVERFLOW if the index is full
+ */
+static int add_row(struct query_index *index, const char *path, size_t path_len, const struct filestat *my_stat)
+{
+	if (index->count == QUERY_INDEX_EMPTY_SLOT - 1)
+		return -EOVERFLOW;
+
+	if (index->count == index->capacity)
+	{
+		size_t capacity = (index->capacity == 0) ? 4096 : index->capacity * 2;
+		if (!grow_column((void **)&index->path_offsets, sizeof(uint64_t), capacity) ||
+			!grow_column((void **)&index->size, sizeof(int64_t), capacity) ||
+			!grow_column((void **)&index->mtime, sizeof(int64_t), capacity) ||
+			!grow_column((void **)&index->uid, sizeof(uint32_t), capacity) ||
+			!grow_column((void **)&index->gid, sizeof(uint32_t), capacity) ||
+			!grow_column((void **)&index->ext, sizeof(uint32_t), capacity) ||
+			!grow_column((void **)&index->type, sizeof(uint8_t), capacity))
+		{
+			return -ENOMEM;
+		}
+		index->capacity = capacity;
+	}
+
+	char ext[QUERY_MAX_EXTENSION + 1];
+	uint32_t ext_id = 0;
+	if (S_ISREG(my_stat->mode) && get_extension(path, path_len, ext) > 0 && add_extension(index, ext, &ext_id) != 0)
+		return -ENOMEM;
+
+	size_t offset = index->paths.len;
+	if (byte_buffer_append(&index->paths, path, path_len) != 0 || byte_buffer_append(&index->paths, "", 1) != 0)
+		return -ENOMEM;
+
+	size_t row = index->count++;
+	index->path_offsets[row] = offset;
+	index->size[row] = my_stat->size;
+	index->mtime[row] = my_stat->mtime;
+	index->uid[row] = my_stat->uid;
+	index->gid[row] = my_stat->gid;
+	index->ext[row] = ext_id;
+	index->type[row] = S_ISDIR(my_stat->mode) ? QUERY_TYPE_DIR : S_ISLNK(my_stat->mode) ? QUERY_TYPE_SYMLINK
+																						   : QUERY_TYPE_FILE;
+	return 0;
+}
+
+/**
+ * Compare rows by a column of int64_t values (for qsort_r())
+ *
+ * @param a is the first row
+ * @param b is the second row
+ * @param column is the column
+ * @return negative, zero or positive value as for qsort()
+ */
+static int compare_rows_by_column(const void *a, const void *b, void *column)
+{
+	const int64_t *values = (const int64_t *)column;
+	uint32_t row_a = *(const uint32_t *)a;
+	uint32_t row_b = *(const uint32_t *)b;
+
+	if (values[row_a] != values[row_b])
+		return (values[row_a] < values[row_b]) ? -1 : 1;
+	return (row_a < row_b) ? -1 : (row_a > row_b);
+}
+
+/**
+ * Compare rows by paths (for qsort_r())
+ *
+ * @param a is the first row
+ * @param b is the second row
+ * @param index is the index
+ * @return negative, zero or positive value as for qsort()
+ */
+static int compare_rows_by_path(const void *a, const void *b, void *index)
+{
+	return strcmp(query_index_path((const struct query_index *)index, *(const uint32_t *)a),
+				  query_index_path((const struct query_index *)index, *(const uint32_t *)b));
+}
+
+/**
+ * Make a sorted index of rows by a column
+ *
+ * @param index is the index
+ * @param column is the column of int64_t values
+ * @return the rows sorted by values, NULL on error
+ */
+static uint32_t *sort_rows(const struct query_index *index, int64_t *column)
+{
+	uint32_t *rows = (uint32_t *)malloc((index->count + 1) * sizeof(uint32_t));
+	if (rows == NULL)
+		return NULL;
+
+	for (size_t i = 0; i < index->count; i++)
+	{
+		rows[i] = (uint32_t)i;
+	}
+	qsort_r(rows, index->count, sizeof(uint32_t), compare_rows_by_column, column);
+	return rows;
+}
+
+/**
+ * Compare row numbers (for qsort())
+ *
+ * @param a is the first row
+ * @param b is the second row
+ * @return negative, zero or positive value as for qsort()
+ */
+static int compare_rows(const void *a, const void *b)
+{
+	uint32_t row_a = *(const uint32_t *)a;
+	uint32_t row_b = *(const uint32_t *)b;
+	return (row_a < row_b) ? -1 : (row_a > row_b);
+}
+
+/**
+ * Reorder values of a column
+ *
+ * @param column is the column (replaced on success)
+ * @param item_size is the size of a value
+ * @param order is the old row of every new row
+ * @param count is the number of rows
+ * @param capacity is the allocated number of rows
+ * @return true on success
+ */
+static bool reorder_column(void **column, size_t item_size, const uint32_t *order, size_t count, size_t capacity)
+{
+	uint8_t *reordered = (uint8_t *)malloc(capacity * item_size);
+	if (reordered == NULL)
+		return false;
+
+	const uint8_t *values = (const uint8_t *)*column;
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy(reordered + i * item_size, values + (size_t)order[i] * item_size, item_size);
+	}
+
+	free(*column);
+	*column = reordered;
+	return true;
+}
+
+/**
+ * Make secondary indexes and the hash table of paths after all rows are added.
+ * Rows are renumbered in the order of paths, so scans find rows already sorted.
+ *
+ * @param index is the index
+ * @return 0 on success, -ENOMEM on error
+ */
+static int finish_index(struct query_index *index)
+{
+	uint32_t *order = (uint32_t *)malloc((index->count + 1) * sizeof(uint32_t));
+	if (order == NULL)
+		return -ENOMEM;
+	for (size_t i = 0; i < index->count; i++)
+	{
+		order[i] = (uint32_t)i;
+	}
+	qsort_r(order, index->count, sizeof(uint32_t), compare_rows_by_path, index);
+
+	bool reordered = reorder_column((void **)&index->path_offsets, sizeof(uint64_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->size, sizeof(int64_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->mtime, sizeof(int64_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->uid, sizeof(uint32_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->gid, sizeof(uint32_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->ext, sizeof(uint32_t), order, index->count, index->capacity) &&
+					 reorder_column((void **)&index->type, sizeof(uint8_t), order, index->count, index->capacity);
+	free(order);
+	if (!reordered)
+		return -ENOMEM;
+
+	index->by_size = sort_rows(index, index->size);
+	index->by_mtime = sort_rows(index, index->mtime);
+	if (index->by_size == NULL || index->by_mtime == NULL)
+		return -ENOMEM;
+
+	size_t slots = 16;
+	while (slots < index->count * 2)
+		slots *= 2;
+	index->path_slots = (uint32_t *)malloc(slots * sizeof(uint32_t));
+	if (index->path_slots == NULL)
+		return -ENOMEM;
+	memset(index->path_slots, 0xff, slots * sizeof(uint32_t));
+	index->path_slots_mask = slots - 1;
+
+	for (size_t row = 0; row < index->count; row++)
+	{
+		const char *path = query_index_path(index, (uint32_t)row);
+		size_t slot = hash_string(path, strlen(path)) & index->path_slots_mask;
+		while (index->path_slots[slot] != QUERY_INDEX_EMPTY_SLOT)
+			slot = (slot + 1) & index->path_slots_mask;
+		index->path_slots[slot] = (uint32_t)row;
+	}
+
+	return 0;
+}
+
+/**
+ * Stack of relative paths of directories to walk
+ */
+struct query_walk
+{
+	/** Paths (owned) */
+	char **paths;
+
+	/** Number of paths */
+	size_t count;
+
+	/** Allocated size of paths */
+	size_t capacity;
+};
+
+/**
+ * Push a directory to the stack
+ *
+ * @param walk is the stack
+ * @param path is the path (copied)
+ * @param len is the length of the path
+ * @return 0 on success, -ENOMEM on error
+ */
+static int walk_push(struct query_walk *walk, const char *path, size_t len)
+{
+	if (walk->count == walk->capacity)
+	{
+		size_t capacity = (walk->capacity == 0) ? 64 : walk->capacity * 2;
+		char **paths = (char **)realloc(walk->paths, capacity * sizeof(char *));
+		if (paths == NULL)
+			return -ENOMEM;
+		walk->paths = paths;
+		walk->capacity = capacity;
+	}
+
+	char *copy = strndup(path, len);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	walk->paths[walk->count++] = copy;
+	return 0;
+}
+
+/**
+ * Free the stack
+ *
+ * @param walk is the stack
+ */
+static void walk_free(struct query_walk *walk)
+{
+	for (size_t i = 0; i < walk->count; i++)
+	{
+		free(walk->paths[i]);
+	}
+	free(walk->paths);
+}
+
+/**
+ * Make a relative path of an entry of a directory
+ *
+ * @param buf is the target buffer (reused)
+ * @param dir_path is the path of the directory (empty for the root)
+ * @param name is the name of the entry
+ * @return 0 on success, -ENOMEM on error
+ */
+static int join_path(struct byte_buffer *buf, const char *dir_path, const char *name)
+{
+	buf->len = 0;
+	if (dir_path[0] != '\0' && (byte_buffer_append(buf, dir_path, strlen(dir_path)) != 0 ||
+								byte_buffer_append(buf, "/", 1) != 0))
+	{
+		return -ENOMEM;
+	}
+	return byte_buffer_append(buf, name, strlen(name));
+}
+
+/**
+ * Get seconds of a monotonic clock
+ *
+ * @return the seconds
+ */
+static double monotonic_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * Build an index of a catalog directory (walks all directories)
+ *
+ * @param index is the new index (must be freed by query_index_free())
+ * @param root_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @return 0 on success, -ENOMEM on error (broken entries are skipped and counted)
+ */
+int query_index_build_dir(struct query_index **index, int root_fd, struct batch_loader *loader)
+{
+	double start = monotonic_seconds();
+	struct query_index *result = query_index_new();
+	if (result == NULL)
+		return -ENOMEM;
+
+	struct query_walk walk = {NULL, 0, 0};
+	struct byte_buffer path = {NULL, 0, 0};
+	int res = walk_push(&walk, "", 0);
+	while (res == 0 && walk.count > 0)
+	{
+		char *dir_path = walk.paths[--walk.count];
+		int fd = openat(root_fd, (dir_path[0] != '\0') ? dir_path : ".",
+						O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+		struct catalog_dir dir;
+		if (fd == -1 || catalog_dir_load_batch(fd, true, loader, &dir, &result->errors) != 0)
+		{
+			result->errors++;
+			if (fd != -1)
+				(void)close(fd);
+			free(dir_path);
+			continue;
+		}
+		(void)close(fd);
+
+		for (size_t i = 0; res == 0 && i < dir.count; i++)
+		{
+			const struct catalog_dir_entry *entry = &dir.entries[i];
+			res = join_path(&path, dir_path, entry->name);
+			if (res == 0)
+				res = add_row(result, (const char *)path.data, path.len, &entry->my_stat);
+			if (res == 0 && catalog_dir_entry_is_dir(entry))
+				res = walk_push(&walk, (const char *)path.data, path.len);
+		}
+
+		catalog_dir_free(&dir);
+		free(dir_path);
+	}
+
+	if (res == 0)
+		res = finish_index(result);
+
+	walk_free(&walk);
+	free(path.data);
+	if (res != 0)
+	{
+		query_index_free(result);
+		return res;
+	}
+
+	result->build_seconds = monotonic_seconds() - start;
+	*index = result;
+	return 0;
+}
+
+/**
+ * Context of listing directories of a single-file catalog
+ */
+struct query_db_walk
+{
+	/** Index being built */
+	struct query_index *index;
+
+	/** Stack of directories */
+	struct query_walk *walk;
+
+	/** Path of the listed directory */
+	const char *dir_path;
+
+	/** Buffer of paths */
+	struct byte_buffer *path;
+
+	/** First error */
+	int res;
+};
+
+/**
+ * Add an entry of a single-file catalog (see catalog_db_list_cb)
+ *
+ * @param ctx is the context of the walk
+ * @param name is the name of the entry
+ * @param entry is the entry
+ * @return 0 to continue, nonzero value to stop
+ */
+static int add_db_entry(void *ctx, const char *name, const struct catalog_db_entry *entry)
+{
+	struct query_db_walk *db_walk = (struct query_db_walk *)ctx;
+
+	int res = join_path(db_walk->path, db_walk->dir_path, name);
+	if (res == 0)
+		res = add_row(db_walk->index, (const char *)db_walk->path->data, db_walk->path->len, &entry->my_stat);
+	if (res == 0 && S_ISDIR(entry->my_stat.mode))
+		res = walk_push(db_walk->walk, (const char *)db_walk->path->data, db_walk->path->len);
+
+	db_walk->res = res;
+	return res;
+}
+
+/**
+ * Build an index of a single-file catalog (see catalog_db.h)
+ *
+ * @param index is the new index (must be freed by query_index_free())
+ * @param db is the catalog
+ * @return 0 on success, -ENOMEM on error (directories that fail to be listed are counted)
+ */
+int query_index_build_db(struct query_index **index, struct catalog_db *db)
+{
+	double start = monotonic_seconds();
+	struct query_index *result = query_index_new();
+	if (result == NULL)
+		return -ENOMEM;
+
+	struct query_walk walk = {NULL, 0, 0};
+	struct byte_buffer path = {NULL, 0, 0};
+	int res = walk_push(&walk, "", 0);
+	while (res == 0 && walk.count > 0)
+	{
+		char *dir_path = walk.paths[--walk.count];
+
+		// Subdirectories are only queued by the callback, the catalog is locked while listing
+		struct query_db_walk db_walk = {result, &walk, dir_path, &path, 0};
+		int list_res = catalog_db_list(db, dir_path, add_db_entry, &db_walk);
+		res = db_walk.res;
+		if (res == 0 && list_res != 0)
+			result->errors++;
+
+		free(dir_path);
+	}
+
+	if (res == 0)
+		res = finish_index(result);
+
+	walk_free(&walk);
+	free(path.data);
+	if (res != 0)
+	{
+		query_index_free(result);
+		return res;
+	}
+
+	result->build_seconds = monotonic_seconds() - start;
+	*index = result;
+	return 0;
+}
+
+/**
+ * Free the index
+ *
+ * @param index is the index (can be NULL)
+ */
+void query_index_free(struct query_index *index)
+{
+	if (index == NULL)
+		return;
+
+	free(index->paths.data);
+	free(index->path_offsets);
+	free(index->size);
+	free(index->mtime);
+	free(index->uid);
+	free(index->gid);
+	free(index->ext);
+	free(index->type);
+	free(index->by_size);
+	free(index->by_mtime);
+	free(index->path_slots);
+	free(index->extensions);
+	free(index->ext_slots);
+	free(index);
+}
+
+/**
+ * Get counters of the index
+ *
+ * @param index is the index
+ * @param stats is the target counters
+ */
+void query_index_get_stats(const struct query_index *index, struct query_index_stats *stats)
+{
+	stats->rows = index->count;
+	stats->extensions = index->extensions_count - 1;
+	stats->memory_usage = index->paths.capacity +
+						  index->capacity * (sizeof(uint64_t) + 2 * sizeof(int64_t) + 3 * sizeof(uint32_t) + 1) +
+						  index->count * 2 * sizeof(uint32_t) + (index->path_slots_mask + 1) * sizeof(uint32_t) +
+						  index->extensions_capacity * sizeof(index->extensions[0]) +
+						  (index->ext_slots_mask + 1) * sizeof(uint32_t);
+	stats->errors = index->errors;
+	stats->build_seconds = index->build_seconds;
+}
+
+/**
+ * Get the number of rows of the index
+ *
+ * @param index is the index
+ * @return the number of rows
+ */
+size_t query_index_count(const struct query_index *index)
+{
+	return index->count;
+}
+
+/**
+ * Get the relative path of a row
+ *
+ * @param index is the index
+ * @param row is the row
+ * @return the path (valid until the index is freed)
+ */
+const char *query_index_path(const struct query_index *index, uint32_t row)
+{
+	return (const char *)index->paths.data + index->path_offsets[row];
+}
+
+/**
+ * Find the row of a path
+ *
+ * @param index is the index
+ * @param path is the relative path (without leading slashes)
+ * @param row is the found row
+ * @return 0 on success, -ENOENT if the path is not indexed
+ */
+int query_index_find(const struct query_index *index, const char *path, uint32_t *row)
+{
+	for (size_t slot = hash_string(path, strlen(path)) & index->path_slots_mask;;
+		 slot = (slot + 1) & index->path_slots_mask)
+	{
+		uint32_t found = index->path_slots[slot];
+		if (found == QUERY_INDEX_EMPTY_SLOT)
+			return -ENOENT;
+		if (strcmp(query_index_path(index, found), path) == 0)
+		{
+			*row = found;
+			return 0;
+		}
+	}
+}
+
+/**
+ * Predicate resolved against an index
+ */
+struct compiled_predicate
+{
+	/** Field */
+	enum query_field field;
+
+	/** Minimum value (inclusive) */
+	int64_t min;
+
+	/** Maximum value (inclusive) */
+	int64_t max;
+
+	/** The value must be outside of the range */
+	uint8_t negate;
+};
+
+/**
+ * Resolve extensions of predicates to ids of the index
+ *
+ * @param index is the index
+ * @param query is the query
+ * @param compiled is the target array of QUERY_MAX_PREDICATES predicates
+ */
+static void compile_query(const struct query_index *index, const struct query *query,
+						  struct compiled_predicate *compiled)
+{
+	for (size_t i = 0; i < query->count; i++)
+	{
+		const struct query_predicate *predicate = &query->predicates[i];
+		compiled[i].field = predicate->field;
+		compiled[i].min = predicate->min;
+		compiled[i].max = predicate->max;
+		compiled[i].negate = (predicate->negate) ? 1 : 0;
+		if (predicate->field == QUERY_FIELD_EXT)
+			compiled[i].min = compiled[i].max = find_extension(index, predicate->ext);
+	}
+}
+
+/**
+ * Get the value of a field of a row
+ *
+ * @param index is the index
+ * @param field is the field
+ * @param row is the row
+ * @return the value
+ */
+static int64_t get_value(const struct query_index *index, enum query_field field, uint32_t row)
+{
+	switch (field)
+	{
+	case QUERY_FIELD_SIZE:
+		return index->size[row];
+	case QUERY_FIELD_MTIME:
+		return index->mtime[row];
+	case QUERY_FIELD_UID:
+		return index->uid[row];
+	case QUERY_FIELD_GID:
+		return index->gid[row];
+	case QUERY_FIELD_EXT:
+		return index->ext[row];
+	case QUERY_FIELD_TYPE:
+		return index->type[row];
+	}
+	return 0;
+}
+
+/**
+ * Check if the row matches compiled predicates
+ *
+ * @param index is the index
+ * @param compiled is the array of predicates
+ * @param count is the number of predicates
+ * @param row is the row
+ * @return true if all predicates match
+ */
+static bool match_row(const struct query_index *index, const struct compiled_predicate *compiled, size_t count,
+					  uint32_t row)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		int64_t value = get_value(index, compiled[i].field, row);
+		bool inside = (value >= compiled[i].min && value <= compiled[i].max);
+		if (inside == (compiled[i].negate != 0))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Check if the row matches the query
+ *
+ * @param index is the index
+ * @param query is the query
+ * @param row is the row
+ * @return true if all predicates match
+ */
+bool query_index_match(const struct query_index *index, const struct query *query, uint32_t row)
+{
+	struct compiled_predicate compiled[QUERY_MAX_PREDICATES];
+	compile_query(index, query, compiled);
+	return match_row(index, compiled, query->count, row);
+}
+
+/*
+ * Scans of a block of a column: every loop is branchless over plain arrays,
+ * so the compiler turns it into SIMD compares and ands.
+ */
+
+/**
+ * Narrow the mask of a block by a column of int64_t values
+ *
+ * @param values is the column at the first row of the block
+ * @param count is the number of rows
+ * @param predicate is the predicate
+ * @param mask is the mask of the block
+ */
+static void scan_int64(const int64_t *values, size_t count, const struct compiled_predicate *predicate, uint8_t *mask)
+{
+	const int64_t min = predicate->min;
+	const int64_t max = predicate->max;
+	const uint8_t negate = predicate->negate;
+	for (size_t i = 0; i < count; i++)
+	{
+		mask[i] &= (uint8_t)((uint8_t)((values[i] >= min) & (values[i] <= max)) ^ negate);
+	}
+}
+
+/**
+ * Narrow the mask of a block by a column of uint32_t values
+ *
+ * @param values is the column at the first row of the block
+ * @param count is the number of rows
+ * @param predicate is the predicate
+ * @param mask is the mask of the block
+ */
+static void scan_uint32(const uint32_t *values, size_t count, const struct compiled_predicate *predicate,
+						uint8_t *mask)
+{
+	// The range is clamped to values of the column, an empty range is min > max
+	const uint32_t min = (predicate->min < 0) ? 0 : (predicate->min > UINT32_MAX) ? UINT32_MAX : (uint32_t)predicate->min;
+	const uint32_t max = (predicate->max > UINT32_MAX) ? UINT32_MAX : (predicate->max < 0) ? 0 : (uint32_t)predicate->max;
+	const bool empty = (predicate->min > predicate->max || predicate->max < 0 || predicate->min > UINT32_MAX);
+	const uint8_t negate = predicate->negate;
+	if (empty)
+	{
+		if (negate == 0)
+			memset(mask, 0, count);
+		return;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		mask[i] &= (uint8_t)((uint8_t)((values[i] >= min) & (values[i] <= max)) ^ negate);
+	}
+}
+
+/**
+ * Narrow the mask of a block by a column of uint8_t values
+ *
+ * @param values is the column at the first row of the block
+ * @param count is the number of rows
+ * @param predicate is the predicate
+ * @param mask is the mask of the block
+ */
+static void scan_uint8(const uint8_t *values, size_t count, const struct compiled_predicate *predicate, uint8_t *mask)
+{
+	const bool empty = (predicate->min > predicate->max || predicate->max < 0 || predicate->min > UINT8_MAX);
+	const uint8_t min = (predicate->min < 0) ? 0 : (predicate->min > UINT8_MAX) ? UINT8_MAX : (uint8_t)predicate->min;
+	const uint8_t max = (predicate->max > UINT8_MAX) ? UINT8_MAX : (predicate->max < 0) ? 0 : (uint8_t)predicate->max;
+	const uint8_t negate = predicate->negate;
+	if (empty)
+	{
+		if (negate == 0)
+			memset(mask, 0, count);
+		return;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		mask[i] &= (uint8_t)((uint8_t)((values[i] >= min) & (values[i] <= max)) ^ negate);
+	}
+}
+
+/**
+ * Find the first position of the sorted index with a value not less than the value
+ *
+ * @param rows is the sorted index
+ * @param values is the column
+ * @param count is the number of rows
+ * @param value is the value
+ * @param after determines if the first value greater than the value is searched instead
+ * @return the position
+ */
+static size_t search_sorted(const uint32_t *rows, const int64_t *values, size_t count, int64_t value, bool after)
+{
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int64_t current = values[rows[mid]];
+		if (current < value || (after && current == value))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Append a row to the results
+ *
+ * @param rows is the array of rows
+ * @param count is the number of rows
+ * @param capacity is the allocated size of the array
+ * @param row is the row
+ * @return 0 on success, -ENOMEM on error
+ */
+static int append_result(uint32_t **rows, size_t *count, size_t *capacity, uint32_t row)
+{
+	if (*count == *capacity)
+	{
+		size_t new_capacity = (*capacity == 0) ? 256 : *capacity * 2;
+		uint32_t *new_rows = (uint32_t *)realloc(*rows, new_capacity * sizeof(uint32_t));
+		if (new_rows == NULL)
+			return -ENOMEM;
+		*rows = new_rows;
+		*capacity = new_capacity;
+	}
+
+	(*rows)[(*count)++] = row;
+	return 0;
+}
+
+/**
+ * Find all rows matching the query
+ *
+ * @param index is the index
+ * @param query is the query
+ * @param rows is the array of found rows sorted by paths (must be freed by the caller)
+ * @param count is the number of found rows
+ * @return 0 on success, -ENOMEM on error
+ */
+int query_index_run(const struct query_index *index, const struct query *query, uint32_t **rows, size_t *count)
+{
+	struct compiled_predicate compiled[QUERY_MAX_PREDICATES];
+	compile_query(index, query, compiled);
+
+	// The most selective range of a sorted index
+	const uint32_t *best_rows = NULL;
+	size_t best_start = 0;
+	size_t best_end = index->count;
+	for (size_t i = 0; i < query->count; i++)
+	{
+		const struct compiled_predicate *predicate = &compiled[i];
+		if (predicate->negate || (predicate->field != QUERY_FIELD_SIZE && predicate->field != QUERY_FIELD_MTIME))
+			continue;
+
+		const uint32_t *sorted = (predicate->field == QUERY_FIELD_SIZE) ? index->by_size : index->by_mtime;
+		const int64_t *values = (predicate->field == QUERY_FIELD_SIZE) ? index->size : index->mtime;
+		size_t start = search_sorted(sorted, values, index->count, predicate->min, false);
+		size_t end = (predicate->min > predicate->max) ? start
+													   : search_sorted(sorted, values, index->count, predicate->max, true);
+		if (end < start)
+			end = start;
+		if (end - start < best_end - best_start)
+		{
+			best_rows = sorted;
+			best_start = start;
+			best_end = end;
+		}
+	}
+
+	uint32_t *results = NULL;
+	size_t results_count = 0;
+	size_t results_capacity = 0;
+	int res = 0;
+
+	bool use_sorted = (best_rows != NULL && (best_end - best_start) * QUERY_INDEX_SCAN_RATIO < index->count);
+	if (use_sorted)
+	{
+		for (size_t i = best_start; res == 0 && i < best_end; i++)
+		{
+			if (match_row(index, compiled, query->count, best_rows[i]))
+				res = append_result(&results, &results_count, &results_capacity, best_rows[i]);
+		}
+	}
+	else
+	{
+		uint8_t mask[QUERY_INDEX_BLOCK_ROWS];
+		for (size_t block = 0; res == 0 && block < index->count; block += QUERY_INDEX_BLOCK_ROWS)
+		{
+			size_t block_count = index->count - block;
+			if (block_count > QUERY_INDEX_BLOCK_ROWS)
+				block_count = QUERY_INDEX_BLOCK_ROWS;
+			memset(mask, 1, block_count);
+
+			for (size_t i = 0; i < query->count; i++)
+			{
+				const struct compiled_predicate *predicate = &compiled[i];
+				switch (predicate->field)
+				{
+				case QUERY_FIELD_SIZE:
+					scan_int64(index->size + block, block_count, predicate, mask);
+					break;
+				case QUERY_FIELD_MTIME:
+					scan_int64(index->mtime + block, block_count, predicate, mask);
+					break;
+				case QUERY_FIELD_UID:
+					scan_uint32(index->uid + block, block_count, predicate, mask);
+					break;
+				case QUERY_FIELD_GID:
+					scan_uint32(index->gid + block, block_count, predicate, mask);
+					break;
+				case QUERY_FIELD_EXT:
+					scan_uint32(index->ext + block, block_count, predicate, mask);
+					break;
+				case QUERY_FIELD_TYPE:
+					scan_uint8(index->type + block, block_count, predicate, mask);
+					break;
+				}
+			}
+
+			for (size_t i = 0; res == 0 && i < block_count; i++)
+			{
+				if (mask[i])
+					res = append_result(&results, &results_count, &results_capacity, (uint32_t)(block + i));
+			}
+		}
+	}
+
+	if (res != 0)
+	{
+		free(results);
+		return res;
+	}
+
+	// Rows are numbered in the order of paths, scans already find them sorted
+	if (use_sorted)
+		qsort(results, results_count, sizeof(uint32_t), compare_rows);
+	*rows = results;
+	*count = results_count;
+	return 0;
+}
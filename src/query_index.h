@@ -0,0 +1,236 @@
+#ifndef INC_CATALOGFS_QUERY_INDEX_H
+#define INC_CATALOGFS_QUERY_INDEX_H
+
+#include "header_common.h"
+
+#include "filestat.h"
+
+// Forward declarations
+struct batch_loader;
+struct catalog_db;
+
+/**
+ * Columnar index of metadata of a catalog for range queries.
+ *
+ * Questions like "files over 1 GiB not modified since 2015" would otherwise
+ * mean a walk over every index file of the catalog. The index keeps one row
+ * per entry with its metadata in columns (arrays of sizes, mtimes, owners,
+ * groups, ids of extensions and types) and two secondary indexes: row
+ * numbers sorted by size and by mtime.
+ *
+ * A query is a conjunction of predicates "<field><op><value>":
+ *
+ *   size>1G  mtime<2015  uid=1000  ext=flac  type=dir  gid!=0
+ *
+ *  - fields: size, mtime, uid, gid, ext (extension of the name, lowercase,
+ *    empty for names without extensions) and type (file, dir or symlink);
+ *  - operators: <, <=, >, >=, = and !=;
+ *  - sizes take suffixes K, M, G, T and P (powers of 1024);
+ *  - times are @<seconds> or dates in UTC: YYYY, YYYY-MM or YYYY-MM-DD,
+ *    a date is its whole period, so mtime<2015 is before 2015-01-01 and
+ *    mtime>2015 is since 2016-01-01.
+ *
+ * If a predicate on size or mtime selects less than 1/QUERY_INDEX_SCAN_RATIO
+ * of rows, the rows are taken from the sorted index by binary search and only
+ * they are checked. Otherwise all columns of the query are scanned in blocks
+ * of QUERY_INDEX_BLOCK_ROWS rows with branchless loops that the compiler
+ * vectorizes, every predicate narrowing a mask of the block.
+ *
+ * An index is a snapshot: it's built once and never changed, so it can be read
+ * by any number of threads without locks.
+ */
+
+/** Maximum number of predicates in a query */
+#define QUERY_MAX_PREDICATES (16)
+
+/** Maximum length of an extension kept by the index (longer ones are not extensions) */
+#define QUERY_MAX_EXTENSION (15)
+
+/** Sorted indexes are used if they select less than 1/QUERY_INDEX_SCAN_RATIO of rows */
+#define QUERY_INDEX_SCAN_RATIO (8)
+
+/** Number of rows scanned at once */
+#define QUERY_INDEX_BLOCK_ROWS (4096)
+
+/**
+ * Field of a predicate
+ */
+enum query_field
+{
+	/** Size in bytes */
+	QUERY_FIELD_SIZE = 0,
+
+	/** Modification time in seconds */
+	QUERY_FIELD_MTIME,
+
+	/** Owner */
+	QUERY_FIELD_UID,
+
+	/** Group */
+	QUERY_FIELD_GID,
+
+	/** Extension of the name */
+	QUERY_FIELD_EXT,
+
+	/** Type of the entry */
+	QUERY_FIELD_TYPE,
+};
+
+/**
+ * Predicate of a query: the value of the field is in [min, max] (or is not, if negated)
+ */
+struct query_predicate
+{
+	/** Field */
+	enum query_field field;
+
+	/** Minimum value (inclusive) */
+	int64_t min;
+
+	/** Maximum value (inclusive) */
+	int64_t max;
+
+	/** The value must be outside of the range */
+	bool negate;
+
+	/** Extension for QUERY_FIELD_EXT (lowercase, empty for names without extensions) */
+	char ext[QUERY_MAX_EXTENSION + 1];
+};
+
+/**
+ * Query: all predicates must match
+ */
+struct query
+{
+	/** Predicates */
+	struct query_predicate predicates[QUERY_MAX_PREDICATES];
+
+	/** Number of predicates */
+	size_t count;
+};
+
+/**
+ * Counters of an index
+ */
+struct query_index_stats
+{
+	/** Number of rows */
+	size_t rows;
+
+	/** Number of distinct extensions */
+	size_t extensions;
+
+	/** Approximate memory usage (in bytes) */
+	size_t memory_usage;
+
+	/** Entries that failed to be read while building */
+	size_t errors;
+
+	/** Time of building in seconds */
+	double build_seconds;
+};
+
+// Forward declaration
+struct query_index;
+
+/**
+ * Parse a predicate ("size>1G")
+ *
+ * @param text is the text of the predicate
+ * @param predicate is the parsed predicate
+ * @return 0 on success, -EINVAL for unknown fields, operators and broken values
+ */
+int query_parse_predicate(const char *text, struct query_predicate *predicate);
+
+/**
+ * Add a parsed predicate to the query
+ *
+ * @param query is the query (zeroed before the first predicate)
+ * @param text is the text of the predicate
+ * @return 0 on success, -EINVAL for broken predicates, -E2BIG if the query is full
+ */
+int query_add_predicate(struct query *query, const char *text);
+
+/**
+ * Build an index of a catalog directory (walks all directories)
+ *
+ * @param index is the new index (must be freed by query_index_free())
+ * @param root_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @return 0 on success, -ENOMEM on error (broken entries are skipped and counted)
+ */
+int query_index_build_dir(struct query_index **index, int root_fd, struct batch_loader *loader);
+
+/**
+ * Build an index of a single-file catalog (see catalog_db.h)
+ *
+ * @param index is the new index (must be freed by query_index_free())
+ * @param db is the catalog
+ * @return 0 on success, -ENOMEM on error (directories that fail to be listed are counted)
+ */
+int query_index_build_db(struct query_index **index, struct catalog_db *db);
+
+/**
+ * Free the index
+ *
+ * @param index is the index (can be NULL)
+ */
+void query_index_free(struct query_index *index);
+
+/**
+ * Get counters of the index
+ *
+ * @param index is the index
+ * @param stats is the target counters
+ */
+void query_index_get_stats(const struct query_index *index, struct query_index_stats *stats);
+
+/**
+ * Get the number of rows of the index
+ *
+ * @param index is the index
+ * @return the number of rows
+ */
+size_t query_index_count(const struct query_index *index);
+
+/**
+ * Get the relative path of a row
+ *
+ * @param index is the index
+ * @param row is the row
+ * @return the path (valid until the index is freed)
+ */
+const char *query_index_path(const struct query_index *index, uint32_t row);
+
+/**
+ * Find the row of a path
+ *
+ * @param index is the index
+ * @param path is the relative path (without leading slashes)
+ * @param row is the found row
+ * @return 0 on success, -ENOENT if the path is not indexed
+ */
+int query_index_find(const struct query_index *index, const char *path, uint32_t *row);
+
+/**
+ * Check if the row matches the query
+ *
+ * @param index is the index
+ * @param query is the query
+ * @param row is the row
+ * @return true if all predicates match
+ */
+bool query_index_match(const struct query_index *index, const struct query *query, uint32_t row);
+
+/**
+ * Find all rows matching the query
+ *
+ * @param index is the index
+ * @param query is the query
+ * @param rows is the array of found rows sorted by paths (must be freed by the caller)
+ * @param count is the number of found rows
+ * @return 0 on success, -ENOMEM on error
+ */
+int query_index_run(const struct query_index *index, const struct query *query, uint32_t **rows, size_t *count);
+
+#endif // INC_CATALOGFS_QUERY_INDEX_H
@@ -0,0 +1,297 @@
+#include "header_common.h"
+
+#include <unistd.h>
+
+#include "sha256.h"
+
+/** Size of the read buffer for hashing files */
+#define SHA256_FILE_BUFFER_SIZE (1024 * 1024)
+
+/** Round constants */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/**
+ * Rotate 32-bit value right
+ *
+ * @param x is the value
+ * @param n is the number of bits
+ * @return rotated value
+ */
+static inline uint32_t sha256_rotr(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * Process one 64-byte block
+ *
+ * @param ctx is the context
+ * @param block is the block to process
+ */
+static void sha256_transform(struct sha256_ctx *ctx, const uint8_t *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t)block[i * 4] << 24) |
+			   ((uint32_t)block[i * 4 + 1] << 16) |
+			   ((uint32_t)block[i * 4 + 2] << 8) |
+			   ((uint32_t)block[i * 4 + 3]);
+	}
+
+	for (int i = 16; i < 64; i++)
+	{
+		uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = ctx->state[0];
+	uint32_t b = ctx->state[1];
+	uint32_t c = ctx->state[2];
+	uint32_t d = ctx->state[3];
+	uint32_t e = ctx->state[4];
+	uint32_t f = ctx->state[5];
+	uint32_t g = ctx->state[6];
+	uint32_t h = ctx->state[7];
+
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t temp1 = h + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t temp2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+/**
+ * Initialize SHA-256 context
+ *
+ * @param ctx is the context to initialize
+ */
+void sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->length = 0;
+	ctx->buffer_len = 0;
+}
+
+/**
+ * Process data with SHA-256
+ *
+ * @param ctx is the context
+ * @param data is the data to process
+ * @param len is the length of data in bytes
+ */
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	ctx->length += len;
+
+	if (ctx->buffer_len > 0)
+	{
+		size_t to_copy = SHA256_BLOCK_SIZE - ctx->buffer_len;
+		if (to_copy > len)
+			to_copy = len;
+
+		memcpy(ctx->buffer + ctx->buffer_len, bytes, to_copy);
+		ctx->buffer_len += to_copy;
+		bytes += to_copy;
+		len -= to_copy;
+
+		if (ctx->buffer_len < SHA256_BLOCK_SIZE)
+			return;
+
+		sha256_transform(ctx, ctx->buffer);
+		ctx->buffer_len = 0;
+	}
+
+	while (len >= SHA256_BLOCK_SIZE)
+	{
+		sha256_transform(ctx, bytes);
+		bytes += SHA256_BLOCK_SIZE;
+		len -= SHA256_BLOCK_SIZE;
+	}
+
+	if (len > 0)
+	{
+		memcpy(ctx->buffer, bytes, len);
+		ctx->buffer_len = len;
+	}
+}
+
+/**
+ * Finish SHA-256 calculation
+ *
+ * @param ctx is the context (can not be used after this call without sha256_init())
+ * @param digest is the target buffer for the digest
+ */
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint64_t bit_length = ctx->length * 8;
+
+	ctx->buffer[ctx->buffer_len++] = 0x80;
+	if (ctx->buffer_len > SHA256_BLOCK_SIZE - 8)
+	{
+		memset(ctx->buffer + ctx->buffer_len, 0, SHA256_BLOCK_SIZE - ctx->buffer_len);
+		sha256_transform(ctx, ctx->buffer);
+		ctx->buffer_len = 0;
+	}
+
+	memset(ctx->buffer + ctx->buffer_len, 0, SHA256_BLOCK_SIZE - 8 - ctx->buffer_len);
+	for (int i = 0; i < 8; i++)
+	{
+		ctx->buffer[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bit_length >> (i * 8));
+	}
+	sha256_transform(ctx, ctx->buffer);
+
+	for (int i = 0; i < 8; i++)
+	{
+		digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)(ctx->state[i]);
+	}
+}
+
+/**
+ * Convert SHA-256 digest to lowercase hex string
+ *
+ * @param digest is the digest
+ * @param hex is the target buffer of (SHA256_DIGEST_SIZE * 2 + 1) chars
+ */
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex)
+{
+	static const char hex_chars[] = "0123456789abcdef";
+
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+	{
+		hex[i * 2] = hex_chars[digest[i] >> 4];
+		hex[i * 2 + 1] = hex_chars[digest[i] & 0x0f];
+	}
+	hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+/**
+ * Get the value of a hex digit
+ *
+ * @param c is the digit
+ * @return the value, -1 for other chars
+ */
+static int hex_digit_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Convert hex string (any case) to SHA-256 digest
+ *
+ * @param hex is the hex string (null-terminated)
+ * @param digest is the target buffer for the digest
+ * @return true if the string is a valid hex digest
+ */
+bool sha256_from_hex(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	if (strlen(hex) != SHA256_DIGEST_SIZE * 2)
+		return false;
+
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+	{
+		int high = hex_digit_value(hex[i * 2]);
+		int low = hex_digit_value(hex[i * 2 + 1]);
+		if (high < 0 || low < 0)
+			return false;
+		digest[i] = (uint8_t)((high << 4) | low);
+	}
+
+	return true;
+}
+
+/**
+ * Calculate SHA-256 of the whole file contents by the file descriptor
+ *
+ * @param fd is the file descriptor (read from the current position to the end)
+ * @param hex is the target buffer of (SHA256_DIGEST_SIZE * 2 + 1) chars
+ * @param bytes_read is the number of read bytes (can be NULL)
+ * @return 0 on success, -errno on error
+ */
+int sha256_fd_hex(int fd, char *hex, uint64_t *bytes_read)
+{
+	uint8_t *buf = (uint8_t *)malloc(SHA256_FILE_BUFFER_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+
+	while (true)
+	{
+		ssize_t res = read(fd, buf, SHA256_FILE_BUFFER_SIZE);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			int errno_stored = errno;
+			free(buf);
+			return -errno_stored;
+		}
+
+		if (res == 0)
+			break;
+
+		sha256_update(&ctx, buf, (size_t)res);
+	}
+
+	free(buf);
+
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	sha256_final(&ctx, digest);
+	sha256_to_hex(digest, hex);
+
+	if (bytes_read != NULL)
+		*bytes_read = ctx.length;
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef INC_CATALOGFS_SHA256_H
+#define INC_CATALOGFS_SHA256_H
+
+#include "header_common.h"
+
+/** Size of SHA-256 digest in bytes */
+#define SHA256_DIGEST_SIZE (32)
+
+/** Size of SHA-256 block in bytes */
+#define SHA256_BLOCK_SIZE (64)
+
+/**
+ * Context of SHA-256 calculation (FIPS 180-4)
+ */
+struct sha256_ctx
+{
+	/** Intermediate hash state */
+	uint32_t state[8];
+
+	/** Total number of processed bytes */
+	uint64_t length;
+
+	/** Buffer for incomplete block */
+	uint8_t buffer[SHA256_BLOCK_SIZE];
+
+	/** Number of bytes in the buffer */
+	size_t buffer_len;
+};
+
+/**
+ * Initialize SHA-256 context
+ *
+ * @param ctx is the context to initialize
+ */
+void sha256_init(struct sha256_ctx *ctx);
+
+/**
+ * Process data with SHA-256
+ *
+ * @param ctx is the context
+ * @param data is the data to process
+ * @param len is the length of data in bytes
+ */
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+
+/**
+ * Finish SHA-256 calculation
+ *
+ * @param ctx is the context (can not be used after this call without sha256_init())
+ * @param digest is the target buffer for the digest
+ */
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Convert SHA-256 digest to lowercase hex string
+ *
+ * @param digest is the digest
+ * @param hex is the target buffer of (SHA256_DIGEST_SIZE * 2 + 1) chars
+ */
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex);
+
+/**
+ * Convert hex string (any case) to SHA-256 digest
+ *
+ * @param hex is the hex string (null-terminated)
+ * @param digest is the target buffer for the digest
+ * @return true if the string is a valid hex digest
+ */
+bool sha256_from_hex(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Calculate SHA-256 of the whole file contents by the file descriptor
+ *
+ * @param fd is the file descriptor (read from the current position to the end)
+ * @param hex is the target buffer of (SHA256_DIGEST_SIZE * 2 + 1) chars
+ * @param bytes_read is the number of read bytes (can be NULL)
+ * @return 0 on success, -errno on error
+ */
+int sha256_fd_hex(int fd, char *hex, uint64_t *bytes_read);
+
+#endif // INC_CATALOGFS_SHA256_H
@@ -0,0 +1,644 @@
+#include "header_common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "source_watch.h"
+#include "path_hash.h"
+
+/** Events of every watched directory */
+#define SOURCE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+						   IN_DELETE_SELF | IN_MOVE_SELF | IN_EXCL_UNLINK | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/**
+ * Watcher of the source directory
+ */
+struct source_watch
+{
+	/** Descriptor of the source directory (owned) */
+	int source_fd;
+
+	/** Descriptor of inotify */
+	int inotify_fd;
+
+	/** Pipe to wake up the thread on stop */
+	int stop_pipe[2];
+
+	/** Relative paths of watched directories by their watch descriptors (used only by the thread after the start) */
+	char **paths;
+
+	/** Size of the array of paths */
+	size_t paths_size;
+
+	/** Function called with every batch of changes */
+	source_watch_changes_t notify;
+
+	/** Context of notify */
+	void *notify_ctx;
+
+	/** Thread that reads events */
+	pthread_t thread;
+
+	/** Lock of everything below */
+	pthread_mutex_t lock;
+
+	/** Queued changes: relative path -> kind + 1 */
+	struct path_hash pending;
+
+	/** Changes were queued since the last take (also read without the lock) */
+	bool changed;
+
+	/** Counters */
+	struct source_watch_stats stats;
+};
+
+/**
+ * Merge a change into a table of changes (the higher kind of a path wins)
+ *
+ * @param table is the table: relative path -> kind + 1
+ * @param relpath is the relative path
+ * @param relpath_len is the length of the relative path
+ * @param kind is the kind of the change
+ * @return 0 on success, -ENOMEM on error
+ */
+static int merge_change(struct path_hash *table, const char *relpath, size_t relpath_len, enum source_watch_kind kind)
+{
+	uintptr_t old = (uintptr_t)path_hash_get(table, relpath, relpath_len);
+	if (old > (uintptr_t)kind)
+		return 0;
+
+	return path_hash_put(table, relpath, relpath_len, (void *)((uintptr_t)kind + 1), NULL);
+}
+
+/**
+ * Replace all changes with the change of the whole tree
+ *
+ * @param table is the table: relative path -> kind + 1
+ */
+static void collapse_changes(struct path_hash *table)
+{
+	path_hash_clear(table, NULL);
+	(void)path_hash_put(table, "", 0, (void *)((uintptr_t)SOURCE_WATCH_TREE + 1), NULL);
+}
+
+/**
+ * Check if the table already contains the change of the whole tree
+ *
+ * @param table is the table: relative path -> kind + 1
+ * @return true if every other change is included
+ */
+static bool has_root_tree_change(const struct path_hash *table)
+{
+	return (uintptr_t)path_hash_get(table, "", 0) == (uintptr_t)SOURCE_WATCH_TREE + 1;
+}
+
+/**
+ * Array of changes being built from a table
+ */
+struct changes_array
+{
+	/** Changes (paths point to keys of the table) */
+	struct source_watch_change *changes;
+
+	/** Number of changes */
+	size_t count;
+};
+
+/**
+ * Add a change of the table to the array
+ *
+ * @param key is the relative path
+ * @param key_len is the length of the relative path
+ * @param value is the kind + 1
+ * @param arg is the array
+ * @return 0
+ */
+static int add_to_array(const char *key, size_t key_len, void *value, void *arg)
+{
+	(void)key_len;
+	struct changes_array *array = (struct changes_array *)arg;
+	array->changes[array->count].relpath = key;
+	array->changes[array->count].kind = (enum source_watch_kind)((uintptr_t)value - 1);
+	array->count++;
+	return 0;
+}
+
+/**
+ * Pass all changes of the table to the function
+ *
+ * @param table is the table: relative path -> kind + 1
+ * @param func is the function
+ * @param ctx is the context of the function
+ * @return number of changes
+ */
+static size_t call_with_changes(const struct path_hash *table, source_watch_changes_t func, void *ctx)
+{
+	if (table->count == 0)
+		return 0;
+
+	struct changes_array array = {.changes = NULL, .count = 0};
+	array.changes = (struct source_watch_change *)malloc(table->count * sizeof(struct source_watch_change));
+	if (array.changes == NULL)
+	{
+		// Nothing may be missed, so everything is reported
+		struct source_watch_change root = {.relpath = "", .kind = SOURCE_WATCH_TREE};
+		func(ctx, &root, 1);
+		return 1;
+	}
+
+	(void)path_hash_for_each(table, add_to_array, &array);
+	func(ctx, array.changes, array.count);
+	free(array.changes);
+	return array.count;
+}
+
+/**
+ * Remember the relative path of a watch descriptor
+ *
+ * @param watch is the watcher
+ * @param wd is the watch descriptor
+ * @param relpath is the relative path of the directory
+ * @return 0 on success, -ENOMEM on error
+ */
+static int set_watch_path(struct source_watch *watch, int wd, const char *relpath)
+{
+	size_t index = (size_t)wd;
+	if (index >= watch->paths_size)
+	{
+		size_t new_size = (watch->paths_size == 0) ? 1024 : watch->paths_size;
+		while (new_size <= index)
+			new_size *= 2;
+
+		char **new_paths = (char **)realloc(watch->paths, new_size * sizeof(char *));
+		if (new_paths == NULL)
+			return -ENOMEM;
+
+		memset(new_paths + watch->paths_size, 0, (new_size - watch->paths_size) * sizeof(char *));
+		watch->paths = new_paths;
+		watch->paths_size = new_size;
+	}
+
+	// The same directory watched again (e.g. after an overflow) keeps its descriptor
+	if (watch->paths[index] != NULL && strcmp(watch->paths[index], relpath) == 0)
+		return 0;
+
+	char *copy = strdup(relpath);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	if (watch->paths[index] == NULL)
+		__atomic_add_fetch(&watch->stats.watches, 1, __ATOMIC_RELAXED);
+	free(watch->paths[index]);
+	watch->paths[index] = copy;
+	return 0;
+}
+
+/**
+ * Forget the relative path of a watch descriptor
+ *
+ * @param watch is the watcher
+ * @param wd is the watch descriptor
+ */
+static void clear_watch_path(struct source_watch *watch, int wd)
+{
+	if (wd < 0 || (size_t)wd >= watch->paths_size || watch->paths[wd] == NULL)
+		return;
+
+	free(watch->paths[wd]);
+	watch->paths[wd] = NULL;
+	__atomic_sub_fetch(&watch->stats.watches, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Watch a directory and all directories under it
+ *
+ * @param watch is the watcher
+ * @param relpath is the buffer of PATH_MAX bytes with the relative path of the directory (changed and restored)
+ * @param relpath_len is the length of the relative path
+ * @return 0 on success (also if the directory is already gone), -ENOSPC if watches are exhausted,
+ *         other negative value (mostly -errno) on error
+ */
+static int watch_tree(struct source_watch *watch, char *relpath, size_t relpath_len)
+{
+	// The source can be under the mountpoint, so it's never reached by its path
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", watch->source_fd, relpath);
+	if (len < 0 || (size_t)len >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	int wd = inotify_add_watch(watch->inotify_fd, path, SOURCE_WATCH_MASK);
+	if (wd == -1)
+		return (errno == ENOENT || errno == ENOTDIR) ? 0 : -errno;
+
+	int res = set_watch_path(watch, wd, relpath);
+	if (res != 0)
+		return res;
+
+	// Directories created from now on are reported by the new watch, existing ones are watched here
+	int dir_fd = openat(watch->source_fd, (relpath_len == 0) ? "." : relpath,
+						O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dir_fd == -1)
+		return (errno == ENOENT || errno == ENOTDIR) ? 0 : -errno;
+
+	DIR *dir = fdopendir(dir_fd);
+	if (dir == NULL)
+	{
+		int errno_stored = errno;
+		(void)close(dir_fd);
+		return -errno_stored;
+	}
+
+	struct dirent *entry;
+	while (res == 0 && (entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+			continue;
+
+		if (entry->d_type == DT_UNKNOWN)
+		{
+			struct stat stbuf;
+			if (fstatat(dirfd(dir), entry->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(stbuf.st_mode))
+				continue;
+		}
+
+		size_t name_len = strlen(entry->d_name);
+		size_t child_len = (relpath_len == 0) ? name_len : relpath_len + 1 + name_len;
+		if (child_len >= PATH_MAX)
+		{
+			res = -ENAMETOOLONG;
+			break;
+		}
+
+		char *name_pos = relpath + relpath_len;
+		if (relpath_len != 0)
+			*name_pos++ = '/';
+		memcpy(name_pos, entry->d_name, name_len + 1);
+
+		res = watch_tree(watch, relpath, child_len);
+		relpath[relpath_len] = '\0';
+	}
+
+	(void)closedir(dir);
+	return res;
+}
+
+/**
+ * Watch a new directory with its subtree (errors are counted)
+ *
+ * @param watch is the watcher
+ * @param relpath is the relative path of the directory
+ */
+static void watch_new_tree(struct source_watch *watch, const char *relpath)
+{
+	char buffer[PATH_MAX];
+	size_t len = strlen(relpath);
+	int res = -ENAMETOOLONG;
+	if (len < sizeof(buffer))
+	{
+		memcpy(buffer, relpath, len + 1);
+		res = watch_tree(watch, buffer, len);
+	}
+
+	if (res != 0)
+	{
+		pthread_mutex_lock(&watch->lock);
+		watch->stats.errors++;
+		pthread_mutex_unlock(&watch->lock);
+	}
+}
+
+/**
+ * Stop watching a directory moved away and all directories under it
+ *
+ * @param watch is the watcher
+ * @param relpath is the old relative path of the directory
+ */
+static void unwatch_tree(struct source_watch *watch, const char *relpath)
+{
+	size_t len = strlen(relpath);
+	for (size_t wd = 0; wd < watch->paths_size; wd++)
+	{
+		const char *path = watch->paths[wd];
+		if (path == NULL || strncmp(path, relpath, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+			continue;
+
+		// Events already queued for the descriptor are dropped with its path
+		(void)inotify_rm_watch(watch->inotify_fd, (int)wd);
+		clear_watch_path(watch, (int)wd);
+	}
+}
+
+/**
+ * Turn an event into changes of the batch
+ *
+ * @param watch is the watcher
+ * @param event is the event
+ * @param batch is the table of changes of the batch
+ * @return 0 on success, -ENOMEM on error
+ */
+static int handle_event(struct source_watch *watch, const struct inotify_event *event, struct path_hash *batch)
+{
+	if ((event->mask & IN_Q_OVERFLOW) != 0)
+	{
+		// Events were lost: the whole tree is changed and new directories may be not watched yet
+		pthread_mutex_lock(&watch->lock);
+		watch->stats.overflows++;
+		pthread_mutex_unlock(&watch->lock);
+		watch_new_tree(watch, "");
+		collapse_changes(batch);
+		return 0;
+	}
+
+	if (event->wd < 0 || (size_t)event->wd >= watch->paths_size || watch->paths[event->wd] == NULL)
+		return 0;
+
+	if ((event->mask & IN_IGNORED) != 0)
+	{
+		clear_watch_path(watch, event->wd);
+		return 0;
+	}
+
+	const char *dir_path = watch->paths[event->wd];
+	if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0)
+		return merge_change(batch, dir_path, strlen(dir_path), SOURCE_WATCH_TREE);
+
+	char path[PATH_MAX];
+	int len = (event->len == 0 || event->name[0] == '\0')
+				  ? snprintf(path, sizeof(path), "%s", dir_path)
+				  : snprintf(path, sizeof(path), (dir_path[0] == '\0') ? "%s%s" : "%s/%s", dir_path, event->name);
+	if (len < 0 || (size_t)len >= sizeof(path))
+		return 0;
+
+	enum source_watch_kind kind = SOURCE_WATCH_ENTRY;
+	if ((event->mask & IN_ISDIR) != 0 && (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+	{
+		watch_new_tree(watch, path);
+		kind = SOURCE_WATCH_TREE;
+	}
+	else if ((event->mask & IN_ISDIR) != 0 && (event->mask & IN_MOVED_FROM) != 0)
+	{
+		unwatch_tree(watch, path);
+		kind = SOURCE_WATCH_TREE;
+	}
+	else if ((event->mask & IN_ISDIR) != 0 && (event->mask & IN_DELETE) != 0)
+	{
+		kind = SOURCE_WATCH_TREE;
+	}
+	else if ((event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) != 0)
+	{
+		kind = SOURCE_WATCH_NAME;
+	}
+
+	return merge_change(batch, path, (size_t)len, kind);
+}
+
+/**
+ * Queue the batch for source_watch_take()
+ *
+ * @param key is the relative path
+ * @param key_len is the length of the relative path
+ * @param value is the kind + 1
+ * @param arg is the watcher (locked)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int queue_change(const char *key, size_t key_len, void *value, void *arg)
+{
+	struct source_watch *watch = (struct source_watch *)arg;
+	return merge_change(&watch->pending, key, key_len, (enum source_watch_kind)((uintptr_t)value - 1));
+}
+
+/**
+ * Queue the batch and pass it to the notify callback
+ *
+ * @param watch is the watcher
+ * @param batch is the table of changes of the batch
+ * @param events is the number of events of the batch
+ */
+static void publish_batch(struct source_watch *watch, struct path_hash *batch, uint64_t events)
+{
+	pthread_mutex_lock(&watch->lock);
+	watch->stats.events += events;
+	watch->stats.changes += batch->count;
+	if (!has_root_tree_change(&watch->pending))
+	{
+		if (has_root_tree_change(batch) ||
+			path_hash_for_each(batch, queue_change, watch) != 0 ||
+			watch->pending.count > SOURCE_WATCH_MAX_PENDING)
+		{
+			collapse_changes(&watch->pending);
+		}
+	}
+	__atomic_store_n(&watch->changed, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&watch->lock);
+
+	// The kernel looks paths up again right after the notify, so they are queued before it
+	if (watch->notify != NULL)
+		(void)call_with_changes(batch, watch->notify, watch->notify_ctx);
+
+	path_hash_clear(batch, NULL);
+}
+
+/**
+ * Read events until the watcher is stopped
+ *
+ * @param arg is the watcher
+ * @return NULL
+ */
+static void *source_watch_thread(void *arg)
+{
+	struct source_watch *watch = (struct source_watch *)arg;
+
+	char *buffer = (char *)malloc(SOURCE_WATCH_BUFFER_SIZE);
+	if (buffer == NULL)
+		return NULL;
+
+	struct path_hash batch;
+	path_hash_init(&batch);
+
+	while (true)
+	{
+		struct pollfd fds[2] = {
+			{.fd = watch->inotify_fd, .events = POLLIN, .revents = 0},
+			{.fd = watch->stop_pipe[0], .events = POLLIN, .revents = 0},
+		};
+
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents != 0)
+			break;
+
+		ssize_t size = read(watch->inotify_fd, buffer, SOURCE_WATCH_BUFFER_SIZE);
+		if (size <= 0)
+		{
+			if (size == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			break;
+		}
+
+		uint64_t events = 0;
+		for (char *pos = buffer; pos < buffer + size;)
+		{
+			struct inotify_event *event = (struct inotify_event *)pos;
+			if (handle_event(watch, event, &batch) != 0)
+				collapse_changes(&batch);
+			pos += sizeof(struct inotify_event) + event->len;
+			events++;
+		}
+
+		if (batch.count > 0)
+			publish_batch(watch, &batch, events);
+	}
+
+	path_hash_clear(&batch, NULL);
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Free the watcher (the thread must not run)
+ *
+ * @param watch is the watcher
+ */
+static void source_watch_free(struct source_watch *watch)
+{
+	for (size_t wd = 0; wd < watch->paths_size; wd++)
+		free(watch->paths[wd]);
+	free(watch->paths);
+
+	path_hash_clear(&watch->pending, NULL);
+	(void)close(watch->inotify_fd);
+	(void)close(watch->stop_pipe[0]);
+	(void)close(watch->stop_pipe[1]);
+	(void)close(watch->source_fd);
+	pthread_mutex_destroy(&watch->lock);
+	free(watch);
+}
+
+/**
+ * Watch the whole source directory and start the thread that reads events
+ *
+ * @param watch is the new watcher (must be stopped by source_watch_stop())
+ * @param source_fd is the descriptor of the source directory (not closed, the watcher uses its duplicate)
+ * @param notify is called by the thread with every batch of changes after it is queued (can be NULL)
+ * @param ctx is the context of notify
+ * @return 0 on success, -ENOSPC if there are more directories than allowed watches,
+ *         other negative value (mostly -errno) on error
+ */
+int source_watch_start(struct source_watch **watch, int source_fd, source_watch_changes_t notify, void *ctx)
+{
+	struct source_watch *new_watch = (struct source_watch *)calloc(1, sizeof(struct source_watch));
+	if (new_watch == NULL)
+		return -ENOMEM;
+
+	new_watch->notify = notify;
+	new_watch->notify_ctx = ctx;
+	new_watch->inotify_fd = -1;
+	new_watch->stop_pipe[0] = -1;
+	new_watch->stop_pipe[1] = -1;
+	path_hash_init(&new_watch->pending);
+
+	if (pthread_mutex_init(&new_watch->lock, NULL) != 0)
+	{
+		free(new_watch);
+		return -ENOMEM;
+	}
+
+	new_watch->source_fd = fcntl(source_fd, F_DUPFD_CLOEXEC, 0);
+	if (new_watch->source_fd == -1 ||
+		(new_watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+		pipe2(new_watch->stop_pipe, O_CLOEXEC) == -1)
+	{
+		int errno_stored = errno;
+		source_watch_free(new_watch);
+		return -errno_stored;
+	}
+
+	// Everything is watched before the start returns, so no change after it is missed
+	char relpath[PATH_MAX] = "";
+	int res = watch_tree(new_watch, relpath, 0);
+	if (res != 0)
+	{
+		source_watch_free(new_watch);
+		return res;
+	}
+
+	if (pthread_create(&new_watch->thread, NULL, source_watch_thread, new_watch) != 0)
+	{
+		source_watch_free(new_watch);
+		return -EAGAIN;
+	}
+
+	*watch = new_watch;
+	return 0;
+}
+
+/**
+ * Take changes queued since the previous call
+ *
+ * @param watch is the watcher (can be NULL)
+ * @param apply is called with the changes (if there are any)
+ * @param ctx is the context of apply
+ * @return number of taken changes
+ */
+size_t source_watch_take(struct source_watch *watch, source_watch_changes_t apply, void *ctx)
+{
+	if (watch == NULL || !__atomic_load_n(&watch->changed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&watch->lock);
+	struct path_hash taken = watch->pending;
+	path_hash_init(&watch->pending);
+	__atomic_store_n(&watch->changed, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&watch->lock);
+
+	size_t count = call_with_changes(&taken, apply, ctx);
+	path_hash_clear(&taken, NULL);
+	return count;
+}
+
+/**
+ * Get counters of the watcher
+ *
+ * @param watch is the watcher
+ * @param stats is the target counters
+ */
+void source_watch_get_stats(struct source_watch *watch, struct source_watch_stats *stats)
+{
+	pthread_mutex_lock(&watch->lock);
+	*stats = watch->stats;
+	stats->watches = __atomic_load_n(&watch->stats.watches, __ATOMIC_RELAXED);
+	stats->pending = watch->pending.count;
+	pthread_mutex_unlock(&watch->lock);
+}
+
+/**
+ * Stop the thread and remove all watches
+ *
+ * @param watch is the watcher (can be NULL)
+ */
+void source_watch_stop(struct source_watch *watch)
+{
+	if (watch == NULL)
+		return;
+
+	char byte = 0;
+	while (write(watch->stop_pipe[1], &byte, 1) == -1 && errno == EINTR)
+	{
+	}
+
+	pthread_join(watch->thread, NULL);
+	source_watch_free(watch);
+}
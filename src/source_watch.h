@@ -0,0 +1,137 @@
+#ifndef INC_CATALOGFS_SOURCE_WATCH_H
+#define INC_CATALOGFS_SOURCE_WATCH_H
+
+#include "header_common.h"
+
+/**
+ * Watcher of changes made directly in the source directory (by a lister,
+ * catalogfs-index or a sync of the catalog) while it is mounted.
+ *
+ * Caches of the filesystem and of the kernel are safe only as long as
+ * nothing but the filesystem changes the source, otherwise they have to be
+ * revalidated all the time. The watcher puts an inotify watch on every
+ * directory of the source, so every change is reported as soon as it is
+ * made: a background thread reads events in batches, turns them into
+ * relative paths of changed entries and
+ *
+ *  - queues them for the thread that owns the caches (see source_watch_take());
+ *  - then passes the same batch to the notify callback (e.g. to invalidate
+ *    caches of the kernel, which can be done from any thread).
+ *
+ * New directories are watched (with their subtrees) as they appear, watches
+ * of removed and moved away directories are dropped. If the kernel drops
+ * events (the inotify queue overflows), the whole tree is reported as changed
+ * and watched again, so nothing is missed.
+ *
+ * inotify needs a watch per directory (fs.inotify.max_user_watches), but
+ * unlike fanotify it needs no privileges and reports names of changed entries.
+ * Changes made on other hosts of network filesystems are not reported.
+ */
+
+/** Size of the buffer of events read at once */
+#define SOURCE_WATCH_BUFFER_SIZE (64 * 1024)
+
+/** Maximum number of changed paths queued for source_watch_take() (more become one change of the tree) */
+#define SOURCE_WATCH_MAX_PENDING (65536)
+
+// Forward declaration
+struct source_watch;
+
+/**
+ * Kinds of changes (a higher kind includes lower ones)
+ */
+enum source_watch_kind
+{
+	/** Metadata or contents of the entry changed */
+	SOURCE_WATCH_ENTRY = 0,
+
+	/** The entry was created or removed (or renamed from or to the path) */
+	SOURCE_WATCH_NAME,
+
+	/** Anything under the path may have changed (directories created, removed or moved, lost events) */
+	SOURCE_WATCH_TREE,
+};
+
+/**
+ * Changed path
+ */
+struct source_watch_change
+{
+	/** Relative path in the source directory (empty for the root) */
+	const char *relpath;
+
+	/** Kind of the change */
+	enum source_watch_kind kind;
+};
+
+/**
+ * Function to handle changes
+ *
+ * @param ctx is the context given to source_watch_start() or source_watch_take()
+ * @param changes is the array of changes (one per path)
+ * @param count is the number of changes
+ */
+typedef void (*source_watch_changes_t)(void *ctx, const struct source_watch_change *changes, size_t count);
+
+/**
+ * Counters of the watcher
+ */
+struct source_watch_stats
+{
+	/** Number of watched directories */
+	size_t watches;
+
+	/** Number of changed paths queued for source_watch_take() */
+	size_t pending;
+
+	/** Number of read events */
+	uint64_t events;
+
+	/** Number of reported changes */
+	uint64_t changes;
+
+	/** Number of overflows of the queue of events (the tree was watched again) */
+	uint64_t overflows;
+
+	/** Number of directories that failed to be watched after the start */
+	uint64_t errors;
+};
+
+/**
+ * Watch the whole source directory and start the thread that reads events
+ *
+ * @param watch is the new watcher (must be stopped by source_watch_stop())
+ * @param source_fd is the descriptor of the source directory (not closed, the watcher uses its duplicate)
+ * @param notify is called by the thread with every batch of changes after it is queued (can be NULL)
+ * @param ctx is the context of notify
+ * @return 0 on success, -ENOSPC if there are more directories than allowed watches,
+ *         other negative value (mostly -errno) on error
+ */
+int source_watch_start(struct source_watch **watch, int source_fd, source_watch_changes_t notify, void *ctx);
+
+/**
+ * Take changes queued since the previous call
+ *
+ * @param watch is the watcher (can be NULL)
+ * @param apply is called with the changes (if there are any)
+ * @param ctx is the context of apply
+ * @return number of taken changes
+ */
+size_t source_watch_take(struct source_watch *watch, source_watch_changes_t apply, void *ctx);
+
+/**
+ * Get counters of the watcher
+ *
+ * @param watch is the watcher
+ * @param stats is the target counters
+ */
+void source_watch_get_stats(struct source_watch *watch, struct source_watch_stats *stats);
+
+/**
+ * Stop the thread and remove all watches
+ *
+ * @param watch is the watcher (can be NULL)
+ */
+void source_watch_stop(struct source_watch *watch);
+
+#endif // INC_CATALOGFS_SOURCE_WATCH_H
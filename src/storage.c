@@ -0,0 +1,414 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+#ifndef ENOATTR
+// Linux reports missing xattrs as ENODATA
+#define ENOATTR ENODATA
+#endif
+
+#include "storage.h"
+
+#include "byte_buffer.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "filestat_parser.h"
+
+/**
+ * Get the storage by its name (as used by command-line options)
+ *
+ * @param name is the name ("text", "sparse" or "xattr")
+ * @param storage is the found storage
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int storage_from_name(const char *name, enum catalog_storage *storage)
+{
+	if (name == NULL || strcmp(name, "text") == 0)
+	{
+		*storage = CATALOG_STORAGE_TEXT;
+		return 0;
+	}
+
+	if (strcmp(name, "sparse") == 0)
+	{
+		*storage = CATALOG_STORAGE_SPARSE;
+		return 0;
+	}
+
+	if (strcmp(name, "xattr") == 0)
+	{
+		*storage = CATALOG_STORAGE_XATTR;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Get the name of the storage
+ *
+ * @param storage is the storage
+ * @return the name (static string)
+ */
+const char *storage_name(enum catalog_storage storage)
+{
+	switch (storage)
+	{
+	case CATALOG_STORAGE_SPARSE:
+		return "sparse";
+	case CATALOG_STORAGE_XATTR:
+		return "xattr";
+	case CATALOG_STORAGE_TEXT:
+	default:
+		return "text";
+	}
+}
+
+/**
+ * Check if the error means that the filesystem does not support xattrs
+ *
+ * @param error is the errno value
+ * @return true if xattrs are not supported
+ */
+static bool is_xattr_unsupported(int error)
+{
+	return error == ENOTSUP || error == EOPNOTSUPP;
+}
+
+/**
+ * Check if the filesystem of the file supports user xattrs
+ *
+ * @param fd is a descriptor of any file or directory of the filesystem (not O_PATH)
+ * @return true if xattrs are supported
+ */
+bool storage_xattr_supported(int fd)
+{
+	// A missing attribute is reported only by filesystems that support them
+	char value;
+	return fgetxattr(fd, STORAGE_XATTR_NAME, &value, sizeof(value)) != -1 || !is_xattr_unsupported(errno);
+}
+
+#ifdef SYS_getxattrat
+#define STORAGE_NR_GETXATTRAT SYS_getxattrat
+#elif defined(__linux__) && !defined(__alpha__)
+// Number of getxattrat() (Linux 6.13) is the same on all architectures, libc headers may not have it yet
+#define STORAGE_NR_GETXATTRAT 464
+#endif
+
+#ifdef STORAGE_NR_GETXATTRAT
+/** Arguments of getxattrat() as defined by the kernel (struct xattr_args) */
+struct storage_xattr_args
+{
+	uint64_t value;
+	uint32_t size;
+	uint32_t flags;
+};
+
+/** Set when the kernel is known not to have getxattrat() */
+static bool getxattrat_missing = false;
+#endif
+
+/**
+ * Get the xattr of the file by the name relative to the directory descriptor
+ * with one system call (getxattrat(), Linux 6.13), older kernels need
+ * to open the file to get its xattr
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param data is the target buffer
+ * @param size is the size of the buffer
+ * @return size of the value, -ENODATA if there is no value (or xattrs are not supported),
+ *         other negative value on error
+ */
+static ssize_t getxattr_at(int dir_fd, const char *name, char *data, size_t size)
+{
+	ssize_t len = -1;
+	int errno_stored = ENOSYS;
+
+#ifdef STORAGE_NR_GETXATTRAT
+	if (!__atomic_load_n(&getxattrat_missing, __ATOMIC_RELAXED))
+	{
+		struct storage_xattr_args args;
+		memset(&args, 0, sizeof(args));
+		args.value = (uint64_t)(uintptr_t)data;
+		args.size = (uint32_t)size;
+
+		len = (ssize_t)syscall(STORAGE_NR_GETXATTRAT, dir_fd, name, AT_SYMLINK_NOFOLLOW,
+							   STORAGE_XATTR_NAME, &args, sizeof(args));
+		errno_stored = errno;
+		if (len == -1 && errno_stored == ENOSYS)
+			__atomic_store_n(&getxattrat_missing, true, __ATOMIC_RELAXED);
+	}
+#endif
+
+	if (len == -1 && errno_stored == ENOSYS)
+	{
+		int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+		if (fd == -1)
+			return -errno;
+
+		len = fgetxattr(fd, STORAGE_XATTR_NAME, data, size);
+		errno_stored = errno;
+		(void)close(fd);
+	}
+
+	if (len == -1)
+		return (errno_stored == ENOATTR || is_xattr_unsupported(errno_stored)) ? -ENODATA : -errno_stored;
+
+	return len;
+}
+
+/**
+ * Check if the index file looks like a sparse one (it has less data
+ * allocated than its size, a filestat record never has)
+ *
+ * @param stbuf is the real stat of the index file
+ * @return true if the file should be read as a sparse one
+ */
+bool storage_is_sparse(const struct stat *stbuf)
+{
+	return S_ISREG(stbuf->st_mode) &&
+		   stbuf->st_size > 0 &&
+		   (int64_t)stbuf->st_blocks * 512 < (int64_t)stbuf->st_size;
+}
+
+/**
+ * Save metadata to an index file in the sparse storage: truncate the file to
+ * the size, apply mode, owner (if permitted), the record xattr and times
+ * (times are the last because the other changes update mtime)
+ *
+ * @param file_fd is the descriptor of the index file (opened for writing)
+ * @param my_stat is the metadata to save
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int storage_save_sparse(int file_fd, const struct filestat *my_stat)
+{
+	if (file_fd < 0 || my_stat == NULL || my_stat->size < 0)
+		return -EINVAL;
+
+	// Drop the content first, so a file that was written before becomes a hole of the size
+	if (ftruncate(file_fd, 0) == -1 || ftruncate(file_fd, (off_t)my_stat->size) == -1)
+		return -errno;
+
+	if (fchmod(file_fd, (mode_t)(my_stat->mode & 07777)) == -1)
+		return -errno;
+
+	// Only root can give files away, the owner is kept in the record anyway
+	if (fchown(file_fd, (uid_t)my_stat->uid, (gid_t)my_stat->gid) == -1 && errno != EPERM)
+		return -errno;
+
+	struct byte_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+
+	int res = format_filestat(my_stat, &buf);
+	if (res != 0)
+	{
+		byte_buffer_free(&buf);
+		return -ENOMEM;
+	}
+
+	// Without xattrs only the fields of stat are kept
+	res = fsetxattr(file_fd, STORAGE_XATTR_NAME, buf.data, buf.len, 0);
+	int errno_stored = errno;
+	byte_buffer_free(&buf);
+	if (res == -1 && !is_xattr_unsupported(errno_stored))
+		return -errno_stored;
+
+	struct timespec times[2];
+	times[0].tv_sec = (time_t)my_stat->atime;
+	times[0].tv_nsec = (long)my_stat->atimensec;
+	times[1].tv_sec = (time_t)my_stat->mtime;
+	times[1].tv_nsec = (long)my_stat->mtimensec;
+	if (futimens(file_fd, times) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Fix the real stat of a sparse index file to look like the original file
+ * (only the number of blocks differs, holes have no blocks)
+ *
+ * @param stbuf is the real stat of the index file
+ */
+void storage_fill_stat_sparse(struct stat *stbuf)
+{
+	stbuf->st_blocks = (blkcnt_t)convert_filesize_to_fileblocks(stbuf->st_size);
+}
+
+/**
+ * Save metadata to an empty index file in the xattr storage (one fsetxattr())
+ *
+ * @param file_fd is the descriptor of the index file (the file must be empty)
+ * @param my_stat is the metadata to save
+ * @return 0 on success, -ENOTSUP if the filesystem does not support user xattrs,
+ *         other negative value (mostly -errno) on error
+ */
+int storage_save_xattr(int file_fd, const struct filestat *my_stat)
+{
+	if (file_fd < 0 || my_stat == NULL)
+		return -EINVAL;
+
+	struct byte_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+
+	int res = format_filestat(my_stat, &buf);
+	if (res != 0)
+	{
+		byte_buffer_free(&buf);
+		return -ENOMEM;
+	}
+
+	res = fsetxattr(file_fd, STORAGE_XATTR_NAME, buf.data, buf.len, 0);
+	int errno_stored = errno;
+	byte_buffer_free(&buf);
+
+	if (res == -1)
+		return is_xattr_unsupported(errno_stored) ? -ENOTSUP : -errno_stored;
+
+	return 0;
+}
+
+/**
+ * Save metadata to an index file in the given storage (the xattr storage
+ * falls back to a filestat record on filesystems without user xattrs)
+ *
+ * @param file_fd is the descriptor of the index file (opened for writing)
+ * @param storage is the storage
+ * @param my_stat is the metadata to save
+ * @param relpath is the relative path of the file (for outdated fields of filestat records)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int storage_save_filestat(int file_fd, enum catalog_storage storage, const struct filestat *my_stat,
+						  const char *relpath)
+{
+	if (storage == CATALOG_STORAGE_SPARSE)
+		return storage_save_sparse(file_fd, my_stat);
+
+	if (storage == CATALOG_STORAGE_XATTR)
+	{
+		int res = storage_save_xattr(file_fd, my_stat);
+
+		// Directories can be mount points of filesystems without xattrs, their files are kept as text
+		if (res != -ENOTSUP)
+			return res;
+	}
+
+	const char *slash = strrchr(relpath, '/');
+	return write_filestat(file_fd, my_stat, (slash != NULL) ? slash + 1 : relpath, relpath);
+}
+
+/**
+ * Read metadata of an index file from its record xattr (one getxattrat())
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param my_stat is the target metadata (must be filled from the real stat before the call)
+ * @return 0 on success, -ENODATA if the file has no record (or xattrs are not supported),
+ *         other negative value on error
+ */
+int storage_read_xattr(int dir_fd, const char *name, struct filestat *my_stat)
+{
+	char data[STORAGE_XATTR_MAXSIZE];
+	ssize_t len = getxattr_at(dir_fd, name, data, sizeof(data));
+	if (len < 0)
+		return (int)len;
+
+	return (read_filestat_from_buffer(data, (size_t)len, my_stat) != 0) ? -EINVAL : 0;
+}
+
+/**
+ * Read metadata of a sparse index file: fields of the record xattr win over
+ * the real stat as for filestat files (the stat of the file can be changed later,
+ * e.g. atime by readers that try to parse a small sparse file as a filestat file),
+ * the real stat is used if there is no record
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target metadata (filled from stbuf even if there is no record)
+ * @return 0 on success, -ENODATA if the file has no record (or xattrs are not supported),
+ *         other negative value on error
+ */
+int storage_read_sparse(int dir_fd, const char *name, const struct stat *stbuf, struct filestat *my_stat)
+{
+	if (fill_filestat_from_stat(my_stat, stbuf) != 0)
+		return -EINVAL;
+
+	// Holes have no blocks, the original file had them
+	my_stat->blocks = convert_filesize_to_fileblocks(my_stat->size);
+
+	return storage_read_xattr(dir_fd, name, my_stat);
+}
+
+/** Cleared when empty index files are files that are not released yet (the text storage) */
+static bool empty_files_have_xattrs = true;
+
+/**
+ * Set the storage of the catalog that is read by storage_read_filestat():
+ * released files of the text storage are never empty, so empty index files
+ * are asked for the record xattr only in the sparse and xattr storages
+ * (all storages are read by default, tools read catalogs of any storage)
+ *
+ * @param storage is the storage of the catalog
+ */
+void storage_set_catalog_storage(enum catalog_storage storage)
+{
+	__atomic_store_n(&empty_files_have_xattrs, storage != CATALOG_STORAGE_TEXT, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read metadata of a regular index file of any storage
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target metadata (must be filled from stbuf before the call)
+ * @return 0 on success, -ENODATA for an empty file without a record (a file that
+ *         is not released yet), other nonzero value on error
+ */
+int storage_read_filestat(int dir_fd, const char *name, const struct stat *stbuf, struct filestat *my_stat)
+{
+	int res;
+
+	// Empty files keep the record in the xattr or are not released yet (the only empty files of the text storage)
+	if (stbuf->st_size == 0)
+	{
+		if (!__atomic_load_n(&empty_files_have_xattrs, __ATOMIC_RELAXED))
+			return -ENODATA;
+		return storage_read_xattr(dir_fd, name, my_stat);
+	}
+
+	if (storage_is_sparse(stbuf))
+	{
+		res = storage_read_sparse(dir_fd, name, stbuf, my_stat);
+		if (res != -ENODATA)
+			return res;
+
+		// Filesystems with compression can make a filestat file look sparse too
+		struct filestat text_stat = *my_stat;
+		if (read_filestat(dir_fd, name, &text_stat) == 0)
+			*my_stat = text_stat;
+
+		// Otherwise it's a sparse file without a record (xattrs are not supported), stat is all we have
+		return 0;
+	}
+
+	res = read_filestat(dir_fd, name, my_stat);
+	if (res == 0)
+		return 0;
+
+	// Small sparse files can have a block allocated for the xattr and do not look sparse
+	struct filestat sparse_stat;
+	if (storage_read_sparse(dir_fd, name, stbuf, &sparse_stat) == 0)
+	{
+		*my_stat = sparse_stat;
+		return 0;
+	}
+
+	return res;
+}
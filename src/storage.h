@@ -0,0 +1,172 @@
+#ifndef INC_CATALOGFS_STORAGE_H
+#define INC_CATALOGFS_STORAGE_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+// Forward declaration
+struct filestat;
+
+/**
+ * Ways to keep metadata of a regular file in its index file.
+ *
+ * text: the content of the index file is a filestat record (see filestat_parser.h),
+ * so getattr() opens and parses the file.
+ *
+ * sparse: the index file is a sparse file truncated to the original size, with
+ * the original mode, atime and mtime (and owner if chown is permitted), so its own
+ * stat is the metadata and getattr() needs only fstatat(). The whole filestat
+ * record is kept in the STORAGE_XATTR_NAME extended attribute of the file too,
+ * so fields that do not fit into stat (ctime, nlink, hash, owner if chown is not
+ * permitted) are not lost (except on filesystems without user xattrs).
+ *
+ * xattr: the index file is empty and the whole filestat record is kept in the
+ * STORAGE_XATTR_NAME extended attribute, so reading it is one getxattrat() and
+ * saving it is one fsetxattr(). Filesystems without user xattrs can't keep
+ * such files, writers fall back to the text storage there.
+ *
+ * Readers of catalogs (see storage_read_filestat()) accept all kinds of files,
+ * so a catalog can mix them.
+ */
+enum catalog_storage
+{
+	/** Filestat record is the content of the index file */
+	CATALOG_STORAGE_TEXT = 0,
+
+	/** Index file is a sparse copy of the original stat */
+	CATALOG_STORAGE_SPARSE,
+
+	/** Filestat record is the extended attribute of an empty index file */
+	CATALOG_STORAGE_XATTR,
+};
+
+/** Name of the extended attribute with the filestat record */
+#define STORAGE_XATTR_NAME "user.catalogfs"
+
+/** Maximum size of the filestat record in the extended attribute */
+#define STORAGE_XATTR_MAXSIZE (4096)
+
+/**
+ * Get the storage by its name (as used by command-line options)
+ *
+ * @param name is the name ("text", "sparse" or "xattr")
+ * @param storage is the found storage
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int storage_from_name(const char *name, enum catalog_storage *storage);
+
+/**
+ * Get the name of the storage
+ *
+ * @param storage is the storage
+ * @return the name (static string)
+ */
+const char *storage_name(enum catalog_storage storage);
+
+/**
+ * Check if the filesystem of the file supports user xattrs
+ *
+ * @param fd is a descriptor of any file or directory of the filesystem (not O_PATH)
+ * @return true if xattrs are supported
+ */
+bool storage_xattr_supported(int fd);
+
+/**
+ * Check if the index file looks like a sparse one (it has less data
+ * allocated than its size, a filestat record never has)
+ *
+ * @param stbuf is the real stat of the index file
+ * @return true if the file should be read as a sparse one
+ */
+bool storage_is_sparse(const struct stat *stbuf);
+
+/**
+ * Save metadata to an index file in the sparse storage: truncate the file to
+ * the size, apply mode, owner (if permitted), the record xattr and times
+ * (times are the last because the other changes update mtime)
+ *
+ * @param file_fd is the descriptor of the index file (opened for writing)
+ * @param my_stat is the metadata to save
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int storage_save_sparse(int file_fd, const struct filestat *my_stat);
+
+/**
+ * Save metadata to an empty index file in the xattr storage (one fsetxattr())
+ *
+ * @param file_fd is the descriptor of the index file (the file must be empty)
+ * @param my_stat is the metadata to save
+ * @return 0 on success, -ENOTSUP if the filesystem does not support user xattrs,
+ *         other negative value (mostly -errno) on error
+ */
+int storage_save_xattr(int file_fd, const struct filestat *my_stat);
+
+/**
+ * Save metadata to an index file in the given storage (the xattr storage
+ * falls back to a filestat record on filesystems without user xattrs)
+ *
+ * @param file_fd is the descriptor of the index file (opened for writing)
+ * @param storage is the storage
+ * @param my_stat is the metadata to save
+ * @param relpath is the relative path of the file (for outdated fields of filestat records)
+ * @return 0 on success, nonzero value (mostly -errno) on error
+ */
+int storage_save_filestat(int file_fd, enum catalog_storage storage, const struct filestat *my_stat,
+						  const char *relpath);
+
+/**
+ * Read metadata of an index file from its record xattr (one getxattrat())
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param my_stat is the target metadata (must be filled from the real stat before the call)
+ * @return 0 on success, -ENODATA if the file has no record (or xattrs are not supported),
+ *         other negative value on error
+ */
+int storage_read_xattr(int dir_fd, const char *name, struct filestat *my_stat);
+
+/**
+ * Fix the real stat of a sparse index file to look like the original file
+ * (only the number of blocks differs, holes have no blocks)
+ *
+ * @param stbuf is the real stat of the index file
+ */
+void storage_fill_stat_sparse(struct stat *stbuf);
+
+/**
+ * Read metadata of a sparse index file: fields of the record xattr win over
+ * the real stat as for filestat files, the real stat is used if there is no record
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target metadata (filled from stbuf even if there is no record)
+ * @return 0 on success, -ENODATA if the file has no record (or xattrs are not supported),
+ *         other negative value on error
+ */
+int storage_read_sparse(int dir_fd, const char *name, const struct stat *stbuf, struct filestat *my_stat);
+
+/**
+ * Set the storage of the catalog that is read by storage_read_filestat():
+ * released files of the text storage are never empty, so empty index files
+ * are asked for the record xattr only in the sparse and xattr storages
+ * (all storages are read by default, tools read catalogs of any storage)
+ *
+ * @param storage is the storage of the catalog
+ */
+void storage_set_catalog_storage(enum catalog_storage storage);
+
+/**
+ * Read metadata of a regular index file of any storage
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file inside the directory
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target metadata (must be filled from stbuf before the call)
+ * @return 0 on success, -ENODATA for an empty file without a record (a file that
+ *         is not released yet), other nonzero value on error
+ */
+int storage_read_filestat(int dir_fd, const char *name, const struct stat *stbuf, struct filestat *my_stat);
+
+#endif // INC_CATALOGFS_STORAGE_H
@@ -0,0 +1,557 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-diff - compares two CatalogFS catalogs (indexes) without mounting them.
+ *
+ * Both catalogs are walked at the same time, directory by directory.
+ * Listings of every pair of directories are sorted by name and merged,
+ * so only one listing per depth level is kept in memory (memory is bounded
+ * by the width of directories, not by the size of the whole tree).
+ *
+ * Filestat files are read directly with the parser (no FUSE, no kernel
+ * round trips) and differences are printed as a stream, one line per entry:
+ *
+ *    added<TAB>-<TAB>/path
+ *    removed<TAB>-<TAB>/path
+ *    modified<TAB>size,mtime,sha256<TAB>/path
+ *
+ * Fields of modified entries can be: type, size, mtime, sha256 (regular files),
+ * mtime (directories), target (symlinks).
+ *
+ * Every entry of an added or removed directory is reported too (after the
+ * directory itself), so the output is a complete list of changes. With
+ * --collapse only the directory is reported.
+ *
+ * Exit code is 0 if catalogs are equal, 1 if differences were found, 2 on error
+ * (the same convention as diff(1) has).
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "filestat.h"
+
+#include "log.h"
+
+/** Exit code: no differences */
+#define DIFF_EXIT_EQUAL (0)
+/** Exit code: differences were found */
+#define DIFF_EXIT_DIFFERENT (1)
+/** Exit code: some error happened */
+#define DIFF_EXIT_ERROR (2)
+
+/**
+ * Options and state of the diff process
+ */
+struct diff_state
+{
+	/** Compare sizes of regular files */
+	bool compare_size;
+
+	/** Compare modification times of regular files */
+	bool compare_mtime;
+
+	/** Compare SHA-256 hashes of regular files (if both are known) */
+	bool compare_hash;
+
+	/** Report every entry of added/removed directories, not only the directory (default) */
+	bool expand;
+
+	/** Record terminator of output lines ('\n' or '\0') */
+	char terminator;
+
+	/** Current path (relative to catalog roots, starts with '/') */
+	char *path;
+
+	/** Length of the current path */
+	size_t path_len;
+
+	/** Allocated size of the path buffer */
+	size_t path_capacity;
+
+	/** Number of reported differences */
+	uint64_t differences;
+
+	/** Number of errors (unreadable directories or entries) */
+	size_t errors;
+
+	/** Batched loader of directory listings */
+	struct batch_loader *loader;
+};
+
+/**
+ * Append a name to the current path
+ *
+ * @param state is the diff state
+ * @param name is the name to append
+ * @return previous length of the path (for diff_path_pop()), SIZE_MAX on error
+ */
+static size_t diff_path_push(struct diff_state *state, const char *name)
+{
+	size_t old_len = state->path_len;
+	size_t name_len = strlen(name);
+	size_t needed = old_len + 1 + name_len + 1;
+
+	if (needed > state->path_capacity)
+	{
+		size_t new_capacity = (state->path_capacity == 0) ? 256 : state->path_capacity;
+		while (new_capacity < needed)
+		{
+			new_capacity *= 2;
+		}
+
+		char *new_path = (char *)realloc(state->path, new_capacity);
+		if (new_path == NULL)
+			return SIZE_MAX;
+
+		state->path = new_path;
+		state->path_capacity = new_capacity;
+	}
+
+	state->path[old_len] = '/';
+	memcpy(state->path + old_len + 1, name, name_len + 1);
+	state->path_len = old_len + 1 + name_len;
+
+	return old_len;
+}
+
+/**
+ * Restore the current path to the previous length
+ *
+ * @param state is the diff state
+ * @param old_len is the length returned by diff_path_push()
+ */
+static void diff_path_pop(struct diff_state *state, size_t old_len)
+{
+	state->path_len = old_len;
+	state->path[old_len] = '\0';
+}
+
+/**
+ * Print a difference line for the current path
+ *
+ * @param state is the diff state
+ * @param kind is the kind of the difference (added, removed, modified)
+ * @param fields is a comma-separated list of changed fields ("-" if not applicable)
+ */
+static void diff_report(struct diff_state *state, const char *kind, const char *fields)
+{
+	state->differences++;
+	printf("%s\t%s\t%s%c", kind, fields, state->path, state->terminator);
+}
+
+/**
+ * Report an error for the current path
+ *
+ * @param state is the diff state
+ * @param message is a description of the error
+ * @param code is the error code (negative errno)
+ */
+static void diff_error(struct diff_state *state, const char *message, int code)
+{
+	state->errors++;
+	PrintToStderrF("%s: %s (path: %s)", message, strerror(-code), (state->path_len > 0) ? state->path : "/");
+}
+
+/**
+ * Open a subdirectory of the directory without following symlinks
+ *
+ * @param dir_fd is the parent directory file descriptor
+ * @param name is the subdirectory name
+ * @return file descriptor on success, -1 on error (errno is set)
+ */
+static int diff_open_subdir(int dir_fd, const char *name)
+{
+	return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/**
+ * Report all entries of a directory that exists only in one catalog (recursively)
+ *
+ * @param state is the diff state
+ * @param dir_fd is the directory file descriptor
+ * @param kind is the kind of the difference (added or removed)
+ */
+static void diff_report_subtree(struct diff_state *state, int dir_fd, const char *kind)
+{
+	struct catalog_dir dir;
+	int res = catalog_dir_load_batch(dir_fd, true, state->loader, &dir, &state->errors);
+	if (res != 0)
+	{
+		diff_error(state, "Failed to read directory", res);
+		return;
+	}
+
+	for (size_t i = 0; i < dir.count; i++)
+	{
+		const struct catalog_dir_entry *entry = &dir.entries[i];
+
+		size_t old_len = diff_path_push(state, entry->name);
+		if (old_len == SIZE_MAX)
+		{
+			diff_error(state, "Failed to build path", -ENOMEM);
+			break;
+		}
+
+		diff_report(state, kind, "-");
+
+		if (catalog_dir_entry_is_dir(entry))
+		{
+			int subdir_fd = diff_open_subdir(dir_fd, entry->name);
+			if (subdir_fd == -1)
+			{
+				diff_error(state, "Failed to open directory", -errno);
+			}
+			else
+			{
+				diff_report_subtree(state, subdir_fd, kind);
+				(void)close(subdir_fd);
+			}
+		}
+
+		diff_path_pop(state, old_len);
+	}
+
+	catalog_dir_free(&dir);
+}
+
+/**
+ * Report an entry that exists only in one catalog
+ *
+ * @param state is the diff state
+ * @param dir_fd is the parent directory file descriptor
+ * @param entry is the entry
+ * @param kind is the kind of the difference (added or removed)
+ */
+static void diff_report_single(struct diff_state *state, int dir_fd,
+							   const struct catalog_dir_entry *entry, const char *kind)
+{
+	diff_report(state, kind, "-");
+
+	if (!state->expand || !catalog_dir_entry_is_dir(entry))
+		return;
+
+	int subdir_fd = diff_open_subdir(dir_fd, entry->name);
+	if (subdir_fd == -1)
+	{
+		diff_error(state, "Failed to open directory", -errno);
+		return;
+	}
+
+	diff_report_subtree(state, subdir_fd, kind);
+	(void)close(subdir_fd);
+}
+
+/**
+ * Append a field name to the comma-separated list of changed fields
+ *
+ * @param fields is the buffer with the list
+ * @param fields_size is the size of the buffer
+ * @param field is the field name to append
+ */
+static void diff_append_field(char *fields, size_t fields_size, const char *field)
+{
+	size_t len = strlen(fields);
+	(void)snprintf(fields + len, fields_size - len, "%s%s", (len > 0) ? "," : "", field);
+}
+
+/**
+ * Compare two entries with the same name and fill the list of changed fields
+ *
+ * @param state is the diff state
+ * @param old_entry is the entry from the old catalog
+ * @param new_entry is the entry from the new catalog
+ * @param fields is the buffer for the list of changed fields (empty if equal)
+ * @param fields_size is the size of the buffer
+ */
+static void diff_compare_entries(const struct diff_state *state,
+								 const struct catalog_dir_entry *old_entry,
+								 const struct catalog_dir_entry *new_entry,
+								 char *fields, size_t fields_size)
+{
+	fields[0] = '\0';
+
+	if ((old_entry->stbuf.st_mode & S_IFMT) != (new_entry->stbuf.st_mode & S_IFMT))
+	{
+		diff_append_field(fields, fields_size, "type");
+		return;
+	}
+
+	if (S_ISLNK(new_entry->stbuf.st_mode))
+	{
+		if (strcmp(old_entry->link_target, new_entry->link_target) != 0)
+		{
+			diff_append_field(fields, fields_size, "target");
+		}
+		return;
+	}
+
+	const struct filestat *old_stat = &old_entry->my_stat;
+	const struct filestat *new_stat = &new_entry->my_stat;
+
+	// Directories of a catalog keep the mtimes of the source ones
+	if (S_ISDIR(new_entry->stbuf.st_mode))
+	{
+		if (state->compare_mtime &&
+			(old_stat->mtime != new_stat->mtime || old_stat->mtimensec != new_stat->mtimensec))
+		{
+			diff_append_field(fields, fields_size, "mtime");
+		}
+		return;
+	}
+
+	if (!S_ISREG(new_entry->stbuf.st_mode))
+		return;
+
+	if (state->compare_size && old_stat->size != new_stat->size)
+	{
+		diff_append_field(fields, fields_size, "size");
+	}
+
+	if (state->compare_mtime &&
+		(old_stat->mtime != new_stat->mtime || old_stat->mtimensec != new_stat->mtimensec))
+	{
+		diff_append_field(fields, fields_size, "mtime");
+	}
+
+	if (state->compare_hash &&
+		old_stat->sha256[0] != '\0' &&
+		new_stat->sha256[0] != '\0' &&
+		strcmp(old_stat->sha256, new_stat->sha256) != 0)
+	{
+		diff_append_field(fields, fields_size, "sha256");
+	}
+}
+
+/**
+ * Compare a pair of directories (recursively) with a sorted merge of their listings
+ *
+ * @param state is the diff state
+ * @param old_fd is the directory file descriptor in the old catalog
+ * @param new_fd is the directory file descriptor in the new catalog
+ */
+static void diff_directories(struct diff_state *state, int old_fd, int new_fd)
+{
+	struct catalog_dir old_dir;
+	struct catalog_dir new_dir;
+
+	int res = catalog_dir_load_batch(old_fd, true, state->loader, &old_dir, &state->errors);
+	if (res != 0)
+	{
+		diff_error(state, "Failed to read directory of old catalog", res);
+		return;
+	}
+
+	res = catalog_dir_load_batch(new_fd, true, state->loader, &new_dir, &state->errors);
+	if (res != 0)
+	{
+		diff_error(state, "Failed to read directory of new catalog", res);
+		catalog_dir_free(&old_dir);
+		return;
+	}
+
+	size_t i = 0;
+	size_t j = 0;
+	while (i < old_dir.count || j < new_dir.count)
+	{
+		const struct catalog_dir_entry *old_entry = (i < old_dir.count) ? &old_dir.entries[i] : NULL;
+		const struct catalog_dir_entry *new_entry = (j < new_dir.count) ? &new_dir.entries[j] : NULL;
+
+		int cmp;
+		if (old_entry == NULL)
+			cmp = 1;
+		else if (new_entry == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(old_entry->name, new_entry->name);
+
+		const char *name = (cmp <= 0) ? old_entry->name : new_entry->name;
+		size_t old_len = diff_path_push(state, name);
+		if (old_len == SIZE_MAX)
+		{
+			diff_error(state, "Failed to build path", -ENOMEM);
+			break;
+		}
+
+		if (cmp < 0)
+		{
+			diff_report_single(state, old_fd, old_entry, "removed");
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			diff_report_single(state, new_fd, new_entry, "added");
+			j++;
+		}
+		else
+		{
+			char fields[64];
+			diff_compare_entries(state, old_entry, new_entry, fields, sizeof(fields));
+			if (fields[0] != '\0')
+			{
+				diff_report(state, "modified", fields);
+			}
+
+			if (catalog_dir_entry_is_dir(old_entry) && catalog_dir_entry_is_dir(new_entry))
+			{
+				int old_subdir_fd = diff_open_subdir(old_fd, name);
+				int new_subdir_fd = diff_open_subdir(new_fd, name);
+				if (old_subdir_fd == -1 || new_subdir_fd == -1)
+				{
+					diff_error(state, "Failed to open directory", -errno);
+				}
+				else
+				{
+					diff_directories(state, old_subdir_fd, new_subdir_fd);
+				}
+
+				if (old_subdir_fd != -1)
+					(void)close(old_subdir_fd);
+				if (new_subdir_fd != -1)
+					(void)close(new_subdir_fd);
+			}
+			i++;
+			j++;
+		}
+
+		diff_path_pop(state, old_len);
+	}
+
+	catalog_dir_free(&old_dir);
+	catalog_dir_free(&new_dir);
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <old_catalog> <new_catalog>", program_name);
+	PrintToStdout("Options:");
+	PrintToStdout("-c   --collapse            report only added/removed directories themselves");
+	PrintToStdout("                           (default: report every entry inside them too)");
+	PrintToStdout("     --no-size             do not compare sizes");
+	PrintToStdout("     --no-mtime            do not compare modification times");
+	PrintToStdout("     --no-hash             do not compare SHA-256 hashes");
+	PrintToStdout("-0   --null                terminate output lines with NUL instead of newline");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 if catalogs are equal, 1 if they differ, 2 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct diff_state state;
+	memset(&state, 0, sizeof(struct diff_state));
+	state.compare_size = true;
+	state.compare_mtime = true;
+	state.compare_hash = true;
+	state.expand = true;
+	state.terminator = '\n';
+
+	enum
+	{
+		OPT_NO_SIZE = 256,
+		OPT_NO_MTIME,
+		OPT_NO_HASH,
+	};
+
+	static const struct option long_options[] = {
+		{"collapse", no_argument, NULL, 'c'},
+		{"no-size", no_argument, NULL, OPT_NO_SIZE},
+		{"no-mtime", no_argument, NULL, OPT_NO_MTIME},
+		{"no-hash", no_argument, NULL, OPT_NO_HASH},
+		{"null", no_argument, NULL, '0'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c0h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			state.expand = false;
+			break;
+		case OPT_NO_SIZE:
+			state.compare_size = false;
+			break;
+		case OPT_NO_MTIME:
+			state.compare_mtime = false;
+			break;
+		case OPT_NO_HASH:
+			state.compare_hash = false;
+			break;
+		case '0':
+			state.terminator = '\0';
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return DIFF_EXIT_EQUAL;
+		default:
+			print_help(argv[0]);
+			return DIFF_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return DIFF_EXIT_ERROR;
+	}
+
+	int old_fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (old_fd == -1)
+	{
+		PrintToStderrF("Failed to open old catalog: %s (path: %s)", strerror(errno), argv[optind]);
+		return DIFF_EXIT_ERROR;
+	}
+
+	int new_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (new_fd == -1)
+	{
+		PrintToStderrF("Failed to open new catalog: %s (path: %s)", strerror(errno), argv[optind + 1]);
+		(void)close(old_fd);
+		return DIFF_EXIT_ERROR;
+	}
+
+	if (batch_loader_new(&state.loader, BATCH_LOADER_DEFAULT_DEPTH) != 0)
+	{
+		PrintToStderr("Failed to allocate loader");
+		(void)close(old_fd);
+		(void)close(new_fd);
+		return DIFF_EXIT_ERROR;
+	}
+
+	diff_directories(&state, old_fd, new_fd);
+
+	(void)close(old_fd);
+	(void)close(new_fd);
+	batch_loader_free(state.loader);
+	free(state.path);
+
+	if (fflush(stdout) != 0)
+		return DIFF_EXIT_ERROR;
+
+	if (state.errors > 0)
+		return DIFF_EXIT_ERROR;
+
+	return (state.differences > 0) ? DIFF_EXIT_DIFFERENT : DIFF_EXIT_EQUAL;
+}
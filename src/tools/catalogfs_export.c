@@ -0,0 +1,1229 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-export - writes metadata of all entries of a catalog (index)
+ * as rows of NDJSON or CSV, e.g. for loading catalogs into a database.
+ *
+ * NDJSON rows have the keys of records of ingest streams (see ingest.h),
+ * so an export can be written back to .catalogfs/ingest of another mount:
+ *
+ *   {"path":"music/a.flac","type":"file","size":31457280,"blocks":61440,"mode":"0644",
+ *    "uid":1000,"gid":1000,"nlink":1,"atime":1589000000.25,"mtime":1589000000.25,
+ *    "ctime":1589000000.25,"sha256":"..."}
+ *
+ * CSV has a header line and the same columns (RFC 4180 quoting), "sha256" and
+ * "target" are empty when unknown. The root directory itself is not exported.
+ *
+ * Directories are loaded by a pool of threads (with the batched loader, see
+ * batch_loader.h), every thread formats rows into its own output buffer
+ * without locks. Buffers are taken from a pool allocated at the start and
+ * full buffers are written by one thread with writev(), up to EXPORT_MAX_IOV
+ * buffers per call, so the output costs one system call per several MiB.
+ * Rows of a directory are sorted by name, but directories come in the order
+ * threads finish them (with --jobs=1 the order is the same on every run).
+ *
+ * Throughput is reported to stderr periodically and at the end.
+ *
+ * Exit code is 0 on success, 1 if some entries failed to be read or the output failed.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "filestat.h"
+
+#include "log.h"
+
+/** Exit code: all entries are exported */
+#define EXPORT_EXIT_OK (0)
+/** Exit code: some error happened */
+#define EXPORT_EXIT_ERROR (1)
+
+/** Default number of threads */
+#define EXPORT_DEFAULT_JOBS (4)
+
+/** Default interval of progress reports in seconds */
+#define EXPORT_DEFAULT_PROGRESS_INTERVAL (10)
+
+/** Size of an output buffer */
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+
+/** Number of output buffers per thread (one is filled while others are written) */
+#define EXPORT_BUFFERS_PER_JOB (4)
+
+/** Maximum number of buffers written by one writev() */
+#define EXPORT_MAX_IOV (64)
+
+/** Maximum size of a row: path and target with every byte escaped (as \u00XX) and numbers */
+#define EXPORT_MAX_ROW_SIZE (2 * 6 * PATH_MAX + 1024)
+
+/**
+ * Format of rows
+ */
+enum export_format
+{
+	/** One JSON object per line */
+	EXPORT_FORMAT_NDJSON = 0,
+
+	/** Comma-separated values with a header */
+	EXPORT_FORMAT_CSV,
+};
+
+/**
+ * Output buffer
+ */
+struct export_buffer
+{
+	/** Data (EXPORT_BUFFER_SIZE bytes) */
+	char *data;
+
+	/** Length of data */
+	size_t len;
+};
+
+/**
+ * State of the export (shared by all threads)
+ */
+struct export_state
+{
+	/** Format of rows */
+	enum export_format format;
+
+	/** Number of threads */
+	unsigned int jobs;
+
+	/** Interval of progress reports in seconds (0 to disable) */
+	unsigned int progress_interval;
+
+	/** File descriptor of the catalog */
+	int catalog_fd;
+
+	/** File descriptor of the output */
+	int output_fd;
+
+	/** Time (monotonic) of the start */
+	struct timespec start_time;
+
+	/** Lock for the stack and counters */
+	pthread_mutex_t lock;
+
+	/** Signaled when directories are queued or the work is finished */
+	pthread_cond_t cond;
+
+	/** Stack of relative paths of directories to export */
+	char **stack;
+
+	/** Number of directories in the stack */
+	size_t stack_count;
+
+	/** Allocated size of the stack */
+	size_t stack_capacity;
+
+	/** Number of threads exporting a directory right now */
+	unsigned int busy_count;
+
+	/** All directories are exported */
+	bool finished;
+
+	/** Number of exported directories */
+	uint64_t dirs_done;
+
+	/** Number of exported rows */
+	uint64_t rows;
+
+	/** Number of errors */
+	uint64_t errors;
+
+	/** Lock of the pool of buffers and the output */
+	pthread_mutex_t output_lock;
+
+	/** Signaled when a buffer is returned to the pool */
+	pthread_cond_t buffer_free;
+
+	/** Signaled when a full buffer is queued or the output is closed */
+	pthread_cond_t buffer_full;
+
+	/** All buffers (allocated at the start) */
+	struct export_buffer *buffers;
+
+	/** Number of buffers */
+	size_t buffers_count;
+
+	/** Free buffers */
+	struct export_buffer **free_buffers;
+
+	/** Number of free buffers */
+	size_t free_count;
+
+	/** Full buffers in the order of writing (ring) */
+	struct export_buffer **full_buffers;
+
+	/** Index of the first full buffer */
+	size_t full_head;
+
+	/** Number of full buffers */
+	size_t full_count;
+
+	/** No more buffers will be queued */
+	bool output_closed;
+
+	/** Writing failed, the export is stopped (-errno, 0 if it did not) */
+	int output_error;
+
+	/** Number of written bytes */
+	uint64_t bytes_written;
+
+	/** Number of writev() calls */
+	uint64_t writes;
+};
+
+/**
+ * Per-thread context of a worker
+ */
+struct export_worker
+{
+	/** Shared state */
+	struct export_state *state;
+
+	/** Batched loader of directories */
+	struct batch_loader *loader;
+
+	/** Buffer being filled (NULL if there is none) */
+	struct export_buffer *buffer;
+
+	/** Number of rows in the buffer (added to the counter when it's queued) */
+	uint64_t buffer_rows;
+};
+
+/**
+ * Get seconds passed since the start
+ *
+ * @param state is the export state
+ * @return elapsed seconds
+ */
+static double export_elapsed(const struct export_state *state)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - state->start_time.tv_sec) +
+		   (double)(now.tv_nsec - state->start_time.tv_nsec) / 1e9;
+}
+
+/**
+ * Print throughput and counters to stderr
+ *
+ * @param state is the export state
+ * @param is_final determines if it's the final report
+ */
+static void export_print_progress(struct export_state *state, bool is_final)
+{
+	pthread_mutex_lock(&state->lock);
+	uint64_t dirs = state->dirs_done;
+	uint64_t rows = state->rows;
+	uint64_t errors = state->errors;
+	pthread_mutex_unlock(&state->lock);
+
+	pthread_mutex_lock(&state->output_lock);
+	uint64_t bytes = state->bytes_written;
+	uint64_t writes = state->writes;
+	pthread_mutex_unlock(&state->output_lock);
+
+	double elapsed = export_elapsed(state);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	double mib = (double)bytes / (1024.0 * 1024.0);
+	PrintToStderrF("%s: %" PRIu64 " dirs, %" PRIu64 " rows (%.0f/s), %.1f MiB written (%.1f MiB/s, "
+				   "%" PRIu64 " writes), %" PRIu64 " errors, %.1f s",
+				   (is_final) ? "Finished" : "Progress",
+				   dirs, rows, (double)rows / elapsed, mib, mib / elapsed, writes, errors, elapsed);
+}
+
+/**
+ * Report an error
+ *
+ * @param state is the export state
+ * @param message is the error message
+ * @param code is the negative error code
+ * @param path is the relative path of the directory
+ */
+static void export_error(struct export_state *state, const char *message, int code, const char *path)
+{
+	pthread_mutex_lock(&state->lock);
+	state->errors++;
+	pthread_mutex_unlock(&state->lock);
+
+	PrintToStderrF("%s: %s (path: %s)", message, strerror(-code), path);
+}
+
+/**
+ * Make a relative path of an entry of the directory
+ *
+ * @param dir_path is the relative path of the directory ("." for the root)
+ * @param name is the name of the entry
+ * @return new allocated path, NULL on error
+ */
+static char *join_relpath(const char *dir_path, const char *name)
+{
+	if (strcmp(dir_path, ".") == 0)
+		return strdup(name);
+
+	size_t dir_len = strlen(dir_path);
+	size_t name_len = strlen(name);
+	char *path = (char *)malloc(dir_len + 1 + name_len + 1);
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, dir_path, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+/**
+ * Push a directory to the stack (the lock must be held, ownership of the path is taken)
+ *
+ * @param state is the export state
+ * @param path is the relative path of the directory
+ * @return 0 on success, -ENOMEM on error (the path is freed)
+ */
+static int export_push_locked(struct export_state *state, char *path)
+{
+	if (state->stack_count == state->stack_capacity)
+	{
+		size_t new_capacity = (state->stack_capacity == 0) ? 64 : state->stack_capacity * 2;
+		char **new_stack = (char **)realloc(state->stack, new_capacity * sizeof(char *));
+		if (new_stack == NULL)
+		{
+			free(path);
+			return -ENOMEM;
+		}
+		state->stack = new_stack;
+		state->stack_capacity = new_capacity;
+	}
+
+	state->stack[state->stack_count++] = path;
+	pthread_cond_signal(&state->cond);
+	return 0;
+}
+
+/**
+ * Take a free buffer from the pool (waits until one is written)
+ *
+ * @param state is the export state
+ * @return the empty buffer
+ */
+static struct export_buffer *export_take_buffer(struct export_state *state)
+{
+	pthread_mutex_lock(&state->output_lock);
+	while (state->free_count == 0)
+	{
+		pthread_cond_wait(&state->buffer_free, &state->output_lock);
+	}
+	struct export_buffer *buffer = state->free_buffers[--state->free_count];
+	pthread_mutex_unlock(&state->output_lock);
+
+	buffer->len = 0;
+	return buffer;
+}
+
+/**
+ * Queue the buffer of the worker for writing
+ *
+ * @param worker is the worker
+ */
+static void export_submit_buffer(struct export_worker *worker)
+{
+	struct export_state *state = worker->state;
+	struct export_buffer *buffer = worker->buffer;
+	if (buffer == NULL)
+		return;
+
+	pthread_mutex_lock(&state->output_lock);
+	if (buffer->len > 0)
+	{
+		state->full_buffers[(state->full_head + state->full_count) % state->buffers_count] = buffer;
+		state->full_count++;
+		pthread_cond_signal(&state->buffer_full);
+	}
+	else
+	{
+		state->free_buffers[state->free_count++] = buffer;
+		pthread_cond_signal(&state->buffer_free);
+	}
+	pthread_mutex_unlock(&state->output_lock);
+
+	pthread_mutex_lock(&state->lock);
+	state->rows += worker->buffer_rows;
+	pthread_mutex_unlock(&state->lock);
+
+	worker->buffer = NULL;
+	worker->buffer_rows = 0;
+}
+
+/**
+ * Write all data of the buffers, retrying short writes
+ *
+ * @param fd is the file descriptor of the output
+ * @param iov is the array of buffers (changed)
+ * @param count is the number of buffers
+ * @return 0 on success, -errno on error
+ */
+static int write_all(int fd, struct iovec *iov, int count)
+{
+	while (count > 0)
+	{
+		ssize_t written = writev(fd, iov, count);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		size_t left = (size_t)written;
+		while (count > 0 && left >= iov->iov_len)
+		{
+			left -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Writer thread function: writes queued buffers in batches
+ *
+ * @param arg is the export state
+ * @return NULL
+ */
+static void *export_writer_thread(void *arg)
+{
+	struct export_state *state = (struct export_state *)arg;
+	struct export_buffer *batch[EXPORT_MAX_IOV];
+	struct iovec iov[EXPORT_MAX_IOV];
+
+	pthread_mutex_lock(&state->output_lock);
+	while (true)
+	{
+		while (state->full_count == 0 && !state->output_closed)
+		{
+			pthread_cond_wait(&state->buffer_full, &state->output_lock);
+		}
+		if (state->full_count == 0)
+			break;
+
+		int count = 0;
+		size_t bytes = 0;
+		while (state->full_count > 0 && count < EXPORT_MAX_IOV)
+		{
+			struct export_buffer *buffer = state->full_buffers[state->full_head];
+			state->full_head = (state->full_head + 1) % state->buffers_count;
+			state->full_count--;
+
+			batch[count] = buffer;
+			iov[count].iov_base = buffer->data;
+			iov[count].iov_len = buffer->len;
+			bytes += buffer->len;
+			count++;
+		}
+		bool failed = (state->output_error != 0);
+		pthread_mutex_unlock(&state->output_lock);
+
+		// After an error buffers are only returned to the pool
+		int res = (failed) ? 0 : write_all(state->output_fd, iov, count);
+
+		pthread_mutex_lock(&state->output_lock);
+		if (res != 0 && state->output_error == 0)
+			state->output_error = res;
+		if (res == 0 && !failed)
+		{
+			state->bytes_written += bytes;
+			state->writes++;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			state->free_buffers[state->free_count++] = batch[i];
+		}
+		pthread_cond_broadcast(&state->buffer_free);
+	}
+	pthread_mutex_unlock(&state->output_lock);
+
+	return NULL;
+}
+
+/**
+ * Check if writing failed
+ *
+ * @param state is the export state
+ * @return true if the export should be stopped
+ */
+static bool export_output_failed(struct export_state *state)
+{
+	pthread_mutex_lock(&state->output_lock);
+	bool failed = (state->output_error != 0);
+	pthread_mutex_unlock(&state->output_lock);
+
+	return failed;
+}
+
+/**
+ * Append an unsigned number
+ *
+ * @param out is the position in the buffer
+ * @param value is the number
+ * @return the position after the number
+ */
+static char *append_u64(char *out, uint64_t value)
+{
+	char digits[20];
+	size_t count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	while (count > 0)
+	{
+		*out++ = digits[--count];
+	}
+	return out;
+}
+
+/**
+ * Append a signed number
+ *
+ * @param out is the position in the buffer
+ * @param value is the number
+ * @return the position after the number
+ */
+static char *append_i64(char *out, int64_t value)
+{
+	if (value >= 0)
+		return append_u64(out, (uint64_t)value);
+
+	*out++ = '-';
+	return append_u64(out, (uint64_t)0 - (uint64_t)value);
+}
+
+/**
+ * Append a time as seconds with a fraction ("1589000000.25"; integer if nsec is 0)
+ *
+ * @param out is the position in the buffer
+ * @param sec is the seconds (rounded down for negative times)
+ * @param nsec is the nanoseconds (0 to 999999999)
+ * @return the position after the time
+ */
+static char *append_time(char *out, int64_t sec, int64_t nsec)
+{
+	if (nsec <= 0 || nsec > 999999999)
+		return append_i64(out, sec);
+
+	// -1.5 is stored as -2 and 500000000 nanoseconds
+	if (sec < 0)
+	{
+		*out++ = '-';
+		out = append_u64(out, (uint64_t)0 - (uint64_t)(sec + 1));
+		nsec = 1000000000 - nsec;
+	}
+	else
+	{
+		out = append_u64(out, (uint64_t)sec);
+	}
+
+	char digits[9];
+	for (int i = 8; i >= 0; i--)
+	{
+		digits[i] = (char)('0' + nsec % 10);
+		nsec /= 10;
+	}
+	size_t len = 9;
+	while (digits[len - 1] == '0')
+		len--;
+
+	*out++ = '.';
+	memcpy(out, digits, len);
+	return out + len;
+}
+
+/**
+ * Append a string with JSON escapes (bytes that are not valid UTF-8 are kept as they are,
+ * as ingest streams read them)
+ *
+ * @param out is the position in the buffer
+ * @param text is the null-terminated string
+ * @return the position after the closing quote
+ */
+static char *append_json_string(char *out, const char *text)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	*out++ = '"';
+	for (const unsigned char *in = (const unsigned char *)text; *in != '\0'; in++)
+	{
+		unsigned char c = *in;
+		if (c >= 0x20 && c != '"' && c != '\\')
+		{
+			*out++ = (char)c;
+			continue;
+		}
+
+		*out++ = '\\';
+		switch (c)
+		{
+		case '"':
+		case '\\':
+			*out++ = (char)c;
+			break;
+		case '\n':
+			*out++ = 'n';
+			break;
+		case '\t':
+			*out++ = 't';
+			break;
+		case '\r':
+			*out++ = 'r';
+			break;
+		default:
+			*out++ = 'u';
+			*out++ = '0';
+			*out++ = '0';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xf];
+			break;
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+/**
+ * Append a CSV field (quoted if it has commas, quotes or line breaks)
+ *
+ * @param out is the position in the buffer
+ * @param text is the null-terminated field
+ * @return the position after the field
+ */
+static char *append_csv_field(char *out, const char *text)
+{
+	size_t len = strlen(text);
+	if (strpbrk(text, ",\"\r\n") == NULL)
+	{
+		memcpy(out, text, len);
+		return out + len;
+	}
+
+	*out++ = '"';
+	for (size_t i = 0; i < len; i++)
+	{
+		if (text[i] == '"')
+			*out++ = '"';
+		*out++ = text[i];
+	}
+	*out++ = '"';
+	return out;
+}
+
+/**
+ * Append a literal string
+ *
+ * @param out is the position in the buffer
+ * @param text is the null-terminated string
+ * @return the position after the string
+ */
+static inline char *append_literal(char *out, const char *text)
+{
+	size_t len = strlen(text);
+	memcpy(out, text, len);
+	return out + len;
+}
+
+/**
+ * Get the name of the type of the entry (as in records of ingest streams)
+ *
+ * @param mode is the mode of the entry
+ * @return the name of the type
+ */
+static const char *type_name(uint32_t mode)
+{
+	if (S_ISDIR(mode))
+		return "dir";
+	if (S_ISLNK(mode))
+		return "symlink";
+	return "file";
+}
+
+/**
+ * Append the permission bits as an octal string ("0644")
+ *
+ * @param out is the position in the buffer
+ * @param mode is the mode of the entry
+ * @return the position after the digits
+ */
+static char *append_mode(char *out, uint32_t mode)
+{
+	uint32_t bits = mode & 07777;
+	*out++ = (char)('0' + ((bits >> 9) & 7));
+	*out++ = (char)('0' + ((bits >> 6) & 7));
+	*out++ = (char)('0' + ((bits >> 3) & 7));
+	*out++ = (char)('0' + (bits & 7));
+	return out;
+}
+
+/**
+ * Format a row of an entry (the buffer must have EXPORT_MAX_ROW_SIZE bytes free)
+ *
+ * @param format is the format of rows
+ * @param out is the position in the buffer
+ * @param path is the relative path of the entry
+ * @param entry is the entry
+ * @return the position after the row
+ */
+static char *format_row(enum export_format format, char *out, const char *path, const struct catalog_dir_entry *entry)
+{
+	const struct filestat *st = &entry->my_stat;
+	const char *target = (S_ISLNK(st->mode) && entry->link_target != NULL) ? entry->link_target : NULL;
+
+	if (format == EXPORT_FORMAT_CSV)
+	{
+		out = append_csv_field(out, path);
+		*out++ = ',';
+		out = append_literal(out, type_name(st->mode));
+		*out++ = ',';
+		out = append_i64(out, st->size);
+		*out++ = ',';
+		out = append_i64(out, st->blocks);
+		*out++ = ',';
+		out = append_mode(out, st->mode);
+		*out++ = ',';
+		out = append_u64(out, st->uid);
+		*out++ = ',';
+		out = append_u64(out, st->gid);
+		*out++ = ',';
+		out = append_u64(out, st->nlink);
+		*out++ = ',';
+		out = append_time(out, st->atime, st->atimensec);
+		*out++ = ',';
+		out = append_time(out, st->mtime, st->mtimensec);
+		*out++ = ',';
+		out = append_time(out, st->ctime, st->ctimensec);
+		*out++ = ',';
+		out = append_literal(out, st->sha256);
+		*out++ = ',';
+		if (target != NULL)
+			out = append_csv_field(out, target);
+		*out++ = '\n';
+		return out;
+	}
+
+	out = append_literal(out, "{\"path\":");
+	out = append_json_string(out, path);
+	out = append_literal(out, ",\"type\":\"");
+	out = append_literal(out, type_name(st->mode));
+	out = append_literal(out, "\",\"size\":");
+	out = append_i64(out, st->size);
+	out = append_literal(out, ",\"blocks\":");
+	out = append_i64(out, st->blocks);
+	out = append_literal(out, ",\"mode\":\"");
+	out = append_mode(out, st->mode);
+	out = append_literal(out, "\",\"uid\":");
+	out = append_u64(out, st->uid);
+	out = append_literal(out, ",\"gid\":");
+	out = append_u64(out, st->gid);
+	out = append_literal(out, ",\"nlink\":");
+	out = append_u64(out, st->nlink);
+	out = append_literal(out, ",\"atime\":");
+	out = append_time(out, st->atime, st->atimensec);
+	out = append_literal(out, ",\"mtime\":");
+	out = append_time(out, st->mtime, st->mtimensec);
+	out = append_literal(out, ",\"ctime\":");
+	out = append_time(out, st->ctime, st->ctimensec);
+	if (st->sha256[0] != '\0')
+	{
+		out = append_literal(out, ",\"sha256\":\"");
+		out = append_literal(out, st->sha256);
+		*out++ = '"';
+	}
+	if (target != NULL)
+	{
+		out = append_literal(out, ",\"target\":");
+		out = append_json_string(out, target);
+	}
+	out = append_literal(out, "}\n");
+	return out;
+}
+
+/**
+ * Export entries of a directory and queue its subdirectories
+ *
+ * @param worker is the worker
+ * @param dir_path is the relative path of the directory ("." for the root)
+ */
+static void export_process_dir(struct export_worker *worker, const char *dir_path)
+{
+	struct export_state *state = worker->state;
+
+	int fd = openat(state->catalog_fd, dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+	{
+		export_error(state, "Failed to open directory", -errno, dir_path);
+		return;
+	}
+
+	struct catalog_dir dir;
+	size_t errors = 0;
+	int res = catalog_dir_load_batch(fd, true, worker->loader, &dir, &errors);
+	(void)close(fd);
+	if (res != 0)
+	{
+		export_error(state, "Failed to load directory", (res < 0) ? res : -EIO, dir_path);
+		return;
+	}
+	if (errors > 0)
+	{
+		pthread_mutex_lock(&state->lock);
+		state->errors += errors;
+		pthread_mutex_unlock(&state->lock);
+		PrintToStderrF("Failed to read %zu entries (path: %s)", errors, dir_path);
+	}
+
+	for (size_t i = 0; i < dir.count; i++)
+	{
+		const struct catalog_dir_entry *entry = &dir.entries[i];
+		char *path = join_relpath(dir_path, entry->name);
+		if (path == NULL)
+		{
+			export_error(state, "Failed to export entry", -ENOMEM, dir_path);
+			continue;
+		}
+
+		if (worker->buffer != NULL && EXPORT_BUFFER_SIZE - worker->buffer->len < EXPORT_MAX_ROW_SIZE)
+			export_submit_buffer(worker);
+		if (worker->buffer == NULL)
+			worker->buffer = export_take_buffer(state);
+
+		struct export_buffer *buffer = worker->buffer;
+		char *end = format_row(state->format, buffer->data + buffer->len, path, entry);
+		buffer->len = (size_t)(end - buffer->data);
+		worker->buffer_rows++;
+
+		if (catalog_dir_entry_is_dir(entry))
+		{
+			pthread_mutex_lock(&state->lock);
+			res = export_push_locked(state, path);
+			pthread_mutex_unlock(&state->lock);
+
+			if (res != 0)
+				export_error(state, "Failed to queue directory", res, dir_path);
+		}
+		else
+		{
+			free(path);
+		}
+	}
+
+	catalog_dir_free(&dir);
+}
+
+/**
+ * Worker thread function
+ *
+ * @param arg is the worker
+ * @return NULL
+ */
+static void *export_worker_thread(void *arg)
+{
+	struct export_worker *worker = (struct export_worker *)arg;
+	struct export_state *state = worker->state;
+
+	pthread_mutex_lock(&state->lock);
+
+	while (true)
+	{
+		while (state->stack_count == 0 && state->busy_count > 0)
+		{
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+
+		if (state->stack_count == 0)
+		{
+			// Nothing is queued and nobody can queue more
+			state->finished = true;
+			pthread_cond_broadcast(&state->cond);
+			break;
+		}
+
+		char *path = state->stack[--state->stack_count];
+		state->busy_count++;
+		pthread_mutex_unlock(&state->lock);
+
+		// After a failed write the rest of the directories are dropped
+		if (!export_output_failed(state))
+			export_process_dir(worker, path);
+		free(path);
+
+		pthread_mutex_lock(&state->lock);
+		state->busy_count--;
+		state->dirs_done++;
+		pthread_cond_broadcast(&state->cond);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+
+	export_submit_buffer(worker);
+
+	return NULL;
+}
+
+/**
+ * Progress reporting thread function
+ *
+ * @param arg is the export state
+ * @return NULL
+ */
+static void *export_progress_thread(void *arg)
+{
+	struct export_state *state = (struct export_state *)arg;
+
+	pthread_mutex_lock(&state->lock);
+	while (!state->finished)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += state->progress_interval;
+
+		int res = pthread_cond_timedwait(&state->cond, &state->lock, &deadline);
+		if (res == ETIMEDOUT)
+		{
+			pthread_mutex_unlock(&state->lock);
+			export_print_progress(state, false);
+			pthread_mutex_lock(&state->lock);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Allocate the pool of output buffers
+ *
+ * @param state is the export state
+ * @return 0 on success, -ENOMEM on error
+ */
+static int export_alloc_buffers(struct export_state *state)
+{
+	state->buffers_count = (size_t)state->jobs * EXPORT_BUFFERS_PER_JOB;
+	state->buffers = (struct export_buffer *)calloc(state->buffers_count, sizeof(struct export_buffer));
+	state->free_buffers = (struct export_buffer **)calloc(state->buffers_count, sizeof(struct export_buffer *));
+	state->full_buffers = (struct export_buffer **)calloc(state->buffers_count, sizeof(struct export_buffer *));
+	if (state->buffers == NULL || state->free_buffers == NULL || state->full_buffers == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < state->buffers_count; i++)
+	{
+		state->buffers[i].data = (char *)malloc(EXPORT_BUFFER_SIZE);
+		if (state->buffers[i].data == NULL)
+			return -ENOMEM;
+		state->free_buffers[state->free_count++] = &state->buffers[i];
+	}
+
+	return 0;
+}
+
+/**
+ * Free the pool of output buffers
+ *
+ * @param state is the export state
+ */
+static void export_free_buffers(struct export_state *state)
+{
+	if (state->buffers != NULL)
+	{
+		for (size_t i = 0; i < state->buffers_count; i++)
+		{
+			free(state->buffers[i].data);
+		}
+	}
+	free(state->buffers);
+	free(state->free_buffers);
+	free(state->full_buffers);
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <catalog> [output]", program_name);
+	PrintToStdout("Writes metadata of all entries of a catalog as NDJSON or CSV rows");
+	PrintToStdout("(to stdout if the output is missing or \"-\").");
+	PrintToStdout("Options:");
+	PrintToStdout("-f   --format=<f>          format of rows: ndjson or csv");
+	PrintToStdout("                           (default: ndjson)");
+	PrintToStdout("-j   --jobs=<n>            number of threads");
+	PrintToStdout("                           (default: 4)");
+	PrintToStdout("-p   --progress=<sec>      interval of throughput reports to stderr, 0 to disable");
+	PrintToStdout("                           (default: 10)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Parse a positive number from a command line argument
+ *
+ * @param arg is the argument
+ * @param allow_zero determines if zero is allowed
+ * @param value is the target value
+ * @return true on success, false on error
+ */
+static bool parse_unsigned_arg(const char *arg, bool allow_zero, unsigned int *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || parsed > UINT_MAX || (!allow_zero && parsed == 0))
+		return false;
+
+	*value = (unsigned int)parsed;
+	return true;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct export_state state;
+	memset(&state, 0, sizeof(struct export_state));
+	state.jobs = EXPORT_DEFAULT_JOBS;
+	state.progress_interval = EXPORT_DEFAULT_PROGRESS_INTERVAL;
+	state.output_fd = STDOUT_FILENO;
+
+	static const struct option long_options[] = {
+		{"format", required_argument, NULL, 'f'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"progress", required_argument, NULL, 'p'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:j:p:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (strcmp(optarg, "ndjson") == 0)
+				state.format = EXPORT_FORMAT_NDJSON;
+			else if (strcmp(optarg, "csv") == 0)
+				state.format = EXPORT_FORMAT_CSV;
+			else
+			{
+				PrintToStderr("Invalid format (should be ndjson or csv)");
+				return EXPORT_EXIT_ERROR;
+			}
+			break;
+		case 'j':
+			if (!parse_unsigned_arg(optarg, false, &state.jobs))
+			{
+				PrintToStderr("Invalid number of jobs");
+				return EXPORT_EXIT_ERROR;
+			}
+			break;
+		case 'p':
+			if (!parse_unsigned_arg(optarg, true, &state.progress_interval))
+			{
+				PrintToStderr("Invalid progress interval");
+				return EXPORT_EXIT_ERROR;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return EXPORT_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return EXPORT_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 1 && argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return EXPORT_EXIT_ERROR;
+	}
+
+	state.catalog_fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (state.catalog_fd == -1)
+	{
+		PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), argv[optind]);
+		return EXPORT_EXIT_ERROR;
+	}
+
+	if (argc - optind == 2 && strcmp(argv[optind + 1], "-") != 0)
+	{
+		state.output_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (state.output_fd == -1)
+		{
+			PrintToStderrF("Failed to open output: %s (path: %s)", strerror(errno), argv[optind + 1]);
+			(void)close(state.catalog_fd);
+			return EXPORT_EXIT_ERROR;
+		}
+	}
+
+	struct export_worker *workers = (struct export_worker *)calloc(state.jobs, sizeof(struct export_worker));
+	pthread_t *threads = (pthread_t *)calloc(state.jobs, sizeof(pthread_t));
+	char *root = strdup(".");
+	int res = (workers == NULL || threads == NULL || root == NULL) ? -ENOMEM : export_alloc_buffers(&state);
+	for (unsigned int i = 0; res == 0 && i < state.jobs; i++)
+	{
+		workers[i].state = &state;
+		res = batch_loader_new(&workers[i].loader, BATCH_LOADER_DEFAULT_DEPTH);
+	}
+
+	if (res != 0)
+	{
+		PrintToStderr("Failed to allocate workers");
+		for (unsigned int i = 0; workers != NULL && i < state.jobs; i++)
+		{
+			batch_loader_free(workers[i].loader);
+		}
+		export_free_buffers(&state);
+		free(workers);
+		free(threads);
+		free(root);
+		if (state.output_fd != STDOUT_FILENO)
+			(void)close(state.output_fd);
+		(void)close(state.catalog_fd);
+		return EXPORT_EXIT_ERROR;
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	pthread_mutex_init(&state.output_lock, NULL);
+	pthread_cond_init(&state.buffer_free, NULL);
+	pthread_cond_init(&state.buffer_full, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &state.start_time);
+
+	if (state.format == EXPORT_FORMAT_CSV)
+	{
+		struct export_worker header;
+		memset(&header, 0, sizeof(struct export_worker));
+		header.state = &state;
+		header.buffer = export_take_buffer(&state);
+		char *end = append_literal(header.buffer->data, "path,type,size,blocks,mode,uid,gid,nlink,"
+														"atime,mtime,ctime,sha256,target\n");
+		header.buffer->len = (size_t)(end - header.buffer->data);
+		export_submit_buffer(&header);
+	}
+
+	pthread_t writer_thread;
+	bool has_writer_thread = (pthread_create(&writer_thread, NULL, export_writer_thread, &state) == 0);
+
+	pthread_mutex_lock(&state.lock);
+	res = (has_writer_thread) ? export_push_locked(&state, root) : -EAGAIN;
+	pthread_mutex_unlock(&state.lock);
+	if (!has_writer_thread)
+		free(root);
+
+	unsigned int threads_count = 0;
+	for (unsigned int i = 0; res == 0 && i < state.jobs; i++)
+	{
+		if (pthread_create(&threads[threads_count], NULL, export_worker_thread, &workers[i]) != 0)
+		{
+			PrintToStderr("Failed to create worker thread");
+			break;
+		}
+		threads_count++;
+	}
+
+	pthread_t progress_thread;
+	bool has_progress_thread = false;
+	if (threads_count > 0 && state.progress_interval > 0)
+	{
+		has_progress_thread = (pthread_create(&progress_thread, NULL, export_progress_thread, &state) == 0);
+	}
+
+	for (unsigned int i = 0; i < threads_count; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	if (has_progress_thread)
+	{
+		pthread_join(progress_thread, NULL);
+	}
+
+	if (has_writer_thread)
+	{
+		pthread_mutex_lock(&state.output_lock);
+		state.output_closed = true;
+		pthread_cond_signal(&state.buffer_full);
+		pthread_mutex_unlock(&state.output_lock);
+		pthread_join(writer_thread, NULL);
+	}
+
+	if (state.output_fd != STDOUT_FILENO && close(state.output_fd) == -1 && state.output_error == 0)
+		state.output_error = -errno;
+
+	if (threads_count == 0)
+	{
+		PrintToStderrF("Failed to start export: %s", strerror((res < 0) ? -res : EAGAIN));
+		state.errors++;
+	}
+	else
+	{
+		if (state.output_error != 0)
+		{
+			PrintToStderrF("Failed to write output: %s", strerror(-state.output_error));
+			state.errors++;
+		}
+		export_print_progress(&state, true);
+	}
+
+	for (unsigned int i = 0; i < state.jobs; i++)
+	{
+		batch_loader_free(workers[i].loader);
+	}
+	for (size_t i = 0; i < state.stack_count; i++)
+	{
+		free(state.stack[i]);
+	}
+	free(state.stack);
+	export_free_buffers(&state);
+	free(workers);
+	free(threads);
+	(void)close(state.catalog_fd);
+	pthread_cond_destroy(&state.buffer_full);
+	pthread_cond_destroy(&state.buffer_free);
+	pthread_mutex_destroy(&state.output_lock);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return (state.errors > 0) ? EXPORT_EXIT_ERROR : EXPORT_EXIT_OK;
+}
@@ -0,0 +1,1894 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-from-tar - creates a CatalogFS catalog (index) of the members of
+ * a tar or cpio archive without extracting it.
+ *
+ * The archive is read once, sequentially, from a file or stdin (so
+ * compressed archives can be piped through zcat, xzcat and so on).
+ * Only headers are parsed, contents of members are skipped: with lseek() if
+ * the archive is a regular file, by reading otherwise. With --sha256 contents
+ * of regular members are hashed while they are read, so the catalog gets
+ * the hashes without a second pass over the data.
+ *
+ * Supported formats:
+ *
+ *  - tar: v7, ustar (prefix of names), GNU (long names and link targets,
+ *    base-256 numbers, atime and ctime, old sparse members) and PAX (per-member
+ *    and global extended headers: path, linkpath, size, uid, gid, times with
+ *    nanoseconds and GNU sparse names and sizes);
+ *  - cpio: "newc" and "crc" (as written by cpio -H newc) and "odc" (POSIX.1
+ *    portable format), binary cpio archives are not supported.
+ *
+ * Entries get the original sizes (real sizes of sparse members), modes,
+ * owners and times of the archive. Hard links get the record of their target.
+ * Devices, fifos, sockets and volume labels are skipped and counted.
+ * Members are created in batches by an ingest stream (see ingest.h), existing
+ * entries of the catalog are replaced, so several archives can be indexed
+ * into one catalog (e.g. with --prefix).
+ *
+ * Throughput is reported to stderr periodically and at the end.
+ *
+ * Exit code is 0 on success, 1 if some members failed or the archive is broken.
+ */
+
+#include "header_common.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "ingest.h"
+#include "path_hash.h"
+#include "sha256.h"
+#include "storage.h"
+
+#include "log.h"
+
+/** Exit code: all members are indexed */
+#define FROM_TAR_EXIT_OK (0)
+/** Exit code: some error happened */
+#define FROM_TAR_EXIT_ERROR (1)
+
+/** Default interval of progress reports in seconds */
+#define FROM_TAR_DEFAULT_PROGRESS_INTERVAL (10)
+
+/** Size of reads of the archive */
+#define FROM_TAR_READ_BUFFER_SIZE (1024 * 1024)
+
+/** Maximum size of extended headers and long names kept in memory */
+#define FROM_TAR_MAX_EXTENDED_SIZE (1024 * 1024)
+
+/** Size of tar blocks */
+#define TAR_BLOCK_SIZE (512)
+
+/** Size of headers of cpio archives */
+#define CPIO_NEWC_HEADER_SIZE (110)
+#define CPIO_ODC_HEADER_SIZE (76)
+
+/** Size of magic numbers of cpio archives */
+#define CPIO_MAGIC_SIZE (6)
+
+/** Name of the last member of cpio archives */
+#define CPIO_TRAILER_NAME "TRAILER!!!"
+
+/**
+ * Format of the archive
+ */
+enum archive_format
+{
+	/** Detected by the first bytes */
+	ARCHIVE_FORMAT_AUTO = 0,
+
+	/** tar (any variant) */
+	ARCHIVE_FORMAT_TAR,
+
+	/** cpio (newc, crc or odc) */
+	ARCHIVE_FORMAT_CPIO,
+};
+
+/**
+ * Buffered sequential reader of the archive
+ */
+struct archive_reader
+{
+	/** File descriptor of the archive */
+	int fd;
+
+	/** The archive is a regular file, so data can be skipped by lseek() */
+	bool seekable;
+
+	/** Size of the archive (if seekable) */
+	uint64_t file_size;
+
+	/** Buffer of read data */
+	uint8_t *buf;
+
+	/** Position of the next byte in the buffer */
+	size_t pos;
+
+	/** Number of valid bytes in the buffer */
+	size_t len;
+
+	/** The end of the archive was read */
+	bool eof;
+
+	/** Number of bytes of the archive consumed so far */
+	uint64_t offset;
+};
+
+/**
+ * Values of PAX extended headers (and of GNU long names)
+ */
+struct pax_values
+{
+	/** Path of the member (NULL if not set) */
+	char *path;
+
+	/** Target of the link (NULL if not set) */
+	char *link_path;
+
+	/** Real name of a GNU sparse member (NULL if not set) */
+	char *sparse_name;
+
+	/** Size of data of the member */
+	uint64_t size;
+
+	/** Real size of a GNU sparse member */
+	uint64_t sparse_size;
+
+	/** Owner and group */
+	uint32_t uid;
+	uint32_t gid;
+
+	/** Times with nanoseconds */
+	int64_t atime;
+	int64_t atimensec;
+	int64_t mtime;
+	int64_t mtimensec;
+	int64_t ctime;
+	int64_t ctimensec;
+
+	/** Flags of set numeric values (enum pax_key) */
+	unsigned int keys;
+
+	/** Some value is broken, the member can't be indexed */
+	bool broken;
+};
+
+/**
+ * Flags of numeric values of PAX headers
+ */
+enum pax_key
+{
+	PAX_SIZE = 1 << 0,
+	PAX_SPARSE_SIZE = 1 << 1,
+	PAX_UID = 1 << 2,
+	PAX_GID = 1 << 3,
+	PAX_ATIME = 1 << 4,
+	PAX_MTIME = 1 << 5,
+	PAX_CTIME = 1 << 6,
+};
+
+/**
+ * Members of a cpio archive that share an inode (hard links)
+ */
+struct cpio_link
+{
+	/** Record of the inode (valid if has_data is true) */
+	struct filestat my_stat;
+
+	/** The member with the data of the inode was read */
+	bool has_data;
+
+	/** Paths of members read before the member with data */
+	char **paths;
+
+	/** Number of paths */
+	size_t count;
+
+	/** Allocated size of paths */
+	size_t capacity;
+};
+
+/**
+ * State of the import
+ */
+struct from_tar_state
+{
+	/** Format of the archive */
+	enum archive_format format;
+
+	/** Hash contents of regular members */
+	bool hash;
+
+	/** Normalized directory of the catalog to put members into (NULL for the root) */
+	char *prefix;
+
+	/** Interval of progress reports in seconds (0 to disable) */
+	unsigned int progress_interval;
+
+	/** Reader of the archive */
+	struct archive_reader reader;
+
+	/** File descriptor of the catalog */
+	int catalog_fd;
+
+	/** Writer of index files */
+	struct ingest_writer writer;
+
+	/** Stream of records */
+	struct ingest_stream stream;
+
+	/** Values of global PAX headers */
+	struct pax_values global;
+
+	/** Hard links of cpio archives by device and inode */
+	struct path_hash links;
+
+	/** Number of members passed to the stream */
+	uint64_t members;
+
+	/** Number of skipped members (devices, fifos and so on) */
+	uint64_t skipped;
+
+	/** Number of members that failed before reaching the stream */
+	uint64_t errors;
+
+	/** Total size of regular members */
+	uint64_t data_bytes;
+
+	/** Message of the first error (empty if there is no error) */
+	char first_error_message[INGEST_ERROR_MESSAGE_SIZE];
+
+	/** Time (monotonic) of the start */
+	struct timespec start_time;
+
+	/** Time (monotonic) of the last progress report */
+	struct timespec report_time;
+};
+
+/**
+ * Get seconds between two times
+ *
+ * @param from is the earlier time
+ * @param to is the later time
+ * @return elapsed seconds
+ */
+static double elapsed_seconds(const struct timespec *from, const struct timespec *to)
+{
+	return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * Print a progress report
+ *
+ * @param state is the state
+ * @param is_final determines if it's the final report
+ */
+static void from_tar_print_progress(struct from_tar_state *state, bool is_final)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state->report_time = now;
+
+	double elapsed = elapsed_seconds(&state->start_time, &now);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	double mib = (double)state->reader.offset / (1024.0 * 1024.0);
+	uint64_t errors = state->errors + state->stream.errors;
+
+	PrintToStderrF("%s: %" PRIu64 " entries (%.0f/s), %.1f MiB of archive (%.1f MiB/s), "
+				   "%" PRIu64 " bytes of files, %" PRIu64 " skipped, %" PRIu64 " errors, %.1f s",
+				   (is_final) ? "Finished" : "Progress",
+				   state->members, (double)state->members / elapsed, mib, mib / elapsed,
+				   state->data_bytes, state->skipped, errors, elapsed);
+}
+
+/**
+ * Print a progress report if the interval has passed
+ *
+ * @param state is the state
+ */
+static void from_tar_check_progress(struct from_tar_state *state)
+{
+	if (state->progress_interval == 0)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (elapsed_seconds(&state->report_time, &now) >= (double)state->progress_interval)
+		from_tar_print_progress(state, false);
+}
+
+/**
+ * Remember the message of the first error
+ *
+ * @param state is the state
+ * @param format is the printf-like format of the message
+ */
+static void from_tar_error(struct from_tar_state *state, const char *format, ...)
+{
+	state->errors++;
+	if (state->first_error_message[0] != '\0')
+		return;
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(state->first_error_message, sizeof(state->first_error_message), format, args);
+	va_end(args);
+}
+
+/**
+ * Apply waiting records of the stream and remember the first error
+ *
+ * @param state is the state
+ */
+static void from_tar_flush(struct from_tar_state *state)
+{
+	if (ingest_stream_flush(&state->stream) != 0 && state->first_error_message[0] == '\0')
+	{
+		memcpy(state->first_error_message, state->stream.first_error_message,
+			   sizeof(state->first_error_message));
+	}
+}
+
+/**
+ * Open the archive for reading
+ *
+ * @param reader is the reader
+ * @param fd is the file descriptor of the archive (not owned)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int reader_init(struct archive_reader *reader, int fd)
+{
+	memset(reader, 0, sizeof(struct archive_reader));
+	reader->fd = fd;
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode))
+	{
+		reader->seekable = true;
+		reader->file_size = (uint64_t)stbuf.st_size;
+		(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	reader->buf = (uint8_t *)malloc(FROM_TAR_READ_BUFFER_SIZE);
+	if (reader->buf == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Read more data into the buffer (sets eof at the end of the archive)
+ *
+ * @param reader is the reader
+ * @return 0 on success, -errno on error
+ */
+static int reader_fill(struct archive_reader *reader)
+{
+	if (reader->pos > 0)
+	{
+		memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+		reader->len -= reader->pos;
+		reader->pos = 0;
+	}
+
+	ssize_t res;
+	do
+	{
+		res = read(reader->fd, reader->buf + reader->len, FROM_TAR_READ_BUFFER_SIZE - reader->len);
+	} while (res == -1 && errno == EINTR);
+
+	if (res == -1)
+		return -errno;
+
+	if (res == 0)
+		reader->eof = true;
+	reader->len += (size_t)res;
+	return 0;
+}
+
+/**
+ * Check if all data of the archive is consumed
+ *
+ * @param reader is the reader
+ * @param at_end is set to true at the end of the archive
+ * @return 0 on success, -errno on error
+ */
+static int reader_at_end(struct archive_reader *reader, bool *at_end)
+{
+	if (reader->pos == reader->len && !reader->eof)
+	{
+		int res = reader_fill(reader);
+		if (res != 0)
+			return res;
+	}
+
+	*at_end = (reader->pos == reader->len && reader->eof);
+	return 0;
+}
+
+/**
+ * Read data of the archive
+ *
+ * @param reader is the reader
+ * @param data is the target buffer
+ * @param size is the number of bytes to read
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int reader_read(struct archive_reader *reader, void *data, size_t size)
+{
+	uint8_t *out = (uint8_t *)data;
+	while (size > 0)
+	{
+		if (reader->pos == reader->len)
+		{
+			if (reader->eof)
+				return -ENODATA;
+
+			int res = reader_fill(reader);
+			if (res != 0)
+				return res;
+			continue;
+		}
+
+		size_t chunk = reader->len - reader->pos;
+		if (chunk > size)
+			chunk = size;
+		memcpy(out, reader->buf + reader->pos, chunk);
+		reader->pos += chunk;
+		reader->offset += chunk;
+		out += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * Skip data of the archive (seeks over large parts of seekable archives that are not hashed)
+ *
+ * @param reader is the reader
+ * @param size is the number of bytes to skip
+ * @param hash is the context to hash skipped data (can be NULL)
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int reader_skip(struct archive_reader *reader, uint64_t size, struct sha256_ctx *hash)
+{
+	while (size > 0)
+	{
+		if (reader->pos == reader->len)
+		{
+			if (reader->eof)
+				return -ENODATA;
+
+			// Small parts are read anyway, the next header is usually right after them
+			if (hash == NULL && reader->seekable && size >= FROM_TAR_READ_BUFFER_SIZE)
+			{
+				if (size > (uint64_t)INT64_MAX)
+					return -ENODATA;
+
+				off_t target = lseek(reader->fd, (off_t)size, SEEK_CUR);
+				if (target == (off_t)-1)
+					return -errno;
+				if ((uint64_t)target > reader->file_size)
+				{
+					reader->offset = reader->file_size;
+					return -ENODATA;
+				}
+
+				reader->offset += size;
+				return 0;
+			}
+
+			int res = reader_fill(reader);
+			if (res != 0)
+				return res;
+			continue;
+		}
+
+		size_t chunk = reader->len - reader->pos;
+		if ((uint64_t)chunk > size)
+			chunk = (size_t)size;
+		if (hash != NULL)
+			sha256_update(hash, reader->buf + reader->pos, chunk);
+		reader->pos += chunk;
+		reader->offset += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * Skip data of a member and hash it if needed
+ *
+ * @param state is the state
+ * @param size is the size of the data
+ * @param my_stat is the record that gets the hash (NULL to not hash the data)
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int from_tar_skip_data(struct from_tar_state *state, uint64_t size, struct filestat *my_stat)
+{
+	if (my_stat == NULL || !state->hash)
+		return reader_skip(&state->reader, size, NULL);
+
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+	int res = reader_skip(&state->reader, size, &ctx);
+	if (res != 0)
+		return res;
+
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	sha256_final(&ctx, digest);
+	sha256_to_hex(digest, my_stat->sha256);
+	return 0;
+}
+
+/**
+ * Fill the record of a member with defaults of archives
+ *
+ * @param my_stat is the record
+ * @param mode is the mode with the type
+ * @param size is the size
+ * @param mtime is the modification time (also used as atime and ctime)
+ */
+static void fill_member_stat(struct filestat *my_stat, uint32_t mode, uint64_t size, int64_t mtime)
+{
+	memset(my_stat, 0, sizeof(struct filestat));
+	my_stat->mode = mode;
+	my_stat->size = (int64_t)size;
+	my_stat->blocks = convert_filesize_to_fileblocks(my_stat->size);
+	my_stat->atime = mtime;
+	my_stat->mtime = mtime;
+	my_stat->ctime = mtime;
+	my_stat->nlink = ((mode & S_IFMT) == S_IFDIR) ? 2 : 1;
+	my_stat->blksize = 4096;
+}
+
+/**
+ * Pass a record of a member to the stream
+ *
+ * @param state is the state
+ * @param path is the path of the member (relative to the archive)
+ * @param my_stat is the record
+ * @param link_target is the target of a symlink (NULL for other types)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int from_tar_emit(struct from_tar_state *state, const char *path, const struct filestat *my_stat,
+						 const char *link_target)
+{
+	struct ingest_record record;
+	memset(&record, 0, sizeof(struct ingest_record));
+	record.my_stat = *my_stat;
+	record.line = ++state->members;
+
+	size_t path_len = strlen(path);
+	size_t prefix_len = (state->prefix != NULL) ? strlen(state->prefix) : 0;
+	record.path = (char *)malloc(prefix_len + 1 + path_len + 1);
+	if (record.path == NULL)
+		return -ENOMEM;
+
+	if (prefix_len > 0)
+	{
+		memcpy(record.path, state->prefix, prefix_len);
+		record.path[prefix_len] = '/';
+		memcpy(record.path + prefix_len + 1, path, path_len + 1);
+	}
+	else
+	{
+		memcpy(record.path, path, path_len + 1);
+	}
+
+	if (link_target != NULL)
+	{
+		record.link_target = strdup(link_target);
+		if (record.link_target == NULL)
+		{
+			free(record.path);
+			return -ENOMEM;
+		}
+	}
+
+	if ((my_stat->mode & S_IFMT) == S_IFREG)
+		state->data_bytes += (uint64_t)my_stat->size;
+
+	ingest_stream_add_record(&state->stream, &record);
+	from_tar_check_progress(state);
+	return 0;
+}
+
+/**
+ * Create a hard link of a tar archive: the record of its target is copied
+ *
+ * @param state is the state
+ * @param path is the path of the member
+ * @param target is the path of the target in the archive
+ * @param my_stat is the record of the member (used for the owner, mode and times)
+ * @return 0 on success, -ENOMEM on error (other errors are counted)
+ */
+static int from_tar_hard_link(struct from_tar_state *state, const char *path, const char *target,
+							  struct filestat *my_stat)
+{
+	// The target is a member read earlier, it can still wait in the stream
+	from_tar_flush(state);
+
+	struct ingest_record lookup;
+	memset(&lookup, 0, sizeof(struct ingest_record));
+	lookup.my_stat.mode = S_IFREG;
+	size_t prefix_len = (state->prefix != NULL) ? strlen(state->prefix) : 0;
+	lookup.path = (char *)malloc(prefix_len + 1 + strlen(target) + 1);
+	if (lookup.path == NULL)
+		return -ENOMEM;
+	sprintf(lookup.path, "%s/%s", (state->prefix != NULL) ? state->prefix : "", target);
+
+	char message[INGEST_ERROR_MESSAGE_SIZE];
+	if (ingest_record_check(&lookup, message, sizeof(message)) != 0)
+	{
+		from_tar_error(state, "hard link \"%s\": %s", path, message);
+		ingest_record_free(&lookup);
+		return 0;
+	}
+
+	// Split to the directory and the name
+	char *slash = strrchr(lookup.path, '/');
+	const char *name = lookup.path;
+	int dir_fd = state->catalog_fd;
+	if (slash != NULL)
+	{
+		*slash = '\0';
+		name = slash + 1;
+		dir_fd = openat(state->catalog_fd, lookup.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		*slash = '/';
+	}
+
+	int res = (dir_fd != -1) ? 0 : -errno;
+	struct stat stbuf;
+	struct filestat target_stat;
+	if (res == 0 && fstatat(dir_fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+		res = -errno;
+	if (res == 0 && !S_ISREG(stbuf.st_mode))
+		res = -EINVAL;
+	if (res == 0)
+	{
+		fill_filestat_from_stat(&target_stat, &stbuf);
+		res = storage_read_filestat(dir_fd, name, &stbuf, &target_stat);
+	}
+	if (dir_fd != -1 && dir_fd != state->catalog_fd)
+		(void)close(dir_fd);
+
+	if (res != 0)
+	{
+		from_tar_error(state, "hard link \"%s\": target \"%s\" is not an indexed file (%s)",
+					   path, lookup.path, strerror(-res));
+		ingest_record_free(&lookup);
+		return 0;
+	}
+	ingest_record_free(&lookup);
+
+	my_stat->size = target_stat.size;
+	my_stat->blocks = target_stat.blocks;
+	memcpy(my_stat->sha256, target_stat.sha256, sizeof(my_stat->sha256));
+	return from_tar_emit(state, path, my_stat, NULL);
+}
+
+/**
+ * Parse a numeric field of a tar header (octal or GNU base-256)
+ *
+ * @param field is the field
+ * @param len is the length of the field
+ * @param value is the parsed value
+ * @return true on success, false for broken and negative values
+ */
+static bool tar_parse_number(const uint8_t *field, size_t len, uint64_t *value)
+{
+	uint64_t result = 0;
+
+	if (field[0] & 0x80)
+	{
+		// Base-256, negative values (0xff) are not supported
+		if (field[0] == 0xff)
+			return false;
+
+		result = field[0] & 0x7f;
+		for (size_t i = 1; i < len; i++)
+		{
+			if (result >> 56)
+				return false;
+			result = (result << 8) | field[i];
+		}
+
+		*value = result;
+		return true;
+	}
+
+	size_t i = 0;
+	while (i < len && field[i] == ' ')
+		i++;
+	while (i < len && field[i] >= '0' && field[i] <= '7')
+	{
+		if (result >> 61)
+			return false;
+		result = (result << 3) | (uint64_t)(field[i] - '0');
+		i++;
+	}
+	if (i < len && field[i] != ' ' && field[i] != '\0')
+		return false;
+
+	*value = result;
+	return true;
+}
+
+/**
+ * Check the checksum of a tar header (sums of unsigned and signed bytes are accepted)
+ *
+ * @param header is the header
+ * @return true if the checksum matches
+ */
+static bool tar_checksum_ok(const uint8_t *header)
+{
+	uint64_t expected;
+	if (!tar_parse_number(header + 148, 8, &expected))
+		return false;
+
+	uint64_t sum = 0;
+	int64_t signed_sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+	{
+		uint8_t c = (i >= 148 && i < 156) ? (uint8_t)' ' : header[i];
+		sum += c;
+		signed_sum += (int8_t)c;
+	}
+
+	return expected == sum || (int64_t)expected == signed_sum;
+}
+
+/**
+ * Check if a block is filled with zeros (the end of a tar archive)
+ *
+ * @param block is the block
+ * @return true if all bytes are zero
+ */
+static bool tar_block_is_zero(const uint8_t *block)
+{
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+	{
+		if (block[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Parse a decimal number of a PAX header
+ *
+ * @param value is the value
+ * @param number is the parsed number
+ * @return true on success
+ */
+static bool pax_parse_unsigned(const char *value, uint64_t *number)
+{
+	if (*value < '0' || *value > '9')
+		return false;
+
+	char *end = NULL;
+	errno = 0;
+	unsigned long long parsed = strtoull(value, &end, 10);
+	if (errno != 0 || *end != '\0')
+		return false;
+
+	*number = (uint64_t)parsed;
+	return true;
+}
+
+/**
+ * Parse a time of a PAX header (seconds with an optional fraction, can be negative)
+ *
+ * @param value is the value
+ * @param sec is the parsed seconds
+ * @param nsec is the parsed nanoseconds
+ * @return true on success
+ */
+static bool pax_parse_time(const char *value, int64_t *sec, int64_t *nsec)
+{
+	bool negative = (*value == '-');
+	if (negative)
+		value++;
+
+	uint64_t whole = 0;
+	int digits = 0;
+	while (*value >= '0' && *value <= '9')
+	{
+		if (whole > (uint64_t)INT64_MAX / 10)
+			return false;
+		whole = whole * 10 + (uint64_t)(*value - '0');
+		value++;
+		digits++;
+	}
+
+	int64_t fraction = 0;
+	if (*value == '.')
+	{
+		value++;
+		int64_t scale = 100000000;
+		while (*value >= '0' && *value <= '9')
+		{
+			fraction += (int64_t)(*value - '0') * scale;
+			scale /= 10;
+			value++;
+			digits++;
+		}
+	}
+
+	if (digits == 0 || *value != '\0')
+		return false;
+
+	*sec = (int64_t)whole;
+	*nsec = fraction;
+	if (negative)
+	{
+		// -1.25 is 1.25 seconds before the epoch: -2 seconds and 0.75
+		*sec = -*sec;
+		if (fraction > 0)
+		{
+			*sec -= 1;
+			*nsec = 1000000000 - fraction;
+		}
+	}
+	return true;
+}
+
+/**
+ * Replace a string value of PAX values
+ *
+ * @param target is the value
+ * @param value is the new value (empty to unset)
+ * @return 0 on success, -ENOMEM on error
+ */
+static int pax_set_string(char **target, const char *value)
+{
+	free(*target);
+	*target = NULL;
+	if (value[0] == '\0')
+		return 0;
+
+	*target = strdup(value);
+	return (*target != NULL) ? 0 : -ENOMEM;
+}
+
+/**
+ * Set one value of a PAX header (unknown keys are ignored)
+ *
+ * @param values is the target values
+ * @param key is the key
+ * @param value is the value (empty to unset)
+ * @return 0 on success, -EINVAL for broken values, -ENOMEM on error
+ */
+static int pax_set(struct pax_values *values, const char *key, const char *value)
+{
+	if (strcmp(key, "path") == 0)
+		return pax_set_string(&values->path, value);
+	if (strcmp(key, "linkpath") == 0)
+		return pax_set_string(&values->link_path, value);
+	if (strcmp(key, "GNU.sparse.name") == 0)
+		return pax_set_string(&values->sparse_name, value);
+
+	unsigned int flag = 0;
+	bool ok = true;
+	uint64_t number = 0;
+	if (strcmp(key, "size") == 0)
+	{
+		flag = PAX_SIZE;
+		ok = (value[0] == '\0' || pax_parse_unsigned(value, &values->size));
+	}
+	else if (strcmp(key, "GNU.sparse.realsize") == 0 || strcmp(key, "GNU.sparse.size") == 0)
+	{
+		flag = PAX_SPARSE_SIZE;
+		ok = (value[0] == '\0' || pax_parse_unsigned(value, &values->sparse_size));
+	}
+	else if (strcmp(key, "uid") == 0 || strcmp(key, "gid") == 0)
+	{
+		flag = (key[0] == 'u') ? PAX_UID : PAX_GID;
+		ok = (value[0] == '\0' || (pax_parse_unsigned(value, &number) && number <= UINT32_MAX));
+		if (flag == PAX_UID)
+			values->uid = (uint32_t)number;
+		else
+			values->gid = (uint32_t)number;
+	}
+	else if (strcmp(key, "atime") == 0)
+	{
+		flag = PAX_ATIME;
+		ok = (value[0] == '\0' || pax_parse_time(value, &values->atime, &values->atimensec));
+	}
+	else if (strcmp(key, "mtime") == 0)
+	{
+		flag = PAX_MTIME;
+		ok = (value[0] == '\0' || pax_parse_time(value, &values->mtime, &values->mtimensec));
+	}
+	else if (strcmp(key, "ctime") == 0)
+	{
+		flag = PAX_CTIME;
+		ok = (value[0] == '\0' || pax_parse_time(value, &values->ctime, &values->ctimensec));
+	}
+
+	if (!ok)
+		return -EINVAL;
+
+	if (value[0] == '\0')
+		values->keys &= ~flag;
+	else
+		values->keys |= flag;
+	return 0;
+}
+
+/**
+ * Parse records of a PAX extended header ("<length> <key>=<value>\n")
+ *
+ * @param data is the data of the header (null-terminated)
+ * @param size is the size of data
+ * @param values is the target values
+ * @return 0 on success, -EINVAL for broken headers, -ENOMEM on error
+ */
+static int pax_parse(char *data, size_t size, struct pax_values *values)
+{
+	size_t pos = 0;
+	while (pos < size && data[pos] != '\0')
+	{
+		size_t len = 0;
+		size_t i = pos;
+		while (i < size && data[i] >= '0' && data[i] <= '9' && len <= size)
+		{
+			len = len * 10 + (size_t)(data[i] - '0');
+			i++;
+		}
+
+		if (i == pos || i >= size || data[i] != ' ' || len <= i - pos + 1 || len > size - pos ||
+			data[pos + len - 1] != '\n')
+		{
+			return -EINVAL;
+		}
+
+		// Key and value are null-terminated in place
+		char *key = data + i + 1;
+		data[pos + len - 1] = '\0';
+		char *eq = strchr(key, '=');
+		if (eq == NULL)
+			return -EINVAL;
+		*eq = '\0';
+
+		int res = pax_set(values, key, eq + 1);
+		if (res != 0)
+			return res;
+
+		pos += len;
+	}
+
+	return 0;
+}
+
+/**
+ * Free memory of PAX values
+ *
+ * @param values is the values
+ */
+static void pax_values_free(struct pax_values *values)
+{
+	free(values->path);
+	free(values->link_path);
+	free(values->sparse_name);
+	memset(values, 0, sizeof(struct pax_values));
+}
+
+/**
+ * Read data of an extended header or a long name into memory
+ *
+ * @param state is the state
+ * @param size is the size of data
+ * @param data is the read data (null-terminated, NULL if it is too large and skipped)
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int tar_read_extended(struct from_tar_state *state, uint64_t size, char **data)
+{
+	*data = NULL;
+	uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+	if (size > FROM_TAR_MAX_EXTENDED_SIZE)
+		return reader_skip(&state->reader, padded, NULL);
+
+	char *buf = (char *)malloc((size_t)size + 1);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	int res = reader_read(&state->reader, buf, (size_t)size);
+	if (res == 0)
+		res = reader_skip(&state->reader, padded - size, NULL);
+	if (res != 0)
+	{
+		free(buf);
+		return res;
+	}
+
+	buf[size] = '\0';
+	*data = buf;
+	return 0;
+}
+
+/**
+ * Handle a header that describes the next member (PAX headers and GNU long names)
+ *
+ * @param state is the state
+ * @param typeflag is the type of the header
+ * @param size is the size of its data
+ * @param local is the values of the next member
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int tar_read_meta(struct from_tar_state *state, char typeflag, uint64_t size, struct pax_values *local)
+{
+	char *data;
+	int res = tar_read_extended(state, size, &data);
+	if (res != 0)
+		return res;
+
+	if (data == NULL)
+	{
+		local->broken = true;
+		return 0;
+	}
+
+	switch (typeflag)
+	{
+	case 'x':
+		res = pax_parse(data, (size_t)size, local);
+		break;
+	case 'g':
+		res = pax_parse(data, (size_t)size, &state->global);
+		break;
+	case 'L':
+		res = pax_set_string(&local->path, data);
+		break;
+	default: // 'K'
+		res = pax_set_string(&local->link_path, data);
+		break;
+	}
+	free(data);
+
+	if (res == -EINVAL)
+	{
+		// A broken global header spoils only itself
+		if (typeflag != 'g')
+			local->broken = true;
+		from_tar_error(state, "broken extended header at offset %" PRIu64, state->reader.offset - size);
+		res = 0;
+	}
+	return res;
+}
+
+/**
+ * Index one member of a tar archive and skip its data
+ *
+ * @param state is the state
+ * @param header is the header of the member
+ * @param local is the values of PAX headers and long names of the member
+ * @return 0 on success, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int tar_read_member(struct from_tar_state *state, const uint8_t *header, const struct pax_values *local)
+{
+	char typeflag = (char)header[156];
+	bool gnu = (memcmp(header + 257, "ustar  ", 8) == 0);
+	bool ustar = (memcmp(header + 257, "ustar", 6) == 0);
+
+	// Values of the member: header < global PAX header < PAX header (or long names) of the member
+	const struct pax_values *global = &state->global;
+	unsigned int keys = local->keys | global->keys;
+	bool broken = local->broken;
+
+	uint64_t size = 0;
+	uint64_t mode = 0;
+	uint64_t uid = 0;
+	uint64_t gid = 0;
+	uint64_t mtime = 0;
+	if ((local->keys & PAX_SIZE))
+		size = local->size;
+	else if ((global->keys & PAX_SIZE))
+		size = global->size;
+	else if (!tar_parse_number(header + 124, 12, &size))
+		return -EINVAL; // Data can't be skipped without the size
+
+	if (!tar_parse_number(header + 100, 8, &mode) || !tar_parse_number(header + 108, 8, &uid) ||
+		!tar_parse_number(header + 116, 8, &gid) || !tar_parse_number(header + 136, 12, &mtime) ||
+		uid > UINT32_MAX || gid > UINT32_MAX || mtime > (uint64_t)INT64_MAX)
+	{
+		broken = true;
+	}
+
+	// Old GNU sparse members: the map continues in extension blocks before the data
+	uint64_t sparse_size = 0;
+	bool sparse = false;
+	if (typeflag == 'S')
+	{
+		sparse = true;
+		if (!tar_parse_number(header + 483, 12, &sparse_size))
+			broken = true;
+
+		uint8_t is_extended = header[482];
+		uint8_t block[TAR_BLOCK_SIZE];
+		while (is_extended)
+		{
+			int res = reader_read(&state->reader, block, TAR_BLOCK_SIZE);
+			if (res != 0)
+				return res;
+			is_extended = block[504];
+		}
+	}
+	if ((keys & PAX_SPARSE_SIZE))
+	{
+		sparse = true;
+		sparse_size = (local->keys & PAX_SPARSE_SIZE) ? local->sparse_size : global->sparse_size;
+	}
+
+	// Name
+	char name[TAR_BLOCK_SIZE];
+	const char *path = (local->sparse_name != NULL) ? local->sparse_name : local->path;
+	if (path == NULL)
+		path = (global->sparse_name != NULL) ? global->sparse_name : global->path;
+	if (path == NULL)
+	{
+		size_t name_len = strnlen((const char *)header, 100);
+		size_t prefix_len = (ustar && !gnu) ? strnlen((const char *)header + 345, 155) : 0;
+		if (prefix_len > 0)
+		{
+			memcpy(name, header + 345, prefix_len);
+			name[prefix_len] = '/';
+			prefix_len++;
+		}
+		memcpy(name + prefix_len, header, name_len);
+		name[prefix_len + name_len] = '\0';
+		path = name;
+	}
+
+	char link_name[101];
+	const char *link_target = (local->link_path != NULL) ? local->link_path : global->link_path;
+	if (link_target == NULL)
+	{
+		size_t link_len = strnlen((const char *)header + 157, 100);
+		memcpy(link_name, header + 157, link_len);
+		link_name[link_len] = '\0';
+		link_target = link_name;
+	}
+
+	// Type
+	uint32_t type = 0;
+	switch (typeflag)
+	{
+	case '0':
+	case '7':
+	case 'S':
+		type = S_IFREG;
+		break;
+	case '\0':
+		// v7 archives mark directories by the trailing slash only
+		type = (path[0] != '\0' && path[strlen(path) - 1] == '/') ? S_IFDIR : S_IFREG;
+		break;
+	case '1':
+		type = S_IFREG;
+		break;
+	case '2':
+		type = S_IFLNK;
+		break;
+	case '5':
+	case 'D':
+		type = S_IFDIR;
+		break;
+	default:
+		// Devices, fifos, volume labels, multi-volume continuations and so on
+		break;
+	}
+
+	uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+	if (type == 0)
+	{
+		state->skipped++;
+		return reader_skip(&state->reader, padded, NULL);
+	}
+
+	if (broken)
+	{
+		from_tar_error(state, "broken header of \"%s\" at offset %" PRIu64, path,
+					   state->reader.offset - TAR_BLOCK_SIZE);
+		return reader_skip(&state->reader, padded, NULL);
+	}
+
+	struct filestat my_stat;
+	fill_member_stat(&my_stat, type | ((uint32_t)mode & 07777), (sparse) ? sparse_size : size, (int64_t)mtime);
+	my_stat.uid = (uint32_t)uid;
+	my_stat.gid = (uint32_t)gid;
+
+	// GNU headers keep atime and ctime in place of the prefix
+	bool has_atime = false;
+	bool has_ctime = false;
+	uint64_t gnu_time;
+	if (gnu && tar_parse_number(header + 345, 12, &gnu_time) && gnu_time > 0 && gnu_time <= (uint64_t)INT64_MAX)
+	{
+		my_stat.atime = (int64_t)gnu_time;
+		has_atime = true;
+	}
+	if (gnu && tar_parse_number(header + 357, 12, &gnu_time) && gnu_time > 0 && gnu_time <= (uint64_t)INT64_MAX)
+	{
+		my_stat.ctime = (int64_t)gnu_time;
+		has_ctime = true;
+	}
+
+	const struct pax_values *values[] = {global, local};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+	{
+		const struct pax_values *pax = values[i];
+		if ((pax->keys & PAX_UID))
+			my_stat.uid = pax->uid;
+		if ((pax->keys & PAX_GID))
+			my_stat.gid = pax->gid;
+		if ((pax->keys & PAX_MTIME))
+		{
+			my_stat.mtime = pax->mtime;
+			my_stat.mtimensec = pax->mtimensec;
+		}
+		if ((pax->keys & PAX_ATIME))
+		{
+			my_stat.atime = pax->atime;
+			my_stat.atimensec = pax->atimensec;
+			has_atime = true;
+		}
+		if ((pax->keys & PAX_CTIME))
+		{
+			my_stat.ctime = pax->ctime;
+			my_stat.ctimensec = pax->ctimensec;
+			has_ctime = true;
+		}
+	}
+	if (!has_atime)
+	{
+		my_stat.atime = my_stat.mtime;
+		my_stat.atimensec = my_stat.mtimensec;
+	}
+	if (!has_ctime)
+	{
+		my_stat.ctime = my_stat.mtime;
+		my_stat.ctimensec = my_stat.mtimensec;
+	}
+
+	// Stored data of sparse members is not the content, so it is not hashed
+	bool hash_data = (type == S_IFREG && typeflag != '1' && !sparse);
+	int res = from_tar_skip_data(state, size, (hash_data) ? &my_stat : NULL);
+	if (res == 0)
+		res = reader_skip(&state->reader, padded - size, NULL);
+	if (res != 0)
+		return res;
+
+	if (typeflag == '1')
+		return from_tar_hard_link(state, path, link_target, &my_stat);
+
+	if (type == S_IFLNK)
+	{
+		my_stat.size = (int64_t)strlen(link_target);
+		my_stat.blocks = 0;
+		return from_tar_emit(state, path, &my_stat, link_target);
+	}
+
+	return from_tar_emit(state, path, &my_stat, NULL);
+}
+
+/**
+ * Index all members of a tar archive
+ *
+ * @param state is the state
+ * @return 0 on success, -EINVAL for broken archives, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int from_tar_run(struct from_tar_state *state)
+{
+	struct pax_values local;
+	memset(&local, 0, sizeof(struct pax_values));
+	uint8_t header[TAR_BLOCK_SIZE];
+	int res = 0;
+
+	while (res == 0)
+	{
+		// Archives truncated right after a member are accepted (some writers omit the end blocks)
+		bool at_end;
+		res = reader_at_end(&state->reader, &at_end);
+		if (res != 0 || at_end)
+			break;
+
+		res = reader_read(&state->reader, header, TAR_BLOCK_SIZE);
+		if (res != 0)
+			break;
+
+		if (tar_block_is_zero(header))
+			break;
+
+		if (!tar_checksum_ok(header))
+		{
+			from_tar_error(state, "broken tar header at offset %" PRIu64, state->reader.offset - TAR_BLOCK_SIZE);
+			res = -EINVAL;
+			break;
+		}
+
+		char typeflag = (char)header[156];
+		if (typeflag == 'x' || typeflag == 'g' || typeflag == 'L' || typeflag == 'K')
+		{
+			uint64_t size;
+			if (!tar_parse_number(header + 124, 12, &size))
+			{
+				from_tar_error(state, "broken tar header at offset %" PRIu64, state->reader.offset - TAR_BLOCK_SIZE);
+				res = -EINVAL;
+				break;
+			}
+			res = tar_read_meta(state, typeflag, size, &local);
+			continue;
+		}
+
+		res = tar_read_member(state, header, &local);
+		if (res == -EINVAL)
+			from_tar_error(state, "broken tar header at offset %" PRIu64, state->reader.offset - TAR_BLOCK_SIZE);
+		pax_values_free(&local);
+	}
+
+	pax_values_free(&local);
+	return res;
+}
+
+/**
+ * Parse a numeric field of a cpio header
+ *
+ * @param field is the field
+ * @param len is the length of the field
+ * @param base is 16 for newc and crc archives or 8 for odc archives
+ * @param value is the parsed value
+ * @return true on success
+ */
+static bool cpio_parse_number(const uint8_t *field, size_t len, unsigned int base, uint64_t *value)
+{
+	uint64_t result = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned int digit;
+		uint8_t c = field[i];
+		if (c >= '0' && c <= '9')
+			digit = (unsigned int)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			digit = (unsigned int)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			digit = (unsigned int)(c - 'A' + 10);
+		else
+			return false;
+
+		if (digit >= base)
+			return false;
+		result = result * base + digit;
+	}
+
+	*value = result;
+	return true;
+}
+
+/**
+ * Free memory of a hard link entry
+ *
+ * @param value is the entry
+ */
+static void cpio_link_free(void *value)
+{
+	struct cpio_link *link = (struct cpio_link *)value;
+	for (size_t i = 0; i < link->count; i++)
+	{
+		free(link->paths[i]);
+	}
+	free(link->paths);
+	free(link);
+}
+
+/**
+ * Index a regular member of a cpio archive that shares its inode.
+ * newc archives keep the data of an inode only with one of its links
+ * (the last one), other links have zero size, so they wait for it.
+ *
+ * @param state is the state
+ * @param path is the path of the member
+ * @param my_stat is the record of the member
+ * @param dev is the device of the member
+ * @param ino is the inode of the member
+ * @return 0 on success, -ENOMEM on error
+ */
+static int cpio_hard_link(struct from_tar_state *state, const char *path, const struct filestat *my_stat,
+						  uint64_t dev, uint64_t ino)
+{
+	char key[48];
+	int key_len = snprintf(key, sizeof(key), "%" PRIx64 ":%" PRIx64, dev, ino);
+
+	struct cpio_link *link = (struct cpio_link *)path_hash_get(&state->links, key, (size_t)key_len);
+	if (link == NULL)
+	{
+		link = (struct cpio_link *)calloc(1, sizeof(struct cpio_link));
+		if (link == NULL)
+			return -ENOMEM;
+		if (path_hash_put(&state->links, key, (size_t)key_len, link, NULL) != 0)
+		{
+			free(link);
+			return -ENOMEM;
+		}
+	}
+
+	if (my_stat->size == 0 && !link->has_data)
+	{
+		if (link->count == link->capacity)
+		{
+			size_t capacity = (link->capacity > 0) ? link->capacity * 2 : 4;
+			char **paths = (char **)realloc(link->paths, capacity * sizeof(char *));
+			if (paths == NULL)
+				return -ENOMEM;
+			link->paths = paths;
+			link->capacity = capacity;
+		}
+
+		link->paths[link->count] = strdup(path);
+		if (link->paths[link->count] == NULL)
+			return -ENOMEM;
+		link->count++;
+		link->my_stat = *my_stat;
+		return 0;
+	}
+
+	if (!link->has_data)
+	{
+		link->my_stat = *my_stat;
+		link->has_data = true;
+	}
+
+	int res = from_tar_emit(state, path, &link->my_stat, NULL);
+	for (size_t i = 0; res == 0 && i < link->count; i++)
+	{
+		res = from_tar_emit(state, link->paths[i], &link->my_stat, NULL);
+	}
+	for (size_t i = 0; i < link->count; i++)
+	{
+		free(link->paths[i]);
+	}
+	link->count = 0;
+	return res;
+}
+
+/**
+ * Index links of inodes that never got data (empty files with several links)
+ *
+ * @param key is the key of the entry
+ * @param key_len is the length of the key
+ * @param value is the entry
+ * @param arg is the state
+ * @return 0 on success, -ENOMEM on error
+ */
+static int cpio_flush_link(const char *key, size_t key_len, void *value, void *arg)
+{
+	(void)key;
+	(void)key_len;
+	struct cpio_link *link = (struct cpio_link *)value;
+	struct from_tar_state *state = (struct from_tar_state *)arg;
+
+	for (size_t i = 0; i < link->count; i++)
+	{
+		int res = from_tar_emit(state, link->paths[i], &link->my_stat, NULL);
+		if (res != 0)
+			return res;
+	}
+	return 0;
+}
+
+/**
+ * Index all members of a cpio archive
+ *
+ * @param state is the state
+ * @return 0 on success, -EINVAL for broken archives, -ENODATA if the archive ends earlier, -errno on error
+ */
+static int from_cpio_run(struct from_tar_state *state)
+{
+	uint8_t header[CPIO_NEWC_HEADER_SIZE];
+	char *name = (char *)malloc(PATH_MAX + 1);
+	char *target = (char *)malloc(PATH_MAX + 1);
+	int res = (name != NULL && target != NULL) ? 0 : -ENOMEM;
+
+	while (res == 0)
+	{
+		uint64_t header_offset = state->reader.offset;
+		res = reader_read(&state->reader, header, CPIO_MAGIC_SIZE);
+		if (res != 0)
+			break;
+
+		// Fields: ino, mode, uid, gid, nlink, mtime, filesize, devmajor, devminor,
+		// rdevmajor, rdevminor, namesize, check (newc)
+		// dev, ino, mode, uid, gid, nlink, rdev, mtime, namesize, filesize (odc)
+		bool newc = (memcmp(header, "070701", CPIO_MAGIC_SIZE) == 0 || memcmp(header, "070702", CPIO_MAGIC_SIZE) == 0);
+		bool odc = (memcmp(header, "070707", CPIO_MAGIC_SIZE) == 0);
+		uint64_t dev = 0, ino = 0, mode = 0, uid = 0, gid = 0, nlink = 0, mtime = 0, filesize = 0, namesize = 0;
+		bool ok = true;
+		if (newc)
+		{
+			res = reader_read(&state->reader, header + CPIO_MAGIC_SIZE, CPIO_NEWC_HEADER_SIZE - CPIO_MAGIC_SIZE);
+			if (res != 0)
+				break;
+
+			const uint8_t *f = header + CPIO_MAGIC_SIZE;
+			uint64_t devmajor = 0, devminor = 0;
+			ok = cpio_parse_number(f, 8, 16, &ino) && cpio_parse_number(f + 8, 8, 16, &mode) &&
+				 cpio_parse_number(f + 16, 8, 16, &uid) && cpio_parse_number(f + 24, 8, 16, &gid) &&
+				 cpio_parse_number(f + 32, 8, 16, &nlink) && cpio_parse_number(f + 40, 8, 16, &mtime) &&
+				 cpio_parse_number(f + 48, 8, 16, &filesize) && cpio_parse_number(f + 56, 8, 16, &devmajor) &&
+				 cpio_parse_number(f + 64, 8, 16, &devminor) && cpio_parse_number(f + 88, 8, 16, &namesize);
+			dev = (devmajor << 32) | devminor;
+		}
+		else if (odc)
+		{
+			res = reader_read(&state->reader, header + CPIO_MAGIC_SIZE, CPIO_ODC_HEADER_SIZE - CPIO_MAGIC_SIZE);
+			if (res != 0)
+				break;
+
+			const uint8_t *f = header + CPIO_MAGIC_SIZE;
+			ok = cpio_parse_number(f, 6, 8, &dev) && cpio_parse_number(f + 6, 6, 8, &ino) &&
+				 cpio_parse_number(f + 12, 6, 8, &mode) && cpio_parse_number(f + 18, 6, 8, &uid) &&
+				 cpio_parse_number(f + 24, 6, 8, &gid) && cpio_parse_number(f + 30, 6, 8, &nlink) &&
+				 cpio_parse_number(f + 42, 11, 8, &mtime) && cpio_parse_number(f + 53, 6, 8, &namesize) &&
+				 cpio_parse_number(f + 59, 11, 8, &filesize);
+		}
+
+		if (!(newc || odc) || !ok || namesize == 0 || namesize > PATH_MAX)
+		{
+			from_tar_error(state, "broken cpio header at offset %" PRIu64, header_offset);
+			res = -EINVAL;
+			break;
+		}
+
+		// Name and data are aligned to 4 bytes in newc archives
+		uint64_t header_size = (newc) ? CPIO_NEWC_HEADER_SIZE : CPIO_ODC_HEADER_SIZE;
+		uint64_t name_pad = (newc) ? (4 - (header_size + namesize) % 4) % 4 : 0;
+		uint64_t data_pad = (newc) ? (4 - filesize % 4) % 4 : 0;
+		res = reader_read(&state->reader, name, (size_t)namesize);
+		if (res == 0)
+			res = reader_skip(&state->reader, name_pad, NULL);
+		if (res != 0)
+			break;
+		name[namesize] = '\0';
+
+		if (strcmp(name, CPIO_TRAILER_NAME) == 0)
+			break;
+
+		uint32_t type = (uint32_t)mode & S_IFMT;
+		if (type != S_IFREG && type != S_IFDIR && type != S_IFLNK)
+		{
+			state->skipped++;
+			res = reader_skip(&state->reader, filesize + data_pad, NULL);
+			continue;
+		}
+
+		struct filestat my_stat;
+		fill_member_stat(&my_stat, (uint32_t)mode & (S_IFMT | 07777), filesize, (int64_t)mtime);
+		my_stat.uid = (uint32_t)uid;
+		my_stat.gid = (uint32_t)gid;
+		my_stat.nlink = (nlink > 0) ? nlink : 1;
+
+		if (type == S_IFLNK)
+		{
+			// The target is the data of the member
+			if (filesize > PATH_MAX)
+			{
+				from_tar_error(state, "too long target of symlink \"%s\"", name);
+				res = reader_skip(&state->reader, filesize + data_pad, NULL);
+				continue;
+			}
+
+			res = reader_read(&state->reader, target, (size_t)filesize);
+			if (res == 0)
+				res = reader_skip(&state->reader, data_pad, NULL);
+			if (res != 0)
+				break;
+			target[filesize] = '\0';
+			my_stat.blocks = 0;
+			res = from_tar_emit(state, name, &my_stat, target);
+			continue;
+		}
+
+		res = from_tar_skip_data(state, filesize, (type == S_IFREG) ? &my_stat : NULL);
+		if (res == 0)
+			res = reader_skip(&state->reader, data_pad, NULL);
+		if (res != 0)
+			break;
+
+		if (type == S_IFREG && nlink > 1)
+			res = cpio_hard_link(state, name, &my_stat, dev, ino);
+		else
+			res = from_tar_emit(state, name, &my_stat, NULL);
+	}
+
+	if (res == 0)
+		res = path_hash_for_each(&state->links, cpio_flush_link, state);
+
+	free(name);
+	free(target);
+	return res;
+}
+
+/**
+ * Detect the format of the archive by its first bytes
+ *
+ * @param reader is the reader
+ * @param format is the detected format
+ * @return 0 on success, -EINVAL for unsupported formats, -errno on error
+ */
+static int detect_format(struct archive_reader *reader, enum archive_format *format)
+{
+	while (reader->len - reader->pos < CPIO_MAGIC_SIZE && !reader->eof)
+	{
+		int res = reader_fill(reader);
+		if (res != 0)
+			return res;
+	}
+
+	const uint8_t *magic = reader->buf + reader->pos;
+	size_t available = reader->len - reader->pos;
+	if (available >= 2 && ((magic[0] == 0xc7 && magic[1] == 0x71) || (magic[0] == 0x71 && magic[1] == 0xc7)))
+		return -EINVAL; // Binary cpio
+
+	if (available >= 4 && memcmp(magic, "0707", 4) == 0)
+		*format = ARCHIVE_FORMAT_CPIO;
+	else
+		*format = ARCHIVE_FORMAT_TAR;
+	return 0;
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <catalog> [archive]", program_name);
+	PrintToStdout("Creates entries of a catalog from members of a tar or cpio archive");
+	PrintToStdout("(read from stdin if the archive is missing or \"-\").");
+	PrintToStdout("The catalog is created if it does not exist, existing entries are replaced.");
+	PrintToStdout("Options:");
+	PrintToStdout("-f   --format=<f>          format of the archive: auto, tar or cpio");
+	PrintToStdout("                           (default: auto)");
+	PrintToStdout("-H   --sha256              hash contents of files while reading the archive");
+	PrintToStdout("-P   --prefix=<dir>        put members into the directory of the catalog");
+	PrintToStdout("-s   --storage=<s>         storage of index files: text, sparse or xattr");
+	PrintToStdout("                           (default: text)");
+	PrintToStdout("-p   --progress=<sec>      interval of throughput reports to stderr, 0 to disable");
+	PrintToStdout("                           (default: 10)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Parse a positive number from a command line argument
+ *
+ * @param arg is the argument
+ * @param value is the target value
+ * @return true on success, false on error
+ */
+static bool parse_unsigned_arg(const char *arg, unsigned int *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || parsed > UINT_MAX)
+		return false;
+
+	*value = (unsigned int)parsed;
+	return true;
+}
+
+/**
+ * Open the catalog directory (created if it does not exist)
+ *
+ * @param path is the path of the catalog
+ * @return the file descriptor, -1 on error (errno is set)
+ */
+static int open_catalog(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT)
+	{
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			return -1;
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	return fd;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct from_tar_state state;
+	memset(&state, 0, sizeof(struct from_tar_state));
+	state.progress_interval = FROM_TAR_DEFAULT_PROGRESS_INTERVAL;
+	path_hash_init(&state.links);
+	enum catalog_storage storage = CATALOG_STORAGE_TEXT;
+	const char *prefix = NULL;
+
+	static const struct option long_options[] = {
+		{"format", required_argument, NULL, 'f'},
+		{"sha256", no_argument, NULL, 'H'},
+		{"prefix", required_argument, NULL, 'P'},
+		{"storage", required_argument, NULL, 's'},
+		{"progress", required_argument, NULL, 'p'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:HP:s:p:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (strcmp(optarg, "auto") == 0)
+				state.format = ARCHIVE_FORMAT_AUTO;
+			else if (strcmp(optarg, "tar") == 0)
+				state.format = ARCHIVE_FORMAT_TAR;
+			else if (strcmp(optarg, "cpio") == 0)
+				state.format = ARCHIVE_FORMAT_CPIO;
+			else
+			{
+				PrintToStderr("Invalid format (should be auto, tar or cpio)");
+				return FROM_TAR_EXIT_ERROR;
+			}
+			break;
+		case 'H':
+			state.hash = true;
+			break;
+		case 'P':
+			prefix = optarg;
+			break;
+		case 's':
+			if (storage_from_name(optarg, &storage) != 0)
+			{
+				PrintToStderr("Invalid storage (should be text, sparse or xattr)");
+				return FROM_TAR_EXIT_ERROR;
+			}
+			break;
+		case 'p':
+			if (!parse_unsigned_arg(optarg, &state.progress_interval))
+			{
+				PrintToStderr("Invalid progress interval");
+				return FROM_TAR_EXIT_ERROR;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return FROM_TAR_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return FROM_TAR_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 1 && argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return FROM_TAR_EXIT_ERROR;
+	}
+
+	if (prefix != NULL)
+	{
+		// The prefix is checked the same way as paths of members
+		struct ingest_record check;
+		memset(&check, 0, sizeof(struct ingest_record));
+		check.my_stat.mode = S_IFDIR;
+		check.path = strdup(prefix);
+		char message[INGEST_ERROR_MESSAGE_SIZE];
+		if (check.path == NULL || ingest_record_check(&check, message, sizeof(message)) != 0)
+		{
+			PrintToStderrF("Invalid prefix: %s", (check.path != NULL) ? message : strerror(ENOMEM));
+			ingest_record_free(&check);
+			return FROM_TAR_EXIT_ERROR;
+		}
+
+		if (check.path[0] != '\0')
+			state.prefix = check.path;
+		else
+			ingest_record_free(&check);
+	}
+
+	const char *archive_path = (argc - optind == 2) ? argv[optind + 1] : "-";
+	int archive_fd = STDIN_FILENO;
+	if (strcmp(archive_path, "-") != 0)
+	{
+		archive_fd = open(archive_path, O_RDONLY | O_CLOEXEC);
+		if (archive_fd == -1)
+		{
+			PrintToStderrF("Failed to open archive: %s (path: %s)", strerror(errno), archive_path);
+			free(state.prefix);
+			return FROM_TAR_EXIT_ERROR;
+		}
+	}
+
+	state.catalog_fd = open_catalog(argv[optind]);
+	if (state.catalog_fd == -1)
+	{
+		PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), argv[optind]);
+		if (archive_fd != STDIN_FILENO)
+			(void)close(archive_fd);
+		free(state.prefix);
+		return FROM_TAR_EXIT_ERROR;
+	}
+
+	// Both sparse and xattr storages keep records in xattrs
+	if (storage != CATALOG_STORAGE_TEXT && !storage_xattr_supported(state.catalog_fd))
+	{
+		PrintToStderrF("Filesystem does not support user xattrs, files are written in %s storage instead",
+					   storage_name(CATALOG_STORAGE_TEXT));
+		storage = CATALOG_STORAGE_TEXT;
+	}
+
+	// Directory metadata is applied once at the end, so the sink does not commit batches
+	ingest_writer_init(&state.writer, state.catalog_fd, storage);
+	struct ingest_sink sink = {ingest_writer_put, NULL, &state.writer};
+	struct filestat defaults;
+	memset(&defaults, 0, sizeof(struct filestat));
+	defaults.mtime = time(NULL);
+
+	int res = ingest_stream_init(&state.stream, &sink, &defaults);
+	if (res == 0)
+		res = reader_init(&state.reader, archive_fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &state.start_time);
+	state.report_time = state.start_time;
+
+	if (res == 0 && state.format == ARCHIVE_FORMAT_AUTO)
+	{
+		res = detect_format(&state.reader, &state.format);
+		if (res == -EINVAL)
+			from_tar_error(&state, "binary cpio archives are not supported (use cpio -H newc)");
+	}
+
+	if (res == 0)
+		res = (state.format == ARCHIVE_FORMAT_CPIO) ? from_cpio_run(&state) : from_tar_run(&state);
+
+	if (res == -ENODATA)
+		from_tar_error(&state, "unexpected end of archive at offset %" PRIu64, state.reader.offset);
+	else if (res != 0 && res != -EINVAL)
+		from_tar_error(&state, "failed to read archive: %s", strerror(-res));
+
+	from_tar_flush(&state);
+	int finish_res = ingest_writer_finish(&state.writer);
+	if (finish_res != 0)
+		from_tar_error(&state, "failed to apply metadata of directories: %s", strerror(-finish_res));
+
+	from_tar_print_progress(&state, true);
+	if (state.first_error_message[0] != '\0')
+		PrintToStderrF("First error: %s", state.first_error_message);
+
+	bool failed = (state.errors > 0 || state.stream.errors > 0);
+	path_hash_clear(&state.links, cpio_link_free);
+	ingest_stream_free(&state.stream);
+	ingest_writer_free(&state.writer);
+	free(state.reader.buf);
+	free(state.prefix);
+	pax_values_free(&state.global);
+	(void)close(state.catalog_fd);
+	if (archive_fd != STDIN_FILENO)
+		(void)close(archive_fd);
+
+	return (failed) ? FROM_TAR_EXIT_ERROR : FROM_TAR_EXIT_OK;
+}
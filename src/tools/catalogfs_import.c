@@ -0,0 +1,2378 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-import - creates a CatalogFS catalog (index) from a listing of
+ * files made on a host that can't run CatalogFS: find -printf output,
+ * a BSD mtree specification or an ncdu JSON export.
+ *
+ * Formats (detected by the first byte of the listing unless --format is given):
+ *
+ *  - find: one line per entry made by
+ *      find <dir> -printf '%y\t%m\t%U\t%G\t%s\t%T@\t%A@\t%C@\t%n\t%P\t%l\n'
+ *    (type, permissions, owner, group, size, mtime, atime, ctime, links,
+ *    path and target of symlinks), with --null the lines end with '\0'
+ *    (-printf '...\t%P\t%l\0') so names can contain newlines;
+ *  - mtree: mtree(5) specifications as written by mtree -c or bsdtar
+ *    --format=mtree (/set and /unset defaults, relative names with ".."
+ *    and full paths, vis(3) escapes, keywords type, mode, uid, gid, size,
+ *    time, link, nlink and sha256digest);
+ *  - ncdu: ncdu -o exports (sizes, and owners, modes and times of exports
+ *    made with -e).
+ *
+ * The catalog is either a directory of index files or a single-file catalog
+ * (--db, see catalog_db.h), entries that already exist are replaced.
+ *
+ * The listing is read once and parsed by the main thread while the catalog
+ * is built by other threads: lines and fields are split with memchr() (which
+ * is vectorized by the C library) and parsed records are passed in batches
+ * through bounded queues, so memory does not depend on the size of the listing.
+ *
+ *  - Index files are created by --jobs threads, records are distributed by
+ *    their parent directory, so every directory is written by one thread.
+ *    Records of directories are spilled to a temporary file and applied at the
+ *    end in reverse order (children before parents), so their times are not
+ *    changed by creation of their entries.
+ *  - Single-file catalogs are built by one thread (the tree has one lock)
+ *    with the ids of the current chain of directories cached, so a record
+ *    costs one insert into the tree and not a lookup of every component of its
+ *    path. The size of the page cache is limited by --cache-mb.
+ *
+ * Throughput is reported to stderr periodically and at the end.
+ *
+ * Exit code is 0 on success, 1 if some entries failed to be imported.
+ */
+
+#include "header_common.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "byte_buffer.h"
+#include "catalog_db.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "ingest.h"
+#include "json.h"
+#include "storage.h"
+
+#include "log.h"
+
+/** Exit code: all entries are imported */
+#define IMPORT_EXIT_OK (0)
+/** Exit code: some error happened */
+#define IMPORT_EXIT_ERROR (1)
+
+/** Default number of threads that create index files */
+#define IMPORT_DEFAULT_JOBS (4)
+
+/** Default interval of progress reports in seconds */
+#define IMPORT_DEFAULT_PROGRESS_INTERVAL (10)
+
+/** Default size of the page cache of single-file catalogs in MiB */
+#define IMPORT_DEFAULT_CACHE_MB (256)
+
+/** Size of reads of the listing */
+#define IMPORT_READ_BUFFER_SIZE (1024 * 1024)
+
+/** Maximum length of a line of the listing */
+#define IMPORT_MAX_LINE_LENGTH INGEST_MAX_LINE_LENGTH
+
+/** Number of records passed to a thread at once */
+#define IMPORT_BATCH_SIZE INGEST_BATCH_SIZE
+
+/** Maximum number of batches waiting for a thread */
+#define IMPORT_QUEUE_BATCHES (4)
+
+/** Number of fields of find lines before the path */
+#define IMPORT_FIND_FIELDS (9)
+
+/** Maximum depth of directories of listings */
+#define IMPORT_MAX_DEPTH (PATH_MAX / 2)
+
+/**
+ * Format of the listing
+ */
+enum import_format
+{
+	/** Detected by the first byte */
+	IMPORT_FORMAT_AUTO = 0,
+
+	/** find -printf lines */
+	IMPORT_FORMAT_FIND,
+
+	/** mtree specification */
+	IMPORT_FORMAT_MTREE,
+
+	/** ncdu JSON export */
+	IMPORT_FORMAT_NCDU,
+};
+
+/**
+ * Batch of parsed records
+ */
+struct import_batch
+{
+	/** Records (owned) */
+	struct ingest_record *records;
+
+	/** Number of records */
+	size_t count;
+};
+
+/**
+ * Bounded queue of batches of one thread
+ */
+struct import_queue
+{
+	/** Lock of the queue */
+	pthread_mutex_t lock;
+
+	/** Signaled when a batch is added or the queue is closed */
+	pthread_cond_t not_empty;
+
+	/** Signaled when a batch is taken */
+	pthread_cond_t not_full;
+
+	/** Ring of batches */
+	struct import_batch *batches[IMPORT_QUEUE_BATCHES];
+
+	/** Index of the first batch */
+	size_t head;
+
+	/** Number of batches */
+	size_t count;
+
+	/** No more batches will be added */
+	bool closed;
+};
+
+/**
+ * Chain of directories of a single-file catalog whose ids are known
+ */
+struct import_db_loader
+{
+	/** Catalog */
+	struct catalog_db *db;
+
+	/** Path of the deepest directory of the chain */
+	char path[PATH_MAX];
+
+	/** End of every component in path */
+	size_t ends[IMPORT_MAX_DEPTH];
+
+	/** Id of every directory of the chain */
+	uint64_t ids[IMPORT_MAX_DEPTH];
+
+	/** Number of directories in the chain */
+	size_t depth;
+};
+
+// Forward declaration
+struct import_state;
+
+/**
+ * Thread that builds (a part of) the catalog
+ */
+struct import_worker
+{
+	/** State of the import */
+	struct import_state *state;
+
+	/** Thread */
+	pthread_t thread;
+
+	/** Batches to apply */
+	struct import_queue queue;
+
+	/** Batch being filled by the parser */
+	struct import_batch *pending;
+
+	/** Writer of index files (directory catalogs) */
+	struct ingest_writer writer;
+
+	/** Stream of records of the writer (directory catalogs) */
+	struct ingest_stream stream;
+
+	/** Loader of a single-file catalog */
+	struct import_db_loader *loader;
+
+	/** Number of applied records (single-file catalogs) */
+	uint64_t applied;
+
+	/** Number of records that failed (single-file catalogs) */
+	uint64_t errors;
+
+	/** Message of the first error (empty if there is no error) */
+	char first_error_message[INGEST_ERROR_MESSAGE_SIZE];
+};
+
+/**
+ * Current directory and defaults of an mtree specification
+ */
+struct import_mtree
+{
+	/** Path of the current directory (relative names are inside it) */
+	struct byte_buffer cwd;
+
+	/** Length of cwd before every entered directory */
+	size_t *lengths;
+
+	/** Number of entered directories */
+	size_t depth;
+
+	/** Allocated size of lengths */
+	size_t capacity;
+
+	/** Line joined from continuation lines */
+	struct byte_buffer line;
+
+	/** Defaults set by /set: "type=file uid=0 ..." */
+	struct byte_buffer defaults;
+};
+
+/**
+ * State of the import
+ */
+struct import_state
+{
+	/** Format of the listing */
+	enum import_format format;
+
+	/** Lines of find listings end with '\0' */
+	bool null_terminated;
+
+	/** Build a single-file catalog */
+	bool db_output;
+
+	/** Storage of index files */
+	enum catalog_storage storage;
+
+	/** Number of threads that create index files */
+	unsigned int jobs;
+
+	/** Interval of progress reports in seconds (0 to disable) */
+	unsigned int progress_interval;
+
+	/** Size of the page cache of single-file catalogs in MiB */
+	unsigned int cache_mb;
+
+	/** Normalized directory of the catalog to put entries into (NULL for the root) */
+	char *prefix;
+
+	/** File descriptor of the catalog directory */
+	int catalog_fd;
+
+	/** Single-file catalog */
+	struct catalog_db *db;
+
+	/** Threads that build the catalog */
+	struct import_worker *workers;
+
+	/** Number of started threads */
+	unsigned int workers_count;
+
+	/** Temporary file of records of directories (directory catalogs) */
+	FILE *dirs_spill;
+
+	/** Metadata for missing values (owner and time of the import) */
+	struct filestat defaults;
+
+	/** Number of lines (or objects) of the listing */
+	uint64_t lines;
+
+	/** Number of records passed to threads */
+	uint64_t records;
+
+	/** Number of skipped entries (devices, fifos and so on) */
+	uint64_t skipped;
+
+	/** Number of entries that failed to be parsed */
+	uint64_t errors;
+
+	/** Message of the first error (empty if there is no error) */
+	char first_error_message[INGEST_ERROR_MESSAGE_SIZE];
+
+	/** Number of bytes of the listing read so far */
+	uint64_t bytes_read;
+
+	/** First byte of the listing (read to detect the format) */
+	char first_byte;
+
+	/** The first byte is not parsed yet */
+	bool has_first_byte;
+
+	/** State of mtree specifications */
+	struct import_mtree mtree;
+
+	/** Time (monotonic) of the start */
+	struct timespec start_time;
+
+	/** Time (monotonic) of the last progress report */
+	struct timespec report_time;
+};
+
+/**
+ * Get seconds between two times
+ *
+ * @param from is the earlier time
+ * @param to is the later time
+ * @return elapsed seconds
+ */
+static double elapsed_seconds(const struct timespec *from, const struct timespec *to)
+{
+	return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * Print a progress report
+ *
+ * @param state is the state
+ * @param is_final determines if it's the final report (threads are finished)
+ */
+static void import_print_progress(struct import_state *state, bool is_final)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state->report_time = now;
+
+	double elapsed = elapsed_seconds(&state->start_time, &now);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	// Counters of threads are read only when they are finished
+	uint64_t errors = state->errors;
+	if (is_final)
+	{
+		for (unsigned int i = 0; i < state->workers_count; i++)
+		{
+			errors += state->workers[i].errors + state->workers[i].stream.errors;
+		}
+	}
+
+	double mib = (double)state->bytes_read / (1024.0 * 1024.0);
+	PrintToStderrF("%s: %" PRIu64 " lines, %" PRIu64 " entries (%.0f/s, %.1f MiB/s), "
+				   "%" PRIu64 " skipped, %" PRIu64 " errors, %.1f s",
+				   (is_final) ? "Finished" : "Progress",
+				   state->lines, state->records, (double)state->records / elapsed, mib / elapsed,
+				   state->skipped, errors, elapsed);
+}
+
+/**
+ * Remember the message of the first error and count the error
+ *
+ * @param state is the state
+ * @param format is the printf-like format of the message
+ */
+static void import_error(struct import_state *state, const char *format, ...)
+{
+	state->errors++;
+	if (state->first_error_message[0] != '\0')
+		return;
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(state->first_error_message, sizeof(state->first_error_message), format, args);
+	va_end(args);
+}
+
+/**
+ * Initialize a queue
+ *
+ * @param queue is the queue
+ */
+static void import_queue_init(struct import_queue *queue)
+{
+	memset(queue, 0, sizeof(struct import_queue));
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+/**
+ * Add a batch to the queue (waits while the queue is full)
+ *
+ * @param queue is the queue
+ * @param batch is the batch (owned by the queue from now on)
+ */
+static void import_queue_push(struct import_queue *queue, struct import_batch *batch)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == IMPORT_QUEUE_BATCHES)
+	{
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	queue->batches[(queue->head + queue->count) % IMPORT_QUEUE_BATCHES] = batch;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Take a batch from the queue (waits while the queue is empty)
+ *
+ * @param queue is the queue
+ * @return the batch, NULL if the queue is closed and empty
+ */
+static struct import_batch *import_queue_pop(struct import_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && !queue->closed)
+	{
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	struct import_batch *batch = NULL;
+	if (queue->count > 0)
+	{
+		batch = queue->batches[queue->head];
+		queue->head = (queue->head + 1) % IMPORT_QUEUE_BATCHES;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return batch;
+}
+
+/**
+ * Close the queue (the thread finishes after the remaining batches)
+ *
+ * @param queue is the queue
+ */
+static void import_queue_close(struct import_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = true;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Free a queue (must be empty)
+ *
+ * @param queue is the queue
+ */
+static void import_queue_destroy(struct import_queue *queue)
+{
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/**
+ * Allocate an empty batch
+ *
+ * @return the batch, NULL on error
+ */
+static struct import_batch *import_batch_new(void)
+{
+	struct import_batch *batch = (struct import_batch *)malloc(sizeof(struct import_batch));
+	if (batch == NULL)
+		return NULL;
+
+	batch->records = (struct ingest_record *)malloc(IMPORT_BATCH_SIZE * sizeof(struct ingest_record));
+	if (batch->records == NULL)
+	{
+		free(batch);
+		return NULL;
+	}
+
+	batch->count = 0;
+	return batch;
+}
+
+/**
+ * Free a batch and its records
+ *
+ * @param batch is the batch (can be NULL)
+ */
+static void import_batch_free(struct import_batch *batch)
+{
+	if (batch == NULL)
+		return;
+
+	for (size_t i = 0; i < batch->count; i++)
+	{
+		ingest_record_free(&batch->records[i]);
+	}
+	free(batch->records);
+	free(batch);
+}
+
+/**
+ * Add or replace an entry of a single-file catalog, missing parent directories are created
+ *
+ * @param loader is the loader
+ * @param record is the record (with a normalized path)
+ * @return 0 on success, negative value on error
+ */
+static int import_db_put(struct import_db_loader *loader, const struct ingest_record *record)
+{
+	struct catalog_db_entry entry;
+	memset(&entry, 0, sizeof(struct catalog_db_entry));
+	entry.my_stat = record->my_stat;
+	if (record->link_target != NULL)
+	{
+		if (strlen(record->link_target) > CATALOG_DB_MAX_LINK_TARGET)
+			return -ENAMETOOLONG;
+		strcpy(entry.link_target, record->link_target);
+	}
+
+	// The root directory is the entry with the empty name in the parent 0
+	const char *path = record->path;
+	if (path[0] == '\0')
+		return catalog_db_put_at(loader->db, 0, "", &entry);
+
+	const char *slash = strrchr(path, '/');
+	size_t parent_len = (slash != NULL) ? (size_t)(slash - path) : 0;
+
+	// Keep the part of the chain that the record is inside (whole components only)
+	size_t keep = 0;
+	while (keep < loader->depth)
+	{
+		size_t end = loader->ends[keep];
+		if (end > parent_len || memcmp(loader->path, path, end) != 0 || (end < parent_len && path[end] != '/'))
+			break;
+		keep++;
+	}
+	loader->depth = keep;
+
+	// Enter directories that are not in the chain yet
+	char name[CATALOG_DB_MAX_NAME + 1];
+	while (true)
+	{
+		size_t start = (loader->depth > 0) ? loader->ends[loader->depth - 1] + 1 : 0;
+		if (start > parent_len || parent_len == 0)
+			break;
+
+		const char *next = memchr(path + start, '/', parent_len - start);
+		size_t end = (next != NULL) ? (size_t)(next - path) : parent_len;
+		if (end - start > CATALOG_DB_MAX_NAME || loader->depth == IMPORT_MAX_DEPTH)
+			return -ENAMETOOLONG;
+		memcpy(name, path + start, end - start);
+		name[end - start] = '\0';
+
+		uint64_t parent = (loader->depth > 0) ? loader->ids[loader->depth - 1] : CATALOG_DB_ROOT_ID;
+		struct catalog_db_entry dir;
+		int res = catalog_db_lookup_at(loader->db, parent, name, &dir);
+		if (res == -ENOENT)
+		{
+			// Missing parents get times of the record until their own records come
+			memset(&dir, 0, sizeof(struct catalog_db_entry));
+			dir.my_stat = record->my_stat;
+			dir.my_stat.mode = S_IFDIR | 0755;
+			dir.my_stat.size = 0;
+			dir.my_stat.blocks = 0;
+			dir.my_stat.nlink = 2;
+			dir.my_stat.sha256[0] = '\0';
+			res = catalog_db_put_at(loader->db, parent, name, &dir);
+		}
+		else if (res == 0 && !S_ISDIR(dir.my_stat.mode))
+		{
+			res = -ENOTDIR;
+		}
+		if (res != 0)
+			return res;
+
+		memcpy(loader->path + start, name, end - start);
+		if (start > 0)
+			loader->path[start - 1] = '/';
+		loader->ends[loader->depth] = end;
+		loader->ids[loader->depth] = dir.id;
+		loader->depth++;
+	}
+
+	uint64_t parent = (loader->depth > 0) ? loader->ids[loader->depth - 1] : CATALOG_DB_ROOT_ID;
+	const char *base = (slash != NULL) ? slash + 1 : path;
+	int res = catalog_db_put_at(loader->db, parent, base, &entry);
+
+	// Entries of a directory usually follow it
+	if (res == 0 && S_ISDIR(entry.my_stat.mode) && loader->depth < IMPORT_MAX_DEPTH)
+	{
+		size_t start = (loader->depth > 0) ? loader->ends[loader->depth - 1] + 1 : 0;
+		size_t len = strlen(base);
+		if (start > 0)
+			loader->path[start - 1] = '/';
+		memcpy(loader->path + start, base, len);
+		loader->ends[loader->depth] = start + len;
+		loader->ids[loader->depth] = entry.id;
+		loader->depth++;
+	}
+
+	return res;
+}
+
+/**
+ * Apply batches of records of a thread
+ *
+ * @param arg is the worker
+ * @return NULL
+ */
+static void *import_worker_thread(void *arg)
+{
+	struct import_worker *worker = (struct import_worker *)arg;
+
+	struct import_batch *batch;
+	while ((batch = import_queue_pop(&worker->queue)) != NULL)
+	{
+		for (size_t i = 0; i < batch->count; i++)
+		{
+			struct ingest_record *record = &batch->records[i];
+			if (worker->loader == NULL)
+			{
+				// The stream takes the record
+				ingest_stream_add_record(&worker->stream, record);
+				continue;
+			}
+
+			int res = import_db_put(worker->loader, record);
+			if (res == 0)
+			{
+				worker->applied++;
+			}
+			else
+			{
+				if (worker->errors == 0)
+				{
+					snprintf(worker->first_error_message, sizeof(worker->first_error_message),
+							 "failed to add \"%s\": %s", record->path, strerror(-res));
+				}
+				worker->errors++;
+			}
+			ingest_record_free(record);
+		}
+		batch->count = 0;
+		import_batch_free(batch);
+
+		if (worker->loader != NULL)
+		{
+			int res = catalog_db_commit_if_due(worker->loader->db);
+			if (res != 0 && worker->errors++ == 0)
+			{
+				snprintf(worker->first_error_message, sizeof(worker->first_error_message),
+						 "failed to commit: %s", strerror(-res));
+			}
+		}
+	}
+
+	if (worker->loader == NULL && ingest_stream_flush(&worker->stream) != 0)
+	{
+		memcpy(worker->first_error_message, worker->stream.first_error_message,
+			   sizeof(worker->first_error_message));
+	}
+
+	return NULL;
+}
+
+/**
+ * Pass the pending batch of a thread to its queue
+ *
+ * @param worker is the worker
+ * @return 0 on success, -ENOMEM on error
+ */
+static int import_worker_send(struct import_worker *worker)
+{
+	if (worker->pending->count == 0)
+		return 0;
+
+	struct import_batch *batch = import_batch_new();
+	if (batch == NULL)
+		return -ENOMEM;
+
+	import_queue_push(&worker->queue, worker->pending);
+	worker->pending = batch;
+	return 0;
+}
+
+/**
+ * Spill the record of a directory to the temporary file
+ * (metadata, length of the path, the path and the total length of the record)
+ *
+ * @param state is the state
+ * @param record is the record
+ * @return 0 on success, -errno on error
+ */
+static int import_spill_dir(struct import_state *state, const struct ingest_record *record)
+{
+	uint32_t path_len = (uint32_t)strlen(record->path);
+	uint32_t total = (uint32_t)(sizeof(struct filestat) + sizeof(path_len) + path_len + sizeof(total));
+
+	if (fwrite(&record->my_stat, sizeof(struct filestat), 1, state->dirs_spill) != 1 ||
+		fwrite(&path_len, sizeof(path_len), 1, state->dirs_spill) != 1 ||
+		fwrite(record->path, 1, path_len, state->dirs_spill) != path_len ||
+		fwrite(&total, sizeof(total), 1, state->dirs_spill) != 1)
+	{
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Hash the parent directory of a path (records of a directory go to one thread)
+ *
+ * @param path is the normalized path
+ * @return the hash
+ */
+static uint64_t hash_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = (slash != NULL) ? (size_t)(slash - path) : 0;
+
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Check a parsed record and pass it to the thread of its directory
+ *
+ * @param state is the state
+ * @param record is the record (its strings are taken)
+ * @return 0 on success, -ENOMEM or -EIO on fatal errors
+ */
+static int import_emit(struct import_state *state, struct ingest_record *record)
+{
+	record->line = state->lines;
+
+	if (state->prefix != NULL)
+	{
+		size_t prefix_len = strlen(state->prefix);
+		size_t path_len = strlen(record->path);
+		char *path = (char *)malloc(prefix_len + 1 + path_len + 1);
+		if (path == NULL)
+		{
+			ingest_record_free(record);
+			return -ENOMEM;
+		}
+		memcpy(path, state->prefix, prefix_len);
+		path[prefix_len] = '/';
+		memcpy(path + prefix_len + 1, record->path, path_len + 1);
+		free(record->path);
+		record->path = path;
+	}
+
+	char message[INGEST_ERROR_MESSAGE_SIZE];
+	if (ingest_record_check(record, message, sizeof(message)) != 0)
+	{
+		import_error(state, "line %" PRIu64 ": %s", state->lines, message);
+		ingest_record_free(record);
+		return 0;
+	}
+
+	state->records++;
+
+	// Metadata of the root directory of the catalog is kept, as ingest streams do
+	if (record->path[0] == '\0')
+	{
+		ingest_record_free(record);
+		return 0;
+	}
+
+	if (!state->db_output && S_ISDIR(record->my_stat.mode))
+	{
+		int res = import_spill_dir(state, record);
+		ingest_record_free(record);
+		return res;
+	}
+
+	struct import_worker *worker = &state->workers[0];
+	if (!state->db_output)
+		worker = &state->workers[hash_parent(record->path) % state->workers_count];
+
+	worker->pending->records[worker->pending->count++] = *record;
+	if (worker->pending->count == IMPORT_BATCH_SIZE)
+		return import_worker_send(worker);
+
+	return 0;
+}
+
+/**
+ * Count a skipped entry (types that catalogs do not keep)
+ *
+ * @param state is the state
+ * @param record is the record to free
+ * @return 0
+ */
+static int import_skip(struct import_state *state, struct ingest_record *record)
+{
+	state->skipped++;
+	ingest_record_free(record);
+	return 0;
+}
+
+/**
+ * Parse a decimal number
+ *
+ * @param text is the text (does not need to be null-terminated)
+ * @param len is the length of the text
+ * @param value is the parsed value
+ * @return true on success
+ */
+static bool parse_decimal(const char *text, size_t len, uint64_t *value)
+{
+	if (len == 0 || len > 19)
+		return false;
+
+	uint64_t result = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (text[i] < '0' || text[i] > '9')
+			return false;
+		result = result * 10 + (uint64_t)(text[i] - '0');
+	}
+
+	*value = result;
+	return true;
+}
+
+/**
+ * Parse an octal number
+ *
+ * @param text is the text (does not need to be null-terminated)
+ * @param len is the length of the text
+ * @param value is the parsed value
+ * @return true on success
+ */
+static bool parse_octal(const char *text, size_t len, uint64_t *value)
+{
+	if (len == 0 || len > 21)
+		return false;
+
+	uint64_t result = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (text[i] < '0' || text[i] > '7')
+			return false;
+		result = (result << 3) | (uint64_t)(text[i] - '0');
+	}
+
+	*value = result;
+	return true;
+}
+
+/**
+ * Parse seconds with an optional fraction ("1589000000.1234567890" of find)
+ *
+ * @param text is the text (does not need to be null-terminated)
+ * @param len is the length of the text
+ * @param sec is the parsed seconds
+ * @param nsec is the parsed nanoseconds (digits after the 9th are dropped)
+ * @return true on success
+ */
+static bool parse_time(const char *text, size_t len, int64_t *sec, int64_t *nsec)
+{
+	bool negative = (len > 0 && text[0] == '-');
+	size_t start = (negative) ? 1 : 0;
+	const char *dot = memchr(text + start, '.', len - start);
+	size_t whole_len = (dot != NULL) ? (size_t)(dot - text) - start : len - start;
+
+	uint64_t whole;
+	if (!parse_decimal(text + start, whole_len, &whole) || whole > (uint64_t)INT64_MAX)
+		return false;
+
+	int64_t fraction = 0;
+	if (dot != NULL)
+	{
+		int64_t scale = 100000000;
+		for (const char *pos = dot + 1; pos < text + len; pos++)
+		{
+			if (*pos < '0' || *pos > '9')
+				return false;
+			fraction += (int64_t)(*pos - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	*sec = (int64_t)whole;
+	*nsec = fraction;
+	if (negative)
+	{
+		*sec = -*sec;
+		if (fraction > 0)
+		{
+			*sec -= 1;
+			*nsec = 1000000000 - fraction;
+		}
+	}
+	return true;
+}
+
+/**
+ * Fill missing metadata of a record: blocks, times, links and block size
+ *
+ * @param my_stat is the metadata
+ */
+static void fill_record_defaults(struct filestat *my_stat)
+{
+	if (my_stat->blocks == 0)
+		my_stat->blocks = convert_filesize_to_fileblocks(my_stat->size);
+	if (my_stat->nlink == 0)
+		my_stat->nlink = S_ISDIR(my_stat->mode) ? 2 : 1;
+	if (my_stat->blksize == 0)
+		my_stat->blksize = 4096;
+}
+
+/**
+ * Parse a line of a find listing:
+ * type, mode, uid, gid, size, mtime, atime, ctime, nlink, path and target separated by tabs
+ *
+ * @param state is the state
+ * @param line is the line (null-terminated, without the delimiter)
+ * @param len is the length of the line
+ * @return 0 on success, negative value on fatal errors
+ */
+static int import_find_line(struct import_state *state, char *line, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	const char *fields[IMPORT_FIND_FIELDS];
+	size_t lengths[IMPORT_FIND_FIELDS];
+	char *pos = line;
+	char *end = line + len;
+	for (size_t i = 0; i < IMPORT_FIND_FIELDS; i++)
+	{
+		char *tab = memchr(pos, '\t', (size_t)(end - pos));
+		if (tab == NULL)
+		{
+			import_error(state, "line %" PRIu64 ": expected %d tab-separated fields", state->lines,
+						 IMPORT_FIND_FIELDS + 2);
+			return 0;
+		}
+		fields[i] = pos;
+		lengths[i] = (size_t)(tab - pos);
+		pos = tab + 1;
+	}
+
+	// Names can contain tabs, the target of the symlink is after the last one
+	char *last_tab = memrchr(pos, '\t', (size_t)(end - pos));
+	if (last_tab == NULL)
+	{
+		import_error(state, "line %" PRIu64 ": expected %d tab-separated fields", state->lines,
+					 IMPORT_FIND_FIELDS + 2);
+		return 0;
+	}
+
+	struct ingest_record record;
+	memset(&record, 0, sizeof(struct ingest_record));
+	struct filestat *st = &record.my_stat;
+
+	uint32_t type = 0;
+	if (lengths[0] == 1)
+	{
+		switch (fields[0][0])
+		{
+		case 'f':
+			type = S_IFREG;
+			break;
+		case 'd':
+			type = S_IFDIR;
+			break;
+		case 'l':
+			type = S_IFLNK;
+			break;
+		default:
+			break;
+		}
+	}
+
+	uint64_t mode, uid, gid, size, nlink;
+	if (lengths[0] != 1 || !parse_octal(fields[1], lengths[1], &mode) ||
+		!parse_decimal(fields[2], lengths[2], &uid) || !parse_decimal(fields[3], lengths[3], &gid) ||
+		!parse_decimal(fields[4], lengths[4], &size) ||
+		!parse_time(fields[5], lengths[5], &st->mtime, &st->mtimensec) ||
+		!parse_time(fields[6], lengths[6], &st->atime, &st->atimensec) ||
+		!parse_time(fields[7], lengths[7], &st->ctime, &st->ctimensec) ||
+		!parse_decimal(fields[8], lengths[8], &nlink) ||
+		uid > UINT32_MAX || gid > UINT32_MAX || size > (uint64_t)INT64_MAX)
+	{
+		import_error(state, "line %" PRIu64 ": broken field", state->lines);
+		return 0;
+	}
+
+	if (type == 0)
+		return import_skip(state, &record);
+
+	st->mode = type | ((uint32_t)mode & 07777);
+	st->uid = (uint32_t)uid;
+	st->gid = (uint32_t)gid;
+	st->size = (int64_t)size;
+	st->nlink = nlink;
+	fill_record_defaults(st);
+
+	record.path = strndup(pos, (size_t)(last_tab - pos));
+	if (record.path == NULL)
+		return -ENOMEM;
+
+	if (type == S_IFLNK)
+	{
+		record.link_target = strndup(last_tab + 1, (size_t)(end - last_tab - 1));
+		if (record.link_target == NULL)
+		{
+			ingest_record_free(&record);
+			return -ENOMEM;
+		}
+	}
+
+	return import_emit(state, &record);
+}
+
+/**
+ * Decode vis(3) escapes of mtree names in place (\ooo, \\, \s and C-style escapes)
+ *
+ * @param text is the null-terminated text
+ */
+static void mtree_unvis(char *text)
+{
+	char *out = text;
+	for (const char *in = text; *in != '\0'; in++)
+	{
+		if (*in != '\\' || in[1] == '\0')
+		{
+			*out++ = *in;
+			continue;
+		}
+
+		in++;
+		if (in[0] >= '0' && in[0] <= '7' && in[1] >= '0' && in[1] <= '7' && in[2] >= '0' && in[2] <= '7')
+		{
+			*out++ = (char)(((in[0] - '0') << 6) | ((in[1] - '0') << 3) | (in[2] - '0'));
+			in += 2;
+			continue;
+		}
+
+		switch (*in)
+		{
+		case 's':
+			*out++ = ' ';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 'a':
+			*out++ = '\a';
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'v':
+			*out++ = '\v';
+			break;
+		default:
+			*out++ = *in;
+			break;
+		}
+	}
+	*out = '\0';
+}
+
+/**
+ * Apply one keyword of an mtree entry
+ *
+ * @param record is the record
+ * @param type is the type of the entry (0 for unsupported types)
+ * @param has_mode is set if the keyword is "mode"
+ * @param keyword is the keyword ("key=value", null-terminated)
+ * @return true on success, false for broken values
+ */
+static bool mtree_apply_keyword(struct ingest_record *record, uint32_t *type, bool *has_mode, char *keyword)
+{
+	char *value = strchr(keyword, '=');
+	if (value == NULL)
+		return true; // Keywords without values (e.g. "optional", "nochange")
+	*value++ = '\0';
+	size_t len = strlen(value);
+
+	struct filestat *st = &record->my_stat;
+	uint64_t number;
+	if (strcmp(keyword, "type") == 0)
+	{
+		*type = 0;
+		if (strcmp(value, "file") == 0)
+			*type = S_IFREG;
+		else if (strcmp(value, "dir") == 0)
+			*type = S_IFDIR;
+		else if (strcmp(value, "link") == 0)
+			*type = S_IFLNK;
+		return true;
+	}
+	if (strcmp(keyword, "mode") == 0)
+	{
+		if (!parse_octal(value, len, &number))
+			return false;
+		st->mode = (uint32_t)number & 07777;
+		*has_mode = true;
+		return true;
+	}
+	if (strcmp(keyword, "uid") == 0 || strcmp(keyword, "gid") == 0)
+	{
+		if (!parse_decimal(value, len, &number) || number > UINT32_MAX)
+			return false;
+		if (keyword[0] == 'u')
+			st->uid = (uint32_t)number;
+		else
+			st->gid = (uint32_t)number;
+		return true;
+	}
+	if (strcmp(keyword, "size") == 0)
+	{
+		if (!parse_decimal(value, len, &number) || number > (uint64_t)INT64_MAX)
+			return false;
+		st->size = (int64_t)number;
+		return true;
+	}
+	if (strcmp(keyword, "nlink") == 0)
+		return parse_decimal(value, len, &st->nlink);
+	if (strcmp(keyword, "time") == 0)
+	{
+		// The fraction is a number of nanoseconds ("%ld.%09ld" or unpadded by old writers)
+		char *dot = strchr(value, '.');
+		uint64_t sec, nsec = 0;
+		size_t sec_len = (dot != NULL) ? (size_t)(dot - value) : len;
+		if (!parse_decimal(value, sec_len, &sec) || sec > (uint64_t)INT64_MAX ||
+			(dot != NULL && (!parse_decimal(dot + 1, strlen(dot + 1), &nsec) || nsec > 999999999)))
+		{
+			return false;
+		}
+		st->mtime = (int64_t)sec;
+		st->mtimensec = (int64_t)nsec;
+		return true;
+	}
+	if (strcmp(keyword, "link") == 0)
+	{
+		mtree_unvis(value);
+		free(record->link_target);
+		record->link_target = strdup(value);
+		return record->link_target != NULL;
+	}
+	if (strcmp(keyword, "sha256digest") == 0 || strcmp(keyword, "sha256") == 0)
+	{
+		if (len != FILESTAT_SHA256_HEX_LENGTH)
+			return false;
+		for (size_t i = 0; i < len; i++)
+		{
+			if (!isxdigit((unsigned char)value[i]))
+				return false;
+			st->sha256[i] = (char)tolower((unsigned char)value[i]);
+		}
+		st->sha256[len] = '\0';
+		return true;
+	}
+
+	// Other keywords (uname, gname, flags, md5digest, cksum and so on) are ignored
+	return true;
+}
+
+/**
+ * Apply keywords separated by spaces and tabs
+ *
+ * @param record is the record
+ * @param type is the type of the entry
+ * @param has_mode is set if the keywords have "mode"
+ * @param keywords is the null-terminated text of keywords (changed)
+ * @return true on success, false for broken values
+ */
+static bool mtree_apply_keywords(struct ingest_record *record, uint32_t *type, bool *has_mode, char *keywords)
+{
+	char *saveptr = NULL;
+	for (char *keyword = strtok_r(keywords, " \t", &saveptr); keyword != NULL;
+		 keyword = strtok_r(NULL, " \t", &saveptr))
+	{
+		if (!mtree_apply_keyword(record, type, has_mode, keyword))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Change the defaults of an mtree specification by a /set or /unset line
+ *
+ * @param mtree is the mtree state
+ * @param keywords is the text after the command
+ * @param set is true for /set and false for /unset
+ * @return 0 on success, -ENOMEM on error
+ */
+static int mtree_change_defaults(struct import_mtree *mtree, const char *keywords, bool set)
+{
+	// Defaults are kept as text, later keywords override earlier ones when applied
+	if (set)
+	{
+		if (byte_buffer_append(&mtree->defaults, " ", 1) != 0 ||
+			byte_buffer_append(&mtree->defaults, keywords, strlen(keywords)) != 0)
+		{
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	// /unset drops keywords by their names ("all" drops everything)
+	char *copy = strdup(keywords);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	char *saveptr = NULL;
+	for (char *name = strtok_r(copy, " \t", &saveptr); name != NULL; name = strtok_r(NULL, " \t", &saveptr))
+	{
+		size_t name_len = strlen(name);
+		if (strcmp(name, "all") == 0)
+		{
+			mtree->defaults.len = 0;
+			continue;
+		}
+
+		size_t out = 0;
+		size_t pos = 0;
+		char *text = (char *)mtree->defaults.data;
+		while (pos < mtree->defaults.len)
+		{
+			size_t start = pos;
+			while (pos < mtree->defaults.len && text[pos] != ' ' && text[pos] != '\t')
+				pos++;
+			size_t word_len = pos - start;
+			bool drop = (word_len > name_len && memcmp(text + start, name, name_len) == 0 &&
+						 text[start + name_len] == '=');
+			if (!drop && word_len > 0)
+			{
+				text[out++] = ' ';
+				memmove(text + out, text + start, word_len);
+				out += word_len;
+			}
+			pos++;
+		}
+		mtree->defaults.len = out;
+	}
+
+	free(copy);
+	return 0;
+}
+
+/**
+ * Handle a complete line of an mtree specification
+ *
+ * @param state is the state
+ * @param line is the null-terminated line (changed)
+ * @return 0 on success, negative value on fatal errors
+ */
+static int import_mtree_entry(struct import_state *state, char *line)
+{
+	struct import_mtree *mtree = &state->mtree;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (*line == '\0' || *line == '#')
+		return 0;
+
+	char *name = line;
+	while (*line != '\0' && *line != ' ' && *line != '\t')
+		line++;
+	if (*line != '\0')
+		*line++ = '\0';
+
+	if (strcmp(name, "/set") == 0 || strcmp(name, "/unset") == 0)
+		return mtree_change_defaults(mtree, line, name[1] == 's');
+
+	if (strcmp(name, "..") == 0)
+	{
+		if (mtree->depth == 0)
+		{
+			import_error(state, "line %" PRIu64 ": \"..\" above the root", state->lines);
+			return 0;
+		}
+		mtree->depth--;
+		mtree->cwd.len = mtree->lengths[mtree->depth];
+		return 0;
+	}
+
+	mtree_unvis(name);
+
+	struct ingest_record record;
+	memset(&record, 0, sizeof(struct ingest_record));
+	record.my_stat.uid = state->defaults.uid;
+	record.my_stat.gid = state->defaults.gid;
+	record.my_stat.mtime = state->defaults.mtime;
+
+	uint32_t type = S_IFREG;
+	bool has_mode = false;
+	char *defaults = strndup((const char *)mtree->defaults.data, mtree->defaults.len);
+	if (defaults == NULL)
+		return -ENOMEM;
+
+	bool ok = mtree_apply_keywords(&record, &type, &has_mode, defaults) &&
+			  mtree_apply_keywords(&record, &type, &has_mode, line);
+	free(defaults);
+	if (!ok)
+	{
+		ingest_record_free(&record);
+		import_error(state, "line %" PRIu64 ": broken keyword of \"%s\"", state->lines, name);
+		return 0;
+	}
+
+	// Names with slashes are full paths, other names are inside the current directory
+	bool is_full_path = (strchr(name, '/') != NULL);
+	size_t name_len = strlen(name);
+	size_t cwd_len = (is_full_path) ? 0 : mtree->cwd.len;
+	record.path = (char *)malloc(cwd_len + 1 + name_len + 1);
+	if (record.path == NULL)
+	{
+		ingest_record_free(&record);
+		return -ENOMEM;
+	}
+	size_t pos = 0;
+	if (cwd_len > 0)
+	{
+		memcpy(record.path, mtree->cwd.data, cwd_len);
+		record.path[cwd_len] = '/';
+		pos = cwd_len + 1;
+	}
+	memcpy(record.path + pos, name, name_len + 1);
+
+	// A directory with a relative name becomes the current one until its ".."
+	if (!is_full_path && type == S_IFDIR)
+	{
+		if (mtree->depth == mtree->capacity)
+		{
+			size_t capacity = (mtree->capacity > 0) ? mtree->capacity * 2 : 64;
+			size_t *lengths = (size_t *)realloc(mtree->lengths, capacity * sizeof(size_t));
+			if (lengths == NULL)
+			{
+				ingest_record_free(&record);
+				return -ENOMEM;
+			}
+			mtree->lengths = lengths;
+			mtree->capacity = capacity;
+		}
+		mtree->lengths[mtree->depth++] = mtree->cwd.len;
+		if (byte_buffer_append(&mtree->cwd, "/", 1) != 0 || byte_buffer_append(&mtree->cwd, name, name_len) != 0)
+		{
+			ingest_record_free(&record);
+			return -ENOMEM;
+		}
+	}
+
+	if (type == 0)
+		return import_skip(state, &record);
+
+	// Entries without "mode" get permissions of the usual umask
+	if (!has_mode)
+		record.my_stat.mode = (type == S_IFDIR) ? 0755 : (type == S_IFLNK) ? 0777 : 0644;
+	record.my_stat.mode |= type;
+	record.my_stat.atime = record.my_stat.ctime = record.my_stat.mtime;
+	record.my_stat.atimensec = record.my_stat.ctimensec = record.my_stat.mtimensec;
+	if (type == S_IFLNK && record.link_target != NULL)
+		record.my_stat.size = (int64_t)strlen(record.link_target);
+	fill_record_defaults(&record.my_stat);
+
+	return import_emit(state, &record);
+}
+
+/**
+ * Parse a line of an mtree specification (lines ending with '\' continue on the next line)
+ *
+ * @param state is the state
+ * @param line is the line (null-terminated, without the delimiter)
+ * @param len is the length of the line
+ * @return 0 on success, negative value on fatal errors
+ */
+static int import_mtree_line(struct import_state *state, char *line, size_t len)
+{
+	struct byte_buffer *joined = &state->mtree.line;
+
+	if (len > 0 && line[len - 1] == '\\')
+	{
+		line[len - 1] = ' ';
+		return (byte_buffer_append(joined, line, len) == 0) ? 0 : -ENOMEM;
+	}
+
+	if (joined->len == 0)
+		return import_mtree_entry(state, line);
+
+	if (byte_buffer_append(joined, line, len) != 0 || byte_buffer_append(joined, "", 1) != 0)
+		return -ENOMEM;
+
+	int res = import_mtree_entry(state, (char *)joined->data);
+	joined->len = 0;
+	return res;
+}
+
+/**
+ * Read the next part of the listing (the byte read to detect the format comes first)
+ *
+ * @param state is the state
+ * @param fd is the file descriptor of the listing
+ * @param buf is the target buffer
+ * @param size is the size of the buffer (at least 1)
+ * @return number of read bytes (0 at the end), -errno on error
+ */
+static ssize_t import_read(struct import_state *state, int fd, char *buf, size_t size)
+{
+	if (state->has_first_byte)
+	{
+		state->has_first_byte = false;
+		buf[0] = state->first_byte;
+		state->bytes_read++;
+		return 1;
+	}
+
+	ssize_t count;
+	do
+	{
+		count = read(fd, buf, size);
+	} while (count == -1 && errno == EINTR);
+
+	if (count == -1)
+		return -errno;
+
+	state->bytes_read += (uint64_t)count;
+	return count;
+}
+
+/**
+ * Read the listing line by line
+ *
+ * @param state is the state
+ * @param fd is the file descriptor of the listing
+ * @param delimiter is the end of lines
+ * @param handle_line is the parser of lines
+ * @return 0 on success, negative value on fatal errors
+ */
+static int import_read_lines(struct import_state *state, int fd, char delimiter,
+							 int (*handle_line)(struct import_state *state, char *line, size_t len))
+{
+	char *buf = (char *)malloc(IMPORT_READ_BUFFER_SIZE + IMPORT_MAX_LINE_LENGTH + 1);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	size_t len = 0;
+	bool skipping = false;
+	int res = 0;
+	while (res == 0)
+	{
+		ssize_t count = import_read(state, fd, buf + len, IMPORT_READ_BUFFER_SIZE + IMPORT_MAX_LINE_LENGTH - len);
+		if (count < 0)
+		{
+			res = (int)count;
+			break;
+		}
+		len += (size_t)count;
+
+		// The last line does not need the delimiter
+		if (count == 0 && len > 0 && buf[len - 1] != delimiter)
+			buf[len++] = delimiter;
+
+		char *pos = buf;
+		char *end = buf + len;
+		char *next;
+		while (res == 0 && (next = memchr(pos, delimiter, (size_t)(end - pos))) != NULL)
+		{
+			*next = '\0';
+			if (!skipping)
+			{
+				state->lines++;
+				res = handle_line(state, pos, (size_t)(next - pos));
+			}
+			skipping = false;
+			pos = next + 1;
+		}
+
+		len = (size_t)(end - pos);
+		if (len > IMPORT_MAX_LINE_LENGTH)
+		{
+			// The rest of a too long line is skipped up to its end
+			state->lines++;
+			import_error(state, "line %" PRIu64 ": too long line", state->lines);
+			skipping = true;
+			len = 0;
+		}
+		memmove(buf, pos, len);
+
+		if (count == 0)
+			break;
+
+		if (state->progress_interval > 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (elapsed_seconds(&state->report_time, &now) >= (double)state->progress_interval)
+				import_print_progress(state, false);
+		}
+	}
+
+	free(buf);
+	return res;
+}
+
+/**
+ * Handle an object of an ncdu export
+ *
+ * @param state is the state
+ * @param object is the text of the object
+ * @param size is the size of the text
+ * @param dirs is the path of the current directory
+ * @param is_dir is true for the first object of an array (the directory itself)
+ * @param is_root is true for the directory of the export itself
+ * @return 0 on success, -EINVAL for broken objects, -ENOMEM on error
+ */
+static int import_ncdu_object(struct import_state *state, const char *object, size_t size,
+							  struct byte_buffer *dirs, bool is_dir, bool is_root)
+{
+	struct json_cursor cur = {object, object + size};
+	struct byte_buffer key = {NULL, 0, 0};
+	struct byte_buffer name = {NULL, 0, 0};
+	uint64_t asize = 0, dsize = 0;
+	bool notreg = false;
+	bool excluded = false;
+	bool has_mode = false;
+
+	struct ingest_record record;
+	memset(&record, 0, sizeof(struct ingest_record));
+	struct filestat *st = &record.my_stat;
+	st->uid = state->defaults.uid;
+	st->gid = state->defaults.gid;
+	st->mtime = state->defaults.mtime;
+
+	int res = 0;
+	cur.pos++; // '{'
+	json_skip_spaces(&cur);
+	while (res == 0 && cur.pos < cur.end && *cur.pos != '}')
+	{
+		res = json_parse_string(&cur, &key);
+		json_skip_spaces(&cur);
+		if (res != 0 || cur.pos >= cur.end || *cur.pos != ':')
+		{
+			res = (res == -ENOMEM) ? res : -EINVAL;
+			break;
+		}
+		cur.pos++;
+		json_skip_spaces(&cur);
+
+		const char *k = (const char *)key.data;
+		int64_t number = 0, nsec = 0;
+		bool has_fraction = false;
+		bool flag = false;
+		if (strcmp(k, "name") == 0)
+		{
+			res = json_parse_string(&cur, &name);
+		}
+		else if (strcmp(k, "asize") == 0 || strcmp(k, "dsize") == 0 || strcmp(k, "uid") == 0 ||
+				 strcmp(k, "gid") == 0 || strcmp(k, "mode") == 0 || strcmp(k, "mtime") == 0 ||
+				 strcmp(k, "nlink") == 0)
+		{
+			res = json_parse_number(&cur, &number, &nsec, &has_fraction);
+			if (res == 0 && number < 0)
+				res = -EINVAL;
+			if (res == 0)
+			{
+				if (k[0] == 'a')
+					asize = (uint64_t)number;
+				else if (k[0] == 'd')
+					dsize = (uint64_t)number;
+				else if (k[0] == 'u')
+					st->uid = (uint32_t)number;
+				else if (k[0] == 'g')
+					st->gid = (uint32_t)number;
+				else if (k[1] == 'o')
+				{
+					st->mode = (uint32_t)number;
+					has_mode = true;
+				}
+				else if (k[1] == 't')
+				{
+					st->mtime = number;
+					st->mtimensec = nsec;
+				}
+				else
+					st->nlink = (uint64_t)number;
+			}
+		}
+		else if (strcmp(k, "notreg") == 0)
+		{
+			res = json_parse_bool(&cur, &flag);
+			notreg = notreg || flag;
+		}
+		else if (strcmp(k, "excluded") == 0)
+		{
+			excluded = true;
+			res = json_skip_value(&cur, 0);
+		}
+		else
+		{
+			res = json_skip_value(&cur, 0);
+		}
+
+		json_skip_spaces(&cur);
+		if (res == 0 && cur.pos < cur.end && *cur.pos == ',')
+		{
+			cur.pos++;
+			json_skip_spaces(&cur);
+		}
+	}
+	free(key.data);
+
+	if (res == 0 && name.data == NULL)
+		res = -EINVAL;
+	if (res != 0)
+	{
+		free(name.data);
+		return res;
+	}
+
+	// The directory of the export is the root of the catalog
+	size_t name_len = name.len - 1;
+	if (is_dir)
+	{
+		if (!is_root && ((dirs->len > 0 && byte_buffer_append(dirs, "/", 1) != 0) ||
+						 byte_buffer_append(dirs, name.data, name_len) != 0))
+		{
+			free(name.data);
+			return -ENOMEM;
+		}
+	}
+
+	uint32_t type = (has_mode) ? (st->mode & S_IFMT) : 0;
+	if (type == 0)
+		type = (is_dir) ? S_IFDIR : (notreg) ? 0 : S_IFREG;
+
+	// Symlinks of exports have no targets, devices and fifos are not kept
+	if ((type != S_IFREG && type != S_IFDIR) || (excluded && !is_dir))
+	{
+		free(name.data);
+		return import_skip(state, &record);
+	}
+
+	st->mode = type | ((has_mode) ? (st->mode & 07777) : (type == S_IFDIR) ? 0755 : 0644);
+	st->size = (int64_t)asize;
+	st->blocks = (int64_t)(dsize / 512);
+	st->atime = st->ctime = st->mtime;
+	st->atimensec = st->ctimensec = st->mtimensec;
+	fill_record_defaults(st);
+
+	if (is_dir)
+	{
+		record.path = strndup((const char *)dirs->data, dirs->len);
+	}
+	else
+	{
+		record.path = (char *)malloc(dirs->len + 1 + name_len + 1);
+		if (record.path != NULL)
+		{
+			memcpy(record.path, dirs->data, dirs->len);
+			record.path[dirs->len] = '/';
+			memcpy(record.path + dirs->len + 1, name.data, name_len + 1);
+		}
+	}
+	free(name.data);
+	if (record.path == NULL)
+		return -ENOMEM;
+
+	return import_emit(state, &record);
+}
+
+/**
+ * Read an ncdu export: [major, minor, {metadata}, [{root}, {file}, [{dir}, ...], ...]]
+ *
+ * @param state is the state
+ * @param fd is the file descriptor of the listing
+ * @return 0 on success, -EINVAL for broken exports, other negative value on fatal errors
+ */
+static int import_read_ncdu(struct import_state *state, int fd)
+{
+	char *buf = (char *)malloc(IMPORT_READ_BUFFER_SIZE);
+	struct byte_buffer object = {NULL, 0, 0};
+	struct byte_buffer dirs = {NULL, 0, 0};
+	size_t *dir_lengths = (size_t *)malloc(IMPORT_MAX_DEPTH * sizeof(size_t));
+	if (buf == NULL || dir_lengths == NULL)
+	{
+		free(buf);
+		free(dir_lengths);
+		return -ENOMEM;
+	}
+
+	// Depth of arrays: 1 is the export itself, 2 is the root directory
+	size_t depth = 0;
+	bool in_object = false;
+	bool in_string = false;
+	bool escaped = false;
+	size_t object_depth = 0;
+	bool first_in_array = false;
+	int res = 0;
+
+	while (res == 0)
+	{
+		ssize_t count = import_read(state, fd, buf, IMPORT_READ_BUFFER_SIZE);
+		if (count < 0)
+		{
+			res = (int)count;
+			break;
+		}
+		if (count == 0)
+			break;
+
+		size_t start = 0;
+		for (size_t i = 0; i < (size_t)count && res == 0; i++)
+		{
+			char c = buf[i];
+			if (in_object)
+			{
+				if (in_string)
+				{
+					if (escaped)
+						escaped = false;
+					else if (c == '\\')
+						escaped = true;
+					else if (c == '"')
+						in_string = false;
+					continue;
+				}
+
+				if (c == '"')
+					in_string = true;
+				else if (c == '{' || c == '[')
+					object_depth++;
+				else if ((c == '}' || c == ']') && --object_depth == 0)
+				{
+					in_object = false;
+					if (byte_buffer_append(&object, buf + start, i + 1 - start) != 0)
+					{
+						res = -ENOMEM;
+						break;
+					}
+
+					// Objects outside of directories are metadata of the export
+					if (depth >= 2)
+					{
+						state->lines++;
+						res = import_ncdu_object(state, (const char *)object.data, object.len, &dirs,
+												 first_in_array, depth == 2);
+						if (res == -EINVAL)
+							import_error(state, "object %" PRIu64 ": broken JSON", state->lines);
+					}
+					first_in_array = false;
+					object.len = 0;
+				}
+				continue;
+			}
+
+			switch (c)
+			{
+			case '{':
+				in_object = true;
+				object_depth = 1;
+				start = i;
+				break;
+			case '[':
+				if (depth >= 1 && depth - 1 >= IMPORT_MAX_DEPTH)
+				{
+					res = -EINVAL;
+					break;
+				}
+				if (depth >= 1)
+					dir_lengths[depth - 1] = dirs.len;
+				depth++;
+				first_in_array = (depth >= 2);
+				break;
+			case ']':
+				if (depth == 0)
+				{
+					res = -EINVAL;
+					break;
+				}
+				depth--;
+				if (depth >= 1)
+					dirs.len = dir_lengths[depth - 1];
+				break;
+			default:
+				// Numbers, commas and spaces between values
+				break;
+			}
+		}
+
+		if (res == 0 && in_object && byte_buffer_append(&object, buf + start, (size_t)count - start) != 0)
+			res = -ENOMEM;
+
+		if (state->progress_interval > 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (elapsed_seconds(&state->report_time, &now) >= (double)state->progress_interval)
+				import_print_progress(state, false);
+		}
+	}
+
+	if (res == 0 && (depth != 0 || in_object))
+		res = -EINVAL;
+	if (res == -EINVAL)
+		import_error(state, "broken ncdu export near object %" PRIu64, state->lines);
+
+	free(buf);
+	free(object.data);
+	free(dirs.data);
+	free(dir_lengths);
+	return res;
+}
+
+/**
+ * Apply spilled records of directories in reverse order (children before parents),
+ * so creation of their entries does not change their times
+ *
+ * @param state is the state
+ * @return 0 on success, negative value on fatal errors
+ */
+static int import_apply_dirs(struct import_state *state)
+{
+	if (fflush(state->dirs_spill) != 0)
+		return -EIO;
+
+	int fd = fileno(state->dirs_spill);
+	off_t pos = lseek(fd, 0, SEEK_END);
+	if (pos == (off_t)-1)
+		return -errno;
+
+	char *path = (char *)malloc(PATH_MAX + 1);
+	if (path == NULL)
+		return -ENOMEM;
+
+	struct ingest_writer writer;
+	ingest_writer_init(&writer, state->catalog_fd, state->storage);
+	size_t pending = 0;
+	int res = 0;
+	while (pos > 0)
+	{
+		uint32_t total;
+		uint32_t path_len;
+		struct ingest_record record;
+		memset(&record, 0, sizeof(struct ingest_record));
+		off_t record_pos = pos - (off_t)sizeof(total);
+		if (pread(fd, &total, sizeof(total), record_pos) != (ssize_t)sizeof(total) || total > (uint64_t)pos)
+		{
+			res = -EIO;
+			break;
+		}
+		record_pos = pos - (off_t)total;
+		if (pread(fd, &record.my_stat, sizeof(struct filestat), record_pos) != (ssize_t)sizeof(struct filestat) ||
+			pread(fd, &path_len, sizeof(path_len), record_pos + (off_t)sizeof(struct filestat)) !=
+				(ssize_t)sizeof(path_len) ||
+			path_len > PATH_MAX ||
+			pread(fd, path, path_len, record_pos + (off_t)(sizeof(struct filestat) + sizeof(path_len))) !=
+				(ssize_t)path_len)
+		{
+			res = -EIO;
+			break;
+		}
+		path[path_len] = '\0';
+		pos = record_pos;
+
+		record.path = path;
+		int put_res = ingest_writer_put(&writer, &record);
+		if (put_res != 0)
+			import_error(state, "failed to create directory \"%s\": %s", path, strerror(-put_res));
+
+		// Metadata is applied in chunks, so memory does not depend on the number of directories
+		if (++pending == IMPORT_BATCH_SIZE)
+		{
+			int finish_res = ingest_writer_finish(&writer);
+			if (finish_res != 0)
+				import_error(state, "failed to apply metadata of directories: %s", strerror(-finish_res));
+			pending = 0;
+		}
+	}
+
+	int finish_res = ingest_writer_finish(&writer);
+	if (finish_res != 0)
+		import_error(state, "failed to apply metadata of directories: %s", strerror(-finish_res));
+	ingest_writer_free(&writer);
+	free(path);
+	return res;
+}
+
+/**
+ * Detect the format of the listing by its first byte
+ *
+ * @param fd is the file descriptor of the listing
+ * @param format is the detected format
+ * @param first is the read byte (prepended to the listing by the caller)
+ * @param has_first is set if a byte was read
+ * @return 0 on success, -errno on error
+ */
+static int detect_format(int fd, enum import_format *format, char *first, bool *has_first)
+{
+	ssize_t count;
+	do
+	{
+		count = read(fd, first, 1);
+	} while (count == -1 && errno == EINTR);
+
+	if (count == -1)
+		return -errno;
+
+	*has_first = (count == 1);
+	if (count == 1 && *first == '[')
+		*format = IMPORT_FORMAT_NCDU;
+	else if (count == 1 && (*first == '#' || *first == '/' || *first == '.'))
+		*format = IMPORT_FORMAT_MTREE;
+	else
+		*format = IMPORT_FORMAT_FIND;
+	return 0;
+}
+
+/**
+ * Start threads that build the catalog
+ *
+ * @param state is the state
+ * @return 0 on success, negative value on error
+ */
+static int import_start_workers(struct import_state *state)
+{
+	unsigned int count = (state->db_output) ? 1 : state->jobs;
+	state->workers = (struct import_worker *)calloc(count, sizeof(struct import_worker));
+	if (state->workers == NULL)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		struct import_worker *worker = &state->workers[i];
+		worker->state = state;
+		import_queue_init(&worker->queue);
+		worker->pending = import_batch_new();
+		if (worker->pending == NULL)
+		{
+			import_queue_destroy(&worker->queue);
+			return -ENOMEM;
+		}
+
+		if (state->db_output)
+		{
+			worker->loader = (struct import_db_loader *)calloc(1, sizeof(struct import_db_loader));
+			if (worker->loader == NULL)
+			{
+				import_batch_free(worker->pending);
+				import_queue_destroy(&worker->queue);
+				return -ENOMEM;
+			}
+			worker->loader->db = state->db;
+		}
+		else
+		{
+			// The directory metadata is applied by import_apply_dirs(), batches are not committed
+			ingest_writer_init(&worker->writer, state->catalog_fd, state->storage);
+			struct ingest_sink sink = {ingest_writer_put, NULL, &worker->writer};
+			if (ingest_stream_init(&worker->stream, &sink, &state->defaults) != 0)
+			{
+				import_batch_free(worker->pending);
+				import_queue_destroy(&worker->queue);
+				return -ENOMEM;
+			}
+		}
+
+		if (pthread_create(&worker->thread, NULL, import_worker_thread, worker) != 0)
+		{
+			if (!state->db_output)
+			{
+				ingest_stream_free(&worker->stream);
+				ingest_writer_free(&worker->writer);
+			}
+			free(worker->loader);
+			import_batch_free(worker->pending);
+			import_queue_destroy(&worker->queue);
+			return -EAGAIN;
+		}
+		state->workers_count++;
+	}
+
+	return 0;
+}
+
+/**
+ * Pass the remaining records, wait for threads and free them
+ *
+ * @param state is the state
+ * @param send is false if the remaining records should be dropped
+ */
+static void import_stop_workers(struct import_state *state, bool send)
+{
+	for (unsigned int i = 0; i < state->workers_count; i++)
+	{
+		struct import_worker *worker = &state->workers[i];
+		if (send && worker->pending->count > 0)
+		{
+			import_queue_push(&worker->queue, worker->pending);
+			worker->pending = NULL;
+		}
+		import_queue_close(&worker->queue);
+	}
+
+	for (unsigned int i = 0; i < state->workers_count; i++)
+	{
+		struct import_worker *worker = &state->workers[i];
+		pthread_join(worker->thread, NULL);
+
+		if (worker->first_error_message[0] != '\0' && state->first_error_message[0] == '\0')
+		{
+			memcpy(state->first_error_message, worker->first_error_message, sizeof(state->first_error_message));
+		}
+
+		import_batch_free(worker->pending);
+		worker->pending = NULL;
+		import_queue_destroy(&worker->queue);
+		if (worker->loader == NULL)
+		{
+			ingest_stream_free(&worker->stream);
+			ingest_writer_free(&worker->writer);
+		}
+		free(worker->loader);
+		worker->loader = NULL;
+	}
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <catalog> [listing]", program_name);
+	PrintToStdout("Creates a catalog from a listing of files (read from stdin if the listing");
+	PrintToStdout("is missing or \"-\"). Listings of find are made by:");
+	PrintToStdout("  find <dir> -printf '%y\\t%m\\t%U\\t%G\\t%s\\t%T@\\t%A@\\t%C@\\t%n\\t%P\\t%l\\n'");
+	PrintToStdout("Options:");
+	PrintToStdout("-f   --format=<f>          format of the listing: auto, find, mtree or ncdu");
+	PrintToStdout("                           (default: auto)");
+	PrintToStdout("-0   --null                lines of find listings end with '\\0' (-printf '...%l\\0')");
+	PrintToStdout("     --db                  create a single-file catalog instead of a directory");
+	PrintToStdout("     --cache-mb=<n>        page cache of the single-file catalog in MiB");
+	PrintToStdout("                           (default: 256)");
+	PrintToStdout("-j   --jobs=<n>            number of threads that create index files");
+	PrintToStdout("                           (default: 4)");
+	PrintToStdout("-P   --prefix=<dir>        put entries into the directory of the catalog");
+	PrintToStdout("-s   --storage=<s>         storage of index files: text, sparse or xattr");
+	PrintToStdout("                           (default: text)");
+	PrintToStdout("-p   --progress=<sec>      interval of throughput reports to stderr, 0 to disable");
+	PrintToStdout("                           (default: 10)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Parse a positive number from a command line argument
+ *
+ * @param arg is the argument
+ * @param allow_zero determines if zero is allowed
+ * @param value is the target value
+ * @return true on success, false on error
+ */
+static bool parse_unsigned_arg(const char *arg, bool allow_zero, unsigned int *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || parsed > UINT_MAX || (!allow_zero && parsed == 0))
+		return false;
+
+	*value = (unsigned int)parsed;
+	return true;
+}
+
+/**
+ * Open the catalog directory (created if it does not exist)
+ *
+ * @param path is the path of the catalog
+ * @return the file descriptor, -1 on error (errno is set)
+ */
+static int open_catalog(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT)
+	{
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			return -1;
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	return fd;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct import_state state;
+	memset(&state, 0, sizeof(struct import_state));
+	state.jobs = IMPORT_DEFAULT_JOBS;
+	state.progress_interval = IMPORT_DEFAULT_PROGRESS_INTERVAL;
+	state.cache_mb = IMPORT_DEFAULT_CACHE_MB;
+	state.storage = CATALOG_STORAGE_TEXT;
+	state.catalog_fd = -1;
+	const char *prefix = NULL;
+
+	enum
+	{
+		OPT_DB = 256,
+		OPT_CACHE_MB,
+	};
+
+	static const struct option long_options[] = {
+		{"format", required_argument, NULL, 'f'},
+		{"null", no_argument, NULL, '0'},
+		{"db", no_argument, NULL, OPT_DB},
+		{"cache-mb", required_argument, NULL, OPT_CACHE_MB},
+		{"jobs", required_argument, NULL, 'j'},
+		{"prefix", required_argument, NULL, 'P'},
+		{"storage", required_argument, NULL, 's'},
+		{"progress", required_argument, NULL, 'p'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:0j:P:s:p:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (strcmp(optarg, "auto") == 0)
+				state.format = IMPORT_FORMAT_AUTO;
+			else if (strcmp(optarg, "find") == 0)
+				state.format = IMPORT_FORMAT_FIND;
+			else if (strcmp(optarg, "mtree") == 0)
+				state.format = IMPORT_FORMAT_MTREE;
+			else if (strcmp(optarg, "ncdu") == 0)
+				state.format = IMPORT_FORMAT_NCDU;
+			else
+			{
+				PrintToStderr("Invalid format (should be auto, find, mtree or ncdu)");
+				return IMPORT_EXIT_ERROR;
+			}
+			break;
+		case '0':
+			state.null_terminated = true;
+			break;
+		case OPT_DB:
+			state.db_output = true;
+			break;
+		case OPT_CACHE_MB:
+			if (!parse_unsigned_arg(optarg, false, &state.cache_mb))
+			{
+				PrintToStderr("Invalid size of the cache");
+				return IMPORT_EXIT_ERROR;
+			}
+			break;
+		case 'j':
+			if (!parse_unsigned_arg(optarg, false, &state.jobs))
+			{
+				PrintToStderr("Invalid number of jobs");
+				return IMPORT_EXIT_ERROR;
+			}
+			break;
+		case 'P':
+			prefix = optarg;
+			break;
+		case 's':
+			if (storage_from_name(optarg, &state.storage) != 0)
+			{
+				PrintToStderr("Invalid storage (should be text, sparse or xattr)");
+				return IMPORT_EXIT_ERROR;
+			}
+			break;
+		case 'p':
+			if (!parse_unsigned_arg(optarg, true, &state.progress_interval))
+			{
+				PrintToStderr("Invalid progress interval");
+				return IMPORT_EXIT_ERROR;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return IMPORT_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return IMPORT_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 1 && argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return IMPORT_EXIT_ERROR;
+	}
+
+	if (prefix != NULL)
+	{
+		// The prefix is checked the same way as paths of entries
+		struct ingest_record check;
+		memset(&check, 0, sizeof(struct ingest_record));
+		check.my_stat.mode = S_IFDIR;
+		check.path = strdup(prefix);
+		char message[INGEST_ERROR_MESSAGE_SIZE];
+		if (check.path == NULL || ingest_record_check(&check, message, sizeof(message)) != 0)
+		{
+			PrintToStderrF("Invalid prefix: %s", (check.path != NULL) ? message : strerror(ENOMEM));
+			ingest_record_free(&check);
+			return IMPORT_EXIT_ERROR;
+		}
+
+		if (check.path[0] != '\0')
+			state.prefix = check.path;
+		else
+			ingest_record_free(&check);
+	}
+
+	const char *listing_path = (argc - optind == 2) ? argv[optind + 1] : "-";
+	int listing_fd = STDIN_FILENO;
+	if (strcmp(listing_path, "-") != 0)
+	{
+		listing_fd = open(listing_path, O_RDONLY | O_CLOEXEC);
+		if (listing_fd == -1)
+		{
+			PrintToStderrF("Failed to open listing: %s (path: %s)", strerror(errno), listing_path);
+			free(state.prefix);
+			return IMPORT_EXIT_ERROR;
+		}
+		(void)posix_fadvise(listing_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	int res = 0;
+	if (state.db_output)
+	{
+		res = catalog_db_open(&state.db, argv[optind], (size_t)state.cache_mb * 1024 * 1024, true);
+		if (res != 0)
+			PrintToStderrF("Failed to open single-file catalog: %s (path: %s)", strerror(-res), argv[optind]);
+	}
+	else
+	{
+		state.catalog_fd = open_catalog(argv[optind]);
+		if (state.catalog_fd == -1)
+		{
+			res = -errno;
+			PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), argv[optind]);
+		}
+
+		// Both sparse and xattr storages keep records in xattrs
+		if (res == 0 && state.storage != CATALOG_STORAGE_TEXT && !storage_xattr_supported(state.catalog_fd))
+		{
+			PrintToStderrF("Filesystem does not support user xattrs, files are written in %s storage instead",
+						   storage_name(CATALOG_STORAGE_TEXT));
+			state.storage = CATALOG_STORAGE_TEXT;
+		}
+
+		if (res == 0)
+		{
+			state.dirs_spill = tmpfile();
+			if (state.dirs_spill == NULL)
+			{
+				res = -errno;
+				PrintToStderrF("Failed to create temporary file: %s", strerror(errno));
+			}
+		}
+	}
+
+	if (res != 0)
+	{
+		if (state.catalog_fd != -1)
+			(void)close(state.catalog_fd);
+		if (listing_fd != STDIN_FILENO)
+			(void)close(listing_fd);
+		free(state.prefix);
+		return IMPORT_EXIT_ERROR;
+	}
+
+	// Entries without owner or time get the ones of the import
+	state.defaults.uid = (uint32_t)getuid();
+	state.defaults.gid = (uint32_t)getgid();
+	state.defaults.mtime = time(NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &state.start_time);
+	state.report_time = state.start_time;
+
+	// The byte read to detect the format is parsed with the rest of the listing
+	enum import_format detected = IMPORT_FORMAT_FIND;
+	res = detect_format(listing_fd, &detected, &state.first_byte, &state.has_first_byte);
+	if (res == 0 && state.format == IMPORT_FORMAT_AUTO)
+		state.format = detected;
+
+	if (res == 0)
+		res = import_start_workers(&state);
+
+	if (res == 0)
+	{
+		if (state.format == IMPORT_FORMAT_NCDU)
+		{
+			res = import_read_ncdu(&state, listing_fd);
+		}
+		else
+		{
+			char delimiter = (state.null_terminated) ? '\0' : '\n';
+			res = import_read_lines(&state, listing_fd, delimiter,
+									(state.format == IMPORT_FORMAT_MTREE) ? import_mtree_line : import_find_line);
+		}
+	}
+
+	if (res != 0 && res != -EINVAL)
+		import_error(&state, "failed to read listing: %s", strerror(-res));
+
+	import_stop_workers(&state, res == 0 || res == -EINVAL);
+
+	if (state.dirs_spill != NULL)
+	{
+		int dirs_res = import_apply_dirs(&state);
+		if (dirs_res != 0)
+			import_error(&state, "failed to read temporary file: %s", strerror(-dirs_res));
+		fclose(state.dirs_spill);
+	}
+
+	if (state.db != NULL)
+	{
+		int close_res = catalog_db_close(state.db);
+		if (close_res != 0)
+			import_error(&state, "failed to commit single-file catalog: %s", strerror(-close_res));
+	}
+
+	import_print_progress(&state, true);
+	if (state.first_error_message[0] != '\0')
+		PrintToStderrF("First error: %s", state.first_error_message);
+
+	bool failed = (state.errors > 0);
+	for (unsigned int i = 0; i < state.workers_count; i++)
+	{
+		failed = failed || state.workers[i].errors > 0 || state.workers[i].stream.errors > 0;
+	}
+
+	free(state.workers);
+	free(state.prefix);
+	free(state.mtree.cwd.data);
+	free(state.mtree.lengths);
+	free(state.mtree.line.data);
+	free(state.mtree.defaults.data);
+	if (state.catalog_fd != -1)
+		(void)close(state.catalog_fd);
+	if (listing_fd != STDIN_FILENO)
+		(void)close(listing_fd);
+
+	return (failed) ? IMPORT_EXIT_ERROR : IMPORT_EXIT_OK;
+}
@@ -0,0 +1,1288 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-index - creates or updates a CatalogFS catalog (index) of a live
+ * directory tree:
+ *
+ *   catalogfs-index /mnt/disk /catalogs/disk
+ *   catalogfs-index --sha256 /mnt/disk /catalogs/disk      (with hashes of files)
+ *
+ * The first run lists the whole tree. Later runs are incremental: identity,
+ * mtime and ctime of every indexed source directory are kept in the state
+ * file of the catalog (see index_state.h), and a directory whose values did
+ * not change has the same entries, so it is not listed again - only its
+ * subdirectories (known from the catalog) are stat()ed and visited. Changed
+ * directories are listed and merged with their catalog directories:
+ *
+ *  - entries that disappeared are removed (with whole subtrees);
+ *  - new entries are created;
+ *  - records of files whose metadata (except atime) did not change are kept
+ *    as they are, other records are rewritten. The SHA-256 of a rewritten
+ *    file is reused when its size and mtime did not change and computed
+ *    (with --sha256) otherwise.
+ *
+ * Only the records of changed entries are written, so an update costs about
+ * a stat() per directory plus the work on what changed.
+ *
+ * Contents of a file modified in place change the mtime of the file but not
+ * of its directory, so such changes in unchanged directories are found only
+ * by --full, which lists every directory (and still reuses hashes).
+ *
+ * With --where (or if the catalog already has one) the sidecar filter of
+ * catalogfs-where (see where_filter.h) is rebuilt after indexing, so lookups
+ * over many catalogs stay correct.
+ *
+ * Exit code is 0 on success, 1 if some entries failed to be indexed (their
+ * directories are listed again by the next run) or on errors.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "index_state.h"
+#include "manifest.h"
+#include "sha256.h"
+#include "storage.h"
+#include "where_filter.h"
+
+#include "log.h"
+
+/** Exit code: the catalog is updated */
+#define INDEX_EXIT_OK (0)
+/** Exit code: some error happened */
+#define INDEX_EXIT_ERROR (1)
+
+/**
+ * State of indexing
+ */
+struct index_run
+{
+	/** File descriptor of the root of the catalog */
+	int catalog_fd;
+
+	/** Device of the root of the catalog (it's skipped if it's inside the source) */
+	dev_t catalog_dev;
+
+	/** Inode of the root of the catalog */
+	ino_t catalog_ino;
+
+	/** Storage of new records */
+	enum catalog_storage storage;
+
+	/** True if hashes of new and changed files should be computed */
+	bool hash;
+
+	/** True if every directory should be listed */
+	bool full;
+
+	/** True if owners of entries can be set */
+	bool is_root;
+
+	/** True if the filter of catalogfs-where should be built (it's rebuilt anyway if it exists) */
+	bool where;
+
+	/** Batched loader of catalog directories */
+	struct batch_loader *loader;
+
+	/** State of the previous indexing */
+	struct index_state previous;
+
+	/** State of this indexing */
+	struct index_state_writer next;
+
+	/** Relative path of the current entry */
+	char path[PATH_MAX];
+
+	/** Length of the path */
+	size_t path_len;
+
+	/** Number of directories with the same state as before (not listed) */
+	uint64_t dirs_skipped;
+
+	/** Number of listed directories */
+	uint64_t dirs_listed;
+
+	/** Number of created entries */
+	uint64_t entries_added;
+
+	/** Number of rewritten entries */
+	uint64_t entries_updated;
+
+	/** Number of entries of listed directories that did not change */
+	uint64_t entries_kept;
+
+	/** Number of removed entries (subtrees count as one) */
+	uint64_t entries_removed;
+
+	/** Number of computed hashes */
+	uint64_t hashes_computed;
+
+	/** Number of hashes of changed records taken from the old records */
+	uint64_t hashes_reused;
+
+	/** Number of entries and directories that failed to be indexed */
+	size_t errors;
+
+	/** Number of keys of the rebuilt filter of catalogfs-where */
+	uint64_t where_keys;
+
+	/** Size of the rebuilt filter of catalogfs-where (in bytes, 0 if it was not rebuilt) */
+	size_t where_size;
+};
+
+/**
+ * Entry of a source directory
+ */
+struct source_entry
+{
+	/** Name of the entry */
+	char *name;
+
+	/** Stat of the entry (not followed) */
+	struct stat stbuf;
+};
+
+/**
+ * Entries of a source directory sorted by name
+ */
+struct source_dir
+{
+	/** Entries */
+	struct source_entry *entries;
+
+	/** Number of entries */
+	size_t count;
+};
+
+/**
+ * Print help
+ *
+ * @param program_name is the name of the program
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <source> <catalog>", program_name);
+	PrintToStdout("Creates or updates the catalog (created if missing) of the source directory.");
+	PrintToStdout("Directories that did not change since the previous run are not listed again.");
+	PrintToStdout("Options:");
+	PrintToStdout("-H   --sha256              compute SHA-256 of new and changed files");
+	PrintToStdout("-F   --full                list every directory (finds files modified in place)");
+	PrintToStdout("-s   --storage=<s>         storage of index files: text, sparse or xattr");
+	PrintToStdout("                           (default: text)");
+	PrintToStdout("-W   --where               build the filter of catalogfs-where (an existing one");
+	PrintToStdout("                           is always rebuilt)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Get seconds of a monotonic clock
+ *
+ * @return the seconds
+ */
+static double monotonic_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * Open a directory without updating its atime when possible
+ * (atimes of directories are part of their metadata, indexing must not change them)
+ *
+ * @param dir_fd is the file descriptor of the parent directory
+ * @param name is the name of the directory
+ * @return file descriptor or -1 on error (errno is set)
+ */
+static int open_dir_noatime(int dir_fd, const char *name)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	// O_NOATIME is allowed only for owners of files
+	if (fd == -1 && errno == EPERM)
+		fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	return fd;
+}
+
+/**
+ * Report an error of the current entry
+ *
+ * @param run is the state
+ * @param error is the error (negative errno)
+ * @param action is the failed action
+ */
+static void report_error(struct index_run *run, int error, const char *action)
+{
+	PrintToStderrF("Failed to %s: %s (path: /%s)", action, strerror(-error), run->path);
+	run->errors++;
+}
+
+/**
+ * Append a name to the current path
+ *
+ * @param run is the state
+ * @param name is the name
+ * @param old_len is the length of the path before the call (for pop_path())
+ * @return 0 on success, -ENAMETOOLONG if the path is too long
+ */
+static int push_path(struct index_run *run, const char *name, size_t *old_len)
+{
+	size_t name_len = strlen(name);
+	size_t len = run->path_len;
+	if (len + 1 + name_len >= sizeof(run->path))
+		return -ENAMETOOLONG;
+
+	*old_len = len;
+	if (len > 0)
+		run->path[len++] = '/';
+	memcpy(run->path + len, name, name_len + 1);
+	run->path_len = len + name_len;
+	return 0;
+}
+
+/**
+ * Restore the current path
+ *
+ * @param run is the state
+ * @param old_len is the length returned by push_path()
+ */
+static void pop_path(struct index_run *run, size_t old_len)
+{
+	run->path_len = old_len;
+	run->path[old_len] = '\0';
+}
+
+/**
+ * Compare entries of source directories by name
+ *
+ * @param a is the first entry
+ * @param b is the second entry
+ * @return result of strcmp() of names
+ */
+static int compare_source_entries(const void *a, const void *b)
+{
+	return strcmp(((const struct source_entry *)a)->name, ((const struct source_entry *)b)->name);
+}
+
+/**
+ * Free entries of a source directory
+ *
+ * @param dir is the directory
+ */
+static void free_source_dir(struct source_dir *dir)
+{
+	for (size_t i = 0; i < dir->count; i++)
+		free(dir->entries[i].name);
+	free(dir->entries);
+	dir->entries = NULL;
+	dir->count = 0;
+}
+
+/**
+ * List a source directory (entries that vanish while listing are skipped)
+ *
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param dir is the sorted listing (must be freed by free_source_dir())
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int list_source_dir(int dir_fd, struct source_dir *dir)
+{
+	memset(dir, 0, sizeof(struct source_dir));
+
+	int fd = dup(dir_fd);
+	DIR *dp = (fd != -1) ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		int res = -errno;
+		if (fd != -1)
+			(void)close(fd);
+		return res;
+	}
+
+	size_t capacity = 0;
+	int res = 0;
+	struct dirent *de;
+	while (res == 0)
+	{
+		errno = 0;
+		de = readdir(dp);
+		if (de == NULL)
+		{
+			res = -errno;
+			break;
+		}
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (dir->count == capacity)
+		{
+			size_t new_capacity = (capacity > 0) ? capacity * 2 : 64;
+			struct source_entry *entries = realloc(dir->entries, new_capacity * sizeof(struct source_entry));
+			if (entries == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			dir->entries = entries;
+			capacity = new_capacity;
+		}
+
+		struct source_entry *entry = &dir->entries[dir->count];
+		if (fstatat(dir_fd, de->d_name, &entry->stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			if (errno == ENOENT)
+				continue;
+			res = -errno;
+			break;
+		}
+
+		entry->name = strdup(de->d_name);
+		if (entry->name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+		dir->count++;
+	}
+
+	(void)closedir(dp);
+	if (res != 0)
+	{
+		free_source_dir(dir);
+		return res;
+	}
+
+	if (dir->count > 1)
+		qsort(dir->entries, dir->count, sizeof(struct source_entry), compare_source_entries);
+	return 0;
+}
+
+/**
+ * Remove an entry of a catalog directory with its whole subtree
+ *
+ * @param dir_fd is the file descriptor of the directory
+ * @param name is the name of the entry
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int remove_catalog_tree(int dir_fd, const char *name)
+{
+	if (unlinkat(dir_fd, name, 0) == 0)
+		return 0;
+	if (errno != EISDIR && errno != EPERM)
+		return -errno;
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	// Directories of read-only sources are read-only in the catalog too
+	(void)fchmod(fd, S_IRWXU);
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL)
+	{
+		int res = -errno;
+		(void)close(fd);
+		return res;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while (res == 0 && (de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			res = remove_catalog_tree(dirfd(dp), de->d_name);
+	}
+	(void)closedir(dp);
+
+	if (res == 0 && unlinkat(dir_fd, name, AT_REMOVEDIR) == -1)
+		res = -errno;
+	return res;
+}
+
+/**
+ * Get the kind of an entry in the catalog (all types except directories and
+ * symlinks are kept as index files)
+ *
+ * @param mode is the mode of the entry
+ * @return S_IFDIR, S_IFLNK or S_IFREG
+ */
+static mode_t catalog_kind(mode_t mode)
+{
+	if (S_ISDIR(mode))
+		return S_IFDIR;
+	if (S_ISLNK(mode))
+		return S_IFLNK;
+	return S_IFREG;
+}
+
+/**
+ * Check if two records are the same (atime and hash are not compared: reading
+ * a file changes only its atime, hashes are handled by fill_record())
+ *
+ * @param a is the first record
+ * @param b is the second record
+ * @return true if the records are the same
+ */
+static bool records_equal(const struct filestat *a, const struct filestat *b)
+{
+	return a->size == b->size && a->blocks == b->blocks && a->mode == b->mode &&
+		   a->uid == b->uid && a->gid == b->gid &&
+		   a->mtime == b->mtime && a->mtimensec == b->mtimensec &&
+		   a->ctime == b->ctime && a->ctimensec == b->ctimensec &&
+		   a->nlink == b->nlink;
+}
+
+/**
+ * Compute the SHA-256 of a source file
+ *
+ * @param dir_fd is the file descriptor of the source directory
+ * @param name is the name of the file
+ * @param my_stat is the record of the file (sha256 is set on success)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int hash_source_file(int dir_fd, const char *name, struct filestat *my_stat)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	if (fd == -1 && errno == EPERM)
+		fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char hex[FILESTAT_SHA256_HEX_LENGTH + 1];
+	uint64_t bytes = 0;
+	int res = sha256_fd_hex(fd, hex, &bytes);
+	(void)close(fd);
+	if (res != 0)
+		return res;
+
+	// A file written while hashing gets no hash, its next indexing computes it
+	if (bytes == (uint64_t)my_stat->size)
+		memcpy(my_stat->sha256, hex, sizeof(hex));
+	return 0;
+}
+
+/**
+ * Make the record of a source file, the hash is taken from the old record
+ * if the size and mtime did not change
+ *
+ * @param run is the state
+ * @param dir_fd is the file descriptor of the source directory
+ * @param entry is the source entry
+ * @param old is the old record (NULL for new entries)
+ * @param my_stat is the new record
+ */
+static void fill_record(struct index_run *run, int dir_fd, const struct source_entry *entry,
+						const struct filestat *old, struct filestat *my_stat)
+{
+	memset(my_stat, 0, sizeof(struct filestat));
+	(void)fill_filestat_from_stat(my_stat, &entry->stbuf);
+	if (!S_ISREG(my_stat->mode))
+		return;
+
+	if (old != NULL && old->sha256[0] != '\0' && S_ISREG(old->mode) && old->size == my_stat->size &&
+		old->mtime == my_stat->mtime && old->mtimensec == my_stat->mtimensec)
+	{
+		memcpy(my_stat->sha256, old->sha256, sizeof(my_stat->sha256));
+		run->hashes_reused++;
+		return;
+	}
+
+	if (!run->hash)
+		return;
+
+	int res = hash_source_file(dir_fd, entry->name, my_stat);
+	if (res != 0)
+		report_error(run, res, "hash file");
+	else if (my_stat->sha256[0] != '\0')
+		run->hashes_computed++;
+}
+
+/**
+ * Write the index file of a record
+ *
+ * @param run is the state
+ * @param dir_fd is the file descriptor of the catalog directory
+ * @param name is the name of the file
+ * @param my_stat is the record
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int write_index_file(struct index_run *run, int dir_fd, const char *name, const struct filestat *my_stat)
+{
+	mode_t mode = (mode_t)my_stat->mode & 07777;
+	int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+	// Index files of read-only files are read-only, they are replaced
+	if (fd == -1 && errno == EACCES && unlinkat(dir_fd, name, 0) == 0)
+		fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+	if (fd == -1)
+		return -errno;
+
+	int res = storage_save_filestat(fd, run->storage, my_stat, run->path);
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+	return res;
+}
+
+/**
+ * Read the target of a source symlink
+ *
+ * @param dir_fd is the file descriptor of the source directory
+ * @param name is the name of the symlink
+ * @param target is the target buffer of PATH_MAX chars
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int read_source_link(int dir_fd, const char *name, char *target)
+{
+	ssize_t len = readlinkat(dir_fd, name, target, PATH_MAX);
+	if (len == -1)
+		return -errno;
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	target[len] = '\0';
+	return 0;
+}
+
+/**
+ * Create (or replace) a symlink of the catalog
+ *
+ * @param run is the state
+ * @param dir_fd is the file descriptor of the catalog directory
+ * @param name is the name of the symlink
+ * @param target is the target
+ * @param stbuf is the stat of the source symlink
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int write_symlink(struct index_run *run, int dir_fd, const char *name, const char *target,
+						 const struct stat *stbuf)
+{
+	int res = symlinkat(target, dir_fd, name);
+	if (res == -1 && errno == EEXIST)
+	{
+		if (unlinkat(dir_fd, name, 0) == -1)
+			return -errno;
+		res = symlinkat(target, dir_fd, name);
+	}
+	if (res == -1)
+		return -errno;
+
+	struct timespec times[2] = {stbuf->st_atim, stbuf->st_mtim};
+	if (utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+
+	// The owner of a symlink is its real owner, it can be set only by root
+	if (run->is_root && fchownat(dir_fd, name, stbuf->st_uid, stbuf->st_gid, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Check if a catalog symlink is the same as its source
+ *
+ * @param run is the state
+ * @param entry is the catalog entry
+ * @param target is the target of the source symlink
+ * @param stbuf is the stat of the source symlink
+ * @return true if the symlink does not need to be replaced
+ */
+static bool symlink_equal(const struct index_run *run, const struct catalog_dir_entry *entry, const char *target,
+						  const struct stat *stbuf)
+{
+	if (entry->link_target == NULL || strcmp(entry->link_target, target) != 0)
+		return false;
+	if (entry->my_stat.mtime != stbuf->st_mtim.tv_sec || entry->my_stat.mtimensec != stbuf->st_mtim.tv_nsec)
+		return false;
+	return !run->is_root || (entry->my_stat.uid == stbuf->st_uid && entry->my_stat.gid == stbuf->st_gid);
+}
+
+/**
+ * Apply metadata of a source directory to its catalog directory
+ * (after its entries are written, creating them changes the mtime)
+ *
+ * @param run is the state
+ * @param dir_fd is the file descriptor of the catalog directory
+ * @param stbuf is the stat of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int apply_dir_metadata(const struct index_run *run, int dir_fd, const struct stat *stbuf)
+{
+	// chown() clears set-user-ID and set-group-ID bits, so the mode is set after it
+	if (run->is_root && fchown(dir_fd, stbuf->st_uid, stbuf->st_gid) == -1)
+		return -errno;
+
+	struct timespec times[2] = {stbuf->st_atim, stbuf->st_mtim};
+	if (fchmod(dir_fd, stbuf->st_mode & 07777) == -1 || futimens(dir_fd, times) == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * Check if a source directory is the catalog itself
+ *
+ * @param run is the state
+ * @param stbuf is the stat of the directory
+ * @return true if the directory is the root of the catalog
+ */
+static bool is_catalog_root(const struct index_run *run, const struct stat *stbuf)
+{
+	return S_ISDIR(stbuf->st_mode) && stbuf->st_dev == run->catalog_dev && stbuf->st_ino == run->catalog_ino;
+}
+
+static int index_dir(struct index_run *run, int source_fd, int catalog_fd, const struct stat *stbuf, bool is_root);
+
+/**
+ * Index subdirectories of a directory
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param subdirs is the array of subdirectories (names and stats of sources)
+ * @param count is the number of subdirectories
+ * @return 0 on success, negative value on errors of the state (errors of entries are counted)
+ */
+static int index_subdirs(struct index_run *run, int source_fd, int catalog_fd, const struct source_entry *subdirs,
+						 size_t count)
+{
+	int res = 0;
+	for (size_t i = 0; res == 0 && i < count; i++)
+	{
+		size_t old_len;
+		if (push_path(run, subdirs[i].name, &old_len) != 0)
+		{
+			PrintToStderrF("Path is too long: /%s/%s", run->path, subdirs[i].name);
+			run->errors++;
+			continue;
+		}
+
+		int child_source_fd = open_dir_noatime(source_fd, subdirs[i].name);
+		if (child_source_fd == -1)
+			report_error(run, -errno, "open directory");
+
+		int child_catalog_fd = -1;
+		if (child_source_fd != -1)
+		{
+			child_catalog_fd = open_dir_noatime(catalog_fd, subdirs[i].name);
+			if (child_catalog_fd == -1)
+				report_error(run, -errno, "open catalog directory");
+		}
+
+		if (child_source_fd != -1 && child_catalog_fd != -1)
+			res = index_dir(run, child_source_fd, child_catalog_fd, &subdirs[i].stbuf, false);
+
+		if (child_catalog_fd != -1)
+			(void)close(child_catalog_fd);
+		if (child_source_fd != -1)
+			(void)close(child_source_fd);
+		pop_path(run, old_len);
+	}
+
+	return res;
+}
+
+/**
+ * Visit subdirectories of a directory that did not change: they are known
+ * from the catalog, so the source directory is not listed
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @return 0 on success, 1 if the directory should be listed (the catalog and the source differ),
+ *         other value on errors of the state (errors of entries are counted)
+ */
+static int visit_unchanged_dir(struct index_run *run, int source_fd, int catalog_fd)
+{
+	int fd = dup(catalog_fd);
+	DIR *dp = (fd != -1) ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		if (fd != -1)
+			(void)close(fd);
+		return 1;
+	}
+
+	struct source_dir subdirs = {NULL, 0};
+	size_t capacity = 0;
+	int res = 0;
+	struct dirent *de;
+	while (res == 0 && (de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+			continue;
+
+		if (subdirs.count == capacity)
+		{
+			size_t new_capacity = (capacity > 0) ? capacity * 2 : 16;
+			struct source_entry *entries = realloc(subdirs.entries, new_capacity * sizeof(struct source_entry));
+			if (entries == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			subdirs.entries = entries;
+			capacity = new_capacity;
+		}
+
+		if (de->d_type == DT_UNKNOWN)
+		{
+			struct stat catalog_stbuf;
+			if (fstatat(catalog_fd, de->d_name, &catalog_stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+			{
+				res = 1;
+				break;
+			}
+			if (!S_ISDIR(catalog_stbuf.st_mode))
+				continue;
+		}
+
+		// Subdirectories of an unchanged directory are the same, otherwise the directory is listed
+		struct source_entry *entry = &subdirs.entries[subdirs.count];
+		if (fstatat(source_fd, de->d_name, &entry->stbuf, AT_SYMLINK_NOFOLLOW) == -1 ||
+			!S_ISDIR(entry->stbuf.st_mode) || is_catalog_root(run, &entry->stbuf))
+		{
+			res = 1;
+			break;
+		}
+
+		entry->name = strdup(de->d_name);
+		if (entry->name == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+		subdirs.count++;
+	}
+	(void)closedir(dp);
+
+	if (res == 0)
+		res = index_subdirs(run, source_fd, catalog_fd, subdirs.entries, subdirs.count);
+
+	free_source_dir(&subdirs);
+	return res;
+}
+
+/**
+ * Add a source entry that is missing in the catalog directory
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param entry is the source entry
+ * @param old is the old record of the entry (NULL if there is none, used for hashes)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int add_entry(struct index_run *run, int source_fd, int catalog_fd, const struct source_entry *entry,
+					 const struct filestat *old)
+{
+	if (S_ISDIR(entry->stbuf.st_mode))
+	{
+		// Metadata is applied when the directory is indexed
+		if (mkdirat(catalog_fd, entry->name, S_IRWXU) == -1 && errno != EEXIST)
+			return -errno;
+		return 0;
+	}
+
+	if (S_ISLNK(entry->stbuf.st_mode))
+	{
+		char target[PATH_MAX];
+		int res = read_source_link(source_fd, entry->name, target);
+		return (res == 0) ? write_symlink(run, catalog_fd, entry->name, target, &entry->stbuf) : res;
+	}
+
+	struct filestat my_stat;
+	fill_record(run, source_fd, entry, old, &my_stat);
+	return write_index_file(run, catalog_fd, entry->name, &my_stat);
+}
+
+/**
+ * Update an entry that exists both in the source and in the catalog directory
+ * with the same kind
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param entry is the source entry
+ * @param catalog_entry is the catalog entry
+ * @param manifest_stat is the new record of an entry of the manifest (set if the result is 1)
+ * @return 0 if the entry is up to date, 1 if the manifest should be updated,
+ *         2 if the entry was rewritten, negative value (mostly -errno) on error
+ */
+static int update_entry(struct index_run *run, int source_fd, int catalog_fd, const struct source_entry *entry,
+						const struct catalog_dir_entry *catalog_entry, struct filestat *manifest_stat)
+{
+	if (S_ISDIR(entry->stbuf.st_mode))
+		return 0;
+
+	if (S_ISLNK(entry->stbuf.st_mode))
+	{
+		char target[PATH_MAX];
+		int res = read_source_link(source_fd, entry->name, target);
+		if (res != 0)
+			return res;
+		if (symlink_equal(run, catalog_entry, target, &entry->stbuf))
+			return 0;
+		res = write_symlink(run, catalog_fd, entry->name, target, &entry->stbuf);
+		return (res == 0) ? 2 : res;
+	}
+
+	struct filestat current;
+	memset(&current, 0, sizeof(struct filestat));
+	(void)fill_filestat_from_stat(&current, &entry->stbuf);
+	if (records_equal(&current, &catalog_entry->my_stat))
+		return 0;
+
+	fill_record(run, source_fd, entry, &catalog_entry->my_stat, manifest_stat);
+	if (catalog_entry->from_manifest)
+		return 1;
+
+	int res = write_index_file(run, catalog_fd, entry->name, manifest_stat);
+	return (res == 0) ? 2 : res;
+}
+
+/**
+ * List a source directory and merge it into its catalog directory
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @param subdirs is the listing of the source, only subdirectories are left in it
+ * @return 0 on success, negative value (mostly -errno) if the directory failed to be listed
+ */
+static int merge_dir(struct index_run *run, int source_fd, int catalog_fd, struct source_dir *subdirs)
+{
+	int res = list_source_dir(source_fd, subdirs);
+	if (res != 0)
+		return res;
+
+	struct catalog_dir dir;
+	res = catalog_dir_load_batch(catalog_fd, true, run->loader, &dir, &run->errors);
+	if (res != 0)
+	{
+		free_source_dir(subdirs);
+		return (res < 0) ? res : -EIO;
+	}
+
+	// Every catalog entry gives at most one change of the manifest
+	struct manifest_change *changes = calloc(dir.count + 1, sizeof(struct manifest_change));
+	struct filestat *stats = calloc(dir.count + 1, sizeof(struct filestat));
+	if (changes == NULL || stats == NULL)
+	{
+		free(changes);
+		free(stats);
+		catalog_dir_free(&dir);
+		return -ENOMEM;
+	}
+
+	size_t changes_count = 0;
+	size_t kept = 0;
+	size_t i = 0;
+	size_t j = 0;
+	while (i < subdirs->count || j < dir.count)
+	{
+		struct source_entry *entry = (i < subdirs->count) ? &subdirs->entries[i] : NULL;
+		const struct catalog_dir_entry *catalog_entry = (j < dir.count) ? &dir.entries[j] : NULL;
+
+		// The catalog inside the source is not indexed
+		if (entry != NULL && is_catalog_root(run, &entry->stbuf))
+		{
+			free(entry->name);
+			entry->name = NULL;
+			i++;
+			continue;
+		}
+
+		int cmp;
+		if (entry == NULL)
+			cmp = 1;
+		else if (catalog_entry == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(entry->name, catalog_entry->name);
+
+		size_t old_len;
+		const char *name = (cmp <= 0) ? entry->name : catalog_entry->name;
+		if (push_path(run, name, &old_len) != 0)
+		{
+			PrintToStderrF("Path is too long: /%s/%s", run->path, name);
+			run->errors++;
+			if (cmp <= 0)
+			{
+				free(entry->name);
+				entry->name = NULL;
+				i++;
+			}
+			if (cmp >= 0)
+				j++;
+			continue;
+		}
+
+		// Entries of another kind are removed and created again
+		if (cmp == 0 && catalog_kind(entry->stbuf.st_mode) != catalog_kind(catalog_entry->my_stat.mode))
+		{
+			res = 0;
+			if (catalog_entry->from_manifest)
+			{
+				changes[changes_count].name = catalog_entry->name;
+				changes[changes_count].my_stat = NULL;
+				changes_count++;
+			}
+			else
+			{
+				res = remove_catalog_tree(catalog_fd, catalog_entry->name);
+			}
+
+			if (res == 0)
+				res = add_entry(run, source_fd, catalog_fd, entry, NULL);
+			if (res == 0)
+				run->entries_updated++;
+			else
+				report_error(run, res, "replace entry");
+		}
+		else if (cmp == 0)
+		{
+			res = update_entry(run, source_fd, catalog_fd, entry, catalog_entry, &stats[changes_count]);
+			if (res == 1)
+			{
+				changes[changes_count].name = catalog_entry->name;
+				changes[changes_count].my_stat = &stats[changes_count];
+				changes_count++;
+			}
+
+			if (res == 0)
+				run->entries_kept++;
+			else if (res > 0)
+				run->entries_updated++;
+			else
+				report_error(run, res, "update entry");
+		}
+		else if (cmp < 0)
+		{
+			res = add_entry(run, source_fd, catalog_fd, entry, NULL);
+			if (res == 0)
+				run->entries_added++;
+			else
+				report_error(run, res, "add entry");
+		}
+		else
+		{
+			res = 0;
+			if (catalog_entry->from_manifest)
+			{
+				changes[changes_count].name = catalog_entry->name;
+				changes[changes_count].my_stat = NULL;
+				changes_count++;
+			}
+			else
+			{
+				res = remove_catalog_tree(catalog_fd, catalog_entry->name);
+			}
+
+			if (res == 0)
+				run->entries_removed++;
+			else
+				report_error(run, res, "remove entry");
+		}
+		pop_path(run, old_len);
+
+		if (cmp <= 0)
+		{
+			// Only subdirectories that are in the catalog now are left for indexing
+			struct source_entry moved = *entry;
+			entry->name = NULL;
+			if (S_ISDIR(moved.stbuf.st_mode) && res >= 0)
+				subdirs->entries[kept++] = moved;
+			else
+				free(moved.name);
+			i++;
+		}
+		if (cmp >= 0)
+			j++;
+	}
+	subdirs->count = kept;
+
+	res = manifest_apply(catalog_fd, changes, changes_count);
+	if (res != 0)
+		report_error(run, res, "update manifest");
+
+	free(changes);
+	free(stats);
+	catalog_dir_free(&dir);
+	return 0;
+}
+
+/**
+ * Index a directory with all subdirectories
+ *
+ * @param run is the state
+ * @param source_fd is the file descriptor of the source directory (not closed)
+ * @param catalog_fd is the file descriptor of the catalog directory (not closed)
+ * @param stbuf is the stat of the source directory (taken before it is listed)
+ * @param is_root determines if it's the root (its metadata is not applied, the state file is written into it)
+ * @return 0 on success, negative value on errors of the state (errors of entries are counted)
+ */
+static int index_dir(struct index_run *run, int source_fd, int catalog_fd, const struct stat *stbuf, bool is_root)
+{
+	struct index_state_dir dir_state;
+	index_state_dir_from_stat(&dir_state, stbuf);
+
+	const struct index_state_dir *previous = index_state_find(&run->previous, run->path, run->path_len);
+	if (!run->full && previous != NULL && index_state_dir_matches(previous, stbuf))
+	{
+		int res = visit_unchanged_dir(run, source_fd, catalog_fd);
+		if (res < 0)
+			return res;
+		if (res == 0)
+		{
+			run->dirs_skipped++;
+			return index_state_writer_add(&run->next, run->path, run->path_len, &dir_state);
+		}
+	}
+
+	run->dirs_listed++;
+	size_t errors = run->errors;
+
+	// Entries are written into the catalog directory before its permissions are applied
+	struct stat catalog_stbuf;
+	if (!is_root && fstat(catalog_fd, &catalog_stbuf) == 0 && (catalog_stbuf.st_mode & S_IRWXU) != S_IRWXU)
+		(void)fchmod(catalog_fd, (catalog_stbuf.st_mode & 07777) | S_IRWXU);
+
+	struct source_dir subdirs;
+	int res = merge_dir(run, source_fd, catalog_fd, &subdirs);
+	if (res != 0)
+	{
+		report_error(run, res, "list directory");
+		return 0;
+	}
+
+	// The directory is listed again next time if some of its entries failed
+	bool complete = (run->errors == errors);
+
+	res = index_subdirs(run, source_fd, catalog_fd, subdirs.entries, subdirs.count);
+	free_source_dir(&subdirs);
+	if (res != 0)
+		return res;
+
+	if (!is_root)
+	{
+		res = apply_dir_metadata(run, catalog_fd, stbuf);
+		if (res != 0)
+		{
+			report_error(run, res, "set metadata of directory");
+			complete = false;
+		}
+	}
+
+	return complete ? index_state_writer_add(&run->next, run->path, run->path_len, &dir_state) : 0;
+}
+
+/**
+ * Open the catalog directory (created if it does not exist)
+ *
+ * @param path is the path of the catalog
+ * @return the file descriptor, -1 on error (errno is set)
+ */
+static int open_catalog(const char *path)
+{
+	int fd = open_dir_noatime(AT_FDCWD, path);
+	if (fd == -1 && errno == ENOENT)
+	{
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			return -1;
+		fd = open_dir_noatime(AT_FDCWD, path);
+	}
+	return fd;
+}
+
+/**
+ * Index the source into the catalog and save the new state
+ *
+ * @param run is the state with the catalog opened
+ * @param source_path is the path of the source directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int index_source(struct index_run *run, const char *source_path)
+{
+	int source_fd = open_dir_noatime(AT_FDCWD, source_path);
+	if (source_fd == -1)
+		return -errno;
+
+	struct stat stbuf;
+	if (fstat(source_fd, &stbuf) == -1)
+	{
+		int res = -errno;
+		(void)close(source_fd);
+		return res;
+	}
+
+	int res = index_state_load(run->catalog_fd, &run->previous);
+	if (res == -EINVAL)
+	{
+		PrintToStderr("State of the previous indexing is broken, every directory is listed");
+		res = 0;
+	}
+
+	if (res == 0)
+		res = batch_loader_new(&run->loader, BATCH_LOADER_DEFAULT_DEPTH);
+	if (res == 0)
+	{
+		res = index_state_writer_open(&run->next, run->catalog_fd);
+		if (res == 0)
+		{
+			res = index_dir(run, source_fd, run->catalog_fd, &stbuf, true);
+			if (res == 0)
+				res = index_state_writer_commit(&run->next);
+			else
+				index_state_writer_abort(&run->next);
+		}
+	}
+
+	// The filter is written after the state, so it's not older than the catalog (see catalogfs-where)
+	struct stat where_stbuf;
+	if (res == 0 && (run->where || fstatat(run->catalog_fd, WHERE_FILTER_FILE_NAME, &where_stbuf,
+										   AT_SYMLINK_NOFOLLOW) == 0))
+	{
+		struct where_filter filter;
+		res = where_filter_rebuild_dir(run->catalog_fd, run->loader, &filter, &run->errors);
+		if (res == 0)
+		{
+			run->where_keys = filter.keys;
+			run->where_size = WHERE_FILTER_PREFIX_SIZE + 3 * (size_t)filter.block_length + filter.dirs_size;
+			where_filter_free(&filter);
+		}
+	}
+
+	batch_loader_free(run->loader);
+	run->loader = NULL;
+	index_state_free(&run->previous);
+	(void)close(source_fd);
+	return res;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct index_run run;
+	memset(&run, 0, sizeof(struct index_run));
+	run.storage = CATALOG_STORAGE_TEXT;
+	run.is_root = (geteuid() == 0);
+
+	static const struct option long_options[] = {
+		{"sha256", no_argument, NULL, 'H'},
+		{"full", no_argument, NULL, 'F'},
+		{"storage", required_argument, NULL, 's'},
+		{"where", no_argument, NULL, 'W'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "HFs:Wh", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'H':
+			run.hash = true;
+			break;
+		case 'F':
+			run.full = true;
+			break;
+		case 's':
+			if (storage_from_name(optarg, &run.storage) != 0)
+			{
+				PrintToStderr("Invalid storage (should be text, sparse or xattr)");
+				return INDEX_EXIT_ERROR;
+			}
+			break;
+		case 'W':
+			run.where = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return INDEX_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return INDEX_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return INDEX_EXIT_ERROR;
+	}
+
+	const char *source_path = argv[optind];
+	const char *catalog_path = argv[optind + 1];
+
+	run.catalog_fd = open_catalog(catalog_path);
+	struct stat catalog_stbuf;
+	if (run.catalog_fd == -1 || fstat(run.catalog_fd, &catalog_stbuf) == -1)
+	{
+		PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), catalog_path);
+		if (run.catalog_fd != -1)
+			(void)close(run.catalog_fd);
+		return INDEX_EXIT_ERROR;
+	}
+	run.catalog_dev = catalog_stbuf.st_dev;
+	run.catalog_ino = catalog_stbuf.st_ino;
+
+	// Both sparse and xattr storages keep records in xattrs
+	if (run.storage != CATALOG_STORAGE_TEXT && !storage_xattr_supported(run.catalog_fd))
+	{
+		PrintToStderrF("Filesystem does not support user xattrs, files are written in %s storage instead",
+					   storage_name(CATALOG_STORAGE_TEXT));
+		run.storage = CATALOG_STORAGE_TEXT;
+	}
+
+	double start = monotonic_seconds();
+	int res = index_source(&run, source_path);
+	(void)close(run.catalog_fd);
+
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to index: %s (source: %s)", strerror(-res), source_path);
+		return INDEX_EXIT_ERROR;
+	}
+
+	PrintToStderrF("Indexed %" PRIu64 " directories in %.3f s: %" PRIu64 " unchanged, %" PRIu64 " listed",
+				   run.dirs_skipped + run.dirs_listed, monotonic_seconds() - start, run.dirs_skipped,
+				   run.dirs_listed);
+	PrintToStderrF("Entries: %" PRIu64 " added, %" PRIu64 " updated, %" PRIu64 " removed, %" PRIu64
+				   " unchanged in listed directories",
+				   run.entries_added, run.entries_updated, run.entries_removed, run.entries_kept);
+	if (run.hash || run.hashes_reused > 0)
+		PrintToStderrF("Hashes: %" PRIu64 " computed, %" PRIu64 " reused", run.hashes_computed, run.hashes_reused);
+	if (run.where_size > 0)
+		PrintToStderrF("Where filter: %" PRIu64 " keys in %zu bytes", run.where_keys, run.where_size);
+
+	if (run.errors > 0)
+	{
+		PrintToStderrF("Failed to index %zu entries", run.errors);
+		return INDEX_EXIT_ERROR;
+	}
+	return INDEX_EXIT_OK;
+}
@@ -0,0 +1,1346 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-migrate - rewrites filestat files of a catalog (index) from
+ * legacy formats (CatalogFS.File.1 and CatalogFS.File.2) to the current one
+ * and converts catalogs between storages of index files (see storage.h).
+ *
+ * Legacy files carry bulky name and path fields and are parsed by the slower
+ * legacy branch of the parser on every access. Files that are already in the
+ * current format, empty files (not released yet) and hard-linked files are
+ * left as they are.
+ *
+ * With --storage every index file is converted to the given storage (text,
+ * sparse or xattr), files of other storages are converted to text only if
+ * they are legacy otherwise. If the filesystem of the catalog does not support
+ * user xattrs, files are converted to text instead.
+ *
+ * Every file is migrated atomically:
+ *
+ *  - the legacy file is parsed the same way the filesystem does it
+ *    (with a skeleton filled from the stat of the index file);
+ *  - the new content is written to a temporary file in the same directory
+ *    with mode, owner and times of the original index file (a sparse file
+ *    gets the original stat instead);
+ *  - the temporary file is read back and parsed again, and the result must be
+ *    equal to the parsed legacy file (verification pass);
+ *  - the temporary file is synced and renamed over the original one.
+ *
+ * So an interrupted run leaves every file either old or new, never broken.
+ * Migration is idempotent and can be resumed by running the tool again:
+ * migrated files are recognized by their header (or storage) and skipped, and temporary
+ * files left by an interrupted run are removed.
+ *
+ * Directories are processed by a pool of threads. The catalog must not be
+ * mounted or written by anything else during migration.
+ *
+ * Throughput and saved (or grown) bytes are reported to stderr periodically and at the end.
+ *
+ * Exit code is 0 on success, 1 if some files failed to be migrated.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "byte_buffer.h"
+#include "filestat.h"
+#include "filestat_converter.h"
+#include "filestat_format_constants.h"
+#include "filestat_parser.h"
+#include "manifest.h"
+#include "storage.h"
+
+#include "log.h"
+
+/** Exit code: all files are in the current format */
+#define MIGRATE_EXIT_OK (0)
+/** Exit code: some error happened */
+#define MIGRATE_EXIT_ERROR (1)
+
+/** Default number of threads */
+#define MIGRATE_DEFAULT_JOBS (4)
+
+/** Default interval of progress reports in seconds */
+#define MIGRATE_DEFAULT_PROGRESS_INTERVAL (10)
+
+/** Prefix and suffix of names of temporary files (the worker number is between them) */
+#define MIGRATE_TMP_PREFIX ".catalogfs-migrate-"
+#define MIGRATE_TMP_SUFFIX ".tmp"
+
+/**
+ * Format of a filestat file
+ */
+enum migrate_format
+{
+	/** Current format, nothing to do */
+	MIGRATE_FORMAT_CURRENT,
+
+	/** Legacy format, should be migrated */
+	MIGRATE_FORMAT_LEGACY
+};
+
+/**
+ * State of the migration (shared by all threads)
+ */
+struct migrate_state
+{
+	/** Only count and verify, do not change anything */
+	bool dry_run;
+
+	/** Sync temporary files and directories before renaming */
+	bool sync;
+
+	/** Convert all files to the target storage (otherwise only legacy files are migrated) */
+	bool convert;
+
+	/** Target storage of converted files */
+	enum catalog_storage storage;
+
+	/** Fallback to text storage was already reported */
+	bool fallback_reported;
+
+	/** Number of threads */
+	unsigned int jobs;
+
+	/** Interval of progress reports in seconds (0 to disable) */
+	unsigned int progress_interval;
+
+	/** File descriptor of the catalog */
+	int catalog_fd;
+
+	/** Time (monotonic) of the start */
+	struct timespec start_time;
+
+	/** Lock for the stack and counters */
+	pthread_mutex_t lock;
+
+	/** Signaled when directories are queued or the work is finished */
+	pthread_cond_t cond;
+
+	/** Stack of relative paths of directories to process */
+	char **stack;
+
+	/** Number of directories in the stack */
+	size_t stack_count;
+
+	/** Allocated size of the stack */
+	size_t stack_capacity;
+
+	/** Number of threads processing a directory right now */
+	unsigned int busy_count;
+
+	/** All directories are processed */
+	bool finished;
+
+	/** Number of processed directories */
+	uint64_t dirs_done;
+
+	/** Number of checked filestat files */
+	uint64_t files_checked;
+
+	/** Number of migrated (or, with dry run, migratable) files */
+	uint64_t files_migrated;
+
+	/** Number of files already in the current format */
+	uint64_t files_current;
+
+	/** Number of skipped files (empty or hard-linked) */
+	uint64_t files_skipped;
+
+	/** Number of read bytes of all checked files */
+	uint64_t bytes_read;
+
+	/** Size of migrated files before migration */
+	uint64_t bytes_before;
+
+	/** Size of migrated files after migration */
+	uint64_t bytes_after;
+
+	/** Number of errors */
+	uint64_t errors;
+};
+
+/**
+ * Per-thread context of a worker
+ */
+struct migrate_worker
+{
+	/** Shared state */
+	struct migrate_state *state;
+
+	/** Number of the worker (used in names of temporary files) */
+	unsigned int index;
+
+	/** Name of temporary files of the worker */
+	char tmp_name[64];
+
+	/** Buffer for content of original files */
+	char *buf;
+
+	/** Buffer for content of written files */
+	char *check_buf;
+
+	/** Scratch file for dry runs (-1 if not a dry run) */
+	int scratch_fd;
+};
+
+/**
+ * Get seconds passed since the start
+ *
+ * @param state is the migrate state
+ * @return elapsed seconds
+ */
+static double migrate_elapsed(const struct migrate_state *state)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - state->start_time.tv_sec) +
+		   (double)(now.tv_nsec - state->start_time.tv_nsec) / 1e9;
+}
+
+/**
+ * Print throughput and counters to stderr
+ *
+ * @param state is the migrate state
+ * @param is_final determines if it's the final report
+ */
+static void migrate_print_progress(struct migrate_state *state, bool is_final)
+{
+	pthread_mutex_lock(&state->lock);
+	uint64_t dirs = state->dirs_done;
+	uint64_t checked = state->files_checked;
+	uint64_t migrated = state->files_migrated;
+	uint64_t current = state->files_current;
+	uint64_t skipped = state->files_skipped;
+	uint64_t bytes_read = state->bytes_read;
+	uint64_t bytes_before = state->bytes_before;
+	uint64_t bytes_after = state->bytes_after;
+	uint64_t errors = state->errors;
+	pthread_mutex_unlock(&state->lock);
+
+	double elapsed = migrate_elapsed(state);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	double mib = (double)bytes_read / (1024.0 * 1024.0);
+	// Text records take more space than xattrs and sparse files, so the change is reported as growth then
+	bool grown = bytes_after > bytes_before;
+	uint64_t delta = (grown) ? bytes_after - bytes_before : bytes_before - bytes_after;
+	char delta_percent[32] = "";
+	if (bytes_before > 0)
+		(void)snprintf(delta_percent, sizeof(delta_percent), ", %.1f%%", 100.0 * (double)delta / (double)bytes_before);
+
+	PrintToStderrF("%s: %" PRIu64 " dirs, %" PRIu64 " files (%.0f/s, %.1f MiB/s), %" PRIu64 " %s, "
+				   "%" PRIu64 " current, %" PRIu64 " skipped, %" PRIu64 " errors, "
+				   "%" PRIu64 " -> %" PRIu64 " bytes (%" PRIu64 " %s%s), %.1f s",
+				   (is_final) ? "Finished" : "Progress",
+				   dirs, checked, (double)checked / elapsed, mib / elapsed,
+				   migrated, (state->dry_run) ? "to migrate" : "migrated",
+				   current, skipped, errors,
+				   bytes_before, bytes_after, delta, (grown) ? "grown" : "saved", delta_percent, elapsed);
+}
+
+/**
+ * Report an error
+ *
+ * @param state is the migrate state
+ * @param message is the error message
+ * @param code is the negative error code
+ * @param dir_path is the relative path of the directory
+ * @param name is the name inside the directory (can be NULL)
+ */
+static void migrate_error(struct migrate_state *state, const char *message, int code,
+						  const char *dir_path, const char *name)
+{
+	pthread_mutex_lock(&state->lock);
+	state->errors++;
+	pthread_mutex_unlock(&state->lock);
+
+	if (name == NULL)
+		PrintToStderrF("%s: %s (path: %s)", message, strerror(-code), dir_path);
+	else
+		PrintToStderrF("%s: %s (path: %s/%s)", message, strerror(-code), dir_path, name);
+}
+
+/**
+ * Make a relative path of an entry of the directory
+ *
+ * @param dir_path is the relative path of the directory ("." for the root)
+ * @param name is the name of the entry
+ * @return new allocated path, NULL on error
+ */
+static char *join_relpath(const char *dir_path, const char *name)
+{
+	if (strcmp(dir_path, ".") == 0)
+		return strdup(name);
+
+	size_t dir_len = strlen(dir_path);
+	size_t name_len = strlen(name);
+	char *path = (char *)malloc(dir_len + 1 + name_len + 1);
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, dir_path, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+/**
+ * Push a directory to the stack (the lock must be held, ownership of the path is taken)
+ *
+ * @param state is the migrate state
+ * @param path is the relative path of the directory
+ * @return 0 on success, -ENOMEM on error (the path is freed)
+ */
+static int migrate_push_locked(struct migrate_state *state, char *path)
+{
+	if (state->stack_count == state->stack_capacity)
+	{
+		size_t new_capacity = (state->stack_capacity == 0) ? 64 : state->stack_capacity * 2;
+		char **new_stack = (char **)realloc(state->stack, new_capacity * sizeof(char *));
+		if (new_stack == NULL)
+		{
+			free(path);
+			return -ENOMEM;
+		}
+		state->stack = new_stack;
+		state->stack_capacity = new_capacity;
+	}
+
+	state->stack[state->stack_count++] = path;
+	pthread_cond_signal(&state->cond);
+	return 0;
+}
+
+/**
+ * Check if the name is a temporary file of this tool
+ *
+ * @param name is the name to check
+ * @return true if it's a temporary file
+ */
+static bool is_tmp_name(const char *name)
+{
+	size_t len = strlen(name);
+	size_t prefix_len = sizeof(MIGRATE_TMP_PREFIX) - 1;
+	size_t suffix_len = sizeof(MIGRATE_TMP_SUFFIX) - 1;
+
+	return len > prefix_len + suffix_len &&
+		   strncmp(name, MIGRATE_TMP_PREFIX, prefix_len) == 0 &&
+		   strcmp(name + len - suffix_len, MIGRATE_TMP_SUFFIX) == 0;
+}
+
+/**
+ * Detect the format of a filestat file by its first meaningful line
+ * (the content must be already checked by the parser)
+ *
+ * @param data is the content of the file
+ * @param size is the size of the content
+ * @return the format
+ */
+static enum migrate_format detect_format(const char *data, size_t size)
+{
+	static const size_t legacy_len = sizeof(FILESTAT_LEGACY_HEADER_V1) - 1;
+
+	const char *end = data + size;
+	const char *line = data;
+	while (line < end)
+	{
+		const char *line_end = memchr(line, FILESTAT_NEWLINE_CHAR_1, (size_t)(end - line));
+		if (line_end == NULL)
+			line_end = end;
+
+		const char *p = line;
+		while (p < line_end && isspace((unsigned char)*p))
+		{
+			p++;
+		}
+
+		if (p < line_end && *p != FILESTAT_COMMENT_CHAR_1 && *p != FILESTAT_COMMENT_CHAR_2)
+		{
+			// Both legacy headers have the same length
+			bool is_legacy = ((size_t)(line_end - p) >= legacy_len &&
+							  (memcmp(p, FILESTAT_LEGACY_HEADER_V1, legacy_len) == 0 ||
+							   memcmp(p, FILESTAT_LEGACY_HEADER_V2, legacy_len) == 0));
+			return (is_legacy) ? MIGRATE_FORMAT_LEGACY : MIGRATE_FORMAT_CURRENT;
+		}
+
+		line = line_end + 1;
+	}
+
+	return MIGRATE_FORMAT_CURRENT;
+}
+
+/**
+ * Compare two filestat structs field by field
+ *
+ * @param a is the first filestat
+ * @param b is the second filestat
+ * @return true if all fields are equal
+ */
+static bool filestat_equal(const struct filestat *a, const struct filestat *b)
+{
+	return a->size == b->size &&
+		   a->blocks == b->blocks &&
+		   a->mode == b->mode &&
+		   a->uid == b->uid &&
+		   a->gid == b->gid &&
+		   a->atime == b->atime &&
+		   a->mtime == b->mtime &&
+		   a->ctime == b->ctime &&
+		   a->atimensec == b->atimensec &&
+		   a->mtimensec == b->mtimensec &&
+		   a->ctimensec == b->ctimensec &&
+		   a->nlink == b->nlink &&
+		   a->blksize == b->blksize &&
+		   strcmp(a->sha256, b->sha256) == 0;
+}
+
+/**
+ * Read the whole file into the buffer
+ *
+ * @param fd is the file descriptor
+ * @param buf is the buffer of FILESTAT_MAXSIZE bytes
+ * @param size is the number of read bytes
+ * @return 0 on success, negative value on error
+ */
+static int read_whole_file(int fd, char *buf, size_t *size)
+{
+	size_t total = 0;
+	while (total < FILESTAT_MAXSIZE)
+	{
+		ssize_t res = pread(fd, buf + total, FILESTAT_MAXSIZE - total, (off_t)total);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			break;
+		total += (size_t)res;
+	}
+
+	*size = total;
+	return 0;
+}
+
+/**
+ * Write the filestat to the file and check that it's read back the same
+ *
+ * @param worker is the worker
+ * @param fd is the target file descriptor
+ * @param my_stat is the filestat to write
+ * @param new_size is the size of the written file
+ * @return 0 on success, negative value on error (-EIO if the check failed)
+ */
+static int write_and_check(struct migrate_worker *worker, int fd, const struct filestat *my_stat, size_t *new_size)
+{
+	int res = write_filestat(fd, my_stat, NULL, NULL);
+	if (res != 0)
+		return res;
+
+	res = read_whole_file(fd, worker->check_buf, new_size);
+	if (res != 0)
+		return res;
+
+	struct stat new_stbuf;
+	if (fstat(fd, &new_stbuf) == -1)
+		return -errno;
+
+	// Skeleton of the new file has another ctime, all fields must be overwritten by the content
+	struct filestat check_stat;
+	if (fill_filestat_from_stat(&check_stat, &new_stbuf) != 0)
+		return -EPERM;
+
+	res = read_filestat_from_buffer(worker->check_buf, *new_size, &check_stat);
+	if (res != 0)
+		return -EIO;
+
+	if (!filestat_equal(my_stat, &check_stat) ||
+		detect_format(worker->check_buf, *new_size) != MIGRATE_FORMAT_CURRENT)
+	{
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Check that the written temporary file of the sparse or xattr storage is read back the same
+ *
+ * @param worker is the worker
+ * @param dir_fd is the directory file descriptor
+ * @param fd is the descriptor of the temporary file
+ * @param storage is the storage of the file
+ * @param my_stat is the written filestat
+ * @return 0 on success, negative value on error (-EIO if the check failed)
+ */
+static int check_record_file(struct migrate_worker *worker, int dir_fd, int fd,
+							 enum catalog_storage storage, const struct filestat *my_stat)
+{
+	struct stat new_stbuf;
+	if (fstat(fd, &new_stbuf) == -1)
+		return -errno;
+
+	// Skeleton of the new file has another ctime, all fields must be overwritten by the record
+	struct filestat check_stat;
+	if (fill_filestat_from_stat(&check_stat, &new_stbuf) != 0)
+		return -EPERM;
+
+	int res = (storage == CATALOG_STORAGE_SPARSE)
+				  ? storage_read_sparse(dir_fd, worker->tmp_name, &new_stbuf, &check_stat)
+				  : storage_read_xattr(dir_fd, worker->tmp_name, &check_stat);
+	if (res != 0 || !filestat_equal(my_stat, &check_stat))
+		return -EIO;
+
+	// Sparse files must show the original stat without reading the record
+	if (storage == CATALOG_STORAGE_SPARSE &&
+		(new_stbuf.st_size != my_stat->size ||
+		 (new_stbuf.st_mode & 07777) != (my_stat->mode & 07777) ||
+		 new_stbuf.st_mtim.tv_sec != my_stat->mtime ||
+		 new_stbuf.st_mtim.tv_nsec != my_stat->mtimensec))
+	{
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Check that the filestat is formatted and parsed back the same (dry runs of storages
+ * that keep the record in an xattr, which can't be written to the scratch file)
+ *
+ * @param my_stat is the filestat
+ * @return 0 on success, negative value on error (-EIO if the check failed)
+ */
+static int check_record(const struct filestat *my_stat)
+{
+	struct byte_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+
+	int res = format_filestat(my_stat, &buf);
+	if (res != 0)
+	{
+		byte_buffer_free(&buf);
+		return -ENOMEM;
+	}
+
+	struct filestat check_stat;
+	memset(&check_stat, 0, sizeof(check_stat));
+	res = read_filestat_from_buffer((const char *)buf.data, buf.len, &check_stat);
+	byte_buffer_free(&buf);
+
+	return (res != 0 || !filestat_equal(my_stat, &check_stat)) ? -EIO : 0;
+}
+
+/**
+ * Report once that files are converted to text storage instead of the target one
+ *
+ * @param state is the migrate state
+ */
+static void report_text_fallback(struct migrate_state *state)
+{
+	pthread_mutex_lock(&state->lock);
+	bool reported = state->fallback_reported;
+	state->fallback_reported = true;
+	pthread_mutex_unlock(&state->lock);
+
+	if (!reported)
+		PrintToStderrF("Filesystem does not support user xattrs, files are converted to %s storage instead",
+					   storage_name(CATALOG_STORAGE_TEXT));
+}
+
+/**
+ * Write the migrated filestat to a temporary file and rename it over the original
+ *
+ * @param worker is the worker
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the original file
+ * @param stbuf is the stat of the original file
+ * @param my_stat is the parsed filestat
+ * @param storage is the target storage
+ * @param new_size is the size of the content of the migrated file
+ * @return 0 on success, negative value on error
+ */
+static int replace_file(struct migrate_worker *worker, int dir_fd, const char *name,
+						const struct stat *stbuf, const struct filestat *my_stat,
+						enum catalog_storage storage, size_t *new_size)
+{
+	int fd = openat(dir_fd, worker->tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -errno;
+
+	int res;
+	*new_size = 0;
+
+	switch (storage)
+	{
+	case CATALOG_STORAGE_SPARSE:
+		res = storage_save_sparse(fd, my_stat);
+		break;
+	case CATALOG_STORAGE_XATTR:
+		res = storage_save_xattr(fd, my_stat);
+		if (res == -ENOTSUP)
+		{
+			// A directory can be a mount point of another filesystem
+			report_text_fallback(worker->state);
+			storage = CATALOG_STORAGE_TEXT;
+			res = write_and_check(worker, fd, my_stat, new_size);
+		}
+		break;
+	case CATALOG_STORAGE_TEXT:
+	default:
+		res = write_and_check(worker, fd, my_stat, new_size);
+		break;
+	}
+
+	// Index files keep their own mode, owner and times (they are shown with --ignore_saved_* options),
+	// sparse files are the original stat themselves
+	if (res == 0 && storage != CATALOG_STORAGE_SPARSE && fchmod(fd, stbuf->st_mode & 07777) == -1)
+		res = -errno;
+
+	if (res == 0 && storage != CATALOG_STORAGE_SPARSE)
+	{
+		// Only root can give files away, keeping the owner is best-effort
+		(void)fchown(fd, stbuf->st_uid, stbuf->st_gid);
+
+		struct timespec times[2] = {stbuf->st_atim, stbuf->st_mtim};
+		if (futimens(fd, times) == -1)
+			res = -errno;
+	}
+
+	if (res == 0 && storage != CATALOG_STORAGE_TEXT)
+		res = check_record_file(worker, dir_fd, fd, storage, my_stat);
+
+	if (res == 0 && worker->state->sync && fdatasync(fd) == -1)
+		res = -errno;
+
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+
+	if (res == 0 && renameat(dir_fd, worker->tmp_name, dir_fd, name) == -1)
+		res = -errno;
+
+	if (res != 0)
+		(void)unlinkat(dir_fd, worker->tmp_name, 0);
+
+	return res;
+}
+
+/**
+ * Read the filestat of an index file of any storage
+ *
+ * @param worker is the worker
+ * @param dir_fd is the directory file descriptor
+ * @param name is the name of the file
+ * @param stbuf is the stat of the file
+ * @param my_stat is the parsed filestat
+ * @param storage is the storage of the file
+ * @param size is the size of the content of the file (0 for storages without content)
+ * @param is_legacy is set if the content is in a legacy format
+ * @return 0 on success, 1 if the file is not released yet, negative value on error
+ *         (-EFBIG if the file is too big, -EINVAL if it can't be parsed)
+ */
+static int read_index_file(struct migrate_worker *worker, int dir_fd, const char *name, const struct stat *stbuf,
+						   struct filestat *my_stat, enum catalog_storage *storage, size_t *size, bool *is_legacy)
+{
+	*size = 0;
+	*is_legacy = false;
+
+	// Same way as getattr() does: a skeleton from the index file, then fields of the record
+	if (fill_filestat_from_stat(my_stat, stbuf) != 0)
+		return -EINVAL;
+
+	int res;
+	if (stbuf->st_size == 0)
+	{
+		*storage = CATALOG_STORAGE_XATTR;
+		res = storage_read_xattr(dir_fd, name, my_stat);
+		return (res == -ENODATA) ? 1 : res;
+	}
+
+	*storage = CATALOG_STORAGE_SPARSE;
+	bool is_sparse = storage_is_sparse(stbuf);
+	if (is_sparse)
+	{
+		res = storage_read_sparse(dir_fd, name, stbuf, my_stat);
+		if (res != -ENODATA)
+			return res;
+	}
+
+	if (stbuf->st_size <= FILESTAT_MAXSIZE)
+	{
+		int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1)
+			return -errno;
+
+		res = read_whole_file(fd, worker->buf, size);
+		(void)close(fd);
+		if (res != 0)
+			return res;
+
+		struct filestat text_stat;
+		if (fill_filestat_from_stat(&text_stat, stbuf) == 0 &&
+			*size != 0 &&
+			read_filestat_from_buffer(worker->buf, *size, &text_stat) == 0)
+		{
+			*storage = CATALOG_STORAGE_TEXT;
+			*is_legacy = (detect_format(worker->buf, *size) == MIGRATE_FORMAT_LEGACY);
+			*my_stat = text_stat;
+			return 0;
+		}
+
+		*size = 0;
+	}
+
+	// A sparse file without a record (xattrs are not supported), stat is all it has
+	if (is_sparse)
+		return 0;
+
+	// Small sparse files can have a block allocated for the xattr and do not look sparse
+	if (storage_read_sparse(dir_fd, name, stbuf, my_stat) == 0)
+		return 0;
+
+	return (stbuf->st_size > FILESTAT_MAXSIZE) ? -EFBIG : -EINVAL;
+}
+
+/**
+ * Migrate one filestat file
+ *
+ * @param worker is the worker
+ * @param dir_fd is the directory file descriptor
+ * @param dir_path is the relative path of the directory (for messages)
+ * @param name is the name of the file
+ * @param stbuf is the stat of the file
+ * @return true if the file was replaced
+ */
+static bool migrate_file(struct migrate_worker *worker, int dir_fd, const char *dir_path,
+						 const char *name, const struct stat *stbuf)
+{
+	struct migrate_state *state = worker->state;
+
+	// Hard links would be split by rename()
+	if (stbuf->st_nlink > 1)
+	{
+		pthread_mutex_lock(&state->lock);
+		state->files_skipped++;
+		pthread_mutex_unlock(&state->lock);
+		return false;
+	}
+
+	struct filestat my_stat;
+	enum catalog_storage storage;
+	size_t size = 0;
+	bool is_legacy = false;
+	int res = read_index_file(worker, dir_fd, name, stbuf, &my_stat, &storage, &size, &is_legacy);
+	if (res == 1)
+	{
+		// Empty files without a record are not released yet
+		pthread_mutex_lock(&state->lock);
+		state->files_skipped++;
+		pthread_mutex_unlock(&state->lock);
+		return false;
+	}
+
+	if (res != 0)
+	{
+		if (res == -EFBIG)
+			migrate_error(state, "File is too big for a filestat file", res, dir_path, name);
+		else if (res == -EINVAL)
+			migrate_error(state, "Failed to parse filestat file", res, dir_path, name);
+		else
+			migrate_error(state, "Failed to read file", res, dir_path, name);
+		return false;
+	}
+
+	// Legacy text files are migrated to the current text format unless another storage is requested
+	enum catalog_storage target = (state->convert) ? state->storage : storage;
+	if (target == storage && !is_legacy)
+	{
+		pthread_mutex_lock(&state->lock);
+		state->files_checked++;
+		state->files_current++;
+		state->bytes_read += size;
+		pthread_mutex_unlock(&state->lock);
+		return false;
+	}
+
+	size_t new_size = 0;
+	if (state->dry_run && target == CATALOG_STORAGE_TEXT)
+		res = write_and_check(worker, worker->scratch_fd, &my_stat, &new_size);
+	else if (state->dry_run)
+		res = check_record(&my_stat);
+	else
+		res = replace_file(worker, dir_fd, name, stbuf, &my_stat, target, &new_size);
+
+	if (res != 0)
+	{
+		migrate_error(state, (res == -EIO) ? "Verification of migrated file failed" : "Failed to migrate file",
+					  res, dir_path, name);
+		return false;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	state->files_checked++;
+	state->files_migrated++;
+	state->bytes_read += size;
+	state->bytes_before += size;
+	state->bytes_after += new_size;
+	pthread_mutex_unlock(&state->lock);
+
+	return !state->dry_run;
+}
+
+/**
+ * Open a directory of a catalog directory without updating its atime when possible
+ * (times of directories are the ones of the source directories)
+ *
+ * @param dir_fd is the file descriptor of the parent directory
+ * @param name is the relative path of the directory
+ * @return file descriptor or -1 on error (errno is set)
+ */
+static int open_catalog_dir(int dir_fd, const char *name)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	// O_NOATIME is allowed only for owners of files
+	if (fd == -1 && errno == EPERM)
+		fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	return fd;
+}
+
+/**
+ * Read names of all entries of the directory (without "." and "..")
+ *
+ * @param dir_fd is the directory file descriptor (not closed)
+ * @param names is the new allocated array of new allocated names
+ * @param count is the number of names
+ * @return 0 on success, negative value on error
+ */
+static int read_dir_names(int dir_fd, char ***names, size_t *count)
+{
+	*names = NULL;
+	*count = 0;
+
+	int fd = open_catalog_dir(dir_fd, ".");
+	if (fd == -1)
+		return -errno;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	size_t capacity = 0;
+	int res = 0;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (*count == capacity)
+		{
+			size_t new_capacity = (capacity == 0) ? 64 : capacity * 2;
+			char **new_names = (char **)realloc(*names, new_capacity * sizeof(char *));
+			if (new_names == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			*names = new_names;
+			capacity = new_capacity;
+		}
+
+		(*names)[*count] = strdup(de->d_name);
+		if ((*names)[*count] == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+		(*count)++;
+	}
+
+	/// NOTE: No close(fd) because closedir(dp) will do it
+	(void)closedir(dp);
+
+	return res;
+}
+
+/**
+ * Check if two times are the same
+ *
+ * @param a is the first time
+ * @param b is the second time
+ * @return true if they are equal
+ */
+static bool same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * Process one directory: migrate its files and queue its subdirectories
+ *
+ * @param worker is the worker
+ * @param dir_path is the relative path of the directory
+ */
+static void migrate_process_dir(struct migrate_worker *worker, const char *dir_path)
+{
+	struct migrate_state *state = worker->state;
+
+	int fd = open_catalog_dir(state->catalog_fd, dir_path);
+	if (fd == -1)
+	{
+		migrate_error(state, "Failed to open directory", -errno, dir_path, NULL);
+		return;
+	}
+
+	// Times of a catalog directory are the ones of the source directory, renames below change them
+	struct stat dir_stbuf;
+	if (fstat(fd, &dir_stbuf) == -1)
+	{
+		migrate_error(state, "Failed to stat directory", -errno, dir_path, NULL);
+		(void)close(fd);
+		return;
+	}
+
+	// Names are read in advance, so entries replaced by rename() are not listed twice
+	char **names;
+	size_t count;
+	int res = read_dir_names(fd, &names, &count);
+	if (res != 0)
+		migrate_error(state, "Failed to read directory", res, dir_path, NULL);
+
+	bool replaced = false;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *name = names[i];
+
+		if (is_tmp_name(name))
+		{
+			// Left by an interrupted run, the original file is still in place
+			if (!state->dry_run && unlinkat(fd, name, 0) == -1 && errno != ENOENT)
+				migrate_error(state, "Failed to remove temporary file", -errno, dir_path, name);
+			continue;
+		}
+
+		// Manifests are already written in the current format
+		if (manifest_is_reserved_name(name))
+			continue;
+
+		struct stat stbuf;
+		if (fstatat(fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			migrate_error(state, "Failed to stat entry", -errno, dir_path, name);
+			continue;
+		}
+
+		if (S_ISDIR(stbuf.st_mode))
+		{
+			char *path = join_relpath(dir_path, name);
+
+			pthread_mutex_lock(&state->lock);
+			res = (path == NULL) ? -ENOMEM : migrate_push_locked(state, path);
+			pthread_mutex_unlock(&state->lock);
+
+			if (res != 0)
+				migrate_error(state, "Failed to queue directory", res, dir_path, name);
+		}
+		else if (S_ISREG(stbuf.st_mode))
+		{
+			if (migrate_file(worker, fd, dir_path, name, &stbuf))
+				replaced = true;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		free(names[i]);
+	}
+	free(names);
+
+	// Temporary files change the directory even if the migration failed, untouched directories keep their ctime
+	struct stat new_stbuf;
+	if (!state->dry_run && fstat(fd, &new_stbuf) == 0 && !same_time(&new_stbuf.st_mtim, &dir_stbuf.st_mtim))
+	{
+		struct timespec times[2] = {dir_stbuf.st_atim, dir_stbuf.st_mtim};
+		if (futimens(fd, times) == -1)
+			migrate_error(state, "Failed to restore times of directory", -errno, dir_path, NULL);
+	}
+
+	// Renames are durable only after the directory itself is synced
+	if (replaced && state->sync && fsync(fd) == -1)
+		migrate_error(state, "Failed to sync directory", -errno, dir_path, NULL);
+
+	(void)close(fd);
+}
+
+/**
+ * Worker thread function
+ *
+ * @param arg is the worker
+ * @return NULL
+ */
+static void *migrate_worker_thread(void *arg)
+{
+	struct migrate_worker *worker = (struct migrate_worker *)arg;
+	struct migrate_state *state = worker->state;
+
+	pthread_mutex_lock(&state->lock);
+
+	while (true)
+	{
+		while (state->stack_count == 0 && state->busy_count > 0)
+		{
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+
+		if (state->stack_count == 0)
+		{
+			// Nothing is queued and nobody can queue more
+			state->finished = true;
+			pthread_cond_broadcast(&state->cond);
+			break;
+		}
+
+		char *path = state->stack[--state->stack_count];
+		state->busy_count++;
+		pthread_mutex_unlock(&state->lock);
+
+		migrate_process_dir(worker, path);
+		free(path);
+
+		pthread_mutex_lock(&state->lock);
+		state->busy_count--;
+		state->dirs_done++;
+		pthread_cond_broadcast(&state->cond);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Progress reporting thread function
+ *
+ * @param arg is the migrate state
+ * @return NULL
+ */
+static void *migrate_progress_thread(void *arg)
+{
+	struct migrate_state *state = (struct migrate_state *)arg;
+
+	pthread_mutex_lock(&state->lock);
+	while (!state->finished)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += state->progress_interval;
+
+		int res = pthread_cond_timedwait(&state->cond, &state->lock, &deadline);
+		if (res == ETIMEDOUT)
+		{
+			pthread_mutex_unlock(&state->lock);
+			migrate_print_progress(state, false);
+			pthread_mutex_lock(&state->lock);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Initialize a worker
+ *
+ * @param worker is the worker
+ * @param state is the migrate state
+ * @param index is the number of the worker
+ * @return 0 on success, negative value on error
+ */
+static int migrate_worker_init(struct migrate_worker *worker, struct migrate_state *state, unsigned int index)
+{
+	memset(worker, 0, sizeof(struct migrate_worker));
+	worker->state = state;
+	worker->index = index;
+	worker->scratch_fd = -1;
+	snprintf(worker->tmp_name, sizeof(worker->tmp_name), "%s%u%s", MIGRATE_TMP_PREFIX, index, MIGRATE_TMP_SUFFIX);
+
+	worker->buf = (char *)malloc(FILESTAT_MAXSIZE);
+	worker->check_buf = (char *)malloc(FILESTAT_MAXSIZE);
+	if (worker->buf == NULL || worker->check_buf == NULL)
+		return -ENOMEM;
+
+	if (state->dry_run)
+	{
+		// Migrated content is written to memory, so its size can be reported
+		worker->scratch_fd = memfd_create("catalogfs-migrate", MFD_CLOEXEC);
+		if (worker->scratch_fd == -1)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Free memory of a worker
+ *
+ * @param worker is the worker
+ */
+static void migrate_worker_free(struct migrate_worker *worker)
+{
+	free(worker->buf);
+	free(worker->check_buf);
+	if (worker->scratch_fd != -1)
+		(void)close(worker->scratch_fd);
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <catalog>", program_name);
+	PrintToStdout("Rewrites legacy filestat files (CatalogFS.File.1/2) to the current format");
+	PrintToStdout("and converts index files between storages.");
+	PrintToStdout("The catalog must not be mounted during migration.");
+	PrintToStdout("Options:");
+	PrintToStdout("-n   --dry-run             only count and verify legacy files, change nothing");
+	PrintToStdout("-j   --jobs=<n>            number of threads");
+	PrintToStdout("                           (default: 4)");
+	PrintToStdout("     --no-sync             do not sync files before renaming (faster, not crash-safe)");
+	PrintToStdout("-s   --storage=<s>         convert all index files to the storage: text, sparse or xattr");
+	PrintToStdout("                           (default: keep storages, migrate legacy text files)");
+	PrintToStdout("-p   --progress=<sec>      interval of throughput reports to stderr, 0 to disable");
+	PrintToStdout("                           (default: 10)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Parse a positive number from a command line argument
+ *
+ * @param arg is the argument
+ * @param allow_zero determines if zero is allowed
+ * @param value is the target value
+ * @return true on success, false on error
+ */
+static bool parse_unsigned_arg(const char *arg, bool allow_zero, unsigned int *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || parsed > UINT_MAX || (!allow_zero && parsed == 0))
+		return false;
+
+	*value = (unsigned int)parsed;
+	return true;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 on success, 1 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct migrate_state state;
+	memset(&state, 0, sizeof(struct migrate_state));
+	state.sync = true;
+	state.jobs = MIGRATE_DEFAULT_JOBS;
+	state.progress_interval = MIGRATE_DEFAULT_PROGRESS_INTERVAL;
+
+	enum
+	{
+		OPT_NO_SYNC = 256,
+	};
+
+	static const struct option long_options[] = {
+		{"dry-run", no_argument, NULL, 'n'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"no-sync", no_argument, NULL, OPT_NO_SYNC},
+		{"storage", required_argument, NULL, 's'},
+		{"progress", required_argument, NULL, 'p'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "nj:s:p:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			state.dry_run = true;
+			break;
+		case 'j':
+			if (!parse_unsigned_arg(optarg, false, &state.jobs))
+			{
+				PrintToStderr("Invalid number of jobs");
+				return MIGRATE_EXIT_ERROR;
+			}
+			break;
+		case OPT_NO_SYNC:
+			state.sync = false;
+			break;
+		case 's':
+			if (storage_from_name(optarg, &state.storage) != 0)
+			{
+				PrintToStderr("Invalid storage (should be text, sparse or xattr)");
+				return MIGRATE_EXIT_ERROR;
+			}
+			state.convert = true;
+			break;
+		case 'p':
+			if (!parse_unsigned_arg(optarg, true, &state.progress_interval))
+			{
+				PrintToStderr("Invalid progress interval");
+				return MIGRATE_EXIT_ERROR;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return MIGRATE_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return MIGRATE_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 1)
+	{
+		print_help(argv[0]);
+		return MIGRATE_EXIT_ERROR;
+	}
+
+	state.catalog_fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (state.catalog_fd == -1)
+	{
+		PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), argv[optind]);
+		return MIGRATE_EXIT_ERROR;
+	}
+
+	// Both sparse and xattr storages keep records in xattrs
+	if (state.convert && state.storage != CATALOG_STORAGE_TEXT && !storage_xattr_supported(state.catalog_fd))
+	{
+		PrintToStderrF("Filesystem does not support user xattrs, files are converted to %s storage instead",
+					   storage_name(CATALOG_STORAGE_TEXT));
+		state.fallback_reported = true;
+		state.storage = CATALOG_STORAGE_TEXT;
+	}
+
+	struct migrate_worker *workers = (struct migrate_worker *)calloc(state.jobs, sizeof(struct migrate_worker));
+	pthread_t *threads = (pthread_t *)calloc(state.jobs, sizeof(pthread_t));
+	char *root = strdup(".");
+	if (workers == NULL || threads == NULL || root == NULL)
+	{
+		PrintToStderr("Failed to allocate workers");
+		free(workers);
+		free(threads);
+		free(root);
+		(void)close(state.catalog_fd);
+		return MIGRATE_EXIT_ERROR;
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &state.start_time);
+
+	int res = 0;
+	unsigned int workers_count = 0;
+	while (workers_count < state.jobs && res == 0)
+	{
+		res = migrate_worker_init(&workers[workers_count], &state, workers_count);
+		workers_count++;
+	}
+
+	if (res == 0)
+	{
+		pthread_mutex_lock(&state.lock);
+		res = migrate_push_locked(&state, root);
+		pthread_mutex_unlock(&state.lock);
+	}
+	else
+	{
+		free(root);
+	}
+
+	unsigned int threads_count = 0;
+	for (unsigned int i = 0; res == 0 && i < state.jobs; i++)
+	{
+		if (pthread_create(&threads[threads_count], NULL, migrate_worker_thread, &workers[i]) != 0)
+		{
+			PrintToStderr("Failed to create worker thread");
+			break;
+		}
+		threads_count++;
+	}
+
+	pthread_t progress_thread;
+	bool has_progress_thread = false;
+	if (threads_count > 0 && state.progress_interval > 0)
+	{
+		has_progress_thread = (pthread_create(&progress_thread, NULL, migrate_progress_thread, &state) == 0);
+	}
+
+	for (unsigned int i = 0; i < threads_count; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	if (has_progress_thread)
+	{
+		pthread_join(progress_thread, NULL);
+	}
+
+	if (threads_count == 0)
+	{
+		PrintToStderrF("Failed to start migration: %s", strerror((res < 0) ? -res : EAGAIN));
+		state.errors++;
+	}
+	else
+	{
+		migrate_print_progress(&state, true);
+	}
+
+	for (unsigned int i = 0; i < workers_count; i++)
+	{
+		migrate_worker_free(&workers[i]);
+	}
+	for (size_t i = 0; i < state.stack_count; i++)
+	{
+		free(state.stack[i]);
+	}
+	free(state.stack);
+	free(workers);
+	free(threads);
+	(void)close(state.catalog_fd);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return (state.errors > 0) ? MIGRATE_EXIT_ERROR : MIGRATE_EXIT_OK;
+}
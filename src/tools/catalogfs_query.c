@@ -0,0 +1,234 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-query - finds entries of a catalog (index) by ranges of metadata:
+ *
+ *   catalogfs-query /catalog 'size>1G' 'mtime<2015'
+ *   catalogfs-query --count /catalog.db ext=flac uid=1000
+ *
+ * The catalog is loaded into a columnar index (see query_index.h) once, then
+ * the query is answered by scans of columns or by the sorted indexes of sizes
+ * and mtimes. Matching relative paths are printed sorted, one per line.
+ *
+ * Both catalog directories and single-file catalogs (see catalog_db.h) are
+ * supported, a regular file is opened as a single-file catalog.
+ *
+ * Exit code is 0 if something matched, 1 if nothing matched, 2 on errors.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch_loader.h"
+#include "catalog_db.h"
+#include "query_index.h"
+
+#include "log.h"
+
+/** Exit code: some entries matched */
+#define QUERY_EXIT_MATCH (0)
+/** Exit code: no entries matched */
+#define QUERY_EXIT_NO_MATCH (1)
+/** Exit code: some error happened */
+#define QUERY_EXIT_ERROR (2)
+
+/** Page cache of single-file catalogs (in bytes) */
+#define QUERY_DB_CACHE_SIZE (64 * 1024 * 1024)
+
+/**
+ * Print help
+ *
+ * @param program_name is the name of the program
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <catalog> <predicate>...", program_name);
+	PrintToStdout("Prints paths of entries of a catalog matching all predicates.");
+	PrintToStdout("Predicates are <field><op><value>, e.g. size>1G mtime<2015 ext=flac:");
+	PrintToStdout("  fields: size, mtime, uid, gid, ext, type (file, dir or symlink)");
+	PrintToStdout("  operators: <, <=, >, >=, =, !=");
+	PrintToStdout("  sizes: bytes or K, M, G, T, P suffixes");
+	PrintToStdout("  times: @<seconds> or dates in UTC (YYYY, YYYY-MM, YYYY-MM-DD)");
+	PrintToStdout("Options:");
+	PrintToStdout("-0   --null                end paths with null characters instead of newlines");
+	PrintToStdout("-c   --count               print only the number of matching entries");
+	PrintToStdout("-v   --verbose             report times of indexing and querying to stderr");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Get milliseconds of a monotonic clock
+ *
+ * @return the milliseconds
+ */
+static double monotonic_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+/**
+ * Build an index of a catalog directory or of a single-file catalog
+ *
+ * @param index is the new index
+ * @param catalog_path is the path of the catalog
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int build_index(struct query_index **index, const char *catalog_path)
+{
+	struct stat stbuf;
+	if (stat(catalog_path, &stbuf) != 0)
+		return -errno;
+
+	if (S_ISREG(stbuf.st_mode))
+	{
+		struct catalog_db *db;
+		int res = catalog_db_open(&db, catalog_path, QUERY_DB_CACHE_SIZE, false);
+		if (res != 0)
+			return res;
+		res = query_index_build_db(index, db);
+		int close_res = catalog_db_close(db);
+		if (res == 0 && close_res != 0)
+		{
+			query_index_free(*index);
+			res = close_res;
+		}
+		return res;
+	}
+
+	int catalog_fd = open(catalog_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (catalog_fd == -1)
+		return -errno;
+
+	struct batch_loader *loader = NULL;
+	int res = batch_loader_new(&loader, BATCH_LOADER_DEFAULT_DEPTH);
+	if (res == 0)
+		res = query_index_build_dir(index, catalog_fd, loader);
+
+	batch_loader_free(loader);
+	(void)close(catalog_fd);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	bool null_terminated = false;
+	bool count_only = false;
+	bool verbose = false;
+
+	static const struct option long_options[] = {
+		{"null", no_argument, NULL, '0'},
+		{"count", no_argument, NULL, 'c'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "0cvh", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case '0':
+			null_terminated = true;
+			break;
+		case 'c':
+			count_only = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return QUERY_EXIT_MATCH;
+		default:
+			print_help(argv[0]);
+			return QUERY_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		print_help(argv[0]);
+		return QUERY_EXIT_ERROR;
+	}
+
+	struct query query;
+	memset(&query, 0, sizeof(struct query));
+	for (int i = optind + 1; i < argc; i++)
+	{
+		int res = query_add_predicate(&query, argv[i]);
+		if (res != 0)
+		{
+			PrintToStderrF("Invalid predicate: %s (%s)", argv[i],
+						   (res == -E2BIG) ? "too many predicates" : "unknown field, operator or value");
+			return QUERY_EXIT_ERROR;
+		}
+	}
+
+	struct query_index *index = NULL;
+	int res = build_index(&index, argv[optind]);
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to index catalog: %s (path: %s)", strerror(-res), argv[optind]);
+		return QUERY_EXIT_ERROR;
+	}
+
+	struct query_index_stats stats;
+	query_index_get_stats(index, &stats);
+	if (stats.errors > 0)
+		PrintToStderrF("Failed to read %zu entries of catalog", stats.errors);
+
+	double start = monotonic_ms();
+	uint32_t *rows = NULL;
+	size_t count = 0;
+	res = query_index_run(index, &query, &rows, &count);
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to run query: %s", strerror(-res));
+		query_index_free(index);
+		return QUERY_EXIT_ERROR;
+	}
+	double query_ms = monotonic_ms() - start;
+
+	if (count_only)
+	{
+		printf("%zu\n", count);
+	}
+	else
+	{
+		char terminator = (null_terminated) ? '\0' : '\n';
+		for (size_t i = 0; i < count; i++)
+		{
+			fputs(query_index_path(index, rows[i]), stdout);
+			putchar(terminator);
+		}
+	}
+
+	bool output_failed = (fflush(stdout) != 0 || ferror(stdout));
+	if (output_failed)
+		PrintToStderrF("Failed to write output: %s", strerror(errno));
+
+	if (verbose)
+	{
+		PrintToStderrF("Indexed %zu entries (%zu extensions, %zu KiB) in %.3f s, %zu matches in %.3f ms",
+					   stats.rows, stats.extensions, stats.memory_usage / 1024, stats.build_seconds, count,
+					   query_ms);
+	}
+
+	free(rows);
+	query_index_free(index);
+
+	if (output_failed || stats.errors > 0)
+		return QUERY_EXIT_ERROR;
+	return (count > 0) ? QUERY_EXIT_MATCH : QUERY_EXIT_NO_MATCH;
+}
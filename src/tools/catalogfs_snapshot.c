@@ -0,0 +1,543 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-snapshot - adds a catalog (index) as a named snapshot to a
+ * versioned store (see catalog_store.h):
+ *
+ *   catalogfs-snapshot /backups/store /catalog            (named by today's date)
+ *   catalogfs-snapshot /backups/store /catalog.db 2026-10-01
+ *   catalogfs-snapshot --list /backups/store
+ *
+ * Directories are stored bottom-up: every directory becomes a node with
+ * metadata of its entries and hashes of nodes of its subdirectories, so
+ * unchanged subtrees have the same nodes as in earlier snapshots and only
+ * nodes of changed directories (and their parents) are written.
+ *
+ * Both catalog directories and single-file catalogs (see catalog_db.h) are
+ * supported, a regular file is opened as a single-file catalog.
+ *
+ * A mount with --store=<path> shows snapshots as @<name> directories.
+ *
+ * Exit code is 0 on success, 1 if some entries failed to be read (the
+ * snapshot is saved without them) or on errors.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch_loader.h"
+#include "catalog_db.h"
+#include "catalog_dir.h"
+#include "catalog_store.h"
+
+#include "log.h"
+
+/** Exit code: the snapshot is saved */
+#define SNAPSHOT_EXIT_OK (0)
+/** Exit code: some error happened */
+#define SNAPSHOT_EXIT_ERROR (1)
+
+/** Page cache of single-file catalogs (in bytes) */
+#define SNAPSHOT_DB_CACHE_SIZE (64 * 1024 * 1024)
+
+/** Length of default names (YYYY-MM-DD) */
+#define SNAPSHOT_DATE_LENGTH (10)
+
+/**
+ * State of adding a snapshot
+ */
+struct snapshot_state
+{
+	/** Target store */
+	struct catalog_store *store;
+
+	/** Batched loader of catalog directories (NULL for single-file catalogs) */
+	struct batch_loader *loader;
+
+	/** Single-file catalog (NULL for catalog directories) */
+	struct catalog_db *db;
+
+	/** Number of stored entries */
+	uint64_t entries;
+
+	/** Number of stored directories */
+	uint64_t dirs;
+
+	/** Number of entries and directories that failed to be read */
+	size_t errors;
+};
+
+/**
+ * Print help
+ *
+ * @param program_name is the name of the program
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <store> <catalog> [name]", program_name);
+	PrintToStdoutF("       %s --list <store>", program_name);
+	PrintToStdout("Adds the catalog as a snapshot to the versioned store (created if missing).");
+	PrintToStdout("Unchanged directories are shared with earlier snapshots.");
+	PrintToStdout("The default name is today's date (YYYY-MM-DD).");
+	PrintToStdout("Options:");
+	PrintToStdout("-f   --force               replace an existing snapshot with the same name");
+	PrintToStdout("-l   --list                print names of snapshots of the store");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Get seconds of a monotonic clock
+ *
+ * @return the seconds
+ */
+static double monotonic_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * Open a directory of a catalog directory without updating its atime when possible
+ * (the atime is not stored, but reading a catalog should not touch it)
+ *
+ * @param dir_fd is the file descriptor of the parent directory
+ * @param name is the name of the directory
+ * @return file descriptor or -1 on error (errno is set)
+ */
+static int open_catalog_dir(int dir_fd, const char *name)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	// O_NOATIME is allowed only for owners of files
+	if (fd == -1 && errno == EPERM)
+		fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	return fd;
+}
+
+/**
+ * Replace times of a directory or a symlink that belong to the catalog itself
+ * (ctime is set by the catalog, atime changes when the catalog is read) with
+ * its mtime, so nodes of catalogs of the same source are the same
+ *
+ * @param my_stat is the metadata of the entry
+ */
+static void drop_catalog_times(struct filestat *my_stat)
+{
+	if (!S_ISDIR(my_stat->mode) && !S_ISLNK(my_stat->mode))
+		return;
+
+	my_stat->atime = my_stat->mtime;
+	my_stat->atimensec = my_stat->mtimensec;
+	my_stat->ctime = my_stat->mtime;
+	my_stat->ctimensec = my_stat->mtimensec;
+}
+
+/**
+ * Store entries of a directory as a node (subdirectories must be stored already)
+ *
+ * @param state is the state
+ * @param inputs is the array of entries sorted by name
+ * @param count is the number of entries
+ * @param hash is the hash of the node
+ * @return 0 on success, negative value on error
+ */
+static int store_node(struct snapshot_state *state, const struct catalog_store_input *inputs, size_t count,
+					  struct catalog_store_hash *hash)
+{
+	state->entries += count;
+	state->dirs++;
+	return catalog_store_put_node(state->store, inputs, count, hash);
+}
+
+/**
+ * Store a directory of a catalog directory with all subdirectories
+ *
+ * @param state is the state
+ * @param dir_fd is the file descriptor of the directory (not closed)
+ * @param hash is the hash of the node of the directory
+ * @return 0 on success, negative value on errors of the store (errors of the catalog are counted)
+ */
+static int snapshot_catalog_dir(struct snapshot_state *state, int dir_fd, struct catalog_store_hash *hash)
+{
+	struct catalog_dir dir;
+	if (catalog_dir_load_batch(dir_fd, true, state->loader, &dir, &state->errors) != 0)
+	{
+		state->errors++;
+		return store_node(state, NULL, 0, hash);
+	}
+
+	struct catalog_store_input *inputs = calloc((dir.count > 0) ? dir.count : 1, sizeof(struct catalog_store_input));
+	if (inputs == NULL)
+	{
+		catalog_dir_free(&dir);
+		return -ENOMEM;
+	}
+
+	int res = 0;
+	for (size_t i = 0; res == 0 && i < dir.count; i++)
+	{
+		const struct catalog_dir_entry *entry = &dir.entries[i];
+		inputs[i].name = entry->name;
+		inputs[i].my_stat = entry->my_stat;
+		drop_catalog_times(&inputs[i].my_stat);
+		inputs[i].link_target = entry->link_target;
+		if (!catalog_dir_entry_is_dir(entry))
+			continue;
+
+		// Entries of the manifest are regular files, directories are always real
+		int child_fd = open_catalog_dir(dir_fd, entry->name);
+		if (child_fd == -1)
+		{
+			PrintToStderrF("Failed to open directory: %s (name: %s)", strerror(errno), entry->name);
+			state->errors++;
+			res = store_node(state, NULL, 0, &inputs[i].child);
+			continue;
+		}
+
+		res = snapshot_catalog_dir(state, child_fd, &inputs[i].child);
+		(void)close(child_fd);
+	}
+
+	if (res == 0)
+		res = store_node(state, inputs, dir.count, hash);
+
+	free(inputs);
+	catalog_dir_free(&dir);
+	return res;
+}
+
+/**
+ * Entries of a directory of a single-file catalog
+ */
+struct snapshot_db_dir
+{
+	/** Entries (names and targets are owned) */
+	struct catalog_store_input *inputs;
+
+	/** Number of entries */
+	size_t count;
+
+	/** Allocated entries */
+	size_t capacity;
+};
+
+/**
+ * Free entries of a directory of a single-file catalog
+ *
+ * @param dir is the directory
+ */
+static void free_db_dir(struct snapshot_db_dir *dir)
+{
+	for (size_t i = 0; i < dir->count; i++)
+	{
+		free((char *)dir->inputs[i].name);
+		free((char *)dir->inputs[i].link_target);
+	}
+	free(dir->inputs);
+}
+
+/**
+ * Copy an entry of a single-file catalog (see catalog_db_list_cb)
+ *
+ * @param ctx is the directory
+ * @param name is the name of the entry
+ * @param entry is the entry
+ * @return 0 to continue, nonzero value to stop
+ */
+static int collect_db_entry(void *ctx, const char *name, const struct catalog_db_entry *entry)
+{
+	struct snapshot_db_dir *dir = (struct snapshot_db_dir *)ctx;
+	if (dir->count == dir->capacity)
+	{
+		size_t capacity = (dir->capacity > 0) ? dir->capacity * 2 : 64;
+		struct catalog_store_input *inputs = realloc(dir->inputs, capacity * sizeof(struct catalog_store_input));
+		if (inputs == NULL)
+			return -ENOMEM;
+		dir->inputs = inputs;
+		dir->capacity = capacity;
+	}
+
+	struct catalog_store_input *input = &dir->inputs[dir->count];
+	memset(input, 0, sizeof(struct catalog_store_input));
+	input->my_stat = entry->my_stat;
+	drop_catalog_times(&input->my_stat);
+	input->name = strdup(name);
+	if (input->name == NULL)
+		return -ENOMEM;
+
+	if (S_ISLNK(entry->my_stat.mode))
+	{
+		input->link_target = strdup(entry->link_target);
+		if (input->link_target == NULL)
+		{
+			free((char *)input->name);
+			return -ENOMEM;
+		}
+	}
+
+	dir->count++;
+	return 0;
+}
+
+/**
+ * Store a directory of a single-file catalog with all subdirectories
+ *
+ * @param state is the state
+ * @param path is the path of the directory (modified while storing subdirectories, restored after)
+ * @param hash is the hash of the node of the directory
+ * @return 0 on success, negative value on errors of the store (errors of the catalog are counted)
+ */
+static int snapshot_db_dir(struct snapshot_state *state, char *path, struct catalog_store_hash *hash)
+{
+	// The catalog is locked while listing, subdirectories are listed after the entries are copied
+	struct snapshot_db_dir dir = {NULL, 0, 0};
+	int res = catalog_db_list(state->db, path, collect_db_entry, &dir);
+	if (res == -ENOMEM)
+	{
+		free_db_dir(&dir);
+		return res;
+	}
+
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to list directory: %s (path: /%s)", strerror(-res), path);
+		state->errors++;
+		free_db_dir(&dir);
+		return store_node(state, NULL, 0, hash);
+	}
+
+	size_t path_len = strlen(path);
+	res = 0;
+	for (size_t i = 0; res == 0 && i < dir.count; i++)
+	{
+		struct catalog_store_input *input = &dir.inputs[i];
+		if (!S_ISDIR(input->my_stat.mode))
+			continue;
+
+		size_t name_len = strlen(input->name);
+		if (path_len + 1 + name_len >= PATH_MAX)
+		{
+			state->errors++;
+			res = store_node(state, NULL, 0, &input->child);
+			continue;
+		}
+
+		size_t len = path_len;
+		if (len > 0)
+			path[len++] = '/';
+		memcpy(path + len, input->name, name_len + 1);
+		res = snapshot_db_dir(state, path, &input->child);
+		path[path_len] = '\0';
+	}
+
+	if (res == 0)
+		res = store_node(state, dir.inputs, dir.count, hash);
+
+	free_db_dir(&dir);
+	return res;
+}
+
+/**
+ * Store a catalog directory or a single-file catalog
+ *
+ * @param state is the state with the store
+ * @param catalog_path is the path of the catalog
+ * @param root is the hash of the node of the root directory
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int snapshot_catalog(struct snapshot_state *state, const char *catalog_path, struct catalog_store_hash *root)
+{
+	struct stat stbuf;
+	if (stat(catalog_path, &stbuf) != 0)
+		return -errno;
+
+	if (S_ISREG(stbuf.st_mode))
+	{
+		int res = catalog_db_open(&state->db, catalog_path, SNAPSHOT_DB_CACHE_SIZE, false);
+		if (res != 0)
+			return res;
+
+		char path[PATH_MAX] = "";
+		res = snapshot_db_dir(state, path, root);
+		int close_res = catalog_db_close(state->db);
+		state->db = NULL;
+		return (res == 0) ? close_res : res;
+	}
+
+	int catalog_fd = open_catalog_dir(AT_FDCWD, catalog_path);
+	if (catalog_fd == -1)
+		return -errno;
+
+	int res = batch_loader_new(&state->loader, BATCH_LOADER_DEFAULT_DEPTH);
+	if (res == 0)
+		res = snapshot_catalog_dir(state, catalog_fd, root);
+
+	batch_loader_free(state->loader);
+	state->loader = NULL;
+	(void)close(catalog_fd);
+	return res;
+}
+
+/**
+ * Print names of snapshots of a store
+ *
+ * @param store_path is the path of the store
+ * @return exit code
+ */
+static int list_snapshots(const char *store_path)
+{
+	struct catalog_store *store;
+	int res = catalog_store_open(&store, store_path, false);
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to open store: %s (path: %s)", strerror(-res), store_path);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	char **names = NULL;
+	size_t count = 0;
+	res = catalog_store_list_snapshots(store, &names, &count);
+	if (res != 0)
+		PrintToStderrF("Failed to list snapshots: %s", strerror(-res));
+
+	for (size_t i = 0; i < count; i++)
+		puts(names[i]);
+
+	catalog_store_free_names(names, count);
+	(void)catalog_store_close(store);
+
+	if (fflush(stdout) != 0 || ferror(stdout))
+		res = -EIO;
+	return (res == 0) ? SNAPSHOT_EXIT_OK : SNAPSHOT_EXIT_ERROR;
+}
+
+int main(int argc, char *argv[])
+{
+	bool force = false;
+	bool list = false;
+
+	static const struct option long_options[] = {
+		{"force", no_argument, NULL, 'f'},
+		{"list", no_argument, NULL, 'l'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "flh", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			force = true;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return SNAPSHOT_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return SNAPSHOT_EXIT_ERROR;
+		}
+	}
+
+	if (list)
+	{
+		if (argc - optind != 1)
+		{
+			print_help(argv[0]);
+			return SNAPSHOT_EXIT_ERROR;
+		}
+		return list_snapshots(argv[optind]);
+	}
+
+	if (argc - optind != 2 && argc - optind != 3)
+	{
+		print_help(argv[0]);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	const char *store_path = argv[optind];
+	const char *catalog_path = argv[optind + 1];
+
+	char date[SNAPSHOT_DATE_LENGTH + 1];
+	const char *name = argv[optind + 2];
+	if (name == NULL)
+	{
+		time_t now = time(NULL);
+		struct tm tm;
+		if (localtime_r(&now, &tm) == NULL || strftime(date, sizeof(date), "%Y-%m-%d", &tm) == 0)
+		{
+			PrintToStderr("Failed to get the current date");
+			return SNAPSHOT_EXIT_ERROR;
+		}
+		name = date;
+	}
+
+	if (!catalog_store_is_snapshot_name(name))
+	{
+		PrintToStderrF("Invalid name of snapshot: %s", name);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	struct snapshot_state state;
+	memset(&state, 0, sizeof(struct snapshot_state));
+	int res = catalog_store_open(&state.store, store_path, true);
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to open store: %s (path: %s)", (res == -EINVAL) ? "not a store" : strerror(-res),
+					   store_path);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	struct catalog_store_hash root;
+	if (!force && catalog_store_get_snapshot(state.store, name, &root, NULL) == 0)
+	{
+		PrintToStderrF("Snapshot already exists (use --force to replace it): %s", name);
+		(void)catalog_store_close(state.store);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	double start = monotonic_seconds();
+	res = snapshot_catalog(&state, catalog_path, &root);
+	if (res == 0)
+		res = catalog_store_set_snapshot(state.store, name, &root);
+
+	struct catalog_store_stats stats;
+	catalog_store_get_stats(state.store, &stats);
+	int close_res = catalog_store_close(state.store);
+	if (res == 0)
+		res = close_res;
+
+	if (res != 0)
+	{
+		PrintToStderrF("Failed to add snapshot: %s (catalog: %s)", strerror(-res), catalog_path);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+
+	char hex[CATALOG_STORE_HASH_SIZE * 2 + 1];
+	catalog_store_hash_to_hex(&root, hex);
+	PrintToStderrF("Snapshot %s (root %.16s): %" PRIu64 " entries in %" PRIu64 " directories in %.3f s", name, hex,
+				   state.entries, state.dirs, monotonic_seconds() - start);
+	PrintToStderrF("Nodes: %" PRIu64 " new (%" PRIu64 " KiB), %" PRIu64 " shared with other snapshots, "
+				   "%zu in the store (%" PRIu64 " KiB)",
+				   stats.nodes_added, stats.bytes_added / 1024, stats.nodes_reused, stats.nodes,
+				   stats.pack_size / 1024);
+
+	if (state.errors > 0)
+	{
+		PrintToStderrF("Failed to read %zu entries of catalog", state.errors);
+		return SNAPSHOT_EXIT_ERROR;
+	}
+	return SNAPSHOT_EXIT_OK;
+}
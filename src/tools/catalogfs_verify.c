@@ -0,0 +1,1089 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-verify - checks that a live directory (e.g. a backup disk) still
+ * matches its CatalogFS catalog (index).
+ *
+ * The live source and the catalog are walked at the same time with a sorted
+ * merge of every pair of directories (like catalogfs-diff does).
+ * Metadata of live files is converted with fill_filestat_from_stat() and
+ * compared with filestat files of the catalog.
+ *
+ * Optionally (--hash) contents of live files are re-hashed with SHA-256
+ * and compared with hashes stored in the catalog. Hashing is done by a pool
+ * of worker threads with a limit of concurrent reads per device, so a single
+ * HDD is not thrashed by parallel reads while several disks are still read
+ * in parallel. With --hdd files of every directory are queued in the order
+ * of their physical location on disk (FIEMAP, inode order as a fallback)
+ * and every device is read by one thread only, so reads stay sequential.
+ *
+ * Mismatches are reported incrementally, one line per entry:
+ *
+ *    missing<TAB>-<TAB>/path          (present in catalog only)
+ *    extra<TAB>-<TAB>/path            (present in live directory only)
+ *    mismatch<TAB>size,mtime<TAB>/path
+ *
+ * Fields of mismatches can be: type, size, mtime, mode, uid, gid, target, sha256.
+ *
+ * Throughput is reported to stderr periodically and at the end.
+ *
+ * Exit code is 0 if everything matches, 1 if mismatches were found, 2 on error.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "batch_loader.h"
+#include "catalog_dir.h"
+#include "filestat.h"
+#include "sha256.h"
+
+#include "log.h"
+
+/** Exit code: everything matches */
+#define VERIFY_EXIT_OK (0)
+/** Exit code: mismatches were found */
+#define VERIFY_EXIT_MISMATCH (1)
+/** Exit code: some error happened */
+#define VERIFY_EXIT_ERROR (2)
+
+/** Default number of hashing threads */
+#define VERIFY_DEFAULT_JOBS (4)
+
+/** Maximum number of queued hash jobs (bounds memory of the queue) */
+#define VERIFY_MAX_QUEUED_JOBS (4096)
+
+/** Default interval of progress reports in seconds */
+#define VERIFY_DEFAULT_PROGRESS_INTERVAL (10)
+
+/**
+ * A file to be hashed by worker threads
+ */
+struct hash_job
+{
+	/** Next job in the queue */
+	struct hash_job *next;
+
+	/** Path relative to the source directory */
+	char *relpath;
+
+	/** Expected hash from the catalog */
+	char expected[FILESTAT_SHA256_HEX_LENGTH + 1];
+
+	/** Device of the live file */
+	dev_t dev;
+
+	/** Inode of the live file */
+	ino_t ino;
+
+	/** Physical offset of the first extent of the live file (0 if unknown) */
+	uint64_t physical;
+};
+
+/**
+ * Number of active readers of a device
+ */
+struct device_slot
+{
+	/** Device id */
+	dev_t dev;
+
+	/** Number of workers that currently read from the device */
+	unsigned int active;
+};
+
+/**
+ * Options and state of the verification process
+ */
+struct verify_state
+{
+	/** Re-hash contents of live files */
+	bool hash;
+
+	/** Order reads for HDDs */
+	bool hdd;
+
+	/** Compare mode, uid and gid */
+	bool strict;
+
+	/** Compare modification times */
+	bool compare_mtime;
+
+	/** Number of hashing threads */
+	unsigned int jobs;
+
+	/** Maximum number of concurrent readers per device */
+	unsigned int device_jobs;
+
+	/** Interval of progress reports in seconds (0 to disable) */
+	unsigned int progress_interval;
+
+	/** File descriptor of the live source directory */
+	int source_fd;
+
+	/** Batched loader of directory listings (used by the walking thread only) */
+	struct batch_loader *loader;
+
+	/** Current path (relative to roots, starts with '/') */
+	char *path;
+
+	/** Length of the current path */
+	size_t path_len;
+
+	/** Allocated size of the path buffer */
+	size_t path_capacity;
+
+	/** Lock for the queue, devices and counters */
+	pthread_mutex_t lock;
+
+	/** Condition for changes of the queue, devices and finished flag */
+	pthread_cond_t cond;
+
+	/** Head of the hash jobs queue */
+	struct hash_job *queue_head;
+
+	/** Tail of the hash jobs queue */
+	struct hash_job *queue_tail;
+
+	/** Number of queued jobs */
+	size_t queued;
+
+	/** Walk is finished and no more jobs will be queued */
+	bool finished;
+
+	/** Devices with active readers */
+	struct device_slot *devices;
+
+	/** Number of known devices */
+	size_t devices_count;
+
+	/** Number of compared entries */
+	uint64_t entries_checked;
+
+	/** Number of hashed files */
+	uint64_t files_hashed;
+
+	/** Number of hashed bytes */
+	uint64_t bytes_hashed;
+
+	/** Number of reported mismatches */
+	uint64_t mismatches;
+
+	/** Number of errors */
+	uint64_t errors;
+
+	/** Time of start */
+	struct timespec start_time;
+};
+
+/**
+ * Get seconds elapsed since the start of verification
+ *
+ * @param state is the verify state
+ * @return elapsed seconds
+ */
+static double verify_elapsed(const struct verify_state *state)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - state->start_time.tv_sec) +
+		   (double)(now.tv_nsec - state->start_time.tv_nsec) / 1e9;
+}
+
+/**
+ * Print throughput statistics to stderr
+ *
+ * @param state is the verify state
+ * @param is_final is true for the final report
+ */
+static void verify_print_progress(struct verify_state *state, bool is_final)
+{
+	pthread_mutex_lock(&state->lock);
+	uint64_t entries = state->entries_checked;
+	uint64_t files = state->files_hashed;
+	uint64_t bytes = state->bytes_hashed;
+	uint64_t mismatches = state->mismatches;
+	uint64_t errors = state->errors;
+	size_t queued = state->queued;
+	pthread_mutex_unlock(&state->lock);
+
+	double elapsed = verify_elapsed(state);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	double mib = (double)bytes / (1024.0 * 1024.0);
+	PrintToStderrF("%s: %" PRIu64 " entries (%.0f/s), %" PRIu64 " files hashed, %.1f MiB (%.1f MiB/s), "
+				   "%" PRIu64 " mismatches, %" PRIu64 " errors, %zu queued, %.1f s",
+				   (is_final) ? "Finished" : "Progress",
+				   entries, (double)entries / elapsed,
+				   files, mib, mib / elapsed,
+				   mismatches, errors, queued, elapsed);
+}
+
+/**
+ * Report a mismatch line
+ *
+ * @param state is the verify state
+ * @param kind is the kind of the mismatch (missing, extra, mismatch)
+ * @param fields is a comma-separated list of fields ("-" if not applicable)
+ * @param path is the path of the entry
+ */
+static void verify_report(struct verify_state *state, const char *kind, const char *fields, const char *path)
+{
+	pthread_mutex_lock(&state->lock);
+	state->mismatches++;
+	pthread_mutex_unlock(&state->lock);
+
+	// One printf() per line, stdout is line buffered and locked by stdio
+	printf("%s\t%s\t%s\n", kind, fields, path);
+}
+
+/**
+ * Report an error
+ *
+ * @param state is the verify state
+ * @param message is a description of the error
+ * @param code is the error code (negative errno)
+ * @param path is the path of the entry
+ */
+static void verify_error(struct verify_state *state, const char *message, int code, const char *path)
+{
+	pthread_mutex_lock(&state->lock);
+	state->errors++;
+	pthread_mutex_unlock(&state->lock);
+
+	PrintToStderrF("%s: %s (path: %s)", message, strerror(-code), (path[0] != '\0') ? path : "/");
+}
+
+/**
+ * Append a name to the current path
+ *
+ * @param state is the verify state
+ * @param name is the name to append
+ * @return previous length of the path (for verify_path_pop()), SIZE_MAX on error
+ */
+static size_t verify_path_push(struct verify_state *state, const char *name)
+{
+	size_t old_len = state->path_len;
+	size_t name_len = strlen(name);
+	size_t needed = old_len + 1 + name_len + 1;
+
+	if (needed > state->path_capacity)
+	{
+		size_t new_capacity = (state->path_capacity == 0) ? 256 : state->path_capacity;
+		while (new_capacity < needed)
+		{
+			new_capacity *= 2;
+		}
+
+		char *new_path = (char *)realloc(state->path, new_capacity);
+		if (new_path == NULL)
+			return SIZE_MAX;
+
+		state->path = new_path;
+		state->path_capacity = new_capacity;
+	}
+
+	state->path[old_len] = '/';
+	memcpy(state->path + old_len + 1, name, name_len + 1);
+	state->path_len = old_len + 1 + name_len;
+
+	return old_len;
+}
+
+/**
+ * Restore the current path to the previous length
+ *
+ * @param state is the verify state
+ * @param old_len is the length returned by verify_path_push()
+ */
+static void verify_path_pop(struct verify_state *state, size_t old_len)
+{
+	state->path_len = old_len;
+	state->path[old_len] = '\0';
+}
+
+/**
+ * Find (or add) the device slot for the device. Must be called under the lock.
+ *
+ * @param state is the verify state
+ * @param dev is the device id
+ * @return device slot, NULL on error
+ */
+static struct device_slot *verify_get_device_slot(struct verify_state *state, dev_t dev)
+{
+	for (size_t i = 0; i < state->devices_count; i++)
+	{
+		if (state->devices[i].dev == dev)
+			return &state->devices[i];
+	}
+
+	struct device_slot *new_devices = (struct device_slot *)realloc(
+		state->devices, (state->devices_count + 1) * sizeof(struct device_slot));
+	if (new_devices == NULL)
+		return NULL;
+
+	state->devices = new_devices;
+	struct device_slot *slot = &state->devices[state->devices_count++];
+	slot->dev = dev;
+	slot->active = 0;
+	return slot;
+}
+
+/**
+ * Take the first queued job whose device has a free reader slot.
+ * Must be called under the lock.
+ *
+ * @param state is the verify state
+ * @return job (removed from the queue), NULL if no job can be started now
+ */
+static struct hash_job *verify_take_job(struct verify_state *state)
+{
+	struct hash_job *prev = NULL;
+	for (struct hash_job *job = state->queue_head; job != NULL; prev = job, job = job->next)
+	{
+		struct device_slot *slot = verify_get_device_slot(state, job->dev);
+		if (slot != NULL && slot->active >= state->device_jobs)
+			continue;
+
+		if (prev == NULL)
+			state->queue_head = job->next;
+		else
+			prev->next = job->next;
+
+		if (state->queue_tail == job)
+			state->queue_tail = prev;
+
+		state->queued--;
+		if (slot != NULL)
+			slot->active++;
+
+		job->next = NULL;
+		return job;
+	}
+
+	return NULL;
+}
+
+/**
+ * Hash a live file and compare the hash with the expected one
+ *
+ * @param state is the verify state
+ * @param job is the job to process
+ */
+static void verify_hash_file(struct verify_state *state, struct hash_job *job)
+{
+	int fd = openat(state->source_fd, job->relpath, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	if (fd == -1 && errno == EPERM)
+	{
+		// O_NOATIME is allowed only for owners of files
+		fd = openat(state->source_fd, job->relpath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	// Path for messages with leading slash, relpath is a suffix of it
+	char *path = NULL;
+	if (asprintf(&path, "/%s", job->relpath) == -1)
+		path = NULL;
+
+	if (fd == -1)
+	{
+		verify_error(state, "Failed to open file for hashing", -errno, (path != NULL) ? path : job->relpath);
+		free(path);
+		return;
+	}
+
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char hex[FILESTAT_SHA256_HEX_LENGTH + 1];
+	uint64_t bytes_read = 0;
+	int res = sha256_fd_hex(fd, hex, &bytes_read);
+	(void)close(fd);
+
+	pthread_mutex_lock(&state->lock);
+	state->bytes_hashed += bytes_read;
+	if (res == 0)
+		state->files_hashed++;
+	pthread_mutex_unlock(&state->lock);
+
+	if (res != 0)
+	{
+		verify_error(state, "Failed to hash file", res, (path != NULL) ? path : job->relpath);
+	}
+	else if (strcmp(hex, job->expected) != 0)
+	{
+		verify_report(state, "mismatch", "sha256", (path != NULL) ? path : job->relpath);
+	}
+
+	free(path);
+}
+
+/**
+ * Worker thread function for hashing
+ *
+ * @param arg is the verify state
+ * @return NULL
+ */
+static void *verify_worker(void *arg)
+{
+	struct verify_state *state = (struct verify_state *)arg;
+
+	pthread_mutex_lock(&state->lock);
+	while (true)
+	{
+		struct hash_job *job = verify_take_job(state);
+		if (job == NULL)
+		{
+			if (state->finished && state->queued == 0)
+				break;
+
+			pthread_cond_wait(&state->cond, &state->lock);
+			continue;
+		}
+
+		// Queue has a free place now
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->lock);
+
+		verify_hash_file(state, job);
+
+		pthread_mutex_lock(&state->lock);
+		struct device_slot *slot = verify_get_device_slot(state, job->dev);
+		if (slot != NULL && slot->active > 0)
+			slot->active--;
+		pthread_cond_broadcast(&state->cond);
+
+		free(job->relpath);
+		free(job);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Progress thread function
+ *
+ * @param arg is the verify state
+ * @return NULL
+ */
+static void *verify_progress_thread(void *arg)
+{
+	struct verify_state *state = (struct verify_state *)arg;
+
+	pthread_mutex_lock(&state->lock);
+	while (!(state->finished && state->queued == 0))
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += state->progress_interval;
+
+		int res = pthread_cond_timedwait(&state->cond, &state->lock, &deadline);
+		if (res == ETIMEDOUT)
+		{
+			pthread_mutex_unlock(&state->lock);
+			verify_print_progress(state, false);
+			pthread_mutex_lock(&state->lock);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/**
+ * Get the physical offset of the first extent of the file (for ordering of reads)
+ *
+ * @param dir_fd is the directory file descriptor
+ * @param name is the file name
+ * @return physical offset in bytes, 0 if unknown
+ */
+static uint64_t verify_get_physical_offset(int dir_fd, const char *name)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	if (fd == -1)
+		fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	union
+	{
+		struct fiemap map;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} fiemap_buf;
+	memset(&fiemap_buf, 0, sizeof(fiemap_buf));
+
+	fiemap_buf.map.fm_start = 0;
+	fiemap_buf.map.fm_length = FIEMAP_MAX_OFFSET;
+	fiemap_buf.map.fm_extent_count = 1;
+
+	uint64_t physical = 0;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fiemap_buf.map) == 0 &&
+		fiemap_buf.map.fm_mapped_extents > 0)
+	{
+		physical = fiemap_buf.map.fm_extents[0].fe_physical;
+	}
+
+	(void)close(fd);
+	return physical;
+}
+
+/**
+ * Compare hash jobs by physical offset (and inode as a fallback) for qsort()
+ *
+ * @param a is the first job pointer
+ * @param b is the second job pointer
+ * @return negative, zero or positive value like strcmp()
+ */
+static int verify_job_compare(const void *a, const void *b)
+{
+	const struct hash_job *job_a = *(const struct hash_job *const *)a;
+	const struct hash_job *job_b = *(const struct hash_job *const *)b;
+
+	if (job_a->physical != job_b->physical)
+		return (job_a->physical < job_b->physical) ? -1 : 1;
+	if (job_a->ino != job_b->ino)
+		return (job_a->ino < job_b->ino) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Queue hash jobs of one directory (blocks while the queue is full)
+ *
+ * @param state is the verify state
+ * @param jobs is the array of jobs
+ * @param count is the number of jobs
+ */
+static void verify_queue_jobs(struct verify_state *state, struct hash_job **jobs, size_t count)
+{
+	if (count > 1)
+	{
+		qsort(jobs, count, sizeof(struct hash_job *), verify_job_compare);
+	}
+
+	pthread_mutex_lock(&state->lock);
+	for (size_t i = 0; i < count; i++)
+	{
+		while (state->queued >= VERIFY_MAX_QUEUED_JOBS)
+		{
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+
+		if (state->queue_tail == NULL)
+			state->queue_head = jobs[i];
+		else
+			state->queue_tail->next = jobs[i];
+		state->queue_tail = jobs[i];
+		state->queued++;
+	}
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Create a hash job for the current path
+ *
+ * @param state is the verify state
+ * @param source_dir_fd is the live directory file descriptor
+ * @param live_entry is the live entry
+ * @param catalog_entry is the catalog entry (with expected hash)
+ * @return new job, NULL on error
+ */
+static struct hash_job *verify_make_job(struct verify_state *state, int source_dir_fd,
+										const struct catalog_dir_entry *live_entry,
+										const struct catalog_dir_entry *catalog_entry)
+{
+	struct hash_job *job = (struct hash_job *)calloc(1, sizeof(struct hash_job));
+	if (job == NULL)
+		return NULL;
+
+	// Skip leading slash to have a path relative to source_fd
+	job->relpath = strdup(state->path + 1);
+	if (job->relpath == NULL)
+	{
+		free(job);
+		return NULL;
+	}
+
+	memcpy(job->expected, catalog_entry->my_stat.sha256, sizeof(job->expected));
+	job->dev = live_entry->stbuf.st_dev;
+	job->ino = live_entry->stbuf.st_ino;
+
+	if (state->hdd)
+	{
+		job->physical = verify_get_physical_offset(source_dir_fd, live_entry->name);
+	}
+
+	return job;
+}
+
+/**
+ * Append a field name to the comma-separated list of mismatched fields
+ *
+ * @param fields is the buffer with the list
+ * @param fields_size is the size of the buffer
+ * @param field is the field name to append
+ */
+static void verify_append_field(char *fields, size_t fields_size, const char *field)
+{
+	size_t len = strlen(fields);
+	(void)snprintf(fields + len, fields_size - len, "%s%s", (len > 0) ? "," : "", field);
+}
+
+/**
+ * Compare a live entry with a catalog entry and fill the list of mismatched fields
+ *
+ * @param state is the verify state
+ * @param live_entry is the entry from the live directory
+ * @param catalog_entry is the entry from the catalog
+ * @param fields is the buffer for the list (empty if entries match)
+ * @param fields_size is the size of the buffer
+ */
+static void verify_compare_entries(const struct verify_state *state,
+								   const struct catalog_dir_entry *live_entry,
+								   const struct catalog_dir_entry *catalog_entry,
+								   char *fields, size_t fields_size)
+{
+	fields[0] = '\0';
+
+	if ((live_entry->stbuf.st_mode & S_IFMT) != (catalog_entry->stbuf.st_mode & S_IFMT))
+	{
+		verify_append_field(fields, fields_size, "type");
+		return;
+	}
+
+	if (S_ISLNK(live_entry->stbuf.st_mode))
+	{
+		if (strcmp(live_entry->link_target, catalog_entry->link_target) != 0)
+		{
+			verify_append_field(fields, fields_size, "target");
+		}
+		return;
+	}
+
+	// Directories of catalogs have their own real metadata, only files have filestats
+	if (!S_ISREG(live_entry->stbuf.st_mode) || !catalog_entry->has_filestat)
+		return;
+
+	const struct filestat *live_stat = &live_entry->my_stat;
+	const struct filestat *catalog_stat = &catalog_entry->my_stat;
+
+	if (live_stat->size != catalog_stat->size)
+	{
+		verify_append_field(fields, fields_size, "size");
+	}
+
+	if (state->compare_mtime &&
+		(live_stat->mtime != catalog_stat->mtime || live_stat->mtimensec != catalog_stat->mtimensec))
+	{
+		verify_append_field(fields, fields_size, "mtime");
+	}
+
+	if (state->strict)
+	{
+		if ((live_stat->mode & 07777) != (catalog_stat->mode & 07777))
+			verify_append_field(fields, fields_size, "mode");
+		if (live_stat->uid != catalog_stat->uid)
+			verify_append_field(fields, fields_size, "uid");
+		if (live_stat->gid != catalog_stat->gid)
+			verify_append_field(fields, fields_size, "gid");
+	}
+}
+
+/**
+ * Open a subdirectory of the directory without following symlinks
+ *
+ * @param dir_fd is the parent directory file descriptor
+ * @param name is the subdirectory name
+ * @return file descriptor on success, -1 on error (errno is set)
+ */
+static int verify_open_subdir(int dir_fd, const char *name)
+{
+	return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/**
+ * Verify a live directory against a catalog directory (recursively)
+ *
+ * @param state is the verify state
+ * @param live_fd is the live directory file descriptor
+ * @param catalog_fd is the catalog directory file descriptor
+ */
+static void verify_directories(struct verify_state *state, int live_fd, int catalog_fd)
+{
+	const char *dir_path = (state->path_len > 0) ? state->path : "";
+
+	struct catalog_dir live_dir;
+	struct catalog_dir catalog_dir;
+	size_t errors = 0;
+
+	int res = catalog_dir_load_batch(live_fd, false, state->loader, &live_dir, &errors);
+	if (res != 0)
+	{
+		verify_error(state, "Failed to read live directory", res, dir_path);
+		return;
+	}
+
+	res = catalog_dir_load_batch(catalog_fd, true, state->loader, &catalog_dir, &errors);
+	if (res != 0)
+	{
+		verify_error(state, "Failed to read catalog directory", res, dir_path);
+		catalog_dir_free(&live_dir);
+		return;
+	}
+
+	if (errors > 0)
+	{
+		verify_error(state, "Failed to read some entries of directory", -EIO, dir_path);
+	}
+
+	struct hash_job **jobs = NULL;
+	size_t jobs_count = 0;
+	if (state->hash)
+	{
+		jobs = (struct hash_job **)calloc((live_dir.count > 0) ? live_dir.count : 1, sizeof(struct hash_job *));
+		if (jobs == NULL)
+		{
+			verify_error(state, "Failed to allocate hash jobs", -ENOMEM, dir_path);
+		}
+	}
+
+	size_t i = 0;
+	size_t j = 0;
+	while (i < live_dir.count || j < catalog_dir.count)
+	{
+		const struct catalog_dir_entry *live_entry = (i < live_dir.count) ? &live_dir.entries[i] : NULL;
+		const struct catalog_dir_entry *catalog_entry = (j < catalog_dir.count) ? &catalog_dir.entries[j] : NULL;
+
+		int cmp;
+		if (live_entry == NULL)
+			cmp = 1;
+		else if (catalog_entry == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(live_entry->name, catalog_entry->name);
+
+		const char *name = (cmp <= 0) ? live_entry->name : catalog_entry->name;
+		size_t old_len = verify_path_push(state, name);
+		if (old_len == SIZE_MAX)
+		{
+			verify_error(state, "Failed to build path", -ENOMEM, dir_path);
+			break;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		state->entries_checked++;
+		pthread_mutex_unlock(&state->lock);
+
+		if (cmp < 0)
+		{
+			verify_report(state, "extra", "-", state->path);
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			verify_report(state, "missing", "-", state->path);
+			j++;
+		}
+		else
+		{
+			char fields[64];
+			verify_compare_entries(state, live_entry, catalog_entry, fields, sizeof(fields));
+			if (fields[0] != '\0')
+			{
+				verify_report(state, "mismatch", fields, state->path);
+			}
+			else if (jobs != NULL &&
+					 S_ISREG(live_entry->stbuf.st_mode) &&
+					 catalog_entry->my_stat.sha256[0] != '\0')
+			{
+				struct hash_job *job = verify_make_job(state, live_fd, live_entry, catalog_entry);
+				if (job == NULL)
+					verify_error(state, "Failed to create hash job", -ENOMEM, state->path);
+				else
+					jobs[jobs_count++] = job;
+			}
+
+			if (catalog_dir_entry_is_dir(live_entry) && catalog_dir_entry_is_dir(catalog_entry))
+			{
+				int live_subdir_fd = verify_open_subdir(live_fd, name);
+				int catalog_subdir_fd = verify_open_subdir(catalog_fd, name);
+				if (live_subdir_fd == -1 || catalog_subdir_fd == -1)
+				{
+					verify_error(state, "Failed to open directory", -errno, state->path);
+				}
+				else
+				{
+					verify_directories(state, live_subdir_fd, catalog_subdir_fd);
+				}
+
+				if (live_subdir_fd != -1)
+					(void)close(live_subdir_fd);
+				if (catalog_subdir_fd != -1)
+					(void)close(catalog_subdir_fd);
+			}
+			i++;
+			j++;
+		}
+
+		verify_path_pop(state, old_len);
+	}
+
+	if (jobs_count > 0)
+	{
+		verify_queue_jobs(state, jobs, jobs_count);
+	}
+	free(jobs);
+
+	catalog_dir_free(&live_dir);
+	catalog_dir_free(&catalog_dir);
+}
+
+/**
+ * Print help in case of -h/--help command line arguments
+ *
+ * @param program_name is the name of the running application
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <live_dir> <catalog>", program_name);
+	PrintToStdout("Options:");
+	PrintToStdout("-H   --sha256              re-hash contents of files with SHA-256");
+	PrintToStdout("                           (default: compare metadata only)");
+	PrintToStdout("-j   --jobs=<n>            number of hashing threads");
+	PrintToStdout("                           (default: 4)");
+	PrintToStdout("-d   --device-jobs=<n>     maximum number of concurrent reads per device");
+	PrintToStdout("                           (default: 1 with --hdd, otherwise the same as --jobs)");
+	PrintToStdout("     --hdd                 order reads by physical location to keep them sequential");
+	PrintToStdout("     --strict              compare mode, uid and gid too");
+	PrintToStdout("     --no-mtime            do not compare modification times");
+	PrintToStdout("-p   --progress=<sec>      interval of throughput reports to stderr, 0 to disable");
+	PrintToStdout("                           (default: 10)");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Parse a positive number from a command line argument
+ *
+ * @param arg is the argument
+ * @param allow_zero determines if zero is allowed
+ * @param value is the target value
+ * @return true on success, false on error
+ */
+static bool parse_unsigned_arg(const char *arg, bool allow_zero, unsigned int *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || parsed > UINT_MAX || (!allow_zero && parsed == 0))
+		return false;
+
+	*value = (unsigned int)parsed;
+	return true;
+}
+
+/**
+ * Main (an entry point)
+ *
+ * @param argc is the arguments count
+ * @param argv is the arguments array
+ * @return 0 if everything matches, 1 on mismatches, 2 on error
+ */
+int main(int argc, char *argv[])
+{
+	struct verify_state state;
+	memset(&state, 0, sizeof(struct verify_state));
+	state.compare_mtime = true;
+	state.jobs = VERIFY_DEFAULT_JOBS;
+	state.progress_interval = VERIFY_DEFAULT_PROGRESS_INTERVAL;
+
+	enum
+	{
+		OPT_HDD = 256,
+		OPT_STRICT,
+		OPT_NO_MTIME,
+	};
+
+	static const struct option long_options[] = {
+		{"sha256", no_argument, NULL, 'H'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"device-jobs", required_argument, NULL, 'd'},
+		{"hdd", no_argument, NULL, OPT_HDD},
+		{"strict", no_argument, NULL, OPT_STRICT},
+		{"no-mtime", no_argument, NULL, OPT_NO_MTIME},
+		{"progress", required_argument, NULL, 'p'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	unsigned int device_jobs = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "Hj:d:p:h", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'H':
+			state.hash = true;
+			break;
+		case 'j':
+			if (!parse_unsigned_arg(optarg, false, &state.jobs))
+			{
+				PrintToStderr("Invalid number of jobs");
+				return VERIFY_EXIT_ERROR;
+			}
+			break;
+		case 'd':
+			if (!parse_unsigned_arg(optarg, false, &device_jobs))
+			{
+				PrintToStderr("Invalid number of device jobs");
+				return VERIFY_EXIT_ERROR;
+			}
+			break;
+		case OPT_HDD:
+			state.hdd = true;
+			break;
+		case OPT_STRICT:
+			state.strict = true;
+			break;
+		case OPT_NO_MTIME:
+			state.compare_mtime = false;
+			break;
+		case 'p':
+			if (!parse_unsigned_arg(optarg, true, &state.progress_interval))
+			{
+				PrintToStderr("Invalid progress interval");
+				return VERIFY_EXIT_ERROR;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return VERIFY_EXIT_OK;
+		default:
+			print_help(argv[0]);
+			return VERIFY_EXIT_ERROR;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		print_help(argv[0]);
+		return VERIFY_EXIT_ERROR;
+	}
+
+	if (device_jobs != 0)
+		state.device_jobs = device_jobs;
+	else
+		state.device_jobs = (state.hdd) ? 1 : state.jobs;
+
+	state.source_fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (state.source_fd == -1)
+	{
+		PrintToStderrF("Failed to open live directory: %s (path: %s)", strerror(errno), argv[optind]);
+		return VERIFY_EXIT_ERROR;
+	}
+
+	int catalog_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (catalog_fd == -1)
+	{
+		PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), argv[optind + 1]);
+		(void)close(state.source_fd);
+		return VERIFY_EXIT_ERROR;
+	}
+
+	if (batch_loader_new(&state.loader, BATCH_LOADER_DEFAULT_DEPTH) != 0)
+	{
+		PrintToStderr("Failed to allocate loader");
+		(void)close(state.source_fd);
+		(void)close(catalog_fd);
+		return VERIFY_EXIT_ERROR;
+	}
+
+	// Mismatches should be visible as soon as they are found
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &state.start_time);
+
+	pthread_t *workers = NULL;
+	unsigned int workers_count = 0;
+	if (state.hash)
+	{
+		workers = (pthread_t *)calloc(state.jobs, sizeof(pthread_t));
+		if (workers == NULL)
+		{
+			PrintToStderr("Failed to allocate worker threads");
+			state.hash = false;
+		}
+
+		for (unsigned int i = 0; workers != NULL && i < state.jobs; i++)
+		{
+			if (pthread_create(&workers[workers_count], NULL, verify_worker, &state) != 0)
+			{
+				PrintToStderr("Failed to create worker thread");
+				break;
+			}
+			workers_count++;
+		}
+
+		if (workers_count == 0)
+		{
+			state.hash = false;
+		}
+	}
+
+	pthread_t progress_thread;
+	bool has_progress_thread = false;
+	if (state.progress_interval > 0)
+	{
+		has_progress_thread = (pthread_create(&progress_thread, NULL, verify_progress_thread, &state) == 0);
+	}
+
+	verify_directories(&state, state.source_fd, catalog_fd);
+
+	pthread_mutex_lock(&state.lock);
+	state.finished = true;
+	pthread_cond_broadcast(&state.cond);
+	pthread_mutex_unlock(&state.lock);
+
+	for (unsigned int i = 0; i < workers_count; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	if (has_progress_thread)
+	{
+		pthread_mutex_lock(&state.lock);
+		pthread_cond_broadcast(&state.cond);
+		pthread_mutex_unlock(&state.lock);
+		pthread_join(progress_thread, NULL);
+	}
+
+	verify_print_progress(&state, true);
+
+	(void)close(state.source_fd);
+	(void)close(catalog_fd);
+	batch_loader_free(state.loader);
+	free(state.path);
+	free(state.devices);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	if (state.errors > 0)
+		return VERIFY_EXIT_ERROR;
+
+	return (state.mismatches > 0) ? VERIFY_EXIT_MISMATCH : VERIFY_EXIT_OK;
+}
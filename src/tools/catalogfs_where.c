@@ -0,0 +1,502 @@
+/*
+  Copyright (C) 2020-present Zakhar Semenov
+
+  This program can be distributed under the terms of the GNU GPLv3 or later.
+*/
+
+/**
+ * catalogfs-where - finds which of many catalogs (e.g. of offline disks) has
+ * a file with the given name or SHA-256:
+ *
+ *   catalogfs-where --build /catalogs/disk-*                  (once per catalog)
+ *   catalogfs-where IMG_0042.JPG /catalogs/disk-*
+ *   catalogfs-where --filter-only 9f86d08...0a08 /catalogs/disk-*
+ *
+ * Every catalog has a sidecar with an xor filter of its names and hashes
+ * (see where_filter.h), built by --build or by catalogfs-index --where. A
+ * lookup maps the sidecars and checks the filter of every catalog with three
+ * byte reads, so hundreds of catalogs are checked in milliseconds. Only
+ * candidates (about 0.4% of catalogs without the file) are walked to print
+ * paths of matching entries as <catalog>/<relative path>.
+ *
+ * Names are matched as whole names with ASCII letters case-folded. A
+ * 64-digit hex argument is also matched against hashes of files.
+ *
+ * Catalogs without a sidecar, and catalogs changed after their sidecar was
+ * built, are always walked. A catalog directory has changed if the ctime of any
+ * of its directories differs from the one recorded in the sidecar (an entry was
+ * added, removed or renamed at any depth) or the state of catalogfs-index is
+ * newer than the sidecar. A single-file catalog has changed if it is newer
+ * than its sidecar. A mount drops the sidecar of its catalog directory on the
+ * first change, so records rewritten in place are noticed too.
+ *
+ * Exit code is 0 if something was found, 1 if nothing was found, 2 on errors.
+ */
+
+#include "header_common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch_loader.h"
+#include "byte_buffer.h"
+#include "catalog_db.h"
+#include "index_state.h"
+#include "where_filter.h"
+
+#include "log.h"
+
+/** Exit code: something was found */
+#define WHERE_EXIT_FOUND (0)
+/** Exit code: nothing was found */
+#define WHERE_EXIT_NOT_FOUND (1)
+/** Exit code: some error happened */
+#define WHERE_EXIT_ERROR (2)
+
+/** Page cache of single-file catalogs (in bytes) */
+#define WHERE_DB_CACHE_SIZE (64 * 1024 * 1024)
+
+/**
+ * State of a lookup
+ */
+struct where_lookup
+{
+	/** Searched name (or hash) */
+	const char *target;
+
+	/** The target is a SHA-256 hash too */
+	bool is_hash;
+
+	/** Key of the target as a name */
+	uint64_t name_key;
+
+	/** Key of the target as a hash */
+	uint64_t hash_key;
+
+	/** Only candidate catalogs are printed (they are not walked) */
+	bool filter_only;
+
+	/** Terminator of printed lines */
+	char terminator;
+
+	/** Path of the walked catalog */
+	const char *catalog_path;
+
+	/** Number of matching entries */
+	uint64_t matches;
+
+	/** Number of checked catalogs */
+	size_t catalogs;
+
+	/** Number of catalogs the filter could not rule out */
+	size_t candidates;
+
+	/** Number of catalogs without a usable filter */
+	size_t unfiltered;
+
+	/** Number of catalogs and entries that failed to be read */
+	size_t errors;
+};
+
+/**
+ * Print help
+ *
+ * @param program_name is the name of the program
+ */
+static void print_help(const char *program_name)
+{
+	PrintToStdoutF("usage: %s [options] <name|sha256> <catalog>...", program_name);
+	PrintToStdoutF("       %s --build [options] <catalog>...", program_name);
+	PrintToStdout("Prints paths of entries of the catalogs with the name (ASCII letters are");
+	PrintToStdout("case-folded) or with the SHA-256 (64 hex digits) as <catalog>/<path>.");
+	PrintToStdout("Sidecar filters let catalogs without the entry be skipped unread.");
+	PrintToStdout("Options:");
+	PrintToStdout("-b   --build               build (or rebuild) sidecar filters of the catalogs");
+	PrintToStdout("-f   --filter-only         print candidate catalogs only (no catalog is read)");
+	PrintToStdout("-0   --null                end lines with null characters instead of newlines");
+	PrintToStdout("-v   --verbose             report numbers and times to stderr");
+	PrintToStdout("-h   --help                show this help");
+}
+
+/**
+ * Get milliseconds of a monotonic clock
+ *
+ * @return the milliseconds
+ */
+static double monotonic_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+/**
+ * Check if the first time is later than the second one
+ *
+ * @param a is the first time
+ * @param b is the second time
+ * @return true if a is later than b
+ */
+static bool time_after(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/**
+ * Check if the path is a sidecar of a single-file catalog (globs like /catalogs/disk-* include them)
+ *
+ * @param path is the path of an argument
+ * @param stbuf is the stat of the path
+ * @return true if it should be skipped
+ */
+static bool is_db_sidecar(const char *path, const struct stat *stbuf)
+{
+	size_t len = strlen(path);
+	size_t suffix_len = strlen(WHERE_FILTER_DB_SUFFIX);
+	return S_ISREG(stbuf->st_mode) && len > suffix_len &&
+		   strcmp(path + len - suffix_len, WHERE_FILTER_DB_SUFFIX) == 0;
+}
+
+/**
+ * Make the path of the sidecar of a single-file catalog
+ *
+ * @param buf is the target buffer (null-terminated)
+ * @param catalog_path is the path of the catalog
+ * @return 0 on success, -ENOMEM on error
+ */
+static int db_sidecar_path(struct byte_buffer *buf, const char *catalog_path)
+{
+	buf->len = 0;
+	if (byte_buffer_append_format(buf, "%s%s", catalog_path, WHERE_FILTER_DB_SUFFIX) != 0 ||
+		byte_buffer_append(buf, "", 1) != 0)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * Build the sidecar of a catalog directory or of a single-file catalog
+ *
+ * @param catalog_path is the path of the catalog
+ * @param stbuf is the stat of the catalog
+ * @param loader is the batched loader (can be NULL)
+ * @param verbose determines if numbers are reported
+ * @param errors is incremented for every entry that failed to be read
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int build_sidecar(const char *catalog_path, const struct stat *stbuf, struct batch_loader *loader,
+						 bool verbose, size_t *errors)
+{
+	double start = monotonic_ms();
+	struct where_filter filter;
+	int res;
+	if (S_ISREG(stbuf->st_mode))
+	{
+		struct byte_buffer path = {NULL, 0, 0};
+		struct catalog_db *db;
+		res = db_sidecar_path(&path, catalog_path);
+		if (res == 0)
+			res = catalog_db_open(&db, catalog_path, WHERE_DB_CACHE_SIZE, false);
+		if (res == 0)
+		{
+			res = where_filter_rebuild_db(db, (const char *)path.data, &filter, errors);
+			int close_res = catalog_db_close(db);
+			if (res == 0 && close_res != 0)
+			{
+				where_filter_free(&filter);
+				res = close_res;
+			}
+		}
+		byte_buffer_free(&path);
+	}
+	else
+	{
+		int catalog_fd = open(catalog_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (catalog_fd == -1)
+			return -errno;
+		res = where_filter_rebuild_dir(catalog_fd, loader, &filter, errors);
+		(void)close(catalog_fd);
+	}
+
+	if (res != 0)
+		return res;
+
+	if (verbose)
+	{
+		PrintToStderrF("Built filter of %s: %" PRIu64 " names, %" PRIu64 " hashes, %" PRIu64
+					   " keys, %zu bytes in %.1f ms",
+					   catalog_path, filter.names, filter.hashes, filter.keys,
+					   WHERE_FILTER_PREFIX_SIZE + 3 * (size_t)filter.block_length + filter.dirs_size,
+					   monotonic_ms() - start);
+	}
+	where_filter_free(&filter);
+	return 0;
+}
+
+/**
+ * Print the matching entry (see where_walk_cb)
+ *
+ * @param ctx is the state of the lookup
+ * @param path is the relative path of the entry
+ * @param path_len is the length of the path
+ * @param name is the name of the entry
+ * @param stat is the metadata of the entry
+ * @return 0 to continue
+ */
+static int match_entry(void *ctx, const char *path, size_t path_len, const char *name, const struct filestat *stat)
+{
+	struct where_lookup *lookup = (struct where_lookup *)ctx;
+	if (strcasecmp(name, lookup->target) != 0 &&
+		!(lookup->is_hash && S_ISREG(stat->mode) && strcasecmp(stat->sha256, lookup->target) == 0))
+		return 0;
+
+	lookup->matches++;
+	fputs(lookup->catalog_path, stdout);
+	putchar('/');
+	fwrite(path, 1, path_len, stdout);
+	putchar(lookup->terminator);
+	return 0;
+}
+
+/**
+ * Check if the filter of a catalog may contain the target
+ *
+ * @param lookup is the state of the lookup
+ * @param catalog_path is the path of the catalog
+ * @param stbuf is the stat of the catalog
+ * @param verbose determines if catalogs without a fresh filter are reported
+ * @return true if the catalog is a candidate (always for catalogs without a fresh filter)
+ */
+static bool check_filter(struct where_lookup *lookup, const char *catalog_path, const struct stat *stbuf,
+						 bool verbose)
+{
+	struct where_filter filter;
+	struct stat filter_stbuf;
+	bool stale = false;
+	int res;
+	if (S_ISREG(stbuf->st_mode))
+	{
+		struct byte_buffer path = {NULL, 0, 0};
+		res = db_sidecar_path(&path, catalog_path);
+		if (res == 0)
+			res = where_filter_open(&filter, AT_FDCWD, (const char *)path.data, &filter_stbuf);
+		byte_buffer_free(&path);
+		if (res == 0)
+			stale = time_after(&stbuf->st_mtim, &filter_stbuf.st_mtim);
+	}
+	else
+	{
+		int catalog_fd = open(catalog_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (catalog_fd == -1)
+			return true;
+
+		res = where_filter_open(&filter, catalog_fd, WHERE_FILTER_FILE_NAME, &filter_stbuf);
+		struct stat state_stbuf;
+		if (res == 0)
+		{
+			stale = (fstatat(catalog_fd, INDEX_STATE_FILE_NAME, &state_stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+					 time_after(&state_stbuf.st_mtim, &filter_stbuf.st_mtim));
+
+			// Directories keep mtimes of the source, only their ctimes show changes (one stat per directory)
+			int check_res = (stale) ? 0 : where_filter_check_dirs(&filter, catalog_fd);
+			if (check_res == -ESTALE)
+			{
+				stale = true;
+			}
+			else if (check_res != 0)
+			{
+				where_filter_free(&filter);
+				res = check_res;
+			}
+		}
+		(void)close(catalog_fd);
+	}
+
+	if (res != 0 || stale)
+	{
+		if (res == 0)
+			where_filter_free(&filter);
+		if (verbose)
+		{
+			PrintToStderrF("%s filter, catalog is read: %s",
+						   (res == -ENOENT) ? "No" : (res == 0) ? "Outdated" : "Broken", catalog_path);
+		}
+		lookup->unfiltered++;
+		return true;
+	}
+
+	bool candidate = where_filter_contains(&filter, lookup->name_key) ||
+					 (lookup->is_hash && where_filter_contains(&filter, lookup->hash_key));
+	where_filter_free(&filter);
+	return candidate;
+}
+
+/**
+ * Walk a candidate catalog and print matching entries
+ *
+ * @param lookup is the state of the lookup
+ * @param catalog_path is the path of the catalog
+ * @param stbuf is the stat of the catalog
+ * @param loader is the batched loader (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int search_catalog(struct where_lookup *lookup, const char *catalog_path, const struct stat *stbuf,
+						  struct batch_loader *loader)
+{
+	lookup->catalog_path = catalog_path;
+	if (S_ISREG(stbuf->st_mode))
+	{
+		struct catalog_db *db;
+		int res = catalog_db_open(&db, catalog_path, WHERE_DB_CACHE_SIZE, false);
+		if (res != 0)
+			return res;
+		res = where_walk_db(db, match_entry, lookup, &lookup->errors);
+		int close_res = catalog_db_close(db);
+		return (res != 0) ? res : close_res;
+	}
+
+	int catalog_fd = open(catalog_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (catalog_fd == -1)
+		return -errno;
+	int res = where_walk_dir(catalog_fd, loader, NULL, match_entry, lookup, &lookup->errors);
+	(void)close(catalog_fd);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	bool build = false;
+	bool verbose = false;
+	struct where_lookup lookup;
+	memset(&lookup, 0, sizeof(struct where_lookup));
+	lookup.terminator = '\n';
+
+	static const struct option long_options[] = {
+		{"build", no_argument, NULL, 'b'},
+		{"filter-only", no_argument, NULL, 'f'},
+		{"null", no_argument, NULL, '0'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "bf0vh", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			build = true;
+			break;
+		case 'f':
+			lookup.filter_only = true;
+			break;
+		case '0':
+			lookup.terminator = '\0';
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return WHERE_EXIT_FOUND;
+		default:
+			print_help(argv[0]);
+			return WHERE_EXIT_ERROR;
+		}
+	}
+
+	int first_catalog = (build) ? optind : optind + 1;
+	if (argc - first_catalog < 1)
+	{
+		print_help(argv[0]);
+		return WHERE_EXIT_ERROR;
+	}
+
+	if (!build)
+	{
+		lookup.target = argv[optind];
+		lookup.name_key = where_filter_name_key(lookup.target, strlen(lookup.target));
+		lookup.is_hash = (where_filter_hash_key(lookup.target, &lookup.hash_key) == 0);
+	}
+
+	// The loader is optional, catalogs are read with usual system calls without it
+	struct batch_loader *loader = NULL;
+	(void)batch_loader_new(&loader, BATCH_LOADER_DEFAULT_DEPTH);
+
+	double start = monotonic_ms();
+	double filter_ms = 0;
+	for (int i = first_catalog; i < argc; i++)
+	{
+		const char *catalog_path = argv[i];
+		struct stat stbuf;
+		if (stat(catalog_path, &stbuf) != 0)
+		{
+			PrintToStderrF("Failed to open catalog: %s (path: %s)", strerror(errno), catalog_path);
+			lookup.errors++;
+			continue;
+		}
+		if (is_db_sidecar(catalog_path, &stbuf))
+			continue;
+
+		lookup.catalogs++;
+		if (build)
+		{
+			int res = build_sidecar(catalog_path, &stbuf, loader, verbose, &lookup.errors);
+			if (res != 0)
+			{
+				PrintToStderrF("Failed to build filter: %s (path: %s)", strerror(-res), catalog_path);
+				lookup.errors++;
+			}
+			continue;
+		}
+
+		double filter_start = monotonic_ms();
+		bool candidate = check_filter(&lookup, catalog_path, &stbuf, verbose);
+		filter_ms += monotonic_ms() - filter_start;
+		if (!candidate)
+			continue;
+
+		lookup.candidates++;
+		if (lookup.filter_only)
+		{
+			fputs(catalog_path, stdout);
+			putchar(lookup.terminator);
+			continue;
+		}
+
+		int res = search_catalog(&lookup, catalog_path, &stbuf, loader);
+		if (res != 0)
+		{
+			PrintToStderrF("Failed to read catalog: %s (path: %s)", strerror(-res), catalog_path);
+			lookup.errors++;
+		}
+	}
+
+	batch_loader_free(loader);
+
+	bool output_failed = (fflush(stdout) != 0 || ferror(stdout));
+	if (output_failed)
+		PrintToStderrF("Failed to write output: %s", strerror(errno));
+
+	if (lookup.unfiltered > 0 && !verbose)
+		PrintToStderrF("%zu catalogs have no fresh filter and were read (rebuild with --build)", lookup.unfiltered);
+
+	if (verbose && !build)
+	{
+		PrintToStderrF("Checked %zu catalogs in %.3f ms: %zu candidates (%zu without a fresh filter), %" PRIu64
+					   " matches in %.3f ms",
+					   lookup.catalogs, filter_ms, lookup.candidates, lookup.unfiltered, lookup.matches,
+					   monotonic_ms() - start);
+	}
+
+	if (output_failed || lookup.errors > 0)
+		return WHERE_EXIT_ERROR;
+	if (build)
+		return WHERE_EXIT_FOUND;
+	if (lookup.filter_only)
+		return (lookup.candidates > 0) ? WHERE_EXIT_FOUND : WHERE_EXIT_NOT_FOUND;
+	return (lookup.matches > 0) ? WHERE_EXIT_FOUND : WHERE_EXIT_NOT_FOUND;
+}
@@ -0,0 +1,156 @@
+#ifndef INC_CATALOGFS_VARINT_H
+#define INC_CATALOGFS_VARINT_H
+
+#include "header_common.h"
+
+#include <endian.h>
+
+/** Maximum length of encoded 64-bit varint in bytes */
+#define VARINT_MAX_LENGTH (10)
+
+/**
+ * Encode unsigned 64-bit value as LEB128 varint (7 bits per byte)
+ *
+ * @param buf is the target buffer (at least VARINT_MAX_LENGTH bytes)
+ * @param value is the value to encode
+ * @return number of written bytes
+ */
+static inline size_t varint_encode(uint8_t *buf, uint64_t value)
+{
+	size_t len = 0;
+	while (value >= 0x80)
+	{
+		buf[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (uint8_t)value;
+	return len;
+}
+
+/**
+ * Decode LEB128 varint
+ *
+ * @param pos is the pointer to the current position (moved past the value on success)
+ * @param end is the end of the buffer
+ * @param value is the decoded value
+ * @return 0 on success, -1 on truncated or too long value
+ */
+static inline int varint_decode(const uint8_t **pos, const uint8_t *end, uint64_t *value)
+{
+	const uint8_t *p = *pos;
+	uint64_t result = 0;
+	unsigned int shift = 0;
+
+	while (p < end && shift < 64)
+	{
+		uint8_t byte = *p++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			*pos = p;
+			*value = result;
+			return 0;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/**
+ * Map signed value to unsigned one, so small negative values stay small (zigzag)
+ *
+ * @param value is the signed value
+ * @return zigzag-encoded value
+ */
+static inline uint64_t zigzag_encode(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+/**
+ * Map zigzag-encoded value back to signed one
+ *
+ * @param value is the zigzag-encoded value
+ * @return signed value
+ */
+static inline int64_t zigzag_decode(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * Get difference of two values without signed overflow (wrapping arithmetic)
+ *
+ * @param a is the minuend
+ * @param b is the subtrahend
+ * @return a - b with wrapping
+ */
+static inline int64_t delta_encode(int64_t a, int64_t b)
+{
+	return (int64_t)((uint64_t)a - (uint64_t)b);
+}
+
+/**
+ * Restore a value from the base and the difference (wrapping arithmetic)
+ *
+ * @param base is the base value
+ * @param delta is the difference returned by delta_encode()
+ * @return base + delta with wrapping
+ */
+static inline int64_t delta_decode(int64_t base, int64_t delta)
+{
+	return (int64_t)((uint64_t)base + (uint64_t)delta);
+}
+
+/**
+ * Write 32-bit value in little-endian byte order
+ *
+ * @param buf is the target buffer
+ * @param value is the value
+ */
+static inline void write_le32(uint8_t *buf, uint32_t value)
+{
+	uint32_t le = htole32(value);
+	memcpy(buf, &le, sizeof(le));
+}
+
+/**
+ * Read 32-bit value in little-endian byte order
+ *
+ * @param buf is the source buffer
+ * @return the value
+ */
+static inline uint32_t read_le32(const uint8_t *buf)
+{
+	uint32_t le;
+	memcpy(&le, buf, sizeof(le));
+	return le32toh(le);
+}
+
+/**
+ * Write 64-bit value in little-endian byte order
+ *
+ * @param buf is the target buffer
+ * @param value is the value
+ */
+static inline void write_le64(uint8_t *buf, uint64_t value)
+{
+	uint64_t le = htole64(value);
+	memcpy(buf, &le, sizeof(le));
+}
+
+/**
+ * Read 64-bit value in little-endian byte order
+ *
+ * @param buf is the source buffer
+ * @return the value
+ */
+static inline uint64_t read_le64(const uint8_t *buf)
+{
+	uint64_t le;
+	memcpy(&le, buf, sizeof(le));
+	return le64toh(le);
+}
+
+#endif // INC_CATALOGFS_VARINT_H
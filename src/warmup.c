@@ -0,0 +1,801 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "warmup.h"
+#include "batch_loader.h"
+#include "catalog_dir.h"
+
+/** Number of traversed directories between checks of available memory */
+#define WARMUP_MEMORY_CHECK_INTERVAL (64)
+
+/** Warm-up stops when available memory is less than this percent of total memory */
+#define WARMUP_MIN_AVAILABLE_MEMORY_PERCENT (10)
+
+/** I/O priority constants of ioprio_set() (see linux/ioprio.h, not available everywhere) */
+#define WARMUP_IOPRIO_WHO_PROCESS (1)
+#define WARMUP_IOPRIO_CLASS_IDLE (3)
+#define WARMUP_IOPRIO_CLASS_SHIFT (13)
+
+/** Initial capacity of a deque of a worker */
+#define WARMUP_DEQUE_INITIAL_CAPACITY (256)
+
+/**
+ * Warm-up thread with its own deque of directories.
+ *
+ * The owner pushes subdirectories of the directory it has just read to the
+ * bottom of its deque and pops from the bottom too (depth first, in the order
+ * of inode numbers), idle workers steal from the top, that is the oldest
+ * directories closest to the root and so the biggest subtrees. A worker
+ * touches the lock of another deque only to steal, so threads rarely wait
+ * for each other.
+ */
+struct warmup_worker
+{
+	/** Warm-up */
+	struct warmup *warmup;
+
+	/** Thread */
+	pthread_t thread;
+
+	/** Lock of the deque */
+	pthread_mutex_t lock;
+
+	/** Ring buffer of relative paths of directories */
+	char **items;
+
+	/** Index of the top (the oldest item) */
+	size_t head;
+
+	/** Number of items */
+	size_t count;
+
+	/** Capacity of the ring buffer (power of 2) */
+	size_t capacity;
+
+	/** Number of traversed directories (atomic) */
+	uint64_t dirs_done;
+
+	/** Number of filestats put to the cache (atomic) */
+	uint64_t files_cached;
+
+	/** Number of entries that failed to be read (atomic) */
+	uint64_t errors;
+
+	/** State of the random choice of victims to steal from */
+	unsigned int seed;
+};
+
+/**
+ * Warm-up of the metadata cache
+ */
+struct warmup
+{
+	/** Source directory file descriptor */
+	int source_dir_fd;
+
+	/** Cache to fill */
+	struct metadata_cache *cache;
+
+	/** Lock for the state, the end time and sleeping of idle workers */
+	pthread_mutex_t lock;
+
+	/** Signaled when directories are queued for sleeping workers or the warm-up is stopped */
+	pthread_cond_t cond;
+
+	/** Current state (atomic, changed with the lock held) */
+	enum warmup_state state;
+
+	/** Number of directories queued in deques (atomic) */
+	uint64_t queued;
+
+	/** Number of directories queued or being traversed, zero means the end (atomic) */
+	uint64_t pending;
+
+	/** Number of workers waiting for directories (atomic) */
+	unsigned int sleeping;
+
+	/** Time (monotonic) of the start */
+	struct timespec started_at;
+
+	/** Time (monotonic) of the end (valid if state is not running) */
+	struct timespec finished_at;
+
+	/** Workers */
+	struct warmup_worker *workers;
+
+	/** Number of workers (with deques) */
+	unsigned int workers_count;
+
+	/** Number of started threads */
+	unsigned int threads_count;
+};
+
+/**
+ * Get seconds between two times
+ *
+ * @param from is the start time
+ * @param to is the end time
+ * @return seconds between times
+ */
+static double seconds_between(const struct timespec *from, const struct timespec *to)
+{
+	return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * Check if the system is low on available memory (by /proc/meminfo)
+ *
+ * @return true if available memory is low
+ */
+static bool system_memory_is_low(void)
+{
+	FILE *fp = fopen("/proc/meminfo", "re");
+	if (fp == NULL)
+		return false;
+
+	unsigned long long total = 0;
+	unsigned long long available = 0;
+	bool has_available = false;
+	char line[256];
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		unsigned long long value;
+		if (sscanf(line, "MemTotal: %llu kB", &value) == 1)
+		{
+			total = value;
+		}
+		else if (sscanf(line, "MemAvailable: %llu kB", &value) == 1)
+		{
+			available = value;
+			has_available = true;
+		}
+	}
+	(void)fclose(fp);
+
+	if (!has_available || total == 0)
+		return false;
+
+	return available * 100 < total * WARMUP_MIN_AVAILABLE_MEMORY_PERCENT;
+}
+
+/**
+ * Set the idle I/O priority for the calling thread (failures are ignored)
+ */
+static void set_idle_io_priority(void)
+{
+#ifdef SYS_ioprio_set
+	// Zero as who means the calling thread
+	(void)syscall(SYS_ioprio_set, WARMUP_IOPRIO_WHO_PROCESS, 0,
+				  WARMUP_IOPRIO_CLASS_IDLE << WARMUP_IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+/**
+ * Stop the warm-up with the state (the lock must be held)
+ *
+ * @param warmup is the warm-up
+ * @param state is the final state
+ */
+static void warmup_finish_locked(struct warmup *warmup, enum warmup_state state)
+{
+	if (warmup->state != WARMUP_STATE_RUNNING)
+		return;
+
+	__atomic_store_n(&warmup->state, state, __ATOMIC_SEQ_CST);
+	(void)clock_gettime(CLOCK_MONOTONIC, &warmup->finished_at);
+	pthread_cond_broadcast(&warmup->cond);
+}
+
+/**
+ * Stop the warm-up with the state
+ *
+ * @param warmup is the warm-up
+ * @param state is the final state
+ */
+static void warmup_finish(struct warmup *warmup, enum warmup_state state)
+{
+	pthread_mutex_lock(&warmup->lock);
+	warmup_finish_locked(warmup, state);
+	pthread_mutex_unlock(&warmup->lock);
+}
+
+/**
+ * Check if the warm-up is still running (without the lock)
+ *
+ * @param warmup is the warm-up
+ * @return true if it's running
+ */
+static bool warmup_is_running(struct warmup *warmup)
+{
+	return __atomic_load_n(&warmup->state, __ATOMIC_SEQ_CST) == WARMUP_STATE_RUNNING;
+}
+
+/**
+ * Push directories to the bottom of the deque of the worker and wake sleeping workers
+ *
+ * @param worker is the worker (the owner of the deque, or any worker before threads are started)
+ * @param paths is the array of relative paths of directories (ownership is taken)
+ * @param count is the number of paths
+ * @return number of paths that were not queued (they are freed)
+ */
+static size_t warmup_push(struct warmup_worker *worker, char **paths, size_t count)
+{
+	struct warmup *warmup = worker->warmup;
+	size_t pushed = 0;
+
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->count + count > worker->capacity)
+	{
+		size_t new_capacity = (worker->capacity == 0) ? WARMUP_DEQUE_INITIAL_CAPACITY : worker->capacity;
+		while (new_capacity < worker->count + count)
+			new_capacity *= 2;
+
+		char **new_items = (char **)malloc(new_capacity * sizeof(char *));
+		if (new_items != NULL)
+		{
+			for (size_t i = 0; i < worker->count; i++)
+			{
+				new_items[i] = worker->items[(worker->head + i) & (worker->capacity - 1)];
+			}
+			free(worker->items);
+			worker->items = new_items;
+			worker->head = 0;
+			worker->capacity = new_capacity;
+		}
+	}
+
+	for (; pushed < count && worker->count < worker->capacity; pushed++)
+	{
+		worker->items[(worker->head + worker->count) & (worker->capacity - 1)] = paths[pushed];
+		worker->count++;
+	}
+
+	// Directories become pending before they can be popped and finished by another worker
+	__atomic_add_fetch(&warmup->pending, pushed, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&warmup->queued, pushed, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&worker->lock);
+
+	for (size_t i = pushed; i < count; i++)
+	{
+		free(paths[i]);
+	}
+
+	// Pairs with the check of queued by a worker that is going to sleep
+	if (pushed > 0 && __atomic_load_n(&warmup->sleeping, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_mutex_lock(&warmup->lock);
+		pthread_cond_broadcast(&warmup->cond);
+		pthread_mutex_unlock(&warmup->lock);
+	}
+
+	return count - pushed;
+}
+
+/**
+ * Pop a directory from the bottom (own deque) or the top (another deque, stealing)
+ *
+ * @param worker is the worker the deque belongs to
+ * @param bottom is true for the owner and false for stealing
+ * @return relative path of the directory, NULL if the deque is empty
+ */
+static char *warmup_pop(struct warmup_worker *worker, bool bottom)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->count > 0)
+	{
+		if (bottom)
+		{
+			path = worker->items[(worker->head + worker->count - 1) & (worker->capacity - 1)];
+		}
+		else
+		{
+			path = worker->items[worker->head];
+			worker->head = (worker->head + 1) & (worker->capacity - 1);
+		}
+		worker->count--;
+		__atomic_sub_fetch(&worker->warmup->queued, 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return path;
+}
+
+/**
+ * Take the next directory: from the own deque or stolen from another worker
+ *
+ * @param worker is the worker
+ * @return relative path of the directory, NULL if all deques are empty
+ */
+static char *warmup_take(struct warmup_worker *worker)
+{
+	char *path = warmup_pop(worker, true);
+	if (path != NULL)
+		return path;
+
+	// Victims are tried from a random one, so thieves do not line up at the same deque
+	struct warmup *warmup = worker->warmup;
+	unsigned int start = (unsigned int)rand_r(&worker->seed);
+	for (unsigned int i = 0; i < warmup->workers_count && path == NULL; i++)
+	{
+		struct warmup_worker *victim = &warmup->workers[(start + i) % warmup->workers_count];
+		if (victim != worker)
+			path = warmup_pop(victim, false);
+	}
+
+	return path;
+}
+
+/**
+ * Join the directory path and the name
+ *
+ * @param dir_path is the relative path of the directory ("." for the source directory)
+ * @param name is the name
+ * @return allocated path, NULL on error
+ */
+static char *join_relpath(const char *dir_path, const char *name)
+{
+	if (strcmp(dir_path, ".") == 0)
+		return strdup(name);
+
+	size_t dir_len = strlen(dir_path);
+	size_t name_len = strlen(name);
+	char *path = (char *)malloc(dir_len + 1 + name_len + 1);
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, dir_path, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+/**
+ * Context of lookup_cached_filestat()
+ */
+struct warmup_lookup_ctx
+{
+	/** Warm-up */
+	struct warmup *warmup;
+
+	/** Relative path of the directory */
+	const char *dir_path;
+};
+
+/**
+ * Get the filestat of an entry from the cache, so files cached already
+ * (e.g. by the snapshot of the previous mount) are not read again
+ * (the lookup of warmup_process_dir(), see struct catalog_dir_lookup)
+ *
+ * @param ctx is the warmup_lookup_ctx
+ * @param name is the name of the entry
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the target filestat
+ * @return true if the filestat was found and is still valid
+ */
+static bool lookup_cached_filestat(void *ctx, const char *name, const struct stat *stbuf, struct filestat *my_stat)
+{
+	struct warmup_lookup_ctx *lookup_ctx = (struct warmup_lookup_ctx *)ctx;
+
+	char *path = join_relpath(lookup_ctx->dir_path, name);
+	if (path == NULL)
+		return false;
+
+	bool found = metadata_cache_get(lookup_ctx->warmup->cache, path, stbuf, my_stat);
+	free(path);
+	return found;
+}
+
+/**
+ * Compare subdirectories by inode numbers in descending order for qsort()
+ * (they are popped from the bottom of the deque in ascending order)
+ */
+static int compare_entries_by_ino_desc(const void *a, const void *b)
+{
+	const struct catalog_dir_entry *ea = *(const struct catalog_dir_entry *const *)a;
+	const struct catalog_dir_entry *eb = *(const struct catalog_dir_entry *const *)b;
+
+	if (ea->stbuf.st_ino < eb->stbuf.st_ino)
+		return 1;
+	if (ea->stbuf.st_ino > eb->stbuf.st_ino)
+		return -1;
+	return 0;
+}
+
+/**
+ * Traverse one directory: cache filestats of its files and queue its subdirectories
+ *
+ * @param worker is the worker
+ * @param loader is the batched loader of the thread (can be NULL)
+ * @param dir_path is the relative path of the directory
+ */
+static void warmup_process_dir(struct warmup_worker *worker, struct batch_loader *loader, const char *dir_path)
+{
+	struct warmup *warmup = worker->warmup;
+	size_t errors_count = 0;
+
+	int fd = openat(warmup->source_dir_fd, dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		__atomic_add_fetch(&worker->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct warmup_lookup_ctx lookup_ctx;
+	lookup_ctx.warmup = warmup;
+	lookup_ctx.dir_path = dir_path;
+
+	struct catalog_dir_lookup lookup;
+	lookup.get = lookup_cached_filestat;
+	lookup.ctx = &lookup_ctx;
+
+	struct catalog_dir dir;
+	int res = catalog_dir_load_lookup(fd, true, loader, &lookup, &dir, &errors_count);
+	(void)close(fd);
+
+	if (res != 0)
+	{
+		__atomic_add_fetch(&worker->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	// Files of the directory are put to the cache at once, subdirectories are queued at once
+	struct metadata_cache_item *items =
+		(struct metadata_cache_item *)malloc((dir.count + 1) * sizeof(struct metadata_cache_item));
+	struct catalog_dir_entry **subdirs =
+		(struct catalog_dir_entry **)malloc((dir.count + 1) * sizeof(struct catalog_dir_entry *));
+	size_t items_count = 0;
+	size_t subdirs_count = 0;
+
+	for (size_t i = 0; i < dir.count && items != NULL; i++)
+	{
+		struct catalog_dir_entry *entry = &dir.entries[i];
+
+		if (catalog_dir_entry_is_dir(entry))
+		{
+			if (subdirs != NULL)
+				subdirs[subdirs_count++] = entry;
+			continue;
+		}
+
+		// Manifests are read as a whole by the filesystem, their entries need no cache
+		if (!entry->has_filestat || entry->from_manifest || entry->from_lookup)
+			continue;
+
+		char *path = join_relpath(dir_path, entry->name);
+		if (path == NULL)
+		{
+			errors_count++;
+			continue;
+		}
+
+		items[items_count].relpath = path;
+		items[items_count].stbuf = &entry->stbuf;
+		items[items_count].my_stat = &entry->my_stat;
+		items_count++;
+	}
+
+	if ((items == NULL || subdirs == NULL) && dir.count > 0)
+		errors_count++;
+
+	size_t files_cached = 0;
+	res = metadata_cache_put_many(warmup->cache, items, items_count, &files_cached);
+	bool cache_full = (res == -ENOSPC);
+	if (res != 0 && !cache_full)
+		errors_count++;
+
+	for (size_t i = 0; i < items_count; i++)
+	{
+		free((char *)items[i].relpath);
+	}
+	free(items);
+
+	if (!cache_full && subdirs_count > 0)
+	{
+		qsort(subdirs, subdirs_count, sizeof(struct catalog_dir_entry *), compare_entries_by_ino_desc);
+
+		// Paths replace entries in the same array, failed ones are dropped
+		char **paths = (char **)subdirs;
+		size_t paths_count = 0;
+		for (size_t i = 0; i < subdirs_count; i++)
+		{
+			char *path = join_relpath(dir_path, subdirs[i]->name);
+			if (path != NULL)
+				paths[paths_count++] = path;
+			else
+				errors_count++;
+		}
+
+		errors_count += warmup_push(worker, paths, paths_count);
+	}
+
+	__atomic_add_fetch(&worker->files_cached, files_cached, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&worker->errors, errors_count, __ATOMIC_RELAXED);
+
+	if (cache_full)
+		warmup_finish(warmup, WARMUP_STATE_CACHE_FULL);
+
+	free(subdirs);
+	catalog_dir_free(&dir);
+}
+
+/**
+ * Wait until directories are queued or there is nothing more to do
+ *
+ * @param warmup is the warm-up
+ * @return true if directories may be queued, false if the warm-up is over
+ */
+static bool warmup_wait(struct warmup *warmup)
+{
+	pthread_mutex_lock(&warmup->lock);
+
+	// Pairs with the check of sleeping in warmup_push()
+	__atomic_add_fetch(&warmup->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	while (warmup->state == WARMUP_STATE_RUNNING &&
+		   __atomic_load_n(&warmup->queued, __ATOMIC_SEQ_CST) == 0 &&
+		   __atomic_load_n(&warmup->pending, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_cond_wait(&warmup->cond, &warmup->lock);
+	}
+
+	__atomic_sub_fetch(&warmup->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	// Nothing is queued and nobody can queue more
+	if (warmup->state == WARMUP_STATE_RUNNING && __atomic_load_n(&warmup->pending, __ATOMIC_SEQ_CST) == 0)
+		warmup_finish_locked(warmup, WARMUP_STATE_FINISHED);
+
+	bool running = (warmup->state == WARMUP_STATE_RUNNING);
+
+	pthread_mutex_unlock(&warmup->lock);
+
+	return running;
+}
+
+/**
+ * Warm-up thread function
+ *
+ * @param arg is the warm-up worker
+ * @return NULL
+ */
+static void *warmup_thread(void *arg)
+{
+	struct warmup_worker *worker = (struct warmup_worker *)arg;
+	struct warmup *warmup = worker->warmup;
+
+	set_idle_io_priority();
+
+	// The loader is optional: without it (ENOMEM) directories are loaded synchronously
+	struct batch_loader *loader = NULL;
+	if (batch_loader_new(&loader, BATCH_LOADER_DEFAULT_DEPTH) != 0)
+		loader = NULL;
+
+	uint64_t dirs_done = 0;
+
+	while (warmup_is_running(warmup))
+	{
+		char *path = warmup_take(worker);
+		if (path == NULL)
+		{
+			if (!warmup_wait(warmup))
+				break;
+			continue;
+		}
+
+		warmup_process_dir(worker, loader, path);
+		free(path);
+
+		__atomic_add_fetch(&worker->dirs_done, 1, __ATOMIC_RELAXED);
+		if (__atomic_sub_fetch(&warmup->pending, 1, __ATOMIC_SEQ_CST) == 0)
+		{
+			// The last directory is done, wake sleeping workers to finish
+			warmup_finish(warmup, WARMUP_STATE_FINISHED);
+			break;
+		}
+
+		if (++dirs_done % WARMUP_MEMORY_CHECK_INTERVAL == 0)
+		{
+			if (system_memory_is_low())
+				warmup_finish(warmup, WARMUP_STATE_MEMORY_PRESSURE);
+			else if (metadata_cache_is_full(warmup->cache))
+				warmup_finish(warmup, WARMUP_STATE_CACHE_FULL);
+		}
+	}
+
+	batch_loader_free(loader);
+
+	return NULL;
+}
+
+/**
+ * Free the warm-up memory (threads must be joined)
+ *
+ * @param warmup is the warm-up
+ */
+static void warmup_free(struct warmup *warmup)
+{
+	for (unsigned int i = 0; i < warmup->workers_count; i++)
+	{
+		struct warmup_worker *worker = &warmup->workers[i];
+		for (size_t j = 0; j < worker->count; j++)
+		{
+			free(worker->items[(worker->head + j) & (worker->capacity - 1)]);
+		}
+		free(worker->items);
+		pthread_mutex_destroy(&worker->lock);
+	}
+	free(warmup->workers);
+	pthread_cond_destroy(&warmup->cond);
+	pthread_mutex_destroy(&warmup->lock);
+	free(warmup);
+}
+
+/**
+ * Start warm-up threads
+ *
+ * @param warmup is the result (must be stopped by warmup_stop())
+ * @param source_dir_fd is the source directory file descriptor (must outlive the warm-up)
+ * @param cache is the cache to fill (must outlive the warm-up)
+ * @param threads_count is the number of threads
+ * @return 0 on success, nonzero value on error
+ */
+int warmup_start(struct warmup **warmup, int source_dir_fd, struct metadata_cache *cache, unsigned int threads_count)
+{
+	*warmup = NULL;
+
+	if (threads_count == 0)
+		return -EINVAL;
+
+	struct warmup *result = (struct warmup *)calloc(1, sizeof(struct warmup));
+	if (result == NULL)
+		return -ENOMEM;
+
+	result->source_dir_fd = source_dir_fd;
+	result->cache = cache;
+	result->state = WARMUP_STATE_RUNNING;
+	(void)clock_gettime(CLOCK_MONOTONIC, &result->started_at);
+
+	if (pthread_mutex_init(&result->lock, NULL) != 0)
+	{
+		free(result);
+		return -ENOMEM;
+	}
+
+	if (pthread_cond_init(&result->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&result->lock);
+		free(result);
+		return -ENOMEM;
+	}
+
+	result->workers = (struct warmup_worker *)calloc(threads_count, sizeof(struct warmup_worker));
+	if (result->workers == NULL)
+	{
+		warmup_free(result);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < threads_count; i++)
+	{
+		struct warmup_worker *worker = &result->workers[i];
+		if (pthread_mutex_init(&worker->lock, NULL) != 0)
+		{
+			warmup_free(result);
+			return -ENOMEM;
+		}
+		worker->warmup = result;
+		worker->seed = i + 1;
+		result->workers_count++;
+	}
+
+	// Traversal starts from the source directory itself
+	char *root = strdup(".");
+	if (root == NULL || warmup_push(&result->workers[0], &root, 1) != 0)
+	{
+		warmup_free(result);
+		return -ENOMEM;
+	}
+
+	// Deques of workers whose threads failed to start are emptied by stealing
+	for (unsigned int i = 0; i < threads_count; i++)
+	{
+		if (pthread_create(&result->workers[i].thread, NULL, warmup_thread, &result->workers[i]) != 0)
+			break;
+		result->threads_count++;
+	}
+
+	if (result->threads_count == 0)
+	{
+		warmup_free(result);
+		return -EAGAIN;
+	}
+
+	*warmup = result;
+	return 0;
+}
+
+/**
+ * Get the progress of the warm-up
+ *
+ * @param warmup is the warm-up
+ * @param progress is the target progress
+ */
+void warmup_get_progress(struct warmup *warmup, struct warmup_progress *progress)
+{
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// Counters of workers are summed without stopping them
+	progress->dirs_done = 0;
+	progress->files_cached = 0;
+	progress->errors = 0;
+	for (unsigned int i = 0; i < warmup->workers_count; i++)
+	{
+		progress->dirs_done += __atomic_load_n(&warmup->workers[i].dirs_done, __ATOMIC_RELAXED);
+		progress->files_cached += __atomic_load_n(&warmup->workers[i].files_cached, __ATOMIC_RELAXED);
+		progress->errors += __atomic_load_n(&warmup->workers[i].errors, __ATOMIC_RELAXED);
+	}
+	progress->dirs_queued = __atomic_load_n(&warmup->queued, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&warmup->lock);
+
+	progress->state = warmup->state;
+	progress->elapsed = seconds_between(&warmup->started_at,
+										(warmup->state == WARMUP_STATE_RUNNING) ? &now : &warmup->finished_at);
+
+	pthread_mutex_unlock(&warmup->lock);
+}
+
+/**
+ * Get the name of the state
+ *
+ * @param state is the state
+ * @return name of the state
+ */
+const char *warmup_state_name(enum warmup_state state)
+{
+	switch (state)
+	{
+	case WARMUP_STATE_RUNNING:
+		return "running";
+	case WARMUP_STATE_FINISHED:
+		return "finished";
+	case WARMUP_STATE_CACHE_FULL:
+		return "stopped (cache is full)";
+	case WARMUP_STATE_MEMORY_PRESSURE:
+		return "stopped (memory pressure)";
+	case WARMUP_STATE_CANCELLED:
+		return "cancelled";
+	}
+	return "unknown";
+}
+
+/**
+ * Stop warm-up threads (if still running), wait for them and free the warm-up
+ *
+ * @param warmup is the warm-up (can be NULL)
+ */
+void warmup_stop(struct warmup *warmup)
+{
+	if (warmup == NULL)
+		return;
+
+	warmup_finish(warmup, WARMUP_STATE_CANCELLED);
+
+	for (unsigned int i = 0; i < warmup->threads_count; i++)
+	{
+		(void)pthread_join(warmup->workers[i].thread, NULL);
+	}
+
+	warmup_free(warmup);
+}
@@ -0,0 +1,107 @@
+#ifndef INC_CATALOGFS_WARMUP_H
+#define INC_CATALOGFS_WARMUP_H
+
+#include "header_common.h"
+
+#include "metadata_cache.h"
+
+/**
+ * Background warm-up of the metadata cache after mount.
+ *
+ * On a cold HDD the first walk over a mounted catalog (e.g. `du`) is
+ * dominated by random seeks for thousands of tiny filestat files.
+ * Warm-up threads traverse the source directory in advance with the idle
+ * I/O priority, read entries of every directory in the order of inode numbers
+ * (see catalog_dir_load()) and put parsed filestats to the metadata cache,
+ * so the first user-visible walk is already hot.
+ *
+ * Every thread has its own deque of directories and idle threads steal
+ * the oldest directories (the biggest subtrees) from other deques, files of
+ * a directory are put to the cache with one lock (see metadata_cache_put_many()),
+ * so threads rarely wait for each other and a walk of a catalog on an SSD
+ * scales with the number of threads.
+ *
+ * Warm-up stops when the metadata cache is full or when the system is low
+ * on available memory.
+ */
+
+/** Default number of warm-up threads */
+#define WARMUP_DEFAULT_THREADS (2)
+
+/** Maximum number of warm-up threads */
+#define WARMUP_MAX_THREADS (256)
+
+/**
+ * State of the warm-up
+ */
+enum warmup_state
+{
+	WARMUP_STATE_RUNNING,
+	WARMUP_STATE_FINISHED,
+	WARMUP_STATE_CACHE_FULL,
+	WARMUP_STATE_MEMORY_PRESSURE,
+	WARMUP_STATE_CANCELLED
+};
+
+/**
+ * Progress of the warm-up
+ */
+struct warmup_progress
+{
+	/** Current state */
+	enum warmup_state state;
+
+	/** Number of traversed directories */
+	uint64_t dirs_done;
+
+	/** Number of directories waiting in the queue */
+	uint64_t dirs_queued;
+
+	/** Number of filestats put to the cache */
+	uint64_t files_cached;
+
+	/** Number of entries that failed to be read */
+	uint64_t errors;
+
+	/** Seconds since the start */
+	double elapsed;
+};
+
+// Forward declaration
+struct warmup;
+
+/**
+ * Start warm-up threads
+ *
+ * @param warmup is the result (must be stopped by warmup_stop())
+ * @param source_dir_fd is the source directory file descriptor (must outlive the warm-up)
+ * @param cache is the cache to fill (must outlive the warm-up)
+ * @param threads_count is the number of threads
+ * @return 0 on success, nonzero value on error
+ */
+int warmup_start(struct warmup **warmup, int source_dir_fd, struct metadata_cache *cache, unsigned int threads_count);
+
+/**
+ * Get the progress of the warm-up
+ *
+ * @param warmup is the warm-up
+ * @param progress is the target progress
+ */
+void warmup_get_progress(struct warmup *warmup, struct warmup_progress *progress);
+
+/**
+ * Get the name of the state
+ *
+ * @param state is the state
+ * @return name of the state
+ */
+const char *warmup_state_name(enum warmup_state state);
+
+/**
+ * Stop warm-up threads (if still running), wait for them and free the warm-up
+ *
+ * @param warmup is the warm-up (can be NULL)
+ */
+void warmup_stop(struct warmup *warmup);
+
+#endif // INC_CATALOGFS_WARMUP_H
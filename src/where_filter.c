@@ -0,0 +1,1024 @@
+#include "header_common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "where_filter.h"
+
+#include "byte_buffer.h"
+#include "catalog_db.h"
+#include "catalog_dir.h"
+#include "varint.h"
+
+/** Length of the header of the sidecar */
+#define WHERE_FILTER_HEADER_LENGTH (sizeof(WHERE_FILTER_HEADER) - 1)
+
+/** Tag of keys of names */
+#define WHERE_FILTER_TAG_NAME ('n')
+
+/** Tag of keys of hashes */
+#define WHERE_FILTER_TAG_HASH ('h')
+
+/** Number of hex digits of a SHA-256 hash */
+#define WHERE_FILTER_SHA256_DIGITS (64)
+
+/**
+ * Mix bits of a 64-bit value (the finalizer of MurmurHash3, a bijection)
+ *
+ * @param value is the value
+ * @return the mixed value
+ */
+static uint64_t mix64(uint64_t value)
+{
+	value ^= value >> 33;
+	value *= 0xff51afd7ed558ccdULL;
+	value ^= value >> 33;
+	value *= 0xc4ceb9fe1a85ec53ULL;
+	value ^= value >> 33;
+	return value;
+}
+
+/**
+ * Get the next seed (splitmix64)
+ *
+ * @param state is the state of the generator
+ * @return the seed
+ */
+static uint64_t next_seed(uint64_t *state)
+{
+	*state += 0x9e3779b97f4a7c15ULL;
+	return mix64(*state);
+}
+
+/**
+ * Rotate a 64-bit value left
+ *
+ * @param value is the value
+ * @param bits is the number of bits (1-63)
+ * @return the rotated value
+ */
+static uint64_t rotl64(uint64_t value, unsigned int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * Map a 32-bit hash to [0, range) without a division
+ *
+ * @param hash is the hash
+ * @param range is the size of the range
+ * @return the value in the range
+ */
+static uint32_t reduce32(uint32_t hash, uint32_t range)
+{
+	return (uint32_t)(((uint64_t)hash * range) >> 32);
+}
+
+/**
+ * Get the three slots of a hash (one in each block)
+ *
+ * @param hash is the hash of a key
+ * @param block_length is the number of slots of one block
+ * @param slots is the target slots
+ */
+static void get_slots(uint64_t hash, uint32_t block_length, uint32_t slots[3])
+{
+	slots[0] = reduce32((uint32_t)hash, block_length);
+	slots[1] = reduce32((uint32_t)rotl64(hash, 21), block_length) + block_length;
+	slots[2] = reduce32((uint32_t)rotl64(hash, 42), block_length) + 2 * block_length;
+}
+
+/**
+ * Get the fingerprint of a hash
+ *
+ * @param hash is the hash of a key
+ * @return the fingerprint
+ */
+static uint8_t get_fingerprint(uint64_t hash)
+{
+	return (uint8_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Hash a tagged string (64-bit FNV-1a, mixed to spread the bits)
+ *
+ * @param tag is the tag of the kind of the key
+ * @param str is the string
+ * @param len is the length of the string
+ * @return the key
+ */
+static uint64_t tagged_key(char tag, const char *str, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	hash ^= (uint8_t)tag;
+	hash *= 1099511628211ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t c = (uint8_t)str[i];
+		if (c >= 'A' && c <= 'Z')
+			c = (uint8_t)(c - 'A' + 'a');
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return mix64(hash);
+}
+
+/**
+ * Get the key of a name (ASCII letters are case-folded, other bytes are kept as they are)
+ *
+ * @param name is the name (not a path)
+ * @param name_len is the length of the name
+ * @return the key
+ */
+uint64_t where_filter_name_key(const char *name, size_t name_len)
+{
+	return tagged_key(WHERE_FILTER_TAG_NAME, name, name_len);
+}
+
+/**
+ * Get the key of a SHA-256 hash
+ *
+ * @param sha256 is the hash in hex (any case)
+ * @param key is the key
+ * @return 0 on success, -EINVAL if it's not 64 hex digits
+ */
+int where_filter_hash_key(const char *sha256, uint64_t *key)
+{
+	size_t len = strlen(sha256);
+	if (len != WHERE_FILTER_SHA256_DIGITS || strspn(sha256, "0123456789abcdefABCDEF") != len)
+		return -EINVAL;
+
+	*key = tagged_key(WHERE_FILTER_TAG_HASH, sha256, len);
+	return 0;
+}
+
+/**
+ * Append a key
+ *
+ * @param keys is the array of keys
+ * @param key is the key
+ * @return 0 on success, -ENOMEM on error
+ */
+static int keys_push(struct where_keys *keys, uint64_t key)
+{
+	if (keys->count == keys->capacity)
+	{
+		size_t capacity = (keys->capacity == 0) ? 1024 : keys->capacity * 2;
+		uint64_t *array = (uint64_t *)realloc(keys->keys, capacity * sizeof(uint64_t));
+		if (array == NULL)
+			return -ENOMEM;
+		keys->keys = array;
+		keys->capacity = capacity;
+	}
+
+	keys->keys[keys->count++] = key;
+	return 0;
+}
+
+/**
+ * Add a name and optionally a hash of an entry
+ *
+ * @param keys is the array of keys (zeroed before the first call)
+ * @param name is the name of the entry
+ * @param sha256 is the hash of the file in hex (NULL or empty if unknown)
+ * @return 0 on success, -ENOMEM on error
+ */
+int where_keys_add_entry(struct where_keys *keys, const char *name, const char *sha256)
+{
+	if (keys_push(keys, where_filter_name_key(name, strlen(name))) != 0)
+		return -ENOMEM;
+	keys->names++;
+
+	uint64_t key;
+	if (sha256 != NULL && where_filter_hash_key(sha256, &key) == 0)
+	{
+		if (keys_push(keys, key) != 0)
+			return -ENOMEM;
+		keys->hashes++;
+	}
+
+	return 0;
+}
+
+/**
+ * Free the array of keys
+ *
+ * @param keys is the array of keys
+ */
+void where_keys_free(struct where_keys *keys)
+{
+	free(keys->keys);
+	memset(keys, 0, sizeof(struct where_keys));
+}
+
+/**
+ * Compare two keys (for qsort())
+ *
+ * @param a is the first key
+ * @param b is the second key
+ * @return negative, zero or positive value
+ */
+static int compare_keys(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Try to assign fingerprints with one seed (peeling of the 3-partite hypergraph)
+ *
+ * @param keys are the distinct keys
+ * @param count is the number of keys
+ * @param seed is the seed
+ * @param block_length is the number of slots of one block
+ * @param fingerprints is the target array (zeroed, 3 * block_length)
+ * @return 0 if all keys were peeled and fingerprints are assigned, -EAGAIN if the seed failed, -ENOMEM on error
+ */
+static int try_seed(const uint64_t *keys, size_t count, uint64_t seed, uint32_t block_length, uint8_t *fingerprints)
+{
+	size_t capacity = 3 * (size_t)block_length;
+	uint64_t *xors = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+	uint32_t *counts = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+	uint32_t *queue = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+	uint64_t *stack_hashes = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+	uint32_t *stack_slots = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+	int res = -ENOMEM;
+	if (xors == NULL || counts == NULL || queue == NULL || stack_hashes == NULL || stack_slots == NULL)
+		goto out;
+
+	// Every slot knows the number of its keys and the xor of their hashes
+	uint32_t slots[3];
+	for (size_t i = 0; i < count; i++)
+	{
+		uint64_t hash = mix64(keys[i] + seed);
+		get_slots(hash, block_length, slots);
+		for (int j = 0; j < 3; j++)
+		{
+			counts[slots[j]]++;
+			xors[slots[j]] ^= hash;
+		}
+	}
+
+	// A slot with one key is peeled: the key is removed from its other slots
+	size_t queue_len = 0;
+	for (size_t i = 0; i < capacity; i++)
+	{
+		if (counts[i] == 1)
+			queue[queue_len++] = (uint32_t)i;
+	}
+
+	size_t stack_len = 0;
+	while (queue_len > 0)
+	{
+		uint32_t slot = queue[--queue_len];
+		if (counts[slot] != 1)
+			continue;
+
+		uint64_t hash = xors[slot];
+		stack_hashes[stack_len] = hash;
+		stack_slots[stack_len] = slot;
+		stack_len++;
+
+		get_slots(hash, block_length, slots);
+		for (int j = 0; j < 3; j++)
+		{
+			counts[slots[j]]--;
+			xors[slots[j]] ^= hash;
+			if (counts[slots[j]] == 1)
+				queue[queue_len++] = slots[j];
+		}
+	}
+
+	res = -EAGAIN;
+	if (stack_len != count)
+		goto out;
+
+	// Keys are assigned in reverse order, so the slot of every key is still free
+	while (stack_len > 0)
+	{
+		stack_len--;
+		uint64_t hash = stack_hashes[stack_len];
+		get_slots(hash, block_length, slots);
+		fingerprints[stack_slots[stack_len]] =
+			get_fingerprint(hash) ^ fingerprints[slots[0]] ^ fingerprints[slots[1]] ^ fingerprints[slots[2]];
+	}
+	res = 0;
+
+out:
+	free(xors);
+	free(counts);
+	free(queue);
+	free(stack_hashes);
+	free(stack_slots);
+	return res;
+}
+
+/**
+ * Build a filter of the keys
+ *
+ * @param filter is the new filter (must be freed by where_filter_free())
+ * @param keys is the array of keys (sorted and deduplicated by the call)
+ * @return 0 on success, -ENOMEM on error, -EAGAIN if no seed worked (should never happen)
+ */
+int where_filter_build(struct where_filter *filter, struct where_keys *keys)
+{
+	memset(filter, 0, sizeof(struct where_filter));
+
+	// The same name in many directories is one key, and duplicates can't be peeled
+	if (keys->count > 0)
+	{
+		qsort(keys->keys, keys->count, sizeof(uint64_t), compare_keys);
+		size_t unique = 1;
+		for (size_t i = 1; i < keys->count; i++)
+		{
+			if (keys->keys[i] != keys->keys[unique - 1])
+				keys->keys[unique++] = keys->keys[i];
+		}
+		keys->count = unique;
+	}
+
+	size_t capacity = 32 + (size_t)(1.23 * (double)keys->count);
+	if (capacity / 3 > UINT32_MAX)
+		return -ENOMEM;
+
+	uint32_t block_length = (uint32_t)(capacity / 3);
+	uint8_t *fingerprints = (uint8_t *)malloc(3 * (size_t)block_length);
+	if (fingerprints == NULL)
+		return -ENOMEM;
+
+	// The seed depends on the keys only, so the same catalog gives the same sidecar
+	uint64_t state = keys->count;
+	int res = -EAGAIN;
+	for (int i = 0; i < WHERE_FILTER_MAX_TRIES && res == -EAGAIN; i++)
+	{
+		uint64_t seed = next_seed(&state);
+		memset(fingerprints, 0, 3 * (size_t)block_length);
+		res = try_seed(keys->keys, keys->count, seed, block_length, fingerprints);
+		if (res == 0)
+		{
+			filter->seed = seed;
+			filter->block_length = block_length;
+			filter->fingerprints = fingerprints;
+			filter->names = keys->names;
+			filter->hashes = keys->hashes;
+			filter->keys = keys->count;
+			return 0;
+		}
+	}
+
+	free(fingerprints);
+	return res;
+}
+
+/**
+ * Check if the key may be in the filter
+ *
+ * @param filter is the filter
+ * @param key is the key
+ * @return false if the key is definitely not in the filter
+ */
+bool where_filter_contains(const struct where_filter *filter, uint64_t key)
+{
+	// Fingerprints of an empty filter are zeros, which would match 1/256 of keys
+	if (filter->keys == 0)
+		return false;
+
+	uint64_t hash = mix64(key + filter->seed);
+	uint32_t slots[3];
+	get_slots(hash, filter->block_length, slots);
+	const uint8_t *f = filter->fingerprints;
+	return get_fingerprint(hash) == (f[slots[0]] ^ f[slots[1]] ^ f[slots[2]]);
+}
+
+/**
+ * Write the whole buffer to the file
+ *
+ * @param fd is the file descriptor
+ * @param data is the buffer
+ * @param size is the size of the buffer
+ * @return 0 on success, negative value on error
+ */
+static int write_all(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0)
+	{
+		ssize_t res = write(fd, p, size);
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += res;
+		size -= (size_t)res;
+	}
+
+	return 0;
+}
+
+/**
+ * Check if two times are the same
+ *
+ * @param a is the first time
+ * @param b is the second time
+ * @return true if they are equal
+ */
+static bool same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * Encode the ctime of the root (u32 nanoseconds and u64 seconds of the prefix)
+ *
+ * @param pos is the target (12 bytes)
+ * @param ctime is the ctime
+ */
+static void write_root_ctime(uint8_t *pos, const struct timespec *ctime)
+{
+	write_le32(pos, (uint32_t)ctime->tv_nsec);
+	write_le64(pos + 4, (uint64_t)ctime->tv_sec);
+}
+
+/**
+ * Write the whole filter to a new sidecar and sync it
+ *
+ * @param filter is the filter
+ * @param fd is the file descriptor of the sidecar (empty)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int write_sidecar(const struct where_filter *filter, int fd)
+{
+	uint8_t prefix[WHERE_FILTER_PREFIX_SIZE];
+	uint8_t *pos = prefix;
+	memcpy(pos, WHERE_FILTER_HEADER, WHERE_FILTER_HEADER_LENGTH);
+	pos += WHERE_FILTER_HEADER_LENGTH;
+	write_le64(pos, filter->seed);
+	write_le32(pos + 8, filter->block_length);
+	write_root_ctime(pos + 12, &filter->root_ctime);
+	write_le64(pos + 24, filter->names);
+	write_le64(pos + 32, filter->hashes);
+	write_le64(pos + 40, filter->keys);
+	write_le64(pos + 48, filter->dirs_size);
+
+	int res = write_all(fd, prefix, sizeof(prefix));
+	if (res == 0)
+		res = write_all(fd, filter->fingerprints, 3 * (size_t)filter->block_length);
+	if (res == 0 && filter->dirs_size > 0)
+		res = write_all(fd, filter->dirs, filter->dirs_size);
+	if (res == 0 && fdatasync(fd) == -1)
+		res = -errno;
+	return res;
+}
+
+/**
+ * Write the filter to a sidecar (through the temporary file and rename())
+ *
+ * @param filter is the filter
+ * @param dir_fd is the descriptor of the directory of the sidecar
+ * @param name is the name of the sidecar
+ * @param tmp_name is the name of the temporary file
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_save(const struct where_filter *filter, int dir_fd, const char *name, const char *tmp_name)
+{
+	int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	int res = write_sidecar(filter, fd);
+	if (res == 0 && renameat(dir_fd, tmp_name, dir_fd, name) == -1)
+		res = -errno;
+
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+	if (res != 0)
+		(void)unlinkat(dir_fd, tmp_name, 0);
+	return res;
+}
+
+/**
+ * Map the filter of a sidecar
+ *
+ * @param filter is the filter (must be freed by where_filter_free())
+ * @param dir_fd is the descriptor of the directory of the sidecar
+ * @param name is the name of the sidecar
+ * @param stbuf is the stat of the sidecar (can be NULL)
+ * @return 0 on success, -ENOENT if there is no sidecar, -EINVAL for a broken one,
+ *         other negative value (mostly -errno) on error
+ */
+int where_filter_open(struct where_filter *filter, int dir_fd, const char *name, struct stat *stbuf)
+{
+	memset(filter, 0, sizeof(struct where_filter));
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		int errno_stored = errno;
+		(void)close(fd);
+		return -errno_stored;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size < (off_t)WHERE_FILTER_PREFIX_SIZE)
+	{
+		(void)close(fd);
+		return -EINVAL;
+	}
+
+	size_t size = (size_t)st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	const uint8_t *pos = (const uint8_t *)map;
+	if (memcmp(pos, WHERE_FILTER_HEADER, WHERE_FILTER_HEADER_LENGTH) != 0)
+	{
+		(void)munmap(map, size);
+		return -EINVAL;
+	}
+
+	pos += WHERE_FILTER_HEADER_LENGTH;
+	uint32_t block_length = read_le32(pos + 8);
+	uint64_t dirs_size = read_le64(pos + 48);
+	size_t fingerprints_size = 3 * (size_t)block_length;
+	const uint8_t *dirs = (const uint8_t *)map + WHERE_FILTER_PREFIX_SIZE + fingerprints_size;
+	if (block_length == 0 || size - WHERE_FILTER_PREFIX_SIZE < fingerprints_size ||
+		size - WHERE_FILTER_PREFIX_SIZE - fingerprints_size != dirs_size ||
+		(dirs_size > 0 && dirs[dirs_size - 1] != '\0'))
+	{
+		(void)munmap(map, size);
+		return -EINVAL;
+	}
+
+	filter->seed = read_le64(pos);
+	filter->block_length = block_length;
+	filter->root_ctime.tv_nsec = (long)read_le32(pos + 12);
+	filter->root_ctime.tv_sec = (time_t)read_le64(pos + 16);
+	filter->names = read_le64(pos + 24);
+	filter->hashes = read_le64(pos + 32);
+	filter->keys = read_le64(pos + 40);
+	filter->fingerprints = (const uint8_t *)map + WHERE_FILTER_PREFIX_SIZE;
+	filter->dirs = dirs;
+	filter->dirs_size = (size_t)dirs_size;
+	filter->map = map;
+	filter->map_size = size;
+
+	if (stbuf != NULL)
+		*stbuf = st;
+	return 0;
+}
+
+/**
+ * Free the filter
+ *
+ * @param filter is the filter
+ */
+void where_filter_free(struct where_filter *filter)
+{
+	if (filter->map != NULL)
+	{
+		(void)munmap(filter->map, filter->map_size);
+	}
+	else
+	{
+		free((void *)filter->fingerprints);
+		free((void *)filter->dirs);
+	}
+	memset(filter, 0, sizeof(struct where_filter));
+}
+
+/**
+ * Stack of directories of a walk
+ */
+struct where_walk
+{
+	/** Relative paths of directories */
+	char **paths;
+
+	/** Number of directories */
+	size_t count;
+
+	/** Allocated number of directories */
+	size_t capacity;
+};
+
+/**
+ * Push a directory to the stack
+ *
+ * @param walk is the stack
+ * @param path is the path (copied)
+ * @param len is the length of the path
+ * @return 0 on success, -ENOMEM on error
+ */
+static int walk_push(struct where_walk *walk, const char *path, size_t len)
+{
+	if (walk->count == walk->capacity)
+	{
+		size_t capacity = (walk->capacity == 0) ? 64 : walk->capacity * 2;
+		char **paths = (char **)realloc(walk->paths, capacity * sizeof(char *));
+		if (paths == NULL)
+			return -ENOMEM;
+		walk->paths = paths;
+		walk->capacity = capacity;
+	}
+
+	char *copy = strndup(path, len);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	walk->paths[walk->count++] = copy;
+	return 0;
+}
+
+/**
+ * Free the stack
+ *
+ * @param walk is the stack
+ */
+static void walk_free(struct where_walk *walk)
+{
+	for (size_t i = 0; i < walk->count; i++)
+	{
+		free(walk->paths[i]);
+	}
+	free(walk->paths);
+}
+
+/**
+ * Make a relative path of an entry of a directory (null-terminated, the null is counted in the length)
+ *
+ * @param buf is the target buffer (reused)
+ * @param dir_path is the path of the directory (empty for the root)
+ * @param name is the name of the entry
+ * @return 0 on success, -ENOMEM on error
+ */
+static int join_path(struct byte_buffer *buf, const char *dir_path, const char *name)
+{
+	buf->len = 0;
+	if (dir_path[0] != '\0' && (byte_buffer_append(buf, dir_path, strlen(dir_path)) != 0 ||
+								byte_buffer_append(buf, "/", 1) != 0))
+	{
+		return -ENOMEM;
+	}
+	return byte_buffer_append(buf, name, strlen(name) + 1);
+}
+
+/**
+ * Append a record of a directory (see where_filter.h)
+ *
+ * @param dirs is the buffer of records
+ * @param path is the relative path of the directory
+ * @param ctime is the ctime of the directory
+ * @return 0 on success, -ENOMEM on error
+ */
+static int append_dir_record(struct byte_buffer *dirs, const char *path, const struct timespec *ctime)
+{
+	uint8_t times[WHERE_FILTER_DIR_RECORD_SIZE];
+	write_le64(times, (uint64_t)ctime->tv_sec);
+	write_le32(times + 8, (uint32_t)ctime->tv_nsec);
+	if (byte_buffer_append(dirs, times, sizeof(times)) != 0 || byte_buffer_append(dirs, path, strlen(path) + 1) != 0)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * Walk all entries of a catalog directory (with filestats, so hashes are known)
+ *
+ * @param root_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param dirs gets records of walked directories other than the root (can be NULL)
+ * @param callback is called for every entry
+ * @param ctx is the context of callback
+ * @param errors is incremented for every directory or entry that failed to be read (can be NULL)
+ * @return 0 on success, -ENOMEM on error, the value returned by callback if it stopped the walk
+ */
+int where_walk_dir(int root_fd, struct batch_loader *loader, struct byte_buffer *dirs, where_walk_cb callback,
+				   void *ctx, size_t *errors)
+{
+	struct where_walk walk = {NULL, 0, 0};
+	struct byte_buffer path = {NULL, 0, 0};
+	int res = walk_push(&walk, "", 0);
+	while (res == 0 && walk.count > 0)
+	{
+		char *dir_path = walk.paths[--walk.count];
+		int fd = openat(root_fd, (dir_path[0] != '\0') ? dir_path : ".",
+						O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+		// The ctime is taken before the listing, so a change while it's read makes the record stale
+		struct stat dir_stbuf;
+		bool stated = (fd != -1 && fstat(fd, &dir_stbuf) == 0);
+
+		struct catalog_dir dir;
+		if (!stated || catalog_dir_load_batch(fd, true, loader, &dir, errors) != 0)
+		{
+			// A directory that wasn't read gets a zero ctime, so the filter is never fresh without it
+			if (dirs != NULL && dir_path[0] != '\0')
+			{
+				struct timespec unknown = {0, 0};
+				res = append_dir_record(dirs, dir_path, &unknown);
+			}
+			if (errors != NULL)
+				(*errors)++;
+			if (fd != -1)
+				(void)close(fd);
+			free(dir_path);
+			continue;
+		}
+		(void)close(fd);
+
+		if (dirs != NULL && dir_path[0] != '\0')
+			res = append_dir_record(dirs, dir_path, &dir_stbuf.st_ctim);
+
+		for (size_t i = 0; res == 0 && i < dir.count; i++)
+		{
+			const struct catalog_dir_entry *entry = &dir.entries[i];
+			res = join_path(&path, dir_path, entry->name);
+			if (res == 0)
+				res = callback(ctx, (const char *)path.data, path.len - 1, entry->name, &entry->my_stat);
+			if (res == 0 && catalog_dir_entry_is_dir(entry))
+				res = walk_push(&walk, (const char *)path.data, path.len - 1);
+		}
+
+		catalog_dir_free(&dir);
+		free(dir_path);
+	}
+
+	walk_free(&walk);
+	free(path.data);
+	return res;
+}
+
+/**
+ * Context of listing directories of a single-file catalog
+ */
+struct where_db_walk
+{
+	/** Stack of directories */
+	struct where_walk *walk;
+
+	/** Path of the listed directory */
+	const char *dir_path;
+
+	/** Buffer of paths */
+	struct byte_buffer *path;
+
+	/** Function called for every entry */
+	where_walk_cb callback;
+
+	/** Context of callback */
+	void *ctx;
+
+	/** First error */
+	int res;
+};
+
+/**
+ * Pass an entry of a single-file catalog to the callback (see catalog_db_list_cb)
+ *
+ * @param ctx is the context of the walk
+ * @param name is the name of the entry
+ * @param entry is the entry
+ * @return 0 to continue, nonzero value to stop
+ */
+static int walk_db_entry(void *ctx, const char *name, const struct catalog_db_entry *entry)
+{
+	struct where_db_walk *db_walk = (struct where_db_walk *)ctx;
+
+	int res = join_path(db_walk->path, db_walk->dir_path, name);
+	if (res == 0)
+	{
+		res = db_walk->callback(db_walk->ctx, (const char *)db_walk->path->data, db_walk->path->len - 1, name,
+								&entry->my_stat);
+	}
+	if (res == 0 && S_ISDIR(entry->my_stat.mode))
+		res = walk_push(db_walk->walk, (const char *)db_walk->path->data, db_walk->path->len - 1);
+
+	db_walk->res = res;
+	return res;
+}
+
+/**
+ * Walk all entries of a single-file catalog (see catalog_db.h)
+ *
+ * @param db is the catalog
+ * @param callback is called for every entry
+ * @param ctx is the context of callback
+ * @param errors is incremented for every directory that failed to be listed (can be NULL)
+ * @return 0 on success, -ENOMEM on error, the value returned by callback if it stopped the walk
+ */
+int where_walk_db(struct catalog_db *db, where_walk_cb callback, void *ctx, size_t *errors)
+{
+	struct where_walk walk = {NULL, 0, 0};
+	struct byte_buffer path = {NULL, 0, 0};
+	int res = walk_push(&walk, "", 0);
+	while (res == 0 && walk.count > 0)
+	{
+		char *dir_path = walk.paths[--walk.count];
+
+		// Subdirectories are only queued by the callback, the catalog is locked while listing
+		struct where_db_walk db_walk = {&walk, dir_path, &path, callback, ctx, 0};
+		int list_res = catalog_db_list(db, dir_path, walk_db_entry, &db_walk);
+		res = db_walk.res;
+		if (res == 0 && list_res != 0 && errors != NULL)
+			(*errors)++;
+
+		free(dir_path);
+	}
+
+	walk_free(&walk);
+	free(path.data);
+	return res;
+}
+
+/**
+ * Add the keys of an entry (see where_walk_cb)
+ *
+ * @param ctx is the array of keys
+ * @param path is the relative path of the entry
+ * @param path_len is the length of the path
+ * @param name is the name of the entry
+ * @param stat is the metadata of the entry
+ * @return 0 on success, -ENOMEM on error
+ */
+static int add_entry_keys(void *ctx, const char *path, size_t path_len, const char *name,
+						  const struct filestat *stat)
+{
+	(void)path;
+	(void)path_len;
+	return where_keys_add_entry((struct where_keys *)ctx, name, S_ISREG(stat->mode) ? stat->sha256 : NULL);
+}
+
+/**
+ * Build a filter of the collected keys and replace a sidecar with it
+ *
+ * @param keys is the array of keys (freed by the call)
+ * @param dir_fd is the descriptor of the directory of the sidecar
+ * @param name is the name of the sidecar
+ * @param tmp_name is the name of the temporary file
+ * @param filter is the new filter (must be freed by where_filter_free(), can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+static int save_keys(struct where_keys *keys, int dir_fd, const char *name, const char *tmp_name,
+					 struct where_filter *filter)
+{
+	struct where_filter built;
+	int res = where_filter_build(&built, keys);
+	where_keys_free(keys);
+	if (res != 0)
+		return res;
+
+	res = where_filter_save(&built, dir_fd, name, tmp_name);
+	if (res == 0 && filter != NULL)
+		*filter = built;
+	else
+		where_filter_free(&built);
+	return res;
+}
+
+/**
+ * Check that no directory of a catalog changed since its filter was built
+ *
+ * @param filter is the filter of the catalog directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @return 0 if the filter is fresh, -ESTALE if a directory changed or is gone,
+ *         -EINVAL for broken records
+ */
+int where_filter_check_dirs(const struct where_filter *filter, int catalog_fd)
+{
+	struct stat stbuf;
+	if (fstat(catalog_fd, &stbuf) == -1 || !same_time(&stbuf.st_ctim, &filter->root_ctime))
+		return -ESTALE;
+
+	// Records end with a null (checked by where_filter_open()), so paths can't run past them
+	const uint8_t *pos = filter->dirs;
+	const uint8_t *end = filter->dirs + filter->dirs_size;
+	while (pos < end)
+	{
+		if ((size_t)(end - pos) <= WHERE_FILTER_DIR_RECORD_SIZE)
+			return -EINVAL;
+
+		struct timespec ctime;
+		ctime.tv_sec = (time_t)read_le64(pos);
+		ctime.tv_nsec = (long)read_le32(pos + 8);
+		const char *path = (const char *)pos + WHERE_FILTER_DIR_RECORD_SIZE;
+		if (fstatat(catalog_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(stbuf.st_mode) ||
+			!same_time(&stbuf.st_ctim, &ctime))
+		{
+			return -ESTALE;
+		}
+
+		pos += WHERE_FILTER_DIR_RECORD_SIZE + strlen(path) + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Walk a catalog directory and replace its sidecar with a filter of its entries
+ *
+ * @param catalog_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param filter is the new filter (must be freed by where_filter_free(), can be NULL)
+ * @param errors is incremented for every directory or entry that failed to be read (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_rebuild_dir(int catalog_fd, struct batch_loader *loader, struct where_filter *filter,
+							 size_t *errors)
+{
+	// The temporary file is created before the walk, so only the rename of it moves the ctime of the root later
+	int fd = openat(catalog_fd, WHERE_FILTER_TMP_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+					0644);
+	if (fd == -1)
+		return -errno;
+
+	struct where_keys keys;
+	memset(&keys, 0, sizeof(struct where_keys));
+	struct byte_buffer dirs = {NULL, 0, 0};
+	struct where_filter built;
+	memset(&built, 0, sizeof(struct where_filter));
+
+	struct stat root_stbuf;
+	int res = (fstat(catalog_fd, &root_stbuf) == -1) ? -errno : 0;
+	if (res == 0)
+		res = where_walk_dir(catalog_fd, loader, &dirs, add_entry_keys, &keys, errors);
+	if (res == 0)
+		res = where_filter_build(&built, &keys);
+	where_keys_free(&keys);
+	if (res == 0)
+	{
+		built.root_ctime = root_stbuf.st_ctim;
+		built.dirs = dirs.data;
+		built.dirs_size = dirs.len;
+		dirs.data = NULL;
+		res = write_sidecar(&built, fd);
+	}
+	byte_buffer_free(&dirs);
+
+	// After the rename the sidecar gets the new ctime of the root, unless the root changed
+	// during the walk: then the old one is kept and the sidecar is stale at once
+	struct stat stbuf;
+	bool root_unchanged =
+		(res == 0 && fstat(catalog_fd, &stbuf) == 0 && same_time(&stbuf.st_ctim, &root_stbuf.st_ctim));
+	if (res == 0 && renameat(catalog_fd, WHERE_FILTER_TMP_FILE_NAME, catalog_fd, WHERE_FILTER_FILE_NAME) == -1)
+		res = -errno;
+	if (res == 0 && root_unchanged && fstat(catalog_fd, &stbuf) == 0)
+	{
+		// A failed write only leaves the sidecar stale
+		uint8_t root_ctime[12];
+		write_root_ctime(root_ctime, &stbuf.st_ctim);
+		if (pwrite(fd, root_ctime, sizeof(root_ctime), WHERE_FILTER_HEADER_LENGTH + 12) ==
+			(ssize_t)sizeof(root_ctime))
+		{
+			built.root_ctime = stbuf.st_ctim;
+		}
+	}
+
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+	if (res != 0)
+		(void)unlinkat(catalog_fd, WHERE_FILTER_TMP_FILE_NAME, 0);
+
+	if (res == 0 && filter != NULL)
+		*filter = built;
+	else
+		where_filter_free(&built);
+	return res;
+}
+
+/**
+ * Walk a single-file catalog and replace its sidecar with a filter of its entries
+ *
+ * @param db is the catalog
+ * @param path is the path of the sidecar (the temporary file gets the ".tmp" suffix)
+ * @param filter is the new filter (must be freed by where_filter_free(), can be NULL)
+ * @param errors is incremented for every directory that failed to be listed (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_rebuild_db(struct catalog_db *db, const char *path, struct where_filter *filter, size_t *errors)
+{
+	struct where_keys keys;
+	memset(&keys, 0, sizeof(struct where_keys));
+
+	struct byte_buffer tmp_path = {NULL, 0, 0};
+	int res = (byte_buffer_append_format(&tmp_path, "%s.tmp", path) == 0 &&
+			   byte_buffer_append(&tmp_path, "", 1) == 0) ? 0 : -ENOMEM;
+	if (res == 0)
+		res = where_walk_db(db, add_entry_keys, &keys, errors);
+	if (res == 0)
+		res = save_keys(&keys, AT_FDCWD, path, (const char *)tmp_path.data, filter);
+	else
+		where_keys_free(&keys);
+
+	byte_buffer_free(&tmp_path);
+	return res;
+}
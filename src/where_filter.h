@@ -0,0 +1,282 @@
+#ifndef INC_CATALOGFS_WHERE_FILTER_H
+#define INC_CATALOGFS_WHERE_FILTER_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "filestat.h"
+
+// Forward declarations
+struct batch_loader;
+struct byte_buffer;
+struct catalog_db;
+
+/**
+ * Filter of names and hashes of a catalog for "which catalog has this file" lookups.
+ *
+ * Finding a file among hundreds of catalogs of offline disks would mean a walk
+ * over every catalog. Instead every catalog gets a small sidecar file with an
+ * xor filter (Graf and Lemire, "Xor Filters: Faster and Smaller Than Bloom and
+ * Cuckoo Filters") of 64-bit keys of all names of its entries (case-folded,
+ * see where_filter_name_key()) and of all known SHA-256 hashes of its files.
+ * A filter answers "definitely not in the catalog" or "maybe in the catalog"
+ * (about 0.4% of false positives) by three byte reads, so only candidates have
+ * to be walked.
+ *
+ * A filter keeps 8-bit fingerprints in 3 blocks of 1.23 * keys / 3 slots (about
+ * 9.9 bits per key). The sidecar is
+ *
+ *   "CatalogFS.Where.2\n", u64 seed, u32 block length, u32 ctime nanoseconds
+ *   of the root, u64 ctime seconds of the root, u64 number of names,
+ *   u64 number of hashes, u64 number of keys, u64 size of directory records,
+ *   then 3 * block length fingerprints,
+ *   then a record of every other directory: u64 ctime seconds,
+ *   u32 ctime nanoseconds, null-terminated relative path
+ *
+ * (little-endian). It's kept in the root of a catalog directory (hidden like
+ * manifests) or next to a single-file catalog (<catalog>.where, without
+ * directory records) and is written through a temporary file and rename(), so
+ * readers always see a whole filter.
+ *
+ * Directories of a catalog keep the mtimes of the source, so only their ctimes
+ * tell that an entry was added or renamed in them. A filter is fresh while every
+ * recorded directory has the same ctime (see where_filter_check_dirs()).
+ */
+
+/** Name of the sidecar in the root of a catalog directory */
+#define WHERE_FILTER_FILE_NAME ".catalogfs-where"
+
+/** Name of the temporary file of a new sidecar */
+#define WHERE_FILTER_TMP_FILE_NAME ".catalogfs-where.tmp"
+
+/** Suffix of the sidecar of a single-file catalog (next to it) */
+#define WHERE_FILTER_DB_SUFFIX ".where"
+
+/** Header of the sidecar (also the version of the layout) */
+#define WHERE_FILTER_HEADER "CatalogFS.Where.2\n"
+
+/** Size of the sidecar before fingerprints (header and fields) */
+#define WHERE_FILTER_PREFIX_SIZE (sizeof(WHERE_FILTER_HEADER) - 1 + 8 + 4 + 4 + 8 + 8 + 8 + 8 + 8)
+
+/** Size of a directory record before its path (ctime seconds and nanoseconds) */
+#define WHERE_FILTER_DIR_RECORD_SIZE (8 + 4)
+
+/** Maximum number of seeds tried to build a filter (every try succeeds with probability about 0.9) */
+#define WHERE_FILTER_MAX_TRIES (64)
+
+/**
+ * Growable array of keys of a catalog
+ */
+struct where_keys
+{
+	/** Keys (may contain duplicates until the filter is built) */
+	uint64_t *keys;
+
+	/** Number of keys */
+	size_t count;
+
+	/** Allocated number of keys */
+	size_t capacity;
+
+	/** Number of added names */
+	uint64_t names;
+
+	/** Number of added hashes */
+	uint64_t hashes;
+};
+
+/**
+ * Xor filter (built or mapped from a sidecar)
+ */
+struct where_filter
+{
+	/** Seed of hashes of keys */
+	uint64_t seed;
+
+	/** Number of slots of one block */
+	uint32_t block_length;
+
+	/** Fingerprints (3 * block_length) */
+	const uint8_t *fingerprints;
+
+	/** Number of names of the catalog */
+	uint64_t names;
+
+	/** Number of hashes of the catalog */
+	uint64_t hashes;
+
+	/** Number of distinct keys */
+	uint64_t keys;
+
+	/** Ctime of the root of the catalog directory when the filter was built (zero for a single-file catalog) */
+	struct timespec root_ctime;
+
+	/** Records of other directories of the catalog (see the layout above) */
+	const uint8_t *dirs;
+
+	/** Size of records of directories */
+	size_t dirs_size;
+
+	/** Mapped sidecar (NULL if the filter was built) */
+	void *map;
+
+	/** Size of the mapped sidecar */
+	size_t map_size;
+};
+
+/**
+ * Function called for every entry of a walked catalog
+ *
+ * @param ctx is the context given to the walk
+ * @param path is the relative path of the entry
+ * @param path_len is the length of the path
+ * @param name is the name of the entry
+ * @param stat is the metadata of the entry
+ * @return 0 to continue, nonzero value to stop the walk (returned by it)
+ */
+typedef int (*where_walk_cb)(void *ctx, const char *path, size_t path_len, const char *name,
+							 const struct filestat *stat);
+
+/**
+ * Walk all entries of a catalog directory (with filestats, so hashes are known)
+ *
+ * @param root_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param dirs gets records of walked directories other than the root (can be NULL)
+ * @param callback is called for every entry
+ * @param ctx is the context of callback
+ * @param errors is incremented for every directory or entry that failed to be read (can be NULL)
+ * @return 0 on success, -ENOMEM on error, the value returned by callback if it stopped the walk
+ */
+int where_walk_dir(int root_fd, struct batch_loader *loader, struct byte_buffer *dirs, where_walk_cb callback,
+				   void *ctx, size_t *errors);
+
+/**
+ * Walk all entries of a single-file catalog (see catalog_db.h)
+ *
+ * @param db is the catalog
+ * @param callback is called for every entry
+ * @param ctx is the context of callback
+ * @param errors is incremented for every directory that failed to be listed (can be NULL)
+ * @return 0 on success, -ENOMEM on error, the value returned by callback if it stopped the walk
+ */
+int where_walk_db(struct catalog_db *db, where_walk_cb callback, void *ctx, size_t *errors);
+
+/**
+ * Get the key of a name (ASCII letters are case-folded, other bytes are kept as they are)
+ *
+ * @param name is the name (not a path)
+ * @param name_len is the length of the name
+ * @return the key
+ */
+uint64_t where_filter_name_key(const char *name, size_t name_len);
+
+/**
+ * Get the key of a SHA-256 hash
+ *
+ * @param sha256 is the hash in hex (any case)
+ * @param key is the key
+ * @return 0 on success, -EINVAL if it's not 64 hex digits
+ */
+int where_filter_hash_key(const char *sha256, uint64_t *key);
+
+/**
+ * Add a name and optionally a hash of an entry
+ *
+ * @param keys is the array of keys (zeroed before the first call)
+ * @param name is the name of the entry
+ * @param sha256 is the hash of the file in hex (NULL or empty if unknown)
+ * @return 0 on success, -ENOMEM on error
+ */
+int where_keys_add_entry(struct where_keys *keys, const char *name, const char *sha256);
+
+/**
+ * Free the array of keys
+ *
+ * @param keys is the array of keys
+ */
+void where_keys_free(struct where_keys *keys);
+
+/**
+ * Build a filter of the keys
+ *
+ * @param filter is the new filter (must be freed by where_filter_free())
+ * @param keys is the array of keys (sorted and deduplicated by the call)
+ * @return 0 on success, -ENOMEM on error, -EAGAIN if no seed worked (should never happen)
+ */
+int where_filter_build(struct where_filter *filter, struct where_keys *keys);
+
+/**
+ * Check if the key may be in the filter
+ *
+ * @param filter is the filter
+ * @param key is the key
+ * @return false if the key is definitely not in the filter
+ */
+bool where_filter_contains(const struct where_filter *filter, uint64_t key);
+
+/**
+ * Write the filter to a sidecar (through the temporary file and rename())
+ *
+ * @param filter is the filter
+ * @param dir_fd is the descriptor of the directory of the sidecar
+ * @param name is the name of the sidecar
+ * @param tmp_name is the name of the temporary file
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_save(const struct where_filter *filter, int dir_fd, const char *name, const char *tmp_name);
+
+/**
+ * Map the filter of a sidecar
+ *
+ * @param filter is the filter (must be freed by where_filter_free())
+ * @param dir_fd is the descriptor of the directory of the sidecar
+ * @param name is the name of the sidecar
+ * @param stbuf is the stat of the sidecar (can be NULL)
+ * @return 0 on success, -ENOENT if there is no sidecar, -EINVAL for a broken one,
+ *         other negative value (mostly -errno) on error
+ */
+int where_filter_open(struct where_filter *filter, int dir_fd, const char *name, struct stat *stbuf);
+
+/**
+ * Check that no directory of a catalog changed since its filter was built
+ *
+ * @param filter is the filter of the catalog directory
+ * @param catalog_fd is the file descriptor of the catalog directory
+ * @return 0 if the filter is fresh, -ESTALE if a directory changed or is gone,
+ *         -EINVAL for broken records
+ */
+int where_filter_check_dirs(const struct where_filter *filter, int catalog_fd);
+
+/**
+ * Walk a catalog directory and replace its sidecar with a filter of its entries
+ *
+ * @param catalog_fd is the file descriptor of the catalog directory (not closed)
+ * @param loader is the batched loader (can be NULL, then usual system calls are used)
+ * @param filter is the new filter (must be freed by where_filter_free(), can be NULL)
+ * @param errors is incremented for every directory or entry that failed to be read (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_rebuild_dir(int catalog_fd, struct batch_loader *loader, struct where_filter *filter,
+							 size_t *errors);
+
+/**
+ * Walk a single-file catalog and replace its sidecar with a filter of its entries
+ *
+ * @param db is the catalog
+ * @param path is the path of the sidecar (the temporary file gets the ".tmp" suffix)
+ * @param filter is the new filter (must be freed by where_filter_free(), can be NULL)
+ * @param errors is incremented for every directory that failed to be listed (can be NULL)
+ * @return 0 on success, negative value (mostly -errno) on error
+ */
+int where_filter_rebuild_db(struct catalog_db *db, const char *path, struct where_filter *filter, size_t *errors);
+
+/**
+ * Free the filter
+ *
+ * @param filter is the filter
+ */
+void where_filter_free(struct where_filter *filter);
+
+#endif // INC_CATALOGFS_WHERE_FILTER_H
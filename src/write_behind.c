@@ -0,0 +1,559 @@
+#include "header_common.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "write_behind.h"
+#include "path_hash.h"
+
+/**
+ * Queued record of a released file
+ */
+struct write_behind_record
+{
+	/** Next record in the queue (or in the batch) */
+	struct write_behind_record *next;
+
+	/** Relative path of the index file */
+	char *relpath;
+
+	/** Length of the relative path */
+	size_t relpath_len;
+
+	/** Descriptor of the index file (owned) */
+	int file_fd;
+
+	/** Device of the index file */
+	dev_t dev;
+
+	/** Inode of the index file */
+	ino_t ino;
+
+	/** Record to save */
+	struct filestat my_stat;
+
+	/** Result of saving */
+	int result;
+};
+
+/**
+ * Write-behind of metadata of released files
+ */
+struct write_behind
+{
+	/** Storage of records in index files */
+	enum catalog_storage storage;
+
+	/** Durability of saved records */
+	enum write_behind_durability durability;
+
+	/** Lock of everything below */
+	pthread_mutex_t lock;
+
+	/** Condition to wake up the thread when records are queued, a batch is full, on flush or on stop */
+	pthread_cond_t queued_cond;
+
+	/** Condition to wake up writers and flushes when a batch is saved */
+	pthread_cond_t saved_cond;
+
+	/** Thread that saves queued records */
+	pthread_t thread;
+
+	/** First queued record */
+	struct write_behind_record *head;
+
+	/** Last queued record */
+	struct write_behind_record *tail;
+
+	/** Number of queued records */
+	size_t queued;
+
+	/** Number of records of the batch being saved */
+	size_t saving;
+
+	/** Time when the first queued record was queued (monotonic) */
+	struct timespec first_queued;
+
+	/** Number of callers waiting in write_behind_flush() */
+	unsigned int flushing;
+
+	/** Latest queued (or being saved) record of every path: relative path -> struct write_behind_record */
+	struct path_hash pending;
+
+	/** Number of saved records */
+	uint64_t saved;
+
+	/** Number of saved batches */
+	uint64_t batches;
+
+	/** Number of records that failed to be saved */
+	uint64_t errors;
+
+	/** First error since the last flush */
+	int first_error;
+
+	/** The thread should stop when the queue is empty */
+	bool stopping;
+};
+
+/**
+ * Get the durability by its name (as used by command-line options)
+ *
+ * @param name is the name ("none", "batch" or "file")
+ * @param durability is the found durability
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int write_behind_durability_from_name(const char *name, enum write_behind_durability *durability)
+{
+	if (name == NULL)
+		return -EINVAL;
+
+	if (strcmp(name, "none") == 0)
+	{
+		*durability = WRITE_BEHIND_DURABILITY_NONE;
+		return 0;
+	}
+
+	if (strcmp(name, "batch") == 0)
+	{
+		*durability = WRITE_BEHIND_DURABILITY_BATCH;
+		return 0;
+	}
+
+	if (strcmp(name, "file") == 0)
+	{
+		*durability = WRITE_BEHIND_DURABILITY_FILE;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * Get the name of the durability
+ *
+ * @param durability is the durability
+ * @return the name (static string)
+ */
+const char *write_behind_durability_name(enum write_behind_durability durability)
+{
+	switch (durability)
+	{
+	case WRITE_BEHIND_DURABILITY_BATCH:
+		return "batch";
+	case WRITE_BEHIND_DURABILITY_FILE:
+		return "file";
+	case WRITE_BEHIND_DURABILITY_NONE:
+	default:
+		return "none";
+	}
+}
+
+/**
+ * Free the record (its descriptor must be closed before)
+ *
+ * @param record is the record
+ */
+static void write_behind_record_free(struct write_behind_record *record)
+{
+	free(record->relpath);
+	free(record);
+}
+
+/**
+ * Save records of the batch and close their descriptors (called without the lock)
+ *
+ * @param wb is the write-behind
+ * @param batch is the list of records
+ */
+static void write_behind_save_batch(struct write_behind *wb, struct write_behind_record *batch)
+{
+	for (struct write_behind_record *record = batch; record != NULL; record = record->next)
+	{
+		record->result = storage_save_filestat(record->file_fd, wb->storage, &record->my_stat, record->relpath);
+		if (record->result == 0 && wb->durability == WRITE_BEHIND_DURABILITY_FILE &&
+			fsync(record->file_fd) == -1)
+		{
+			record->result = -errno;
+		}
+	}
+
+	// One sync of the whole filesystem commits the batch (all index files are on the same one)
+	if (wb->durability == WRITE_BEHIND_DURABILITY_BATCH)
+	{
+#ifdef __linux__
+		int res = (syncfs(batch->file_fd) == -1) ? -errno : 0;
+#else
+		sync();
+		int res = 0;
+#endif
+		for (struct write_behind_record *record = batch; record != NULL && res != 0; record = record->next)
+		{
+			if (record->result == 0)
+				record->result = res;
+		}
+	}
+
+	for (struct write_behind_record *record = batch; record != NULL; record = record->next)
+	{
+		if (close(record->file_fd) == -1 && record->result == 0)
+			record->result = -errno;
+	}
+}
+
+/**
+ * Check if the batch should be saved without waiting for more records
+ *
+ * @param wb is the write-behind (locked)
+ * @return true if the batch is full, somebody waits for it or the write-behind is stopping
+ */
+static bool write_behind_batch_is_due(const struct write_behind *wb)
+{
+	return wb->queued >= WRITE_BEHIND_BATCH_SIZE || wb->flushing > 0 || wb->stopping;
+}
+
+/**
+ * Save queued records in batches until the write-behind is stopped
+ *
+ * @param arg is the write-behind
+ * @return NULL
+ */
+static void *write_behind_thread(void *arg)
+{
+	struct write_behind *wb = (struct write_behind *)arg;
+
+	pthread_mutex_lock(&wb->lock);
+	while (true)
+	{
+		while (wb->head == NULL && !(wb->stopping))
+			pthread_cond_wait(&wb->queued_cond, &wb->lock);
+
+		if (wb->head == NULL)
+			break;
+
+		// Records queued within WRITE_BEHIND_DELAY_MS after the first one join its batch
+		struct timespec deadline = wb->first_queued;
+		deadline.tv_nsec += (long)WRITE_BEHIND_DELAY_MS * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+		}
+
+		while (!write_behind_batch_is_due(wb) &&
+			   pthread_cond_timedwait(&wb->queued_cond, &wb->lock, &deadline) == 0)
+		{
+		}
+
+		// The batch is everything queued since then (up to WRITE_BEHIND_BATCH_SIZE records)
+		struct write_behind_record *batch = wb->head;
+		struct write_behind_record *last = batch;
+		size_t count = 1;
+		while (last->next != NULL && count < WRITE_BEHIND_BATCH_SIZE)
+		{
+			last = last->next;
+			count++;
+		}
+
+		wb->head = last->next;
+		if (wb->head == NULL)
+			wb->tail = NULL;
+		else
+			(void)clock_gettime(CLOCK_MONOTONIC, &wb->first_queued);
+		last->next = NULL;
+		wb->queued -= count;
+		wb->saving = count;
+
+		pthread_mutex_unlock(&wb->lock);
+		write_behind_save_batch(wb, batch);
+		pthread_mutex_lock(&wb->lock);
+
+		while (batch != NULL)
+		{
+			struct write_behind_record *record = batch;
+			batch = record->next;
+
+			if (record->result != 0)
+			{
+				wb->errors++;
+				if (wb->first_error == 0)
+					wb->first_error = record->result;
+			}
+			else
+			{
+				wb->saved++;
+			}
+
+			// A later record of the same path stays visible
+			if (path_hash_get(&wb->pending, record->relpath, record->relpath_len) == record)
+				(void)path_hash_remove(&wb->pending, record->relpath, record->relpath_len);
+
+			write_behind_record_free(record);
+		}
+
+		wb->saving = 0;
+		wb->batches++;
+		pthread_cond_broadcast(&wb->saved_cond);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+/**
+ * Start the thread that saves queued records
+ *
+ * @param wb is the new write-behind (must be stopped by write_behind_stop())
+ * @param storage is the storage of records in index files
+ * @param durability is the durability of saved records
+ * @return 0 on success, -ENOMEM or -EAGAIN on error
+ */
+int write_behind_start(struct write_behind **wb, enum catalog_storage storage,
+					   enum write_behind_durability durability)
+{
+	struct write_behind *new_wb = (struct write_behind *)calloc(1, sizeof(struct write_behind));
+	if (new_wb == NULL)
+		return -ENOMEM;
+
+	new_wb->storage = storage;
+	new_wb->durability = durability;
+	path_hash_init(&new_wb->pending);
+
+	if (pthread_mutex_init(&new_wb->lock, NULL) != 0)
+	{
+		free(new_wb);
+		return -ENOMEM;
+	}
+
+	pthread_condattr_t cond_attr;
+	if (pthread_condattr_init(&cond_attr) != 0)
+	{
+		pthread_mutex_destroy(&new_wb->lock);
+		free(new_wb);
+		return -ENOMEM;
+	}
+
+	// Deadlines of batches are monotonic, changes of the clock do not delay them
+	(void)pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	int res = pthread_cond_init(&new_wb->queued_cond, &cond_attr);
+	(void)pthread_condattr_destroy(&cond_attr);
+	if (res != 0)
+	{
+		pthread_mutex_destroy(&new_wb->lock);
+		free(new_wb);
+		return -ENOMEM;
+	}
+
+	if (pthread_cond_init(&new_wb->saved_cond, NULL) != 0)
+	{
+		pthread_cond_destroy(&new_wb->queued_cond);
+		pthread_mutex_destroy(&new_wb->lock);
+		free(new_wb);
+		return -ENOMEM;
+	}
+
+	if (pthread_create(&new_wb->thread, NULL, write_behind_thread, new_wb) != 0)
+	{
+		pthread_cond_destroy(&new_wb->saved_cond);
+		pthread_cond_destroy(&new_wb->queued_cond);
+		pthread_mutex_destroy(&new_wb->lock);
+		free(new_wb);
+		return -EAGAIN;
+	}
+
+	*wb = new_wb;
+	return 0;
+}
+
+/**
+ * Queue the record of a released file (waits if too many records are queued)
+ *
+ * @param wb is the write-behind
+ * @param relpath is the relative path of the index file
+ * @param file_fd is the descriptor of the index file opened for writing
+ *        (owned by the write-behind from now on, closed after the record is saved)
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the record to save
+ * @return 0 on success, -ENOMEM on error (then file_fd is closed too)
+ */
+int write_behind_add(struct write_behind *wb, const char *relpath, int file_fd,
+					 const struct stat *stbuf, const struct filestat *my_stat)
+{
+	struct write_behind_record *record = (struct write_behind_record *)calloc(1, sizeof(struct write_behind_record));
+	if (record == NULL)
+	{
+		(void)close(file_fd);
+		return -ENOMEM;
+	}
+
+	record->relpath = strdup(relpath);
+	if (record->relpath == NULL)
+	{
+		(void)close(file_fd);
+		free(record);
+		return -ENOMEM;
+	}
+
+	record->relpath_len = strlen(relpath);
+	record->file_fd = file_fd;
+	record->dev = stbuf->st_dev;
+	record->ino = stbuf->st_ino;
+	record->my_stat = *my_stat;
+
+	pthread_mutex_lock(&wb->lock);
+
+	while (wb->queued + wb->saving >= WRITE_BEHIND_MAX_PENDING)
+		pthread_cond_wait(&wb->saved_cond, &wb->lock);
+
+	// A record that is not visible to readers is still saved
+	(void)path_hash_put(&wb->pending, record->relpath, record->relpath_len, record, NULL);
+
+	if (wb->tail != NULL)
+	{
+		wb->tail->next = record;
+	}
+	else
+	{
+		wb->head = record;
+		(void)clock_gettime(CLOCK_MONOTONIC, &wb->first_queued);
+	}
+	wb->tail = record;
+	wb->queued++;
+
+	// The thread is woken up only to start waiting for a batch and when the batch is full
+	if (wb->queued == 1 || wb->queued == WRITE_BEHIND_BATCH_SIZE)
+		pthread_cond_signal(&wb->queued_cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	return 0;
+}
+
+/**
+ * Find the queued record of the index file
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the found record
+ * @return true if the latest queued record of the path is of the same file
+ */
+bool write_behind_get(struct write_behind *wb, const char *relpath, const struct stat *stbuf,
+					  struct filestat *my_stat)
+{
+	if (wb == NULL)
+		return false;
+
+	pthread_mutex_lock(&wb->lock);
+
+	bool found = false;
+	const struct write_behind_record *record = (const struct write_behind_record *)path_hash_get(
+		&wb->pending, relpath, strlen(relpath));
+	if (record != NULL && record->dev == stbuf->st_dev && record->ino == stbuf->st_ino)
+	{
+		*my_stat = record->my_stat;
+		found = true;
+	}
+
+	pthread_mutex_unlock(&wb->lock);
+	return found;
+}
+
+/**
+ * Wait until all queued records are saved
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @return 0 on success, the first error of records saved since the previous call otherwise
+ */
+int write_behind_flush(struct write_behind *wb)
+{
+	if (wb == NULL)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+
+	wb->flushing++;
+	pthread_cond_signal(&wb->queued_cond);
+	while (wb->queued + wb->saving > 0)
+		pthread_cond_wait(&wb->saved_cond, &wb->lock);
+	wb->flushing--;
+
+	int res = wb->first_error;
+	wb->first_error = 0;
+
+	pthread_mutex_unlock(&wb->lock);
+	return res;
+}
+
+/**
+ * Wait until the queued record of the path (if any) is saved, so a change of
+ * the index file made after the call is not overwritten by it
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @param relpath is the relative path of the index file
+ */
+void write_behind_flush_path(struct write_behind *wb, const char *relpath)
+{
+	if (wb == NULL)
+		return;
+
+	size_t relpath_len = strlen(relpath);
+	pthread_mutex_lock(&wb->lock);
+
+	// The batch with the record is saved at once, errors are reported by write_behind_flush()
+	if (path_hash_get(&wb->pending, relpath, relpath_len) != NULL)
+	{
+		wb->flushing++;
+		pthread_cond_signal(&wb->queued_cond);
+		while (path_hash_get(&wb->pending, relpath, relpath_len) != NULL)
+			pthread_cond_wait(&wb->saved_cond, &wb->lock);
+		wb->flushing--;
+	}
+
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/**
+ * Get counters
+ *
+ * @param wb is the write-behind
+ * @param stats is the target counters
+ */
+void write_behind_get_stats(struct write_behind *wb, struct write_behind_stats *stats)
+{
+	pthread_mutex_lock(&wb->lock);
+	stats->pending = wb->queued + wb->saving;
+	stats->saved = wb->saved;
+	stats->batches = wb->batches;
+	stats->errors = wb->errors;
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/**
+ * Save all queued records, stop the thread and free the write-behind
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @return 0 on success, the first error of records saved since the last flush otherwise
+ */
+int write_behind_stop(struct write_behind *wb)
+{
+	if (wb == NULL)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+	wb->stopping = true;
+	pthread_cond_signal(&wb->queued_cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	(void)pthread_join(wb->thread, NULL);
+
+	int res = wb->first_error;
+
+	path_hash_clear(&wb->pending, NULL);
+	pthread_cond_destroy(&wb->saved_cond);
+	pthread_cond_destroy(&wb->queued_cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+	return res;
+}
@@ -0,0 +1,168 @@
+#ifndef INC_CATALOGFS_WRITE_BEHIND_H
+#define INC_CATALOGFS_WRITE_BEHIND_H
+
+#include "header_common.h"
+
+#include <sys/stat.h>
+
+#include "filestat.h"
+#include "storage.h"
+
+/**
+ * Write-behind of metadata of released files.
+ *
+ * Every close() of a written file waits until its metadata is saved to the
+ * index file, so copying millions of small files is bound by the latency of
+ * the disk of the catalog. With write-behind, flush() and release() only
+ * queue the record (with a descriptor of the index file) and a background
+ * thread saves queued records in batches (group commit): a batch takes
+ * records queued within WRITE_BEHIND_DELAY_MS after its first one (or while
+ * the previous batch was saved), up to WRITE_BEHIND_BATCH_SIZE records.
+ *
+ * Durability of saved records:
+ *  - none: records are written and left to the page cache of the system;
+ *  - batch: the filesystem of the catalog is synced once per batch;
+ *  - file: every index file is synced after its record is written.
+ *
+ * Queued records are visible to readers (see write_behind_get()) until they
+ * are saved, a record is found by the path and the inode of its index file,
+ * so a file replaced or renamed since then does not get it. At most
+ * WRITE_BEHIND_MAX_PENDING records wait at once, more writers wait for them.
+ *
+ * Errors of saving are counted and reported by write_behind_flush().
+ * All calls are thread-safe.
+ */
+
+/** Maximum number of records waiting to be saved */
+#define WRITE_BEHIND_MAX_PENDING (4096)
+
+/** Maximum number of records saved in one batch */
+#define WRITE_BEHIND_BATCH_SIZE (512)
+
+/** Time to wait for more records after the first one of a batch (in milliseconds) */
+#define WRITE_BEHIND_DELAY_MS (2)
+
+// Forward declaration
+struct write_behind;
+
+/**
+ * Durability of saved records
+ */
+enum write_behind_durability
+{
+	/** Records are not synced */
+	WRITE_BEHIND_DURABILITY_NONE = 0,
+
+	/** The filesystem is synced once per batch */
+	WRITE_BEHIND_DURABILITY_BATCH,
+
+	/** Every index file is synced */
+	WRITE_BEHIND_DURABILITY_FILE,
+};
+
+/**
+ * Counters of write-behind
+ */
+struct write_behind_stats
+{
+	/** Number of records waiting to be saved (or being saved) */
+	size_t pending;
+
+	/** Number of saved records */
+	uint64_t saved;
+
+	/** Number of saved batches */
+	uint64_t batches;
+
+	/** Number of records that failed to be saved */
+	uint64_t errors;
+};
+
+/**
+ * Get the durability by its name (as used by command-line options)
+ *
+ * @param name is the name ("none", "batch" or "file")
+ * @param durability is the found durability
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int write_behind_durability_from_name(const char *name, enum write_behind_durability *durability);
+
+/**
+ * Get the name of the durability
+ *
+ * @param durability is the durability
+ * @return the name
+ */
+const char *write_behind_durability_name(enum write_behind_durability durability);
+
+/**
+ * Start the thread that saves queued records
+ *
+ * @param wb is the new write-behind (must be stopped by write_behind_stop())
+ * @param storage is the storage of records in index files
+ * @param durability is the durability of saved records
+ * @return 0 on success, -ENOMEM or -EAGAIN on error
+ */
+int write_behind_start(struct write_behind **wb, enum catalog_storage storage,
+					   enum write_behind_durability durability);
+
+/**
+ * Queue the record of a released file (waits if too many records are queued)
+ *
+ * @param wb is the write-behind
+ * @param relpath is the relative path of the index file
+ * @param file_fd is the descriptor of the index file opened for writing
+ *        (owned by the write-behind from now on, closed after the record is saved)
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the record to save
+ * @return 0 on success, -ENOMEM on error (then file_fd is closed too)
+ */
+int write_behind_add(struct write_behind *wb, const char *relpath, int file_fd,
+					 const struct stat *stbuf, const struct filestat *my_stat);
+
+/**
+ * Find the queued record of the index file
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @param relpath is the relative path of the index file
+ * @param stbuf is the real stat of the index file
+ * @param my_stat is the found record
+ * @return true if the latest queued record of the path is of the same file
+ */
+bool write_behind_get(struct write_behind *wb, const char *relpath, const struct stat *stbuf,
+					  struct filestat *my_stat);
+
+/**
+ * Wait until all queued records are saved
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @return 0 on success, the first error of records saved since the previous call otherwise
+ */
+int write_behind_flush(struct write_behind *wb);
+
+/**
+ * Wait until the queued record of the path (if any) is saved, so a change of
+ * the index file made after the call is not overwritten by it
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @param relpath is the relative path of the index file
+ */
+void write_behind_flush_path(struct write_behind *wb, const char *relpath);
+
+/**
+ * Get counters
+ *
+ * @param wb is the write-behind
+ * @param stats is the target counters
+ */
+void write_behind_get_stats(struct write_behind *wb, struct write_behind_stats *stats);
+
+/**
+ * Save all queued records, stop the thread and free the write-behind
+ *
+ * @param wb is the write-behind (can be NULL)
+ * @return 0 on success, the first error of records saved since the last flush otherwise
+ */
+int write_behind_stop(struct write_behind *wb);
+
+#endif // INC_CATALOGFS_WRITE_BEHIND_H
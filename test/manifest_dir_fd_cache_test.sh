@@ -0,0 +1,44 @@
+#!/bin/sh
+# Entries of manifests of subdirectories are found, renamed and removed with
+# --dir_fd_cache_size=0, when names are resolved relative to the root
+#
+#   make test  (or: sh test/manifest_dir_fd_cache_test.sh from the root of the repository)
+
+set -e
+
+BIN=${BIN:-$(pwd)/bin}
+if [ ! -x "$BIN/catalogfs" ] || [ ! -e /dev/fuse ] || ! command -v fusermount3 > /dev/null 2>&1; then
+	echo "SKIP: bin/catalogfs, /dev/fuse or fusermount3 is missing"
+	exit 0
+fi
+
+WORK=$(mktemp -d)
+trap 'fusermount3 -u "$WORK/mnt" 2> /dev/null || true; rm -rf "$WORK"' EXIT
+
+fail()
+{
+	echo "FAIL: $1"
+	exit 1
+}
+
+mkdir "$WORK/source" "$WORK/mnt"
+"$BIN/catalogfs" --source="$WORK/source" --manifests --dir_fd_cache_size=0 \
+	"$WORK/mnt" > /dev/null
+
+mkdir "$WORK/mnt/dir"
+head -c 3000 /dev/zero > "$WORK/mnt/dir/file"
+# Files of a directory are moved into its manifest when files of another directory are written
+head -c 10 /dev/zero > "$WORK/mnt/other"
+[ -f "$WORK/source/dir/.catalogfs-manifest" ] && [ ! -e "$WORK/source/dir/file" ] ||
+	fail "dir/file was not moved into the manifest"
+
+[ "$(stat -c %s "$WORK/mnt/dir/file")" = 3000 ] || fail "stat of dir/file"
+mv "$WORK/mnt/dir/file" "$WORK/mnt/dir/renamed" || fail "rename inside dir"
+[ "$(stat -c %s "$WORK/mnt/dir/renamed")" = 3000 ] || fail "stat of dir/renamed"
+mv "$WORK/mnt/dir/renamed" "$WORK/mnt/moved" || fail "rename out of dir"
+[ "$(stat -c %s "$WORK/mnt/moved")" = 3000 ] || fail "stat of moved"
+[ -z "$(ls "$WORK/mnt/dir")" ] || fail "dir is not empty"
+rm "$WORK/mnt/moved" || fail "unlink of moved"
+[ ! -e "$WORK/mnt/moved" ] || fail "moved is still shown"
+
+echo "OK: entries of manifests of subdirectories work without the descriptor cache"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Snapshots of two catalogs of one source, built independently, share all nodes
+# (times that belong to the catalogs themselves are not stored)
+#
+#   make test  (or: sh test/snapshot_test.sh from the root of the repository)
+
+set -e
+
+BIN=${BIN:-$(pwd)/bin}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/source/a/b/c" "$WORK/source/d"
+for name in one two three; do
+	echo "$name" > "$WORK/source/$name"
+	echo "$name" > "$WORK/source/a/$name"
+	echo "$name" > "$WORK/source/a/b/c/$name"
+done
+ln -s ../one "$WORK/source/d/link"
+
+"$BIN/catalogfs-index" "$WORK/source" "$WORK/catalog1" > /dev/null 2>&1
+# Directories of the second catalog get other ctimes and atimes
+sleep 1
+"$BIN/catalogfs-index" "$WORK/source" "$WORK/catalog2" > /dev/null 2>&1
+ls -R "$WORK/catalog1" > /dev/null 2>&1
+
+"$BIN/catalogfs-snapshot" "$WORK/store" "$WORK/catalog1" first 2> /dev/null
+nodes=$("$BIN/catalogfs-snapshot" "$WORK/store" "$WORK/catalog2" second 2>&1 | grep '^Nodes:')
+
+case "$nodes" in
+"Nodes: 0 new (0 KiB), 5 shared with other snapshots,"*)
+	echo "OK: $nodes"
+	;;
+*)
+	echo "FAIL: expected 0 new and 5 shared nodes, got: $nodes"
+	exit 1
+	;;
+esac